@@ -3,13 +3,14 @@
 #include "KeyboardEmuAPI.h"
 
 
-HANDLE CreateDriverHandle(void) {
+static PVOID OpenDevice(PVOID context, ULONG flags) {
+	UNREFERENCED_PARAMETER(context);
 	HANDLE file = CreateFileW(L"\\\\.\\KeyboardEmulator",
 		GENERIC_READ | FILE_GENERIC_WRITE,
 		FILE_SHARE_READ,
 		NULL, // no SECURITY_ATTRIBUTES structure
 		OPEN_EXISTING, // No special create flags
-		0, // No special attributes
+		(flags & EMU_TRANSPORT_OVERLAPPED) ? FILE_FLAG_OVERLAPPED : 0, // capture requests stay pending
 		NULL);
 	if (INVALID_HANDLE_VALUE == file) {
 
@@ -18,10 +19,52 @@ HANDLE CreateDriverHandle(void) {
 	return file;
 }
 
+static ULONG IoControlDevice(PVOID context, PVOID handle, ULONG ioControlCode, PVOID input, ULONG inputSize, PVOID output, ULONG outputSize, PULONG bytesReturned, PVOID overlapped) {
+	UNREFERENCED_PARAMETER(context);
+	DWORD returned = 0;
+	BOOL result = DeviceIoControl((HANDLE)handle, ioControlCode, input, inputSize, output, outputSize, &returned, (LPOVERLAPPED)overlapped);
+	*bytesReturned = returned;
+	return result ? ERROR_SUCCESS : GetLastError();
+}
+
+static VOID CloseDevice(PVOID context, PVOID handle) {
+	UNREFERENCED_PARAMETER(context);
+	CloseHandle((HANDLE)handle);
+}
+
+static const EMU_TRANSPORT DeviceTransport = { NULL, OpenDevice, IoControlDevice, CloseDevice };
+
+//every handle is opened and every request is sent through it
+static EMU_TRANSPORT Transport = DeviceTransport;
+
+static BOOL DriverIoControl(IN HANDLE driverHandle, IN DWORD ioControlCode, IN LPVOID inputBuffer, IN DWORD inputSize, OUT LPVOID outputBuffer, IN DWORD outputSize, OUT LPDWORD bytesReturned, IN LPOVERLAPPED overlapped) {
+	ULONG returned = 0;
+	ULONG error = Transport.IoControl(Transport.Context, driverHandle, ioControlCode, inputBuffer, inputSize, outputBuffer, outputSize, &returned, overlapped);
+	if (bytesReturned)
+		*bytesReturned = returned;
+	SetLastError(error);
+	return error == ERROR_SUCCESS;
+}
+
+BOOL KeyboardSetTransport(IN const EMU_TRANSPORT* transport) {
+	if (!transport) {
+		Transport = DeviceTransport;
+		return TRUE;
+	}
+	if (!transport->Open || !transport->IoControl || !transport->Close)
+		return FALSE;
+	Transport = *transport;
+	return TRUE;
+}
+
+HANDLE CreateDriverHandle(void) {
+	return Transport.Open(Transport.Context, 0);
+}
+
 void DisposeHandle(HANDLE driverHandle) {
 	if (driverHandle != INVALID_HANDLE_VALUE)
 	{
-		CloseHandle(driverHandle);
+		Transport.Close(Transport.Context, driverHandle);
 	}
 }
 
@@ -29,7 +72,7 @@ BOOL KeyboardGetDevices(IN HANDLE driverHandle, OUT PKEYBOARD_QUERY_RESULT devic
 	if (!devices || driverHandle == INVALID_HANDLE_VALUE)
 		return FALSE;
 	DWORD bytesReturned = 0;
-	if (!DeviceIoControl(
+	if (!DriverIoControl(
 		driverHandle,
 		IOCTL_KEYBOARD_GET_DEVICE_ID,
 		NULL, 0,
@@ -46,7 +89,7 @@ BOOL KeyboardSetActiveDevice(IN HANDLE driverHandle, IN USHORT deviceId) {
 	if (driverHandle == INVALID_HANDLE_VALUE)
 		return FALSE;
 	DWORD bytesReturned = 0;
-	if (!DeviceIoControl(
+	if (!DriverIoControl(
 		driverHandle,
 		IOCTL_KEYBOARD_SET_DEVICE_ID,
 		&deviceId, sizeof(deviceId),
@@ -58,6 +101,77 @@ BOOL KeyboardSetActiveDevice(IN HANDLE driverHandle, IN USHORT deviceId) {
 	return TRUE;
 }
 
+BOOL KeyboardGetDeviceHandles(IN HANDLE driverHandle, OUT PKEY_DEVICE_INFO devices, IN ULONG capacity, OUT PULONG count) {
+	if (!devices || !count || capacity == 0 || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	BOOL result = DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_GET_DEVICES,
+		NULL, 0,
+		devices, capacity * sizeof(KEY_DEVICE_INFO),
+		&bytesReturned, NULL);
+	//a partial list comes back with ERROR_MORE_DATA
+	if (!result && GetLastError() != ERROR_MORE_DATA)
+		return FALSE;
+	*count = bytesReturned / sizeof(KEY_DEVICE_INFO);
+	return result;
+}
+
+BOOL KeyboardSetActiveDeviceHandle(IN HANDLE driverHandle, IN ULONG deviceHandle) {
+	if (driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_SET_DEVICE_HANDLE,
+		&deviceHandle, sizeof(deviceHandle),
+		NULL, 0,
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//
+//Buffer a thread reuses to marshal its requests, grown to the largest one so far
+//and freed when the thread exits
+//
+typedef struct _SCRATCH_BUFFER {
+	PVOID Buffer;
+	SIZE_T Size;
+
+	~_SCRATCH_BUFFER() {
+		if (Buffer)
+			HeapFree(GetProcessHeap(), 0, Buffer);
+	}
+} SCRATCH_BUFFER, * PSCRATCH_BUFFER;
+
+//packs the request sent to the driver or receives its reply
+static thread_local SCRATCH_BUFFER RequestScratch;
+//holds the table an add or remove edits while the request scratch packs it
+static thread_local SCRATCH_BUFFER TableScratch;
+
+static PVOID ScratchBuffer(IN OUT PSCRATCH_BUFFER scratch, IN SIZE_T size) {
+	if (size > scratch->Size) {
+		//at least double, a table growing one entry per call reallocates only now and then
+		SIZE_T grown = max(size, max(2 * scratch->Size, (SIZE_T)256));
+		HANDLE processHeap = GetProcessHeap();
+		if (!processHeap)
+			return NULL;
+		//the contents are not kept, a fresh block avoids copying them
+		PVOID buffer = HeapAlloc(processHeap, 0, grown);
+		if (!buffer)
+			return NULL;
+		if (scratch->Buffer)
+			HeapFree(processHeap, 0, scratch->Buffer);
+		scratch->Buffer = buffer;
+		scratch->Size = grown;
+	}
+	return scratch->Buffer;
+}
+
 BOOL KeyboardSetKeyFiltering(IN HANDLE driverHandle, IN PKEY_FILTER_REQUEST filterRequest)
 {
 	if (!filterRequest || driverHandle == INVALID_HANDLE_VALUE)
@@ -67,7 +181,7 @@ BOOL KeyboardSetKeyFiltering(IN HANDLE driverHandle, IN PKEY_FILTER_REQUEST filt
 	if (filterRequest->FilterMode == FILTER_KEY_NONE || filterRequest->FilterMode == FILTER_KEY_ALL)
 	{
 
-		if (!DeviceIoControl(
+		if (!DriverIoControl(
 			driverHandle,
 			IOCTL_KEYBOARD_SET_FILTER,
 			&filterRequest->FilterMode, sizeof(USHORT),
@@ -79,7 +193,7 @@ BOOL KeyboardSetKeyFiltering(IN HANDLE driverHandle, IN PKEY_FILTER_REQUEST filt
 	}
 	else if (filterRequest->FilterMode == FILTER_KEY_FLAGS)
 	{
-		if (!DeviceIoControl(
+		if (!DriverIoControl(
 			driverHandle,
 			IOCTL_KEYBOARD_SET_FILTER,
 			filterRequest, 2 * sizeof(USHORT),
@@ -92,40 +206,21 @@ BOOL KeyboardSetKeyFiltering(IN HANDLE driverHandle, IN PKEY_FILTER_REQUEST filt
 	}
 	else if (filterRequest->FilterMode == FILTER_KEY_FLAG_AND_SCANCODE)
 	{
-		HANDLE processHeap = GetProcessHeap();
-		if (!processHeap)
-		{
-			return FALSE;
-		}
 		DWORD requiredBytes = 2 * sizeof(USHORT) + filterRequest->FilterCount * sizeof(KEY_FILTER_DATA);
-		PUSHORT buffer = (PUSHORT)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, requiredBytes);
+		PUSHORT buffer = (PUSHORT)ScratchBuffer(&RequestScratch, requiredBytes);
 		if (!buffer)
 		{
-			CloseHandle(processHeap);
 			return FALSE;
 		}
 		buffer[0] = filterRequest->FilterMode;
 		buffer[1] = filterRequest->FilterCount;
-
-		PKEY_FILTER_DATA fData = (PKEY_FILTER_DATA)(&buffer[2]);
-		for (USHORT i = 0; i < filterRequest->FilterCount; i++)
-		{
-			fData[i] = filterRequest->FilterData[i];
-		}
-		if (!DeviceIoControl(
+		memcpy(&buffer[2], filterRequest->FilterData, filterRequest->FilterCount * sizeof(KEY_FILTER_DATA));
+		return DriverIoControl(
 			driverHandle,
 			IOCTL_KEYBOARD_SET_FILTER,
 			buffer, requiredBytes,
 			NULL, 0,
-			&bytesReturned, NULL))
-		{
-			HeapFree(processHeap, 0, buffer);
-			CloseHandle(processHeap);
-			return FALSE;
-		}
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
-		return TRUE;
+			&bytesReturned, NULL);
 	}
 	return FALSE;
 }
@@ -136,52 +231,31 @@ BOOL KeyboardGetKeyFiltering(IN HANDLE driverHandle, IN OUT PKEY_FILTER_REQUEST
 		return FALSE;
 	DWORD bytesReturned = 0;
 	DWORD requiredBytes = 2 * sizeof(USHORT) + filterBuffer->FilterCount * sizeof(KEY_FILTER_DATA);
-	HANDLE processHeap = GetProcessHeap();
-	if (!processHeap)
-		return FALSE;
-	PUSHORT buffer = (PUSHORT)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, requiredBytes);
+	PUSHORT buffer = (PUSHORT)ScratchBuffer(&RequestScratch, requiredBytes);
 	if (!buffer)
-	{
-		CloseHandle(processHeap);
 		return FALSE;
-	}
 
-	if (!DeviceIoControl(
+	if (!DriverIoControl(
 		driverHandle,
 		IOCTL_KEYBOARD_GET_FILTER,
 		NULL, 0,
 		buffer, requiredBytes,
 		&bytesReturned, NULL))
 	{
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
 		return FALSE;
 	}
-	if (bytesReturned >= sizeof(USHORT))
-	{
-		filterBuffer->FilterMode = buffer[0];
-		bytesReturned -= sizeof(USHORT);
-		if (bytesReturned >= sizeof(USHORT)) {
-			filterBuffer->FilterCount = buffer[1];
-			bytesReturned -= sizeof(USHORT);
-			USHORT filterCount = bytesReturned / sizeof(KEY_FILTER_DATA);
-			if (filterCount > 0) {
-				PKEY_FILTER_DATA filterData = (PKEY_FILTER_DATA)(&buffer[2]);
-				for (USHORT i = 0; i < filterCount; i++)
-				{
-					filterBuffer->FilterData[i] = filterData[i];
-				}
-			}
-		}
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
-		return TRUE;
-	}
-	else {
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
+	if (bytesReturned < sizeof(USHORT))
 		return FALSE;
+	filterBuffer->FilterMode = buffer[0];
+	bytesReturned -= sizeof(USHORT);
+	if (bytesReturned >= sizeof(USHORT)) {
+		filterBuffer->FilterCount = buffer[1];
+		bytesReturned -= sizeof(USHORT);
+		USHORT filterCount = bytesReturned / sizeof(KEY_FILTER_DATA);
+		if (filterCount > 0)
+			memcpy(filterBuffer->FilterData, &buffer[2], filterCount * sizeof(KEY_FILTER_DATA));
 	}
+	return TRUE;
 }
 
 BOOL KeyboardAddKeyFiltering(IN HANDLE driverHandle, IN PKEY_FILTER_DATA filterData)
@@ -205,15 +279,9 @@ BOOL KeyboardAddKeyFiltering(IN HANDLE driverHandle, IN PKEY_FILTER_DATA filterD
 	{
 		//add room for one more filter data
 		DWORD requiredBytes = (filterCount + 1) * sizeof(KEY_FILTER_DATA);
-		HANDLE processHeap = GetProcessHeap();
-		if (!processHeap)
-			return FALSE;
-		PKEY_FILTER_DATA buffer = (PKEY_FILTER_DATA)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, requiredBytes);
+		PKEY_FILTER_DATA buffer = (PKEY_FILTER_DATA)ScratchBuffer(&TableScratch, requiredBytes);
 		if (!buffer)
-		{
-			CloseHandle(processHeap);
 			return FALSE;
-		}
 		filterBuffer.FilterData = buffer;
 		//first get current filters
 		if (!KeyboardGetKeyFiltering(driverHandle, &filterBuffer))
@@ -226,8 +294,6 @@ BOOL KeyboardAddKeyFiltering(IN HANDLE driverHandle, IN PKEY_FILTER_DATA filterD
 				filterBuffer.FilterData[i].ScanCode == filterData->ScanCode)
 			{
 				//already exists
-				HeapFree(processHeap, 0, buffer);
-				CloseHandle(processHeap);
 				return TRUE;
 			}
 		}
@@ -235,10 +301,7 @@ BOOL KeyboardAddKeyFiltering(IN HANDLE driverHandle, IN PKEY_FILTER_DATA filterD
 		//add the new one to the end
 		filterBuffer.FilterData[filterCount] = *filterData;
 		filterBuffer.FilterCount = filterCount + 1;
-		BOOL result = KeyboardSetKeyFiltering(driverHandle, &filterBuffer);
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
-		return result;
+		return KeyboardSetKeyFiltering(driverHandle, &filterBuffer);
 	}
 }
 
@@ -259,15 +322,9 @@ BOOL KeyboardRemoveKeyFiltering(IN HANDLE driverHandle, IN PKEY_FILTER_DATA filt
 	else
 	{
 		DWORD requiredBytes = filterCount * sizeof(KEY_FILTER_DATA);
-		HANDLE processHeap = GetProcessHeap();
-		if (!processHeap)
-			return FALSE;
-		PKEY_FILTER_DATA buffer = (PKEY_FILTER_DATA)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, requiredBytes);
+		PKEY_FILTER_DATA buffer = (PKEY_FILTER_DATA)ScratchBuffer(&TableScratch, requiredBytes);
 		if (!buffer)
-		{
-			CloseHandle(processHeap);
 			return FALSE;
-		}
 		filterBuffer.FilterData = buffer;
 		//first get current filters
 		if (!KeyboardGetKeyFiltering(driverHandle, &filterBuffer))
@@ -289,10 +346,7 @@ BOOL KeyboardRemoveKeyFiltering(IN HANDLE driverHandle, IN PKEY_FILTER_DATA filt
 		}
 		filterBuffer.FilterMode = FILTER_KEY_FLAG_AND_SCANCODE;
 		filterBuffer.FilterCount = filterCount;
-		BOOL result = KeyboardSetKeyFiltering(driverHandle, &filterBuffer);
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
-		return result;
+		return KeyboardSetKeyFiltering(driverHandle, &filterBuffer);
 	}
 }
 
@@ -303,7 +357,7 @@ BOOL KeyboardSetKeyModifying(IN HANDLE driverHandle, IN PKEY_MODIFY_REQUEST modi
 	DWORD bytesReturned = 0;
 	if (modifyRequest->ModifyCount == 0)
 	{
-		if (!DeviceIoControl(
+		if (!DriverIoControl(
 			driverHandle,
 			IOCTL_KEYBOARD_SET_MODIFY,
 			&modifyRequest->ModifyCount, sizeof(USHORT),
@@ -315,32 +369,17 @@ BOOL KeyboardSetKeyModifying(IN HANDLE driverHandle, IN PKEY_MODIFY_REQUEST modi
 		return TRUE;
 	}
 	DWORD requiredBytes = sizeof(USHORT) + modifyRequest->ModifyCount * sizeof(KEY_MODIFY_DATA);
-	HANDLE processHeap = GetProcessHeap();
-	if (!processHeap)
-		return FALSE;
-	PUSHORT p = (PUSHORT)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, requiredBytes);
+	PUSHORT p = (PUSHORT)ScratchBuffer(&RequestScratch, requiredBytes);
 	if (!p)
 		return FALSE;
 	p[0] = modifyRequest->ModifyCount;
-	PKEY_MODIFY_DATA modifyData = (PKEY_MODIFY_DATA)(&p[1]);
-	for (USHORT i = 0; i < modifyRequest->ModifyCount; i++)
-	{
-		modifyData[i] = modifyRequest->ModifyData[i];
-	}
-	if (!DeviceIoControl(
+	memcpy(&p[1], modifyRequest->ModifyData, modifyRequest->ModifyCount * sizeof(KEY_MODIFY_DATA));
+	return DriverIoControl(
 		driverHandle,
 		IOCTL_KEYBOARD_SET_MODIFY,
 		p, requiredBytes,
 		NULL, 0,
-		&bytesReturned, NULL))
-	{
-		HeapFree(processHeap, HEAP_ZERO_MEMORY, p);
-		CloseHandle(processHeap);
-		return FALSE;
-	}
-	HeapFree(processHeap, HEAP_ZERO_MEMORY, p);
-	CloseHandle(processHeap);
-	return TRUE;
+		&bytesReturned, NULL);
 }
 
 BOOL KeyboardGetKeyModifying(IN HANDLE driverHandle, IN OUT PKEY_MODIFY_REQUEST modifyBuffer)
@@ -349,46 +388,26 @@ BOOL KeyboardGetKeyModifying(IN HANDLE driverHandle, IN OUT PKEY_MODIFY_REQUEST
 		return FALSE;
 	DWORD bytesReturned = 0;
 	DWORD requiredBytes = sizeof(USHORT) + modifyBuffer->ModifyCount * sizeof(KEY_MODIFY_DATA);
-	HANDLE processHeap = GetProcessHeap();
-	if (!processHeap)
-		return FALSE;
-	PUSHORT buffer = (PUSHORT)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, requiredBytes);
+	PUSHORT buffer = (PUSHORT)ScratchBuffer(&RequestScratch, requiredBytes);
 	if (!buffer)
-	{
-		CloseHandle(processHeap);
 		return FALSE;
-	}
-	if (!DeviceIoControl(
+	if (!DriverIoControl(
 		driverHandle,
 		IOCTL_KEYBOARD_GET_MODIFY,
 		NULL, 0,
 		buffer, requiredBytes,
 		&bytesReturned, NULL))
 	{
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
 		return FALSE;
 	}
-	if (bytesReturned >= sizeof(USHORT)) {
-		modifyBuffer->ModifyCount = buffer[0];
-		bytesReturned -= sizeof(USHORT);
-		USHORT modifyCount = bytesReturned / sizeof(KEY_MODIFY_DATA);
-		if (modifyCount > 0) {
-			PKEY_MODIFY_DATA modifyData = (PKEY_MODIFY_DATA)(&buffer[1]);
-			for (USHORT i = 0; i < modifyCount; i++)
-			{
-				modifyBuffer->ModifyData[i] = modifyData[i];
-			}
-		}
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
-		return TRUE;
-	}
-	else {
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
+	if (bytesReturned < sizeof(USHORT))
 		return FALSE;
-	}
+	modifyBuffer->ModifyCount = buffer[0];
+	bytesReturned -= sizeof(USHORT);
+	USHORT modifyCount = bytesReturned / sizeof(KEY_MODIFY_DATA);
+	if (modifyCount > 0)
+		memcpy(modifyBuffer->ModifyData, &buffer[1], modifyCount * sizeof(KEY_MODIFY_DATA));
+	return TRUE;
 }
 
 BOOL KeyboardAddKeyModifying(IN HANDLE driverHandle, IN PKEY_MODIFY_DATA modifyData)
@@ -411,15 +430,9 @@ BOOL KeyboardAddKeyModifying(IN HANDLE driverHandle, IN PKEY_MODIFY_DATA modifyD
 	{
 		//add room for one more filter data
 		DWORD requiredBytes = (modifyCount + 1) * sizeof(KEY_MODIFY_DATA);
-		HANDLE processHeap = GetProcessHeap();
-		if (!processHeap)
-			return FALSE;
-		PKEY_MODIFY_DATA buffer = (PKEY_MODIFY_DATA)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, requiredBytes);
+		PKEY_MODIFY_DATA buffer = (PKEY_MODIFY_DATA)ScratchBuffer(&TableScratch, requiredBytes);
 		if (!buffer)
-		{
-			CloseHandle(processHeap);
 			return FALSE;
-		}
 		modifyBuffer.ModifyData = buffer;
 		//first get current filters
 		if (!KeyboardGetKeyModifying(driverHandle, &modifyBuffer))
@@ -433,18 +446,13 @@ BOOL KeyboardAddKeyModifying(IN HANDLE driverHandle, IN PKEY_MODIFY_DATA modifyD
 				modifyBuffer.ModifyData[i].ToScanCode == modifyData->ToScanCode)
 			{
 				//already exists
-				HeapFree(processHeap, 0, buffer);
-				CloseHandle(processHeap);
 				return TRUE;
 			}
 		}
 		//add the new one to the end
 		modifyBuffer.ModifyData[modifyCount] = *modifyData;
 		modifyBuffer.ModifyCount = modifyCount + 1;
-		BOOL result = KeyboardSetKeyModifying(driverHandle, &modifyBuffer);
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
-		return result;
+		return KeyboardSetKeyModifying(driverHandle, &modifyBuffer);
 	}
 }
 
@@ -465,15 +473,9 @@ BOOL KeyboardRemoveKeyModifying(IN HANDLE driverHandle, IN PKEY_MODIFY_DATA modi
 	else
 	{
 		DWORD requiredBytes = modifyCount * sizeof(KEY_MODIFY_DATA);
-		HANDLE processHeap = GetProcessHeap();
-		if (!processHeap)
-			return FALSE;
-		PKEY_MODIFY_DATA buffer = (PKEY_MODIFY_DATA)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, requiredBytes);
+		PKEY_MODIFY_DATA buffer = (PKEY_MODIFY_DATA)ScratchBuffer(&TableScratch, requiredBytes);
 		if (!buffer)
-		{
-			CloseHandle(processHeap);
 			return FALSE;
-		}
 		modifyBuffer.ModifyData = buffer;
 		//first get current modifications
 		if (!KeyboardGetKeyModifying(driverHandle, &modifyBuffer))
@@ -495,60 +497,1576 @@ BOOL KeyboardRemoveKeyModifying(IN HANDLE driverHandle, IN PKEY_MODIFY_DATA modi
 			}
 		}
 		modifyBuffer.ModifyCount = modifyCount;
-		BOOL result = KeyboardSetKeyModifying(driverHandle, &modifyBuffer);
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
-		return result;
+		return KeyboardSetKeyModifying(driverHandle, &modifyBuffer);
 	}
 }
 
-BOOL KeyboardInsertKeys(IN HANDLE driverHandle, IN PKEYBOARD_INPUT_DATA inputKeys, IN ULONG inputCount) {
-	if (!inputKeys || driverHandle == INVALID_HANDLE_VALUE || inputCount == 0)
+BOOL KeyboardGetRuleGeneration(IN HANDLE driverHandle, IN ULONG deviceHandle, OUT PULONG generation) {
+	if (!generation)
 		return FALSE;
 	DWORD bytesReturned = 0;
-	if (!DeviceIoControl(
-		driverHandle,
-		IOCTL_KEYBOARD_INSERT_KEY,
-		inputKeys, inputCount * sizeof(KEYBOARD_INPUT_DATA),
-		NULL, 0,
-		&bytesReturned, NULL)) {
+	if (!KeyboardDeviceIoControl(driverHandle, deviceHandle, IOCTL_KEYBOARD_GET_GENERATION, NULL, 0, generation, sizeof(ULONG), &bytesReturned))
+		return FALSE;
+	return bytesReturned == sizeof(ULONG);
+}
+
+static ULONG64 FilterCacheKey(IN const KEY_FILTER_DATA* filterData) {
+	return ((ULONG64)filterData->FlagPredicates << 16) | filterData->ScanCode;
+}
+
+static ULONG64 ModifyCacheKey(IN const KEY_MODIFY_DATA* modifyData) {
+	return ((ULONG64)modifyData->FlagPredicates << 32) | ((ULONG64)modifyData->FromScanCode << 16) | modifyData->ToScanCode;
+}
+
+static BOOL GrowCacheBuffer(IN OUT PVOID* buffer, IN SIZE_T size) {
+	HANDLE processHeap = GetProcessHeap();
+	if (!processHeap)
 		return FALSE;
+	PVOID grown = *buffer ? HeapReAlloc(processHeap, 0, *buffer, size) : HeapAlloc(processHeap, 0, size);
+	if (!grown)
+		return FALSE;
+	*buffer = grown;
+	return TRUE;
+}
+
+static VOID IndexCacheFilters(IN PKEY_RULE_CACHE cache) {
+	EmuEntrySetInitialize(&cache->FilterSet, cache->FilterSet.Slots, cache->FilterSet.Capacity);
+	//a key repeated in the table is found at its first entry, the later ones count as removed
+	for (ULONG i = 0; i < cache->FilterCount; i++)
+	{
+		if (EmuEntrySetFind(&cache->FilterSet, FilterCacheKey(&cache->Filters[i])) == EMU_ENTRY_NONE)
+			EmuEntrySetInsert(&cache->FilterSet, FilterCacheKey(&cache->Filters[i]), i);
+	}
+}
+
+static VOID IndexCacheModifies(IN PKEY_RULE_CACHE cache) {
+	EmuEntrySetInitialize(&cache->ModifySet, cache->ModifySet.Slots, cache->ModifySet.Capacity);
+	for (ULONG i = 0; i < cache->ModifyCount; i++)
+	{
+		if (EmuEntrySetFind(&cache->ModifySet, ModifyCacheKey(&cache->Modifies[i])) == EMU_ENTRY_NONE)
+			EmuEntrySetInsert(&cache->ModifySet, ModifyCacheKey(&cache->Modifies[i]), i);
 	}
+}
 
+static BOOL GrowCacheSet(IN OUT PEMU_ENTRY_SET set, IN ULONG capacity) {
+	HANDLE processHeap = GetProcessHeap();
+	if (!processHeap)
+		return FALSE;
+	PEMU_ENTRY_SLOT slots = (PEMU_ENTRY_SLOT)HeapAlloc(processHeap, 0, EmuEntrySetSlots(capacity) * sizeof(EMU_ENTRY_SLOT));
+	if (!slots)
+		return FALSE;
+	//the keys are moved rather than indexed again, entries an edit removed stay removed
+	EMU_ENTRY_SET grown;
+	EmuEntrySetInitialize(&grown, slots, EmuEntrySetSlots(capacity));
+	if (set->Slots) {
+		EmuEntrySetMove(&grown, set);
+		HeapFree(processHeap, 0, set->Slots);
+	}
+	*set = grown;
 	return TRUE;
 }
 
-BOOL KeyboardDetectDeviceId(IN HANDLE driverHandle, OUT PUSHORT deviceId) {
-	if (driverHandle == INVALID_HANDLE_VALUE)
+static BOOL ReserveCacheEntries(IN PKEY_RULE_CACHE cache, IN ULONG filterCount, IN ULONG modifyCount) {
+	if (filterCount > cache->FilterCapacity) {
+		ULONG capacity = EmuEntrySetSlots(filterCount) / 2;
+		if (!GrowCacheBuffer((PVOID*)&cache->Filters, capacity * sizeof(KEY_FILTER_DATA)) ||
+			!GrowCacheSet(&cache->FilterSet, capacity))
+			return FALSE;
+		cache->FilterCapacity = capacity;
+	}
+	if (modifyCount > cache->ModifyCapacity) {
+		ULONG capacity = EmuEntrySetSlots(modifyCount) / 2;
+		if (!GrowCacheBuffer((PVOID*)&cache->Modifies, capacity * sizeof(KEY_MODIFY_DATA)) ||
+			!GrowCacheSet(&cache->ModifySet, capacity))
+			return FALSE;
+		cache->ModifyCapacity = capacity;
+	}
+	//room for both tables behind the header, as IOCTL_KEYBOARD_SET_TABLES takes them
+	DWORD filterBytes = cache->FilterCapacity * sizeof(KEY_FILTER_DATA);
+	DWORD modifyBytes = cache->ModifyCapacity * sizeof(KEY_MODIFY_DATA);
+	DWORD uploadSize = sizeof(KEY_DEVICE_HEADER) + 3 * sizeof(USHORT) + filterBytes + modifyBytes;
+	if (uploadSize > cache->UploadSize) {
+		if (!GrowCacheBuffer((PVOID*)&cache->Upload, uploadSize))
+			return FALSE;
+		cache->UploadSize = uploadSize;
+	}
+	return TRUE;
+}
+
+static PUSHORT CacheTable(IN PKEY_RULE_CACHE cache) {
+	return (PUSHORT)(cache->Upload + sizeof(KEY_DEVICE_HEADER));
+}
+
+static BOOL CacheIoControl(IN PKEY_RULE_CACHE cache, IN DWORD ioControlCode, IN ULONG generation, IN DWORD tableSize, OUT LPVOID outputBuffer, IN DWORD outputSize, OUT LPDWORD bytesReturned) {
+	PKEY_DEVICE_HEADER header = (PKEY_DEVICE_HEADER)cache->Upload;
+	header->DeviceHandle = cache->DeviceHandle;
+	header->Generation = generation;
+	*bytesReturned = 0;
+	return DriverIoControl(
+		cache->DriverHandle,
+		IOCTL_KEYBOARD_TARGETED(ioControlCode),
+		header, sizeof(KEY_DEVICE_HEADER) + tableSize,
+		outputBuffer, outputSize,
+		bytesReturned, NULL);
+}
+
+static BOOL LoadRuleCache(IN PKEY_RULE_CACHE cache) {
+	cache->Generation = 0;
+	cache->FilterCount = 0;
+	cache->ModifyCount = 0;
+	for (ULONG attempt = 0; attempt < KEY_RULE_CACHE_ATTEMPTS; attempt++)
+	{
+		DWORD bytesReturned = 0;
+		ULONG before = 0;
+		ULONG after = 0;
+		USHORT counts[2] = { 0 };
+		if (!CacheIoControl(cache, IOCTL_KEYBOARD_GET_GENERATION, 0, 0, &before, sizeof(ULONG), &bytesReturned) || bytesReturned != sizeof(ULONG))
+			return FALSE;
+		//the counts first, so the tables can be read in one go
+		if (!CacheIoControl(cache, IOCTL_KEYBOARD_GET_FILTER, 0, 0, counts, 2 * sizeof(USHORT), &bytesReturned) || bytesReturned < 2 * sizeof(USHORT))
+			return FALSE;
+		ULONG filterCount = counts[0] == FILTER_KEY_FLAG_AND_SCANCODE ? counts[1] : 0;
+		if (!CacheIoControl(cache, IOCTL_KEYBOARD_GET_MODIFY, 0, 0, counts, sizeof(USHORT), &bytesReturned) || bytesReturned < sizeof(USHORT))
+			return FALSE;
+		if (!ReserveCacheEntries(cache, filterCount, counts[0]))
+			return FALSE;
+
+		//each read is limited to the room of the table it fills
+		PUSHORT table = CacheTable(cache);
+		DWORD tableSize = 2 * sizeof(USHORT) + cache->FilterCapacity * sizeof(KEY_FILTER_DATA);
+		if (!CacheIoControl(cache, IOCTL_KEYBOARD_GET_FILTER, 0, 0, table, tableSize, &bytesReturned) || bytesReturned < 2 * sizeof(USHORT))
+			return FALSE;
+		USHORT filterMode = table[0];
+		USHORT filterFlags = table[1];
+		filterCount = filterMode == FILTER_KEY_FLAG_AND_SCANCODE ? min((ULONG)table[1], (ULONG)((bytesReturned - 2 * sizeof(USHORT)) / sizeof(KEY_FILTER_DATA))) : 0;
+		CopyMemory(cache->Filters, &table[2], filterCount * sizeof(KEY_FILTER_DATA));
+		tableSize = sizeof(USHORT) + cache->ModifyCapacity * sizeof(KEY_MODIFY_DATA);
+		if (!CacheIoControl(cache, IOCTL_KEYBOARD_GET_MODIFY, 0, 0, table, tableSize, &bytesReturned) || bytesReturned < sizeof(USHORT))
+			return FALSE;
+		ULONG modifyCount = min((ULONG)table[0], (ULONG)((bytesReturned - sizeof(USHORT)) / sizeof(KEY_MODIFY_DATA)));
+		CopyMemory(cache->Modifies, &table[1], modifyCount * sizeof(KEY_MODIFY_DATA));
+
+		//the tables belong together only if nothing changed them while they were read
+		if (!CacheIoControl(cache, IOCTL_KEYBOARD_GET_GENERATION, 0, 0, &after, sizeof(ULONG), &bytesReturned) || bytesReturned != sizeof(ULONG))
+			return FALSE;
+		if (before == after) {
+			cache->FilterMode = filterMode;
+			cache->FilterFlags = filterMode == FILTER_KEY_FLAGS ? filterFlags : 0;
+			cache->FilterCount = filterCount;
+			cache->ModifyCount = modifyCount;
+			IndexCacheFilters(cache);
+			IndexCacheModifies(cache);
+			cache->Generation = before;
+			return TRUE;
+		}
+	}
+	SetLastError(ERROR_REVISION_MISMATCH);
+	return FALSE;
+}
+
+static BOOL UploadCacheFilters(IN PKEY_RULE_CACHE cache, IN ULONG filterCount) {
+	PUSHORT table = CacheTable(cache);
+	DWORD bytesReturned = 0;
+	ULONG committed = 0;
+	table[0] = FILTER_KEY_FLAG_AND_SCANCODE;
+	table[1] = (USHORT)filterCount;
+	if (!CacheIoControl(cache, IOCTL_KEYBOARD_SET_FILTER, cache->Generation, 2 * sizeof(USHORT) + filterCount * sizeof(KEY_FILTER_DATA), &committed, sizeof(ULONG), &bytesReturned))
 		return FALSE;
+	CopyMemory(cache->Filters, &table[2], filterCount * sizeof(KEY_FILTER_DATA));
+	cache->FilterMode = FILTER_KEY_FLAG_AND_SCANCODE;
+	cache->FilterCount = filterCount;
+	IndexCacheFilters(cache);
+	//the generation the driver committed the tables under, without it the next edit reloads them
+	cache->Generation = bytesReturned == sizeof(ULONG) ? committed : 0;
+	return TRUE;
+}
+
+static BOOL UploadCacheModifies(IN PKEY_RULE_CACHE cache, IN ULONG modifyCount) {
+	PUSHORT table = CacheTable(cache);
 	DWORD bytesReturned = 0;
-	if (!DeviceIoControl(
-		driverHandle,
-		IOCTL_KEYBOARD_DETECT_DEVICE_ID,
-		NULL, 0,
-		deviceId, sizeof(USHORT),
-		&bytesReturned, NULL)) {
+	ULONG committed = 0;
+	table[0] = (USHORT)modifyCount;
+	if (!CacheIoControl(cache, IOCTL_KEYBOARD_SET_MODIFY, cache->Generation, sizeof(USHORT) + modifyCount * sizeof(KEY_MODIFY_DATA), &committed, sizeof(ULONG), &bytesReturned))
 		return FALSE;
-	}
-	if (bytesReturned != sizeof(USHORT))
+	CopyMemory(cache->Modifies, &table[1], modifyCount * sizeof(KEY_MODIFY_DATA));
+	cache->ModifyCount = modifyCount;
+	IndexCacheModifies(cache);
+	cache->Generation = bytesReturned == sizeof(ULONG) ? committed : 0;
+	return TRUE;
+}
+
+BOOL KeyboardRuleCacheOpen(IN HANDLE driverHandle, IN ULONG deviceHandle, OUT PKEY_RULE_CACHE cache) {
+	if (!cache || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	ZeroMemory(cache, sizeof(KEY_RULE_CACHE));
+	cache->DriverHandle = driverHandle;
+	cache->DeviceHandle = deviceHandle;
+	if (!ReserveCacheEntries(cache, 1, 1) || !LoadRuleCache(cache)) {
+		KeyboardRuleCacheClose(cache);
 		return FALSE;
+	}
 	return TRUE;
 }
 
-BOOL KeyboardGetAttributes(IN HANDLE driverHandle, OUT PKEYBOARD_ATTRIBUTES attributes) {
-	if (!attributes || driverHandle == INVALID_HANDLE_VALUE)
+BOOL KeyboardCachedAddKeyFiltering(IN PKEY_RULE_CACHE cache, IN PKEY_FILTER_DATA filterData) {
+	if (!cache || !filterData)
 		return FALSE;
-	DWORD bytesReturned = 0;
-	if (!DeviceIoControl(
-		driverHandle,
-		IOCTL_KEYBOARD_GET_ATTRIBUTES,
-		NULL, 0,
-		attributes, sizeof(KEYBOARD_ATTRIBUTES),
-		&bytesReturned, NULL)) {
+	for (ULONG attempt = 0; attempt < KEY_RULE_CACHE_ATTEMPTS; attempt++)
+	{
+		if (cache->Generation == 0 && !LoadRuleCache(cache))
+			return FALSE;
+		//any other mode is replaced by a table holding the new filter only
+		ULONG filterCount = cache->FilterMode == FILTER_KEY_FLAG_AND_SCANCODE ? cache->FilterCount : 0;
+		if (filterCount > 0 && EmuEntrySetFind(&cache->FilterSet, FilterCacheKey(filterData)) != EMU_ENTRY_NONE)
+			return TRUE;
+		if (filterCount >= MAXUSHORT || !ReserveCacheEntries(cache, filterCount + 1, cache->ModifyCount))
+			return FALSE;
+		PKEY_FILTER_DATA table = (PKEY_FILTER_DATA)&CacheTable(cache)[2];
+		CopyMemory(table, cache->Filters, filterCount * sizeof(KEY_FILTER_DATA));
+		table[filterCount] = *filterData;
+		if (UploadCacheFilters(cache, filterCount + 1))
+			return TRUE;
+		//read the tables again, whatever the driver holds now
+		cache->Generation = 0;
+		if (GetLastError() != ERROR_REVISION_MISMATCH)
+			return FALSE;
+	}
+	return FALSE;
+}
+
+BOOL KeyboardCachedRemoveKeyFiltering(IN PKEY_RULE_CACHE cache, IN PKEY_FILTER_DATA filterData) {
+	if (!cache || !filterData)
+		return FALSE;
+	ULONG64 key = FilterCacheKey(filterData);
+	for (ULONG attempt = 0; attempt < KEY_RULE_CACHE_ATTEMPTS; attempt++)
+	{
+		if (cache->Generation == 0 && !LoadRuleCache(cache))
+			return FALSE;
+		if (cache->FilterMode != FILTER_KEY_FLAG_AND_SCANCODE || EmuEntrySetFind(&cache->FilterSet, key) == EMU_ENTRY_NONE)
+			return TRUE;
+		PKEY_FILTER_DATA table = (PKEY_FILTER_DATA)&CacheTable(cache)[2];
+		ULONG filterCount = 0;
+		for (ULONG i = 0; i < cache->FilterCount; i++)
+		{
+			if (FilterCacheKey(&cache->Filters[i]) != key)
+				table[filterCount++] = cache->Filters[i];
+		}
+		if (UploadCacheFilters(cache, filterCount))
+			return TRUE;
+		//read the tables again, whatever the driver holds now
+		cache->Generation = 0;
+		if (GetLastError() != ERROR_REVISION_MISMATCH)
+			return FALSE;
+	}
+	return FALSE;
+}
+
+BOOL KeyboardCachedAddKeyModifying(IN PKEY_RULE_CACHE cache, IN PKEY_MODIFY_DATA modifyData) {
+	if (!cache || !modifyData)
 		return FALSE;
+	for (ULONG attempt = 0; attempt < KEY_RULE_CACHE_ATTEMPTS; attempt++)
+	{
+		if (cache->Generation == 0 && !LoadRuleCache(cache))
+			return FALSE;
+		ULONG modifyCount = cache->ModifyCount;
+		if (EmuEntrySetFind(&cache->ModifySet, ModifyCacheKey(modifyData)) != EMU_ENTRY_NONE)
+			return TRUE;
+		if (modifyCount >= MAXUSHORT || !ReserveCacheEntries(cache, cache->FilterCount, modifyCount + 1))
+			return FALSE;
+		PKEY_MODIFY_DATA table = (PKEY_MODIFY_DATA)&CacheTable(cache)[1];
+		CopyMemory(table, cache->Modifies, modifyCount * sizeof(KEY_MODIFY_DATA));
+		table[modifyCount] = *modifyData;
+		if (UploadCacheModifies(cache, modifyCount + 1))
+			return TRUE;
+		//read the tables again, whatever the driver holds now
+		cache->Generation = 0;
+		if (GetLastError() != ERROR_REVISION_MISMATCH)
+			return FALSE;
 	}
-	if (bytesReturned != sizeof(KEYBOARD_ATTRIBUTES))
+	return FALSE;
+}
+
+BOOL KeyboardCachedRemoveKeyModifying(IN PKEY_RULE_CACHE cache, IN PKEY_MODIFY_DATA modifyData) {
+	if (!cache || !modifyData)
+		return FALSE;
+	ULONG64 key = ModifyCacheKey(modifyData);
+	for (ULONG attempt = 0; attempt < KEY_RULE_CACHE_ATTEMPTS; attempt++)
+	{
+		if (cache->Generation == 0 && !LoadRuleCache(cache))
+			return FALSE;
+		if (EmuEntrySetFind(&cache->ModifySet, key) == EMU_ENTRY_NONE)
+			return TRUE;
+		PKEY_MODIFY_DATA table = (PKEY_MODIFY_DATA)&CacheTable(cache)[1];
+		ULONG modifyCount = 0;
+		for (ULONG i = 0; i < cache->ModifyCount; i++)
+		{
+			if (ModifyCacheKey(&cache->Modifies[i]) != key)
+				table[modifyCount++] = cache->Modifies[i];
+		}
+		if (UploadCacheModifies(cache, modifyCount))
+			return TRUE;
+		//read the tables again, whatever the driver holds now
+		cache->Generation = 0;
+		if (GetLastError() != ERROR_REVISION_MISMATCH)
+			return FALSE;
+	}
+	return FALSE;
+}
+
+BOOL KeyboardRuleCacheClose(IN PKEY_RULE_CACHE cache) {
+	if (!cache)
+		return FALSE;
+	HANDLE processHeap = GetProcessHeap();
+	if (!processHeap)
 		return FALSE;
+	if (cache->Filters)
+		HeapFree(processHeap, 0, cache->Filters);
+	if (cache->FilterSet.Slots)
+		HeapFree(processHeap, 0, cache->FilterSet.Slots);
+	if (cache->Modifies)
+		HeapFree(processHeap, 0, cache->Modifies);
+	if (cache->ModifySet.Slots)
+		HeapFree(processHeap, 0, cache->ModifySet.Slots);
+	if (cache->Upload)
+		HeapFree(processHeap, 0, cache->Upload);
+	ZeroMemory(cache, sizeof(KEY_RULE_CACHE));
 	return TRUE;
 }
 
+static VOID CompactCacheFilters(IN PKEY_RULE_CACHE cache) {
+	ULONG filterCount = 0;
+	for (ULONG i = 0; i < cache->FilterCount; i++)
+	{
+		if (EmuEntrySetFind(&cache->FilterSet, FilterCacheKey(&cache->Filters[i])) == i)
+			cache->Filters[filterCount++] = cache->Filters[i];
+	}
+	if (filterCount < cache->FilterCount) {
+		cache->FilterCount = filterCount;
+		IndexCacheFilters(cache);
+	}
+}
+
+static VOID CompactCacheModifies(IN PKEY_RULE_CACHE cache) {
+	ULONG modifyCount = 0;
+	for (ULONG i = 0; i < cache->ModifyCount; i++)
+	{
+		if (EmuEntrySetFind(&cache->ModifySet, ModifyCacheKey(&cache->Modifies[i])) == i)
+			cache->Modifies[modifyCount++] = cache->Modifies[i];
+	}
+	if (modifyCount < cache->ModifyCount) {
+		cache->ModifyCount = modifyCount;
+		IndexCacheModifies(cache);
+	}
+}
+
+BOOL KeyboardBeginRuleEdit(IN HANDLE driverHandle, IN ULONG deviceHandle, OUT PKEY_RULE_EDIT edit) {
+	if (!edit)
+		return FALSE;
+	edit->Changed = FALSE;
+	return KeyboardRuleCacheOpen(driverHandle, deviceHandle, &edit->Tables);
+}
+
+BOOL KeyboardRuleEditAddFilter(IN PKEY_RULE_EDIT edit, IN PKEY_FILTER_DATA filterData) {
+	if (!edit || !filterData)
+		return FALSE;
+	PKEY_RULE_CACHE tables = &edit->Tables;
+	ULONG64 key = FilterCacheKey(filterData);
+	if (tables->FilterMode != FILTER_KEY_FLAG_AND_SCANCODE) {
+		tables->FilterMode = FILTER_KEY_FLAG_AND_SCANCODE;
+		tables->FilterFlags = 0;
+		tables->FilterCount = 0;
+		IndexCacheFilters(tables);
+	}
+	else if (EmuEntrySetFind(&tables->FilterSet, key) != EMU_ENTRY_NONE)
+		return TRUE;
+	if (tables->FilterSet.Count >= MAXUSHORT)
+		return FALSE;
+	//reuse the room of removed filters before growing
+	if (tables->FilterCount == tables->FilterCapacity)
+		CompactCacheFilters(tables);
+	if (!ReserveCacheEntries(tables, tables->FilterCount + 1, tables->ModifyCount))
+		return FALSE;
+	tables->Filters[tables->FilterCount] = *filterData;
+	EmuEntrySetInsert(&tables->FilterSet, key, tables->FilterCount);
+	tables->FilterCount++;
+	edit->Changed = TRUE;
+	return TRUE;
+}
+
+BOOL KeyboardRuleEditRemoveFilter(IN PKEY_RULE_EDIT edit, IN PKEY_FILTER_DATA filterData) {
+	if (!edit || !filterData)
+		return FALSE;
+	PKEY_RULE_CACHE tables = &edit->Tables;
+	//the entry stays in Filters until the commit, the set no longer finds it there
+	if (tables->FilterMode == FILTER_KEY_FLAG_AND_SCANCODE &&
+		EmuEntrySetRemove(&tables->FilterSet, FilterCacheKey(filterData)) != EMU_ENTRY_NONE)
+		edit->Changed = TRUE;
+	return TRUE;
+}
+
+BOOL KeyboardRuleEditAddModify(IN PKEY_RULE_EDIT edit, IN PKEY_MODIFY_DATA modifyData) {
+	if (!edit || !modifyData)
+		return FALSE;
+	PKEY_RULE_CACHE tables = &edit->Tables;
+	ULONG64 key = ModifyCacheKey(modifyData);
+	if (EmuEntrySetFind(&tables->ModifySet, key) != EMU_ENTRY_NONE)
+		return TRUE;
+	if (tables->ModifySet.Count >= MAXUSHORT)
+		return FALSE;
+	if (tables->ModifyCount == tables->ModifyCapacity)
+		CompactCacheModifies(tables);
+	if (!ReserveCacheEntries(tables, tables->FilterCount, tables->ModifyCount + 1))
+		return FALSE;
+	tables->Modifies[tables->ModifyCount] = *modifyData;
+	EmuEntrySetInsert(&tables->ModifySet, key, tables->ModifyCount);
+	tables->ModifyCount++;
+	edit->Changed = TRUE;
+	return TRUE;
+}
+
+BOOL KeyboardRuleEditRemoveModify(IN PKEY_RULE_EDIT edit, IN PKEY_MODIFY_DATA modifyData) {
+	if (!edit || !modifyData)
+		return FALSE;
+	if (EmuEntrySetRemove(&edit->Tables.ModifySet, ModifyCacheKey(modifyData)) != EMU_ENTRY_NONE)
+		edit->Changed = TRUE;
+	return TRUE;
+}
+
+BOOL KeyboardCommitRuleEdit(IN PKEY_RULE_EDIT edit) {
+	if (!edit)
+		return FALSE;
+	if (!edit->Changed)
+		return TRUE;
+	PKEY_RULE_CACHE tables = &edit->Tables;
+	CompactCacheFilters(tables);
+	CompactCacheModifies(tables);
+
+	PUSHORT table = CacheTable(tables);
+	ULONG filterCount = tables->FilterMode == FILTER_KEY_FLAG_AND_SCANCODE ? tables->FilterCount : 0;
+	table[0] = tables->FilterMode;
+	table[1] = tables->FilterMode == FILTER_KEY_FLAG_AND_SCANCODE ? (USHORT)filterCount : tables->FilterFlags;
+	CopyMemory(&table[2], tables->Filters, filterCount * sizeof(KEY_FILTER_DATA));
+	PUSHORT modifyTable = (PUSHORT)((PUCHAR)&table[2] + filterCount * sizeof(KEY_FILTER_DATA));
+	modifyTable[0] = (USHORT)tables->ModifyCount;
+	CopyMemory(&modifyTable[1], tables->Modifies, tables->ModifyCount * sizeof(KEY_MODIFY_DATA));
+	DWORD tableSize = (DWORD)((PUCHAR)&modifyTable[1] - (PUCHAR)table) + tables->ModifyCount * sizeof(KEY_MODIFY_DATA);
+
+	DWORD bytesReturned = 0;
+	ULONG committed = 0;
+	if (!CacheIoControl(tables, IOCTL_KEYBOARD_SET_TABLES, tables->Generation, tableSize, &committed, sizeof(ULONG), &bytesReturned))
+		return FALSE;
+	tables->Generation = bytesReturned == sizeof(ULONG) ? committed : 0;
+	edit->Changed = FALSE;
+	return TRUE;
+}
+
+BOOL KeyboardEndRuleEdit(IN PKEY_RULE_EDIT edit) {
+	if (!edit)
+		return FALSE;
+	edit->Changed = FALSE;
+	return KeyboardRuleCacheClose(&edit->Tables);
+}
+
+BOOL KeyboardInsertKeys(IN HANDLE driverHandle, IN PKEYBOARD_INPUT_DATA inputKeys, IN ULONG inputCount) {
+	if (!inputKeys || driverHandle == INVALID_HANDLE_VALUE || inputCount == 0)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_INSERT_KEY,
+		inputKeys, inputCount * sizeof(KEYBOARD_INPUT_DATA),
+		NULL, 0,
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static BOOL InsertSlotDone(IN PKEY_INSERT_QUEUE queue, IN PKEY_INSERT_SLOT slot, IN BOOL wait) {
+	if (slot->Error != ERROR_IO_PENDING)
+		return TRUE;
+	DWORD bytesReturned = 0;
+	if (GetOverlappedResult(queue->DriverHandle, &slot->Overlapped, &bytesReturned, wait))
+		slot->Error = ERROR_SUCCESS;
+	else if (GetLastError() != ERROR_IO_INCOMPLETE)
+		slot->Error = GetLastError();
+	return slot->Error != ERROR_IO_PENDING;
+}
+
+BOOL KeyboardInsertQueueOpen(IN HANDLE driverHandle, IN ULONG depth, IN OPTIONAL PKEY_INSERT_COMPLETION completion, OUT PKEY_INSERT_QUEUE queue) {
+	if (!queue || driverHandle == INVALID_HANDLE_VALUE || depth == 0 || depth > KEY_INSERT_DEPTH_MAX)
+		return FALSE;
+	ZeroMemory(queue, sizeof(KEY_INSERT_QUEUE));
+	queue->DriverHandle = driverHandle;
+	queue->Completion = completion;
+	queue->Depth = depth;
+	for (ULONG i = 0; i < depth; i++)
+	{
+		//manual reset, GetOverlappedResult waits on the event of its own insert
+		queue->Slots[i].Overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (!queue->Slots[i].Overlapped.hEvent) {
+			KeyboardInsertQueueClose(queue);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+BOOL KeyboardInsertKeysAsync(IN PKEY_INSERT_QUEUE queue, IN PKEYBOARD_INPUT_DATA inputs, IN ULONG inputCount, IN OPTIONAL PVOID context) {
+	if (!queue || !inputs || inputCount == 0)
+		return FALSE;
+	if (queue->Count == queue->Depth)
+		KeyboardInsertQueueComplete(queue, TRUE);
+	PKEY_INSERT_SLOT slot = &queue->Slots[(queue->Head + queue->Count) % queue->Depth];
+	if (inputCount > slot->Capacity) {
+		//the slots keep their buffers, steady inserts of the same size do not allocate
+		if (!GrowCacheBuffer((PVOID*)&slot->Inputs, inputCount * sizeof(KEYBOARD_INPUT_DATA)))
+			return FALSE;
+		slot->Capacity = inputCount;
+	}
+	CopyMemory(slot->Inputs, inputs, inputCount * sizeof(KEYBOARD_INPUT_DATA));
+	slot->InputCount = inputCount;
+	slot->Context = context;
+	HANDLE event = slot->Overlapped.hEvent;
+	ZeroMemory(&slot->Overlapped, sizeof(OVERLAPPED));
+	slot->Overlapped.hEvent = event;
+	if (DriverIoControl(
+		queue->DriverHandle,
+		IOCTL_KEYBOARD_INSERT_KEY,
+		slot->Inputs, inputCount * sizeof(KEYBOARD_INPUT_DATA),
+		NULL, 0,
+		NULL, &slot->Overlapped)) {
+		slot->Error = ERROR_SUCCESS;
+	}
+	else if (GetLastError() == ERROR_IO_PENDING) {
+		slot->Error = ERROR_IO_PENDING;
+	}
+	else {
+		return FALSE;
+	}
+	queue->Count++;
+	return TRUE;
+}
+
+ULONG KeyboardInsertQueueComplete(IN PKEY_INSERT_QUEUE queue, IN BOOL wait) {
+	if (!queue)
+		return 0;
+	ULONG reported = 0;
+	while (queue->Count > 0)
+	{
+		PKEY_INSERT_SLOT slot = &queue->Slots[queue->Head];
+		//only the first insert is waited for, the ones after it are reported if already done
+		if (!InsertSlotDone(queue, slot, wait && reported == 0))
+			break;
+		queue->Head = (queue->Head + 1) % queue->Depth;
+		queue->Count--;
+		reported++;
+		if (queue->Completion)
+			queue->Completion(slot->Context, slot->Error, slot->InputCount);
+	}
+	return reported;
+}
+
+BOOL KeyboardInsertQueueClose(IN PKEY_INSERT_QUEUE queue) {
+	if (!queue)
+		return FALSE;
+	while (queue->Count > 0)
+	{
+		KeyboardInsertQueueComplete(queue, TRUE);
+	}
+	HANDLE processHeap = GetProcessHeap();
+	for (ULONG i = 0; i < queue->Depth; i++)
+	{
+		if (queue->Slots[i].Overlapped.hEvent)
+			CloseHandle(queue->Slots[i].Overlapped.hEvent);
+		if (queue->Slots[i].Inputs && processHeap)
+			HeapFree(processHeap, 0, queue->Slots[i].Inputs);
+	}
+	ZeroMemory(queue, sizeof(KEY_INSERT_QUEUE));
+	return TRUE;
+}
+
+//
+//Layouts whose tables were built, replaced round robin once full
+//
+#define KEY_LAYOUT_CACHE 8
+
+typedef struct _KEY_LAYOUT_ENTRY {
+	HKL Layout;
+	PEMU_LAYOUT_KEY Keys;
+} KEY_LAYOUT_ENTRY;
+
+static SRWLOCK LayoutLock = SRWLOCK_INIT;
+static KEY_LAYOUT_ENTRY LayoutCache[KEY_LAYOUT_CACHE];
+static ULONG LayoutNext;
+
+static PEMU_LAYOUT_KEY BuildLayoutKeys(IN HKL layout) {
+	HANDLE processHeap = GetProcessHeap();
+	if (!processHeap)
+		return NULL;
+	PEMU_LAYOUT_KEY keys = (PEMU_LAYOUT_KEY)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, EMU_LAYOUT_MAX_CHARS * sizeof(EMU_LAYOUT_KEY));
+	if (!keys)
+		return NULL;
+	for (ULONG character = 0; character < EMU_LAYOUT_MAX_CHARS; character++)
+	{
+		//other control characters would type control with a letter
+		if ((character < 0x20 && character != '\t' && character != '\b' && character != '\r') || character == 0x7F ||
+			(character >= 0xD800 && character <= 0xDFFF))
+			continue;
+		SHORT vkScan = VkKeyScanExW((WCHAR)character, layout);
+		//the other shift states are kana and OEM specific ones the table cannot hold
+		if (vkScan == -1 || (HIBYTE(vkScan) & ~EMU_LAYOUT_MODIFIERS))
+			continue;
+		UINT scanCode = MapVirtualKeyExW(LOBYTE(vkScan), MAPVK_VK_TO_VSC_EX, layout);
+		if ((scanCode & 0xFF) == 0)
+			continue;
+		BYTE keyState[256];
+		ZeroMemory(keyState, sizeof(keyState));
+		if (HIBYTE(vkScan) & EMU_LAYOUT_SHIFT)
+			keyState[VK_SHIFT] = 0x80;
+		if (HIBYTE(vkScan) & EMU_LAYOUT_CTRL)
+			keyState[VK_CONTROL] = 0x80;
+		if (HIBYTE(vkScan) & EMU_LAYOUT_ALT)
+			keyState[VK_MENU] = 0x80;
+		//a dead key types its character only with the key after it, 4 keeps the dead key state of the thread
+		WCHAR typed[4];
+		if (ToUnicodeEx(LOBYTE(vkScan), scanCode, keyState, typed, 4, 4, layout) < 0)
+			continue;
+		keys[character].ScanCode = (UCHAR)scanCode;
+		keys[character].Flags = (UCHAR)(HIBYTE(vkScan) | ((scanCode & 0xFF00) == 0xE000 ? EMU_LAYOUT_E0 : 0));
+	}
+	//line feeds type enter like carriage returns
+	keys['\n'] = keys['\r'];
+	return keys;
+}
+
+static PEMU_LAYOUT_KEY FindLayoutKeys(IN HKL layout) {
+	for (ULONG i = 0; i < KEY_LAYOUT_CACHE; i++)
+	{
+		if (LayoutCache[i].Keys && LayoutCache[i].Layout == layout)
+			return LayoutCache[i].Keys;
+	}
+	return NULL;
+}
+
+static BOOL CompileText(IN HKL layout, IN const VOID* text, IN ULONG length, IN BOOL utf8, OUT PKEYBOARD_INPUT_DATA inputs, IN ULONG capacity, OUT PULONG inputCount, OUT PULONG consumed, OUT OPTIONAL PULONG skipped) {
+	if ((!text && length > 0) || (!inputs && capacity > 0) || !inputCount || !consumed)
+		return FALSE;
+	if (!layout)
+		layout = GetKeyboardLayout(0);
+	EMU_LAYOUT table;
+	table.Count = EMU_LAYOUT_MAX_CHARS;
+	BOOL exclusive = FALSE;
+	AcquireSRWLockShared(&LayoutLock);
+	table.Keys = FindLayoutKeys(layout);
+	if (!table.Keys) {
+		//built under the exclusive lock, no other layout replaces the table before it is used
+		ReleaseSRWLockShared(&LayoutLock);
+		AcquireSRWLockExclusive(&LayoutLock);
+		exclusive = TRUE;
+		table.Keys = FindLayoutKeys(layout);
+		if (!table.Keys) {
+			PEMU_LAYOUT_KEY keys = BuildLayoutKeys(layout);
+			if (keys) {
+				if (LayoutCache[LayoutNext].Keys)
+					HeapFree(GetProcessHeap(), 0, LayoutCache[LayoutNext].Keys);
+				LayoutCache[LayoutNext].Layout = layout;
+				LayoutCache[LayoutNext].Keys = keys;
+				LayoutNext = (LayoutNext + 1) % KEY_LAYOUT_CACHE;
+			}
+			table.Keys = keys;
+		}
+	}
+	if (table.Keys) {
+		*consumed = utf8 ?
+			EmuCompileTextUtf8(&table, (const UCHAR*)text, length, inputs, capacity, inputCount, skipped) :
+			EmuCompileTextUtf16(&table, (const USHORT*)text, length, inputs, capacity, inputCount, skipped);
+	}
+	if (exclusive)
+		ReleaseSRWLockExclusive(&LayoutLock);
+	else
+		ReleaseSRWLockShared(&LayoutLock);
+	return table.Keys != NULL;
+}
+
+BOOL KeyboardCompileText(IN OPTIONAL HKL layout, IN LPCWSTR text, IN ULONG length, OUT PKEYBOARD_INPUT_DATA inputs, IN ULONG capacity, OUT PULONG inputCount, OUT PULONG consumed, OUT OPTIONAL PULONG skipped) {
+	return CompileText(layout, text, length, FALSE, inputs, capacity, inputCount, consumed, skipped);
+}
+
+BOOL KeyboardCompileTextUtf8(IN OPTIONAL HKL layout, IN LPCSTR text, IN ULONG length, OUT PKEYBOARD_INPUT_DATA inputs, IN ULONG capacity, OUT PULONG inputCount, OUT PULONG consumed, OUT OPTIONAL PULONG skipped) {
+	return CompileText(layout, text, length, TRUE, inputs, capacity, inputCount, consumed, skipped);
+}
+
+BOOL KeyboardDetectDeviceId(IN HANDLE driverHandle, OUT PUSHORT deviceId) {
+	if (driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_DETECT_DEVICE_ID,
+		NULL, 0,
+		deviceId, sizeof(USHORT),
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+	if (bytesReturned != sizeof(USHORT))
+		return FALSE;
+	return TRUE;
+}
+
+BOOL KeyboardDetectDevice(IN HANDLE driverHandle, IN ULONG timeout, OUT PKEY_DETECT_RESULT result, IN LPOVERLAPPED overlapped) {
+	if (!result || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	KEY_DETECT_REQUEST detectRequest = { timeout };
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_DETECT_DEVICE_ID,
+		&detectRequest, sizeof(KEY_DETECT_REQUEST),
+		result, sizeof(KEY_DETECT_RESULT),
+		overlapped ? NULL : &bytesReturned, overlapped)) {
+		return overlapped && GetLastError() == ERROR_IO_PENDING;
+	}
+	if (!overlapped && bytesReturned != sizeof(KEY_DETECT_RESULT))
+		return FALSE;
+	return TRUE;
+}
+
+BOOL KeyboardGetAttributes(IN HANDLE driverHandle, OUT PKEYBOARD_ATTRIBUTES attributes) {
+	if (!attributes || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_GET_ATTRIBUTES,
+		NULL, 0,
+		attributes, sizeof(KEYBOARD_ATTRIBUTES),
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+	if (bytesReturned != sizeof(KEYBOARD_ATTRIBUTES))
+		return FALSE;
+	return TRUE;
+}
+
+BOOL KeyboardSetAutofire(IN HANDLE driverHandle, IN PKEY_AUTOFIRE_DATA autofireData) {
+	if (!autofireData || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_SET_AUTOFIRE,
+		autofireData, sizeof(KEY_AUTOFIRE_DATA),
+		NULL, 0,
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL KeyboardGetAutofire(IN HANDLE driverHandle, OUT PKEY_AUTOFIRE_DATA autofireData) {
+	if (!autofireData || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_GET_AUTOFIRE,
+		NULL, 0,
+		autofireData, sizeof(KEY_AUTOFIRE_DATA),
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+	if (bytesReturned != sizeof(KEY_AUTOFIRE_DATA))
+		return FALSE;
+	return TRUE;
+}
+
+BOOL KeyboardSetRules(IN HANDLE driverHandle, IN PEMU_RULE_REQUEST ruleRequest)
+{
+	if (!ruleRequest || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (ruleRequest->RuleCount == 0)
+	{
+		return DriverIoControl(
+			driverHandle,
+			IOCTL_KEYBOARD_SET_RULES,
+			&ruleRequest->RuleCount, sizeof(USHORT),
+			NULL, 0,
+			&bytesReturned, NULL);
+	}
+	DWORD requiredBytes = sizeof(USHORT) + ruleRequest->RuleCount * sizeof(EMU_RULE);
+	PUSHORT p = (PUSHORT)ScratchBuffer(&RequestScratch, requiredBytes);
+	if (!p)
+		return FALSE;
+	p[0] = ruleRequest->RuleCount;
+	memcpy(&p[1], ruleRequest->Rules, ruleRequest->RuleCount * sizeof(EMU_RULE));
+	return DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_SET_RULES,
+		p, requiredBytes,
+		NULL, 0,
+		&bytesReturned, NULL);
+}
+
+BOOL KeyboardBroadcastRules(IN HANDLE driverHandle, IN const ULONG* deviceHandles, IN ULONG deviceCount, IN PEMU_RULE_REQUEST ruleRequest)
+{
+	if (!ruleRequest || (ruleRequest->RuleCount > 0 && !ruleRequest->Rules) || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	if (!deviceHandles)
+		deviceCount = 0;
+	else if (deviceCount == 0)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	DWORD handleBytes = deviceCount * sizeof(ULONG);
+	DWORD requiredBytes = FIELD_OFFSET(KEY_RULE_BROADCAST, DeviceHandles) + handleBytes + sizeof(USHORT) + ruleRequest->RuleCount * sizeof(EMU_RULE);
+	PKEY_RULE_BROADCAST broadcast = (PKEY_RULE_BROADCAST)ScratchBuffer(&RequestScratch, requiredBytes);
+	if (!broadcast)
+		return FALSE;
+	broadcast->DeviceCount = deviceHandles ? deviceCount : KEY_ALL_DEVICES;
+	if (handleBytes > 0)
+		memcpy(broadcast->DeviceHandles, deviceHandles, handleBytes);
+	PUCHAR rules = (PUCHAR)broadcast + FIELD_OFFSET(KEY_RULE_BROADCAST, DeviceHandles) + handleBytes;
+	memcpy(rules, &ruleRequest->RuleCount, sizeof(USHORT));
+	if (ruleRequest->RuleCount > 0)
+		memcpy(rules + sizeof(USHORT), ruleRequest->Rules, ruleRequest->RuleCount * sizeof(EMU_RULE));
+	return DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_BROADCAST_RULES,
+		broadcast, requiredBytes,
+		NULL, 0,
+		&bytesReturned, NULL);
+}
+
+BOOL KeyboardGetRules(IN HANDLE driverHandle, IN OUT PEMU_RULE_REQUEST ruleBuffer)
+{
+	if (!ruleBuffer || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	DWORD requiredBytes = sizeof(USHORT) + ruleBuffer->RuleCount * sizeof(EMU_RULE);
+	PUSHORT buffer = (PUSHORT)ScratchBuffer(&RequestScratch, requiredBytes);
+	if (!buffer)
+		return FALSE;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_GET_RULES,
+		NULL, 0,
+		buffer, requiredBytes,
+		&bytesReturned, NULL) || bytesReturned < sizeof(USHORT))
+		return FALSE;
+	ruleBuffer->RuleCount = buffer[0];
+	USHORT ruleCount = (USHORT)((bytesReturned - sizeof(USHORT)) / sizeof(EMU_RULE));
+	if (ruleCount > 0)
+		memcpy(ruleBuffer->Rules, &buffer[1], ruleCount * sizeof(EMU_RULE));
+	return TRUE;
+}
+
+BOOL KeyboardSetProfile(IN HANDLE driverHandle, IN PKEY_PROFILE_DATA profileData) {
+	if (!profileData || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_SET_PROFILE,
+		profileData, sizeof(KEY_PROFILE_DATA),
+		NULL, 0,
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL KeyboardGetProfile(IN HANDLE driverHandle, OUT PKEY_PROFILE_DATA profileData) {
+	if (!profileData || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_GET_PROFILE,
+		NULL, 0,
+		profileData, sizeof(KEY_PROFILE_DATA),
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+	if (bytesReturned != sizeof(KEY_PROFILE_DATA))
+		return FALSE;
+	return TRUE;
+}
+
+BOOL KeyboardSwitchProfile(IN HANDLE driverHandle, IN USHORT profileIndex) {
+	if (driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_SWITCH_PROFILE,
+		&profileIndex, sizeof(USHORT),
+		NULL, 0,
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL KeyboardSaveProfiles(IN HANDLE driverHandle) {
+	if (driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_SAVE_IMAGE,
+		NULL, 0,
+		NULL, 0,
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+HANDLE CreateCaptureHandle(void) {
+	return Transport.Open(Transport.Context, EMU_TRANSPORT_OVERLAPPED);
+}
+
+BOOL KeyboardSetCapture(IN HANDLE driverHandle, IN PKEY_CAPTURE_CONFIG captureConfig) {
+	if (!captureConfig || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_SET_CAPTURE,
+		captureConfig, sizeof(KEY_CAPTURE_CONFIG),
+		NULL, 0,
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL KeyboardGetCapture(IN HANDLE driverHandle, OUT PKEY_CAPTURE_CONFIG captureConfig) {
+	if (!captureConfig || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_GET_CAPTURE,
+		NULL, 0,
+		captureConfig, sizeof(KEY_CAPTURE_CONFIG),
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+	if (bytesReturned != sizeof(KEY_CAPTURE_CONFIG))
+		return FALSE;
+	return TRUE;
+}
+
+BOOL KeyboardCapture(IN HANDLE captureHandle, OUT PKEY_CAPTURE_RECORD records, IN ULONG recordCount, IN LPOVERLAPPED overlapped) {
+	if (!records || recordCount == 0 || !overlapped || captureHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	if (!DriverIoControl(
+		captureHandle,
+		IOCTL_KEYBOARD_CAPTURE,
+		NULL, 0,
+		records, recordCount * sizeof(KEY_CAPTURE_RECORD),
+		NULL, overlapped)) {
+		return GetLastError() == ERROR_IO_PENDING;
+	}
+
+	return TRUE;
+}
+
+BOOL KeyboardOpenCaptureRing(IN HANDLE driverHandle, OUT PKEY_CAPTURE_READER reader) {
+	if (!reader || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	KEY_CAPTURE_RING_REQUEST ringRequest;
+	KEY_CAPTURE_RING_MAPPING ringMapping;
+	DWORD bytesReturned = 0;
+	reader->Event = CreateEventW(NULL, FALSE, FALSE, NULL);
+	if (reader->Event == NULL)
+		return FALSE;
+	ringRequest.EventHandle = (ULONG64)(ULONG_PTR)reader->Event;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_MAP_CAPTURE_RING,
+		&ringRequest, sizeof(KEY_CAPTURE_RING_REQUEST),
+		&ringMapping, sizeof(KEY_CAPTURE_RING_MAPPING),
+		&bytesReturned, NULL) || bytesReturned != sizeof(KEY_CAPTURE_RING_MAPPING)) {
+		CloseHandle(reader->Event);
+		reader->Event = NULL;
+		return FALSE;
+	}
+	reader->ReaderIndex = ringMapping.ReaderIndex;
+	if (!EmuRingAttach(&reader->Ring, (const VOID*)(ULONG_PTR)ringMapping.Address, ringMapping.Size,
+		(volatile LONG*)(ULONG_PTR)ringMapping.WaitAddress)) {
+		DriverIoControl(driverHandle, IOCTL_KEYBOARD_UNMAP_CAPTURE_RING, NULL, 0, NULL, 0, &bytesReturned, NULL);
+		CloseHandle(reader->Event);
+		reader->Event = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+ULONG KeyboardReadCaptureRing(IN PKEY_CAPTURE_READER reader, OUT PKEY_CAPTURE_RECORD records, IN ULONG recordCount, IN DWORD timeout) {
+	if (!reader || !records || recordCount == 0 || reader->Event == NULL)
+		return 0;
+	for (;;) {
+		ULONG count = 0;
+		while (count < recordCount && EmuRingRead(&reader->Ring, &records[count]))
+			count++;
+		if (count > 0)
+			return count;
+		//the ring ran dry, block until the driver publishes the next key
+		if (EmuRingPrepareWait(&reader->Ring, reader->ReaderIndex) &&
+			WaitForSingleObject(reader->Event, timeout) != WAIT_OBJECT_0)
+			return 0;
+	}
+}
+
+BOOL KeyboardCloseCaptureRing(IN HANDLE driverHandle, IN PKEY_CAPTURE_READER reader) {
+	if (!reader || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	BOOL result = DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_UNMAP_CAPTURE_RING,
+		NULL, 0,
+		NULL, 0,
+		&bytesReturned, NULL);
+	if (reader->Event != NULL)
+		CloseHandle(reader->Event);
+	ZeroMemory(reader, sizeof(KEY_CAPTURE_READER));
+	return result;
+}
+
+BOOL KeyboardGetStats(IN HANDLE driverHandle, OUT PKEY_STATS stats, IN ULONG size) {
+	if (!stats || size < FIELD_OFFSET(KEY_STATS, RuleHits) || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	return DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_GET_STATS,
+		NULL, 0,
+		stats, size,
+		&bytesReturned, NULL);
+}
+
+BOOL KeyboardSetStats(IN HANDLE driverHandle, IN PKEY_STATS_CONFIG config) {
+	if (!config || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	return DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_SET_STATS,
+		config, sizeof(KEY_STATS_CONFIG),
+		NULL, 0,
+		&bytesReturned, NULL);
+}
+
+BOOL KeyboardGetLatency(IN HANDLE driverHandle, IN BOOL reset, OUT PKEY_LATENCY latency) {
+	if (!latency || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	KEY_LATENCY_REQUEST request;
+	request.Flags = reset ? KEY_LATENCY_RESET : 0;
+	return DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_GET_LATENCY,
+		&request, sizeof(KEY_LATENCY_REQUEST),
+		latency, sizeof(KEY_LATENCY),
+		&bytesReturned, NULL);
+}
+
+BOOL KeyboardSetTrace(IN HANDLE driverHandle, IN BOOL enable) {
+	if (driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	KEY_TRACE_CONFIG config;
+	config.Flags = enable ? KEY_TRACE_ENABLE : 0;
+	return DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_SET_TRACE,
+		&config, sizeof(KEY_TRACE_CONFIG),
+		NULL, 0,
+		&bytesReturned, NULL);
+}
+
+BOOL KeyboardReadTrace(IN HANDLE driverHandle, OUT PVOID buffer, IN ULONG size, OUT PULONG bytesRead) {
+	if (!buffer || !bytesRead || size < sizeof(EMU_TRACE_DUMP) || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_READ_TRACE,
+		NULL, 0,
+		buffer, size,
+		&bytesReturned, NULL))
+		return FALSE;
+	*bytesRead = bytesReturned;
+	return TRUE;
+}
+
+BOOL KeyboardRecorderOpen(IN LPCWSTR path, IN LONG64 frequency, OUT PKEY_RECORDER recorder) {
+	if (!path || !recorder || frequency <= 0)
+		return FALSE;
+	recorder->File = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (recorder->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	EmuRecReset(&recorder->State, 0);
+	recorder->Used = EmuRecWriteHeader(recorder->Buffer, EMU_REC_KEYBOARD, frequency);
+	return TRUE;
+}
+
+BOOL KeyboardRecorderWrite(IN PKEY_RECORDER recorder, IN PKEY_CAPTURE_RECORD records, IN ULONG recordCount) {
+	if (!recorder || recorder->File == INVALID_HANDLE_VALUE || (recordCount > 0 && !records))
+		return FALSE;
+	for (ULONG i = 0; i < recordCount; i++) {
+		if (recorder->Used > KEY_RECORDING_BUFFER - EMU_REC_MAX_EVENT) {
+			DWORD written = 0;
+			if (!WriteFile(recorder->File, recorder->Buffer, recorder->Used, &written, NULL) || written != recorder->Used)
+				return FALSE;
+			recorder->Used = 0;
+		}
+		recorder->Used += EmuRecEncodeKeyboard(&recorder->State, records[i].Timestamp, &records[i].Input, recorder->Buffer + recorder->Used);
+	}
+	return TRUE;
+}
+
+BOOL KeyboardRecorderClose(IN PKEY_RECORDER recorder) {
+	if (!recorder || recorder->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD written = 0;
+	BOOL result = recorder->Used == 0 ||
+		(WriteFile(recorder->File, recorder->Buffer, recorder->Used, &written, NULL) && written == recorder->Used);
+	if (!CloseHandle(recorder->File))
+		result = FALSE;
+	recorder->File = INVALID_HANDLE_VALUE;
+	recorder->Used = 0;
+	return result;
+}
+
+BOOL KeyboardPlayerOpen(IN LPCWSTR path, OUT PKEY_PLAYER player) {
+	if (!path || !player)
+		return FALSE;
+	player->File = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (player->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	EMU_REC_HEADER header;
+	DWORD bytesRead = 0;
+	if (!ReadFile(player->File, &header, sizeof(header), &bytesRead, NULL) ||
+		!EmuRecReadHeader(&header, bytesRead, EMU_REC_KEYBOARD, &header)) {
+		CloseHandle(player->File);
+		player->File = INVALID_HANDLE_VALUE;
+		return FALSE;
+	}
+	EmuRecReset(&player->State, 0);
+	player->Frequency = header.Frequency;
+	player->Offset = 0;
+	player->Filled = 0;
+	player->EndOfFile = FALSE;
+	return TRUE;
+}
+
+ULONG KeyboardPlayerRead(IN PKEY_PLAYER player, OUT PKEY_CAPTURE_RECORD records, IN ULONG recordCount) {
+	if (!player || !records || player->File == INVALID_HANDLE_VALUE)
+		return 0;
+	ULONG count = 0;
+	while (count < recordCount) {
+		//keep a whole event in the buffer unless the file ends before
+		if (!player->EndOfFile && player->Filled - player->Offset < EMU_REC_MAX_EVENT) {
+			DWORD bytesRead = 0;
+			MoveMemory(player->Buffer, player->Buffer + player->Offset, player->Filled - player->Offset);
+			player->Filled -= player->Offset;
+			player->Offset = 0;
+			if (!ReadFile(player->File, player->Buffer + player->Filled, KEY_RECORDING_BUFFER - player->Filled, &bytesRead, NULL))
+				break;
+			player->Filled += bytesRead;
+			player->EndOfFile = bytesRead == 0;
+		}
+		const UCHAR* cursor = player->Buffer + player->Offset;
+		ZeroMemory(&records[count], sizeof(KEY_CAPTURE_RECORD));
+		if (!EmuRecDecodeKeyboard(&player->State, &cursor, player->Buffer + player->Filled, &records[count].Timestamp, &records[count].Input))
+			break;
+		player->Offset = (ULONG)(cursor - player->Buffer);
+		count++;
+	}
+	return count;
+}
+
+BOOL KeyboardPlayerClose(IN PKEY_PLAYER player) {
+	if (!player || player->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	BOOL result = CloseHandle(player->File);
+	player->File = INVALID_HANDLE_VALUE;
+	return result;
+}
+
+static BOOL WriteReplay(IN HANDLE file, IN const VOID* buffer, IN DWORD size) {
+	DWORD written = 0;
+	return WriteFile(file, buffer, size, &written, NULL) && written == size;
+}
+
+static BOOL WriteReplayChunk(IN PKEY_REPLAY_WRITER writer) {
+	if (writer->Chunk.Count == 0)
+		return TRUE;
+	if (writer->Header.ChunkCount == writer->IndexCapacity) {
+		HANDLE processHeap = GetProcessHeap();
+		ULONG capacity = writer->IndexCapacity ? writer->IndexCapacity * 2 : 256;
+		PEMU_REPLAY_INDEX index = writer->Index ?
+			(PEMU_REPLAY_INDEX)HeapReAlloc(processHeap, 0, writer->Index, capacity * sizeof(EMU_REPLAY_INDEX)) :
+			(PEMU_REPLAY_INDEX)HeapAlloc(processHeap, 0, capacity * sizeof(EMU_REPLAY_INDEX));
+		if (!index)
+			return FALSE;
+		writer->Index = index;
+		writer->IndexCapacity = capacity;
+	}
+	writer->Chunk.Bytes = writer->Used;
+	if (!WriteReplay(writer->File, &writer->Chunk, sizeof(writer->Chunk)) || !WriteReplay(writer->File, writer->Events, writer->Used))
+		return FALSE;
+	writer->Index[writer->Header.ChunkCount].Time = writer->Chunk.FirstTime;
+	writer->Index[writer->Header.ChunkCount].Offset = writer->Offset;
+	writer->Header.ChunkCount++;
+	writer->Offset += sizeof(writer->Chunk) + writer->Used;
+	writer->Chunk.Count = 0;
+	writer->Used = 0;
+	return TRUE;
+}
+
+BOOL KeyboardReplayCreate(IN LPCWSTR path, IN LONG64 frequency, OUT PKEY_REPLAY_WRITER writer) {
+	if (!path || !writer || frequency <= 0)
+		return FALSE;
+	writer->File = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (writer->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	EmuReplayInitializeHeader(&writer->Header, EMU_REC_KEYBOARD, frequency);
+	ZeroMemory(&writer->Chunk, sizeof(writer->Chunk));
+	writer->Chunk.Magic = EMU_REPLAY_CHUNK_MAGIC;
+	writer->Index = NULL;
+	writer->IndexCapacity = 0;
+	writer->Used = 0;
+	writer->Offset = sizeof(writer->Header);
+	//the header is written again once the index is in place
+	if (!WriteReplay(writer->File, &writer->Header, sizeof(writer->Header))) {
+		CloseHandle(writer->File);
+		writer->File = INVALID_HANDLE_VALUE;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL KeyboardReplayAppend(IN PKEY_REPLAY_WRITER writer, IN PKEY_CAPTURE_RECORD records, IN ULONG recordCount) {
+	if (!writer || writer->File == INVALID_HANDLE_VALUE || (recordCount > 0 && !records))
+		return FALSE;
+	for (ULONG i = 0; i < recordCount; i++) {
+		if (writer->Used > EMU_REPLAY_CHUNK_BYTES - EMU_REC_MAX_EVENT && !WriteReplayChunk(writer))
+			return FALSE;
+		if (writer->Chunk.Count == 0) {
+			//a chunk starts where the one before ended, time never runs backwards
+			LONG64 time = records[i].Timestamp;
+			if (writer->Header.EventCount > 0 && time < writer->Header.LastTime)
+				time = writer->Header.LastTime;
+			writer->Chunk.FirstTime = time;
+			EmuRecReset(&writer->State, time);
+		}
+		writer->Used += EmuRecEncodeKeyboard(&writer->State, records[i].Timestamp, &records[i].Input, writer->Events + writer->Used);
+		writer->Chunk.Count++;
+		writer->Chunk.LastTime = writer->State.Time;
+		writer->Header.EventCount++;
+		writer->Header.LastTime = writer->State.Time;
+	}
+	return TRUE;
+}
+
+BOOL KeyboardReplayFinish(IN PKEY_REPLAY_WRITER writer) {
+	if (!writer || writer->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	LARGE_INTEGER start = { 0 };
+	BOOL result = WriteReplayChunk(writer);
+	if (result && writer->Header.ChunkCount > 0)
+		result = WriteReplay(writer->File, writer->Index, writer->Header.ChunkCount * sizeof(EMU_REPLAY_INDEX));
+	if (result) {
+		writer->Header.IndexOffset = writer->Offset;
+		result = SetFilePointerEx(writer->File, start, NULL, FILE_BEGIN) &&
+			WriteReplay(writer->File, &writer->Header, sizeof(writer->Header));
+	}
+	if (!CloseHandle(writer->File))
+		result = FALSE;
+	if (writer->Index)
+		HeapFree(GetProcessHeap(), 0, writer->Index);
+	writer->File = INVALID_HANDLE_VALUE;
+	writer->Index = NULL;
+	writer->IndexCapacity = 0;
+	return result;
+}
+
+static PVOID MapReplay(IN HANDLE mapping, IN ULONG64 offset, IN SIZE_T size, OUT const UCHAR** at) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	//views start on the allocation granularity
+	ULONG64 base = offset - offset % info.dwAllocationGranularity;
+	PVOID view = MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(base >> 32), (DWORD)base, (SIZE_T)(offset - base) + size);
+	if (view)
+		*at = (const UCHAR*)view + (offset - base);
+	return view;
+}
+
+static BOOL EnterReplayChunk(IN PKEY_REPLAY replay, IN ULONG chunk) {
+	if (replay->ChunkView) {
+		UnmapViewOfFile(replay->ChunkView);
+		replay->ChunkView = NULL;
+	}
+	replay->Cursor.Left = 0;
+	replay->NextChunk = replay->Header.ChunkCount;
+	if (chunk >= replay->Header.ChunkCount)
+		return TRUE;
+	const EMU_REPLAY_INDEX* entry = &replay->Index[chunk];
+	if (entry->Offset < sizeof(EMU_REPLAY_HEADER) || entry->Offset > replay->Header.IndexOffset - sizeof(EMU_REPLAY_CHUNK))
+		return FALSE;
+	//map the largest chunk there can be, cut at the index
+	ULONG64 size = replay->Header.IndexOffset - entry->Offset;
+	if (size > sizeof(EMU_REPLAY_CHUNK) + EMU_REPLAY_CHUNK_BYTES)
+		size = sizeof(EMU_REPLAY_CHUNK) + EMU_REPLAY_CHUNK_BYTES;
+	const UCHAR* at = NULL;
+	replay->ChunkView = MapReplay(replay->Mapping, entry->Offset, (SIZE_T)size, &at);
+	if (!replay->ChunkView)
+		return FALSE;
+	EMU_REPLAY_CHUNK header;
+	CopyMemory(&header, at, sizeof(header));
+	if (!EmuReplayCheckChunk(&header, &replay->Header, entry))
+		return FALSE;
+	EmuReplayBeginChunk(&replay->Cursor, EMU_REC_KEYBOARD, &header, at + sizeof(header));
+	replay->NextChunk = chunk + 1;
+	return TRUE;
+}
+
+BOOL KeyboardReplayOpen(IN LPCWSTR path, OUT PKEY_REPLAY replay) {
+	if (!path || !replay)
+		return FALSE;
+	ZeroMemory(replay, sizeof(KEY_REPLAY));
+	replay->File = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (replay->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	LARGE_INTEGER fileSize;
+	EMU_REPLAY_HEADER header;
+	DWORD bytesRead = 0;
+	if (GetFileSizeEx(replay->File, &fileSize) &&
+		ReadFile(replay->File, &header, sizeof(header), &bytesRead, NULL) && bytesRead == sizeof(header) &&
+		EmuReplayCheckHeader(&header, (ULONG64)fileSize.QuadPart, EMU_REC_KEYBOARD)) {
+		replay->Header = header;
+		replay->Mapping = CreateFileMappingW(replay->File, NULL, PAGE_READONLY, 0, 0, NULL);
+	}
+	if (replay->Mapping && replay->Header.ChunkCount > 0) {
+		const UCHAR* at = NULL;
+		replay->IndexView = MapReplay(replay->Mapping, replay->Header.IndexOffset, replay->Header.ChunkCount * sizeof(EMU_REPLAY_INDEX), &at);
+		replay->Index = (const EMU_REPLAY_INDEX*)at;
+	}
+	if (!replay->Mapping || (replay->Header.ChunkCount > 0 && !replay->IndexView)) {
+		KeyboardReplayClose(replay);
+		return FALSE;
+	}
+	replay->SeekTime = replay->Header.ChunkCount > 0 ? replay->Index[0].Time : 0;
+	return TRUE;
+}
+
+BOOL KeyboardReplaySeek(IN PKEY_REPLAY replay, IN LONG64 time) {
+	if (!replay || !replay->Mapping)
+		return FALSE;
+	replay->SeekTime = time;
+	if (replay->Header.ChunkCount == 0)
+		return TRUE;
+	return EnterReplayChunk(replay, EmuReplayFindChunk(replay->Index, replay->Header.ChunkCount, time));
+}
+
+ULONG KeyboardReplayRead(IN PKEY_REPLAY replay, OUT PKEY_CAPTURE_RECORD records, IN ULONG recordCount) {
+	if (!replay || !records || !replay->Mapping)
+		return 0;
+	ULONG count = 0;
+	while (count < recordCount) {
+		ZeroMemory(&records[count], sizeof(KEY_CAPTURE_RECORD));
+		if (!EmuReplayNextKeyboard(&replay->Cursor, &records[count].Timestamp, &records[count].Input)) {
+			//chunks are mapped only once reading reaches them
+			if (replay->NextChunk >= replay->Header.ChunkCount || !EnterReplayChunk(replay, replay->NextChunk))
+				break;
+			continue;
+		}
+		if (records[count].Timestamp >= replay->SeekTime)
+			count++;
+	}
+	return count;
+}
+
+BOOL KeyboardReplayClose(IN PKEY_REPLAY replay) {
+	if (!replay || replay->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	if (replay->ChunkView)
+		UnmapViewOfFile(replay->ChunkView);
+	if (replay->IndexView)
+		UnmapViewOfFile(replay->IndexView);
+	if (replay->Mapping)
+		CloseHandle(replay->Mapping);
+	BOOL result = CloseHandle(replay->File);
+	ZeroMemory(replay, sizeof(KEY_REPLAY));
+	replay->File = INVALID_HANDLE_VALUE;
+	return result;
+}
+
+typedef struct _KEY_PLAYBACK {
+	HANDLE DriverHandle;
+	HANDLE StopEvent;
+	//High resolution waitable timer the playback sleeps on
+	HANDLE Timer;
+	LPCWSTR Path;
+	LONG64 StartTime;
+	LONG64 Frequency;
+	//TRUE for a replay file, FALSE for a recording read by the player
+	BOOL Seekable;
+	KEY_REPLAY Replay;
+	KEY_PLAYER Player;
+	KEY_CAPTURE_RECORD Records[EMU_REPLAY_LOOKAHEAD];
+} KEY_PLAYBACK, * PKEY_PLAYBACK;
+
+static ULONG ReadPlayback(PVOID context, PEMU_REPLAY_EVENT events, ULONG count) {
+	PKEY_PLAYBACK playback = (PKEY_PLAYBACK)context;
+	ULONG filled = 0;
+	if (count > EMU_REPLAY_LOOKAHEAD)
+		count = EMU_REPLAY_LOOKAHEAD;
+	while (filled == 0) {
+		ULONG read = playback->Seekable ?
+			KeyboardReplayRead(&playback->Replay, playback->Records, count) :
+			KeyboardPlayerRead(&playback->Player, playback->Records, count);
+		if (read == 0)
+			break;
+		for (ULONG i = 0; i < read; i++) {
+			//a recording has no index, it is decoded up to the start time
+			if (playback->Records[i].Timestamp < playback->StartTime)
+				continue;
+			ZeroMemory(&events[filled], sizeof(EMU_REPLAY_EVENT));
+			events[filled].Time = playback->Records[i].Timestamp;
+			events[filled].Input.Keyboard = playback->Records[i].Input;
+			filled++;
+		}
+	}
+	return filled;
+}
+
+static BOOLEAN RewindPlayback(PVOID context) {
+	PKEY_PLAYBACK playback = (PKEY_PLAYBACK)context;
+	if (playback->Seekable)
+		return KeyboardReplaySeek(&playback->Replay, playback->StartTime) != FALSE;
+	KeyboardPlayerClose(&playback->Player);
+	return KeyboardPlayerOpen(playback->Path, &playback->Player) != FALSE;
+}
+
+static BOOLEAN InsertPlayback(PVOID context, const VOID* inputs, ULONG count) {
+	PKEY_PLAYBACK playback = (PKEY_PLAYBACK)context;
+	return KeyboardInsertKeys(playback->DriverHandle, (PKEYBOARD_INPUT_DATA)inputs, count) != FALSE;
+}
+
+static LONG64 NowPlayback(PVOID context) {
+	UNREFERENCED_PARAMETER(context);
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+static BOOLEAN WaitPlayback(PVOID context, LONG64 until) {
+	PKEY_PLAYBACK playback = (PKEY_PLAYBACK)context;
+	LONG64 left = until - NowPlayback(context);
+	HANDLE handles[2] = { playback->StopEvent, playback->Timer };
+	DWORD handleCount = 0;
+	if (left > 0) {
+		//relative due times of a waitable timer are negative, in 100 ns units
+		LARGE_INTEGER dueTime;
+		dueTime.QuadPart = -(LONG64)((double)left * 10000000.0 / (double)playback->Frequency);
+		if (dueTime.QuadPart < 0 && SetWaitableTimer(playback->Timer, &dueTime, 0, NULL, NULL, FALSE))
+			handleCount = 2;
+	}
+	if (!playback->StopEvent) {
+		if (handleCount)
+			WaitForSingleObject(playback->Timer, INFINITE);
+		return TRUE;
+	}
+	return WaitForMultipleObjects(handleCount ? handleCount : 1, handles, FALSE, handleCount ? INFINITE : 0) != WAIT_OBJECT_0;
+}
+
+BOOL KeyboardPlayRecording(IN HANDLE driverHandle, IN LPCWSTR path, IN PKEY_PLAYBACK_OPTIONS options, OUT OPTIONAL PEMU_REPLAY_STATS stats) {
+	if (driverHandle == INVALID_HANDLE_VALUE || !path || !options)
+		return FALSE;
+	HANDLE processHeap = GetProcessHeap();
+	PKEY_PLAYBACK playback = (PKEY_PLAYBACK)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, sizeof(KEY_PLAYBACK));
+	if (!playback)
+		return FALSE;
+	playback->DriverHandle = driverHandle;
+	playback->StopEvent = options->StopEvent;
+	playback->Path = path;
+	playback->StartTime = options->StartTime;
+	//a replay file seeks to the start time, any other file is played as a recording
+	playback->Seekable = KeyboardReplayOpen(path, &playback->Replay);
+	if (playback->Seekable && !KeyboardReplaySeek(&playback->Replay, options->StartTime)) {
+		KeyboardReplayClose(&playback->Replay);
+		HeapFree(processHeap, 0, playback);
+		return FALSE;
+	}
+	if (!playback->Seekable && !KeyboardPlayerOpen(path, &playback->Player)) {
+		HeapFree(processHeap, 0, playback);
+		return FALSE;
+	}
+	playback->Timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	if (!playback->Timer)
+		playback->Timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	playback->Frequency = frequency.QuadPart;
+	EMU_REPLAY_SOURCE source = { playback, ReadPlayback, RewindPlayback,
+		playback->Seekable ? playback->Replay.Header.Frequency : playback->Player.Frequency };
+	EMU_REPLAY_TRANSPORT transport = { playback, InsertPlayback };
+	EMU_REPLAY_CLOCK clock = { playback, NowPlayback, WaitPlayback, frequency.QuadPart };
+	EMU_REPLAY_OPTIONS replayOptions = { EMU_REC_KEYBOARD, 0, options->SpeedPercent, options->Loops,
+		(LONG64)options->BatchWindowMicroseconds * frequency.QuadPart / 1000000 };
+	EMU_REPLAY_STATS replayStats = { 0 };
+	EMU_REPLAY_STATUS status = playback->Timer ?
+		EmuReplayRun(&source, &transport, &clock, &replayOptions, &replayStats) : EMU_REPLAY_INVALID;
+	if (stats)
+		*stats = replayStats;
+
+	if (playback->Timer)
+		CloseHandle(playback->Timer);
+	if (playback->Seekable)
+		KeyboardReplayClose(&playback->Replay);
+	else
+		KeyboardPlayerClose(&playback->Player);
+	HeapFree(processHeap, 0, playback);
+	return status == EMU_REPLAY_DONE || status == EMU_REPLAY_STOPPED;
+}
+
+BOOL KeyboardDeviceIoControl(IN HANDLE driverHandle, IN ULONG deviceHandle, IN DWORD ioControlCode, IN LPVOID inputBuffer, IN DWORD inputSize, OUT LPVOID outputBuffer, IN DWORD outputSize, OUT LPDWORD bytesReturned) {
+	if (driverHandle == INVALID_HANDLE_VALUE || (inputSize > 0 && !inputBuffer))
+		return FALSE;
+	DWORD requiredBytes = sizeof(KEY_DEVICE_HEADER) + inputSize;
+	PKEY_DEVICE_HEADER header = (PKEY_DEVICE_HEADER)ScratchBuffer(&RequestScratch, requiredBytes);
+	if (!header)
+	{
+		return FALSE;
+	}
+	ZeroMemory(header, sizeof(KEY_DEVICE_HEADER));
+	header->DeviceHandle = deviceHandle;
+	if (inputSize > 0)
+		CopyMemory(header + 1, inputBuffer, inputSize);
+
+	DWORD returned = 0;
+	BOOL result = DriverIoControl(
+		driverHandle,
+		IOCTL_KEYBOARD_TARGETED(ioControlCode),
+		header, requiredBytes,
+		outputBuffer, outputSize,
+		&returned, NULL);
+	if (bytesReturned)
+		*bytesReturned = returned;
+	return result;
+}
@@ -35,6 +35,168 @@ enum KBD_FILTER_FLAG
 	FLAG_KEY_TERMSRV_SHADOW = KBD_KEY_TERMSRV_SHADOW << 1,
 	FLAG_KEY_TERMSRV_VKPACKET = KBD_KEY_TERMSRV_VKPACKET << 1
 };
+
+typedef struct _KEY_CAPTURE_READER {
+	//Cursor of this reader in the capture ring mapped into the process
+	EMU_RING_READER Ring;
+	//Event the driver signals when keys arrive while the reader waits
+	HANDLE Event;
+	//Bit of the reader in the WaitMask of the ring
+	ULONG ReaderIndex;
+} KEY_CAPTURE_READER, * PKEY_CAPTURE_READER;
+
+//
+//Bytes a recorder or player buffers between file accesses
+//
+#define KEY_RECORDING_BUFFER 0x10000
+
+typedef struct _KEY_RECORDER {
+	//File the recording is written to
+	HANDLE File;
+	//Encoder state after the last key
+	EMU_REC_STATE State;
+	//Bytes of Buffer not yet written to the file
+	ULONG Used;
+	UCHAR Buffer[KEY_RECORDING_BUFFER];
+} KEY_RECORDER, * PKEY_RECORDER;
+
+typedef struct _KEY_PLAYER {
+	//File the recording is read from
+	HANDLE File;
+	//Decoder state after the last key
+	EMU_REC_STATE State;
+	//Time units per second of the recording
+	LONG64 Frequency;
+	//Next byte of Buffer to decode
+	ULONG Offset;
+	//Bytes read into Buffer
+	ULONG Filled;
+	//TRUE once the end of the file was read into Buffer
+	BOOL EndOfFile;
+	UCHAR Buffer[KEY_RECORDING_BUFFER];
+} KEY_PLAYER, * PKEY_PLAYER;
+
+typedef struct _KEY_REPLAY_WRITER {
+	//File the replay is written to
+	HANDLE File;
+	//Header written once the replay is finished
+	EMU_REPLAY_HEADER Header;
+	//Chunk being filled, Count is 0 before its first key
+	EMU_REPLAY_CHUNK Chunk;
+	//Encoder state after the last key
+	EMU_REC_STATE State;
+	//Index entries of the chunks written so far
+	PEMU_REPLAY_INDEX Index;
+	ULONG IndexCapacity;
+	//Bytes of Events encoded into the chunk being filled
+	ULONG Used;
+	//File offset of the chunk being filled
+	ULONG64 Offset;
+	UCHAR Events[EMU_REPLAY_CHUNK_BYTES];
+} KEY_REPLAY_WRITER, * PKEY_REPLAY_WRITER;
+
+typedef struct _KEY_REPLAY {
+	//File and mapping the replay is read from
+	HANDLE File;
+	HANDLE Mapping;
+	//Header of the replay, Frequency tells the time units per second
+	EMU_REPLAY_HEADER Header;
+	//View of the index and the first entry in it
+	PVOID IndexView;
+	const EMU_REPLAY_INDEX* Index;
+	//View of the chunk being decoded, NULL before the first one
+	PVOID ChunkView;
+	//Chunk decoded after the current one
+	ULONG NextChunk;
+	//Records before this time are skipped after a seek
+	LONG64 SeekTime;
+	EMU_REPLAY_CURSOR Cursor;
+} KEY_REPLAY, * PKEY_REPLAY;
+
+typedef struct _KEY_PLAYBACK_OPTIONS {
+	//Percent of the recorded speed, EMU_REPLAY_SPEED_MIN (half) to EMU_REPLAY_SPEED_MAX (ten times)
+	ULONG SpeedPercent;
+	//Times the recording is played, 0 until stopEvent is signaled
+	ULONG Loops;
+	//Time of the recording each pass starts at, in the units of its timestamps
+	LONG64 StartTime;
+	//Microseconds keys may be injected early to join the batch before them
+	ULONG BatchWindowMicroseconds;
+	//Optional event that stops the playback once signaled
+	HANDLE StopEvent;
+} KEY_PLAYBACK_OPTIONS, * PKEY_PLAYBACK_OPTIONS;
+
+//
+//Times a cached edit reads the tables again after another client changed them
+//
+#define KEY_RULE_CACHE_ATTEMPTS 4
+
+typedef struct _KEY_RULE_CACHE {
+	//Driver handle and keyboard the cache shadows the tables of
+	HANDLE DriverHandle;
+	ULONG DeviceHandle;
+	//Rule generation of the keyboard the shadow matches, 0 once it has to be read again
+	ULONG Generation;
+	//Filter mode of the keyboard, Filters only holds entries in FILTER_KEY_FLAG_AND_SCANCODE
+	USHORT FilterMode;
+	//Flags filtered in FILTER_KEY_FLAGS mode
+	USHORT FilterFlags;
+	ULONG FilterCount;
+	ULONG FilterCapacity;
+	PKEY_FILTER_DATA Filters;
+	//Finds an entry of Filters by its flags and scan code
+	EMU_ENTRY_SET FilterSet;
+	ULONG ModifyCount;
+	ULONG ModifyCapacity;
+	PKEY_MODIFY_DATA Modifies;
+	//Finds an entry of Modifies by its flags and scan codes
+	EMU_ENTRY_SET ModifySet;
+	//Device header and table of the IOCTLs the cache sends, reused by every edit
+	PUCHAR Upload;
+	DWORD UploadSize;
+} KEY_RULE_CACHE, * PKEY_RULE_CACHE;
+
+typedef struct _KEY_RULE_EDIT {
+	//Tables being edited and the generation they were read at. Entries their set no longer
+	//finds at their position were removed by the edit, the commit drops them
+	KEY_RULE_CACHE Tables;
+	//TRUE once the tables were edited since they were read or committed
+	BOOL Changed;
+} KEY_RULE_EDIT, * PKEY_RULE_EDIT;
+
+//
+//Inserts a queue keeps in flight at most
+//
+#define KEY_INSERT_DEPTH_MAX 64
+
+//
+//Called for every insert of a queue, in the order they were queued, with the context given
+//to 'KeyboardInsertKeysAsync' and ERROR_SUCCESS or the error the insert failed with
+//
+typedef VOID(*PKEY_INSERT_COMPLETION)(PVOID context, DWORD error, ULONG inputCount);
+
+typedef struct _KEY_INSERT_SLOT {
+	//Signalled when the insert completes, its event is owned by the queue
+	OVERLAPPED Overlapped;
+	//Copy of the keys, the driver reads them until the insert completes
+	PKEYBOARD_INPUT_DATA Inputs;
+	ULONG Capacity;
+	ULONG InputCount;
+	//ERROR_IO_PENDING while in flight, the result once the driver completed the insert
+	DWORD Error;
+	PVOID Context;
+} KEY_INSERT_SLOT, * PKEY_INSERT_SLOT;
+
+typedef struct _KEY_INSERT_QUEUE {
+	//Handle the inserts are sent on, overlapped so several stay in flight
+	HANDLE DriverHandle;
+	PKEY_INSERT_COMPLETION Completion;
+	ULONG Depth;
+	//Oldest insert not yet reported and the number in flight after it
+	ULONG Head;
+	ULONG Count;
+	KEY_INSERT_SLOT Slots[KEY_INSERT_DEPTH_MAX];
+} KEY_INSERT_QUEUE, * PKEY_INSERT_QUEUE;
 /*++
 
 Function Description:
@@ -65,6 +227,28 @@ Arguments:
 --*/
 Public void DisposeHandle(HANDLE driverHandle);
 
+/*++
+
+Function Description:
+
+	Replaces the transport the API reaches the driver through, the device object by default.
+	Handles got before keep working only if both transports accept them, so the transport is
+	replaced before any handle is created. The transport is copied, its context must stay
+	valid while it is installed.
+
+Arguments:
+
+	transport - Pointer to an 'EMU_TRANSPORT' structure with the callbacks to open handles,
+	send IOCTLs and close handles, NULL to return to the device object.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE if a callback is missing.
+
+--*/
+Public BOOL KeyboardSetTransport(IN const EMU_TRANSPORT* transport);
 
 /*++
 
@@ -134,6 +318,85 @@ Return Value:
 --*/
 Public BOOL KeyboardDetectDeviceId(IN HANDLE driverHandle, OUT PUSHORT deviceId);
 
+/*++
+
+Function Description:
+
+	Waits for the next input on any keyboard like 'KeyboardDetectDeviceId', but several callers may
+	wait at once and each wait may be bounded. All the requests waiting when an input arrives
+	complete with the keyboard that generated it, which also becomes the active device of each
+	handle they were sent on. With an overlapped handle from 'CreateCaptureHandle' the call returns
+	at once and the wait can be abandoned with 'CancelIoEx', the request then fails with
+	'ERROR_OPERATION_ABORTED'.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	timeout - Milliseconds to wait before the request fails with 'ERROR_TIMEOUT', 0 waits until canceled.
+
+	result - Pointer to a 'KEY_DETECT_RESULT' structure that will contain the handle of the
+	detected keyboard, must stay valid until the request completes.
+
+	overlapped - Overlapped structure signalled when the request completes, NULL to block until it does.
+
+Return Value:
+
+	TRUE if the keyboard was detected or the request is pending ('GetLastError' returns 'ERROR_IO_PENDING'),
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardDetectDevice(IN HANDLE driverHandle, IN ULONG timeout, OUT PKEY_DETECT_RESULT result, IN LPOVERLAPPED overlapped);
+
+/*++
+
+Function Description:
+
+	Lists the keyboards with their stable handles. A handle stays the same when the
+	keyboard is plugged back or the machine restarts, while its index may change.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	devices - Receives the handles and current indices of the keyboards.
+
+	capacity - Number of entries 'devices' can hold.
+
+	count - Receives the number of entries written.
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise. GetLastError returns ERROR_MORE_DATA if there are more keyboards
+	than 'capacity', the first 'capacity' are written anyway.
+
+--*/
+Public BOOL KeyboardGetDeviceHandles(IN HANDLE driverHandle, OUT PKEY_DEVICE_INFO devices, IN ULONG capacity, OUT PULONG count);
+
+
+/*++
+
+Function Description:
+
+	Sets the active device to the keyboard with the given handle. Unlike the index set by
+	'KeyboardSetActiveDevice' the handle keeps naming the same keyboard when others come and go.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	deviceHandle - Handle of the target keyboard as returned by 'KeyboardGetDeviceHandles',
+				   or 0 to follow the first keyboard.
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardSetActiveDeviceHandle(IN HANDLE driverHandle, IN ULONG deviceHandle);
+
 
 /*++
 
@@ -327,15 +590,16 @@ Public BOOL KeyboardRemoveKeyModifying(IN HANDLE driverHandle, IN PKEY_MODIFY_DA
 
 Function Description:
 
-	Insert keys to the output from the context of the active device.
+	Gets the rule generation of a keyboard. The driver moves it on whenever the filters, modifies,
+	rules or edit profile of the keyboard change, so an unchanged generation means unchanged tables.
 
 Arguments:
 
 	driverHandle - Handle to the driver control object
 
-	inputKeys - Pointer to 'KEYBOARD_INPUT_DATA' structures that contain the input data.
+	deviceHandle - Handle of the keyboard as returned by 'KeyboardGetDeviceHandles'.
 
-	inputCount - Number of keyboard input datas that 'inputKeys' points to.
+	generation - Receives the generation, never 0.
 
 
 Return Value:
@@ -344,20 +608,133 @@ Return Value:
 	FALSE otherwise.
 
 --*/
-Public BOOL KeyboardInsertKeys(IN HANDLE driverHandle, IN PKEYBOARD_INPUT_DATA inputKeys, IN ULONG inputCount);
+Public BOOL KeyboardGetRuleGeneration(IN HANDLE driverHandle, IN ULONG deviceHandle, OUT PULONG generation);
 
 
 /*++
 
 Function Description:
 
-	Gets the attributes of the active keyboard device.
+	Opens a cache of the key filters and modifications of a keyboard. The cached calls edit a local
+	copy of the tables and upload the result only, on the condition that the rule generation of the
+	keyboard is still the one the copy was read at. If another client changed the tables meanwhile
+	the copy is read again and the edit retried, up to 'KEY_RULE_CACHE_ATTEMPTS' times.
 
 Arguments:
 
 	driverHandle - Handle to the driver control object
 
-	modifyBuffer - Pointer to a 'KEYBOARD_ATTRIBUTES' structure that will contains the keyboard attributes.
+	deviceHandle - Handle of the keyboard as returned by 'KeyboardGetDeviceHandles'.
+
+	cache - Receives the cache, close it with 'KeyboardRuleCacheClose'.
+
+
+Return Value:
+
+	TRUE if the tables were read,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardRuleCacheOpen(IN HANDLE driverHandle, IN ULONG deviceHandle, OUT PKEY_RULE_CACHE cache);
+
+
+/*++
+
+Function Description:
+
+	Adds a key filtering data like 'KeyboardAddKeyFiltering' does, to the keyboard of a cache.
+
+Arguments:
+
+	cache - Cache opened by 'KeyboardRuleCacheOpen'.
+
+	filterData - Pointer to a 'KEY_FILTER_DATA' structure that contains the key filtering data to be added.
+
+
+Return Value:
+
+	TRUE if successfully added or already existed,
+	FALSE otherwise, GetLastError returns ERROR_REVISION_MISMATCH if other clients kept changing the tables.
+
+--*/
+Public BOOL KeyboardCachedAddKeyFiltering(IN PKEY_RULE_CACHE cache, IN PKEY_FILTER_DATA filterData);
+
+
+/*++
+
+Function Description:
+
+	Removes a key filtering data like 'KeyboardRemoveKeyFiltering' does, from the keyboard of a cache.
+
+Arguments:
+
+	cache - Cache opened by 'KeyboardRuleCacheOpen'.
+
+	filterData - Pointer to a 'KEY_FILTER_DATA' structure that contains the key filtering data to be removed.
+
+
+Return Value:
+
+	TRUE if successfully removed or not found,
+	FALSE otherwise, GetLastError returns ERROR_REVISION_MISMATCH if other clients kept changing the tables.
+
+--*/
+Public BOOL KeyboardCachedRemoveKeyFiltering(IN PKEY_RULE_CACHE cache, IN PKEY_FILTER_DATA filterData);
+
+
+/*++
+
+Function Description:
+
+	Adds a key modifying data like 'KeyboardAddKeyModifying' does, to the keyboard of a cache.
+
+Arguments:
+
+	cache - Cache opened by 'KeyboardRuleCacheOpen'.
+
+	modifyData - Pointer to a 'KEY_MODIFY_DATA' structure that contains the key modification data to be added.
+
+
+Return Value:
+
+	TRUE if successfully added or already existed,
+	FALSE otherwise, GetLastError returns ERROR_REVISION_MISMATCH if other clients kept changing the tables.
+
+--*/
+Public BOOL KeyboardCachedAddKeyModifying(IN PKEY_RULE_CACHE cache, IN PKEY_MODIFY_DATA modifyData);
+
+
+/*++
+
+Function Description:
+
+	Removes a key modifying data like 'KeyboardRemoveKeyModifying' does, from the keyboard of a cache.
+
+Arguments:
+
+	cache - Cache opened by 'KeyboardRuleCacheOpen'.
+
+	modifyData - Pointer to a 'KEY_MODIFY_DATA' structure that contains the key modification data to be removed.
+
+
+Return Value:
+
+	TRUE if successfully removed or not found,
+	FALSE otherwise, GetLastError returns ERROR_REVISION_MISMATCH if other clients kept changing the tables.
+
+--*/
+Public BOOL KeyboardCachedRemoveKeyModifying(IN PKEY_RULE_CACHE cache, IN PKEY_MODIFY_DATA modifyData);
+
+
+/*++
+
+Function Description:
+
+	Frees the local copy of a cache. The tables of the keyboard stay as they are.
+
+Arguments:
+
+	cache - Cache opened by 'KeyboardRuleCacheOpen'.
 
 
 Return Value:
@@ -366,7 +743,1237 @@ Return Value:
 	FALSE otherwise.
 
 --*/
-Public BOOL KeyboardGetAttributes(IN HANDLE driverHandle, OUT PKEYBOARD_ATTRIBUTES attributes);
+Public BOOL KeyboardRuleCacheClose(IN PKEY_RULE_CACHE cache);
+
+
+/*++
+
+Function Description:
+
+	Begins a batch of edits to the key filters and modifications of a keyboard. The tables are
+	read once, the edits only change the local copy and 'KeyboardCommitRuleEdit' uploads both
+	tables in one request, so a batch costs the same few IOCTLs whatever its size.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	deviceHandle - Handle of the keyboard as returned by 'KeyboardGetDeviceHandles'.
+
+	edit - Receives the edit, end it with 'KeyboardEndRuleEdit'.
+
+
+Return Value:
+
+	TRUE if the tables were read,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardBeginRuleEdit(IN HANDLE driverHandle, IN ULONG deviceHandle, OUT PKEY_RULE_EDIT edit);
+
+
+/*++
+
+Function Description:
+
+	Stages a key filtering data to be added. Like 'KeyboardAddKeyFiltering' it switches the
+	filter mode to 'FILTER_KEY_FLAG_AND_SCANCODE'.
+
+Arguments:
+
+	edit - Edit begun by 'KeyboardBeginRuleEdit'.
+
+	filterData - Pointer to a 'KEY_FILTER_DATA' structure that contains the key filtering data to be added.
+
+
+Return Value:
+
+	TRUE if staged or already staged,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardRuleEditAddFilter(IN PKEY_RULE_EDIT edit, IN PKEY_FILTER_DATA filterData);
+
+
+/*++
+
+Function Description:
+
+	Stages a key filtering data to be removed.
+
+Arguments:
+
+	edit - Edit begun by 'KeyboardBeginRuleEdit'.
+
+	filterData - Pointer to a 'KEY_FILTER_DATA' structure that contains the key filtering data to be removed.
+
+
+Return Value:
+
+	TRUE if staged or not found,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardRuleEditRemoveFilter(IN PKEY_RULE_EDIT edit, IN PKEY_FILTER_DATA filterData);
+
+
+/*++
+
+Function Description:
+
+	Stages a key modifying data to be added after the modifications already there.
+
+Arguments:
+
+	edit - Edit begun by 'KeyboardBeginRuleEdit'.
+
+	modifyData - Pointer to a 'KEY_MODIFY_DATA' structure that contains the key modification data to be added.
+
+
+Return Value:
+
+	TRUE if staged or already staged,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardRuleEditAddModify(IN PKEY_RULE_EDIT edit, IN PKEY_MODIFY_DATA modifyData);
+
+
+/*++
+
+Function Description:
+
+	Stages a key modifying data to be removed.
+
+Arguments:
+
+	edit - Edit begun by 'KeyboardBeginRuleEdit'.
+
+	modifyData - Pointer to a 'KEY_MODIFY_DATA' structure that contains the key modification data to be removed.
+
+
+Return Value:
+
+	TRUE if staged or not found,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardRuleEditRemoveModify(IN PKEY_RULE_EDIT edit, IN PKEY_MODIFY_DATA modifyData);
+
+
+/*++
+
+Function Description:
+
+	Uploads the staged filters and modifications in one 'IOCTL_KEYBOARD_SET_TABLES', on the
+	condition that no other client changed the tables of the keyboard since they were read or
+	last committed. The edit stays open, later edits are committed on top of this one.
+
+Arguments:
+
+	edit - Edit begun by 'KeyboardBeginRuleEdit'.
+
+
+Return Value:
+
+	TRUE if the tables were replaced or nothing was staged,
+	FALSE otherwise, the keyboard keeps its tables. GetLastError returns ERROR_REVISION_MISMATCH
+	if another client changed them, the edit should then be ended and begun again.
+
+--*/
+Public BOOL KeyboardCommitRuleEdit(IN PKEY_RULE_EDIT edit);
+
+
+/*++
+
+Function Description:
+
+	Ends an edit, dropping whatever was staged and not committed.
+
+Arguments:
+
+	edit - Edit begun by 'KeyboardBeginRuleEdit'.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardEndRuleEdit(IN PKEY_RULE_EDIT edit);
+
+
+/*++
+
+Function Description:
+
+	Insert keys to the output from the context of the active device.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	inputKeys - Pointer to 'KEYBOARD_INPUT_DATA' structures that contain the input data.
+
+	inputCount - Number of keyboard input datas that 'inputKeys' points to.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardInsertKeys(IN HANDLE driverHandle, IN PKEYBOARD_INPUT_DATA inputKeys, IN ULONG inputCount);
+
+
+/*++
+
+Function Description:
+
+	Opens a queue that keeps several inserts in flight, so one thread keeps the driver busy
+	instead of waiting a round trip for every insert. The driver injects the inserts of a
+	handle in the order they were sent, the queue reports them in the same order.
+
+Arguments:
+
+	driverHandle - Handle from 'CreateCaptureHandle', its active device receives the keys.
+	With a handle from 'CreateDriverHandle' every insert completes before it is queued.
+
+	depth - Inserts in flight at most, 1 to KEY_INSERT_DEPTH_MAX.
+
+	completion - Called for every insert when it is reported, may be NULL.
+
+	queue - Receives the queue, close it with 'KeyboardInsertQueueClose'.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardInsertQueueOpen(IN HANDLE driverHandle, IN ULONG depth, IN OPTIONAL PKEY_INSERT_COMPLETION completion, OUT PKEY_INSERT_QUEUE queue);
+
+
+/*++
+
+Function Description:
+
+	Sends an insert without waiting for it. The keys are copied, the caller may reuse its
+	buffer at once. When the queue is full the oldest insert is waited for and reported first.
+
+Arguments:
+
+	queue - Queue opened by 'KeyboardInsertQueueOpen'.
+
+	inputs - Pointer to 'KEYBOARD_INPUT_DATA' structures that contain the input data.
+
+	inputCount - Number of keys that 'inputs' points to.
+
+	context - Passed to the completion of the insert.
+
+
+Return Value:
+
+	TRUE if the insert was sent, its completion reports how it ended,
+	FALSE if it could not be sent, it is not reported.
+
+--*/
+Public BOOL KeyboardInsertKeysAsync(IN PKEY_INSERT_QUEUE queue, IN PKEYBOARD_INPUT_DATA inputs, IN ULONG inputCount, IN OPTIONAL PVOID context);
+
+
+/*++
+
+Function Description:
+
+	Reports the inserts that completed, oldest first, stopping at the first still in flight.
+
+Arguments:
+
+	queue - Queue opened by 'KeyboardInsertQueueOpen'.
+
+	wait - TRUE to wait for the oldest insert when none completed yet.
+
+
+Return Value:
+
+	Number of inserts reported.
+
+--*/
+Public ULONG KeyboardInsertQueueComplete(IN PKEY_INSERT_QUEUE queue, IN BOOL wait);
+
+
+/*++
+
+Function Description:
+
+	Waits for the inserts in flight, reports them and frees the queue. The handle stays open.
+
+Arguments:
+
+	queue - Queue opened by 'KeyboardInsertQueueOpen'.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardInsertQueueClose(IN PKEY_INSERT_QUEUE queue);
+
+
+/*++
+
+Function Description:
+
+	Compiles UTF-16 text into the keys typing it on a keyboard layout, ready for one
+	'KeyboardInsertKeys'. Shift, control and alt are pressed around the characters that need
+	them and released at the end, extended keys get 'KBD_KEY_E0'. The table of a layout is
+	built the first time it is used and kept for the next calls. Characters the layout types
+	with dead keys or has no key for are skipped. When the buffer is full the compilation
+	stops, the rest of the text is compiled by the next call.
+
+Arguments:
+
+	layout - Keyboard layout to type with, NULL for the layout of the calling thread.
+
+	text - Text to compile.
+
+	length - Number of UTF-16 code units in 'text'.
+
+	inputs - Buffer receiving the keys, 'EMU_TEXT_MAX_INPUTS' times 'length' holds all of them.
+
+	capacity - Number of 'KEYBOARD_INPUT_DATA' structures 'inputs' holds.
+
+	inputCount - Receives the number of keys compiled.
+
+	consumed - Receives the number of code units of 'text' compiled, less than 'length' if the buffer filled.
+
+	skipped - Receives the number of characters that could not be typed, may be NULL.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardCompileText(IN OPTIONAL HKL layout, IN LPCWSTR text, IN ULONG length, OUT PKEYBOARD_INPUT_DATA inputs, IN ULONG capacity, OUT PULONG inputCount, OUT PULONG consumed, OUT OPTIONAL PULONG skipped);
+
+
+/*++
+
+Function Description:
+
+	Compiles UTF-8 text like 'KeyboardCompileText'. Bytes that don't decode are skipped.
+
+Arguments:
+
+	layout - Keyboard layout to type with, NULL for the layout of the calling thread.
+
+	text - Text to compile.
+
+	length - Number of bytes in 'text'.
+
+	inputs - Buffer receiving the keys, 'EMU_TEXT_MAX_INPUTS' times 'length' holds all of them.
+
+	capacity - Number of 'KEYBOARD_INPUT_DATA' structures 'inputs' holds.
+
+	inputCount - Receives the number of keys compiled.
+
+	consumed - Receives the number of bytes of 'text' compiled, less than 'length' if the buffer filled.
+
+	skipped - Receives the number of characters that could not be typed, may be NULL.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardCompileTextUtf8(IN OPTIONAL HKL layout, IN LPCSTR text, IN ULONG length, OUT PKEYBOARD_INPUT_DATA inputs, IN ULONG capacity, OUT PULONG inputCount, OUT PULONG consumed, OUT OPTIONAL PULONG skipped);
+
+
+/*++
+
+Function Description:
+
+	Gets the attributes of the active keyboard device.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	modifyBuffer - Pointer to a 'KEYBOARD_ATTRIBUTES' structure that will contains the keyboard attributes.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardGetAttributes(IN HANDLE driverHandle, OUT PKEYBOARD_ATTRIBUTES attributes);
+
+
+/*++
+
+Function Description:
+
+	Sets the autofire of the active device. While the trigger key is held down the
+	driver emits press/release pairs of the output key from a kernel timer, so the
+	rate does not depend on the calling thread.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	autofireData - Pointer to a 'KEY_AUTOFIRE_DATA' structure that contains the trigger, output and timing.
+				   Set 'TriggerScanCode' to 0 to disable autofire.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardSetAutofire(IN HANDLE driverHandle, IN PKEY_AUTOFIRE_DATA autofireData);
+
+
+/*++
+
+Function Description:
+
+	Gets the autofire of the active device.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	autofireData - Pointer to a 'KEY_AUTOFIRE_DATA' structure that will contain the autofire.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardGetAutofire(IN HANDLE driverHandle, OUT PKEY_AUTOFIRE_DATA autofireData);
+
+/*++
+
+Function Description:
+
+	Sets the conditional rules of the active device. A rule only applies while its condition
+	holds on the live key state of all keyboards or the button state of all mice, e.g. a key
+	can be remapped only while the right mouse button is held.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	ruleRequest - Pointer to a 'EMU_RULE_REQUEST' structure that contains the rules.
+				  The 'Rules' member should point a location that contains 'RuleCount' of 'EMU_RULE' structs.
+				  The first rule matching a key wins.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardSetRules(IN HANDLE driverHandle, IN PEMU_RULE_REQUEST ruleRequest);
+
+/*++
+
+Function Description:
+
+	Sets the same conditional rules on several keyboards at once. The driver keeps one
+	copy of the rules that all the targets share, so the upload is paid once however
+	many keyboards get it. Each target gets the rules in the profile it edits.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	deviceHandles - Handles of the target keyboards as returned by 'KeyboardGetDeviceHandles',
+					or NULL to target every keyboard present.
+
+	deviceCount - Number of handles in 'deviceHandles', ignored when it is NULL.
+
+	ruleRequest - Pointer to a 'EMU_RULE_REQUEST' structure that contains the rules,
+				  as for 'KeyboardSetRules'.
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise, in which case none of the keyboards got the rules.
+
+--*/
+Public BOOL KeyboardBroadcastRules(IN HANDLE driverHandle, IN const ULONG* deviceHandles, IN ULONG deviceCount, IN PEMU_RULE_REQUEST ruleRequest);
+
+
+/*++
+
+Function Description:
+
+	Gets the conditional rules of the active device.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	ruleBuffer - Pointer to a 'EMU_RULE_REQUEST' structure that will contain the rules.
+				 The 'Rules' member should point a location that contains 'RuleCount' of 'EMU_RULE' buffers.
+				 If the buffer is not large enough, the result will only contain 'RuleCount' amount of rules.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardGetRules(IN HANDLE driverHandle, IN OUT PEMU_RULE_REQUEST ruleBuffer);
+
+/*++
+
+Function Description:
+
+	Configures the profiles of the active device. Each device holds 'KEY_PROFILE_COUNT' preloaded
+	profiles of filters, modifications and rules. Only the active profile is applied to the inputs,
+	the others can be filled in advance by setting 'EditProfile' and calling the filter, modify and
+	rule functions, so switching later costs nothing.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	profileData - Pointer to a 'KEY_PROFILE_DATA' structure that contains the active and edited profile and the hotkeys.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardSetProfile(IN HANDLE driverHandle, IN PKEY_PROFILE_DATA profileData);
+
+
+/*++
+
+Function Description:
+
+	Gets the profile configuration of the active device.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	profileData - Pointer to a 'KEY_PROFILE_DATA' structure that will contain the profile configuration.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardGetProfile(IN HANDLE driverHandle, OUT PKEY_PROFILE_DATA profileData);
+
+
+/*++
+
+Function Description:
+
+	Activates one of the preloaded profiles of the active device. The switch is atomic,
+	inputs are processed either with the previous or with the new profile.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	profileIndex - Index of the profile, less than 'KEY_PROFILE_COUNT'.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardSwitchProfile(IN HANDLE driverHandle, IN USHORT profileIndex);
+
+/*++
+
+Function Description:
+
+	Saves the profiles and profile hotkeys of the active device in the registry, under the
+	handle of the device. The driver applies them to that keyboard before its first input
+	whenever it is attached, so no client has to be running for them to take effect. Other
+	keyboards are not affected.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardSaveProfiles(IN HANDLE driverHandle);
+
+/*++
+
+Function Description:
+
+	Creates a handle to the driver control object for overlapped I/O, to be used with 'KeyboardCapture'.
+
+Return Value:
+
+	Handle to the driver if successful,
+	NULL otherwise.
+
+--*/
+Public HANDLE CreateCaptureHandle(void);
+
+/*++
+
+Function Description:
+
+	Configures which keys of all keyboards are copied to the pending capture requests, and how long
+	a captured key may wait for its request to fill before the request is completed anyway.
+	Disabling the capture completes the pending requests with 'ERROR_OPERATION_ABORTED'.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	captureConfig - Pointer to a 'KEY_CAPTURE_CONFIG' structure that contains the 'KEY_CAPTURE_SOURCE' bits and the latency.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardSetCapture(IN HANDLE driverHandle, IN PKEY_CAPTURE_CONFIG captureConfig);
+
+/*++
+
+Function Description:
+
+	Gets the capture configuration.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	captureConfig - Pointer to a 'KEY_CAPTURE_CONFIG' structure that will contain the configuration.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardGetCapture(IN HANDLE driverHandle, OUT PKEY_CAPTURE_CONFIG captureConfig);
+
+/*++
+
+Function Description:
+
+	Queues a capture request that the driver fills with captured keys. Keep several requests pending
+	so keys captured while one completes go to the next. The request completes once the buffer, or
+	'KEY_CAPTURE_BATCH_MAX' records, is full or the latency deadline of its first key passes, the number
+	of records is the transferred byte count divided by sizeof('KEY_CAPTURE_RECORD'). Keys captured while
+	no request is pending are lost, as are those collected for a request canceled with 'CancelIoEx' or
+	by closing the handle.
+
+Arguments:
+
+	captureHandle - Handle returned by 'CreateCaptureHandle'
+
+	records - Buffer of 'recordCount' records, must stay valid until the request completes.
+
+	recordCount - Number of records the buffer holds.
+
+	overlapped - Overlapped structure signalled when the request completes.
+
+
+Return Value:
+
+	TRUE if the request completed or is pending ('GetLastError' returns 'ERROR_IO_PENDING'),
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardCapture(IN HANDLE captureHandle, OUT PKEY_CAPTURE_RECORD records, IN ULONG recordCount, IN LPOVERLAPPED overlapped);
+
+/*++
+
+Function Description:
+
+	Maps the capture ring of the driver into this process. With 'KEY_CAPTURE_DELIVERY_RING' set by
+	'KeyboardSetCapture' the driver writes every captured key to the ring, which any number of readers
+	consume at their own pace without a request or a copy per key. A handle maps the ring once.
+	The ring is mapped read-only, a reader cannot change the keys the other readers see.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	reader - Pointer to a 'KEY_CAPTURE_READER' structure that will be set up for 'KeyboardReadCaptureRing'.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardOpenCaptureRing(IN HANDLE driverHandle, OUT PKEY_CAPTURE_READER reader);
+
+/*++
+
+Function Description:
+
+	Copies the captured keys the reader has not seen yet out of the capture ring. While keys keep
+	coming this only polls the ring, the calling thread blocks on the reader's event only when the
+	ring has run dry. Keys overwritten before the reader got to them are counted in 'reader->Ring.Lost'.
+
+Arguments:
+
+	reader - Pointer to a 'KEY_CAPTURE_READER' structure set up by 'KeyboardOpenCaptureRing'.
+
+	records - Pointer to a buffer of 'recordCount' 'KEY_CAPTURE_RECORD' structures.
+
+	recordCount - Number of records the buffer holds.
+
+	timeout - Milliseconds to wait for a key when the ring is empty, may be 'INFINITE'.
+
+
+Return Value:
+
+	Number of records copied, 0 if the timeout elapsed.
+
+--*/
+Public ULONG KeyboardReadCaptureRing(IN PKEY_CAPTURE_READER reader, OUT PKEY_CAPTURE_RECORD records, IN ULONG recordCount, IN DWORD timeout);
+
+/*++
+
+Function Description:
+
+	Unmaps the capture ring mapped by 'KeyboardOpenCaptureRing'. Closing the driver handle unmaps it as well.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object the ring was mapped with
+
+	reader - Pointer to the 'KEY_CAPTURE_READER' structure of the ring.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardCloseCaptureRing(IN HANDLE driverHandle, IN PKEY_CAPTURE_READER reader);
+
+/*++
+
+Function Description:
+
+	Reads the counters of the keyboard selected on the handle: what it reported, what the driver
+	dropped, modified, injected or synthesized for it, and with rule hit counting enabled how often
+	each rule of its active profile applied. The rule hits that fit behind the counters are
+	returned, 'RuleCount' tells how many the profile has.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	stats - Buffer which receives the counters and rule hits.
+
+	size - Size of the buffer in bytes, at least FIELD_OFFSET(KEY_STATS, RuleHits).
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardGetStats(IN HANDLE driverHandle, OUT PKEY_STATS stats, IN ULONG size);
+
+/*++
+
+Function Description:
+
+	Turns counting rule hits on or off for the rules set from then on, on every keyboard. Rules
+	already installed keep counting or not counting until they are replaced.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	config - 'KEY_STATS_RULE_HITS' in 'Flags' counts how often each rule applies.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardSetStats(IN HANDLE driverHandle, IN PKEY_STATS_CONFIG config);
+
+/*++
+
+Function Description:
+
+	Reads the latency histograms of the keyboard selected on the handle, indexed by EMU_HIST: the
+	time its service callbacks spent per batch, the packets per batch and the time from an
+	injection until the class service returned. Times are in performance counter ticks, divide
+	by 'Frequency' for seconds. 'EmuHistogramValueAt' reads percentiles off a histogram.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	reset - TRUE to start the next interval right after the returned histograms, FALSE to
+		keep counting since the last reset.
+
+	latency - Receives the histograms.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardGetLatency(IN HANDLE driverHandle, IN BOOL reset, OUT PKEY_LATENCY latency);
+
+/*++
+
+Function Description:
+
+	Turns the binary trace of the driver on or off. While on, the service callbacks and injections
+	of every keyboard write compact records into a ring per processor, see TraceRing.h. Records
+	are kept until 'KeyboardReadTrace' drains them, a full ring drops new records and counts them.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	enable - TRUE to record, FALSE to stop recording.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardSetTrace(IN HANDLE driverHandle, IN BOOL enable);
+
+/*++
+
+Function Description:
+
+	Drains the trace rings into a dump that 'EmuTraceOpen' and 'EmuTraceNext' decode. Records that
+	don't fit stay in the rings for the next call.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	buffer - Buffer which receives the dump.
+
+	size - Size of the buffer in bytes, at least sizeof(EMU_TRACE_DUMP).
+
+	bytesRead - Receives the size of the dump.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardReadTrace(IN HANDLE driverHandle, OUT PVOID buffer, IN ULONG size, OUT PULONG bytesRead);
+
+/*++
+
+Function Description:
+
+	Creates a recording file and prepares to write keys into it. A recording keeps the time and
+	the key of each record in a compact encoding, see InputRecording.h, which takes a fraction
+	of the size of the records. Records are buffered, 'KeyboardRecorderClose' writes out the rest.
+
+Arguments:
+
+	path - Path of the file, an existing file is replaced.
+
+	frequency - Time units per second of the timestamps, 'QueryPerformanceFrequency' for records
+		captured from the driver.
+
+	recorder - Recorder to set up, it must stay in place until it is closed.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardRecorderOpen(IN LPCWSTR path, IN LONG64 frequency, OUT PKEY_RECORDER recorder);
+
+/*++
+
+Function Description:
+
+	Appends records, e.g. the ones read with 'KeyboardReadCaptureRing', to a recording. Records must
+	come in the order of their timestamps, a record older than the one before it is recorded at
+	the time of the one before. 'DeviceHandle' and 'Source' are not recorded.
+
+Arguments:
+
+	recorder - Recorder opened with 'KeyboardRecorderOpen'.
+
+	records - Records to append.
+
+	recordCount - Number of records.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardRecorderWrite(IN PKEY_RECORDER recorder, IN PKEY_CAPTURE_RECORD records, IN ULONG recordCount);
+
+/*++
+
+Function Description:
+
+	Writes the buffered part of a recording and closes its file.
+
+Arguments:
+
+	recorder - Recorder opened with 'KeyboardRecorderOpen'.
+
+
+Return Value:
+
+	TRUE if the whole recording was written,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardRecorderClose(IN PKEY_RECORDER recorder);
+
+/*++
+
+Function Description:
+
+	Opens a recording written by 'KeyboardRecorderOpen' for reading it from the start.
+
+Arguments:
+
+	path - Path of the recording.
+
+	player - Player to set up, 'Frequency' tells the time units per second of the recording.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE if the file can't be read or is not a keyboard recording.
+
+--*/
+Public BOOL KeyboardPlayerOpen(IN LPCWSTR path, OUT PKEY_PLAYER player);
+
+/*++
+
+Function Description:
+
+	Reads the next records of a recording, with the time and the key they were recorded with.
+	'DeviceHandle' and 'Source' are set to 0.
+
+Arguments:
+
+	player - Player opened with 'KeyboardPlayerOpen'.
+
+	records - Buffer which receives the records.
+
+	recordCount - Number of records the buffer can hold.
+
+
+Return Value:
+
+	Number of records read,
+	0 at the end of the recording or if it can't be read further.
+
+--*/
+Public ULONG KeyboardPlayerRead(IN PKEY_PLAYER player, OUT PKEY_CAPTURE_RECORD records, IN ULONG recordCount);
+
+/*++
+
+Function Description:
+
+	Closes the file of a player.
+
+Arguments:
+
+	player - Player opened with 'KeyboardPlayerOpen'.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardPlayerClose(IN PKEY_PLAYER player);
+
+/*++
+
+Function Description:
+
+	Creates a replay file, a recording split into chunks with an index of their times, see
+	ReplayFile.h. Unlike the stream of 'KeyboardRecorderOpen' a replay can be opened at any time
+	without decoding what comes before it. The file can only be read once 'KeyboardReplayFinish'
+	wrote its index.
+
+Arguments:
+
+	path - Path of the file, an existing file is replaced.
+
+	frequency - Time units per second of the timestamps, 'QueryPerformanceFrequency' for records
+		captured from the driver.
+
+	writer - Writer to set up, it must stay in place until it is finished.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardReplayCreate(IN LPCWSTR path, IN LONG64 frequency, OUT PKEY_REPLAY_WRITER writer);
+
+/*++
+
+Function Description:
+
+	Appends records to a replay. Records must come in the order of their timestamps, a record
+	older than the one before it is written at the time of the one before. 'DeviceHandle' and 'Source'
+	are not written.
+
+Arguments:
+
+	writer - Writer created with 'KeyboardReplayCreate'.
+
+	records - Records to append.
+
+	recordCount - Number of records.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardReplayAppend(IN PKEY_REPLAY_WRITER writer, IN PKEY_CAPTURE_RECORD records, IN ULONG recordCount);
+
+/*++
+
+Function Description:
+
+	Writes the last chunk, the index and the header of a replay and closes its file. The writer
+	is released even if writing fails.
+
+Arguments:
+
+	writer - Writer created with 'KeyboardReplayCreate'.
+
+
+Return Value:
+
+	TRUE if the whole replay was written,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardReplayFinish(IN PKEY_REPLAY_WRITER writer);
+
+/*++
+
+Function Description:
+
+	Maps a replay written by 'KeyboardReplayCreate' for reading it from the start. Only the header
+	and the index are read, chunks are mapped and decoded as reading reaches them.
+
+Arguments:
+
+	path - Path of the replay.
+
+	replay - Replay to set up.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE if the file can't be mapped, is not a keyboard replay or was not finished.
+
+--*/
+Public BOOL KeyboardReplayOpen(IN LPCWSTR path, OUT PKEY_REPLAY replay);
+
+/*++
+
+Function Description:
+
+	Moves a replay to the first record at or after a time. The chunk holding it is found by a
+	binary search of the index, only the records of that chunk before the time are decoded again.
+
+Arguments:
+
+	replay - Replay opened with 'KeyboardReplayOpen'.
+
+	time - Time in the units of the replay, as the timestamps of the records.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE if the chunk can't be mapped or is damaged.
+
+--*/
+Public BOOL KeyboardReplaySeek(IN PKEY_REPLAY replay, IN LONG64 time);
+
+/*++
+
+Function Description:
+
+	Reads the next records of a replay, with the time and the key they were recorded with.
+	'DeviceHandle' and 'Source' are set to 0.
+
+Arguments:
+
+	replay - Replay opened with 'KeyboardReplayOpen'.
+
+	records - Buffer which receives the records.
+
+	recordCount - Number of records the buffer can hold.
+
+
+Return Value:
+
+	Number of records read,
+	0 at the end of the replay or at a chunk that can't be read.
+
+--*/
+Public ULONG KeyboardReplayRead(IN PKEY_REPLAY replay, OUT PKEY_CAPTURE_RECORD records, IN ULONG recordCount);
+
+/*++
+
+Function Description:
+
+	Unmaps a replay and closes its file.
+
+Arguments:
+
+	replay - Replay opened with 'KeyboardReplayOpen'.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardReplayClose(IN PKEY_REPLAY replay);
+
+/*++
+
+Function Description:
+
+	Plays a recording back into the driver at the pace it was recorded at, see ReplayEngine.h.
+	Keys falling due together are injected in one call, and every key is scheduled from
+	the start of its pass on the performance counter, so late wakeups don't add up over a long
+	recording. Blocks until all passes are played or the stop event is signaled.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	path - Replay file written by 'KeyboardReplayCreate' or recording written by 'KeyboardRecorderOpen'.
+		A recording is decoded from its start to reach options->StartTime on every pass.
+
+	options - Speed, passes and batching of the playback.
+
+	stats - Optional, receives the keys and batches injected and how late they were in
+		performance counter ticks.
+
+
+Return Value:
+
+	TRUE if all passes were played or the playback was stopped,
+	FALSE if the file can't be read, the options are out of range or injecting failed.
+
+--*/
+Public BOOL KeyboardPlayRecording(IN HANDLE driverHandle, IN LPCWSTR path, IN PKEY_PLAYBACK_OPTIONS options, OUT OPTIONAL PEMU_REPLAY_STATS stats);
+
+/*++
+
+Function Description:
+
+	Sends a device IOCTL to the given keyboard without selecting it on the handle first. The
+	input is sent behind a 'KEY_DEVICE_HEADER' naming the keyboard, the handle keeps the
+	keyboard selected by 'KeyboardSetActiveDevice' for the other calls.
+
+Arguments:
+
+	driverHandle - Handle to the driver control object
+
+	deviceHandle - Handle of the target keyboard as returned by 'KeyboardGetDeviceHandles'.
+
+	ioControlCode - One of the device IOCTLs, e.g. 'IOCTL_KEYBOARD_SET_FILTER' or 'IOCTL_KEYBOARD_INSERT_KEY'.
+
+	inputBuffer - Input of the IOCTL as it would be sent without a header, may be NULL.
+
+	inputSize - Size of the input in bytes.
+
+	outputBuffer - Output buffer of the IOCTL, may be NULL.
+
+	outputSize - Size of the output buffer in bytes.
+
+	bytesReturned - Receives the number of bytes the driver returned, may be NULL.
+
+
+Return Value:
+
+	TRUE if successful,
+	FALSE otherwise.
+
+--*/
+Public BOOL KeyboardDeviceIoControl(IN HANDLE driverHandle, IN ULONG deviceHandle, IN DWORD ioControlCode, IN LPVOID inputBuffer, IN DWORD inputSize, OUT LPVOID outputBuffer, IN DWORD outputSize, OUT LPDWORD bytesReturned);
 
 #ifdef __cplusplus
 }
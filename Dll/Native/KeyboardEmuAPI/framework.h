@@ -7,3 +7,4 @@
 // Windows Header Files
 #include <windows.h>
 #include <ntddkbd.h>
+#include <ntddmou.h>
@@ -3,13 +3,14 @@
 #include "MouseEmuAPI.h"
 
 
-HANDLE CreateDriverHandle(void) {
+static PVOID OpenDevice(PVOID context, ULONG flags) {
+	UNREFERENCED_PARAMETER(context);
 	HANDLE file = CreateFileW(L"\\\\.\\MouseEmulator",
 		GENERIC_READ | FILE_GENERIC_WRITE,
 		FILE_SHARE_READ,
 		NULL, // no SECURITY_ATTRIBUTES structure
 		OPEN_EXISTING, // No special create flags
-		0, // No special attributes
+		(flags & EMU_TRANSPORT_OVERLAPPED) ? FILE_FLAG_OVERLAPPED : 0, // capture requests stay pending
 		NULL);
 	if (INVALID_HANDLE_VALUE == file) {
 
@@ -18,10 +19,52 @@ HANDLE CreateDriverHandle(void) {
 	return file;
 }
 
+static ULONG IoControlDevice(PVOID context, PVOID handle, ULONG ioControlCode, PVOID input, ULONG inputSize, PVOID output, ULONG outputSize, PULONG bytesReturned, PVOID overlapped) {
+	UNREFERENCED_PARAMETER(context);
+	DWORD returned = 0;
+	BOOL result = DeviceIoControl((HANDLE)handle, ioControlCode, input, inputSize, output, outputSize, &returned, (LPOVERLAPPED)overlapped);
+	*bytesReturned = returned;
+	return result ? ERROR_SUCCESS : GetLastError();
+}
+
+static VOID CloseDevice(PVOID context, PVOID handle) {
+	UNREFERENCED_PARAMETER(context);
+	CloseHandle((HANDLE)handle);
+}
+
+static const EMU_TRANSPORT DeviceTransport = { NULL, OpenDevice, IoControlDevice, CloseDevice };
+
+//every handle is opened and every request is sent through it
+static EMU_TRANSPORT Transport = DeviceTransport;
+
+static BOOL DriverIoControl(IN HANDLE driverHandle, IN DWORD ioControlCode, IN LPVOID inputBuffer, IN DWORD inputSize, OUT LPVOID outputBuffer, IN DWORD outputSize, OUT LPDWORD bytesReturned, IN LPOVERLAPPED overlapped) {
+	ULONG returned = 0;
+	ULONG error = Transport.IoControl(Transport.Context, driverHandle, ioControlCode, inputBuffer, inputSize, outputBuffer, outputSize, &returned, overlapped);
+	if (bytesReturned)
+		*bytesReturned = returned;
+	SetLastError(error);
+	return error == ERROR_SUCCESS;
+}
+
+BOOL MouseSetTransport(IN const EMU_TRANSPORT* transport) {
+	if (!transport) {
+		Transport = DeviceTransport;
+		return TRUE;
+	}
+	if (!transport->Open || !transport->IoControl || !transport->Close)
+		return FALSE;
+	Transport = *transport;
+	return TRUE;
+}
+
+HANDLE CreateDriverHandle(void) {
+	return Transport.Open(Transport.Context, 0);
+}
+
 void DisposeHandle(HANDLE driverHandle) {
 	if (driverHandle != INVALID_HANDLE_VALUE)
 	{
-		CloseHandle(driverHandle);
+		Transport.Close(Transport.Context, driverHandle);
 	}
 }
 
@@ -29,7 +72,7 @@ BOOL MouseGetDevices(IN HANDLE driverHandle, OUT PMOUSE_QUERY_RESULT devices) {
 	if (!devices || driverHandle == INVALID_HANDLE_VALUE)
 		return FALSE;
 	DWORD bytesReturned = 0;
-	if (!DeviceIoControl(
+	if (!DriverIoControl(
 		driverHandle,
 		IOCTL_MOUSE_GET_DEVICE_ID,
 		NULL, 0,
@@ -46,7 +89,7 @@ BOOL MouseSetActiveDevice(IN HANDLE driverHandle, IN USHORT deviceId) {
 	if (driverHandle == INVALID_HANDLE_VALUE)
 		return FALSE;
 	DWORD bytesReturned = 0;
-	if (!DeviceIoControl(
+	if (!DriverIoControl(
 		driverHandle,
 		IOCTL_MOUSE_SET_DEVICE_ID,
 		&deviceId, sizeof(deviceId),
@@ -58,13 +101,46 @@ BOOL MouseSetActiveDevice(IN HANDLE driverHandle, IN USHORT deviceId) {
 	return TRUE;
 }
 
+BOOL MouseGetDeviceHandles(IN HANDLE driverHandle, OUT PMOUSE_DEVICE_INFO devices, IN ULONG capacity, OUT PULONG count) {
+	if (!devices || !count || capacity == 0 || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	BOOL result = DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_GET_DEVICES,
+		NULL, 0,
+		devices, capacity * sizeof(MOUSE_DEVICE_INFO),
+		&bytesReturned, NULL);
+	//a partial list comes back with ERROR_MORE_DATA
+	if (!result && GetLastError() != ERROR_MORE_DATA)
+		return FALSE;
+	*count = bytesReturned / sizeof(MOUSE_DEVICE_INFO);
+	return result;
+}
+
+BOOL MouseSetActiveDeviceHandle(IN HANDLE driverHandle, IN ULONG deviceHandle) {
+	if (driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_SET_DEVICE_HANDLE,
+		&deviceHandle, sizeof(deviceHandle),
+		NULL, 0,
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 BOOL MouseSetFilterMode(IN HANDLE driverHandle, IN MOUSE_FILTER_MODE filterMode)
 {
 	if (driverHandle == INVALID_HANDLE_VALUE)
 		return FALSE;
 	DWORD bytesReturned = 0;
 	USHORT filterCode = (USHORT)filterMode;
-	if (!DeviceIoControl(
+	if (!DriverIoControl(
 		driverHandle,
 		IOCTL_MOUSE_SET_FILTER,
 		&filterCode, sizeof(USHORT),
@@ -77,23 +153,64 @@ BOOL MouseSetFilterMode(IN HANDLE driverHandle, IN MOUSE_FILTER_MODE filterMode)
 
 BOOL MouseGetFilterMode(IN HANDLE driverHandle, IN OUT PMOUSE_FILTER_MODE filterMode)
 {
-	if (driverHandle == INVALID_HANDLE_VALUE)
+	if (!filterMode || driverHandle == INVALID_HANDLE_VALUE)
 		return FALSE;
 
 	DWORD bytesReturned = 0;
+	USHORT mode = 0;
 
-	if (!DeviceIoControl(
+	//the driver reports the mode as a USHORT, the enum is wider
+	if (!DriverIoControl(
 		driverHandle,
 		IOCTL_MOUSE_GET_FILTER,
 		NULL, 0,
-		&filterMode, sizeof(USHORT),
+		&mode, sizeof(USHORT),
 		&bytesReturned, NULL)) {
 		return FALSE;
 	}
 
+	*filterMode = (MOUSE_FILTER_MODE)mode;
 	return TRUE;
 }
 
+//
+//Buffer a thread reuses to marshal its requests, grown to the largest one so far
+//and freed when the thread exits
+//
+typedef struct _SCRATCH_BUFFER {
+	PVOID Buffer;
+	SIZE_T Size;
+
+	~_SCRATCH_BUFFER() {
+		if (Buffer)
+			HeapFree(GetProcessHeap(), 0, Buffer);
+	}
+} SCRATCH_BUFFER, * PSCRATCH_BUFFER;
+
+//packs the request sent to the driver or receives its reply
+static thread_local SCRATCH_BUFFER RequestScratch;
+//holds the table an add or remove edits while the request scratch packs it
+static thread_local SCRATCH_BUFFER TableScratch;
+
+static PVOID ScratchBuffer(IN OUT PSCRATCH_BUFFER scratch, IN SIZE_T size) {
+	if (size > scratch->Size) {
+		//at least double, a table growing one entry per call reallocates only now and then
+		SIZE_T grown = max(size, max(2 * scratch->Size, (SIZE_T)256));
+		HANDLE processHeap = GetProcessHeap();
+		if (!processHeap)
+			return NULL;
+		//the contents are not kept, a fresh block avoids copying them
+		PVOID buffer = HeapAlloc(processHeap, 0, grown);
+		if (!buffer)
+			return NULL;
+		if (scratch->Buffer)
+			HeapFree(processHeap, 0, scratch->Buffer);
+		scratch->Buffer = buffer;
+		scratch->Size = grown;
+	}
+	return scratch->Buffer;
+}
+
 BOOL MouseSetModification(IN HANDLE driverHandle, IN PMOUSE_MODIFY_REQUEST modifyRequest)
 {
 	if (!modifyRequest || driverHandle == INVALID_HANDLE_VALUE)
@@ -101,7 +218,7 @@ BOOL MouseSetModification(IN HANDLE driverHandle, IN PMOUSE_MODIFY_REQUEST modif
 	DWORD bytesReturned = 0;
 	if (modifyRequest->ModifyCount == 0)
 	{
-		if (!DeviceIoControl(
+		if (!DriverIoControl(
 			driverHandle,
 			IOCTL_MOUSE_SET_MODIFY,
 			&modifyRequest->ModifyCount, sizeof(USHORT),
@@ -113,32 +230,17 @@ BOOL MouseSetModification(IN HANDLE driverHandle, IN PMOUSE_MODIFY_REQUEST modif
 		return TRUE;
 	}
 	DWORD requiredBytes = sizeof(USHORT) + modifyRequest->ModifyCount * sizeof(MOUSE_MODIFY_DATA);
-	HANDLE processHeap = GetProcessHeap();
-	if (!processHeap)
-		return FALSE;
-	PUSHORT p = (PUSHORT)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, requiredBytes);
+	PUSHORT p = (PUSHORT)ScratchBuffer(&RequestScratch, requiredBytes);
 	if (!p)
 		return FALSE;
 	p[0] = modifyRequest->ModifyCount;
-	PMOUSE_MODIFY_DATA modifyData = (PMOUSE_MODIFY_DATA)(&p[1]);
-	for (USHORT i = 0; i < modifyRequest->ModifyCount; i++)
-	{
-		modifyData[i] = modifyRequest->ModifyData[i];
-	}
-	if (!DeviceIoControl(
+	memcpy(&p[1], modifyRequest->ModifyData, modifyRequest->ModifyCount * sizeof(MOUSE_MODIFY_DATA));
+	return DriverIoControl(
 		driverHandle,
 		IOCTL_MOUSE_SET_MODIFY,
 		p, requiredBytes,
 		NULL, 0,
-		&bytesReturned, NULL))
-	{
-		HeapFree(processHeap, HEAP_ZERO_MEMORY, p);
-		CloseHandle(processHeap);
-		return FALSE;
-	}
-	HeapFree(processHeap, HEAP_ZERO_MEMORY, p);
-	CloseHandle(processHeap);
-	return TRUE;
+		&bytesReturned, NULL);
 }
 
 BOOL MouseGetModifications(IN HANDLE driverHandle, IN OUT PMOUSE_MODIFY_REQUEST modifyBuffer)
@@ -147,46 +249,26 @@ BOOL MouseGetModifications(IN HANDLE driverHandle, IN OUT PMOUSE_MODIFY_REQUEST
 		return FALSE;
 	DWORD bytesReturned = 0;
 	DWORD requiredBytes = sizeof(USHORT) + modifyBuffer->ModifyCount * sizeof(MOUSE_MODIFY_DATA);
-	HANDLE processHeap = GetProcessHeap();
-	if (!processHeap)
-		return FALSE;
-	PUSHORT buffer = (PUSHORT)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, requiredBytes);
+	PUSHORT buffer = (PUSHORT)ScratchBuffer(&RequestScratch, requiredBytes);
 	if (!buffer)
-	{
-		CloseHandle(processHeap);
 		return FALSE;
-	}
-	if (!DeviceIoControl(
+	if (!DriverIoControl(
 		driverHandle,
 		IOCTL_MOUSE_GET_MODIFY,
 		NULL, 0,
 		buffer, requiredBytes,
 		&bytesReturned, NULL))
 	{
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
 		return FALSE;
 	}
-	if (bytesReturned >= sizeof(USHORT)) {
-		modifyBuffer->ModifyCount = buffer[0];
-		bytesReturned -= sizeof(USHORT);
-		USHORT modifyCount = bytesReturned / sizeof(MOUSE_MODIFY_DATA);
-		if (modifyCount > 0) {
-			PMOUSE_MODIFY_DATA modifyData = (PMOUSE_MODIFY_DATA)(&buffer[1]);
-			for (USHORT i = 0; i < modifyCount; i++)
-			{
-				modifyBuffer->ModifyData[i] = modifyData[i];
-			}
-		}
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
-		return TRUE;
-	}
-	else {
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
+	if (bytesReturned < sizeof(USHORT))
 		return FALSE;
-	}
+	modifyBuffer->ModifyCount = buffer[0];
+	bytesReturned -= sizeof(USHORT);
+	USHORT modifyCount = bytesReturned / sizeof(MOUSE_MODIFY_DATA);
+	if (modifyCount > 0)
+		memcpy(modifyBuffer->ModifyData, &buffer[1], modifyCount * sizeof(MOUSE_MODIFY_DATA));
+	return TRUE;
 }
 
 BOOL MouseAddButtonModification(IN HANDLE driverHandle, IN PMOUSE_MODIFY_DATA modifyData)
@@ -209,15 +291,9 @@ BOOL MouseAddButtonModification(IN HANDLE driverHandle, IN PMOUSE_MODIFY_DATA mo
 	{
 		//add room for one more filter data
 		DWORD requiredBytes = (modifyCount + 1) * sizeof(MOUSE_MODIFY_DATA);
-		HANDLE processHeap = GetProcessHeap();
-		if (!processHeap)
-			return FALSE;
-		PMOUSE_MODIFY_DATA buffer = (PMOUSE_MODIFY_DATA)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, requiredBytes);
+		PMOUSE_MODIFY_DATA buffer = (PMOUSE_MODIFY_DATA)ScratchBuffer(&TableScratch, requiredBytes);
 		if (!buffer)
-		{
-			CloseHandle(processHeap);
 			return FALSE;
-		}
 		modifyBuffer.ModifyData = buffer;
 		//first get current filters
 		if (!MouseGetModifications(driverHandle, &modifyBuffer))
@@ -230,18 +306,13 @@ BOOL MouseAddButtonModification(IN HANDLE driverHandle, IN PMOUSE_MODIFY_DATA mo
 				modifyBuffer.ModifyData[i].ToState == modifyData->ToState)
 			{
 				//already exists
-				HeapFree(processHeap, 0, buffer);
-				CloseHandle(processHeap);
 				return TRUE;
 			}
 		}
 		//add the new one to the end
 		modifyBuffer.ModifyData[modifyCount] = *modifyData;
 		modifyBuffer.ModifyCount = modifyCount + 1;
-		BOOL result = MouseSetModification(driverHandle, &modifyBuffer);
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
-		return result;
+		return MouseSetModification(driverHandle, &modifyBuffer);
 	}
 }
 
@@ -262,15 +333,9 @@ BOOL MouseRemoveButtonModification(IN HANDLE driverHandle, IN PMOUSE_MODIFY_DATA
 	else
 	{
 		DWORD requiredBytes = modifyCount * sizeof(MOUSE_MODIFY_DATA);
-		HANDLE processHeap = GetProcessHeap();
-		if (!processHeap)
-			return FALSE;
-		PMOUSE_MODIFY_DATA buffer = (PMOUSE_MODIFY_DATA)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, requiredBytes);
+		PMOUSE_MODIFY_DATA buffer = (PMOUSE_MODIFY_DATA)ScratchBuffer(&TableScratch, requiredBytes);
 		if (!buffer)
-		{
-			CloseHandle(processHeap);
 			return FALSE;
-		}
 		modifyBuffer.ModifyData = buffer;
 		//first get current modifications
 		if (!MouseGetModifications(driverHandle, &modifyBuffer))
@@ -291,18 +356,308 @@ BOOL MouseRemoveButtonModification(IN HANDLE driverHandle, IN PMOUSE_MODIFY_DATA
 			}
 		}
 		modifyBuffer.ModifyCount = modifyCount;
-		BOOL result = MouseSetModification(driverHandle, &modifyBuffer);
-		HeapFree(processHeap, 0, buffer);
-		CloseHandle(processHeap);
-		return result;
+		return MouseSetModification(driverHandle, &modifyBuffer);
+	}
+}
+
+BOOL MouseGetRuleGeneration(IN HANDLE driverHandle, IN ULONG deviceHandle, OUT PULONG generation) {
+	if (!generation)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!MouseDeviceIoControl(driverHandle, deviceHandle, IOCTL_MOUSE_GET_GENERATION, NULL, 0, generation, sizeof(ULONG), &bytesReturned))
+		return FALSE;
+	return bytesReturned == sizeof(ULONG);
+}
+
+static ULONG64 ModifyCacheKey(IN const MOUSE_MODIFY_DATA* modifyData) {
+	return ((ULONG64)modifyData->FromState << 16) | modifyData->ToState;
+}
+
+static BOOL GrowCacheBuffer(IN OUT PVOID* buffer, IN SIZE_T size) {
+	HANDLE processHeap = GetProcessHeap();
+	if (!processHeap)
+		return FALSE;
+	PVOID grown = *buffer ? HeapReAlloc(processHeap, 0, *buffer, size) : HeapAlloc(processHeap, 0, size);
+	if (!grown)
+		return FALSE;
+	*buffer = grown;
+	return TRUE;
+}
+
+static VOID IndexCacheModifies(IN PMOUSE_RULE_CACHE cache) {
+	EmuEntrySetInitialize(&cache->ModifySet, cache->ModifySet.Slots, cache->ModifySet.Capacity);
+	//a key repeated in the table is found at its first entry, the later ones count as removed
+	for (ULONG i = 0; i < cache->ModifyCount; i++)
+	{
+		if (EmuEntrySetFind(&cache->ModifySet, ModifyCacheKey(&cache->Modifies[i])) == EMU_ENTRY_NONE)
+			EmuEntrySetInsert(&cache->ModifySet, ModifyCacheKey(&cache->Modifies[i]), i);
+	}
+}
+
+static BOOL GrowCacheSet(IN OUT PEMU_ENTRY_SET set, IN ULONG capacity) {
+	HANDLE processHeap = GetProcessHeap();
+	if (!processHeap)
+		return FALSE;
+	PEMU_ENTRY_SLOT slots = (PEMU_ENTRY_SLOT)HeapAlloc(processHeap, 0, EmuEntrySetSlots(capacity) * sizeof(EMU_ENTRY_SLOT));
+	if (!slots)
+		return FALSE;
+	//the keys are moved rather than indexed again, entries an edit removed stay removed
+	EMU_ENTRY_SET grown;
+	EmuEntrySetInitialize(&grown, slots, EmuEntrySetSlots(capacity));
+	if (set->Slots) {
+		EmuEntrySetMove(&grown, set);
+		HeapFree(processHeap, 0, set->Slots);
+	}
+	*set = grown;
+	return TRUE;
+}
+
+static BOOL ReserveCacheEntries(IN PMOUSE_RULE_CACHE cache, IN ULONG modifyCount) {
+	if (modifyCount > cache->ModifyCapacity) {
+		ULONG capacity = EmuEntrySetSlots(modifyCount) / 2;
+		if (!GrowCacheBuffer((PVOID*)&cache->Modifies, capacity * sizeof(MOUSE_MODIFY_DATA)) ||
+			!GrowCacheSet(&cache->ModifySet, capacity))
+			return FALSE;
+		cache->ModifyCapacity = capacity;
+	}
+	//room for the table behind the header and its count
+	DWORD uploadSize = sizeof(MOUSE_DEVICE_HEADER) + sizeof(USHORT) + cache->ModifyCapacity * sizeof(MOUSE_MODIFY_DATA);
+	if (uploadSize > cache->UploadSize) {
+		if (!GrowCacheBuffer((PVOID*)&cache->Upload, uploadSize))
+			return FALSE;
+		cache->UploadSize = uploadSize;
+	}
+	return TRUE;
+}
+
+static PUSHORT CacheTable(IN PMOUSE_RULE_CACHE cache) {
+	return (PUSHORT)(cache->Upload + sizeof(MOUSE_DEVICE_HEADER));
+}
+
+static BOOL CacheIoControl(IN PMOUSE_RULE_CACHE cache, IN DWORD ioControlCode, IN ULONG generation, IN DWORD tableSize, OUT LPVOID outputBuffer, IN DWORD outputSize, OUT LPDWORD bytesReturned) {
+	PMOUSE_DEVICE_HEADER header = (PMOUSE_DEVICE_HEADER)cache->Upload;
+	header->DeviceHandle = cache->DeviceHandle;
+	header->Generation = generation;
+	*bytesReturned = 0;
+	return DriverIoControl(
+		cache->DriverHandle,
+		IOCTL_MOUSE_TARGETED(ioControlCode),
+		header, sizeof(MOUSE_DEVICE_HEADER) + tableSize,
+		outputBuffer, outputSize,
+		bytesReturned, NULL);
+}
+
+static BOOL LoadRuleCache(IN PMOUSE_RULE_CACHE cache) {
+	cache->Generation = 0;
+	cache->ModifyCount = 0;
+	for (ULONG attempt = 0; attempt < MOUSE_RULE_CACHE_ATTEMPTS; attempt++)
+	{
+		DWORD bytesReturned = 0;
+		ULONG before = 0;
+		ULONG after = 0;
+		USHORT count = 0;
+		if (!CacheIoControl(cache, IOCTL_MOUSE_GET_GENERATION, 0, 0, &before, sizeof(ULONG), &bytesReturned) || bytesReturned != sizeof(ULONG))
+			return FALSE;
+		//the count first, so the table can be read in one go
+		if (!CacheIoControl(cache, IOCTL_MOUSE_GET_MODIFY, 0, 0, &count, sizeof(USHORT), &bytesReturned) || bytesReturned < sizeof(USHORT))
+			return FALSE;
+		if (!ReserveCacheEntries(cache, count))
+			return FALSE;
+
+		//the read is limited to the room of the table it fills
+		PUSHORT table = CacheTable(cache);
+		DWORD tableSize = sizeof(USHORT) + cache->ModifyCapacity * sizeof(MOUSE_MODIFY_DATA);
+		if (!CacheIoControl(cache, IOCTL_MOUSE_GET_MODIFY, 0, 0, table, tableSize, &bytesReturned) || bytesReturned < sizeof(USHORT))
+			return FALSE;
+		ULONG modifyCount = min((ULONG)table[0], (ULONG)((bytesReturned - sizeof(USHORT)) / sizeof(MOUSE_MODIFY_DATA)));
+		CopyMemory(cache->Modifies, &table[1], modifyCount * sizeof(MOUSE_MODIFY_DATA));
+
+		//the table is current only if nothing changed it while it was read
+		if (!CacheIoControl(cache, IOCTL_MOUSE_GET_GENERATION, 0, 0, &after, sizeof(ULONG), &bytesReturned) || bytesReturned != sizeof(ULONG))
+			return FALSE;
+		if (before == after) {
+			cache->ModifyCount = modifyCount;
+			IndexCacheModifies(cache);
+			cache->Generation = before;
+			return TRUE;
+		}
+	}
+	SetLastError(ERROR_REVISION_MISMATCH);
+	return FALSE;
+}
+
+static BOOL UploadCacheModifies(IN PMOUSE_RULE_CACHE cache, IN ULONG modifyCount) {
+	PUSHORT table = CacheTable(cache);
+	DWORD bytesReturned = 0;
+	ULONG committed = 0;
+	table[0] = (USHORT)modifyCount;
+	if (!CacheIoControl(cache, IOCTL_MOUSE_SET_MODIFY, cache->Generation, sizeof(USHORT) + modifyCount * sizeof(MOUSE_MODIFY_DATA), &committed, sizeof(ULONG), &bytesReturned))
+		return FALSE;
+	CopyMemory(cache->Modifies, &table[1], modifyCount * sizeof(MOUSE_MODIFY_DATA));
+	cache->ModifyCount = modifyCount;
+	IndexCacheModifies(cache);
+	//the generation the driver committed the tables under, without it the next edit reloads them
+	cache->Generation = bytesReturned == sizeof(ULONG) ? committed : 0;
+	return TRUE;
+}
+
+BOOL MouseRuleCacheOpen(IN HANDLE driverHandle, IN ULONG deviceHandle, OUT PMOUSE_RULE_CACHE cache) {
+	if (!cache || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	ZeroMemory(cache, sizeof(MOUSE_RULE_CACHE));
+	cache->DriverHandle = driverHandle;
+	cache->DeviceHandle = deviceHandle;
+	if (!ReserveCacheEntries(cache, 1) || !LoadRuleCache(cache)) {
+		MouseRuleCacheClose(cache);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL MouseCachedAddButtonModification(IN PMOUSE_RULE_CACHE cache, IN PMOUSE_MODIFY_DATA modifyData) {
+	if (!cache || !modifyData)
+		return FALSE;
+	for (ULONG attempt = 0; attempt < MOUSE_RULE_CACHE_ATTEMPTS; attempt++)
+	{
+		if (cache->Generation == 0 && !LoadRuleCache(cache))
+			return FALSE;
+		ULONG modifyCount = cache->ModifyCount;
+		if (EmuEntrySetFind(&cache->ModifySet, ModifyCacheKey(modifyData)) != EMU_ENTRY_NONE)
+			return TRUE;
+		if (modifyCount >= MAXUSHORT || !ReserveCacheEntries(cache, modifyCount + 1))
+			return FALSE;
+		PMOUSE_MODIFY_DATA table = (PMOUSE_MODIFY_DATA)&CacheTable(cache)[1];
+		CopyMemory(table, cache->Modifies, modifyCount * sizeof(MOUSE_MODIFY_DATA));
+		table[modifyCount] = *modifyData;
+		if (UploadCacheModifies(cache, modifyCount + 1))
+			return TRUE;
+		//read the table again, whatever the driver holds now
+		cache->Generation = 0;
+		if (GetLastError() != ERROR_REVISION_MISMATCH)
+			return FALSE;
+	}
+	return FALSE;
+}
+
+BOOL MouseCachedRemoveButtonModification(IN PMOUSE_RULE_CACHE cache, IN PMOUSE_MODIFY_DATA modifyData) {
+	if (!cache || !modifyData)
+		return FALSE;
+	ULONG64 key = ModifyCacheKey(modifyData);
+	for (ULONG attempt = 0; attempt < MOUSE_RULE_CACHE_ATTEMPTS; attempt++)
+	{
+		if (cache->Generation == 0 && !LoadRuleCache(cache))
+			return FALSE;
+		if (EmuEntrySetFind(&cache->ModifySet, key) == EMU_ENTRY_NONE)
+			return TRUE;
+		PMOUSE_MODIFY_DATA table = (PMOUSE_MODIFY_DATA)&CacheTable(cache)[1];
+		ULONG modifyCount = 0;
+		for (ULONG i = 0; i < cache->ModifyCount; i++)
+		{
+			if (ModifyCacheKey(&cache->Modifies[i]) != key)
+				table[modifyCount++] = cache->Modifies[i];
+		}
+		if (UploadCacheModifies(cache, modifyCount))
+			return TRUE;
+		//read the table again, whatever the driver holds now
+		cache->Generation = 0;
+		if (GetLastError() != ERROR_REVISION_MISMATCH)
+			return FALSE;
 	}
+	return FALSE;
+}
+
+BOOL MouseRuleCacheClose(IN PMOUSE_RULE_CACHE cache) {
+	if (!cache)
+		return FALSE;
+	HANDLE processHeap = GetProcessHeap();
+	if (!processHeap)
+		return FALSE;
+	if (cache->Modifies)
+		HeapFree(processHeap, 0, cache->Modifies);
+	if (cache->ModifySet.Slots)
+		HeapFree(processHeap, 0, cache->ModifySet.Slots);
+	if (cache->Upload)
+		HeapFree(processHeap, 0, cache->Upload);
+	ZeroMemory(cache, sizeof(MOUSE_RULE_CACHE));
+	return TRUE;
+}
+
+static VOID CompactCacheModifies(IN PMOUSE_RULE_CACHE cache) {
+	ULONG modifyCount = 0;
+	for (ULONG i = 0; i < cache->ModifyCount; i++)
+	{
+		if (EmuEntrySetFind(&cache->ModifySet, ModifyCacheKey(&cache->Modifies[i])) == i)
+			cache->Modifies[modifyCount++] = cache->Modifies[i];
+	}
+	if (modifyCount < cache->ModifyCount) {
+		cache->ModifyCount = modifyCount;
+		IndexCacheModifies(cache);
+	}
+}
+
+BOOL MouseBeginRuleEdit(IN HANDLE driverHandle, IN ULONG deviceHandle, OUT PMOUSE_RULE_EDIT edit) {
+	if (!edit)
+		return FALSE;
+	edit->Changed = FALSE;
+	return MouseRuleCacheOpen(driverHandle, deviceHandle, &edit->Tables);
+}
+
+BOOL MouseRuleEditAddModification(IN PMOUSE_RULE_EDIT edit, IN PMOUSE_MODIFY_DATA modifyData) {
+	if (!edit || !modifyData)
+		return FALSE;
+	PMOUSE_RULE_CACHE tables = &edit->Tables;
+	ULONG64 key = ModifyCacheKey(modifyData);
+	if (EmuEntrySetFind(&tables->ModifySet, key) != EMU_ENTRY_NONE)
+		return TRUE;
+	if (tables->ModifySet.Count >= MAXUSHORT)
+		return FALSE;
+	//reuse the room of removed modifications before growing
+	if (tables->ModifyCount == tables->ModifyCapacity)
+		CompactCacheModifies(tables);
+	if (!ReserveCacheEntries(tables, tables->ModifyCount + 1))
+		return FALSE;
+	tables->Modifies[tables->ModifyCount] = *modifyData;
+	EmuEntrySetInsert(&tables->ModifySet, key, tables->ModifyCount);
+	tables->ModifyCount++;
+	edit->Changed = TRUE;
+	return TRUE;
+}
+
+BOOL MouseRuleEditRemoveModification(IN PMOUSE_RULE_EDIT edit, IN PMOUSE_MODIFY_DATA modifyData) {
+	if (!edit || !modifyData)
+		return FALSE;
+	//the entry stays in Modifies until the commit, the set no longer finds it there
+	if (EmuEntrySetRemove(&edit->Tables.ModifySet, ModifyCacheKey(modifyData)) != EMU_ENTRY_NONE)
+		edit->Changed = TRUE;
+	return TRUE;
+}
+
+BOOL MouseCommitRuleEdit(IN PMOUSE_RULE_EDIT edit) {
+	if (!edit)
+		return FALSE;
+	if (!edit->Changed)
+		return TRUE;
+	PMOUSE_RULE_CACHE tables = &edit->Tables;
+	CompactCacheModifies(tables);
+	CopyMemory(&CacheTable(tables)[1], tables->Modifies, tables->ModifyCount * sizeof(MOUSE_MODIFY_DATA));
+	if (!UploadCacheModifies(tables, tables->ModifyCount))
+		return FALSE;
+	edit->Changed = FALSE;
+	return TRUE;
+}
+
+BOOL MouseEndRuleEdit(IN PMOUSE_RULE_EDIT edit) {
+	if (!edit)
+		return FALSE;
+	edit->Changed = FALSE;
+	return MouseRuleCacheClose(&edit->Tables);
 }
 
 BOOL MouseInsertInputs(IN HANDLE driverHandle, IN PMOUSE_INPUT_DATA inputDatas, IN ULONG inputCount) {
 	if (!inputDatas || driverHandle == INVALID_HANDLE_VALUE || inputCount == 0)
 		return FALSE;
 	DWORD bytesReturned = 0;
-	if (!DeviceIoControl(
+	if (!DriverIoControl(
 		driverHandle,
 		IOCTL_MOUSE_INSERT_KEY,
 		inputDatas, inputCount * sizeof(MOUSE_INPUT_DATA),
@@ -314,11 +669,115 @@ BOOL MouseInsertInputs(IN HANDLE driverHandle, IN PMOUSE_INPUT_DATA inputDatas,
 	return TRUE;
 }
 
+static BOOL InsertSlotDone(IN PMOUSE_INSERT_QUEUE queue, IN PMOUSE_INSERT_SLOT slot, IN BOOL wait) {
+	if (slot->Error != ERROR_IO_PENDING)
+		return TRUE;
+	DWORD bytesReturned = 0;
+	if (GetOverlappedResult(queue->DriverHandle, &slot->Overlapped, &bytesReturned, wait))
+		slot->Error = ERROR_SUCCESS;
+	else if (GetLastError() != ERROR_IO_INCOMPLETE)
+		slot->Error = GetLastError();
+	return slot->Error != ERROR_IO_PENDING;
+}
+
+BOOL MouseInsertQueueOpen(IN HANDLE driverHandle, IN ULONG depth, IN OPTIONAL PMOUSE_INSERT_COMPLETION completion, OUT PMOUSE_INSERT_QUEUE queue) {
+	if (!queue || driverHandle == INVALID_HANDLE_VALUE || depth == 0 || depth > MOUSE_INSERT_DEPTH_MAX)
+		return FALSE;
+	ZeroMemory(queue, sizeof(MOUSE_INSERT_QUEUE));
+	queue->DriverHandle = driverHandle;
+	queue->Completion = completion;
+	queue->Depth = depth;
+	for (ULONG i = 0; i < depth; i++)
+	{
+		//manual reset, GetOverlappedResult waits on the event of its own insert
+		queue->Slots[i].Overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (!queue->Slots[i].Overlapped.hEvent) {
+			MouseInsertQueueClose(queue);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+BOOL MouseInsertInputsAsync(IN PMOUSE_INSERT_QUEUE queue, IN PMOUSE_INPUT_DATA inputs, IN ULONG inputCount, IN OPTIONAL PVOID context) {
+	if (!queue || !inputs || inputCount == 0)
+		return FALSE;
+	if (queue->Count == queue->Depth)
+		MouseInsertQueueComplete(queue, TRUE);
+	PMOUSE_INSERT_SLOT slot = &queue->Slots[(queue->Head + queue->Count) % queue->Depth];
+	if (inputCount > slot->Capacity) {
+		//the slots keep their buffers, steady inserts of the same size do not allocate
+		if (!GrowCacheBuffer((PVOID*)&slot->Inputs, inputCount * sizeof(MOUSE_INPUT_DATA)))
+			return FALSE;
+		slot->Capacity = inputCount;
+	}
+	CopyMemory(slot->Inputs, inputs, inputCount * sizeof(MOUSE_INPUT_DATA));
+	slot->InputCount = inputCount;
+	slot->Context = context;
+	HANDLE event = slot->Overlapped.hEvent;
+	ZeroMemory(&slot->Overlapped, sizeof(OVERLAPPED));
+	slot->Overlapped.hEvent = event;
+	if (DriverIoControl(
+		queue->DriverHandle,
+		IOCTL_MOUSE_INSERT_KEY,
+		slot->Inputs, inputCount * sizeof(MOUSE_INPUT_DATA),
+		NULL, 0,
+		NULL, &slot->Overlapped)) {
+		slot->Error = ERROR_SUCCESS;
+	}
+	else if (GetLastError() == ERROR_IO_PENDING) {
+		slot->Error = ERROR_IO_PENDING;
+	}
+	else {
+		return FALSE;
+	}
+	queue->Count++;
+	return TRUE;
+}
+
+ULONG MouseInsertQueueComplete(IN PMOUSE_INSERT_QUEUE queue, IN BOOL wait) {
+	if (!queue)
+		return 0;
+	ULONG reported = 0;
+	while (queue->Count > 0)
+	{
+		PMOUSE_INSERT_SLOT slot = &queue->Slots[queue->Head];
+		//only the first insert is waited for, the ones after it are reported if already done
+		if (!InsertSlotDone(queue, slot, wait && reported == 0))
+			break;
+		queue->Head = (queue->Head + 1) % queue->Depth;
+		queue->Count--;
+		reported++;
+		if (queue->Completion)
+			queue->Completion(slot->Context, slot->Error, slot->InputCount);
+	}
+	return reported;
+}
+
+BOOL MouseInsertQueueClose(IN PMOUSE_INSERT_QUEUE queue) {
+	if (!queue)
+		return FALSE;
+	while (queue->Count > 0)
+	{
+		MouseInsertQueueComplete(queue, TRUE);
+	}
+	HANDLE processHeap = GetProcessHeap();
+	for (ULONG i = 0; i < queue->Depth; i++)
+	{
+		if (queue->Slots[i].Overlapped.hEvent)
+			CloseHandle(queue->Slots[i].Overlapped.hEvent);
+		if (queue->Slots[i].Inputs && processHeap)
+			HeapFree(processHeap, 0, queue->Slots[i].Inputs);
+	}
+	ZeroMemory(queue, sizeof(MOUSE_INSERT_QUEUE));
+	return TRUE;
+}
+
 BOOL MouseDetectDeviceId(IN HANDLE driverHandle, OUT PUSHORT deviceId) {
 	if (driverHandle == INVALID_HANDLE_VALUE)
 		return FALSE;
 	DWORD bytesReturned = 0;
-	if (!DeviceIoControl(
+	if (!DriverIoControl(
 		driverHandle,
 		IOCTL_MOUSE_DETECT_DEVICE_ID,
 		NULL, 0,
@@ -331,11 +790,29 @@ BOOL MouseDetectDeviceId(IN HANDLE driverHandle, OUT PUSHORT deviceId) {
 	return TRUE;
 }
 
+BOOL MouseDetectDevice(IN HANDLE driverHandle, IN ULONG timeout, OUT PMOUSE_DETECT_RESULT result, IN LPOVERLAPPED overlapped) {
+	if (!result || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	MOUSE_DETECT_REQUEST detectRequest = { timeout };
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_DETECT_DEVICE_ID,
+		&detectRequest, sizeof(MOUSE_DETECT_REQUEST),
+		result, sizeof(MOUSE_DETECT_RESULT),
+		overlapped ? NULL : &bytesReturned, overlapped)) {
+		return overlapped && GetLastError() == ERROR_IO_PENDING;
+	}
+	if (!overlapped && bytesReturned != sizeof(MOUSE_DETECT_RESULT))
+		return FALSE;
+	return TRUE;
+}
+
 BOOL MouseGetAttributes(IN HANDLE driverHandle, OUT PMOUSE_ATTRIBUTES attributes) {
 	if (!attributes || driverHandle == INVALID_HANDLE_VALUE)
 		return FALSE;
 	DWORD bytesReturned = 0;
-	if (!DeviceIoControl(
+	if (!DriverIoControl(
 		driverHandle,
 		IOCTL_MOUSE_GET_ATTRIBUTES,
 		NULL, 0,
@@ -346,4 +823,904 @@ BOOL MouseGetAttributes(IN HANDLE driverHandle, OUT PMOUSE_ATTRIBUTES attributes
 	if (bytesReturned != sizeof(MOUSE_ATTRIBUTES))
 		return FALSE;
 	return TRUE;
+}
+
+BOOL MouseSetAbsoluteMapping(IN HANDLE driverHandle, IN PMOUSE_ABSOLUTE_MAP absoluteMap) {
+	if (!absoluteMap || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_SET_ABSOLUTE_MAP,
+		absoluteMap, sizeof(MOUSE_ABSOLUTE_MAP),
+		NULL, 0,
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL MouseGetAbsoluteMapping(IN HANDLE driverHandle, OUT PMOUSE_ABSOLUTE_MAP absoluteMap) {
+	if (!absoluteMap || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_GET_ABSOLUTE_MAP,
+		NULL, 0,
+		absoluteMap, sizeof(MOUSE_ABSOLUTE_MAP),
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+	if (bytesReturned != sizeof(MOUSE_ABSOLUTE_MAP))
+		return FALSE;
+	return TRUE;
+}
+
+BOOL MouseSetAutofire(IN HANDLE driverHandle, IN PMOUSE_AUTOFIRE_DATA autofireData) {
+	if (!autofireData || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_SET_AUTOFIRE,
+		autofireData, sizeof(MOUSE_AUTOFIRE_DATA),
+		NULL, 0,
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL MouseGetAutofire(IN HANDLE driverHandle, OUT PMOUSE_AUTOFIRE_DATA autofireData) {
+	if (!autofireData || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_GET_AUTOFIRE,
+		NULL, 0,
+		autofireData, sizeof(MOUSE_AUTOFIRE_DATA),
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+	if (bytesReturned != sizeof(MOUSE_AUTOFIRE_DATA))
+		return FALSE;
+	return TRUE;
+}
+
+BOOL MouseSetRules(IN HANDLE driverHandle, IN PEMU_RULE_REQUEST ruleRequest)
+{
+	if (!ruleRequest || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (ruleRequest->RuleCount == 0)
+	{
+		return DriverIoControl(
+			driverHandle,
+			IOCTL_MOUSE_SET_RULES,
+			&ruleRequest->RuleCount, sizeof(USHORT),
+			NULL, 0,
+			&bytesReturned, NULL);
+	}
+	DWORD requiredBytes = sizeof(USHORT) + ruleRequest->RuleCount * sizeof(EMU_RULE);
+	PUSHORT p = (PUSHORT)ScratchBuffer(&RequestScratch, requiredBytes);
+	if (!p)
+		return FALSE;
+	p[0] = ruleRequest->RuleCount;
+	memcpy(&p[1], ruleRequest->Rules, ruleRequest->RuleCount * sizeof(EMU_RULE));
+	return DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_SET_RULES,
+		p, requiredBytes,
+		NULL, 0,
+		&bytesReturned, NULL);
+}
+
+BOOL MouseBroadcastRules(IN HANDLE driverHandle, IN const ULONG* deviceHandles, IN ULONG deviceCount, IN PEMU_RULE_REQUEST ruleRequest)
+{
+	if (!ruleRequest || (ruleRequest->RuleCount > 0 && !ruleRequest->Rules) || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	if (!deviceHandles)
+		deviceCount = 0;
+	else if (deviceCount == 0)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	DWORD handleBytes = deviceCount * sizeof(ULONG);
+	DWORD requiredBytes = FIELD_OFFSET(MOUSE_RULE_BROADCAST, DeviceHandles) + handleBytes + sizeof(USHORT) + ruleRequest->RuleCount * sizeof(EMU_RULE);
+	PMOUSE_RULE_BROADCAST broadcast = (PMOUSE_RULE_BROADCAST)ScratchBuffer(&RequestScratch, requiredBytes);
+	if (!broadcast)
+		return FALSE;
+	broadcast->DeviceCount = deviceHandles ? deviceCount : MOUSE_ALL_DEVICES;
+	if (handleBytes > 0)
+		memcpy(broadcast->DeviceHandles, deviceHandles, handleBytes);
+	PUCHAR rules = (PUCHAR)broadcast + FIELD_OFFSET(MOUSE_RULE_BROADCAST, DeviceHandles) + handleBytes;
+	memcpy(rules, &ruleRequest->RuleCount, sizeof(USHORT));
+	if (ruleRequest->RuleCount > 0)
+		memcpy(rules + sizeof(USHORT), ruleRequest->Rules, ruleRequest->RuleCount * sizeof(EMU_RULE));
+	return DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_BROADCAST_RULES,
+		broadcast, requiredBytes,
+		NULL, 0,
+		&bytesReturned, NULL);
+}
+
+BOOL MouseGetRules(IN HANDLE driverHandle, IN OUT PEMU_RULE_REQUEST ruleBuffer)
+{
+	if (!ruleBuffer || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	DWORD requiredBytes = sizeof(USHORT) + ruleBuffer->RuleCount * sizeof(EMU_RULE);
+	PUSHORT buffer = (PUSHORT)ScratchBuffer(&RequestScratch, requiredBytes);
+	if (!buffer)
+		return FALSE;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_GET_RULES,
+		NULL, 0,
+		buffer, requiredBytes,
+		&bytesReturned, NULL) || bytesReturned < sizeof(USHORT))
+		return FALSE;
+	ruleBuffer->RuleCount = buffer[0];
+	USHORT ruleCount = (USHORT)((bytesReturned - sizeof(USHORT)) / sizeof(EMU_RULE));
+	if (ruleCount > 0)
+		memcpy(ruleBuffer->Rules, &buffer[1], ruleCount * sizeof(EMU_RULE));
+	return TRUE;
+}
+
+BOOL MouseSetProfile(IN HANDLE driverHandle, IN PMOUSE_PROFILE_DATA profileData) {
+	if (!profileData || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_SET_PROFILE,
+		profileData, sizeof(MOUSE_PROFILE_DATA),
+		NULL, 0,
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL MouseGetProfile(IN HANDLE driverHandle, OUT PMOUSE_PROFILE_DATA profileData) {
+	if (!profileData || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_GET_PROFILE,
+		NULL, 0,
+		profileData, sizeof(MOUSE_PROFILE_DATA),
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+	if (bytesReturned != sizeof(MOUSE_PROFILE_DATA))
+		return FALSE;
+	return TRUE;
+}
+
+BOOL MouseSwitchProfile(IN HANDLE driverHandle, IN USHORT profileIndex) {
+	if (driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_SWITCH_PROFILE,
+		&profileIndex, sizeof(USHORT),
+		NULL, 0,
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL MouseSaveProfiles(IN HANDLE driverHandle) {
+	if (driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_SAVE_IMAGE,
+		NULL, 0,
+		NULL, 0,
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+HANDLE CreateCaptureHandle(void) {
+	return Transport.Open(Transport.Context, EMU_TRANSPORT_OVERLAPPED);
+}
+
+BOOL MouseSetCapture(IN HANDLE driverHandle, IN PMOUSE_CAPTURE_CONFIG captureConfig) {
+	if (!captureConfig || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_SET_CAPTURE,
+		captureConfig, sizeof(MOUSE_CAPTURE_CONFIG),
+		NULL, 0,
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL MouseGetCapture(IN HANDLE driverHandle, OUT PMOUSE_CAPTURE_CONFIG captureConfig) {
+	if (!captureConfig || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_GET_CAPTURE,
+		NULL, 0,
+		captureConfig, sizeof(MOUSE_CAPTURE_CONFIG),
+		&bytesReturned, NULL)) {
+		return FALSE;
+	}
+	if (bytesReturned != sizeof(MOUSE_CAPTURE_CONFIG))
+		return FALSE;
+	return TRUE;
+}
+
+BOOL MouseCapture(IN HANDLE captureHandle, OUT PMOUSE_CAPTURE_RECORD records, IN ULONG recordCount, IN LPOVERLAPPED overlapped) {
+	if (!records || recordCount == 0 || !overlapped || captureHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	if (!DriverIoControl(
+		captureHandle,
+		IOCTL_MOUSE_CAPTURE,
+		NULL, 0,
+		records, recordCount * sizeof(MOUSE_CAPTURE_RECORD),
+		NULL, overlapped)) {
+		return GetLastError() == ERROR_IO_PENDING;
+	}
+
+	return TRUE;
+}
+
+BOOL MouseOpenCaptureRing(IN HANDLE driverHandle, OUT PMOUSE_CAPTURE_READER reader) {
+	if (!reader || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	MOUSE_CAPTURE_RING_REQUEST ringRequest;
+	MOUSE_CAPTURE_RING_MAPPING ringMapping;
+	DWORD bytesReturned = 0;
+	reader->Event = CreateEventW(NULL, FALSE, FALSE, NULL);
+	if (reader->Event == NULL)
+		return FALSE;
+	ringRequest.EventHandle = (ULONG64)(ULONG_PTR)reader->Event;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_MAP_CAPTURE_RING,
+		&ringRequest, sizeof(MOUSE_CAPTURE_RING_REQUEST),
+		&ringMapping, sizeof(MOUSE_CAPTURE_RING_MAPPING),
+		&bytesReturned, NULL) || bytesReturned != sizeof(MOUSE_CAPTURE_RING_MAPPING)) {
+		CloseHandle(reader->Event);
+		reader->Event = NULL;
+		return FALSE;
+	}
+	reader->ReaderIndex = ringMapping.ReaderIndex;
+	if (!EmuRingAttach(&reader->Ring, (const VOID*)(ULONG_PTR)ringMapping.Address, ringMapping.Size,
+		(volatile LONG*)(ULONG_PTR)ringMapping.WaitAddress)) {
+		DriverIoControl(driverHandle, IOCTL_MOUSE_UNMAP_CAPTURE_RING, NULL, 0, NULL, 0, &bytesReturned, NULL);
+		CloseHandle(reader->Event);
+		reader->Event = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+ULONG MouseReadCaptureRing(IN PMOUSE_CAPTURE_READER reader, OUT PMOUSE_CAPTURE_RECORD records, IN ULONG recordCount, IN DWORD timeout) {
+	if (!reader || !records || recordCount == 0 || reader->Event == NULL)
+		return 0;
+	for (;;) {
+		ULONG count = 0;
+		while (count < recordCount && EmuRingRead(&reader->Ring, &records[count]))
+			count++;
+		if (count > 0)
+			return count;
+		//the ring ran dry, block until the driver publishes the next packet
+		if (EmuRingPrepareWait(&reader->Ring, reader->ReaderIndex) &&
+			WaitForSingleObject(reader->Event, timeout) != WAIT_OBJECT_0)
+			return 0;
+	}
+}
+
+BOOL MouseCloseCaptureRing(IN HANDLE driverHandle, IN PMOUSE_CAPTURE_READER reader) {
+	if (!reader || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	BOOL result = DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_UNMAP_CAPTURE_RING,
+		NULL, 0,
+		NULL, 0,
+		&bytesReturned, NULL);
+	if (reader->Event != NULL)
+		CloseHandle(reader->Event);
+	ZeroMemory(reader, sizeof(MOUSE_CAPTURE_READER));
+	return result;
+}
+
+BOOL MouseGetStats(IN HANDLE driverHandle, OUT PMOUSE_STATS stats, IN ULONG size) {
+	if (!stats || size < FIELD_OFFSET(MOUSE_STATS, RuleHits) || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	return DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_GET_STATS,
+		NULL, 0,
+		stats, size,
+		&bytesReturned, NULL);
+}
+
+BOOL MouseSetStats(IN HANDLE driverHandle, IN PMOUSE_STATS_CONFIG config) {
+	if (!config || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	return DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_SET_STATS,
+		config, sizeof(MOUSE_STATS_CONFIG),
+		NULL, 0,
+		&bytesReturned, NULL);
+}
+
+BOOL MouseGetLatency(IN HANDLE driverHandle, IN BOOL reset, OUT PMOUSE_LATENCY latency) {
+	if (!latency || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	MOUSE_LATENCY_REQUEST request;
+	request.Flags = reset ? MOUSE_LATENCY_RESET : 0;
+	return DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_GET_LATENCY,
+		&request, sizeof(MOUSE_LATENCY_REQUEST),
+		latency, sizeof(MOUSE_LATENCY),
+		&bytesReturned, NULL);
+}
+
+BOOL MouseSetTrace(IN HANDLE driverHandle, IN BOOL enable) {
+	if (driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	MOUSE_TRACE_CONFIG config;
+	config.Flags = enable ? MOUSE_TRACE_ENABLE : 0;
+	return DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_SET_TRACE,
+		&config, sizeof(MOUSE_TRACE_CONFIG),
+		NULL, 0,
+		&bytesReturned, NULL);
+}
+
+BOOL MouseReadTrace(IN HANDLE driverHandle, OUT PVOID buffer, IN ULONG size, OUT PULONG bytesRead) {
+	if (!buffer || !bytesRead || size < sizeof(EMU_TRACE_DUMP) || driverHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD bytesReturned = 0;
+	if (!DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_READ_TRACE,
+		NULL, 0,
+		buffer, size,
+		&bytesReturned, NULL))
+		return FALSE;
+	*bytesRead = bytesReturned;
+	return TRUE;
+}
+
+BOOL MouseRecorderOpen(IN LPCWSTR path, IN LONG64 frequency, OUT PMOUSE_RECORDER recorder) {
+	if (!path || !recorder || frequency <= 0)
+		return FALSE;
+	recorder->File = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (recorder->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	EmuRecReset(&recorder->State, 0);
+	recorder->Used = EmuRecWriteHeader(recorder->Buffer, EMU_REC_MOUSE, frequency);
+	return TRUE;
+}
+
+BOOL MouseRecorderWrite(IN PMOUSE_RECORDER recorder, IN PMOUSE_CAPTURE_RECORD records, IN ULONG recordCount) {
+	if (!recorder || recorder->File == INVALID_HANDLE_VALUE || (recordCount > 0 && !records))
+		return FALSE;
+	for (ULONG i = 0; i < recordCount; i++) {
+		if (recorder->Used > MOUSE_RECORDING_BUFFER - EMU_REC_MAX_EVENT) {
+			DWORD written = 0;
+			if (!WriteFile(recorder->File, recorder->Buffer, recorder->Used, &written, NULL) || written != recorder->Used)
+				return FALSE;
+			recorder->Used = 0;
+		}
+		recorder->Used += EmuRecEncodeMouse(&recorder->State, records[i].Timestamp, &records[i].Input, recorder->Buffer + recorder->Used);
+	}
+	return TRUE;
+}
+
+BOOL MouseRecorderClose(IN PMOUSE_RECORDER recorder) {
+	if (!recorder || recorder->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD written = 0;
+	BOOL result = recorder->Used == 0 ||
+		(WriteFile(recorder->File, recorder->Buffer, recorder->Used, &written, NULL) && written == recorder->Used);
+	if (!CloseHandle(recorder->File))
+		result = FALSE;
+	recorder->File = INVALID_HANDLE_VALUE;
+	recorder->Used = 0;
+	return result;
+}
+
+BOOL MousePlayerOpen(IN LPCWSTR path, OUT PMOUSE_PLAYER player) {
+	if (!path || !player)
+		return FALSE;
+	player->File = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (player->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	EMU_REC_HEADER header;
+	DWORD bytesRead = 0;
+	if (!ReadFile(player->File, &header, sizeof(header), &bytesRead, NULL) ||
+		!EmuRecReadHeader(&header, bytesRead, EMU_REC_MOUSE, &header)) {
+		CloseHandle(player->File);
+		player->File = INVALID_HANDLE_VALUE;
+		return FALSE;
+	}
+	EmuRecReset(&player->State, 0);
+	player->Frequency = header.Frequency;
+	player->Offset = 0;
+	player->Filled = 0;
+	player->EndOfFile = FALSE;
+	return TRUE;
+}
+
+ULONG MousePlayerRead(IN PMOUSE_PLAYER player, OUT PMOUSE_CAPTURE_RECORD records, IN ULONG recordCount) {
+	if (!player || !records || player->File == INVALID_HANDLE_VALUE)
+		return 0;
+	ULONG count = 0;
+	while (count < recordCount) {
+		//keep a whole event in the buffer unless the file ends before
+		if (!player->EndOfFile && player->Filled - player->Offset < EMU_REC_MAX_EVENT) {
+			DWORD bytesRead = 0;
+			MoveMemory(player->Buffer, player->Buffer + player->Offset, player->Filled - player->Offset);
+			player->Filled -= player->Offset;
+			player->Offset = 0;
+			if (!ReadFile(player->File, player->Buffer + player->Filled, MOUSE_RECORDING_BUFFER - player->Filled, &bytesRead, NULL))
+				break;
+			player->Filled += bytesRead;
+			player->EndOfFile = bytesRead == 0;
+		}
+		const UCHAR* cursor = player->Buffer + player->Offset;
+		ZeroMemory(&records[count], sizeof(MOUSE_CAPTURE_RECORD));
+		if (!EmuRecDecodeMouse(&player->State, &cursor, player->Buffer + player->Filled, &records[count].Timestamp, &records[count].Input))
+			break;
+		player->Offset = (ULONG)(cursor - player->Buffer);
+		count++;
+	}
+	return count;
+}
+
+BOOL MousePlayerClose(IN PMOUSE_PLAYER player) {
+	if (!player || player->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	BOOL result = CloseHandle(player->File);
+	player->File = INVALID_HANDLE_VALUE;
+	return result;
+}
+
+static BOOL WriteReplay(IN HANDLE file, IN const VOID* buffer, IN DWORD size) {
+	DWORD written = 0;
+	return WriteFile(file, buffer, size, &written, NULL) && written == size;
+}
+
+static BOOL WriteReplayChunk(IN PMOUSE_REPLAY_WRITER writer) {
+	if (writer->Chunk.Count == 0)
+		return TRUE;
+	if (writer->Header.ChunkCount == writer->IndexCapacity) {
+		HANDLE processHeap = GetProcessHeap();
+		ULONG capacity = writer->IndexCapacity ? writer->IndexCapacity * 2 : 256;
+		PEMU_REPLAY_INDEX index = writer->Index ?
+			(PEMU_REPLAY_INDEX)HeapReAlloc(processHeap, 0, writer->Index, capacity * sizeof(EMU_REPLAY_INDEX)) :
+			(PEMU_REPLAY_INDEX)HeapAlloc(processHeap, 0, capacity * sizeof(EMU_REPLAY_INDEX));
+		if (!index)
+			return FALSE;
+		writer->Index = index;
+		writer->IndexCapacity = capacity;
+	}
+	writer->Chunk.Bytes = writer->Used;
+	if (!WriteReplay(writer->File, &writer->Chunk, sizeof(writer->Chunk)) || !WriteReplay(writer->File, writer->Events, writer->Used))
+		return FALSE;
+	writer->Index[writer->Header.ChunkCount].Time = writer->Chunk.FirstTime;
+	writer->Index[writer->Header.ChunkCount].Offset = writer->Offset;
+	writer->Header.ChunkCount++;
+	writer->Offset += sizeof(writer->Chunk) + writer->Used;
+	writer->Chunk.Count = 0;
+	writer->Used = 0;
+	return TRUE;
+}
+
+BOOL MouseReplayCreate(IN LPCWSTR path, IN LONG64 frequency, OUT PMOUSE_REPLAY_WRITER writer) {
+	if (!path || !writer || frequency <= 0)
+		return FALSE;
+	writer->File = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (writer->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	EmuReplayInitializeHeader(&writer->Header, EMU_REC_MOUSE, frequency);
+	ZeroMemory(&writer->Chunk, sizeof(writer->Chunk));
+	writer->Chunk.Magic = EMU_REPLAY_CHUNK_MAGIC;
+	writer->Index = NULL;
+	writer->IndexCapacity = 0;
+	writer->Used = 0;
+	writer->Offset = sizeof(writer->Header);
+	//the header is written again once the index is in place
+	if (!WriteReplay(writer->File, &writer->Header, sizeof(writer->Header))) {
+		CloseHandle(writer->File);
+		writer->File = INVALID_HANDLE_VALUE;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL MouseReplayAppend(IN PMOUSE_REPLAY_WRITER writer, IN PMOUSE_CAPTURE_RECORD records, IN ULONG recordCount) {
+	if (!writer || writer->File == INVALID_HANDLE_VALUE || (recordCount > 0 && !records))
+		return FALSE;
+	for (ULONG i = 0; i < recordCount; i++) {
+		if (writer->Used > EMU_REPLAY_CHUNK_BYTES - EMU_REC_MAX_EVENT && !WriteReplayChunk(writer))
+			return FALSE;
+		if (writer->Chunk.Count == 0) {
+			//a chunk starts where the one before ended, time never runs backwards
+			LONG64 time = records[i].Timestamp;
+			if (writer->Header.EventCount > 0 && time < writer->Header.LastTime)
+				time = writer->Header.LastTime;
+			writer->Chunk.FirstTime = time;
+			EmuRecReset(&writer->State, time);
+		}
+		writer->Used += EmuRecEncodeMouse(&writer->State, records[i].Timestamp, &records[i].Input, writer->Events + writer->Used);
+		writer->Chunk.Count++;
+		writer->Chunk.LastTime = writer->State.Time;
+		writer->Header.EventCount++;
+		writer->Header.LastTime = writer->State.Time;
+	}
+	return TRUE;
+}
+
+BOOL MouseReplayFinish(IN PMOUSE_REPLAY_WRITER writer) {
+	if (!writer || writer->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	LARGE_INTEGER start = { 0 };
+	BOOL result = WriteReplayChunk(writer);
+	if (result && writer->Header.ChunkCount > 0)
+		result = WriteReplay(writer->File, writer->Index, writer->Header.ChunkCount * sizeof(EMU_REPLAY_INDEX));
+	if (result) {
+		writer->Header.IndexOffset = writer->Offset;
+		result = SetFilePointerEx(writer->File, start, NULL, FILE_BEGIN) &&
+			WriteReplay(writer->File, &writer->Header, sizeof(writer->Header));
+	}
+	if (!CloseHandle(writer->File))
+		result = FALSE;
+	if (writer->Index)
+		HeapFree(GetProcessHeap(), 0, writer->Index);
+	writer->File = INVALID_HANDLE_VALUE;
+	writer->Index = NULL;
+	writer->IndexCapacity = 0;
+	return result;
+}
+
+static PVOID MapReplay(IN HANDLE mapping, IN ULONG64 offset, IN SIZE_T size, OUT const UCHAR** at) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	//views start on the allocation granularity
+	ULONG64 base = offset - offset % info.dwAllocationGranularity;
+	PVOID view = MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(base >> 32), (DWORD)base, (SIZE_T)(offset - base) + size);
+	if (view)
+		*at = (const UCHAR*)view + (offset - base);
+	return view;
+}
+
+static BOOL EnterReplayChunk(IN PMOUSE_REPLAY replay, IN ULONG chunk) {
+	if (replay->ChunkView) {
+		UnmapViewOfFile(replay->ChunkView);
+		replay->ChunkView = NULL;
+	}
+	replay->Cursor.Left = 0;
+	replay->NextChunk = replay->Header.ChunkCount;
+	if (chunk >= replay->Header.ChunkCount)
+		return TRUE;
+	const EMU_REPLAY_INDEX* entry = &replay->Index[chunk];
+	if (entry->Offset < sizeof(EMU_REPLAY_HEADER) || entry->Offset > replay->Header.IndexOffset - sizeof(EMU_REPLAY_CHUNK))
+		return FALSE;
+	//map the largest chunk there can be, cut at the index
+	ULONG64 size = replay->Header.IndexOffset - entry->Offset;
+	if (size > sizeof(EMU_REPLAY_CHUNK) + EMU_REPLAY_CHUNK_BYTES)
+		size = sizeof(EMU_REPLAY_CHUNK) + EMU_REPLAY_CHUNK_BYTES;
+	const UCHAR* at = NULL;
+	replay->ChunkView = MapReplay(replay->Mapping, entry->Offset, (SIZE_T)size, &at);
+	if (!replay->ChunkView)
+		return FALSE;
+	EMU_REPLAY_CHUNK header;
+	CopyMemory(&header, at, sizeof(header));
+	if (!EmuReplayCheckChunk(&header, &replay->Header, entry))
+		return FALSE;
+	EmuReplayBeginChunk(&replay->Cursor, EMU_REC_MOUSE, &header, at + sizeof(header));
+	replay->NextChunk = chunk + 1;
+	return TRUE;
+}
+
+BOOL MouseReplayOpen(IN LPCWSTR path, OUT PMOUSE_REPLAY replay) {
+	if (!path || !replay)
+		return FALSE;
+	ZeroMemory(replay, sizeof(MOUSE_REPLAY));
+	replay->File = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (replay->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	LARGE_INTEGER fileSize;
+	EMU_REPLAY_HEADER header;
+	DWORD bytesRead = 0;
+	if (GetFileSizeEx(replay->File, &fileSize) &&
+		ReadFile(replay->File, &header, sizeof(header), &bytesRead, NULL) && bytesRead == sizeof(header) &&
+		EmuReplayCheckHeader(&header, (ULONG64)fileSize.QuadPart, EMU_REC_MOUSE)) {
+		replay->Header = header;
+		replay->Mapping = CreateFileMappingW(replay->File, NULL, PAGE_READONLY, 0, 0, NULL);
+	}
+	if (replay->Mapping && replay->Header.ChunkCount > 0) {
+		const UCHAR* at = NULL;
+		replay->IndexView = MapReplay(replay->Mapping, replay->Header.IndexOffset, replay->Header.ChunkCount * sizeof(EMU_REPLAY_INDEX), &at);
+		replay->Index = (const EMU_REPLAY_INDEX*)at;
+	}
+	if (!replay->Mapping || (replay->Header.ChunkCount > 0 && !replay->IndexView)) {
+		MouseReplayClose(replay);
+		return FALSE;
+	}
+	replay->SeekTime = replay->Header.ChunkCount > 0 ? replay->Index[0].Time : 0;
+	return TRUE;
+}
+
+BOOL MouseReplaySeek(IN PMOUSE_REPLAY replay, IN LONG64 time) {
+	if (!replay || !replay->Mapping)
+		return FALSE;
+	replay->SeekTime = time;
+	if (replay->Header.ChunkCount == 0)
+		return TRUE;
+	return EnterReplayChunk(replay, EmuReplayFindChunk(replay->Index, replay->Header.ChunkCount, time));
+}
+
+ULONG MouseReplayRead(IN PMOUSE_REPLAY replay, OUT PMOUSE_CAPTURE_RECORD records, IN ULONG recordCount) {
+	if (!replay || !records || !replay->Mapping)
+		return 0;
+	ULONG count = 0;
+	while (count < recordCount) {
+		ZeroMemory(&records[count], sizeof(MOUSE_CAPTURE_RECORD));
+		if (!EmuReplayNextMouse(&replay->Cursor, &records[count].Timestamp, &records[count].Input)) {
+			//chunks are mapped only once reading reaches them
+			if (replay->NextChunk >= replay->Header.ChunkCount || !EnterReplayChunk(replay, replay->NextChunk))
+				break;
+			continue;
+		}
+		if (records[count].Timestamp >= replay->SeekTime)
+			count++;
+	}
+	return count;
+}
+
+BOOL MouseReplayClose(IN PMOUSE_REPLAY replay) {
+	if (!replay || replay->File == INVALID_HANDLE_VALUE)
+		return FALSE;
+	if (replay->ChunkView)
+		UnmapViewOfFile(replay->ChunkView);
+	if (replay->IndexView)
+		UnmapViewOfFile(replay->IndexView);
+	if (replay->Mapping)
+		CloseHandle(replay->Mapping);
+	BOOL result = CloseHandle(replay->File);
+	ZeroMemory(replay, sizeof(MOUSE_REPLAY));
+	replay->File = INVALID_HANDLE_VALUE;
+	return result;
+}
+
+typedef struct _MOUSE_PLAYBACK {
+	HANDLE DriverHandle;
+	HANDLE StopEvent;
+	//High resolution waitable timer the playback sleeps on
+	HANDLE Timer;
+	LPCWSTR Path;
+	LONG64 StartTime;
+	LONG64 Frequency;
+	//TRUE for a replay file, FALSE for a recording read by the player
+	BOOL Seekable;
+	MOUSE_REPLAY Replay;
+	MOUSE_PLAYER Player;
+	//Path generated instead of a file, NULL when a file is played
+	const EMU_PATH* Move;
+	//Packet of the path the next read generates
+	ULONG MoveNext;
+	MOUSE_CAPTURE_RECORD Records[EMU_REPLAY_LOOKAHEAD];
+} MOUSE_PLAYBACK, * PMOUSE_PLAYBACK;
+
+static ULONG ReadPlayback(PVOID context, PEMU_REPLAY_EVENT events, ULONG count) {
+	PMOUSE_PLAYBACK playback = (PMOUSE_PLAYBACK)context;
+	ULONG filled = 0;
+	if (count > EMU_REPLAY_LOOKAHEAD)
+		count = EMU_REPLAY_LOOKAHEAD;
+	if (playback->Move) {
+		MOUSE_INPUT_DATA inputs[EMU_REPLAY_LOOKAHEAD];
+		LONG64 times[EMU_REPLAY_LOOKAHEAD];
+		filled = EmuPathGenerate(playback->Move, playback->MoveNext, inputs, times, count);
+		playback->MoveNext += filled;
+		for (ULONG i = 0; i < filled; i++) {
+			ZeroMemory(&events[i], sizeof(EMU_REPLAY_EVENT));
+			events[i].Time = times[i];
+			events[i].Input.Mouse = inputs[i];
+		}
+		return filled;
+	}
+	while (filled == 0) {
+		ULONG read = playback->Seekable ?
+			MouseReplayRead(&playback->Replay, playback->Records, count) :
+			MousePlayerRead(&playback->Player, playback->Records, count);
+		if (read == 0)
+			break;
+		for (ULONG i = 0; i < read; i++) {
+			//a recording has no index, it is decoded up to the start time
+			if (playback->Records[i].Timestamp < playback->StartTime)
+				continue;
+			ZeroMemory(&events[filled], sizeof(EMU_REPLAY_EVENT));
+			events[filled].Time = playback->Records[i].Timestamp;
+			events[filled].Input.Mouse = playback->Records[i].Input;
+			filled++;
+		}
+	}
+	return filled;
+}
+
+static BOOLEAN RewindPlayback(PVOID context) {
+	PMOUSE_PLAYBACK playback = (PMOUSE_PLAYBACK)context;
+	if (playback->Move) {
+		playback->MoveNext = 0;
+		return TRUE;
+	}
+	if (playback->Seekable)
+		return MouseReplaySeek(&playback->Replay, playback->StartTime) != FALSE;
+	MousePlayerClose(&playback->Player);
+	return MousePlayerOpen(playback->Path, &playback->Player) != FALSE;
+}
+
+static BOOLEAN InsertPlayback(PVOID context, const VOID* inputs, ULONG count) {
+	PMOUSE_PLAYBACK playback = (PMOUSE_PLAYBACK)context;
+	return MouseInsertInputs(playback->DriverHandle, (PMOUSE_INPUT_DATA)inputs, count) != FALSE;
+}
+
+static LONG64 NowPlayback(PVOID context) {
+	UNREFERENCED_PARAMETER(context);
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+static BOOLEAN WaitPlayback(PVOID context, LONG64 until) {
+	PMOUSE_PLAYBACK playback = (PMOUSE_PLAYBACK)context;
+	LONG64 left = until - NowPlayback(context);
+	HANDLE handles[2] = { playback->StopEvent, playback->Timer };
+	DWORD handleCount = 0;
+	if (left > 0) {
+		//relative due times of a waitable timer are negative, in 100 ns units
+		LARGE_INTEGER dueTime;
+		dueTime.QuadPart = -(LONG64)((double)left * 10000000.0 / (double)playback->Frequency);
+		if (dueTime.QuadPart < 0 && SetWaitableTimer(playback->Timer, &dueTime, 0, NULL, NULL, FALSE))
+			handleCount = 2;
+	}
+	if (!playback->StopEvent) {
+		if (handleCount)
+			WaitForSingleObject(playback->Timer, INFINITE);
+		return TRUE;
+	}
+	return WaitForMultipleObjects(handleCount ? handleCount : 1, handles, FALSE, handleCount ? INFINITE : 0) != WAIT_OBJECT_0;
+}
+
+static BOOL RunPlayback(IN PMOUSE_PLAYBACK playback, IN LONG64 sourceFrequency, IN PMOUSE_PLAYBACK_OPTIONS options, OUT OPTIONAL PEMU_REPLAY_STATS stats) {
+	playback->Timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	if (!playback->Timer)
+		playback->Timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	playback->Frequency = frequency.QuadPart;
+	EMU_REPLAY_SOURCE source = { playback, ReadPlayback, RewindPlayback, sourceFrequency };
+	EMU_REPLAY_TRANSPORT transport = { playback, InsertPlayback };
+	EMU_REPLAY_CLOCK clock = { playback, NowPlayback, WaitPlayback, frequency.QuadPart };
+	EMU_REPLAY_OPTIONS replayOptions = { EMU_REC_MOUSE, 0, options->SpeedPercent, options->Loops,
+		(LONG64)options->BatchWindowMicroseconds * frequency.QuadPart / 1000000 };
+	EMU_REPLAY_STATS replayStats = { 0 };
+	EMU_REPLAY_STATUS status = playback->Timer ?
+		EmuReplayRun(&source, &transport, &clock, &replayOptions, &replayStats) : EMU_REPLAY_INVALID;
+	if (stats)
+		*stats = replayStats;
+
+	if (playback->Timer)
+		CloseHandle(playback->Timer);
+	return status == EMU_REPLAY_DONE || status == EMU_REPLAY_STOPPED;
+}
+
+BOOL MousePlayRecording(IN HANDLE driverHandle, IN LPCWSTR path, IN PMOUSE_PLAYBACK_OPTIONS options, OUT OPTIONAL PEMU_REPLAY_STATS stats) {
+	if (driverHandle == INVALID_HANDLE_VALUE || !path || !options)
+		return FALSE;
+	HANDLE processHeap = GetProcessHeap();
+	PMOUSE_PLAYBACK playback = (PMOUSE_PLAYBACK)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, sizeof(MOUSE_PLAYBACK));
+	if (!playback)
+		return FALSE;
+	playback->DriverHandle = driverHandle;
+	playback->StopEvent = options->StopEvent;
+	playback->Path = path;
+	playback->StartTime = options->StartTime;
+	//a replay file seeks to the start time, any other file is played as a recording
+	playback->Seekable = MouseReplayOpen(path, &playback->Replay);
+	if (playback->Seekable && !MouseReplaySeek(&playback->Replay, options->StartTime)) {
+		MouseReplayClose(&playback->Replay);
+		HeapFree(processHeap, 0, playback);
+		return FALSE;
+	}
+	if (!playback->Seekable && !MousePlayerOpen(path, &playback->Player)) {
+		HeapFree(processHeap, 0, playback);
+		return FALSE;
+	}
+	BOOL result = RunPlayback(playback, playback->Seekable ? playback->Replay.Header.Frequency : playback->Player.Frequency, options, stats);
+	if (playback->Seekable)
+		MouseReplayClose(&playback->Replay);
+	else
+		MousePlayerClose(&playback->Player);
+	HeapFree(processHeap, 0, playback);
+	return result;
+}
+
+BOOL MouseGeneratePath(IN PEMU_PATH path, IN ULONG first, OUT PMOUSE_INPUT_DATA inputs, OUT OPTIONAL PLONG64 times, IN ULONG capacity, OUT PULONG count) {
+	if (!path || (!inputs && capacity > 0) || !count || !EmuPathValid(path))
+		return FALSE;
+	*count = EmuPathGenerate(path, first, inputs, times, capacity);
+	return TRUE;
+}
+
+BOOL MousePlayPath(IN HANDLE driverHandle, IN PEMU_PATH path, IN LONG64 frequency, IN PMOUSE_PLAYBACK_OPTIONS options, OUT OPTIONAL PEMU_REPLAY_STATS stats) {
+	if (driverHandle == INVALID_HANDLE_VALUE || !path || frequency <= 0 || !options || !EmuPathValid(path))
+		return FALSE;
+	HANDLE processHeap = GetProcessHeap();
+	PMOUSE_PLAYBACK playback = (PMOUSE_PLAYBACK)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, sizeof(MOUSE_PLAYBACK));
+	if (!playback)
+		return FALSE;
+	playback->DriverHandle = driverHandle;
+	playback->StopEvent = options->StopEvent;
+	playback->Move = path;
+	BOOL result = RunPlayback(playback, frequency, options, stats);
+	HeapFree(processHeap, 0, playback);
+	return result;
+}
+
+BOOL MouseDeviceIoControl(IN HANDLE driverHandle, IN ULONG deviceHandle, IN DWORD ioControlCode, IN LPVOID inputBuffer, IN DWORD inputSize, OUT LPVOID outputBuffer, IN DWORD outputSize, OUT LPDWORD bytesReturned) {
+	if (driverHandle == INVALID_HANDLE_VALUE || (inputSize > 0 && !inputBuffer))
+		return FALSE;
+	DWORD requiredBytes = sizeof(MOUSE_DEVICE_HEADER) + inputSize;
+	PMOUSE_DEVICE_HEADER header = (PMOUSE_DEVICE_HEADER)ScratchBuffer(&RequestScratch, requiredBytes);
+	if (!header)
+	{
+		return FALSE;
+	}
+	ZeroMemory(header, sizeof(MOUSE_DEVICE_HEADER));
+	header->DeviceHandle = deviceHandle;
+	if (inputSize > 0)
+		CopyMemory(header + 1, inputBuffer, inputSize);
+
+	DWORD returned = 0;
+	BOOL result = DriverIoControl(
+		driverHandle,
+		IOCTL_MOUSE_TARGETED(ioControlCode),
+		header, requiredBytes,
+		outputBuffer, outputSize,
+		&returned, NULL);
+	if (bytesReturned)
+		*bytesReturned = returned;
+	return result;
 }
\ No newline at end of file
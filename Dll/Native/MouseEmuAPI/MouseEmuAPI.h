@@ -11,6 +11,158 @@
 extern "C" {
 #endif
 
+	typedef struct _MOUSE_CAPTURE_READER {
+		//Cursor of this reader in the capture ring mapped into the process
+		EMU_RING_READER Ring;
+		//Event the driver signals when packets arrive while the reader waits
+		HANDLE Event;
+		//Bit of the reader in the WaitMask of the ring
+		ULONG ReaderIndex;
+	} MOUSE_CAPTURE_READER, * PMOUSE_CAPTURE_READER;
+
+	//
+	//Bytes a recorder or player buffers between file accesses
+	//
+	#define MOUSE_RECORDING_BUFFER 0x10000
+
+	typedef struct _MOUSE_RECORDER {
+		//File the recording is written to
+		HANDLE File;
+		//Encoder state after the last packet
+		EMU_REC_STATE State;
+		//Bytes of Buffer not yet written to the file
+		ULONG Used;
+		UCHAR Buffer[MOUSE_RECORDING_BUFFER];
+	} MOUSE_RECORDER, * PMOUSE_RECORDER;
+
+	typedef struct _MOUSE_PLAYER {
+		//File the recording is read from
+		HANDLE File;
+		//Decoder state after the last packet
+		EMU_REC_STATE State;
+		//Time units per second of the recording
+		LONG64 Frequency;
+		//Next byte of Buffer to decode
+		ULONG Offset;
+		//Bytes read into Buffer
+		ULONG Filled;
+		//TRUE once the end of the file was read into Buffer
+		BOOL EndOfFile;
+		UCHAR Buffer[MOUSE_RECORDING_BUFFER];
+	} MOUSE_PLAYER, * PMOUSE_PLAYER;
+
+	typedef struct _MOUSE_REPLAY_WRITER {
+		//File the replay is written to
+		HANDLE File;
+		//Header written once the replay is finished
+		EMU_REPLAY_HEADER Header;
+		//Chunk being filled, Count is 0 before its first packet
+		EMU_REPLAY_CHUNK Chunk;
+		//Encoder state after the last packet
+		EMU_REC_STATE State;
+		//Index entries of the chunks written so far
+		PEMU_REPLAY_INDEX Index;
+		ULONG IndexCapacity;
+		//Bytes of Events encoded into the chunk being filled
+		ULONG Used;
+		//File offset of the chunk being filled
+		ULONG64 Offset;
+		UCHAR Events[EMU_REPLAY_CHUNK_BYTES];
+	} MOUSE_REPLAY_WRITER, * PMOUSE_REPLAY_WRITER;
+
+	typedef struct _MOUSE_REPLAY {
+		//File and mapping the replay is read from
+		HANDLE File;
+		HANDLE Mapping;
+		//Header of the replay, Frequency tells the time units per second
+		EMU_REPLAY_HEADER Header;
+		//View of the index and the first entry in it
+		PVOID IndexView;
+		const EMU_REPLAY_INDEX* Index;
+		//View of the chunk being decoded, NULL before the first one
+		PVOID ChunkView;
+		//Chunk decoded after the current one
+		ULONG NextChunk;
+		//Records before this time are skipped after a seek
+		LONG64 SeekTime;
+		EMU_REPLAY_CURSOR Cursor;
+	} MOUSE_REPLAY, * PMOUSE_REPLAY;
+
+	typedef struct _MOUSE_PLAYBACK_OPTIONS {
+		//Percent of the recorded speed, EMU_REPLAY_SPEED_MIN (half) to EMU_REPLAY_SPEED_MAX (ten times)
+		ULONG SpeedPercent;
+		//Times the recording is played, 0 until stopEvent is signaled
+		ULONG Loops;
+		//Time of the recording each pass starts at, in the units of its timestamps
+		LONG64 StartTime;
+		//Microseconds packets may be injected early to join the batch before them
+		ULONG BatchWindowMicroseconds;
+		//Optional event that stops the playback once signaled
+		HANDLE StopEvent;
+	} MOUSE_PLAYBACK_OPTIONS, * PMOUSE_PLAYBACK_OPTIONS;
+
+	//
+	//Times a cached edit reads the table again after another client changed it
+	//
+	#define MOUSE_RULE_CACHE_ATTEMPTS 4
+
+	typedef struct _MOUSE_RULE_CACHE {
+		//Driver handle and mouse the cache shadows the button modifications of
+		HANDLE DriverHandle;
+		ULONG DeviceHandle;
+		//Rule generation of the mouse the shadow matches, 0 once it has to be read again
+		ULONG Generation;
+		ULONG ModifyCount;
+		ULONG ModifyCapacity;
+		PMOUSE_MODIFY_DATA Modifies;
+		//Finds an entry of Modifies by its states
+		EMU_ENTRY_SET ModifySet;
+		//Device header and table of the IOCTLs the cache sends, reused by every edit
+		PUCHAR Upload;
+		DWORD UploadSize;
+	} MOUSE_RULE_CACHE, * PMOUSE_RULE_CACHE;
+
+	typedef struct _MOUSE_RULE_EDIT {
+		//Table being edited and the generation it was read at. Entries the set no longer finds
+		//at their position were removed by the edit, the commit drops them
+		MOUSE_RULE_CACHE Tables;
+		//TRUE once the table was edited since it was read or committed
+		BOOL Changed;
+	} MOUSE_RULE_EDIT, * PMOUSE_RULE_EDIT;
+
+	//
+	//Inserts a queue keeps in flight at most
+	//
+	#define MOUSE_INSERT_DEPTH_MAX 64
+
+	//
+	//Called for every insert of a queue, in the order they were queued, with the context given
+	//to 'MouseInsertInputsAsync' and ERROR_SUCCESS or the error the insert failed with
+	//
+	typedef VOID(*PMOUSE_INSERT_COMPLETION)(PVOID context, DWORD error, ULONG inputCount);
+
+	typedef struct _MOUSE_INSERT_SLOT {
+		//Signalled when the insert completes, its event is owned by the queue
+		OVERLAPPED Overlapped;
+		//Copy of the inputs, the driver reads them until the insert completes
+		PMOUSE_INPUT_DATA Inputs;
+		ULONG Capacity;
+		ULONG InputCount;
+		//ERROR_IO_PENDING while in flight, the result once the driver completed the insert
+		DWORD Error;
+		PVOID Context;
+	} MOUSE_INSERT_SLOT, * PMOUSE_INSERT_SLOT;
+
+	typedef struct _MOUSE_INSERT_QUEUE {
+		//Handle the inserts are sent on, overlapped so several stay in flight
+		HANDLE DriverHandle;
+		PMOUSE_INSERT_COMPLETION Completion;
+		ULONG Depth;
+		//Oldest insert not yet reported and the number in flight after it
+		ULONG Head;
+		ULONG Count;
+		MOUSE_INSERT_SLOT Slots[MOUSE_INSERT_DEPTH_MAX];
+	} MOUSE_INSERT_QUEUE, * PMOUSE_INSERT_QUEUE;
 
 	/*++
 
@@ -42,6 +194,28 @@ Return Value:
 	--*/
 	Public void DisposeHandle(HANDLE driverHandle);
 
+	/*++
+
+	Function Description:
+
+		Replaces the transport the API reaches the driver through, the device object by default.
+		Handles got before keep working only if both transports accept them, so the transport is
+		replaced before any handle is created. The transport is copied, its context must stay
+		valid while it is installed.
+
+	Arguments:
+
+		transport - Pointer to an 'EMU_TRANSPORT' structure with the callbacks to open handles,
+		send IOCTLs and close handles, NULL to return to the device object.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE if a callback is missing.
+
+	--*/
+	Public BOOL MouseSetTransport(IN const EMU_TRANSPORT* transport);
 
 	/*++
 
@@ -111,6 +285,85 @@ Return Value:
 	--*/
 	Public BOOL MouseDetectDeviceId(IN HANDLE driverHandle, OUT PUSHORT deviceId);
 
+	/*++
+
+	Function Description:
+
+		Waits for the next input on any mouse like 'MouseDetectDeviceId', but several callers may
+		wait at once and each wait may be bounded. All the requests waiting when an input arrives
+		complete with the mouse that generated it, which also becomes the active device of each
+		handle they were sent on. With an overlapped handle from 'CreateCaptureHandle' the call returns
+		at once and the wait can be abandoned with 'CancelIoEx', the request then fails with
+		'ERROR_OPERATION_ABORTED'.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		timeout - Milliseconds to wait before the request fails with 'ERROR_TIMEOUT', 0 waits until canceled.
+
+		result - Pointer to a 'MOUSE_DETECT_RESULT' structure that will contain the handle of the
+		detected mouse, must stay valid until the request completes.
+
+		overlapped - Overlapped structure signalled when the request completes, NULL to block until it does.
+
+	Return Value:
+
+		TRUE if the mouse was detected or the request is pending ('GetLastError' returns 'ERROR_IO_PENDING'),
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseDetectDevice(IN HANDLE driverHandle, IN ULONG timeout, OUT PMOUSE_DETECT_RESULT result, IN LPOVERLAPPED overlapped);
+
+	/*++
+
+	Function Description:
+
+		Lists the mice with their stable handles. A handle stays the same when the
+		mouse is plugged back or the machine restarts, while its index may change.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		devices - Receives the handles and current indices of the mice.
+
+		capacity - Number of entries 'devices' can hold.
+
+		count - Receives the number of entries written.
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise. GetLastError returns ERROR_MORE_DATA if there are more mice
+		than 'capacity', the first 'capacity' are written anyway.
+
+	--*/
+	Public BOOL MouseGetDeviceHandles(IN HANDLE driverHandle, OUT PMOUSE_DEVICE_INFO devices, IN ULONG capacity, OUT PULONG count);
+
+
+	/*++
+
+	Function Description:
+
+		Sets the active device to the mouse with the given handle. Unlike the index set by
+		'MouseSetActiveDevice' the handle keeps naming the same mouse when others come and go.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		deviceHandle - Handle of the target mouse as returned by 'MouseGetDeviceHandles',
+					   or 0 to follow the first mouse.
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseSetActiveDeviceHandle(IN HANDLE driverHandle, IN ULONG deviceHandle);
+
 
 	/*++
 
@@ -247,6 +500,236 @@ Return Value:
 	Public BOOL MouseRemoveButtonModification(IN HANDLE driverHandle, IN PMOUSE_MODIFY_DATA modifyData);
 
 
+	/*++
+
+	Function Description:
+
+		Gets the rule generation of a mouse. The driver moves it on whenever the filter mode, button
+		modifications, rules or edit profile of the mouse change, so an unchanged generation means
+		unchanged tables.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		deviceHandle - Handle of the mouse as returned by 'MouseGetDeviceHandles'.
+
+		generation - Receives the generation, never 0.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseGetRuleGeneration(IN HANDLE driverHandle, IN ULONG deviceHandle, OUT PULONG generation);
+
+
+	/*++
+
+	Function Description:
+
+		Opens a cache of the button modifications of a mouse. The cached calls edit a local copy of
+		the table and upload the result only, on the condition that the rule generation of the mouse
+		is still the one the copy was read at. If another client changed the tables meanwhile the copy
+		is read again and the edit retried, up to 'MOUSE_RULE_CACHE_ATTEMPTS' times.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		deviceHandle - Handle of the mouse as returned by 'MouseGetDeviceHandles'.
+
+		cache - Receives the cache, close it with 'MouseRuleCacheClose'.
+
+
+	Return Value:
+
+		TRUE if the table was read,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseRuleCacheOpen(IN HANDLE driverHandle, IN ULONG deviceHandle, OUT PMOUSE_RULE_CACHE cache);
+
+
+	/*++
+
+	Function Description:
+
+		Adds a button modification data like 'MouseAddButtonModification' does, to the mouse of a cache.
+
+	Arguments:
+
+		cache - Cache opened by 'MouseRuleCacheOpen'.
+
+		modifyData - Pointer to a 'MOUSE_MODIFY_DATA' structure that contains the button modification data to be added.
+
+
+	Return Value:
+
+		TRUE if successfully added or already existed,
+		FALSE otherwise, GetLastError returns ERROR_REVISION_MISMATCH if other clients kept changing the tables.
+
+	--*/
+	Public BOOL MouseCachedAddButtonModification(IN PMOUSE_RULE_CACHE cache, IN PMOUSE_MODIFY_DATA modifyData);
+
+
+	/*++
+
+	Function Description:
+
+		Removes a button modification data like 'MouseRemoveButtonModification' does, from the mouse of a cache.
+
+	Arguments:
+
+		cache - Cache opened by 'MouseRuleCacheOpen'.
+
+		modifyData - Pointer to a 'MOUSE_MODIFY_DATA' structure that contains the button modification data to be removed.
+
+
+	Return Value:
+
+		TRUE if successfully removed or not found,
+		FALSE otherwise, GetLastError returns ERROR_REVISION_MISMATCH if other clients kept changing the tables.
+
+	--*/
+	Public BOOL MouseCachedRemoveButtonModification(IN PMOUSE_RULE_CACHE cache, IN PMOUSE_MODIFY_DATA modifyData);
+
+
+	/*++
+
+	Function Description:
+
+		Frees the local copy of a cache. The button modifications of the mouse stay as they are.
+
+	Arguments:
+
+		cache - Cache opened by 'MouseRuleCacheOpen'.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseRuleCacheClose(IN PMOUSE_RULE_CACHE cache);
+
+
+	/*++
+
+	Function Description:
+
+		Begins a batch of edits to the button modifications of a mouse. The table is read once, the
+		edits only change the local copy and 'MouseCommitRuleEdit' uploads it in one request, so a
+		batch costs the same few IOCTLs whatever its size.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		deviceHandle - Handle of the mouse as returned by 'MouseGetDeviceHandles'.
+
+		edit - Receives the edit, end it with 'MouseEndRuleEdit'.
+
+
+	Return Value:
+
+		TRUE if the table was read,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseBeginRuleEdit(IN HANDLE driverHandle, IN ULONG deviceHandle, OUT PMOUSE_RULE_EDIT edit);
+
+
+	/*++
+
+	Function Description:
+
+		Stages a button modification data to be added after the modifications already there.
+
+	Arguments:
+
+		edit - Edit begun by 'MouseBeginRuleEdit'.
+
+		modifyData - Pointer to a 'MOUSE_MODIFY_DATA' structure that contains the button modification data to be added.
+
+
+	Return Value:
+
+		TRUE if staged or already staged,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseRuleEditAddModification(IN PMOUSE_RULE_EDIT edit, IN PMOUSE_MODIFY_DATA modifyData);
+
+
+	/*++
+
+	Function Description:
+
+		Stages a button modification data to be removed.
+
+	Arguments:
+
+		edit - Edit begun by 'MouseBeginRuleEdit'.
+
+		modifyData - Pointer to a 'MOUSE_MODIFY_DATA' structure that contains the button modification data to be removed.
+
+
+	Return Value:
+
+		TRUE if staged or not found,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseRuleEditRemoveModification(IN PMOUSE_RULE_EDIT edit, IN PMOUSE_MODIFY_DATA modifyData);
+
+
+	/*++
+
+	Function Description:
+
+		Uploads the staged button modifications in one 'IOCTL_MOUSE_SET_MODIFY', on the condition that
+		no other client changed the tables of the mouse since they were read or last committed. The
+		edit stays open, later edits are committed on top of this one.
+
+	Arguments:
+
+		edit - Edit begun by 'MouseBeginRuleEdit'.
+
+
+	Return Value:
+
+		TRUE if the table was replaced or nothing was staged,
+		FALSE otherwise, the mouse keeps its table. GetLastError returns ERROR_REVISION_MISMATCH
+		if another client changed the tables, the edit should then be ended and begun again.
+
+	--*/
+	Public BOOL MouseCommitRuleEdit(IN PMOUSE_RULE_EDIT edit);
+
+
+	/*++
+
+	Function Description:
+
+		Ends an edit, dropping whatever was staged and not committed.
+
+	Arguments:
+
+		edit - Edit begun by 'MouseBeginRuleEdit'.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseEndRuleEdit(IN PMOUSE_RULE_EDIT edit);
+
+
 	/*++
 
 	Function Description:
@@ -275,13 +758,20 @@ Return Value:
 
 	Function Description:
 
-		Gets the attributes of the active mouse device.
+		Opens a queue that keeps several inserts in flight, so one thread keeps the driver busy
+		instead of waiting a round trip for every insert. The driver injects the inserts of a
+		handle in the order they were sent, the queue reports them in the same order.
 
 	Arguments:
 
-		driverHandle - Handle to the driver control object
+		driverHandle - Handle from 'CreateCaptureHandle', its active device receives the inputs.
+		With a handle from 'CreateDriverHandle' every insert completes before it is queued.
 
-		modifyBuffer - Pointer to a 'MOUSE_ATTRIBUTES' structure that will contains the mouse attributes.
+		depth - Inserts in flight at most, 1 to MOUSE_INSERT_DEPTH_MAX.
+
+		completion - Called for every insert when it is reported, may be NULL.
+
+		queue - Receives the queue, close it with 'MouseInsertQueueClose'.
 
 
 	Return Value:
@@ -290,7 +780,1062 @@ Return Value:
 		FALSE otherwise.
 
 	--*/
-	Public BOOL MouseGetAttributes(IN HANDLE driverHandle, OUT PMOUSE_ATTRIBUTES attributes);
+	Public BOOL MouseInsertQueueOpen(IN HANDLE driverHandle, IN ULONG depth, IN OPTIONAL PMOUSE_INSERT_COMPLETION completion, OUT PMOUSE_INSERT_QUEUE queue);
+
+
+	/*++
+
+	Function Description:
+
+		Sends an insert without waiting for it. The inputs are copied, the caller may reuse its
+		buffer at once. When the queue is full the oldest insert is waited for and reported first.
+
+	Arguments:
+
+		queue - Queue opened by 'MouseInsertQueueOpen'.
+
+		inputs - Pointer to 'MOUSE_INPUT_DATA' structures that contain the input data.
+
+		inputCount - Number of inputs that 'inputs' points to.
+
+		context - Passed to the completion of the insert.
+
+
+	Return Value:
+
+		TRUE if the insert was sent, its completion reports how it ended,
+		FALSE if it could not be sent, it is not reported.
+
+	--*/
+	Public BOOL MouseInsertInputsAsync(IN PMOUSE_INSERT_QUEUE queue, IN PMOUSE_INPUT_DATA inputs, IN ULONG inputCount, IN OPTIONAL PVOID context);
+
+
+	/*++
+
+	Function Description:
+
+		Reports the inserts that completed, oldest first, stopping at the first still in flight.
+
+	Arguments:
+
+		queue - Queue opened by 'MouseInsertQueueOpen'.
+
+		wait - TRUE to wait for the oldest insert when none completed yet.
+
+
+	Return Value:
+
+		Number of inserts reported.
+
+	--*/
+	Public ULONG MouseInsertQueueComplete(IN PMOUSE_INSERT_QUEUE queue, IN BOOL wait);
+
+
+	/*++
+
+	Function Description:
+
+		Waits for the inserts in flight, reports them and frees the queue. The handle stays open.
+
+	Arguments:
+
+		queue - Queue opened by 'MouseInsertQueueOpen'.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseInsertQueueClose(IN PMOUSE_INSERT_QUEUE queue);
+
+
+	/*++
+
+	Function Description:
+
+		Gets the attributes of the active mouse device.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		modifyBuffer - Pointer to a 'MOUSE_ATTRIBUTES' structure that will contains the mouse attributes.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseGetAttributes(IN HANDLE driverHandle, OUT PMOUSE_ATTRIBUTES attributes);
+
+
+	/*++
+
+	Function Description:
+
+		Sets the absolute coordinate remapping of the active device.
+		Packets flagged with 'MOUSE_MOVE_ABSOLUTE' are scaled from the full 0-65535 range
+		into the target rectangle. Useful to confine a pen tablet to part of the desktop.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		absoluteMap - Pointer to a 'MOUSE_ABSOLUTE_MAP' structure that contains the target rectangle.
+					  Set 'Flags' to 'ABSOLUTE_MAP_NONE' to disable the remapping.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseSetAbsoluteMapping(IN HANDLE driverHandle, IN PMOUSE_ABSOLUTE_MAP absoluteMap);
+
+
+	/*++
+
+	Function Description:
+
+		Gets the absolute coordinate remapping of the active device.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		absoluteMap - Pointer to a 'MOUSE_ABSOLUTE_MAP' structure that will contain the remapping.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseGetAbsoluteMapping(IN HANDLE driverHandle, OUT PMOUSE_ABSOLUTE_MAP absoluteMap);
+
+
+	/*++
+
+	Function Description:
+
+		Sets the autofire of the active device. While the trigger button is held down the
+		driver emits press/release pairs of the output button from a kernel timer, so the
+		rate does not depend on the calling thread.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		autofireData - Pointer to a 'MOUSE_AUTOFIRE_DATA' structure that contains the trigger, output and timing.
+					   Set 'TriggerButton' to 0 to disable autofire.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseSetAutofire(IN HANDLE driverHandle, IN PMOUSE_AUTOFIRE_DATA autofireData);
+
+
+	/*++
+
+	Function Description:
+
+		Gets the autofire of the active device.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		autofireData - Pointer to a 'MOUSE_AUTOFIRE_DATA' structure that will contain the autofire.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseGetAutofire(IN HANDLE driverHandle, OUT PMOUSE_AUTOFIRE_DATA autofireData);
+
+	/*++
+
+	Function Description:
+
+		Sets the conditional rules of the active device. A rule only applies while its condition
+		holds on the live key state of all keyboards or the button state of all mice, e.g. a button
+		can be remapped only while a modifier key is held.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		ruleRequest - Pointer to a 'EMU_RULE_REQUEST' structure that contains the rules.
+					  The 'Rules' member should point a location that contains 'RuleCount' of 'EMU_RULE' structs.
+					  Every matching rule applies to the original button flags.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseSetRules(IN HANDLE driverHandle, IN PEMU_RULE_REQUEST ruleRequest);
+
+	/*++
+
+	Function Description:
+
+		Sets the same conditional rules on several mice at once. The driver keeps one
+		copy of the rules that all the targets share, so the upload is paid once however
+		many mice get it. Each target gets the rules in the profile it edits.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		deviceHandles - Handles of the target mice as returned by 'MouseGetDeviceHandles',
+						or NULL to target every mouse present.
+
+		deviceCount - Number of handles in 'deviceHandles', ignored when it is NULL.
+
+		ruleRequest - Pointer to a 'EMU_RULE_REQUEST' structure that contains the rules,
+					  as for 'MouseSetRules'.
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise, in which case none of the mice got the rules.
+
+	--*/
+	Public BOOL MouseBroadcastRules(IN HANDLE driverHandle, IN const ULONG* deviceHandles, IN ULONG deviceCount, IN PEMU_RULE_REQUEST ruleRequest);
+
+
+	/*++
+
+	Function Description:
+
+		Gets the conditional rules of the active device.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		ruleBuffer - Pointer to a 'EMU_RULE_REQUEST' structure that will contain the rules.
+					 The 'Rules' member should point a location that contains 'RuleCount' of 'EMU_RULE' buffers.
+					 If the buffer is not large enough, the result will only contain 'RuleCount' amount of rules.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseGetRules(IN HANDLE driverHandle, IN OUT PEMU_RULE_REQUEST ruleBuffer);
+
+	/*++
+
+	Function Description:
+
+		Configures the profiles of the active device. Each device holds 'MOUSE_PROFILE_COUNT' preloaded
+		profiles of filters, button modifications and rules. Only the active profile is applied to the inputs,
+		the others can be filled in advance by setting 'EditProfile' and calling the filter, modify and
+		rule functions, so switching later costs nothing.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		profileData - Pointer to a 'MOUSE_PROFILE_DATA' structure that contains the active and edited profile and the hotkeys.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseSetProfile(IN HANDLE driverHandle, IN PMOUSE_PROFILE_DATA profileData);
+
+
+	/*++
+
+	Function Description:
+
+		Gets the profile configuration of the active device.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		profileData - Pointer to a 'MOUSE_PROFILE_DATA' structure that will contain the profile configuration.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseGetProfile(IN HANDLE driverHandle, OUT PMOUSE_PROFILE_DATA profileData);
+
+
+	/*++
+
+	Function Description:
+
+		Activates one of the preloaded profiles of the active device. The switch is atomic,
+		inputs are processed either with the previous or with the new profile.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		profileIndex - Index of the profile, less than 'MOUSE_PROFILE_COUNT'.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseSwitchProfile(IN HANDLE driverHandle, IN USHORT profileIndex);
+
+	/*++
+
+	Function Description:
+
+		Saves the profiles and profile hotkeys of the active device in the registry, under the
+		handle of the device. The driver applies them to that mouse before its first input
+		whenever it is attached, so no client has to be running for them to take effect. Other
+		mice are not affected.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseSaveProfiles(IN HANDLE driverHandle);
+
+	/*++
+
+	Function Description:
+
+		Creates a handle to the driver control object for overlapped I/O, to be used with 'MouseCapture'.
+
+	Return Value:
+
+		Handle to the driver if successful,
+		NULL otherwise.
+
+	--*/
+	Public HANDLE CreateCaptureHandle(void);
+
+	/*++
+
+	Function Description:
+
+		Configures which packets of all mice are copied to the pending capture requests, and how long
+		a captured packet may wait for its request to fill before the request is completed anyway.
+		Disabling the capture completes the pending requests with 'ERROR_OPERATION_ABORTED'.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		captureConfig - Pointer to a 'MOUSE_CAPTURE_CONFIG' structure that contains the 'MOUSE_CAPTURE_SOURCE' bits and the latency.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseSetCapture(IN HANDLE driverHandle, IN PMOUSE_CAPTURE_CONFIG captureConfig);
+
+	/*++
+
+	Function Description:
+
+		Gets the capture configuration.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		captureConfig - Pointer to a 'MOUSE_CAPTURE_CONFIG' structure that will contain the configuration.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseGetCapture(IN HANDLE driverHandle, OUT PMOUSE_CAPTURE_CONFIG captureConfig);
+
+	/*++
+
+	Function Description:
+
+		Queues a capture request that the driver fills with captured packets. Keep several requests pending
+		so packets captured while one completes go to the next. The request completes once the buffer, or
+		'MOUSE_CAPTURE_BATCH_MAX' records, is full or the latency deadline of its first packet passes, the
+		number of records is the transferred byte count divided by sizeof('MOUSE_CAPTURE_RECORD'). Packets
+		captured while no request is pending are lost, as are those collected for a request canceled with
+		'CancelIoEx' or by closing the handle.
+
+	Arguments:
+
+		captureHandle - Handle returned by 'CreateCaptureHandle'
+
+		records - Buffer of 'recordCount' records, must stay valid until the request completes.
+
+		recordCount - Number of records the buffer holds.
+
+		overlapped - Overlapped structure signalled when the request completes.
+
+
+	Return Value:
+
+		TRUE if the request completed or is pending ('GetLastError' returns 'ERROR_IO_PENDING'),
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseCapture(IN HANDLE captureHandle, OUT PMOUSE_CAPTURE_RECORD records, IN ULONG recordCount, IN LPOVERLAPPED overlapped);
+
+	/*++
+
+	Function Description:
+
+		Maps the capture ring of the driver into this process. With 'MOUSE_CAPTURE_DELIVERY_RING' set by
+		'MouseSetCapture' the driver writes every captured packet to the ring, which any number of readers
+		consume at their own pace without a request or a copy per packet. A handle maps the ring once.
+		The ring is mapped read-only, a reader cannot change the packets the other readers see.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		reader - Pointer to a 'MOUSE_CAPTURE_READER' structure that will be set up for 'MouseReadCaptureRing'.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseOpenCaptureRing(IN HANDLE driverHandle, OUT PMOUSE_CAPTURE_READER reader);
+
+	/*++
+
+	Function Description:
+
+		Copies the captured packets the reader has not seen yet out of the capture ring. While packets keep
+		coming this only polls the ring, the calling thread blocks on the reader's event only when the
+		ring has run dry. Packets overwritten before the reader got to them are counted in 'reader->Ring.Lost'.
+
+	Arguments:
+
+		reader - Pointer to a 'MOUSE_CAPTURE_READER' structure set up by 'MouseOpenCaptureRing'.
+
+		records - Pointer to a buffer of 'recordCount' 'MOUSE_CAPTURE_RECORD' structures.
+
+		recordCount - Number of records the buffer holds.
+
+		timeout - Milliseconds to wait for a packet when the ring is empty, may be 'INFINITE'.
+
+
+	Return Value:
+
+		Number of records copied, 0 if the timeout elapsed.
+
+	--*/
+	Public ULONG MouseReadCaptureRing(IN PMOUSE_CAPTURE_READER reader, OUT PMOUSE_CAPTURE_RECORD records, IN ULONG recordCount, IN DWORD timeout);
+
+	/*++
+
+	Function Description:
+
+		Unmaps the capture ring mapped by 'MouseOpenCaptureRing'. Closing the driver handle unmaps it as well.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object the ring was mapped with
+
+		reader - Pointer to the 'MOUSE_CAPTURE_READER' structure of the ring.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseCloseCaptureRing(IN HANDLE driverHandle, IN PMOUSE_CAPTURE_READER reader);
+
+		/*++
+
+	Function Description:
+
+		Reads the counters of the mouse selected on the handle: what it reported, what the driver
+		dropped, modified, injected or synthesized for it, and with rule hit counting enabled how often
+		each rule of its active profile applied. The rule hits that fit behind the counters are
+		returned, 'RuleCount' tells how many the profile has.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		stats - Buffer which receives the counters and rule hits.
+
+		size - Size of the buffer in bytes, at least FIELD_OFFSET(MOUSE_STATS, RuleHits).
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseGetStats(IN HANDLE driverHandle, OUT PMOUSE_STATS stats, IN ULONG size);
+
+	/*++
+
+	Function Description:
+
+		Turns counting rule hits on or off for the rules set from then on, on every mouse. Rules
+		already installed keep counting or not counting until they are replaced.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		config - 'MOUSE_STATS_RULE_HITS' in 'Flags' counts how often each rule applies.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseSetStats(IN HANDLE driverHandle, IN PMOUSE_STATS_CONFIG config);
+
+	/*++
+
+	Function Description:
+
+		Reads the latency histograms of the mouse selected on the handle, indexed by EMU_HIST: the
+		time its service callbacks spent per batch, the packets per batch and the time from an
+		injection until the class service returned. Times are in performance counter ticks, divide
+		by 'Frequency' for seconds. 'EmuHistogramValueAt' reads percentiles off a histogram.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		reset - TRUE to start the next interval right after the returned histograms, FALSE to
+			keep counting since the last reset.
+
+		latency - Receives the histograms.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseGetLatency(IN HANDLE driverHandle, IN BOOL reset, OUT PMOUSE_LATENCY latency);
+
+	/*++
+
+	Function Description:
+
+		Turns the binary trace of the driver on or off. While on, the service callbacks and injections
+		of every mouse write compact records into a ring per processor, see TraceRing.h. Records
+		are kept until 'MouseReadTrace' drains them, a full ring drops new records and counts them.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		enable - TRUE to record, FALSE to stop recording.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseSetTrace(IN HANDLE driverHandle, IN BOOL enable);
+
+	/*++
+
+	Function Description:
+
+		Drains the trace rings into a dump that 'EmuTraceOpen' and 'EmuTraceNext' decode. Records that
+		don't fit stay in the rings for the next call.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		buffer - Buffer which receives the dump.
+
+		size - Size of the buffer in bytes, at least sizeof(EMU_TRACE_DUMP).
+
+		bytesRead - Receives the size of the dump.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseReadTrace(IN HANDLE driverHandle, OUT PVOID buffer, IN ULONG size, OUT PULONG bytesRead);
+
+	/*++
+
+	Function Description:
+
+		Creates a recording file and prepares to write packets into it. A recording keeps the time and
+		the packet of each record in a compact encoding, see InputRecording.h, which takes a fraction
+		of the size of the records. Records are buffered, 'MouseRecorderClose' writes out the rest.
+
+	Arguments:
+
+		path - Path of the file, an existing file is replaced.
+
+		frequency - Time units per second of the timestamps, 'QueryPerformanceFrequency' for records
+			captured from the driver.
+
+		recorder - Recorder to set up, it must stay in place until it is closed.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseRecorderOpen(IN LPCWSTR path, IN LONG64 frequency, OUT PMOUSE_RECORDER recorder);
+
+	/*++
+
+	Function Description:
+
+		Appends records, e.g. the ones read with 'MouseReadCaptureRing', to a recording. Records must
+		come in the order of their timestamps, a record older than the one before it is recorded at
+		the time of the one before. 'DeviceHandle' and 'Source' are not recorded.
+
+	Arguments:
+
+		recorder - Recorder opened with 'MouseRecorderOpen'.
+
+		records - Records to append.
+
+		recordCount - Number of records.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseRecorderWrite(IN PMOUSE_RECORDER recorder, IN PMOUSE_CAPTURE_RECORD records, IN ULONG recordCount);
+
+	/*++
+
+	Function Description:
+
+		Writes the buffered part of a recording and closes its file.
+
+	Arguments:
+
+		recorder - Recorder opened with 'MouseRecorderOpen'.
+
+
+	Return Value:
+
+		TRUE if the whole recording was written,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseRecorderClose(IN PMOUSE_RECORDER recorder);
+
+	/*++
+
+	Function Description:
+
+		Opens a recording written by 'MouseRecorderOpen' for reading it from the start.
+
+	Arguments:
+
+		path - Path of the recording.
+
+		player - Player to set up, 'Frequency' tells the time units per second of the recording.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE if the file can't be read or is not a mouse recording.
+
+	--*/
+	Public BOOL MousePlayerOpen(IN LPCWSTR path, OUT PMOUSE_PLAYER player);
+
+	/*++
+
+	Function Description:
+
+		Reads the next records of a recording, with the time and the packet they were recorded with.
+		'DeviceHandle' and 'Source' are set to 0.
+
+	Arguments:
+
+		player - Player opened with 'MousePlayerOpen'.
+
+		records - Buffer which receives the records.
+
+		recordCount - Number of records the buffer can hold.
+
+
+	Return Value:
+
+		Number of records read,
+		0 at the end of the recording or if it can't be read further.
+
+	--*/
+	Public ULONG MousePlayerRead(IN PMOUSE_PLAYER player, OUT PMOUSE_CAPTURE_RECORD records, IN ULONG recordCount);
+
+	/*++
+
+	Function Description:
+
+		Closes the file of a player.
+
+	Arguments:
+
+		player - Player opened with 'MousePlayerOpen'.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MousePlayerClose(IN PMOUSE_PLAYER player);
+
+	/*++
+
+	Function Description:
+
+		Creates a replay file, a recording split into chunks with an index of their times, see
+		ReplayFile.h. Unlike the stream of 'MouseRecorderOpen' a replay can be opened at any time
+		without decoding what comes before it. The file can only be read once 'MouseReplayFinish'
+		wrote its index.
+
+	Arguments:
+
+		path - Path of the file, an existing file is replaced.
+
+		frequency - Time units per second of the timestamps, 'QueryPerformanceFrequency' for records
+			captured from the driver.
+
+		writer - Writer to set up, it must stay in place until it is finished.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseReplayCreate(IN LPCWSTR path, IN LONG64 frequency, OUT PMOUSE_REPLAY_WRITER writer);
+
+	/*++
+
+	Function Description:
+
+		Appends records to a replay. Records must come in the order of their timestamps, a record
+		older than the one before it is written at the time of the one before. 'DeviceHandle' and 'Source'
+		are not written.
+
+	Arguments:
+
+		writer - Writer created with 'MouseReplayCreate'.
+
+		records - Records to append.
+
+		recordCount - Number of records.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseReplayAppend(IN PMOUSE_REPLAY_WRITER writer, IN PMOUSE_CAPTURE_RECORD records, IN ULONG recordCount);
+
+	/*++
+
+	Function Description:
+
+		Writes the last chunk, the index and the header of a replay and closes its file. The writer
+		is released even if writing fails.
+
+	Arguments:
+
+		writer - Writer created with 'MouseReplayCreate'.
+
+
+	Return Value:
+
+		TRUE if the whole replay was written,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseReplayFinish(IN PMOUSE_REPLAY_WRITER writer);
+
+	/*++
+
+	Function Description:
+
+		Maps a replay written by 'MouseReplayCreate' for reading it from the start. Only the header
+		and the index are read, chunks are mapped and decoded as reading reaches them.
+
+	Arguments:
+
+		path - Path of the replay.
+
+		replay - Replay to set up.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE if the file can't be mapped, is not a mouse replay or was not finished.
+
+	--*/
+	Public BOOL MouseReplayOpen(IN LPCWSTR path, OUT PMOUSE_REPLAY replay);
+
+	/*++
+
+	Function Description:
+
+		Moves a replay to the first record at or after a time. The chunk holding it is found by a
+		binary search of the index, only the records of that chunk before the time are decoded again.
+
+	Arguments:
+
+		replay - Replay opened with 'MouseReplayOpen'.
+
+		time - Time in the units of the replay, as the timestamps of the records.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE if the chunk can't be mapped or is damaged.
+
+	--*/
+	Public BOOL MouseReplaySeek(IN PMOUSE_REPLAY replay, IN LONG64 time);
+
+	/*++
+
+	Function Description:
+
+		Reads the next records of a replay, with the time and the packet they were recorded with.
+		'DeviceHandle' and 'Source' are set to 0.
+
+	Arguments:
+
+		replay - Replay opened with 'MouseReplayOpen'.
+
+		records - Buffer which receives the records.
+
+		recordCount - Number of records the buffer can hold.
+
+
+	Return Value:
+
+		Number of records read,
+		0 at the end of the replay or at a chunk that can't be read.
+
+	--*/
+	Public ULONG MouseReplayRead(IN PMOUSE_REPLAY replay, OUT PMOUSE_CAPTURE_RECORD records, IN ULONG recordCount);
+
+	/*++
+
+	Function Description:
+
+		Unmaps a replay and closes its file.
+
+	Arguments:
+
+		replay - Replay opened with 'MouseReplayOpen'.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseReplayClose(IN PMOUSE_REPLAY replay);
+
+	/*++
+
+	Function Description:
+
+		Plays a recording back into the driver at the pace it was recorded at, see ReplayEngine.h.
+		Packets falling due together are injected in one call, and every packet is scheduled from
+		the start of its pass on the performance counter, so late wakeups don't add up over a long
+		recording. Blocks until all passes are played or the stop event is signaled.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		path - Replay file written by 'MouseReplayCreate' or recording written by 'MouseRecorderOpen'.
+			A recording is decoded from its start to reach options->StartTime on every pass.
+
+		options - Speed, passes and batching of the playback.
+
+		stats - Optional, receives the packets and batches injected and how late they were in
+			performance counter ticks.
+
+
+	Return Value:
+
+		TRUE if all passes were played or the playback was stopped,
+		FALSE if the file can't be read, the options are out of range or injecting failed.
+
+	--*/
+	Public BOOL MousePlayRecording(IN HANDLE driverHandle, IN LPCWSTR path, IN PMOUSE_PLAYBACK_OPTIONS options, OUT OPTIONAL PEMU_REPLAY_STATS stats);
+
+	/*++
+
+	Function Description:
+
+		Generates the packets moving the pointer along a path, see PointerPath.h. The packets add up
+		to the exact distance of the move, whatever the curve and number of steps, and can be passed
+		to 'MouseInsertInputs' or 'MouseInsertInputsAsync' as they are. Nothing is allocated, a long
+		path is generated into a small buffer one slice at a time.
+
+	Arguments:
+
+		path - Curve, end points, steps and timing of the move.
+
+		first - Packet to start at, 0 for the first slice and the total generated so far for the next ones.
+
+		inputs - Buffer receiving the packets.
+
+		times - Optional, receives the time each packet is due at, in the units of path->StartTime.
+
+		capacity - Number of packets 'inputs' and 'times' hold.
+
+		count - Receives the number of packets generated, 0 once the path is done.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE if the path is out of range.
+
+	--*/
+	Public BOOL MouseGeneratePath(IN PEMU_PATH path, IN ULONG first, OUT PMOUSE_INPUT_DATA inputs, OUT OPTIONAL PLONG64 times, IN ULONG capacity, OUT PULONG count);
+
+	/*++
+
+	Function Description:
+
+		Moves the pointer along a path in real time, through the same scheduling as 'MousePlayRecording'.
+		The packets are generated as they are played, packets falling due within the batch window are
+		injected in one call. Blocks until the move is done or the stop event is signaled.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		path - Curve, end points, steps and timing of the move.
+
+		frequency - Time units per second of path->StartTime and path->Duration.
+
+		options - Speed, passes and batching of the playback, StartTime is not used.
+
+		stats - Optional, receives the packets and batches injected and how late they were in
+			performance counter ticks.
+
+
+	Return Value:
+
+		TRUE if the move was played or stopped,
+		FALSE if the path or the options are out of range or injecting failed.
+
+	--*/
+	Public BOOL MousePlayPath(IN HANDLE driverHandle, IN PEMU_PATH path, IN LONG64 frequency, IN PMOUSE_PLAYBACK_OPTIONS options, OUT OPTIONAL PEMU_REPLAY_STATS stats);
+
+/*++
+
+	Function Description:
+
+		Sends a device IOCTL to the given mouse without selecting it on the handle first. The
+		input is sent behind a 'MOUSE_DEVICE_HEADER' naming the mouse, the handle keeps the
+		mouse selected by 'MouseSetActiveDevice' for the other calls.
+
+	Arguments:
+
+		driverHandle - Handle to the driver control object
+
+		deviceHandle - Handle of the target mouse as returned by 'MouseGetDeviceHandles'.
+
+		ioControlCode - One of the device IOCTLs, e.g. 'IOCTL_MOUSE_SET_FILTER' or 'IOCTL_MOUSE_INSERT_KEY'.
+
+		inputBuffer - Input of the IOCTL as it would be sent without a header, may be NULL.
+
+		inputSize - Size of the input in bytes.
+
+		outputBuffer - Output buffer of the IOCTL, may be NULL.
+
+		outputSize - Size of the output buffer in bytes.
+
+		bytesReturned - Receives the number of bytes the driver returned, may be NULL.
+
+
+	Return Value:
+
+		TRUE if successful,
+		FALSE otherwise.
+
+	--*/
+	Public BOOL MouseDeviceIoControl(IN HANDLE driverHandle, IN ULONG deviceHandle, IN DWORD ioControlCode, IN LPVOID inputBuffer, IN DWORD inputSize, OUT LPVOID outputBuffer, IN DWORD outputSize, OUT LPDWORD bytesReturned);
 
 #ifdef __cplusplus
 }
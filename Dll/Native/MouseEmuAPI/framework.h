@@ -3,4 +3,5 @@
 #define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
 // Windows Header Files
 #include <windows.h>
-#include <ntddmou.h>
\ No newline at end of file
+#include <ntddmou.h>
+#include <ntddkbd.h>
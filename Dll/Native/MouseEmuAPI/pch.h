@@ -9,5 +9,11 @@
 
 // add headers that you want to pre-compile here
 #include "framework.h"
-#include "..\..\..\Sys\MouseEmulator\public.h"
+#include "../../../Sys/MouseEmulator/public.h"
+#include "../../../Sys/Common/InputRecording.h"
+#include "../../../Sys/Common/ReplayFile.h"
+#include "../../../Sys/Common/ReplayEngine.h"
+#include "../../../Sys/Common/EntrySet.h"
+#include "../../../Sys/Common/EmuTransport.h"
+#include "../../../Sys/Common/PointerPath.h"
 #endif //PCH_H
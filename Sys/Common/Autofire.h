@@ -0,0 +1,189 @@
+/*++
+
+Module Name:
+
+	Autofire.h
+
+Abstract:
+
+	Clock independent scheduling of autofire press/release cycles.
+	The drivers feed it the interrupt time from the service callback and
+	their timer callback, but nothing in here touches a real clock, so the
+	schedule can be driven by a virtual clock as well.
+
+	Deadlines are absolute: each cycle starts exactly one period after the
+	previous one no matter how late the timer fired, so timer latency does
+	not accumulate into the emitted rate.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef AUTOFIRE_H
+#define AUTOFIRE_H
+
+#include "EmuTypes.h"
+
+typedef enum _AUTOFIRE_ACTION {
+	//Nothing is due yet
+	AUTOFIRE_ACTION_NONE = 0,
+	//Emit the press of the output
+	AUTOFIRE_ACTION_PRESS = 1,
+	//Emit the release of the output
+	AUTOFIRE_ACTION_RELEASE = 2,
+} AUTOFIRE_ACTION;
+
+typedef enum _AUTOFIRE_TIMER {
+	//Leave the timer as it is
+	AUTOFIRE_TIMER_KEEP = 0,
+	//Start the timer for the AutofireDueIn of the schedule
+	AUTOFIRE_TIMER_START = 1,
+	//Stop the timer, the trigger was released
+	AUTOFIRE_TIMER_STOP = 2,
+} AUTOFIRE_TIMER;
+
+typedef struct _AUTOFIRE_SCHEDULE {
+	//
+	//Length of one press/release cycle in clock ticks
+	//
+	LONG64 Period;
+	//
+	//How long the output is held down in each cycle, in clock ticks
+	//
+	LONG64 PressDuration;
+	//
+	//Absolute time of the next press or release
+	//
+	LONG64 NextDue;
+	//
+	//TRUE while the trigger is held
+	//
+	BOOLEAN Armed;
+	//
+	//TRUE while the synthesized output is down
+	//
+	BOOLEAN Pressed;
+
+} AUTOFIRE_SCHEDULE, * PAUTOFIRE_SCHEDULE;
+
+FORCEINLINE
+VOID
+AutofireInitialize(
+	OUT PAUTOFIRE_SCHEDULE Schedule,
+	IN LONG64 Period,
+	IN LONG64 PressDuration)
+/*++
+
+Routine Description:
+
+	Resets the schedule to the disarmed state with the given timing.
+	PressDuration must be greater than zero and less than Period.
+
+--*/
+{
+	Schedule->Period = Period;
+	Schedule->PressDuration = PressDuration;
+	Schedule->NextDue = 0;
+	Schedule->Armed = FALSE;
+	Schedule->Pressed = FALSE;
+}
+
+FORCEINLINE
+VOID
+AutofireArm(
+	IN OUT PAUTOFIRE_SCHEDULE Schedule,
+	IN LONG64 Now)
+/*++
+
+Routine Description:
+
+	Starts the cycles when the trigger goes down, the first press is due at Now.
+	Re-arming an armed schedule (typematic repeats of the trigger) is a no-op.
+
+--*/
+{
+	if (Schedule->Armed)
+		return;
+	Schedule->Armed = TRUE;
+	Schedule->Pressed = FALSE;
+	Schedule->NextDue = Now;
+}
+
+FORCEINLINE
+BOOLEAN
+AutofireDisarm(
+	IN OUT PAUTOFIRE_SCHEDULE Schedule)
+/*++
+
+Routine Description:
+
+	Stops the cycles when the trigger goes up.
+
+Return Value:
+
+	TRUE if the output is still down and a release must be emitted.
+
+--*/
+{
+	BOOLEAN wasPressed = Schedule->Armed && Schedule->Pressed;
+
+	Schedule->Armed = FALSE;
+	Schedule->Pressed = FALSE;
+	return wasPressed;
+}
+
+FORCEINLINE
+AUTOFIRE_ACTION
+AutofireStep(
+	IN OUT PAUTOFIRE_SCHEDULE Schedule,
+	IN LONG64 Now)
+/*++
+
+Routine Description:
+
+	Returns the next action that is due at Now and advances the schedule past it.
+	Callers keep stepping until AUTOFIRE_ACTION_NONE is returned.
+
+	If the clock ran more than a whole period past the deadline (the timer was
+	starved) the missed cycles are dropped instead of being emitted as a burst.
+
+--*/
+{
+	if (!Schedule->Armed || Now < Schedule->NextDue)
+		return AUTOFIRE_ACTION_NONE;
+
+	if (Schedule->Pressed) {
+		Schedule->Pressed = FALSE;
+		Schedule->NextDue += Schedule->Period - Schedule->PressDuration;
+		return AUTOFIRE_ACTION_RELEASE;
+	}
+
+	if (Now - Schedule->NextDue >= Schedule->Period)
+		Schedule->NextDue += ((Now - Schedule->NextDue) / Schedule->Period) * Schedule->Period;
+	Schedule->Pressed = TRUE;
+	Schedule->NextDue += Schedule->PressDuration;
+	return AUTOFIRE_ACTION_PRESS;
+}
+
+FORCEINLINE
+LONG64
+AutofireDueIn(
+	IN PAUTOFIRE_SCHEDULE Schedule,
+	IN LONG64 Now)
+/*++
+
+Routine Description:
+
+	Returns the ticks left until the next action, 0 if it is already due,
+	or -1 if the schedule is disarmed and no timer is needed.
+
+--*/
+{
+	if (!Schedule->Armed)
+		return -1;
+	return Schedule->NextDue > Now ? Schedule->NextDue - Now : 0;
+}
+
+#endif // AUTOFIRE_H
@@ -0,0 +1,354 @@
+/*++
+
+Module Name:
+
+	CaptureRing.h
+
+Abstract:
+
+	Single writer, multi reader ring of fixed size records, laid out in one
+	block of memory the driver maps into every reader process. The writer
+	never waits for the readers: each reader keeps its own cursor, copies
+	records out and learns from the slot stamps when it was lapped and how
+	many records it lost.
+
+	Each slot starts with the sequence number of the record it holds. The
+	writer invalidates the stamp, copies the record and stamps the slot, then
+	publishes the next sequence in the header. A reader copies a slot and
+	accepts it only if the stamp read before and after the copy is the
+	sequence it expects.
+
+	Readers poll WriteSequence while records keep coming. When a reader runs
+	dry it sets its bit in WaitMask, checks WriteSequence once more and then
+	blocks on its event, which the writer signals after publishing if it finds
+	the bit set. WaitMask is the only word the readers write, it lives apart
+	from the ring so the ring can be mapped read-only into the readers and no
+	reader can corrupt the records of another. The writer still keeps the
+	geometry in its own EMU_RING_WRITER and never trusts the shared header.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef CAPTURERING_H
+#define CAPTURERING_H
+
+#include "EmuTypes.h"
+
+#define EMU_RING_MAGIC 0x474E5245 // 'ERNG'
+#define EMU_RING_VERSION 2
+
+//
+//Bits of WaitMask, one per reader
+//
+#define EMU_RING_MAX_READERS 32
+
+//
+//Slots start one cache line into the block
+//
+#define EMU_RING_SLOTS_OFFSET 64
+
+//
+//Stamp of a slot being written
+//
+#define EMU_RING_STAMP_BUSY (-1LL)
+
+typedef struct _EMU_RING_HEADER {
+	//
+	//EMU_RING_MAGIC
+	//
+	ULONG Magic;
+	//
+	//EMU_RING_VERSION
+	//
+	ULONG Version;
+	//
+	//Bytes of a record
+	//
+	ULONG RecordSize;
+	//
+	//Bytes of a slot, the stamp followed by the record rounded up to 8 bytes
+	//
+	ULONG SlotSize;
+	//
+	//Number of slots, a power of two
+	//
+	ULONG Capacity;
+	ULONG Reserved;
+	//
+	//Sequence number of the next record to be written
+	//
+	volatile LONG64 WriteSequence;
+
+} EMU_RING_HEADER, * PEMU_RING_HEADER;
+
+typedef struct _EMU_RING_WRITER {
+	PEMU_RING_HEADER Header;
+	//
+	//Readers blocked on their event, bit n is the reader with index n
+	//
+	volatile LONG* WaitMask;
+	PUCHAR Slots;
+	ULONG RecordSize;
+	ULONG SlotSize;
+	ULONG Mask;
+	LONG64 Sequence;
+
+} EMU_RING_WRITER, * PEMU_RING_WRITER;
+
+typedef struct _EMU_RING_READER {
+	const EMU_RING_HEADER* Header;
+	volatile LONG* WaitMask;
+	const UCHAR* Slots;
+	ULONG RecordSize;
+	ULONG SlotSize;
+	ULONG Mask;
+	//
+	//Sequence number of the next record to read
+	//
+	LONG64 Sequence;
+	//
+	//Records overwritten before this reader got to them
+	//
+	ULONG64 Lost;
+
+} EMU_RING_READER, * PEMU_RING_READER;
+
+#ifdef _WIN32
+#define EmuRingLoad(Target) ReadAcquire64(Target)
+#define EmuRingStore(Target, Value) WriteRelease64((Target), (Value))
+#else
+#define EmuRingLoad(Target) __atomic_load_n((Target), __ATOMIC_ACQUIRE)
+#define EmuRingStore(Target, Value) __atomic_store_n((Target), (Value), __ATOMIC_RELEASE)
+#endif
+
+FORCEINLINE
+ULONG
+EmuRingSlotSize(
+	IN ULONG RecordSize)
+{
+	return (ULONG)sizeof(LONG64) + ((RecordSize + 7) & ~7u);
+}
+
+FORCEINLINE
+ULONG
+EmuRingSize(
+	IN ULONG RecordSize,
+	IN ULONG Capacity)
+/*++
+
+Routine Description:
+
+	Returns the bytes of a ring of Capacity records of RecordSize bytes.
+
+--*/
+{
+	return EMU_RING_SLOTS_OFFSET + EmuRingSlotSize(RecordSize) * Capacity;
+}
+
+FORCEINLINE
+VOID
+EmuRingInitialize(
+	OUT PEMU_RING_WRITER Writer,
+	OUT PVOID Ring,
+	OUT volatile LONG* WaitMask,
+	IN ULONG RecordSize,
+	IN ULONG Capacity)
+/*++
+
+Routine Description:
+
+	Lays out an empty ring in a zeroed block of EmuRingSize bytes and sets up
+	the writer on it and on the WaitMask the readers share. Capacity must be
+	a power of two.
+
+--*/
+{
+	PEMU_RING_HEADER header = (PEMU_RING_HEADER)Ring;
+	ULONG slotSize = EmuRingSlotSize(RecordSize);
+
+	Writer->Header = header;
+	Writer->WaitMask = WaitMask;
+	Writer->Slots = (PUCHAR)Ring + EMU_RING_SLOTS_OFFSET;
+	Writer->RecordSize = RecordSize;
+	Writer->SlotSize = slotSize;
+	Writer->Mask = Capacity - 1;
+	Writer->Sequence = 0;
+
+	header->RecordSize = RecordSize;
+	header->SlotSize = slotSize;
+	header->Capacity = Capacity;
+	header->Reserved = 0;
+	*WaitMask = 0;
+	header->Version = EMU_RING_VERSION;
+	EmuRingStore(&header->WriteSequence, 0);
+	header->Magic = EMU_RING_MAGIC;
+}
+
+FORCEINLINE
+VOID
+EmuRingWrite(
+	IN OUT PEMU_RING_WRITER Writer,
+	IN const VOID* Record)
+/*++
+
+Routine Description:
+
+	Writes one record over the oldest slot and publishes it. Callers
+	serialize the writes and call EmuRingTakeWaiters once a batch is out.
+
+--*/
+{
+	volatile LONG64* stamp = (volatile LONG64*)(Writer->Slots + (size_t)(Writer->Sequence & Writer->Mask) * Writer->SlotSize);
+
+	EmuRingStore(stamp, EMU_RING_STAMP_BUSY);
+	//the busy stamp must be visible before any byte of the record changes
+	MemoryBarrier();
+	RtlCopyMemory((PUCHAR)stamp + sizeof(LONG64), Record, Writer->RecordSize);
+	EmuRingStore(stamp, Writer->Sequence);
+	Writer->Sequence++;
+	EmuRingStore(&Writer->Header->WriteSequence, Writer->Sequence);
+}
+
+FORCEINLINE
+ULONG
+EmuRingTakeWaiters(
+	IN PEMU_RING_WRITER Writer)
+/*++
+
+Routine Description:
+
+	Returns and clears the WaitMask bits of the readers that blocked since
+	the last call. Their events must be signalled.
+
+--*/
+{
+	//pairs with the reader setting its bit before checking WriteSequence
+	MemoryBarrier();
+	if (*Writer->WaitMask == 0)
+		return 0;
+	return (ULONG)InterlockedExchange(Writer->WaitMask, 0);
+}
+
+FORCEINLINE
+BOOLEAN
+EmuRingAttach(
+	OUT PEMU_RING_READER Reader,
+	IN const VOID* Ring,
+	IN ULONG Size,
+	IN volatile LONG* WaitMask)
+/*++
+
+Routine Description:
+
+	Checks the layout of a mapped ring of Size bytes and sets up a reader on
+	it and on the WaitMask of the ring. The reader starts at the next record
+	written, older ones are skipped. The ring itself is only ever read.
+
+Return Value:
+
+	TRUE if the ring is valid,
+	FALSE otherwise.
+
+--*/
+{
+	const EMU_RING_HEADER* header = (const EMU_RING_HEADER*)Ring;
+
+	if (Size < EMU_RING_SLOTS_OFFSET || header->Magic != EMU_RING_MAGIC || header->Version != EMU_RING_VERSION)
+		return FALSE;
+	if (header->Capacity == 0 || (header->Capacity & (header->Capacity - 1)) != 0 ||
+		header->SlotSize != EmuRingSlotSize(header->RecordSize) ||
+		header->Capacity > (Size - EMU_RING_SLOTS_OFFSET) / header->SlotSize)
+		return FALSE;
+
+	Reader->Header = header;
+	Reader->WaitMask = WaitMask;
+	Reader->Slots = (const UCHAR*)Ring + EMU_RING_SLOTS_OFFSET;
+	Reader->RecordSize = header->RecordSize;
+	Reader->SlotSize = header->SlotSize;
+	Reader->Mask = header->Capacity - 1;
+	Reader->Sequence = EmuRingLoad(&header->WriteSequence);
+	Reader->Lost = 0;
+	return TRUE;
+}
+
+FORCEINLINE
+BOOLEAN
+EmuRingRead(
+	IN OUT PEMU_RING_READER Reader,
+	OUT PVOID Record)
+/*++
+
+Routine Description:
+
+	Copies the next record out of the ring. A reader that fell more than a
+	ring behind skips to the oldest record still held and counts the skipped
+	ones in Lost.
+
+Return Value:
+
+	TRUE if a record was copied,
+	FALSE if the reader caught up with the writer.
+
+--*/
+{
+	for (;;)
+	{
+		LONG64 written = EmuRingLoad(&Reader->Header->WriteSequence);
+		LONG64 oldest = written - (LONG64)Reader->Mask - 1;
+		const volatile LONG64* stamp;
+		LONG64 before, after;
+
+		if (Reader->Sequence >= written)
+			return FALSE;
+		if (Reader->Sequence < oldest) {
+			Reader->Lost += (ULONG64)(oldest - Reader->Sequence);
+			Reader->Sequence = oldest;
+		}
+
+		stamp = (const volatile LONG64*)(Reader->Slots + (size_t)(Reader->Sequence & Reader->Mask) * Reader->SlotSize);
+		before = EmuRingLoad(stamp);
+		RtlCopyMemory(Record, (const UCHAR*)stamp + sizeof(LONG64), Reader->RecordSize);
+		//the copy must be complete before the stamp is checked again
+		MemoryBarrier();
+		after = EmuRingLoad(stamp);
+		if (before == Reader->Sequence && after == Reader->Sequence) {
+			Reader->Sequence++;
+			return TRUE;
+		}
+		//the writer lapped us while copying, start over from the oldest record
+		Reader->Lost++;
+		Reader->Sequence++;
+	}
+}
+
+FORCEINLINE
+BOOLEAN
+EmuRingPrepareWait(
+	IN PEMU_RING_READER Reader,
+	IN ULONG ReaderIndex)
+/*++
+
+Routine Description:
+
+	Announces that the reader is about to block on its event.
+
+Return Value:
+
+	TRUE if the ring is still empty and the reader must wait,
+	FALSE if records arrived meanwhile and the reader must read them instead.
+
+--*/
+{
+	LONG bit = (LONG)(1u << (ReaderIndex % EMU_RING_MAX_READERS));
+
+	InterlockedOr(Reader->WaitMask, bit);
+	if (EmuRingLoad(&Reader->Header->WriteSequence) == Reader->Sequence)
+		return TRUE;
+	InterlockedAnd(Reader->WaitMask, ~bit);
+	return FALSE;
+}
+
+#endif // CAPTURERING_H
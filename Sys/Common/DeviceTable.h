@@ -0,0 +1,215 @@
+/*++
+
+Module Name:
+
+	DeviceTable.h
+
+Abstract:
+
+	Stable 32-bit handles for the filtered devices. A handle is derived
+	from the instance ID of the device, so the same keyboard or mouse gets
+	the same handle after it is unplugged and plugged back or the machine
+	restarts, while its index in the device collection may change.
+
+	Handles are kept in a small open addressed table with linear probing.
+	Besides the handle each entry holds a second hash of the instance ID,
+	which tells two devices whose handles collide apart; the later one
+	takes the next free handle. An entry outlives its device when the
+	driver parks the configuration of the device in it, and the device
+	gets both its handle and its configuration back when it returns.
+
+	The table does not own the devices or the parked configurations and
+	does no locking, the drivers guard it with their own locks.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef DEVICETABLE_H
+#define DEVICETABLE_H
+
+#include "EmuTypes.h"
+
+//
+//Number of entries, a power of two. Configurations are parked only while
+//the table is at most half full, so live devices always find a free entry.
+//
+#define EMU_DEVICE_TABLE_SIZE 128
+
+//
+//Never handed out, marks a free entry and a session without a device
+//
+#define EMU_DEVICE_HANDLE_NONE 0
+
+#define EMU_DEVICE_HANDLE_SEED 0x811C9DC5
+#define EMU_DEVICE_IDENTITY_SEED 0x050C5D1F
+
+typedef struct _EMU_DEVICE_ENTRY {
+	//
+	//Handle of the device, EMU_DEVICE_HANDLE_NONE if the entry is free
+	//
+	ULONG Handle;
+	//
+	//Second hash of the instance ID, tells colliding devices apart
+	//
+	ULONG Identity;
+	//
+	//Extension of the device while it is present, NULL otherwise
+	//
+	PVOID Device;
+	//
+	//Configuration kept for the device while it is gone, may be NULL
+	//
+	PVOID Parked;
+
+} EMU_DEVICE_ENTRY, * PEMU_DEVICE_ENTRY;
+
+typedef struct _EMU_DEVICE_TABLE {
+	EMU_DEVICE_ENTRY Entries[EMU_DEVICE_TABLE_SIZE];
+	//
+	//Number of entries in use
+	//
+	ULONG Count;
+
+} EMU_DEVICE_TABLE, * PEMU_DEVICE_TABLE;
+
+FORCEINLINE
+ULONG
+EmuHashDeviceId(
+	IN const UCHAR* Id,
+	IN ULONG Length,
+	IN ULONG Seed)
+/*++
+
+Routine Description:
+
+	FNV-1a hash of an instance ID. Callers upcase the ID first, instance
+	IDs are case insensitive.
+
+--*/
+{
+	ULONG hash = Seed;
+
+	for (ULONG i = 0; i < Length; i++)
+	{
+		hash ^= Id[i];
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+FORCEINLINE
+PEMU_DEVICE_ENTRY
+EmuDeviceTableFind(
+	IN PEMU_DEVICE_TABLE Table,
+	IN ULONG Handle)
+/*++
+
+Routine Description:
+
+	Returns the entry of a handle, NULL if there is none.
+
+--*/
+{
+	ULONG slot = Handle & (EMU_DEVICE_TABLE_SIZE - 1);
+
+	if (Handle == EMU_DEVICE_HANDLE_NONE)
+		return NULL;
+	for (ULONG probes = 0; probes < EMU_DEVICE_TABLE_SIZE; probes++)
+	{
+		PEMU_DEVICE_ENTRY entry = &Table->Entries[slot];
+		if (entry->Handle == Handle)
+			return entry;
+		if (entry->Handle == EMU_DEVICE_HANDLE_NONE)
+			return NULL;
+		slot = (slot + 1) & (EMU_DEVICE_TABLE_SIZE - 1);
+	}
+	return NULL;
+}
+
+FORCEINLINE
+PEMU_DEVICE_ENTRY
+EmuDeviceTableClaim(
+	IN OUT PEMU_DEVICE_TABLE Table,
+	IN ULONG Handle,
+	IN ULONG Identity)
+/*++
+
+Routine Description:
+
+	Returns the entry of the device with the given hashes. A device seen
+	before gets its old entry back with whatever was parked in it, a new
+	device gets a free entry under the first handle from Handle on that
+	no other device holds.
+
+Return Value:
+
+	The entry of the device,
+	NULL if the table is full.
+
+--*/
+{
+	PEMU_DEVICE_ENTRY entry;
+
+	if (Table->Count >= EMU_DEVICE_TABLE_SIZE)
+		return NULL;
+	for (;;)
+	{
+		if (Handle == EMU_DEVICE_HANDLE_NONE)
+			Handle++;
+		entry = EmuDeviceTableFind(Table, Handle);
+		if (entry == NULL)
+			break;
+		if (entry->Identity == Identity && entry->Device == NULL)
+			return entry;
+		Handle++;
+	}
+
+	entry = &Table->Entries[Handle & (EMU_DEVICE_TABLE_SIZE - 1)];
+	while (entry->Handle != EMU_DEVICE_HANDLE_NONE)
+		entry = &Table->Entries[(entry - Table->Entries + 1) & (EMU_DEVICE_TABLE_SIZE - 1)];
+	entry->Handle = Handle;
+	entry->Identity = Identity;
+	entry->Device = NULL;
+	entry->Parked = NULL;
+	Table->Count++;
+	return entry;
+}
+
+FORCEINLINE
+VOID
+EmuDeviceTableRemove(
+	IN OUT PEMU_DEVICE_TABLE Table,
+	IN PEMU_DEVICE_ENTRY Entry)
+/*++
+
+Routine Description:
+
+	Frees an entry. The entries after it in its probe run are moved back
+	so that lookups never stop early at the hole.
+
+--*/
+{
+	ULONG hole = (ULONG)(Entry - Table->Entries);
+	ULONG slot = hole;
+
+	for (;;)
+	{
+		ULONG home;
+		slot = (slot + 1) & (EMU_DEVICE_TABLE_SIZE - 1);
+		if (Table->Entries[slot].Handle == EMU_DEVICE_HANDLE_NONE)
+			break;
+		home = Table->Entries[slot].Handle & (EMU_DEVICE_TABLE_SIZE - 1);
+		//move the entry only if the hole lies between its home slot and where it sits
+		if (((slot - home) & (EMU_DEVICE_TABLE_SIZE - 1)) >= ((slot - hole) & (EMU_DEVICE_TABLE_SIZE - 1))) {
+			Table->Entries[hole] = Table->Entries[slot];
+			hole = slot;
+		}
+	}
+	RtlZeroMemory(&Table->Entries[hole], sizeof(EMU_DEVICE_ENTRY));
+	Table->Count--;
+}
+
+#endif // DEVICETABLE_H
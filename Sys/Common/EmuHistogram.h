@@ -0,0 +1,247 @@
+/*++
+
+Module Name:
+
+	EmuHistogram.h
+
+Abstract:
+
+	Log-linear histograms for the latencies and batch sizes of the drivers.
+
+	Values below EMU_HIST_SUB_COUNT get a bucket each. Every power of two
+	above is split into EMU_HIST_SUB_COUNT equal buckets, so a bucket is
+	never wider than 1/EMU_HIST_SUB_COUNT of the values it holds and the
+	whole 32-bit range fits in EMU_HIST_BUCKETS counters. Larger values
+	land in the last bucket, negative ones in the first.
+
+	Recording is a plain increment of one counter. The drivers keep a set
+	of histograms per processor and record at DISPATCH_LEVEL, readers add
+	the sets of all processors up. Counters wrap at 32 bits; differences
+	between two snapshots stay exact as long as a bucket gets fewer than
+	2^32 values in between.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef EMUHISTOGRAM_H
+#define EMUHISTOGRAM_H
+
+#include "EmuTypes.h"
+
+//
+//Linear buckets per power of two, 1 << EMU_HIST_SUB_BITS
+//
+#define EMU_HIST_SUB_BITS 3
+#define EMU_HIST_SUB_COUNT (1 << EMU_HIST_SUB_BITS)
+#define EMU_HIST_BUCKETS ((32 - EMU_HIST_SUB_BITS + 1) * EMU_HIST_SUB_COUNT)
+
+//
+//Parts per million of EmuHistogramValueAt, 990000 is the 99th percentile
+//
+#define EMU_HIST_PPM 1000000
+
+typedef enum _EMU_HIST {
+	//Performance counter ticks a service callback spent on a batch before passing it on or dropping it
+	EMU_HIST_CALLBACK,
+	//Packets per service callback
+	EMU_HIST_BATCH,
+	//Performance counter ticks from an injection call until the class service returned
+	EMU_HIST_INJECT,
+	EMU_HIST_COUNT
+} EMU_HIST;
+
+typedef struct _EMU_HISTOGRAM {
+	ULONG Counts[EMU_HIST_BUCKETS];
+
+} EMU_HISTOGRAM, * PEMU_HISTOGRAM;
+
+FORCEINLINE
+ULONG
+EmuHistogramHighBit(
+	IN ULONG Value)
+{
+#ifdef _WIN32
+	ULONG index;
+
+	_BitScanReverse(&index, Value);
+	return index;
+#else
+	return 31 - (ULONG)__builtin_clz(Value);
+#endif
+}
+
+FORCEINLINE
+ULONG
+EmuHistogramBucket(
+	IN LONG64 Value)
+/*++
+
+Routine Description:
+
+	Returns the bucket of a value.
+
+--*/
+{
+	ULONG value;
+	ULONG shift;
+
+	if (Value <= 0)
+		return 0;
+	value = Value > 0xFFFFFFFF ? 0xFFFFFFFF : (ULONG)Value;
+	if (value < EMU_HIST_SUB_COUNT)
+		return value;
+	shift = EmuHistogramHighBit(value) - EMU_HIST_SUB_BITS;
+	return (shift + 1) * EMU_HIST_SUB_COUNT + ((value >> shift) & (EMU_HIST_SUB_COUNT - 1));
+}
+
+FORCEINLINE
+ULONG
+EmuHistogramBucketLow(
+	IN ULONG Bucket)
+/*++
+
+Routine Description:
+
+	Returns the smallest value of a bucket.
+
+--*/
+{
+	ULONG shift;
+
+	if (Bucket < EMU_HIST_SUB_COUNT)
+		return Bucket;
+	shift = Bucket / EMU_HIST_SUB_COUNT - 1;
+	return (EMU_HIST_SUB_COUNT + Bucket % EMU_HIST_SUB_COUNT) << shift;
+}
+
+FORCEINLINE
+ULONG
+EmuHistogramBucketHigh(
+	IN ULONG Bucket)
+/*++
+
+Routine Description:
+
+	Returns the largest value of a bucket.
+
+--*/
+{
+	if (Bucket < EMU_HIST_SUB_COUNT)
+		return Bucket;
+	return EmuHistogramBucketLow(Bucket) + ((1u << (Bucket / EMU_HIST_SUB_COUNT - 1)) - 1);
+}
+
+FORCEINLINE
+VOID
+EmuHistogramRecord(
+	IN OUT PEMU_HISTOGRAM Histogram,
+	IN LONG64 Value)
+/*++
+
+Routine Description:
+
+	Counts a value. The caller must not be preempted by another writer of
+	the same histogram, in the drivers it runs at DISPATCH_LEVEL on the
+	processor the histogram belongs to.
+
+--*/
+{
+	Histogram->Counts[EmuHistogramBucket(Value)]++;
+}
+
+FORCEINLINE
+VOID
+EmuHistogramAccumulate(
+	IN OUT PEMU_HISTOGRAM Total,
+	IN const EMU_HISTOGRAM* Histogram)
+/*++
+
+Routine Description:
+
+	Adds a histogram that may be recorded into meanwhile to a total.
+
+--*/
+{
+	for (ULONG i = 0; i < EMU_HIST_BUCKETS; i++)
+		Total->Counts[i] += *(const volatile ULONG*)&Histogram->Counts[i];
+}
+
+FORCEINLINE
+VOID
+EmuHistogramSubtract(
+	IN OUT PEMU_HISTOGRAM Histogram,
+	IN const EMU_HISTOGRAM* Base)
+/*++
+
+Routine Description:
+
+	Leaves what was recorded after the snapshot Base in a later snapshot.
+
+--*/
+{
+	for (ULONG i = 0; i < EMU_HIST_BUCKETS; i++)
+		Histogram->Counts[i] -= Base->Counts[i];
+}
+
+FORCEINLINE
+ULONG64
+EmuHistogramTotal(
+	IN const EMU_HISTOGRAM* Histogram)
+{
+	ULONG64 total = 0;
+
+	for (ULONG i = 0; i < EMU_HIST_BUCKETS; i++)
+		total += Histogram->Counts[i];
+	return total;
+}
+
+FORCEINLINE
+ULONG
+EmuHistogramValueAt(
+	IN const EMU_HISTOGRAM* Histogram,
+	IN ULONG PartsPerMillion)
+/*++
+
+Routine Description:
+
+	Returns the value at a quantile, the largest value of the bucket that
+	holds it, so the true value is at most that high.
+
+Arguments:
+
+	Histogram - Histogram to look into.
+
+	PartsPerMillion - Quantile in parts of EMU_HIST_PPM, EMU_HIST_PPM for
+		the maximum.
+
+Return Value:
+
+	The value at the quantile,
+	0 if the histogram is empty.
+
+--*/
+{
+	ULONG64 total = EmuHistogramTotal(Histogram);
+	ULONG64 rank;
+	ULONG64 seen = 0;
+
+	if (total == 0)
+		return 0;
+	if (PartsPerMillion > EMU_HIST_PPM)
+		PartsPerMillion = EMU_HIST_PPM;
+	rank = (total * PartsPerMillion + EMU_HIST_PPM - 1) / EMU_HIST_PPM;
+	if (rank == 0)
+		rank = 1;
+	for (ULONG i = 0; i < EMU_HIST_BUCKETS; i++)
+	{
+		seen += Histogram->Counts[i];
+		if (seen >= rank)
+			return EmuHistogramBucketHigh(i);
+	}
+	return EmuHistogramBucketHigh(EMU_HIST_BUCKETS - 1);
+}
+
+#endif // EMUHISTOGRAM_H
@@ -0,0 +1,218 @@
+/*++
+
+Module Name:
+
+	EmuStats.h
+
+Abstract:
+
+	Packet counters of a device and hit counters of a rule table, kept per
+	processor so the service callbacks never write a cache line another
+	processor writes as well.
+
+	A block holds one area per processor, each starting on a cache line:
+	an EMU_STATS_SLOT with the packet counters, followed by one counter per
+	rule rounded up to whole cache lines. Writers run at DISPATCH_LEVEL on
+	the processor whose area they update, so a plain add is enough. Readers
+	sum the areas of all processors; the sum is a snapshot that may miss
+	the adds in flight, and a 32-bit reader may see a counter torn while it
+	carries into its high half.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef EMUSTATS_H
+#define EMUSTATS_H
+
+#include "EmuTypes.h"
+
+#define EMU_STATS_CACHE_LINE 64
+
+typedef enum _EMU_STAT {
+	//Packets the device reported
+	EMU_STAT_SEEN,
+	//Packets consumed by filters, rules, profile hotkeys or the autofire trigger
+	EMU_STAT_DROPPED,
+	//Packets changed by modify entries or rules
+	EMU_STAT_MODIFIED,
+	//Packets inserted from user mode
+	EMU_STAT_INJECTED,
+	//Packets the driver synthesized, the autofire presses and releases
+	EMU_STAT_EXPANDED,
+	EMU_STAT_COUNT
+} EMU_STAT;
+
+typedef struct _EMU_STATS_SLOT {
+	ULONG64 Counters[EMU_STAT_COUNT];
+	//
+	//Fills the slot up to a cache line
+	//
+	ULONG64 Padding[EMU_STATS_CACHE_LINE / sizeof(ULONG64) - EMU_STAT_COUNT];
+
+} EMU_STATS_SLOT, * PEMU_STATS_SLOT;
+
+typedef struct _EMU_STATS {
+	//
+	//Area of processor 0, cache line aligned
+	//
+	PUCHAR Areas;
+	//
+	//Bytes of an area, the slot followed by the rule counters
+	//
+	ULONG AreaSize;
+	ULONG ProcessorCount;
+	//
+	//Rule counters per area, 0 for the counters of a device
+	//
+	ULONG RuleCount;
+	ULONG Reserved;
+
+} EMU_STATS, * PEMU_STATS;
+
+FORCEINLINE
+ULONG
+EmuStatsAreaSize(
+	IN ULONG RuleCount)
+{
+	return (ULONG)sizeof(EMU_STATS_SLOT) +
+		((RuleCount * (ULONG)sizeof(ULONG64) + EMU_STATS_CACHE_LINE - 1) & ~(ULONG)(EMU_STATS_CACHE_LINE - 1));
+}
+
+FORCEINLINE
+ULONG
+EmuStatsSize(
+	IN ULONG ProcessorCount,
+	IN ULONG RuleCount)
+/*++
+
+Routine Description:
+
+	Returns the bytes of a block for ProcessorCount processors, including
+	the slack to align the areas in a block of any alignment.
+
+--*/
+{
+	return (ULONG)sizeof(EMU_STATS) + EMU_STATS_CACHE_LINE - 1 + ProcessorCount * EmuStatsAreaSize(RuleCount);
+}
+
+FORCEINLINE
+PEMU_STATS
+EmuStatsInitialize(
+	OUT PVOID Block,
+	IN ULONG ProcessorCount,
+	IN ULONG RuleCount)
+/*++
+
+Routine Description:
+
+	Lays out zeroed counters in a block of EmuStatsSize bytes. Processor
+	numbers passed to the other routines must be below ProcessorCount.
+
+--*/
+{
+	PEMU_STATS stats = (PEMU_STATS)Block;
+	size_t areas = ((size_t)(stats + 1) + EMU_STATS_CACHE_LINE - 1) & ~(size_t)(EMU_STATS_CACHE_LINE - 1);
+
+	stats->Areas = (PUCHAR)areas;
+	stats->AreaSize = EmuStatsAreaSize(RuleCount);
+	stats->ProcessorCount = ProcessorCount;
+	stats->RuleCount = RuleCount;
+	stats->Reserved = 0;
+	RtlZeroMemory(stats->Areas, (size_t)ProcessorCount * stats->AreaSize);
+	return stats;
+}
+
+FORCEINLINE
+VOID
+EmuStatsAdd(
+	IN PEMU_STATS Stats,
+	IN ULONG Processor,
+	IN EMU_STAT Stat,
+	IN ULONG Count)
+/*++
+
+Routine Description:
+
+	Adds to a packet counter of the calling processor. The caller must not
+	be preempted by another writer of the same area, in the drivers it runs
+	at DISPATCH_LEVEL.
+
+--*/
+{
+	((PEMU_STATS_SLOT)(Stats->Areas + (size_t)Processor * Stats->AreaSize))->Counters[Stat] += Count;
+}
+
+FORCEINLINE
+PULONG64
+EmuStatsRuleHits(
+	IN OPTIONAL PEMU_STATS Stats,
+	IN ULONG Processor)
+/*++
+
+Routine Description:
+
+	Returns the rule counters of the calling processor, indexed like the
+	rules, under the same rule as EmuStatsAdd.
+
+Return Value:
+
+	The counters,
+	NULL if Stats is NULL or counts no rules.
+
+--*/
+{
+	if (Stats == NULL || Stats->RuleCount == 0)
+		return NULL;
+	return (PULONG64)(Stats->Areas + (size_t)Processor * Stats->AreaSize + sizeof(EMU_STATS_SLOT));
+}
+
+FORCEINLINE
+VOID
+EmuStatsCollect(
+	IN const EMU_STATS* Stats,
+	OUT ULONG64 Counters[EMU_STAT_COUNT])
+/*++
+
+Routine Description:
+
+	Sums the packet counters of all processors.
+
+--*/
+{
+	RtlZeroMemory(Counters, EMU_STAT_COUNT * sizeof(ULONG64));
+	for (ULONG p = 0; p < Stats->ProcessorCount; p++)
+	{
+		const EMU_STATS_SLOT* slot = (const EMU_STATS_SLOT*)(Stats->Areas + (size_t)p * Stats->AreaSize);
+		for (ULONG i = 0; i < EMU_STAT_COUNT; i++)
+			Counters[i] += *(const volatile ULONG64*)&slot->Counters[i];
+	}
+}
+
+FORCEINLINE
+VOID
+EmuStatsCollectRuleHits(
+	IN const EMU_STATS* Stats,
+	OUT PULONG64 Hits,
+	IN ULONG Count)
+/*++
+
+Routine Description:
+
+	Sums the counters of the first Count rules over all processors. Count
+	must not exceed the RuleCount of the block.
+
+--*/
+{
+	RtlZeroMemory(Hits, (size_t)Count * sizeof(ULONG64));
+	for (ULONG p = 0; p < Stats->ProcessorCount; p++)
+	{
+		const ULONG64* row = (const ULONG64*)(Stats->Areas + (size_t)p * Stats->AreaSize + sizeof(EMU_STATS_SLOT));
+		for (ULONG r = 0; r < Count; r++)
+			Hits[r] += *(const volatile ULONG64*)&row[r];
+	}
+}
+
+#endif // EMUSTATS_H
@@ -0,0 +1,63 @@
+/*++
+
+Module Name:
+
+	EmuTransport.h
+
+Abstract:
+
+	Transport the native APIs reach the driver through. By default it is
+	the device object, opened with CreateFileW and driven with
+	DeviceIoControl. A client installs its own transport to run the APIs
+	against anything that answers the same IOCTLs, a driver simulated in
+	process or one in another process.
+
+	A transport hands out opaque handles and completes IOCTLs on them with
+	the buffers laid out as the driver expects. Errors are Win32 error
+	codes, so a transport reports a rule generation mismatch or a pending
+	request the way the device does.
+
+Environment:
+
+	user mode
+
+--*/
+
+#ifndef EMUTRANSPORT_H
+#define EMUTRANSPORT_H
+
+#include "EmuTypes.h"
+
+//
+//Requests on the handle may stay pending and complete through their overlapped
+//
+#define EMU_TRANSPORT_OVERLAPPED 0x0001
+
+#define EMU_TRANSPORT_SUCCESS 0
+//
+//ERROR_IO_PENDING, the request completes later through its overlapped
+//
+#define EMU_TRANSPORT_PENDING 997
+
+//
+//Opens a handle with EMU_TRANSPORT_* flags, returns NULL on failure
+//
+typedef PVOID(*PEMU_TRANSPORT_OPEN)(PVOID Context, ULONG Flags);
+//
+//Sends an IOCTL and returns a Win32 error code. Overlapped is NULL for a request
+//completed before the call returns, otherwise the OVERLAPPED of an async request
+//on a handle opened with EMU_TRANSPORT_OVERLAPPED
+//
+typedef ULONG(*PEMU_TRANSPORT_IOCONTROL)(PVOID Context, PVOID Handle, ULONG IoControlCode,
+	PVOID Input, ULONG InputSize, PVOID Output, ULONG OutputSize, PULONG BytesReturned, PVOID Overlapped);
+typedef VOID(*PEMU_TRANSPORT_CLOSE)(PVOID Context, PVOID Handle);
+
+typedef struct _EMU_TRANSPORT {
+	PVOID Context;
+	PEMU_TRANSPORT_OPEN Open;
+	PEMU_TRANSPORT_IOCONTROL IoControl;
+	PEMU_TRANSPORT_CLOSE Close;
+
+} EMU_TRANSPORT, * PEMU_TRANSPORT;
+
+#endif // EMUTRANSPORT_H
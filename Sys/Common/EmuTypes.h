@@ -0,0 +1,98 @@
+/*++
+
+Module Name:
+
+	EmuTypes.h
+
+Abstract:
+
+	Base types used by the portable parts of the emulator drivers.
+	Kernel and Win32 builds take them from the WDK/SDK headers, every
+	other platform gets the minimal equivalents below so the same
+	sources can be compiled and exercised off target.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef EMUTYPES_H
+#define EMUTYPES_H
+
+#ifndef _WIN32
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t		UCHAR, * PUCHAR;
+typedef uint8_t		BOOLEAN, * PBOOLEAN;
+typedef uint16_t	USHORT, * PUSHORT;
+typedef int16_t		SHORT, * PSHORT;
+typedef uint32_t	ULONG, * PULONG;
+typedef int32_t		LONG, * PLONG;
+typedef int64_t		LONG64, * PLONG64;
+typedef uint64_t	ULONG64, * PULONG64;
+typedef void		* PVOID;
+
+#define VOID void
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#ifndef IN
+#define IN
+#define OUT
+#define OPTIONAL
+#endif
+
+#define FORCEINLINE static inline
+#define FIELD_OFFSET(Type, Field) ((LONG)offsetof(Type, Field))
+#define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+#define RtlCopyMemory(Destination, Source, Length) memcpy((Destination), (Source), (Length))
+
+#define InterlockedOr(Target, Value) __atomic_fetch_or((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedAnd(Target, Value) __atomic_fetch_and((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchange(Target, Value) __atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedIncrement(Target) __atomic_add_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(Target) __atomic_sub_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define MemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+//
+//Input packet layouts as defined by ntddkbd.h and ntddmou.h
+//
+typedef struct _KEYBOARD_INPUT_DATA {
+	USHORT UnitId;
+	USHORT MakeCode;
+	USHORT Flags;
+	USHORT Reserved;
+	ULONG ExtraInformation;
+} KEYBOARD_INPUT_DATA, * PKEYBOARD_INPUT_DATA;
+
+typedef struct _MOUSE_INPUT_DATA {
+	USHORT UnitId;
+	USHORT Flags;
+	union {
+		ULONG Buttons;
+		struct {
+			USHORT ButtonFlags;
+			USHORT ButtonData;
+		};
+	};
+	ULONG RawButtons;
+	LONG LastX;
+	LONG LastY;
+	ULONG ExtraInformation;
+} MOUSE_INPUT_DATA, * PMOUSE_INPUT_DATA;
+
+#define KEY_MAKE	0
+#define KEY_BREAK	1
+#define KEY_E0		2
+#define KEY_E1		4
+
+#endif // !_WIN32
+
+#endif // EMUTYPES_H
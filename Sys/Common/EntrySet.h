@@ -0,0 +1,261 @@
+/*++
+
+Module Name:
+
+	EntrySet.h
+
+Abstract:
+
+	Hash set over the entries of a rule table, so a client editing filters
+	or modifies finds an entry by its value without scanning the table.
+
+	The entries stay in the table of their owner, in the order the driver
+	applies them. The set only maps the value of an entry, packed into a
+	ULONG64 key, to its position in that table. It is an open addressing
+	table with linear probing, kept at most half full so a probe always
+	ends at an empty slot.
+
+	The set does not own its slots. The owner allocates
+	EmuEntrySetSlots(Entries) of them for the most entries it will hold
+	and indexes the table again whenever entries move.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef ENTRYSET_H
+#define ENTRYSET_H
+
+#include "EmuTypes.h"
+
+//
+//Index of an empty slot, and what a lookup of a missing key returns
+//
+#define EMU_ENTRY_NONE 0xFFFFFFFF
+
+#define EMU_ENTRY_SET_MIN_SLOTS 16
+
+typedef struct _EMU_ENTRY_SLOT {
+	//
+	//Value of the entry, valid unless Index is EMU_ENTRY_NONE
+	//
+	ULONG64 Key;
+	//
+	//Position of the entry in the table of the owner
+	//
+	ULONG Index;
+	ULONG Reserved;
+
+} EMU_ENTRY_SLOT, * PEMU_ENTRY_SLOT;
+
+typedef struct _EMU_ENTRY_SET {
+	PEMU_ENTRY_SLOT Slots;
+	//
+	//Slots, a power of two
+	//
+	ULONG Capacity;
+	ULONG Count;
+
+} EMU_ENTRY_SET, * PEMU_ENTRY_SET;
+
+FORCEINLINE
+ULONG
+EmuEntrySetSlots(
+	IN ULONG Entries)
+/*++
+
+Routine Description:
+
+	Returns the slots a set needs to hold up to Entries entries.
+
+--*/
+{
+	ULONG slots = EMU_ENTRY_SET_MIN_SLOTS;
+
+	while (slots / 2 < Entries)
+		slots *= 2;
+	return slots;
+}
+
+FORCEINLINE
+VOID
+EmuEntrySetInitialize(
+	OUT PEMU_ENTRY_SET Set,
+	IN PEMU_ENTRY_SLOT Slots,
+	IN ULONG Capacity)
+/*++
+
+Routine Description:
+
+	Starts an empty set over Capacity slots, a power of two.
+
+--*/
+{
+	ULONG i;
+
+	Set->Slots = Slots;
+	Set->Capacity = Capacity;
+	Set->Count = 0;
+	for (i = 0; i < Capacity; i++)
+		Slots[i].Index = EMU_ENTRY_NONE;
+}
+
+FORCEINLINE
+ULONG
+EmuEntrySetHome(
+	IN const EMU_ENTRY_SET* Set,
+	IN ULONG64 Key)
+/*++
+
+Routine Description:
+
+	Returns the slot a key is probed from. The keys are packed fields of a
+	few bits each, the multiply spreads them over the high bits.
+
+--*/
+{
+	return (ULONG)((Key * 0x9E3779B97F4A7C15ULL) >> 32) & (Set->Capacity - 1);
+}
+
+FORCEINLINE
+ULONG
+EmuEntrySetFind(
+	IN const EMU_ENTRY_SET* Set,
+	IN ULONG64 Key)
+/*++
+
+Return Value:
+
+	The position of the entry with the key,
+	EMU_ENTRY_NONE if there is none.
+
+--*/
+{
+	ULONG slot = EmuEntrySetHome(Set, Key);
+
+	while (Set->Slots[slot].Index != EMU_ENTRY_NONE)
+	{
+		if (Set->Slots[slot].Key == Key)
+			return Set->Slots[slot].Index;
+		slot = (slot + 1) & (Set->Capacity - 1);
+	}
+	return EMU_ENTRY_NONE;
+}
+
+FORCEINLINE
+BOOLEAN
+EmuEntrySetInsert(
+	IN OUT PEMU_ENTRY_SET Set,
+	IN ULONG64 Key,
+	IN ULONG Index)
+/*++
+
+Routine Description:
+
+	Maps a key to the position of its entry, or moves it there if the key
+	is in the set already.
+
+Return Value:
+
+	TRUE if the key is in the set,
+	FALSE if the set holds as many entries as its slots allow.
+
+--*/
+{
+	ULONG slot = EmuEntrySetHome(Set, Key);
+
+	while (Set->Slots[slot].Index != EMU_ENTRY_NONE)
+	{
+		if (Set->Slots[slot].Key == Key) {
+			Set->Slots[slot].Index = Index;
+			return TRUE;
+		}
+		slot = (slot + 1) & (Set->Capacity - 1);
+	}
+	if (Set->Count >= Set->Capacity / 2)
+		return FALSE;
+	Set->Slots[slot].Key = Key;
+	Set->Slots[slot].Index = Index;
+	Set->Count++;
+	return TRUE;
+}
+
+FORCEINLINE
+ULONG
+EmuEntrySetRemove(
+	IN OUT PEMU_ENTRY_SET Set,
+	IN ULONG64 Key)
+/*++
+
+Routine Description:
+
+	Removes a key. The slots probed after it move back into the gap, so
+	lookups never need to skip over removed slots.
+
+Return Value:
+
+	The position the key was mapped to,
+	EMU_ENTRY_NONE if it was not in the set.
+
+--*/
+{
+	ULONG mask = Set->Capacity - 1;
+	ULONG slot = EmuEntrySetHome(Set, Key);
+	ULONG next;
+	ULONG index;
+
+	while (Set->Slots[slot].Key != Key || Set->Slots[slot].Index == EMU_ENTRY_NONE)
+	{
+		if (Set->Slots[slot].Index == EMU_ENTRY_NONE)
+			return EMU_ENTRY_NONE;
+		slot = (slot + 1) & mask;
+	}
+	index = Set->Slots[slot].Index;
+
+	next = slot;
+	for (;;)
+	{
+		ULONG home;
+
+		next = (next + 1) & mask;
+		if (Set->Slots[next].Index == EMU_ENTRY_NONE)
+			break;
+		//a key stays if its home lies cyclically after the gap, up to its slot
+		home = EmuEntrySetHome(Set, Set->Slots[next].Key);
+		if (((next - home) & mask) < ((next - slot) & mask))
+			continue;
+		Set->Slots[slot] = Set->Slots[next];
+		slot = next;
+	}
+	Set->Slots[slot].Index = EMU_ENTRY_NONE;
+	Set->Count--;
+	return index;
+}
+
+FORCEINLINE
+VOID
+EmuEntrySetMove(
+	IN OUT PEMU_ENTRY_SET Target,
+	IN const EMU_ENTRY_SET* Source)
+/*++
+
+Routine Description:
+
+	Inserts the keys of a set into an empty one with room for them, when
+	the slots are grown. Entries the source no longer finds stay missing,
+	unlike when the table is indexed again.
+
+--*/
+{
+	ULONG i;
+
+	for (i = 0; i < Source->Capacity; i++)
+	{
+		if (Source->Slots[i].Index != EMU_ENTRY_NONE)
+			EmuEntrySetInsert(Target, Source->Slots[i].Key, Source->Slots[i].Index);
+	}
+}
+
+#endif // ENTRYSET_H
@@ -0,0 +1,498 @@
+/*++
+
+Module Name:
+
+	InputRecording.h
+
+Abstract:
+
+	Compact encoding of timestamped keyboard and mouse input for recorded
+	sessions. A recording starts with an EMU_REC_HEADER, every event after
+	it is encoded against the EMU_REC_STATE left by the event before, so a
+	stream must be decoded from where its state was reset.
+
+	All integers are LEB128 varints. An event carries the time since the
+	previous event, a keyboard event then either the index of a recently
+	seen packet or the packet itself, which joins the dictionary of recent
+	packets. A mouse event starts with a mask of the fields that differ
+	from the previous packet; relative motion is stored zig-zag encoded,
+	absolute positions as the zig-zag encoded move from the last position.
+
+	Encoding takes at most EMU_REC_MAX_EVENT bytes per event. Decoding
+	checks every read against the end of the input and stops at the first
+	event that doesn't fit.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef INPUTRECORDING_H
+#define INPUTRECORDING_H
+
+#include "EmuTypes.h"
+
+#define EMU_REC_MAGIC 0x43455245 // 'EREC'
+#define EMU_REC_VERSION 1
+
+#define EMU_REC_KEYBOARD 1
+#define EMU_REC_MOUSE 2
+
+//
+//Worst case size of one encoded event, varints take up to 10 bytes
+//
+#define EMU_REC_MAX_EVENT 64
+
+//
+//Recent keyboard packets, replaced round robin once full
+//
+#define EMU_REC_DICT_SIZE 128
+
+//
+//Keyboard token of a packet spelled out after it
+//
+#define EMU_REC_LITERAL 0x80
+
+//
+//Mask bits of a mouse event, set for the fields that follow
+//
+#define EMU_REC_MOUSE_FLAGS 0x01
+#define EMU_REC_MOUSE_BUTTON_FLAGS 0x02
+#define EMU_REC_MOUSE_BUTTON_DATA 0x04
+#define EMU_REC_MOUSE_X 0x08
+#define EMU_REC_MOUSE_Y 0x10
+#define EMU_REC_MOUSE_UNIT 0x20
+#define EMU_REC_MOUSE_RAW_BUTTONS 0x40
+#define EMU_REC_MOUSE_EXTRA 0x80
+
+//
+//MOUSE_MOVE_ABSOLUTE of ntddmou.h
+//
+#define EMU_REC_MOUSE_ABSOLUTE 0x0001
+
+typedef struct _EMU_REC_HEADER {
+	//
+	//EMU_REC_MAGIC
+	//
+	ULONG Magic;
+	//
+	//EMU_REC_VERSION
+	//
+	USHORT Version;
+	//
+	//EMU_REC_KEYBOARD or EMU_REC_MOUSE
+	//
+	USHORT Kind;
+	//
+	//Time units per second
+	//
+	LONG64 Frequency;
+
+} EMU_REC_HEADER, * PEMU_REC_HEADER;
+
+typedef struct _EMU_REC_STATE {
+	//
+	//Time of the previous event
+	//
+	LONG64 Time;
+	ULONG DictCount;
+	//
+	//Entry the next new keyboard packet replaces once the dictionary is full
+	//
+	ULONG DictNext;
+	KEYBOARD_INPUT_DATA Dict[EMU_REC_DICT_SIZE];
+	//
+	//Previous mouse packet
+	//
+	MOUSE_INPUT_DATA Mouse;
+
+} EMU_REC_STATE, * PEMU_REC_STATE;
+
+FORCEINLINE
+ULONG
+EmuRecPutVarint(
+	OUT PUCHAR Out,
+	IN ULONG64 Value)
+{
+	ULONG length = 0;
+
+	while (Value >= 0x80)
+	{
+		Out[length++] = (UCHAR)(Value | 0x80);
+		Value >>= 7;
+	}
+	Out[length++] = (UCHAR)Value;
+	return length;
+}
+
+FORCEINLINE
+BOOLEAN
+EmuRecGetVarint(
+	IN OUT const UCHAR** Cursor,
+	IN const UCHAR* End,
+	OUT PULONG64 Value)
+{
+	const UCHAR* next = *Cursor;
+	ULONG64 value = 0;
+
+	for (ULONG shift = 0; shift < 64; shift += 7)
+	{
+		if (next == End)
+			return FALSE;
+		value |= (ULONG64)(*next & 0x7F) << shift;
+		if ((*next++ & 0x80) == 0) {
+			*Cursor = next;
+			*Value = value;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+FORCEINLINE
+ULONG64
+EmuRecZigZag(
+	IN LONG64 Value)
+{
+	return ((ULONG64)Value << 1) ^ (ULONG64)(Value >> 63);
+}
+
+FORCEINLINE
+LONG64
+EmuRecUnZigZag(
+	IN ULONG64 Value)
+{
+	return (LONG64)(Value >> 1) ^ -(LONG64)(Value & 1);
+}
+
+FORCEINLINE
+VOID
+EmuRecReset(
+	OUT PEMU_REC_STATE State,
+	IN LONG64 Time)
+/*++
+
+Routine Description:
+
+	Starts a stream whose first event is encoded against Time.
+
+--*/
+{
+	RtlZeroMemory(State, sizeof(EMU_REC_STATE));
+	State->Time = Time;
+}
+
+FORCEINLINE
+ULONG
+EmuRecWriteHeader(
+	OUT PVOID Out,
+	IN USHORT Kind,
+	IN LONG64 Frequency)
+{
+	EMU_REC_HEADER header;
+
+	header.Magic = EMU_REC_MAGIC;
+	header.Version = EMU_REC_VERSION;
+	header.Kind = Kind;
+	header.Frequency = Frequency;
+	RtlCopyMemory(Out, &header, sizeof(header));
+	return (ULONG)sizeof(header);
+}
+
+FORCEINLINE
+BOOLEAN
+EmuRecReadHeader(
+	IN const VOID* In,
+	IN size_t Size,
+	IN USHORT Kind,
+	OUT PEMU_REC_HEADER Header)
+/*++
+
+Routine Description:
+
+	Reads the header of a recording and checks that this version can
+	decode it and that it holds the expected kind of input.
+
+--*/
+{
+	if (Size < sizeof(EMU_REC_HEADER))
+		return FALSE;
+	RtlCopyMemory(Header, In, sizeof(EMU_REC_HEADER));
+	return Header->Magic == EMU_REC_MAGIC && Header->Version == EMU_REC_VERSION &&
+		Header->Kind == Kind && Header->Frequency > 0;
+}
+
+FORCEINLINE
+ULONG
+EmuRecPutTime(
+	IN OUT PEMU_REC_STATE State,
+	OUT PUCHAR Out,
+	IN LONG64 Time)
+{
+	//time never runs backwards in a recording, out of order events keep the previous time
+	ULONG64 delta = Time > State->Time ? (ULONG64)(Time - State->Time) : 0;
+
+	State->Time += (LONG64)delta;
+	return EmuRecPutVarint(Out, delta);
+}
+
+FORCEINLINE
+ULONG
+EmuRecEncodeKeyboard(
+	IN OUT PEMU_REC_STATE State,
+	IN LONG64 Time,
+	IN const KEYBOARD_INPUT_DATA* Input,
+	OUT PUCHAR Out)
+/*++
+
+Routine Description:
+
+	Encodes a keyboard event into a buffer of at least EMU_REC_MAX_EVENT
+	bytes and returns its length.
+
+--*/
+{
+	ULONG length = EmuRecPutTime(State, Out, Time);
+	PKEYBOARD_INPUT_DATA entry;
+
+	for (ULONG i = 0; i < State->DictCount; i++)
+	{
+		entry = &State->Dict[i];
+		if (entry->MakeCode == Input->MakeCode && entry->Flags == Input->Flags &&
+			entry->UnitId == Input->UnitId && entry->ExtraInformation == Input->ExtraInformation) {
+			Out[length++] = (UCHAR)i;
+			return length;
+		}
+	}
+
+	Out[length++] = EMU_REC_LITERAL;
+	length += EmuRecPutVarint(Out + length, Input->MakeCode);
+	length += EmuRecPutVarint(Out + length, Input->Flags);
+	length += EmuRecPutVarint(Out + length, Input->UnitId);
+	length += EmuRecPutVarint(Out + length, Input->ExtraInformation);
+
+	entry = &State->Dict[State->DictNext];
+	RtlZeroMemory(entry, sizeof(KEYBOARD_INPUT_DATA));
+	entry->MakeCode = Input->MakeCode;
+	entry->Flags = Input->Flags;
+	entry->UnitId = Input->UnitId;
+	entry->ExtraInformation = Input->ExtraInformation;
+	State->DictNext = (State->DictNext + 1) % EMU_REC_DICT_SIZE;
+	if (State->DictCount < EMU_REC_DICT_SIZE)
+		State->DictCount++;
+	return length;
+}
+
+FORCEINLINE
+BOOLEAN
+EmuRecDecodeKeyboard(
+	IN OUT PEMU_REC_STATE State,
+	IN OUT const UCHAR** Cursor,
+	IN const UCHAR* End,
+	OUT PLONG64 Time,
+	OUT PKEYBOARD_INPUT_DATA Input)
+/*++
+
+Routine Description:
+
+	Decodes the keyboard event at Cursor and moves Cursor past it.
+
+Return Value:
+
+	TRUE if an event was decoded,
+	FALSE if the input ends or is not a valid event.
+
+--*/
+{
+	const UCHAR* next = *Cursor;
+	ULONG64 delta, makeCode, flags, unitId, extra;
+	PKEYBOARD_INPUT_DATA entry;
+	UCHAR token;
+
+	if (!EmuRecGetVarint(&next, End, &delta) || next == End)
+		return FALSE;
+	token = *next++;
+	if (token < EMU_REC_LITERAL) {
+		if (token >= State->DictCount)
+			return FALSE;
+		*Input = State->Dict[token];
+	}
+	else {
+		//nothing is changed before the whole event was read
+		if (token != EMU_REC_LITERAL ||
+			!EmuRecGetVarint(&next, End, &makeCode) || !EmuRecGetVarint(&next, End, &flags) ||
+			!EmuRecGetVarint(&next, End, &unitId) || !EmuRecGetVarint(&next, End, &extra))
+			return FALSE;
+		entry = &State->Dict[State->DictNext];
+		RtlZeroMemory(entry, sizeof(KEYBOARD_INPUT_DATA));
+		entry->MakeCode = (USHORT)makeCode;
+		entry->Flags = (USHORT)flags;
+		entry->UnitId = (USHORT)unitId;
+		entry->ExtraInformation = (ULONG)extra;
+		*Input = *entry;
+		State->DictNext = (State->DictNext + 1) % EMU_REC_DICT_SIZE;
+		if (State->DictCount < EMU_REC_DICT_SIZE)
+			State->DictCount++;
+	}
+	State->Time += (LONG64)delta;
+	*Time = State->Time;
+	*Cursor = next;
+	return TRUE;
+}
+
+FORCEINLINE
+ULONG
+EmuRecEncodeMouse(
+	IN OUT PEMU_REC_STATE State,
+	IN LONG64 Time,
+	IN const MOUSE_INPUT_DATA* Input,
+	OUT PUCHAR Out)
+/*++
+
+Routine Description:
+
+	Encodes a mouse event into a buffer of at least EMU_REC_MAX_EVENT
+	bytes and returns its length.
+
+--*/
+{
+	PMOUSE_INPUT_DATA last = &State->Mouse;
+	BOOLEAN absolute = (Input->Flags & EMU_REC_MOUSE_ABSOLUTE) != 0;
+	LONG64 dx = (LONG64)Input->LastX - (absolute ? last->LastX : 0);
+	LONG64 dy = (LONG64)Input->LastY - (absolute ? last->LastY : 0);
+	UCHAR mask = 0;
+	ULONG length;
+
+	if (Input->Flags != last->Flags)
+		mask |= EMU_REC_MOUSE_FLAGS;
+	if (Input->ButtonFlags != 0)
+		mask |= EMU_REC_MOUSE_BUTTON_FLAGS;
+	if (Input->ButtonData != 0)
+		mask |= EMU_REC_MOUSE_BUTTON_DATA;
+	if (dx != 0)
+		mask |= EMU_REC_MOUSE_X;
+	if (dy != 0)
+		mask |= EMU_REC_MOUSE_Y;
+	if (Input->UnitId != last->UnitId)
+		mask |= EMU_REC_MOUSE_UNIT;
+	if (Input->RawButtons != last->RawButtons)
+		mask |= EMU_REC_MOUSE_RAW_BUTTONS;
+	if (Input->ExtraInformation != last->ExtraInformation)
+		mask |= EMU_REC_MOUSE_EXTRA;
+
+	Out[0] = mask;
+	length = 1 + EmuRecPutTime(State, Out + 1, Time);
+	if (mask & EMU_REC_MOUSE_FLAGS)
+		length += EmuRecPutVarint(Out + length, Input->Flags);
+	if (mask & EMU_REC_MOUSE_BUTTON_FLAGS)
+		length += EmuRecPutVarint(Out + length, Input->ButtonFlags);
+	if (mask & EMU_REC_MOUSE_BUTTON_DATA)
+		length += EmuRecPutVarint(Out + length, Input->ButtonData);
+	if (mask & EMU_REC_MOUSE_X)
+		length += EmuRecPutVarint(Out + length, EmuRecZigZag(dx));
+	if (mask & EMU_REC_MOUSE_Y)
+		length += EmuRecPutVarint(Out + length, EmuRecZigZag(dy));
+	if (mask & EMU_REC_MOUSE_UNIT)
+		length += EmuRecPutVarint(Out + length, Input->UnitId);
+	if (mask & EMU_REC_MOUSE_RAW_BUTTONS)
+		length += EmuRecPutVarint(Out + length, Input->RawButtons);
+	if (mask & EMU_REC_MOUSE_EXTRA)
+		length += EmuRecPutVarint(Out + length, Input->ExtraInformation);
+	*last = *Input;
+	return length;
+}
+
+FORCEINLINE
+BOOLEAN
+EmuRecDecodeMouse(
+	IN OUT PEMU_REC_STATE State,
+	IN OUT const UCHAR** Cursor,
+	IN const UCHAR* End,
+	OUT PLONG64 Time,
+	OUT PMOUSE_INPUT_DATA Input)
+/*++
+
+Routine Description:
+
+	Decodes the mouse event at Cursor and moves Cursor past it.
+
+Return Value:
+
+	TRUE if an event was decoded,
+	FALSE if the input ends or is not a valid event.
+
+--*/
+{
+	const UCHAR* next = *Cursor;
+	LONG64 time = State->Time;
+	MOUSE_INPUT_DATA input;
+	ULONG64 value;
+	UCHAR mask;
+
+	if (next == End)
+		return FALSE;
+	mask = *next++;
+	if (!EmuRecGetVarint(&next, End, &value))
+		return FALSE;
+	time += (LONG64)value;
+
+	RtlZeroMemory(&input, sizeof(input));
+	input.Flags = State->Mouse.Flags;
+	input.UnitId = State->Mouse.UnitId;
+	input.RawButtons = State->Mouse.RawButtons;
+	input.ExtraInformation = State->Mouse.ExtraInformation;
+	if (mask & EMU_REC_MOUSE_FLAGS) {
+		if (!EmuRecGetVarint(&next, End, &value))
+			return FALSE;
+		input.Flags = (USHORT)value;
+	}
+	if (mask & EMU_REC_MOUSE_BUTTON_FLAGS) {
+		if (!EmuRecGetVarint(&next, End, &value))
+			return FALSE;
+		input.ButtonFlags = (USHORT)value;
+	}
+	if (mask & EMU_REC_MOUSE_BUTTON_DATA) {
+		if (!EmuRecGetVarint(&next, End, &value))
+			return FALSE;
+		input.ButtonData = (USHORT)value;
+	}
+	if (input.Flags & EMU_REC_MOUSE_ABSOLUTE) {
+		input.LastX = State->Mouse.LastX;
+		input.LastY = State->Mouse.LastY;
+	}
+	if (mask & EMU_REC_MOUSE_X) {
+		if (!EmuRecGetVarint(&next, End, &value))
+			return FALSE;
+		input.LastX = (LONG)(input.LastX + EmuRecUnZigZag(value));
+	}
+	if (mask & EMU_REC_MOUSE_Y) {
+		if (!EmuRecGetVarint(&next, End, &value))
+			return FALSE;
+		input.LastY = (LONG)(input.LastY + EmuRecUnZigZag(value));
+	}
+	if (mask & EMU_REC_MOUSE_UNIT) {
+		if (!EmuRecGetVarint(&next, End, &value))
+			return FALSE;
+		input.UnitId = (USHORT)value;
+	}
+	if (mask & EMU_REC_MOUSE_RAW_BUTTONS) {
+		if (!EmuRecGetVarint(&next, End, &value))
+			return FALSE;
+		input.RawButtons = (ULONG)value;
+	}
+	if (mask & EMU_REC_MOUSE_EXTRA) {
+		if (!EmuRecGetVarint(&next, End, &value))
+			return FALSE;
+		input.ExtraInformation = (ULONG)value;
+	}
+
+	State->Time = time;
+	State->Mouse = input;
+	*Time = time;
+	*Input = input;
+	*Cursor = next;
+	return TRUE;
+}
+
+#endif // INPUTRECORDING_H
@@ -0,0 +1,97 @@
+/*++
+
+Module Name:
+
+	InputState.h
+
+Abstract:
+
+	Live key and button state maintained by the service callbacks and read
+	by the rule conditions of both filters. Every update is a single
+	interlocked bit operation and every query a single load, so service
+	callbacks of different devices can share one block without a lock.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef INPUTSTATE_H
+#define INPUTSTATE_H
+
+#include "EmuTypes.h"
+#include "RuleTypes.h"
+
+//
+//256 scan codes, twice for the E0 prefixed keys
+//
+#define EMU_KEY_STATE_BITS 512
+
+//
+//Every MOUSE_*_BUTTON_DOWN flag, the matching up flag is always the next bit
+//
+#define EMU_BUTTON_DOWN_MASK 0x0155
+
+typedef struct _EMU_INPUT_STATE {
+	//
+	//One bit per held key, indexed by EMU_KEY_INDEX
+	//
+	volatile LONG KeysDown[EMU_KEY_STATE_BITS / 32];
+	//
+	//MOUSE_*_BUTTON_DOWN flags of the held buttons
+	//
+	volatile LONG ButtonsDown;
+
+} EMU_INPUT_STATE, * PEMU_INPUT_STATE;
+
+FORCEINLINE
+BOOLEAN
+EmuIsKeyDown(
+	IN const EMU_INPUT_STATE* State,
+	IN USHORT KeyIndex)
+{
+	return (BOOLEAN)(((ULONG)State->KeysDown[(KeyIndex >> 5) & 0xF] >> (KeyIndex & 31)) & 1);
+}
+
+FORCEINLINE
+BOOLEAN
+EmuIsButtonDown(
+	IN const EMU_INPUT_STATE* State,
+	IN USHORT ButtonDown)
+{
+	return (State->ButtonsDown & ButtonDown) != 0;
+}
+
+FORCEINLINE
+VOID
+EmuTrackKey(
+	IN OUT PEMU_INPUT_STATE State,
+	IN USHORT MakeCode,
+	IN USHORT Flags)
+{
+	USHORT index = EMU_KEY_INDEX(MakeCode, Flags);
+	LONG bit = (LONG)(1UL << (index & 31));
+
+	if (Flags & KEY_BREAK)
+		InterlockedAnd(&State->KeysDown[index >> 5], ~bit);
+	else
+		InterlockedOr(&State->KeysDown[index >> 5], bit);
+}
+
+FORCEINLINE
+VOID
+EmuTrackButtons(
+	IN OUT PEMU_INPUT_STATE State,
+	IN USHORT ButtonFlags)
+{
+	LONG down = ButtonFlags & EMU_BUTTON_DOWN_MASK;
+	LONG up = (ButtonFlags >> 1) & EMU_BUTTON_DOWN_MASK;
+
+	if (down)
+		InterlockedOr(&State->ButtonsDown, down);
+	if (up)
+		InterlockedAnd(&State->ButtonsDown, ~up);
+}
+
+#endif // INPUTSTATE_H
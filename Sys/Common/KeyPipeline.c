@@ -0,0 +1,347 @@
+/*--
+
+Module Name:
+
+	KeyPipeline.c
+
+Abstract:
+
+	Stages of the keyboard service callback shared by KbFilter and the host.
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#include <ntddkbd.h>
+#endif
+#include "KeyPipeline.h"
+#include "SharedRules.h"
+
+static
+VOID
+KeyPipelineRemove(
+	IN OUT PKEYBOARD_INPUT_DATA Inputs,
+	IN OUT PULONG InputCount,
+	IN ULONG Index)
+/*++
+
+Routine Description:
+
+	Removes a consumed packet, moving the ones after it down.
+
+--*/
+{
+	for (ULONG j = Index; j + 1 < *InputCount; j++)
+		Inputs[j] = Inputs[j + 1];
+	(*InputCount)--;
+}
+
+static
+PKEYBOARD_PROFILE
+KeyPipelineSelectProfile(
+	IN OUT PKEY_PIPELINE Pipeline,
+	IN PKEYBOARD_INPUT_DATA Input,
+	IN LONG ActiveProfile)
+/*++
+
+Routine Description:
+
+	Picks the profile that filters and modifies a packet. A press goes through
+	the active profile and ties its key to it, repeats and the release of the
+	key go through the same profile so switching profiles while the key is
+	held can not leave the output of the press stuck.
+
+Arguments:
+
+	Pipeline - Pipeline of the device that generated the input.
+
+	Input - Packet about to be filtered and modified.
+
+	ActiveProfile - Index of the active profile.
+
+Return Value:
+
+	The profile to apply to the packet.
+
+--*/
+{
+	PUCHAR held = &Pipeline->HeldProfiles[EMU_KEY_INDEX(Input->MakeCode, Input->Flags)];
+	LONG index = *held != 0 ? *held - 1 : ActiveProfile;
+
+	*held = (Input->Flags & KEY_BREAK) ? 0 : (UCHAR)(index + 1);
+	return &Pipeline->Profiles[index];
+}
+
+VOID
+KeyPipelineHotkeys(
+	IN OUT PKEY_PIPELINE Pipeline,
+	IN OUT PKEYBOARD_INPUT_DATA Inputs,
+	IN OUT PULONG InputCount,
+	IN OUT PULONG Consumed)
+/*++
+
+Routine Description:
+
+	Activates the profile whose hotkey is pressed. Presses and releases of
+	the hotkeys are consumed so they never reach the system whichever
+	profile is active.
+
+Arguments:
+
+	Pipeline - Pipeline of the device that generated the input.
+
+	Inputs - Packets of the batch.
+
+	InputCount - Packets in Inputs, decremented for every consumed packet.
+
+	Consumed - Incremented for every consumed packet.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	for (ULONG i = 0; i < *InputCount; i++)
+	{
+		LONG profile = -1;
+
+		for (LONG p = 0; p < KEY_PROFILE_COUNT; p++)
+		{
+			if (Pipeline->ProfileHotkeys[p].ScanCode != 0 &&
+				Inputs[i].MakeCode == Pipeline->ProfileHotkeys[p].ScanCode &&
+				(Inputs[i].Flags & (KEY_E0 | KEY_E1)) == Pipeline->ProfileHotkeys[p].Flags) {
+				profile = p;
+				break;
+			}
+		}
+		if (profile < 0)
+			continue;
+
+		if ((Inputs[i].Flags & KEY_BREAK) == 0 && Pipeline->ActiveProfile != profile)
+			InterlockedExchange(&Pipeline->ActiveProfile, profile);
+
+		//consume the hotkey
+		(*Consumed)++;
+		KeyPipelineRemove(Inputs, InputCount, i--);
+	}
+}
+
+VOID
+KeyPipelineFilter(
+	IN OUT PKEY_PIPELINE Pipeline,
+	IN LONG ActiveProfile,
+	IN const KEY_PIPELINE_CONTEXT* Context,
+	IN OUT PKEYBOARD_INPUT_DATA Inputs,
+	IN OUT PULONG InputCount,
+	IN OUT PULONG Consumed)
+/*++
+
+Routine Description:
+
+	Filters and modifies every packet through the profile it goes through,
+	see KeyPipelineSelectProfile. Filtered packets are consumed, the first
+	modify entry matching a packet changes its scan code.
+
+Arguments:
+
+	Pipeline - Pipeline of the device that generated the input.
+
+	ActiveProfile - Index of the active profile, read once for the batch.
+
+	Context - Counters, trace and capture of the batch.
+
+	Inputs - Packets of the batch.
+
+	InputCount - Packets in Inputs, decremented for every consumed packet.
+
+	Consumed - Incremented for every consumed packet.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	PKEYBOARD_PROFILE profile;
+
+	for (ULONG i = 0; i < *InputCount; i++)
+	{
+		BOOLEAN shouldFilter = FALSE;
+		USHORT checkFlag = Inputs[i].Flags == 0 ? 1 : (USHORT)(Inputs[i].Flags << 1);
+
+		//a release goes through the profile its press went through, even after a switch
+		profile = KeyPipelineSelectProfile(Pipeline, &Inputs[i], ActiveProfile);
+		switch (profile->FilterRequest.FilterMode) {
+		case FILTER_KEY_ALL:
+			shouldFilter = TRUE;
+			break;
+		case FILTER_KEY_FLAGS:
+			//In this filter mode, profile->FilterRequest.FilterCount is where our flag predicate stored.
+			shouldFilter = (checkFlag & profile->FilterRequest.FilterCount) != 0;
+			break;
+		case FILTER_KEY_FLAG_AND_SCANCODE:
+			for (USHORT j = 0; j < profile->FilterRequest.FilterCount; j++)
+			{
+				if (Inputs[i].MakeCode == profile->FilterRequest.FilterData[j].ScanCode &&
+					(checkFlag & profile->FilterRequest.FilterData[j].FlagPredicates) != 0) {
+					shouldFilter = TRUE;
+					break;
+				}
+			}
+			break;
+		}
+		if (shouldFilter) {
+			//Every filtered key needs to be consumed.
+			(*Consumed)++;
+			if (Context->Trace)
+				Context->Trace(Context->TraceContext, EMU_TRACE_FILTER, 1, Inputs[i].MakeCode | (ULONG)Inputs[i].Flags << 16);
+			if (Context->CaptureFiltered)
+				Context->CaptureFiltered(Context->CaptureContext, Context->DeviceHandle, &Inputs[i]);
+			KeyPipelineRemove(Inputs, InputCount, i--);
+			continue;
+		}
+
+		for (USHORT j = 0; j < profile->ModifyRequest.ModifyCount; j++)
+		{
+			if (Inputs[i].MakeCode == profile->ModifyRequest.ModifyData[j].FromScanCode &&
+				(checkFlag & profile->ModifyRequest.ModifyData[j].FlagPredicates) != 0) {
+				Inputs[i].MakeCode = profile->ModifyRequest.ModifyData[j].ToScanCode;
+				EmuStatsAdd(Context->Stats, Context->Processor, EMU_STAT_MODIFIED, 1);
+				if (Context->Trace)
+					Context->Trace(Context->TraceContext, EMU_TRACE_MODIFY, profile->ModifyRequest.ModifyData[j].FromScanCode,
+						profile->ModifyRequest.ModifyData[j].ToScanCode);
+				break;
+			}
+		}
+	}
+}
+
+VOID
+KeyPipelineRules(
+	IN OUT PKEY_PIPELINE Pipeline,
+	IN LONG ActiveProfile,
+	IN const KEY_PIPELINE_CONTEXT* Context,
+	IN const EMU_INPUT_STATE* KeyboardState,
+	IN OPTIONAL const EMU_INPUT_STATE* MouseState,
+	IN OUT PKEYBOARD_INPUT_DATA Inputs,
+	IN OUT PULONG InputCount,
+	IN OUT PULONG Consumed)
+/*++
+
+Routine Description:
+
+	Runs the conditional rules of the active profile over the batch. The
+	rule latches already tie the releases to how their presses went
+	through the rules, so no profile is selected per packet.
+
+Arguments:
+
+	Pipeline - Pipeline of the device that generated the input.
+
+	ActiveProfile - Index of the active profile, read once for the batch.
+
+	Context - Counters of the batch.
+
+	KeyboardState - Physical state of the keyboard.
+
+	MouseState - Physical state of the mouse, NULL if it is not known.
+
+	Inputs - Packets of the batch.
+
+	InputCount - Packets in Inputs, lowered by the packets the rules drop.
+
+	Consumed - Incremented for every dropped packet.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	PKEYBOARD_PROFILE profile = &Pipeline->Profiles[ActiveProfile];
+	ULONG remapped;
+	ULONG keptCount;
+
+	if (profile->RuleRequest.RuleCount == 0)
+		return;
+	keptCount = EmuApplyKeyboardRules(profile->RuleRequest.Rules, EmuSharedRulesIndex(profile->RuleRequest.Rules),
+		KeyboardState, MouseState, Inputs, *InputCount, &Pipeline->RuleLatches,
+		EmuStatsRuleHits(EmuSharedRulesHits(profile->RuleRequest.Rules), Context->Processor), &remapped);
+	EmuStatsAdd(Context->Stats, Context->Processor, EMU_STAT_MODIFIED, remapped);
+	//Every dropped key needs to be consumed.
+	*Consumed += *InputCount - keptCount;
+	*InputCount = keptCount;
+}
+
+AUTOFIRE_TIMER
+KeyPipelineAutofire(
+	IN OUT PKEY_PIPELINE Pipeline,
+	IN LONG64 Now,
+	IN OUT PKEYBOARD_INPUT_DATA Inputs,
+	IN OUT PULONG InputCount,
+	IN OUT PULONG Consumed)
+/*++
+
+Routine Description:
+
+	Arms and disarms the autofire schedule on the trigger key. The first press
+	of the trigger is turned into the first synthesized press and the final
+	release into the synthesized release, typematic repeats in between are
+	consumed since the timer owns the output while the trigger is held.
+
+Arguments:
+
+	Pipeline - Pipeline of the device that generated the input.
+
+	Now - Current time in the clock ticks of the schedule.
+
+	Inputs - Packets of the batch.
+
+	InputCount - Packets in Inputs, decremented for every consumed packet.
+
+	Consumed - Incremented for every consumed packet.
+
+Return Value:
+
+	What to do with the autofire timer, the last arm or disarm of the
+	batch wins.
+
+--*/
+{
+	PKEY_AUTOFIRE_DATA autofire = &Pipeline->Autofire;
+	PAUTOFIRE_SCHEDULE schedule = &Pipeline->AutofireSchedule;
+	AUTOFIRE_TIMER timer = AUTOFIRE_TIMER_KEEP;
+
+	for (ULONG i = 0; i < *InputCount; i++)
+	{
+		if (Inputs[i].MakeCode != autofire->TriggerScanCode ||
+			(Inputs[i].Flags & (KEY_E0 | KEY_E1)) != autofire->TriggerFlags)
+			continue;
+
+		if ((Inputs[i].Flags & KEY_BREAK) == 0) {
+			if (!schedule->Armed) {
+				//the trigger press itself becomes the first synthesized press
+				AutofireArm(schedule, Now);
+				AutofireStep(schedule, Now);
+				Inputs[i].MakeCode = autofire->OutputScanCode;
+				Inputs[i].Flags = autofire->OutputFlags | KEY_MAKE;
+				timer = AUTOFIRE_TIMER_START;
+				continue;
+			}
+		}
+		else {
+			timer = AUTOFIRE_TIMER_STOP;
+			if (AutofireDisarm(schedule)) {
+				Inputs[i].MakeCode = autofire->OutputScanCode;
+				Inputs[i].Flags = autofire->OutputFlags | KEY_BREAK;
+				continue;
+			}
+		}
+
+		//consume the trigger
+		(*Consumed)++;
+		KeyPipelineRemove(Inputs, InputCount, i--);
+	}
+	return timer;
+}
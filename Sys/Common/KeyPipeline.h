@@ -0,0 +1,154 @@
+/*++
+
+Module Name:
+
+	KeyPipeline.h
+
+Abstract:
+
+	Stages of the keyboard service callback shared by KbFilter and the
+	host: profile hotkeys, filters and modifies of the profile a packet
+	goes through, the conditional rules of the active profile and the
+	autofire trigger.
+
+	The stages work on an array of packets and a count, removing consumed
+	packets in place. The caller tracks the physical state, counts the
+	batch, holds whatever lock guards the pipeline, and owns the autofire
+	timer, which KeyPipelineAutofire only tells it what to do with.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef KEYPIPELINE_H
+#define KEYPIPELINE_H
+
+#include "EmuTypes.h"
+#include "../KeyboardEmulator/public.h"
+#include "Autofire.h"
+#include "EmuStats.h"
+#include "InputState.h"
+#include "RuleEngine.h"
+#include "TraceRing.h"
+
+typedef struct _KEYBOARD_PROFILE
+{
+	//
+	// The keyboard key filtering request
+	//
+	KEY_FILTER_REQUEST FilterRequest;
+	//
+	//The keyboard key modify request
+	//
+	KEY_MODIFY_REQUEST ModifyRequest;
+	//
+	//Rules that only apply while their condition holds on the keyboard or mouse state
+	//
+	EMU_RULE_REQUEST RuleRequest;
+
+} KEYBOARD_PROFILE, * PKEYBOARD_PROFILE;
+
+//
+//Receives a packet the profile filters, before it is removed from the batch
+//
+typedef VOID (*KEY_PIPELINE_CAPTURE)(PVOID Context, ULONG DeviceHandle, PKEYBOARD_INPUT_DATA Input);
+
+typedef struct _KEY_PIPELINE
+{
+	//
+	//Preloaded profiles, only the active one is applied to the inputs
+	//
+	KEYBOARD_PROFILE Profiles[KEY_PROFILE_COUNT];
+	//
+	//Index of the active profile, switching profiles is a single exchange of this index
+	//
+	volatile LONG ActiveProfile;
+	//
+	//TRUE if any of the profile hotkeys is set
+	//
+	BOOLEAN ProfileHotkeysSet;
+	//
+	//Keys that activate the profile with the same index
+	//
+	KEY_PROFILE_HOTKEY ProfileHotkeys[KEY_PROFILE_COUNT];
+	//
+	//One plus the index of the profile the press of each held key went through, 0 once released
+	//
+	UCHAR HeldProfiles[EMU_KEY_STATE_BITS];
+	//
+	//How the presses of the held keys went through the conditional rules
+	//
+	EMU_KEY_LATCHES RuleLatches;
+	//
+	//The autofire request as received from user mode
+	//
+	KEY_AUTOFIRE_DATA Autofire;
+	//
+	//Press/release cycles of the held autofire trigger
+	//
+	AUTOFIRE_SCHEDULE AutofireSchedule;
+
+} KEY_PIPELINE, * PKEY_PIPELINE;
+
+//
+//What a batch runs with besides the pipeline of its device
+//
+typedef struct _KEY_PIPELINE_CONTEXT
+{
+	//
+	//Counters of the device, and the processor whose counters the batch owns
+	//
+	PEMU_STATS Stats;
+	ULONG Processor;
+	//
+	//Writes the FILTER and MODIFY records, NULL while tracing is off
+	//
+	EMU_TRACE_WRITER Trace;
+	PVOID TraceContext;
+	//
+	//Gets the filtered packets, NULL unless KEY_CAPTURE_FILTERED is captured
+	//
+	KEY_PIPELINE_CAPTURE CaptureFiltered;
+	PVOID CaptureContext;
+	ULONG DeviceHandle;
+
+} KEY_PIPELINE_CONTEXT, * PKEY_PIPELINE_CONTEXT;
+
+VOID
+KeyPipelineHotkeys(
+	IN OUT PKEY_PIPELINE Pipeline,
+	IN OUT PKEYBOARD_INPUT_DATA Inputs,
+	IN OUT PULONG InputCount,
+	IN OUT PULONG Consumed);
+
+VOID
+KeyPipelineFilter(
+	IN OUT PKEY_PIPELINE Pipeline,
+	IN LONG ActiveProfile,
+	IN const KEY_PIPELINE_CONTEXT* Context,
+	IN OUT PKEYBOARD_INPUT_DATA Inputs,
+	IN OUT PULONG InputCount,
+	IN OUT PULONG Consumed);
+
+VOID
+KeyPipelineRules(
+	IN OUT PKEY_PIPELINE Pipeline,
+	IN LONG ActiveProfile,
+	IN const KEY_PIPELINE_CONTEXT* Context,
+	IN const EMU_INPUT_STATE* KeyboardState,
+	IN OPTIONAL const EMU_INPUT_STATE* MouseState,
+	IN OUT PKEYBOARD_INPUT_DATA Inputs,
+	IN OUT PULONG InputCount,
+	IN OUT PULONG Consumed);
+
+AUTOFIRE_TIMER
+KeyPipelineAutofire(
+	IN OUT PKEY_PIPELINE Pipeline,
+	IN LONG64 Now,
+	IN OUT PKEYBOARD_INPUT_DATA Inputs,
+	IN OUT PULONG InputCount,
+	IN OUT PULONG Consumed);
+
+#endif // KEYPIPELINE_H
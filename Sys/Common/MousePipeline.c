@@ -0,0 +1,384 @@
+/*--
+
+Module Name:
+
+	MousePipeline.c
+
+Abstract:
+
+	Stages of the mouse service callback shared by MouFilter and the host.
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#endif
+#include <ntddmou.h>
+#include "MousePipeline.h"
+#include "SharedRules.h"
+
+VOID
+MousePipelineCompileAbsoluteMap(
+	IN const MOUSE_ABSOLUTE_MAP* AbsoluteMap,
+	OUT PMOUSE_ABSOLUTE_TRANSFORM Transform)
+/*++
+
+Routine Description:
+
+	Precomputes the fixed point scale and offset that map the whole absolute
+	range of a device into the requested target rectangle.
+
+Arguments:
+
+	AbsoluteMap - Validated absolute map received from user mode.
+
+	Transform - Receives the compiled transform.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	LONG width;
+	LONG height;
+
+	RtlZeroMemory(Transform, sizeof(MOUSE_ABSOLUTE_TRANSFORM));
+	if ((AbsoluteMap->Flags & ABSOLUTE_MAP_ENABLED) == 0)
+		return;
+
+	width = AbsoluteMap->Right - AbsoluteMap->Left;
+	height = AbsoluteMap->Bottom - AbsoluteMap->Top;
+	//rounding the scale up lands the last device coordinate exactly on the right/bottom edge
+	Transform->ScaleX = (LONG)((((LONG64)width << 16) + MOUSE_ABSOLUTE_MAX - 1) / MOUSE_ABSOLUTE_MAX);
+	Transform->ScaleY = (LONG)((((LONG64)height << 16) + MOUSE_ABSOLUTE_MAX - 1) / MOUSE_ABSOLUTE_MAX);
+	Transform->OffsetX = AbsoluteMap->Left;
+	Transform->OffsetY = AbsoluteMap->Top;
+	Transform->MaxX = AbsoluteMap->Right;
+	Transform->MaxY = AbsoluteMap->Bottom;
+	Transform->SetFlags = (AbsoluteMap->Flags & ABSOLUTE_MAP_VIRTUAL_DESKTOP) ? MOUSE_VIRTUAL_DESKTOP : 0;
+	Transform->Enabled = TRUE;
+}
+
+static
+PMOUSE_PROFILE
+MousePipelineSelectProfile(
+	IN OUT PMOUSE_PIPELINE Pipeline,
+	IN PMOUSE_INPUT_DATA Input,
+	IN LONG ActiveProfile)
+/*++
+
+Routine Description:
+
+	Picks the profile that filters and modifies a packet. A packet releasing a
+	button goes through the profile the down of that button went through, any
+	other packet through the active profile. The downs of the packet are tied
+	to the profile it went through, so switching profiles while a button is
+	held can not leave the output of its down stuck.
+
+Arguments:
+
+	Pipeline - Pipeline of the device that generated the input.
+
+	Input - Packet about to be filtered and modified.
+
+	ActiveProfile - Index of the active profile.
+
+Return Value:
+
+	The profile to apply to the packet.
+
+--*/
+{
+	LONG index = ActiveProfile;
+	ULONG b;
+
+	for (b = 0; b < EMU_LATCH_BUTTONS; b++)
+	{
+		if ((Input->ButtonFlags & (2 << (b * 2))) && Pipeline->HeldProfiles[b] != 0) {
+			index = Pipeline->HeldProfiles[b] - 1;
+			break;
+		}
+	}
+	for (b = 0; b < EMU_LATCH_BUTTONS; b++)
+	{
+		if (Input->ButtonFlags & (1 << (b * 2)))
+			Pipeline->HeldProfiles[b] = (UCHAR)(index + 1);
+		if (Input->ButtonFlags & (2 << (b * 2)))
+			Pipeline->HeldProfiles[b] = 0;
+	}
+	return &Pipeline->Profiles[index];
+}
+
+VOID
+MousePipelineHotkeys(
+	IN OUT PMOUSE_PIPELINE Pipeline,
+	IN OUT PMOUSE_INPUT_DATA Inputs,
+	IN ULONG InputCount)
+/*++
+
+Routine Description:
+
+	Activates the profile whose hotkey button is pressed. The down and up
+	flags of the hotkeys are stripped so they never reach the system
+	whichever profile is active, the rest of the packet is kept.
+
+Arguments:
+
+	Pipeline - Pipeline of the device that generated the input.
+
+	Inputs - Packets of the batch.
+
+	InputCount - Packets in Inputs.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	USHORT hotkeyMask = Pipeline->ProfileHotkeyMask;
+	USHORT stripMask = (USHORT)(hotkeyMask | (hotkeyMask << 1));
+
+	for (ULONG i = 0; i < InputCount; i++)
+	{
+		USHORT pressed = Inputs[i].ButtonFlags & hotkeyMask;
+
+		if (pressed) {
+			for (LONG p = 0; p < MOUSE_PROFILE_COUNT; p++)
+			{
+				if ((pressed & Pipeline->ProfileHotkeys[p]) != 0) {
+					InterlockedExchange(&Pipeline->ActiveProfile, p);
+					break;
+				}
+			}
+		}
+		Inputs[i].ButtonFlags &= (USHORT)~stripMask;
+	}
+}
+
+VOID
+MousePipelineFilter(
+	IN OUT PMOUSE_PIPELINE Pipeline,
+	IN LONG ActiveProfile,
+	IN const MOUSE_PIPELINE_CONTEXT* Context,
+	IN OUT PMOUSE_INPUT_DATA Inputs,
+	IN OUT PULONG InputCount,
+	IN OUT PULONG Consumed)
+/*++
+
+Routine Description:
+
+	Filters and modifies every packet through the profile it goes through,
+	see MousePipelineSelectProfile. Filtered packets are consumed, the first
+	modify entry matching the button flags of a packet replaces them.
+
+Arguments:
+
+	Pipeline - Pipeline of the device that generated the input.
+
+	ActiveProfile - Index of the active profile, read once for the batch.
+
+	Context - Counters, trace and capture of the batch.
+
+	Inputs - Packets of the batch.
+
+	InputCount - Packets in Inputs, decremented for every consumed packet.
+
+	Consumed - Incremented for every consumed packet.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	PMOUSE_PROFILE profile;
+
+	for (ULONG i = 0; i < *InputCount; i++)
+	{
+		//a button up goes through the profile its down went through, even after a switch
+		profile = MousePipelineSelectProfile(Pipeline, &Inputs[i], ActiveProfile);
+		if (profile->FilterMode & FILTER_MOUSE_MOVE || (Inputs[i].ButtonFlags & profile->FilterMode)) {
+			//Every filtered input needs to be consumed.
+			(*Consumed)++;
+			if (Context->Trace)
+				Context->Trace(Context->TraceContext, EMU_TRACE_FILTER, 1, Inputs[i].ButtonFlags | (ULONG)Inputs[i].Flags << 16);
+			if (Context->CaptureFiltered)
+				Context->CaptureFiltered(Context->CaptureContext, Context->DeviceHandle, &Inputs[i]);
+			for (ULONG j = i; j + 1 < *InputCount; j++)
+				Inputs[j] = Inputs[j + 1];
+			(*InputCount)--;
+			i--;
+			continue;
+		}
+
+		for (USHORT j = 0; j < profile->ModifyRequest.ModifyCount; j++)
+		{
+			if (Inputs[i].ButtonFlags == profile->ModifyRequest.ModifyData[j].FromState) {
+				Inputs[i].ButtonFlags = profile->ModifyRequest.ModifyData[j].ToState;
+				EmuStatsAdd(Context->Stats, Context->Processor, EMU_STAT_MODIFIED, 1);
+				if (Context->Trace)
+					Context->Trace(Context->TraceContext, EMU_TRACE_MODIFY, profile->ModifyRequest.ModifyData[j].FromState,
+						profile->ModifyRequest.ModifyData[j].ToState);
+				break;
+			}
+		}
+	}
+}
+
+VOID
+MousePipelineRules(
+	IN OUT PMOUSE_PIPELINE Pipeline,
+	IN LONG ActiveProfile,
+	IN const MOUSE_PIPELINE_CONTEXT* Context,
+	IN OPTIONAL const EMU_INPUT_STATE* KeyboardState,
+	IN const EMU_INPUT_STATE* MouseState,
+	IN OUT PMOUSE_INPUT_DATA Inputs,
+	IN ULONG InputCount)
+/*++
+
+Routine Description:
+
+	Runs the conditional rules of the active profile over the batch. The
+	rule latches already tie the button ups to how their downs went
+	through the rules, so no profile is selected per packet.
+
+Arguments:
+
+	Pipeline - Pipeline of the device that generated the input.
+
+	ActiveProfile - Index of the active profile, read once for the batch.
+
+	Context - Counters of the batch.
+
+	KeyboardState - Physical state of the keyboard, NULL if it is not known.
+
+	MouseState - Physical state of the mouse.
+
+	Inputs - Packets of the batch.
+
+	InputCount - Packets in Inputs.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	PMOUSE_PROFILE profile = &Pipeline->Profiles[ActiveProfile];
+	ULONG modified;
+
+	if (profile->RuleRequest.RuleCount == 0)
+		return;
+	modified = EmuApplyMouseRules(profile->RuleRequest.Rules, EmuSharedRulesIndex(profile->RuleRequest.Rules),
+		KeyboardState, MouseState, Inputs, InputCount, &Pipeline->RuleLatches,
+		EmuStatsRuleHits(EmuSharedRulesHits(profile->RuleRequest.Rules), Context->Processor));
+	EmuStatsAdd(Context->Stats, Context->Processor, EMU_STAT_MODIFIED, modified);
+}
+
+VOID
+MousePipelineRemapAbsolute(
+	IN const MOUSE_PIPELINE* Pipeline,
+	IN OUT PMOUSE_INPUT_DATA Inputs,
+	IN ULONG InputCount)
+/*++
+
+Routine Description:
+
+	Maps the absolute packets into the target rectangle of the compiled
+	absolute map. Relative packets pass through untouched.
+
+Arguments:
+
+	Pipeline - Pipeline of the device that generated the input.
+
+	Inputs - Packets of the batch.
+
+	InputCount - Packets in Inputs.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	const MOUSE_ABSOLUTE_TRANSFORM* transform = &Pipeline->AbsoluteTransform;
+
+	for (ULONG i = 0; i < InputCount; i++)
+	{
+		LONG x;
+		LONG y;
+
+		if ((Inputs[i].Flags & MOUSE_MOVE_ABSOLUTE) == 0)
+			continue;
+		x = (LONG)(((LONG64)Inputs[i].LastX * transform->ScaleX) >> 16) + transform->OffsetX;
+		y = (LONG)(((LONG64)Inputs[i].LastY * transform->ScaleY) >> 16) + transform->OffsetY;
+		Inputs[i].LastX = x < transform->OffsetX ? transform->OffsetX : (x > transform->MaxX ? transform->MaxX : x);
+		Inputs[i].LastY = y < transform->OffsetY ? transform->OffsetY : (y > transform->MaxY ? transform->MaxY : y);
+		Inputs[i].Flags |= transform->SetFlags;
+	}
+}
+
+AUTOFIRE_TIMER
+MousePipelineAutofire(
+	IN OUT PMOUSE_PIPELINE Pipeline,
+	IN LONG64 Now,
+	IN OUT PMOUSE_INPUT_DATA Inputs,
+	IN ULONG InputCount)
+/*++
+
+Routine Description:
+
+	Arms and disarms the autofire schedule on the trigger button. The trigger
+	down flag is replaced by the first synthesized press and the trigger up
+	flag by the synthesized release, so movement carried by the same packets
+	is left intact.
+
+Arguments:
+
+	Pipeline - Pipeline of the device that generated the input.
+
+	Now - Current time in the clock ticks of the schedule.
+
+	Inputs - Packets of the batch.
+
+	InputCount - Packets in Inputs.
+
+Return Value:
+
+	What to do with the autofire timer, the last arm or disarm of the
+	batch wins.
+
+--*/
+{
+	PMOUSE_AUTOFIRE_DATA autofire = &Pipeline->Autofire;
+	PAUTOFIRE_SCHEDULE schedule = &Pipeline->AutofireSchedule;
+	USHORT triggerUp = (USHORT)(autofire->TriggerButton << 1);
+	USHORT outputUp = (USHORT)(autofire->OutputButton << 1);
+	AUTOFIRE_TIMER timer = AUTOFIRE_TIMER_KEEP;
+
+	for (ULONG i = 0; i < InputCount; i++)
+	{
+		USHORT buttonFlags = Inputs[i].ButtonFlags;
+
+		if (buttonFlags & autofire->TriggerButton) {
+			buttonFlags &= (USHORT)~autofire->TriggerButton;
+			if (!schedule->Armed) {
+				//the trigger press itself becomes the first synthesized press
+				AutofireArm(schedule, Now);
+				AutofireStep(schedule, Now);
+				buttonFlags |= autofire->OutputButton;
+				timer = AUTOFIRE_TIMER_START;
+			}
+		}
+		if (buttonFlags & triggerUp) {
+			buttonFlags &= (USHORT)~triggerUp;
+			timer = AUTOFIRE_TIMER_STOP;
+			if (AutofireDisarm(schedule))
+				buttonFlags |= outputUp;
+		}
+		Inputs[i].ButtonFlags = buttonFlags;
+	}
+	return timer;
+}
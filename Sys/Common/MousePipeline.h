@@ -0,0 +1,208 @@
+/*++
+
+Module Name:
+
+	MousePipeline.h
+
+Abstract:
+
+	Stages of the mouse service callback shared by MouFilter and the host:
+	profile hotkeys, filters and modifies of the profile a packet goes
+	through, the conditional rules of the active profile, absolute
+	remapping and the autofire trigger.
+
+	The stages work on an array of packets and a count, removing filtered
+	packets in place. The caller tracks the physical state, counts the
+	batch, holds whatever lock guards the pipeline, and owns the autofire
+	timer, which MousePipelineAutofire only tells it what to do with.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef MOUSEPIPELINE_H
+#define MOUSEPIPELINE_H
+
+#include "EmuTypes.h"
+#include "../MouseEmulator/public.h"
+#include "Autofire.h"
+#include "EmuStats.h"
+#include "InputState.h"
+#include "RuleEngine.h"
+#include "TraceRing.h"
+
+//
+//Upper bound of the normalized coordinates reported by absolute devices
+//
+#define MOUSE_ABSOLUTE_MAX 0xFFFF
+
+//
+//Every button down flag, the matching up flag is always the next bit
+//
+#define MOUSE_BUTTON_DOWN_MASK (MOUSE_LEFT_BUTTON_DOWN | MOUSE_RIGHT_BUTTON_DOWN | MOUSE_MIDDLE_BUTTON_DOWN | MOUSE_BUTTON_4_DOWN | MOUSE_BUTTON_5_DOWN)
+
+//
+//MOUSE_ABSOLUTE_MAP compiled at upload time, so the service callback only
+//needs a multiply and a shift per axis.
+//
+typedef struct _MOUSE_ABSOLUTE_TRANSFORM
+{
+	//
+	//Fixed point (16.16) scale per axis
+	//
+	LONG ScaleX;
+	LONG ScaleY;
+	//
+	//Left/top edge of the target rectangle, added after scaling
+	//
+	LONG OffsetX;
+	LONG OffsetY;
+	//
+	//Right/bottom edge of the target rectangle, results are clamped to it
+	//
+	LONG MaxX;
+	LONG MaxY;
+	//
+	//Flags OR'ed into every remapped packet
+	//
+	USHORT SetFlags;
+	//
+	//FALSE if absolute packets should pass through untouched
+	//
+	BOOLEAN Enabled;
+
+} MOUSE_ABSOLUTE_TRANSFORM, * PMOUSE_ABSOLUTE_TRANSFORM;
+
+typedef struct _MOUSE_PROFILE
+{
+	//
+	// The mouse filtering request
+	//
+	USHORT FilterMode;
+	//
+	//The mouse modify request
+	//
+	MOUSE_MODIFY_REQUEST ModifyRequest;
+	//
+	//Rules that only apply while their condition holds on the keyboard or mouse state
+	//
+	EMU_RULE_REQUEST RuleRequest;
+
+} MOUSE_PROFILE, * PMOUSE_PROFILE;
+
+//
+//Receives a packet the profile filters, before it is removed from the batch
+//
+typedef VOID (*MOUSE_PIPELINE_CAPTURE)(PVOID Context, ULONG DeviceHandle, PMOUSE_INPUT_DATA Input);
+
+typedef struct _MOUSE_PIPELINE
+{
+	//
+	//Preloaded profiles, only the active one is applied to the inputs
+	//
+	MOUSE_PROFILE Profiles[MOUSE_PROFILE_COUNT];
+	//
+	//Index of the active profile, switching profiles is a single exchange of this index
+	//
+	volatile LONG ActiveProfile;
+	//
+	//Union of the profile hotkeys, 0 if none is set
+	//
+	USHORT ProfileHotkeyMask;
+	//
+	//Button down flags that activate the profile with the same index
+	//
+	USHORT ProfileHotkeys[MOUSE_PROFILE_COUNT];
+	//
+	//One plus the index of the profile the down of each held button went through, 0 once released
+	//
+	UCHAR HeldProfiles[EMU_LATCH_BUTTONS];
+	//
+	//What the presses of the held buttons were turned into by the conditional rules
+	//
+	EMU_BUTTON_LATCHES RuleLatches;
+	//
+	//The absolute map compiled for the service callback
+	//
+	MOUSE_ABSOLUTE_TRANSFORM AbsoluteTransform;
+	//
+	//The autofire request as received from user mode
+	//
+	MOUSE_AUTOFIRE_DATA Autofire;
+	//
+	//Press/release cycles of the held autofire trigger
+	//
+	AUTOFIRE_SCHEDULE AutofireSchedule;
+
+} MOUSE_PIPELINE, * PMOUSE_PIPELINE;
+
+//
+//What a batch runs with besides the pipeline of its device
+//
+typedef struct _MOUSE_PIPELINE_CONTEXT
+{
+	//
+	//Counters of the device, and the processor whose counters the batch owns
+	//
+	PEMU_STATS Stats;
+	ULONG Processor;
+	//
+	//Writes the FILTER and MODIFY records, NULL while tracing is off
+	//
+	EMU_TRACE_WRITER Trace;
+	PVOID TraceContext;
+	//
+	//Gets the filtered packets, NULL unless MOUSE_CAPTURE_FILTERED is captured
+	//
+	MOUSE_PIPELINE_CAPTURE CaptureFiltered;
+	PVOID CaptureContext;
+	ULONG DeviceHandle;
+
+} MOUSE_PIPELINE_CONTEXT, * PMOUSE_PIPELINE_CONTEXT;
+
+VOID
+MousePipelineCompileAbsoluteMap(
+	IN const MOUSE_ABSOLUTE_MAP* AbsoluteMap,
+	OUT PMOUSE_ABSOLUTE_TRANSFORM Transform);
+
+VOID
+MousePipelineHotkeys(
+	IN OUT PMOUSE_PIPELINE Pipeline,
+	IN OUT PMOUSE_INPUT_DATA Inputs,
+	IN ULONG InputCount);
+
+VOID
+MousePipelineFilter(
+	IN OUT PMOUSE_PIPELINE Pipeline,
+	IN LONG ActiveProfile,
+	IN const MOUSE_PIPELINE_CONTEXT* Context,
+	IN OUT PMOUSE_INPUT_DATA Inputs,
+	IN OUT PULONG InputCount,
+	IN OUT PULONG Consumed);
+
+VOID
+MousePipelineRules(
+	IN OUT PMOUSE_PIPELINE Pipeline,
+	IN LONG ActiveProfile,
+	IN const MOUSE_PIPELINE_CONTEXT* Context,
+	IN OPTIONAL const EMU_INPUT_STATE* KeyboardState,
+	IN const EMU_INPUT_STATE* MouseState,
+	IN OUT PMOUSE_INPUT_DATA Inputs,
+	IN ULONG InputCount);
+
+VOID
+MousePipelineRemapAbsolute(
+	IN const MOUSE_PIPELINE* Pipeline,
+	IN OUT PMOUSE_INPUT_DATA Inputs,
+	IN ULONG InputCount);
+
+AUTOFIRE_TIMER
+MousePipelineAutofire(
+	IN OUT PMOUSE_PIPELINE Pipeline,
+	IN LONG64 Now,
+	IN OUT PMOUSE_INPUT_DATA Inputs,
+	IN ULONG InputCount);
+
+#endif // MOUSEPIPELINE_H
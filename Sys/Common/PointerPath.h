@@ -0,0 +1,275 @@
+/*++
+
+Module Name:
+
+	PointerPath.h
+
+Abstract:
+
+	Synthesizes the mouse packets moving the pointer along a path, with
+	the time each packet is due.
+
+	A path is a straight line at a constant speed, a cubic Bezier curve,
+	or a straight line eased by the minimum jerk profile, which starts
+	and ends at rest like a hand moving the pointer. The curve is sampled
+	at Steps points, spread evenly over the duration of the move.
+
+	Every point is computed on its own, in 30 bit fixed point so the same
+	code runs in kernel mode, and rounded to the nearest integer. A
+	relative packet moves from the rounded point before it to its own, so
+	the rounding never accumulates: the packets add up to the exact
+	distance and no point is off the curve by a unit or more. Since a
+	point depends only on its step, a path is generated into buffers of
+	any size, one slice at a time.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef POINTERPATH_H
+#define POINTERPATH_H
+
+#include "EmuTypes.h"
+
+typedef enum _EMU_PATH_CURVE {
+	//Straight line at a constant speed
+	EMU_PATH_LINEAR,
+	//Cubic Bezier curve through the two control points
+	EMU_PATH_BEZIER,
+	//Straight line, accelerating then decelerating smoothly
+	EMU_PATH_MINIMUM_JERK
+} EMU_PATH_CURVE;
+
+//
+//Flags of the packets, MOUSE_MOVE_ABSOLUTE and MOUSE_VIRTUAL_DESKTOP of ntddmou.h
+//
+#define EMU_PATH_ABSOLUTE			0x0001
+#define EMU_PATH_VIRTUAL_DESKTOP	0x0002
+
+#define EMU_PATH_MAX_STEPS			0x100000
+//
+//Largest coordinate of a relative path, and of its distances
+//
+#define EMU_PATH_MAX_COORDINATE		0x100000
+//
+//Largest coordinate of an absolute path, the normalized 0-65535 range
+//
+#define EMU_PATH_MAX_ABSOLUTE		0xFFFF
+#define EMU_PATH_MAX_DURATION		0x10000000000LL
+
+//
+//One in the fixed point the curves are sampled in
+//
+#define EMU_PATH_ONE				0x40000000LL
+
+typedef struct _EMU_PATH_POINT {
+	LONG X;
+	LONG Y;
+
+} EMU_PATH_POINT, * PEMU_PATH_POINT;
+
+typedef struct _EMU_PATH {
+	//
+	//EMU_PATH_CURVE
+	//
+	USHORT Curve;
+	//
+	//EMU_PATH_ABSOLUTE and EMU_PATH_VIRTUAL_DESKTOP, 0 for relative packets
+	//
+	USHORT Flags;
+	//
+	//Packets of the move, 1 to EMU_PATH_MAX_STEPS
+	//
+	ULONG Steps;
+	EMU_PATH_POINT Start;
+	EMU_PATH_POINT End;
+	//
+	//Control points of EMU_PATH_BEZIER, ignored by the other curves
+	//
+	EMU_PATH_POINT Control1;
+	EMU_PATH_POINT Control2;
+	//
+	//Time of the start of the move and how long it takes, in units chosen by
+	//the caller, the last packet is due at StartTime + Duration
+	//
+	LONG64 StartTime;
+	LONG64 Duration;
+
+} EMU_PATH, * PEMU_PATH;
+
+FORCEINLINE
+BOOLEAN
+EmuPathPointValid(
+	IN const EMU_PATH_POINT* Point,
+	IN BOOLEAN Absolute)
+{
+	if (Absolute)
+		return Point->X >= 0 && Point->X <= EMU_PATH_MAX_ABSOLUTE && Point->Y >= 0 && Point->Y <= EMU_PATH_MAX_ABSOLUTE;
+	return Point->X >= -EMU_PATH_MAX_COORDINATE && Point->X <= EMU_PATH_MAX_COORDINATE &&
+		Point->Y >= -EMU_PATH_MAX_COORDINATE && Point->Y <= EMU_PATH_MAX_COORDINATE;
+}
+
+FORCEINLINE
+BOOLEAN
+EmuPathValid(
+	IN const EMU_PATH* Path)
+/*++
+
+Routine Description:
+
+	Checks a path is within the ranges the fixed point math holds.
+
+--*/
+{
+	BOOLEAN absolute = (Path->Flags & EMU_PATH_ABSOLUTE) != 0;
+
+	if (Path->Curve > EMU_PATH_MINIMUM_JERK ||
+		(Path->Flags & ~(EMU_PATH_ABSOLUTE | EMU_PATH_VIRTUAL_DESKTOP)) != 0 ||
+		((Path->Flags & EMU_PATH_VIRTUAL_DESKTOP) && !absolute) ||
+		Path->Steps == 0 || Path->Steps > EMU_PATH_MAX_STEPS ||
+		Path->Duration < 0 || Path->Duration > EMU_PATH_MAX_DURATION)
+		return FALSE;
+	if (!EmuPathPointValid(&Path->Start, absolute) || !EmuPathPointValid(&Path->End, absolute))
+		return FALSE;
+	//a Bezier curve stays within its points, absolute ones stay on the screen
+	if (Path->Curve == EMU_PATH_BEZIER &&
+		(!EmuPathPointValid(&Path->Control1, absolute) || !EmuPathPointValid(&Path->Control2, absolute)))
+		return FALSE;
+	return TRUE;
+}
+
+FORCEINLINE
+LONG64
+EmuPathRound(
+	IN LONG64 Numerator,
+	IN LONG64 Denominator)
+/*++
+
+Routine Description:
+
+	Divides by a positive denominator, rounding halves away from zero so a
+	path and its mirror image take the same steps.
+
+--*/
+{
+	if (Numerator >= 0)
+		return (Numerator + Denominator / 2) / Denominator;
+	return -((-Numerator + Denominator / 2) / Denominator);
+}
+
+FORCEINLINE
+VOID
+EmuPathPoint(
+	IN const EMU_PATH* Path,
+	IN ULONG Step,
+	OUT PEMU_PATH_POINT Point)
+/*++
+
+Routine Description:
+
+	Computes the rounded point of a step, Start at step 0 and End at step
+	Steps.
+
+--*/
+{
+	LONG64 dx = (LONG64)Path->End.X - Path->Start.X;
+	LONG64 dy = (LONG64)Path->End.Y - Path->Start.Y;
+	LONG64 u;
+	LONG64 u2;
+	LONG64 u3;
+	LONG64 x;
+	LONG64 y;
+
+	if (Step >= Path->Steps) {
+		*Point = Path->End;
+		return;
+	}
+	if (Path->Curve == EMU_PATH_LINEAR) {
+		x = EmuPathRound(dx * Step, Path->Steps);
+		y = EmuPathRound(dy * Step, Path->Steps);
+	}
+	else {
+		u = ((LONG64)Step << 30) / Path->Steps;
+		u2 = (u * u) >> 30;
+		u3 = (u2 * u) >> 30;
+		if (Path->Curve == EMU_PATH_MINIMUM_JERK) {
+			//10u^3 - 15u^4 + 6u^5, at most one so the product fits
+			LONG64 s = (u3 * (10 * EMU_PATH_ONE - 15 * u + 6 * u2)) >> 30;
+			x = EmuPathRound(dx * s, EMU_PATH_ONE);
+			y = EmuPathRound(dy * s, EMU_PATH_ONE);
+		}
+		else {
+			//Bernstein weights of the control points, the start point weighs nothing relative to itself
+			LONG64 v = EMU_PATH_ONE - u;
+			LONG64 b1 = (3 * ((v * v) >> 30) * u) >> 30;
+			LONG64 b2 = (3 * v * u2) >> 30;
+			x = EmuPathRound(b1 * ((LONG64)Path->Control1.X - Path->Start.X) +
+				b2 * ((LONG64)Path->Control2.X - Path->Start.X) + u3 * dx, EMU_PATH_ONE);
+			y = EmuPathRound(b1 * ((LONG64)Path->Control1.Y - Path->Start.Y) +
+				b2 * ((LONG64)Path->Control2.Y - Path->Start.Y) + u3 * dy, EMU_PATH_ONE);
+		}
+	}
+	Point->X = (LONG)(Path->Start.X + x);
+	Point->Y = (LONG)(Path->Start.Y + y);
+}
+
+FORCEINLINE
+ULONG
+EmuPathGenerate(
+	IN const EMU_PATH* Path,
+	IN ULONG First,
+	OUT PMOUSE_INPUT_DATA Inputs,
+	OUT OPTIONAL PLONG64 Times,
+	IN ULONG Capacity)
+/*++
+
+Routine Description:
+
+	Generates the packets of a path from packet First on, as many as fit.
+	Packet n moves the pointer to the point of step n + 1 and is due when
+	n + 1 of the Steps parts of the duration have passed.
+
+Return Value:
+
+	The packets generated, 0 once First reaches Steps or for a path
+	EmuPathValid rejects.
+
+--*/
+{
+	EMU_PATH_POINT previous;
+	EMU_PATH_POINT point;
+	ULONG count;
+	ULONG i;
+
+	if (!EmuPathValid(Path) || First >= Path->Steps)
+		return 0;
+	count = Path->Steps - First;
+	if (count > Capacity)
+		count = Capacity;
+
+	EmuPathPoint(Path, First, &previous);
+	for (i = 0; i < count; i++)
+	{
+		ULONG step = First + i + 1;
+
+		EmuPathPoint(Path, step, &point);
+		RtlZeroMemory(&Inputs[i], sizeof(MOUSE_INPUT_DATA));
+		Inputs[i].Flags = Path->Flags;
+		if (Path->Flags & EMU_PATH_ABSOLUTE) {
+			Inputs[i].LastX = point.X;
+			Inputs[i].LastY = point.Y;
+		}
+		else {
+			Inputs[i].LastX = point.X - previous.X;
+			Inputs[i].LastY = point.Y - previous.Y;
+		}
+		if (Times)
+			Times[i] = Path->StartTime + Path->Duration * step / Path->Steps;
+		previous = point;
+	}
+	return count;
+}
+
+#endif // POINTERPATH_H
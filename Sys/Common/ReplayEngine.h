@@ -0,0 +1,304 @@
+/*++
+
+Module Name:
+
+	ReplayEngine.h
+
+Abstract:
+
+	Plays timestamped input back at the pace it was recorded at, scaled by
+	a speed, through a transport that injects it.
+
+	The engine asks a source for events in the order of their times and a
+	clock for the time. The due time of an event is computed from where
+	the pass started, on the clock and in the recording, never from the
+	batch before, so a late wakeup does not shift the events after it:
+	they are due as early as before and the playback catches up. Events
+	due within a window after the first one of a batch, or overdue, go to
+	the transport in one call.
+
+	Sources, transports and clocks are callbacks, so the engine runs the
+	same against the driver and against a virtual clock that only moves
+	when the engine waits.
+
+Environment:
+
+	user mode
+
+--*/
+
+#ifndef REPLAYENGINE_H
+#define REPLAYENGINE_H
+
+#include "EmuTypes.h"
+#include "InputRecording.h"
+
+//
+//Events read from the source ahead of the clock, the most a batch holds
+//
+#define EMU_REPLAY_LOOKAHEAD 64
+
+#define EMU_REPLAY_SPEED_MIN 50
+#define EMU_REPLAY_SPEED_MAX 1000
+
+typedef union _EMU_REPLAY_INPUT {
+	KEYBOARD_INPUT_DATA Keyboard;
+	MOUSE_INPUT_DATA Mouse;
+
+} EMU_REPLAY_INPUT, * PEMU_REPLAY_INPUT;
+
+typedef struct _EMU_REPLAY_EVENT {
+	//
+	//Time in the units of the source
+	//
+	LONG64 Time;
+	EMU_REPLAY_INPUT Input;
+
+} EMU_REPLAY_EVENT, * PEMU_REPLAY_EVENT;
+
+//
+//Fills up to Count events and returns how many, 0 at the end of the source
+//
+typedef ULONG(*PEMU_REPLAY_READ)(PVOID Context, PEMU_REPLAY_EVENT Events, ULONG Count);
+//
+//Starts the source over for the next pass
+//
+typedef BOOLEAN(*PEMU_REPLAY_REWIND)(PVOID Context);
+//
+//Injects an array of KEYBOARD_INPUT_DATA or MOUSE_INPUT_DATA, by the kind played
+//
+typedef BOOLEAN(*PEMU_REPLAY_INSERT)(PVOID Context, const VOID* Inputs, ULONG Count);
+//
+//Returns the time of a monotonic clock
+//
+typedef LONG64(*PEMU_REPLAY_NOW)(PVOID Context);
+//
+//Waits until the clock reaches Until or a bit less, returns FALSE to stop
+//
+typedef BOOLEAN(*PEMU_REPLAY_WAIT)(PVOID Context, LONG64 Until);
+
+typedef struct _EMU_REPLAY_SOURCE {
+	PVOID Context;
+	PEMU_REPLAY_READ Read;
+	//
+	//NULL if the source can only be played once
+	//
+	PEMU_REPLAY_REWIND Rewind;
+	//
+	//Time units per second of the events
+	//
+	LONG64 Frequency;
+
+} EMU_REPLAY_SOURCE, * PEMU_REPLAY_SOURCE;
+
+typedef struct _EMU_REPLAY_TRANSPORT {
+	PVOID Context;
+	PEMU_REPLAY_INSERT Insert;
+
+} EMU_REPLAY_TRANSPORT, * PEMU_REPLAY_TRANSPORT;
+
+typedef struct _EMU_REPLAY_CLOCK {
+	PVOID Context;
+	PEMU_REPLAY_NOW Now;
+	//
+	//Called before every batch, also when it is due already, so it can stop
+	//the playback between any two batches
+	//
+	PEMU_REPLAY_WAIT Wait;
+	//
+	//Time units per second of the clock
+	//
+	LONG64 Frequency;
+
+} EMU_REPLAY_CLOCK, * PEMU_REPLAY_CLOCK;
+
+typedef struct _EMU_REPLAY_OPTIONS {
+	//
+	//EMU_REC_KEYBOARD or EMU_REC_MOUSE
+	//
+	USHORT Kind;
+	USHORT Reserved;
+	//
+	//Percent of the recorded speed, EMU_REPLAY_SPEED_MIN to EMU_REPLAY_SPEED_MAX
+	//
+	ULONG SpeedPercent;
+	//
+	//Passes over the source, 0 to play until the clock stops the playback
+	//
+	ULONG Loops;
+	//
+	//Clock units an event may be injected early to join the batch before it
+	//
+	LONG64 Window;
+
+} EMU_REPLAY_OPTIONS, * PEMU_REPLAY_OPTIONS;
+
+typedef enum _EMU_REPLAY_STATUS {
+	//All passes were played
+	EMU_REPLAY_DONE,
+	//The clock stopped the playback
+	EMU_REPLAY_STOPPED,
+	//The options are out of range or a callback is missing
+	EMU_REPLAY_INVALID,
+	//The source could not be rewound for the next pass
+	EMU_REPLAY_SOURCE_FAILED,
+	//The transport failed to inject a batch
+	EMU_REPLAY_INSERT_FAILED
+} EMU_REPLAY_STATUS;
+
+typedef struct _EMU_REPLAY_STATS {
+	ULONG64 Events;
+	//
+	//Transport calls, each with the events of one batch
+	//
+	ULONG64 Batches;
+	//
+	//Passes played to their end
+	//
+	ULONG Loops;
+	ULONG Reserved;
+	//
+	//Clock units the batches were injected after they were due, summed and at most
+	//
+	LONG64 TotalLate;
+	LONG64 MaxLate;
+
+} EMU_REPLAY_STATS, * PEMU_REPLAY_STATS;
+
+FORCEINLINE
+LONG64
+EmuReplayScale(
+	IN LONG64 Elapsed,
+	IN const EMU_REPLAY_SOURCE* Source,
+	IN const EMU_REPLAY_CLOCK* Clock,
+	IN ULONG SpeedPercent)
+/*++
+
+Routine Description:
+
+	Converts time elapsed in a recording to the clock time it takes to
+	play it at a speed.
+
+--*/
+{
+	return (LONG64)((double)Elapsed * (double)Clock->Frequency * 100.0 /
+		((double)Source->Frequency * (double)SpeedPercent));
+}
+
+FORCEINLINE
+EMU_REPLAY_STATUS
+EmuReplayRun(
+	IN const EMU_REPLAY_SOURCE* Source,
+	IN const EMU_REPLAY_TRANSPORT* Transport,
+	IN const EMU_REPLAY_CLOCK* Clock,
+	IN const EMU_REPLAY_OPTIONS* Options,
+	OUT PEMU_REPLAY_STATS Stats)
+/*++
+
+Routine Description:
+
+	Plays a source until its passes are done or the clock stops it. Events
+	older than the event before them are played along with it.
+
+Return Value:
+
+	How the playback ended, Stats tells what it played before.
+
+--*/
+{
+	EMU_REPLAY_EVENT events[EMU_REPLAY_LOOKAHEAD];
+	KEYBOARD_INPUT_DATA keys[EMU_REPLAY_LOOKAHEAD];
+	MOUSE_INPUT_DATA packets[EMU_REPLAY_LOOKAHEAD];
+	ULONG filled = 0;
+	ULONG next = 0;
+	//where the pass started on the clock and in the recording
+	LONG64 passClock = 0;
+	LONG64 passTime = 0;
+	LONG64 lastDue = 0;
+	LONG64 lastTime = 0;
+	ULONG64 passEvents = 0;
+
+	RtlZeroMemory(Stats, sizeof(EMU_REPLAY_STATS));
+	if (!Source->Read || Source->Frequency <= 0 || !Transport->Insert ||
+		!Clock->Now || !Clock->Wait || Clock->Frequency <= 0 ||
+		(Options->Kind != EMU_REC_KEYBOARD && Options->Kind != EMU_REC_MOUSE) ||
+		Options->SpeedPercent < EMU_REPLAY_SPEED_MIN || Options->SpeedPercent > EMU_REPLAY_SPEED_MAX ||
+		Options->Window < 0)
+		return EMU_REPLAY_INVALID;
+
+	passClock = lastDue = Clock->Now(Clock->Context);
+	for (;;)
+	{
+		LONG64 due;
+		LONG64 now;
+		ULONG count = 0;
+
+		if (next == filled) {
+			next = 0;
+			filled = Source->Read(Source->Context, events, EMU_REPLAY_LOOKAHEAD);
+			if (filled > EMU_REPLAY_LOOKAHEAD)
+				filled = 0;
+			if (filled == 0) {
+				//a pass without events would loop forever
+				if (passEvents == 0)
+					return EMU_REPLAY_DONE;
+				Stats->Loops++;
+				if (Options->Loops != 0 && Stats->Loops >= Options->Loops)
+					return EMU_REPLAY_DONE;
+				if (!Source->Rewind || !Source->Rewind(Source->Context))
+					return EMU_REPLAY_SOURCE_FAILED;
+				//the next pass starts where the last event of this one was due
+				passClock = lastDue;
+				passEvents = 0;
+				continue;
+			}
+		}
+
+		if (passEvents == 0)
+			passTime = lastTime = events[next].Time;
+		due = events[next].Time > lastTime ?
+			passClock + EmuReplayScale(events[next].Time - passTime, Source, Clock, Options->SpeedPercent) : lastDue;
+		if (due < lastDue)
+			due = lastDue;
+
+		if (!Clock->Wait(Clock->Context, due))
+			return EMU_REPLAY_STOPPED;
+		while ((now = Clock->Now(Clock->Context)) < due)
+		{
+			if (!Clock->Wait(Clock->Context, due))
+				return EMU_REPLAY_STOPPED;
+		}
+		Stats->TotalLate += now - due;
+		if (now - due > Stats->MaxLate)
+			Stats->MaxLate = now - due;
+
+		//take the events read ahead that are due by the end of the window
+		while (next < filled)
+		{
+			LONG64 eventDue = due;
+			if (events[next].Time > lastTime)
+				eventDue = passClock + EmuReplayScale(events[next].Time - passTime, Source, Clock, Options->SpeedPercent);
+			if (count > 0 && eventDue > now + Options->Window)
+				break;
+			if (eventDue > due)
+				due = eventDue;
+			if (events[next].Time > lastTime)
+				lastTime = events[next].Time;
+			if (Options->Kind == EMU_REC_KEYBOARD)
+				keys[count] = events[next].Input.Keyboard;
+			else
+				packets[count] = events[next].Input.Mouse;
+			count++;
+			next++;
+		}
+		lastDue = due;
+		passEvents += count;
+
+		if (!Transport->Insert(Transport->Context, Options->Kind == EMU_REC_KEYBOARD ? (const VOID*)keys : (const VOID*)packets, count))
+			return EMU_REPLAY_INSERT_FAILED;
+		Stats->Events += count;
+		Stats->Batches++;
+	}
+}
+
+#endif // REPLAYENGINE_H
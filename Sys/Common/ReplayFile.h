@@ -0,0 +1,295 @@
+/*++
+
+Module Name:
+
+	ReplayFile.h
+
+Abstract:
+
+	Seekable layout of a recording, for files too long to decode from the
+	start every time a later part is needed.
+
+	A replay file starts with an EMU_REPLAY_HEADER. Chunks follow, each an
+	EMU_REPLAY_CHUNK followed by up to EMU_REPLAY_CHUNK_BYTES of events in
+	the encoding of InputRecording.h, with the state reset to the time of
+	the first event of the chunk. The file ends with the index, one
+	EMU_REPLAY_INDEX per chunk in the order of their times.
+
+	All parts have a fixed size or a size given by the part before, so a
+	reader maps the header and the index, finds the chunk holding a time by
+	a binary search of the index and decodes only the chunks it plays.
+
+	A writer streams the chunks and writes the index once it is done, then
+	fills in the header. A file whose header has no index was not finished
+	and is rejected.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef REPLAYFILE_H
+#define REPLAYFILE_H
+
+#include "EmuTypes.h"
+#include "InputRecording.h"
+
+#define EMU_REPLAY_MAGIC 0x4C505245 // 'ERPL'
+#define EMU_REPLAY_VERSION 1
+#define EMU_REPLAY_CHUNK_MAGIC 0x4B484345 // 'ECHK'
+
+//
+//Encoded bytes of a chunk at most
+//
+#define EMU_REPLAY_CHUNK_BYTES 0x10000
+
+typedef struct _EMU_REPLAY_HEADER {
+	//
+	//EMU_REPLAY_MAGIC
+	//
+	ULONG Magic;
+	//
+	//EMU_REPLAY_VERSION
+	//
+	USHORT Version;
+	//
+	//EMU_REC_KEYBOARD or EMU_REC_MOUSE
+	//
+	USHORT Kind;
+	ULONG ChunkCount;
+	ULONG Reserved;
+	//
+	//Time units per second
+	//
+	LONG64 Frequency;
+	ULONG64 EventCount;
+	//
+	//Time of the last event
+	//
+	LONG64 LastTime;
+	//
+	//File offset of the index, 0 until the writer is done
+	//
+	ULONG64 IndexOffset;
+
+} EMU_REPLAY_HEADER, * PEMU_REPLAY_HEADER;
+
+typedef struct _EMU_REPLAY_CHUNK {
+	//
+	//EMU_REPLAY_CHUNK_MAGIC
+	//
+	ULONG Magic;
+	//
+	//Events of the chunk
+	//
+	ULONG Count;
+	//
+	//Encoded bytes following the chunk
+	//
+	ULONG Bytes;
+	ULONG Reserved;
+	//
+	//Time of the first event, the state of the chunk starts at it
+	//
+	LONG64 FirstTime;
+	LONG64 LastTime;
+
+} EMU_REPLAY_CHUNK, * PEMU_REPLAY_CHUNK;
+
+typedef struct _EMU_REPLAY_INDEX {
+	//
+	//Time of the first event of the chunk
+	//
+	LONG64 Time;
+	//
+	//File offset of the EMU_REPLAY_CHUNK
+	//
+	ULONG64 Offset;
+
+} EMU_REPLAY_INDEX, * PEMU_REPLAY_INDEX;
+
+typedef struct _EMU_REPLAY_CURSOR {
+	EMU_REC_STATE State;
+	const UCHAR* Next;
+	const UCHAR* End;
+	//
+	//Events of the chunk not yet decoded
+	//
+	ULONG Left;
+	USHORT Kind;
+	USHORT Reserved;
+
+} EMU_REPLAY_CURSOR, * PEMU_REPLAY_CURSOR;
+
+FORCEINLINE
+VOID
+EmuReplayInitializeHeader(
+	OUT PEMU_REPLAY_HEADER Header,
+	IN USHORT Kind,
+	IN LONG64 Frequency)
+{
+	RtlZeroMemory(Header, sizeof(EMU_REPLAY_HEADER));
+	Header->Magic = EMU_REPLAY_MAGIC;
+	Header->Version = EMU_REPLAY_VERSION;
+	Header->Kind = Kind;
+	Header->Frequency = Frequency;
+}
+
+FORCEINLINE
+BOOLEAN
+EmuReplayCheckHeader(
+	IN const EMU_REPLAY_HEADER* Header,
+	IN ULONG64 FileSize,
+	IN USHORT Kind)
+/*++
+
+Routine Description:
+
+	Checks that this version can read a finished file holding the expected
+	kind of input, and that its index lies within the file.
+
+--*/
+{
+	if (FileSize < sizeof(EMU_REPLAY_HEADER) ||
+		Header->Magic != EMU_REPLAY_MAGIC || Header->Version != EMU_REPLAY_VERSION ||
+		Header->Kind != Kind || Header->Frequency <= 0)
+		return FALSE;
+	if (Header->IndexOffset < sizeof(EMU_REPLAY_HEADER) || Header->IndexOffset > FileSize)
+		return FALSE;
+	return (FileSize - Header->IndexOffset) / sizeof(EMU_REPLAY_INDEX) >= Header->ChunkCount;
+}
+
+FORCEINLINE
+BOOLEAN
+EmuReplayCheckChunk(
+	IN const EMU_REPLAY_CHUNK* Chunk,
+	IN const EMU_REPLAY_HEADER* Header,
+	IN const EMU_REPLAY_INDEX* Entry)
+/*++
+
+Routine Description:
+
+	Checks a chunk header against its index entry and that its events end
+	before the index.
+
+--*/
+{
+	ULONG64 end = Entry->Offset + sizeof(EMU_REPLAY_CHUNK) + Chunk->Bytes;
+
+	return Chunk->Magic == EMU_REPLAY_CHUNK_MAGIC && Chunk->FirstTime == Entry->Time &&
+		Chunk->Bytes <= EMU_REPLAY_CHUNK_BYTES && end <= Header->IndexOffset;
+}
+
+FORCEINLINE
+ULONG
+EmuReplayFindChunk(
+	IN const EMU_REPLAY_INDEX* Index,
+	IN ULONG ChunkCount,
+	IN LONG64 Time)
+/*++
+
+Routine Description:
+
+	Returns the last chunk starting before Time, the chunk to read on from
+	for the first event at or after it. Events at the same time may span
+	chunks, so a chunk starting at Time can follow events at Time in the
+	chunk before it.
+
+Return Value:
+
+	The chunk number,
+	0 if Time lies at or before the first chunk.
+
+--*/
+{
+	ULONG low = 0;
+	ULONG high = ChunkCount;
+
+	//the first chunk starting at or after Time, the one before it is the answer
+	while (low < high)
+	{
+		ULONG middle = low + (high - low) / 2;
+		if (Index[middle].Time < Time)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low > 0 ? low - 1 : 0;
+}
+
+FORCEINLINE
+VOID
+EmuReplayBeginChunk(
+	OUT PEMU_REPLAY_CURSOR Cursor,
+	IN USHORT Kind,
+	IN const EMU_REPLAY_CHUNK* Chunk,
+	IN const VOID* Events)
+/*++
+
+Routine Description:
+
+	Starts decoding the events of a checked chunk, Events points at the
+	Chunk->Bytes following it.
+
+--*/
+{
+	EmuRecReset(&Cursor->State, Chunk->FirstTime);
+	Cursor->Next = (const UCHAR*)Events;
+	Cursor->End = (const UCHAR*)Events + Chunk->Bytes;
+	Cursor->Left = Chunk->Count;
+	Cursor->Kind = Kind;
+	Cursor->Reserved = 0;
+}
+
+FORCEINLINE
+BOOLEAN
+EmuReplayNextKeyboard(
+	IN OUT PEMU_REPLAY_CURSOR Cursor,
+	OUT PLONG64 Time,
+	OUT PKEYBOARD_INPUT_DATA Input)
+/*++
+
+Return Value:
+
+	TRUE if an event was decoded,
+	FALSE at the end of the chunk or on an event that doesn't decode.
+
+--*/
+{
+	if (Cursor->Left == 0 || Cursor->Kind != EMU_REC_KEYBOARD)
+		return FALSE;
+	if (!EmuRecDecodeKeyboard(&Cursor->State, &Cursor->Next, Cursor->End, Time, Input)) {
+		Cursor->Left = 0;
+		return FALSE;
+	}
+	Cursor->Left--;
+	return TRUE;
+}
+
+FORCEINLINE
+BOOLEAN
+EmuReplayNextMouse(
+	IN OUT PEMU_REPLAY_CURSOR Cursor,
+	OUT PLONG64 Time,
+	OUT PMOUSE_INPUT_DATA Input)
+/*++
+
+Return Value:
+
+	TRUE if an event was decoded,
+	FALSE at the end of the chunk or on an event that doesn't decode.
+
+--*/
+{
+	if (Cursor->Left == 0 || Cursor->Kind != EMU_REC_MOUSE)
+		return FALSE;
+	if (!EmuRecDecodeMouse(&Cursor->State, &Cursor->Next, Cursor->End, Time, Input)) {
+		Cursor->Left = 0;
+		return FALSE;
+	}
+	Cursor->Left--;
+	return TRUE;
+}
+
+#endif // REPLAYFILE_H
@@ -0,0 +1,359 @@
+/*--
+
+Module Name:
+
+	RuleEngine.c
+
+Abstract:
+
+	Conditional rule evaluation shared by the keyboard and mouse filters.
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#include <ntddkbd.h>
+#include <ntddmou.h>
+#endif
+#include "RuleEngine.h"
+
+BOOLEAN
+EmuValidateRules(
+	IN const EMU_RULE* Rules,
+	IN USHORT RuleCount,
+	OUT OPTIONAL PEMU_RULE_INDEX Index)
+/*++
+
+Routine Description:
+
+	Checks the rules received from user mode before they are handed to the
+	service callback, and indexes valid ones so a packet only looks at the
+	rules whose From can match it.
+
+Arguments:
+
+	Rules - Rule entries.
+
+	RuleCount - Number of rule entries.
+
+	Index - Receives the index of the rules, EmuRuleIndexSize bytes. May be
+	NULL to only check them.
+
+Return Value:
+
+	TRUE if every rule has a known condition on a key or buttons that exist,
+	and a known action,
+	FALSE otherwise.
+
+--*/
+{
+	for (USHORT i = 0; i < RuleCount; i++)
+	{
+		if (Rules[i].ConditionType > EMU_CONDITION_BUTTON_UP)
+			return FALSE;
+		if ((Rules[i].ConditionType == EMU_CONDITION_KEY_DOWN || Rules[i].ConditionType == EMU_CONDITION_KEY_UP) &&
+			Rules[i].ConditionValue >= EMU_KEY_STATE_BITS)
+			return FALSE;
+		if ((Rules[i].ConditionType == EMU_CONDITION_BUTTON_DOWN || Rules[i].ConditionType == EMU_CONDITION_BUTTON_UP) &&
+			(Rules[i].ConditionValue == 0 || (Rules[i].ConditionValue & ~EMU_BUTTON_DOWN_MASK) != 0))
+			return FALSE;
+		if (Rules[i].Action != EMU_RULE_DROP && Rules[i].Action != EMU_RULE_REMAP)
+			return FALSE;
+	}
+	if (Index == NULL)
+		return TRUE;
+
+	Index->RuleCount = RuleCount;
+	Index->ButtonHeadMask = 0;
+	for (USHORT i = 0; i < EMU_RULE_KEY_HEADS; i++)
+		Index->KeyHeads[i] = EMU_RULE_INDEX_END;
+	for (USHORT i = 0; i < EMU_RULE_BUTTON_HEADS; i++)
+		Index->ButtonHeads[i] = EMU_RULE_INDEX_END;
+	//built from the last rule so every chain keeps the order of the rules
+	for (USHORT i = RuleCount; i-- > 0;)
+	{
+		USHORT head = Rules[i].From & (EMU_RULE_KEY_HEADS - 1);
+		USHORT bit = 0;
+
+		Index->Next[i] = Index->KeyHeads[head];
+		Index->KeyHeads[head] = i;
+		//a mouse rule without flags never matches
+		if (Rules[i].From == 0) {
+			Index->Next[RuleCount + i] = EMU_RULE_INDEX_END;
+			continue;
+		}
+		while ((Rules[i].From & (1 << bit)) == 0)
+			bit++;
+		Index->Next[RuleCount + i] = Index->ButtonHeads[bit];
+		Index->ButtonHeads[bit] = i;
+		Index->ButtonHeadMask |= (USHORT)(1 << bit);
+	}
+	return TRUE;
+}
+
+BOOLEAN
+EmuRuleConditionHolds(
+	IN const EMU_RULE* Rule,
+	IN OPTIONAL const EMU_INPUT_STATE* KeyboardState,
+	IN OPTIONAL const EMU_INPUT_STATE* MouseState)
+/*++
+
+Routine Description:
+
+	Checks the condition of a rule against the live device state. A missing
+	state (the other filter is not loaded) counts as nothing held.
+
+Arguments:
+
+	Rule - Rule whose condition is checked.
+
+	KeyboardState - Key state of all keyboards, may be NULL.
+
+	MouseState - Button state of all mice, may be NULL.
+
+Return Value:
+
+	TRUE if the rule applies,
+	FALSE otherwise.
+
+--*/
+{
+	switch (Rule->ConditionType) {
+	case EMU_CONDITION_KEY_DOWN:
+		return KeyboardState != NULL && EmuIsKeyDown(KeyboardState, Rule->ConditionValue);
+	case EMU_CONDITION_KEY_UP:
+		return KeyboardState == NULL || !EmuIsKeyDown(KeyboardState, Rule->ConditionValue);
+	case EMU_CONDITION_BUTTON_DOWN:
+		return MouseState != NULL && EmuIsButtonDown(MouseState, Rule->ConditionValue);
+	case EMU_CONDITION_BUTTON_UP:
+		return MouseState == NULL || !EmuIsButtonDown(MouseState, Rule->ConditionValue);
+	default:
+		return TRUE;
+	}
+}
+
+ULONG
+EmuApplyKeyboardRules(
+	IN const EMU_RULE* Rules,
+	IN const EMU_RULE_INDEX* Index,
+	IN OPTIONAL const EMU_INPUT_STATE* KeyboardState,
+	IN OPTIONAL const EMU_INPUT_STATE* MouseState,
+	IN OUT PKEYBOARD_INPUT_DATA Inputs,
+	IN ULONG InputCount,
+	IN OUT OPTIONAL PEMU_KEY_LATCHES Latches,
+	IN OUT OPTIONAL PULONG64 RuleHits,
+	OUT PULONG Remapped)
+/*++
+
+Routine Description:
+
+	Applies the first matching rule to every key. Dropped keys are removed
+	from the buffer and the remaining ones keep their order. Only the key
+	chain of the scan code of a packet is walked.
+
+	What a press went through, a rule or none, is latched for the key. Its
+	repeats and its release are dropped or remapped the same way whatever
+	the conditions are by then, so a key remapped while a button was held
+	is still released as the key it was remapped to.
+
+Arguments:
+
+	Rules - Rule entries.
+
+	Index - Index of the rules, from EmuValidateRules.
+
+	KeyboardState - Key state of all keyboards, may be NULL.
+
+	MouseState - Button state of all mice, may be NULL.
+
+	Inputs - Keyboard packets, modified in place.
+
+	InputCount - Number of packets.
+
+	Latches - How the presses of the held keys went through the rules, kept
+	per device. May be NULL to evaluate every packet on its own.
+
+	RuleHits - Counters indexed like the rules, the rule applied to every
+	press, or to a packet evaluated on its own, is counted. May be NULL.
+
+	Remapped - Receives the number of keys a rule remapped.
+
+Return Value:
+
+	Number of packets left in the buffer.
+
+--*/
+{
+	ULONG kept = 0;
+
+	*Remapped = 0;
+
+	for (ULONG i = 0; i < InputCount; i++)
+	{
+		BOOLEAN drop = FALSE;
+		USHORT checkFlag = Inputs[i].Flags == 0 ? 1 : (USHORT)(Inputs[i].Flags << 1);
+		PEMU_KEY_LATCH latch = Latches != NULL ? &Latches->Keys[EMU_KEY_INDEX(Inputs[i].MakeCode, Inputs[i].Flags)] : NULL;
+
+		if (latch != NULL && latch->State != EMU_LATCH_NONE) {
+			//a repeat or the release of a latched press
+			if (latch->State == EMU_LATCH_DROP)
+				drop = TRUE;
+			else if (latch->State == EMU_LATCH_REMAP) {
+				Inputs[i].MakeCode = latch->To;
+				(*Remapped)++;
+			}
+			if (Inputs[i].Flags & KEY_BREAK)
+				latch->State = EMU_LATCH_NONE;
+		}
+		else {
+			UCHAR state = EMU_LATCH_PASS;
+			for (USHORT j = Index->KeyHeads[Inputs[i].MakeCode & (EMU_RULE_KEY_HEADS - 1)]; j != EMU_RULE_INDEX_END; j = Index->Next[j])
+			{
+				if (Inputs[i].MakeCode != Rules[j].From || (checkFlag & Rules[j].FlagPredicates) == 0)
+					continue;
+				if (!EmuRuleConditionHolds(&Rules[j], KeyboardState, MouseState))
+					continue;
+				if (RuleHits != NULL)
+					RuleHits[j]++;
+				if (Rules[j].Action == EMU_RULE_DROP) {
+					drop = TRUE;
+					state = EMU_LATCH_DROP;
+				}
+				else {
+					Inputs[i].MakeCode = Rules[j].To;
+					(*Remapped)++;
+					state = EMU_LATCH_REMAP;
+				}
+				break;
+			}
+			//a release without a latched press, of a key held before the rules were set, is evaluated on its own
+			if (latch != NULL && (Inputs[i].Flags & KEY_BREAK) == 0) {
+				latch->State = state;
+				latch->To = Inputs[i].MakeCode;
+			}
+		}
+		if (drop)
+			continue;
+		if (kept != i)
+			Inputs[kept] = Inputs[i];
+		kept++;
+	}
+	return kept;
+}
+
+ULONG
+EmuApplyMouseRules(
+	IN const EMU_RULE* Rules,
+	IN const EMU_RULE_INDEX* Index,
+	IN OPTIONAL const EMU_INPUT_STATE* KeyboardState,
+	IN OPTIONAL const EMU_INPUT_STATE* MouseState,
+	IN OUT PMOUSE_INPUT_DATA Inputs,
+	IN ULONG InputCount,
+	IN OUT OPTIONAL PEMU_BUTTON_LATCHES Latches,
+	IN OUT OPTIONAL PULONG64 RuleHits)
+/*++
+
+Routine Description:
+
+	Applies every matching rule to the button flags of every packet. Rules
+	are matched against the original flags, so two rules can swap buttons.
+	Packets are never removed since they may carry movement as well. Only
+	the button chains of the flags set in a packet are walked.
+
+	The down flags the press of a button was turned into are latched. Its
+	release is turned into the up flags of those buttons, whatever the
+	conditions are by then, instead of going through the rules again.
+
+Arguments:
+
+	Rules - Rule entries.
+
+	Index - Index of the rules, from EmuValidateRules.
+
+	KeyboardState - Key state of all keyboards, may be NULL.
+
+	MouseState - Button state of all mice, may be NULL.
+
+	Inputs - Mouse packets, modified in place.
+
+	InputCount - Number of packets.
+
+	Latches - What the presses of the held buttons were turned into, kept
+	per device. May be NULL to evaluate every packet on its own.
+
+	RuleHits - Counters indexed like the rules, every applied rule is
+	counted. May be NULL.
+
+Return Value:
+
+	Number of packets whose button flags changed.
+
+--*/
+{
+	ULONG modified = 0;
+
+	for (ULONG i = 0; i < InputCount; i++)
+	{
+		USHORT original = Inputs[i].ButtonFlags;
+		USHORT live = original;
+		USHORT released = 0;
+		USHORT stripped = 0;
+		USHORT added = 0;
+		USHORT pressed[EMU_LATCH_BUTTONS] = { 0 };
+		USHORT button;
+		USHORT heads;
+		if (original == 0)
+			continue;
+		//the release of a latched press releases what the press was turned into
+		if (Latches != NULL) {
+			for (button = 0; button < EMU_LATCH_BUTTONS; button++)
+			{
+				USHORT down = (USHORT)(1 << (2 * button));
+				if ((live & (down << 1)) == 0 || (Latches->Latched & down) == 0)
+					continue;
+				live &= (USHORT)~(down << 1);
+				released |= (USHORT)(Latches->Outputs[button] << 1);
+				Latches->Latched &= (USHORT)~down;
+			}
+		}
+		//a rule can only match if the lowest flag of its From is set
+		heads = (USHORT)(live & Index->ButtonHeadMask);
+		for (USHORT bit = 0; heads != 0; bit++, heads >>= 1)
+		{
+			if ((heads & 1) == 0)
+				continue;
+			for (USHORT j = Index->ButtonHeads[bit]; j != EMU_RULE_INDEX_END; j = Index->Next[Index->RuleCount + j])
+			{
+				if ((live & Rules[j].From) != Rules[j].From)
+					continue;
+				if (!EmuRuleConditionHolds(&Rules[j], KeyboardState, MouseState))
+					continue;
+				if (RuleHits != NULL)
+					RuleHits[j]++;
+				stripped |= Rules[j].From;
+				if (Rules[j].Action != EMU_RULE_REMAP)
+					continue;
+				added |= Rules[j].To;
+				for (button = 0; button < EMU_LATCH_BUTTONS; button++)
+				{
+					if (Rules[j].From & (1 << (2 * button)))
+						pressed[button] |= Rules[j].To & EMU_BUTTON_DOWN_MASK;
+				}
+			}
+		}
+		if (Latches != NULL) {
+			for (button = 0; button < EMU_LATCH_BUTTONS; button++)
+			{
+				USHORT down = (USHORT)(1 << (2 * button));
+				if ((live & down) == 0)
+					continue;
+				Latches->Latched |= down;
+				Latches->Outputs[button] = (stripped & down) ? pressed[button] : down;
+			}
+		}
+		Inputs[i].ButtonFlags = (USHORT)((live & ~stripped) | added | released);
+		if (Inputs[i].ButtonFlags != original)
+			modified++;
+	}
+	return modified;
+}
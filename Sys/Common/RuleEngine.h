@@ -0,0 +1,154 @@
+/*++
+
+Module Name:
+
+	RuleEngine.h
+
+Abstract:
+
+	Evaluation of conditional rules against keyboard and mouse packets.
+	Shared by both filters, it only depends on EmuTypes.h so it builds
+	off target as well.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef RULEENGINE_H
+#define RULEENGINE_H
+
+#include "EmuTypes.h"
+#include "RuleTypes.h"
+#include "InputState.h"
+
+//
+//How the press of a key went through the rules, its repeats and release go the same way
+//
+#define EMU_LATCH_NONE		0
+#define EMU_LATCH_PASS		1
+#define EMU_LATCH_DROP		2
+#define EMU_LATCH_REMAP		3
+
+//
+//Mouse buttons with a MOUSE_*_BUTTON_DOWN flag in EMU_BUTTON_DOWN_MASK
+//
+#define EMU_LATCH_BUTTONS	5
+
+typedef struct _EMU_KEY_LATCH {
+	//
+	//EMU_LATCH_*, EMU_LATCH_NONE while the key is not held
+	//
+	UCHAR State;
+	UCHAR Reserved;
+	//
+	//Scan code the press was remapped to
+	//
+	USHORT To;
+
+} EMU_KEY_LATCH, * PEMU_KEY_LATCH;
+
+typedef struct _EMU_KEY_LATCHES {
+	//
+	//Indexed by EMU_KEY_INDEX of the key as the rules see it
+	//
+	EMU_KEY_LATCH Keys[EMU_KEY_STATE_BITS];
+
+} EMU_KEY_LATCHES, * PEMU_KEY_LATCHES;
+
+typedef struct _EMU_BUTTON_LATCHES {
+	//
+	//MOUSE_*_BUTTON_DOWN flags of the buttons whose press went through the rules
+	//
+	USHORT Latched;
+	//
+	//Down flags the press of every latched button was turned into, by button
+	//
+	USHORT Outputs[EMU_LATCH_BUTTONS];
+
+} EMU_BUTTON_LATCHES, * PEMU_BUTTON_LATCHES;
+
+//
+//Heads of the rule index, one key chain per low byte of the scan code and
+//one button chain per button flag
+//
+#define EMU_RULE_KEY_HEADS		256
+#define EMU_RULE_BUTTON_HEADS	16
+#define EMU_RULE_INDEX_END		0xFFFF
+
+typedef struct _EMU_RULE_INDEX {
+	USHORT RuleCount;
+	//
+	//Button flags a button chain starts at
+	//
+	USHORT ButtonHeadMask;
+	//
+	//First keyboard rule whose From has the low byte of the index, the
+	//others follow in Next[rule] in the order of the rules
+	//
+	USHORT KeyHeads[EMU_RULE_KEY_HEADS];
+	//
+	//First mouse rule whose lowest From flag is 1 << index, the others
+	//follow in Next[RuleCount + rule]
+	//
+	USHORT ButtonHeads[EMU_RULE_BUTTON_HEADS];
+	//
+	//Key chain links of all the rules, then their button chain links,
+	//EMU_RULE_INDEX_END ends a chain
+	//
+	USHORT Next[1];
+
+} EMU_RULE_INDEX, * PEMU_RULE_INDEX;
+
+FORCEINLINE
+ULONG
+EmuRuleIndexSize(
+	IN USHORT RuleCount)
+/*++
+
+Routine Description:
+
+	Returns the bytes of the index of RuleCount rules.
+
+--*/
+{
+	return (ULONG)FIELD_OFFSET(EMU_RULE_INDEX, Next) + 2 * RuleCount * (ULONG)sizeof(USHORT);
+}
+
+BOOLEAN
+EmuValidateRules(
+	IN const EMU_RULE* Rules,
+	IN USHORT RuleCount,
+	OUT OPTIONAL PEMU_RULE_INDEX Index);
+
+BOOLEAN
+EmuRuleConditionHolds(
+	IN const EMU_RULE* Rule,
+	IN OPTIONAL const EMU_INPUT_STATE* KeyboardState,
+	IN OPTIONAL const EMU_INPUT_STATE* MouseState);
+
+ULONG
+EmuApplyKeyboardRules(
+	IN const EMU_RULE* Rules,
+	IN const EMU_RULE_INDEX* Index,
+	IN OPTIONAL const EMU_INPUT_STATE* KeyboardState,
+	IN OPTIONAL const EMU_INPUT_STATE* MouseState,
+	IN OUT PKEYBOARD_INPUT_DATA Inputs,
+	IN ULONG InputCount,
+	IN OUT OPTIONAL PEMU_KEY_LATCHES Latches,
+	IN OUT OPTIONAL PULONG64 RuleHits,
+	OUT PULONG Remapped);
+
+ULONG
+EmuApplyMouseRules(
+	IN const EMU_RULE* Rules,
+	IN const EMU_RULE_INDEX* Index,
+	IN OPTIONAL const EMU_INPUT_STATE* KeyboardState,
+	IN OPTIONAL const EMU_INPUT_STATE* MouseState,
+	IN OUT PMOUSE_INPUT_DATA Inputs,
+	IN ULONG InputCount,
+	IN OUT OPTIONAL PEMU_BUTTON_LATCHES Latches,
+	IN OUT OPTIONAL PULONG64 RuleHits);
+
+#endif // RULEENGINE_H
@@ -0,0 +1,253 @@
+/*--
+
+Module Name:
+
+	RuleImage.c
+
+Abstract:
+
+	Parsing and writing of the persisted profile image.
+
+--*/
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#endif
+#include "RuleImage.h"
+
+//
+//CRC-32 (IEEE 802.3, reflected) of every 4 bit value
+//
+static const ULONG Crc32Nibbles[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+	0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+	0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+ULONG
+EmuCrc32(
+	IN ULONG Crc,
+	IN const VOID* Data,
+	IN ULONG Length)
+/*++
+
+Routine Description:
+
+	Continues a CRC-32 over Data. Start with 0 for a new checksum.
+
+Arguments:
+
+	Crc - Checksum of the preceding bytes.
+
+	Data - Bytes to add.
+
+	Length - Number of bytes.
+
+Return Value:
+
+	The updated checksum.
+
+--*/
+{
+	const UCHAR* bytes = (const UCHAR*)Data;
+
+	Crc = ~Crc;
+	for (ULONG i = 0; i < Length; i++)
+	{
+		Crc ^= bytes[i];
+		Crc = (Crc >> 4) ^ Crc32Nibbles[Crc & 0x0F];
+		Crc = (Crc >> 4) ^ Crc32Nibbles[Crc & 0x0F];
+	}
+	return ~Crc;
+}
+
+BOOLEAN
+EmuValidateRuleImage(
+	IN const VOID* Image,
+	IN ULONG Size)
+/*++
+
+Routine Description:
+
+	Checks the header, the checksum and that every section lies inside the
+	image. Section payloads are not interpreted, that is up to the driver.
+
+Arguments:
+
+	Image - Image bytes, no alignment required.
+
+	Size - Number of bytes in Image.
+
+Return Value:
+
+	TRUE if the image can be walked with EmuNextImageSection,
+	FALSE otherwise.
+
+--*/
+{
+	EMU_IMAGE_HEADER header;
+	EMU_IMAGE_CURSOR cursor;
+	EMU_IMAGE_SECTION section;
+	const UCHAR* payload;
+
+	if (Image == NULL || Size < sizeof(EMU_IMAGE_HEADER) || Size > EMU_IMAGE_MAX_SIZE)
+		return FALSE;
+	RtlCopyMemory(&header, Image, sizeof(header));
+	if (header.Magic != EMU_IMAGE_MAGIC || header.Version != EMU_IMAGE_VERSION || header.Size != Size)
+		return FALSE;
+	if (EmuCrc32(0, (const UCHAR*)Image + sizeof(header), Size - sizeof(header)) != header.Checksum)
+		return FALSE;
+
+	EmuOpenRuleImage(&cursor, Image);
+	while (EmuNextImageSection(&cursor, &section, &payload))
+		;
+	//every section must be well formed and nothing may trail the last one
+	return cursor.SectionsLeft == 0 && cursor.Next == cursor.End;
+}
+
+VOID
+EmuOpenRuleImage(
+	OUT PEMU_IMAGE_CURSOR Cursor,
+	IN const VOID* Image)
+/*++
+
+Routine Description:
+
+	Positions the cursor on the first section of an image that passed
+	EmuValidateRuleImage.
+
+--*/
+{
+	EMU_IMAGE_HEADER header;
+
+	RtlCopyMemory(&header, Image, sizeof(header));
+	Cursor->Next = (const UCHAR*)Image + sizeof(header);
+	Cursor->End = (const UCHAR*)Image + header.Size;
+	Cursor->SectionsLeft = header.SectionCount;
+}
+
+BOOLEAN
+EmuNextImageSection(
+	IN OUT PEMU_IMAGE_CURSOR Cursor,
+	OUT PEMU_IMAGE_SECTION Section,
+	OUT const UCHAR** Payload)
+/*++
+
+Routine Description:
+
+	Returns the next section and moves the cursor past its payload.
+
+Arguments:
+
+	Cursor - Cursor from EmuOpenRuleImage.
+
+	Section - Receives the section header.
+
+	Payload - Receives a pointer to the first payload byte, which may be unaligned.
+
+Return Value:
+
+	TRUE if a section was returned,
+	FALSE if there are no more sections or the next one does not fit in the image.
+
+--*/
+{
+	if (Cursor->SectionsLeft == 0 || (ULONG)(Cursor->End - Cursor->Next) < sizeof(EMU_IMAGE_SECTION))
+		return FALSE;
+	RtlCopyMemory(Section, Cursor->Next, sizeof(EMU_IMAGE_SECTION));
+	if (Section->Length > (ULONG)(Cursor->End - Cursor->Next) - sizeof(EMU_IMAGE_SECTION))
+		return FALSE;
+	*Payload = Cursor->Next + sizeof(EMU_IMAGE_SECTION);
+	Cursor->Next = *Payload + Section->Length;
+	Cursor->SectionsLeft--;
+	return TRUE;
+}
+
+BOOLEAN
+EmuAppendImageSection(
+	IN OUT OPTIONAL PUCHAR Image,
+	IN ULONG Capacity,
+	IN OUT PULONG Size,
+	IN USHORT Type,
+	IN USHORT Profile,
+	IN const VOID* Prefix,
+	IN ULONG PrefixLength,
+	IN OPTIONAL const VOID* Data,
+	IN ULONG DataLength)
+/*++
+
+Routine Description:
+
+	Appends a section whose payload is Prefix followed by Data. With a NULL
+	Image only Size is advanced, so the same code can measure the image
+	before it is allocated.
+
+Arguments:
+
+	Image - Image being written, starts with room for EMU_IMAGE_HEADER. May be NULL.
+
+	Capacity - Number of bytes in Image.
+
+	Size - Bytes written so far, advanced by the section size.
+
+	Type - EMU_IMAGE_SECTION_TYPE.
+
+	Profile - Index of the profile.
+
+	Prefix - First part of the payload, usually the counts.
+
+	PrefixLength - Number of bytes in Prefix.
+
+	Data - Second part of the payload, usually the entries. May be NULL if DataLength is 0.
+
+	DataLength - Number of bytes in Data.
+
+Return Value:
+
+	TRUE if the section was appended,
+	FALSE if it does not fit in Capacity.
+
+--*/
+{
+	EMU_IMAGE_SECTION section;
+	ULONG sectionSize = sizeof(section) + PrefixLength + DataLength;
+
+	if (Image != NULL) {
+		if (Capacity < *Size || Capacity - *Size < sectionSize)
+			return FALSE;
+		section.Type = Type;
+		section.Profile = Profile;
+		section.Length = PrefixLength + DataLength;
+		RtlCopyMemory(Image + *Size, &section, sizeof(section));
+		RtlCopyMemory(Image + *Size + sizeof(section), Prefix, PrefixLength);
+		if (DataLength > 0)
+			RtlCopyMemory(Image + *Size + sizeof(section) + PrefixLength, Data, DataLength);
+	}
+	*Size += sectionSize;
+	return TRUE;
+}
+
+VOID
+EmuFinishRuleImage(
+	IN OUT PUCHAR Image,
+	IN ULONG Size,
+	IN USHORT SectionCount)
+/*++
+
+Routine Description:
+
+	Writes the header of an image whose sections were appended with
+	EmuAppendImageSection.
+
+--*/
+{
+	EMU_IMAGE_HEADER header;
+
+	header.Magic = EMU_IMAGE_MAGIC;
+	header.Version = EMU_IMAGE_VERSION;
+	header.SectionCount = SectionCount;
+	header.Size = Size;
+	header.Checksum = EmuCrc32(0, Image + sizeof(header), Size - sizeof(header));
+	RtlCopyMemory(Image, &header, sizeof(header));
+}
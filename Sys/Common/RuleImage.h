@@ -0,0 +1,138 @@
+/*++
+
+Module Name:
+
+	RuleImage.h
+
+Abstract:
+
+	Compact binary image of the profiles of a filter device. The drivers
+	persist it in their Parameters registry key and apply it to every device
+	before it is connected, so the tables are active from the first packet.
+
+	An image is an EMU_IMAGE_HEADER followed by 'SectionCount' sections, each
+	an EMU_IMAGE_SECTION and 'Length' bytes of payload. Payloads have the
+	layout of the input buffer of the matching SET IOCTL. Nothing is aligned,
+	readers copy fields out of the image.
+
+	The parser does not trust the image. Every length is checked against the
+	image size before it is used, so it can be fed arbitrary bytes.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef RULEIMAGE_H
+#define RULEIMAGE_H
+
+#include "EmuTypes.h"
+
+#define EMU_IMAGE_MAGIC		0x554D4549 //'IEMU'
+#define EMU_IMAGE_VERSION	1
+#define EMU_IMAGE_MAX_SIZE	(1024 * 1024)
+
+//
+//Name of the REG_BINARY value under the Parameters key of the driver
+//
+#define EMU_IMAGE_VALUE_NAME L"RuleImage"
+//
+//Name of the value holding the image saved for one device, formatted with its
+//handle. Devices without one start with the image of EMU_IMAGE_VALUE_NAME
+//
+#define EMU_IMAGE_DEVICE_VALUE_FORMAT L"RuleImage.%08X"
+#define EMU_IMAGE_DEVICE_VALUE_CHARS 18
+
+typedef enum _EMU_IMAGE_SECTION_TYPE {
+	//USHORT index of the active profile, 'Profile' is ignored
+	EMU_SECTION_ACTIVE_PROFILE = 0x0001,
+	//Input buffer of the SET_FILTER IOCTL
+	EMU_SECTION_FILTER = 0x0002,
+	//Input buffer of the SET_MODIFY IOCTL
+	EMU_SECTION_MODIFY = 0x0003,
+	//Input buffer of the SET_RULES IOCTL
+	EMU_SECTION_RULES = 0x0004,
+	//Hotkey of the profile as in the Hotkeys member of the profile data
+	EMU_SECTION_HOTKEY = 0x0005,
+} EMU_IMAGE_SECTION_TYPE;
+
+typedef struct _EMU_IMAGE_HEADER {
+	//EMU_IMAGE_MAGIC
+	ULONG Magic;
+	//EMU_IMAGE_VERSION
+	USHORT Version;
+	//Number of sections following the header
+	USHORT SectionCount;
+	//Size of the whole image including this header
+	ULONG Size;
+	//CRC-32 of everything following this header
+	ULONG Checksum;
+} EMU_IMAGE_HEADER, * PEMU_IMAGE_HEADER;
+
+typedef struct _EMU_IMAGE_SECTION {
+	//EMU_IMAGE_SECTION_TYPE
+	USHORT Type;
+	//Index of the profile the section belongs to
+	USHORT Profile;
+	//Number of payload bytes following this section header
+	ULONG Length;
+} EMU_IMAGE_SECTION, * PEMU_IMAGE_SECTION;
+
+typedef struct _EMU_IMAGE_CURSOR {
+	const UCHAR* Next;
+	const UCHAR* End;
+	USHORT SectionsLeft;
+} EMU_IMAGE_CURSOR, * PEMU_IMAGE_CURSOR;
+
+FORCEINLINE
+USHORT
+EmuReadUshort(
+	IN const UCHAR* Source)
+{
+	USHORT value;
+	RtlCopyMemory(&value, Source, sizeof(value));
+	return value;
+}
+
+ULONG
+EmuCrc32(
+	IN ULONG Crc,
+	IN const VOID* Data,
+	IN ULONG Length);
+
+BOOLEAN
+EmuValidateRuleImage(
+	IN const VOID* Image,
+	IN ULONG Size);
+
+VOID
+EmuOpenRuleImage(
+	OUT PEMU_IMAGE_CURSOR Cursor,
+	IN const VOID* Image);
+
+BOOLEAN
+EmuNextImageSection(
+	IN OUT PEMU_IMAGE_CURSOR Cursor,
+	OUT PEMU_IMAGE_SECTION Section,
+	OUT const UCHAR** Payload);
+
+BOOLEAN
+EmuAppendImageSection(
+	IN OUT OPTIONAL PUCHAR Image,
+	IN ULONG Capacity,
+	IN OUT PULONG Size,
+	IN USHORT Type,
+	IN USHORT Profile,
+	IN const VOID* Prefix,
+	IN ULONG PrefixLength,
+	IN OPTIONAL const VOID* Data,
+	IN ULONG DataLength);
+
+VOID
+EmuFinishRuleImage(
+	IN OUT PUCHAR Image,
+	IN ULONG Size,
+	IN USHORT SectionCount);
+
+#endif // RULEIMAGE_H
@@ -0,0 +1,77 @@
+/*++
+
+Module Name:
+
+	RuleTypes.h
+
+Abstract:
+
+	Conditional rule layout shared by the keyboard and mouse filters and
+	their user mode APIs. A rule fires only while its condition holds on
+	the live state of either device class, so a keyboard rule can depend
+	on a held mouse button and the other way around.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef RULETYPES_H
+#define RULETYPES_H
+
+#include "EmuTypes.h"
+
+//
+//Index of a key in the key state, the E0 prefixed keys live in the upper half
+//
+#define EMU_KEY_INDEX(ScanCode, Flags) ((USHORT)(((ScanCode) & 0xFF) | (((Flags) & KEY_E0) ? 0x100 : 0)))
+
+typedef enum _EMU_CONDITION_TYPE {
+	//Rule always applies
+	EMU_CONDITION_NONE = 0x0000,
+	//Rule applies while the key EMU_KEY_INDEX 'ConditionValue' is held on any keyboard
+	EMU_CONDITION_KEY_DOWN = 0x0001,
+	//Rule applies while the key EMU_KEY_INDEX 'ConditionValue' is not held on any keyboard
+	EMU_CONDITION_KEY_UP = 0x0002,
+	//Rule applies while the button MOUSE_*_BUTTON_DOWN 'ConditionValue' is held on any mouse
+	EMU_CONDITION_BUTTON_DOWN = 0x0003,
+	//Rule applies while the button MOUSE_*_BUTTON_DOWN 'ConditionValue' is not held on any mouse
+	EMU_CONDITION_BUTTON_UP = 0x0004,
+} EMU_CONDITION_TYPE, * PEMU_CONDITION_TYPE;
+
+typedef enum _EMU_RULE_ACTION {
+	//Drop the key, or strip the matched button flags
+	EMU_RULE_DROP = 0x0001,
+	//Replace the scan code, or the matched button flags
+	EMU_RULE_REMAP = 0x0002,
+} EMU_RULE_ACTION, * PEMU_RULE_ACTION;
+
+typedef struct _EMU_RULE {
+	//EMU_CONDITION_TYPE
+	USHORT ConditionType;
+	//Key index or button flag the condition looks at
+	USHORT ConditionValue;
+	//EMU_RULE_ACTION
+	USHORT Action;
+	//Keyboard rules: the predicate flag as in KEY_MODIFY_DATA. Mouse rules: unused
+	USHORT FlagPredicates;
+	//Keyboard rules: scan code to match. Mouse rules: button flags that all must be set
+	USHORT From;
+	//Keyboard rules: replacement scan code. Mouse rules: replacement button flags
+	USHORT To;
+} EMU_RULE, * PEMU_RULE;
+
+typedef struct _EMU_RULE_REQUEST {
+	//
+	//Number of rule entries
+	//
+	USHORT RuleCount;
+	//
+	//Rule entries, the first matching keyboard rule wins
+	//
+	PEMU_RULE Rules;
+
+} EMU_RULE_REQUEST, * PEMU_RULE_REQUEST;
+
+#endif // RULETYPES_H
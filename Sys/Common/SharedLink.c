@@ -0,0 +1,243 @@
+/*--
+
+Module Name:
+
+	SharedLink.c
+
+Abstract:
+
+	Cross driver link between the keyboard and mouse filters.
+
+--*/
+
+#include <ntddk.h>
+#include <ntddkbd.h>
+#include "SharedLink.h"
+
+CALLBACK_FUNCTION EmuLinkCallback;
+
+VOID
+EmuLinkCallback(
+	IN PVOID CallbackContext,
+	IN PVOID Argument1,
+	IN PVOID Argument2)
+/*++
+
+Routine Description:
+
+	Called for every message posted on the callback object, including our own.
+	The callback object does not hold its lock while calling us, so waiting for
+	the rundown on withdraw is fine; withdraw is only sent at PASSIVE_LEVEL.
+
+Arguments:
+
+	CallbackContext - Our EMU_SHARED_LINK.
+
+	Argument1 - EMU_LINK_MESSAGE posted by one of the drivers.
+
+	Argument2 - Unused.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	PEMU_SHARED_LINK link = (PEMU_SHARED_LINK)CallbackContext;
+	PEMU_LINK_MESSAGE message = (PEMU_LINK_MESSAGE)Argument1;
+
+	UNREFERENCED_PARAMETER(Argument2);
+
+	if (message == NULL || message->Role == link->Role)
+		return;
+
+	switch (message->Type) {
+	case EMU_LINK_ANNOUNCE:
+		InterlockedCompareExchangePointer((PVOID volatile*)&link->PeerState, message->State, NULL);
+		message->ReplyState = link->LocalState;
+		break;
+	case EMU_LINK_WITHDRAW:
+		if (link->PeerState != message->State)
+			break;
+		InterlockedExchangePointer((PVOID volatile*)&link->PeerState, NULL);
+		//wait for the service callbacks still reading the block, then let new readers in again
+		ExWaitForRundownProtectionReleaseCacheAware(link->PeerRundown);
+		ExReInitializeRundownProtectionCacheAware(link->PeerRundown);
+		break;
+	}
+}
+
+_Use_decl_annotations_
+NTSTATUS
+EmuLinkOpen(
+	PEMU_SHARED_LINK Link,
+	ULONG Role,
+	PEMU_INPUT_STATE LocalState)
+/*++
+
+Routine Description:
+
+	Opens the named callback object, registers on it and announces our state
+	block. If the other driver is already loaded it replies with its block.
+
+Arguments:
+
+	Link - Link to initialize, must stay valid until EmuLinkClose.
+
+	Role - EMU_LINK_ROLE of the calling driver.
+
+	LocalState - State block maintained by the calling driver.
+
+Return Value:
+
+	STATUS_SUCCESS if successful,
+	error status of ExCreateCallback or STATUS_INSUFFICIENT_RESOURCES otherwise.
+	The link stays usable without a peer on failure.
+
+--*/
+{
+	NTSTATUS			status;
+	OBJECT_ATTRIBUTES	attributes;
+	UNICODE_STRING		callbackName = RTL_CONSTANT_STRING(EMU_LINK_CALLBACK_NAME);
+	EMU_LINK_MESSAGE	message;
+
+	PAGED_CODE();
+
+	RtlZeroMemory(Link, sizeof(EMU_SHARED_LINK));
+	Link->Role = Role;
+	Link->LocalState = LocalState;
+	Link->PeerRundown = ExAllocateCacheAwareRundownProtection(NonPagedPool, EMU_LINK_POOL_TAG);
+	if (Link->PeerRundown == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	InitializeObjectAttributes(&attributes, &callbackName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+	status = ExCreateCallback(&Link->CallbackObject, &attributes, TRUE, TRUE);
+	if (!NT_SUCCESS(status)) {
+		Link->CallbackObject = NULL;
+		ExFreeCacheAwareRundownProtection(Link->PeerRundown);
+		Link->PeerRundown = NULL;
+		return status;
+	}
+
+	Link->Registration = ExRegisterCallback(Link->CallbackObject, EmuLinkCallback, Link);
+	if (Link->Registration == NULL) {
+		ObDereferenceObject(Link->CallbackObject);
+		Link->CallbackObject = NULL;
+		ExFreeCacheAwareRundownProtection(Link->PeerRundown);
+		Link->PeerRundown = NULL;
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	RtlZeroMemory(&message, sizeof(message));
+	message.Type = EMU_LINK_ANNOUNCE;
+	message.Role = Role;
+	message.State = LocalState;
+	ExNotifyCallback(Link->CallbackObject, &message, NULL);
+	if (message.ReplyState != NULL)
+		InterlockedCompareExchangePointer((PVOID volatile*)&Link->PeerState, message.ReplyState, NULL);
+
+	return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+VOID
+EmuLinkClose(
+	PEMU_SHARED_LINK Link)
+/*++
+
+Routine Description:
+
+	Withdraws our state block, the peer returns only after its readers are
+	done with it, and unregisters from the callback object.
+
+Arguments:
+
+	Link - Link opened by EmuLinkOpen.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	EMU_LINK_MESSAGE message;
+
+	PAGED_CODE();
+
+	if (Link->CallbackObject == NULL)
+		return;
+
+	RtlZeroMemory(&message, sizeof(message));
+	message.Type = EMU_LINK_WITHDRAW;
+	message.Role = Link->Role;
+	message.State = Link->LocalState;
+	ExNotifyCallback(Link->CallbackObject, &message, NULL);
+
+	ExUnregisterCallback(Link->Registration);
+	Link->Registration = NULL;
+	InterlockedExchangePointer((PVOID volatile*)&Link->PeerState, NULL);
+	ExWaitForRundownProtectionReleaseCacheAware(Link->PeerRundown);
+
+	ObDereferenceObject(Link->CallbackObject);
+	Link->CallbackObject = NULL;
+	ExFreeCacheAwareRundownProtection(Link->PeerRundown);
+	Link->PeerRundown = NULL;
+}
+
+_Use_decl_annotations_
+PEMU_INPUT_STATE
+EmuLinkAcquirePeer(
+	PEMU_SHARED_LINK Link)
+/*++
+
+Routine Description:
+
+	Returns the state block of the other driver for the duration of a service
+	callback. A non NULL result must be handed back with EmuLinkReleasePeer.
+	While the other driver is not loaded this reads PeerState only and
+	touches no shared counter.
+
+Arguments:
+
+	Link - Link opened by EmuLinkOpen.
+
+Return Value:
+
+	Peer state block, NULL if the other driver is not loaded.
+
+--*/
+{
+	PEMU_INPUT_STATE peerState;
+
+	if (ReadPointerNoFence((PVOID volatile*)&Link->PeerState) == NULL)
+		return NULL;
+	if (!ExAcquireRundownProtectionCacheAware(Link->PeerRundown))
+		return NULL;
+	peerState = Link->PeerState;
+	if (peerState == NULL)
+		ExReleaseRundownProtectionCacheAware(Link->PeerRundown);
+	return peerState;
+}
+
+_Use_decl_annotations_
+VOID
+EmuLinkReleasePeer(
+	PEMU_SHARED_LINK Link)
+/*++
+
+Routine Description:
+
+	Ends the use of the state block returned by EmuLinkAcquirePeer.
+
+Arguments:
+
+	Link - Link opened by EmuLinkOpen.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	ExReleaseRundownProtectionCacheAware(Link->PeerRundown);
+}
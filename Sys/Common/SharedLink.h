@@ -0,0 +1,116 @@
+/*++
+
+Module Name:
+
+	SharedLink.h
+
+Abstract:
+
+	Cross driver link that lets the keyboard and mouse filters read each
+	other's EMU_INPUT_STATE without a round trip through user mode.
+
+	Both drivers register on the named callback object and announce their
+	state block when they load. The peer pointer is guarded by a rundown
+	reference, so a driver that unloads can wait for the other side to
+	stop reading its block before the block goes away. The reference is
+	cache aware: every service callback takes it, and a single counter
+	would bounce between the processors serving different devices.
+
+Environment:
+
+	kernel mode only
+
+--*/
+
+#ifndef SHAREDLINK_H
+#define SHAREDLINK_H
+
+#include "InputState.h"
+
+#define EMU_LINK_CALLBACK_NAME L"\\Callback\\InputEmulatorSharedState"
+
+#define EMU_LINK_POOL_TAG (ULONG) 'lemu'
+
+typedef enum _EMU_LINK_ROLE {
+	EMU_LINK_ROLE_KEYBOARD = 1,
+	EMU_LINK_ROLE_MOUSE = 2,
+} EMU_LINK_ROLE;
+
+typedef enum _EMU_LINK_MESSAGE_TYPE {
+	//A driver loaded and publishes its state block
+	EMU_LINK_ANNOUNCE = 1,
+	//A driver unloads, its state block must not be read anymore
+	EMU_LINK_WITHDRAW = 2,
+} EMU_LINK_MESSAGE_TYPE;
+
+typedef struct _EMU_LINK_MESSAGE {
+	//
+	//EMU_LINK_MESSAGE_TYPE
+	//
+	ULONG Type;
+	//
+	//EMU_LINK_ROLE of the sender
+	//
+	ULONG Role;
+	//
+	//State block of the sender
+	//
+	PEMU_INPUT_STATE State;
+	//
+	//Filled by an already loaded peer in reply to EMU_LINK_ANNOUNCE
+	//
+	PEMU_INPUT_STATE ReplyState;
+
+} EMU_LINK_MESSAGE, * PEMU_LINK_MESSAGE;
+
+typedef struct _EMU_SHARED_LINK {
+	//
+	//The named callback object both drivers register on
+	//
+	PCALLBACK_OBJECT CallbackObject;
+	//
+	//Our registration on the callback object
+	//
+	PVOID Registration;
+	//
+	//EMU_LINK_ROLE of this driver
+	//
+	ULONG Role;
+	//
+	//State block this driver maintains
+	//
+	PEMU_INPUT_STATE LocalState;
+	//
+	//State block of the other driver, NULL while it is not loaded
+	//
+	PEMU_INPUT_STATE volatile PeerState;
+	//
+	//Held by readers of PeerState, NULL if the link could not be opened
+	//
+	PEX_RUNDOWN_REF_CACHE_AWARE PeerRundown;
+
+} EMU_SHARED_LINK, * PEMU_SHARED_LINK;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+EmuLinkOpen(
+	OUT PEMU_SHARED_LINK Link,
+	IN ULONG Role,
+	IN PEMU_INPUT_STATE LocalState);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+EmuLinkClose(
+	IN OUT PEMU_SHARED_LINK Link);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+PEMU_INPUT_STATE
+EmuLinkAcquirePeer(
+	IN PEMU_SHARED_LINK Link);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+EmuLinkReleasePeer(
+	IN PEMU_SHARED_LINK Link);
+
+#endif // SHAREDLINK_H
@@ -0,0 +1,156 @@
+/*++
+
+Module Name:
+
+	SharedRules.h
+
+Abstract:
+
+	Reference counted rule tables. The rules of a profile live in the
+	Rules array of an EMU_SHARED_RULES block, and EMU_RULE_REQUEST points
+	at that array, so the rule engine and the IOCTLs keep seeing a plain
+	EMU_RULE table. One upload can be installed in the profiles of many
+	devices; each of them holds a reference and the last one to let go
+	frees the block.
+
+	The index EmuValidateRules builds for the rule engine follows the
+	rules in the same block.
+
+	A table is never written after it is installed, replacing rules
+	installs a new table. Only its hit counters keep changing, a table
+	allocated while rule hits are counted carries an EMU_STATS block with
+	one counter per rule.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef SHAREDRULES_H
+#define SHAREDRULES_H
+
+#include "EmuTypes.h"
+#include "RuleTypes.h"
+#include "RuleEngine.h"
+#include "EmuStats.h"
+
+typedef struct _EMU_SHARED_RULES {
+	//
+	//Profiles the table is installed in, plus one for the upload in progress
+	//
+	volatile LONG References;
+	USHORT RuleCount;
+	USHORT Reserved;
+	//
+	//Hit counters of the rules, NULL if the table does not count them
+	//
+	PEMU_STATS Hits;
+	//
+	//Index of the rules, behind them
+	//
+	PEMU_RULE_INDEX Index;
+	EMU_RULE Rules[1];
+
+} EMU_SHARED_RULES, * PEMU_SHARED_RULES;
+
+FORCEINLINE
+ULONG
+EmuSharedRulesSize(
+	IN USHORT RuleCount)
+/*++
+
+Routine Description:
+
+	Returns the bytes of a shared table of RuleCount rules and their index.
+
+--*/
+{
+	return (ULONG)FIELD_OFFSET(EMU_SHARED_RULES, Rules) + RuleCount * (ULONG)sizeof(EMU_RULE) + EmuRuleIndexSize(RuleCount);
+}
+
+FORCEINLINE
+PEMU_RULE
+EmuSharedRulesInitialize(
+	OUT PVOID Block,
+	IN USHORT RuleCount)
+/*++
+
+Routine Description:
+
+	Sets up a block of EmuSharedRulesSize bytes as a table owned by the
+	caller and returns its rules for the caller to fill. EmuValidateRules
+	fills the index with EmuSharedRulesIndex.
+
+--*/
+{
+	PEMU_SHARED_RULES table = (PEMU_SHARED_RULES)Block;
+
+	table->References = 1;
+	table->RuleCount = RuleCount;
+	table->Reserved = 0;
+	table->Hits = NULL;
+	table->Index = (PEMU_RULE_INDEX)&table->Rules[RuleCount];
+	return table->Rules;
+}
+
+FORCEINLINE
+PVOID
+EmuSharedRulesBlock(
+	IN PEMU_RULE Rules)
+/*++
+
+Routine Description:
+
+	Returns the block a table of rules lives in, the one to free.
+
+--*/
+{
+	return (PUCHAR)Rules - FIELD_OFFSET(EMU_SHARED_RULES, Rules);
+}
+
+FORCEINLINE
+PEMU_STATS
+EmuSharedRulesHits(
+	IN PEMU_RULE Rules)
+{
+	return ((PEMU_SHARED_RULES)EmuSharedRulesBlock(Rules))->Hits;
+}
+
+FORCEINLINE
+PEMU_RULE_INDEX
+EmuSharedRulesIndex(
+	IN const EMU_RULE* Rules)
+{
+	return ((PEMU_SHARED_RULES)EmuSharedRulesBlock((PEMU_RULE)Rules))->Index;
+}
+
+FORCEINLINE
+VOID
+EmuSharedRulesReference(
+	IN PEMU_RULE Rules)
+{
+	InterlockedIncrement(&((PEMU_SHARED_RULES)EmuSharedRulesBlock(Rules))->References);
+}
+
+FORCEINLINE
+BOOLEAN
+EmuSharedRulesRelease(
+	IN PEMU_RULE Rules)
+/*++
+
+Routine Description:
+
+	Drops one reference to a table.
+
+Return Value:
+
+	TRUE if it was the last one and the block must be freed,
+	FALSE otherwise.
+
+--*/
+{
+	return InterlockedDecrement(&((PEMU_SHARED_RULES)EmuSharedRulesBlock(Rules))->References) == 0;
+}
+
+#endif // SHAREDRULES_H
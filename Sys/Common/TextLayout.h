@@ -0,0 +1,391 @@
+/*++
+
+Module Name:
+
+	TextLayout.h
+
+Abstract:
+
+	Compiles text into the keyboard packets that type it, through a table
+	of the key and modifiers typing every character of a layout.
+
+	A layout table is indexed by the UTF-16 code unit of a character, so a
+	lookup is one load. Characters past the end of the table, surrogate
+	pairs and characters the layout has no key for are skipped.
+
+	Modifiers stay pressed while consecutive characters need them, so a
+	run of capitals takes one shift press. Every compiled buffer releases
+	the modifiers it pressed, the packets of one call are complete and go
+	to the driver in one insert. A call stops before the first character
+	whose packets, with the releases after them, don't fit, and returns
+	how much of the text it consumed so the rest is compiled into the
+	next buffer.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef TEXTLAYOUT_H
+#define TEXTLAYOUT_H
+
+#include "EmuTypes.h"
+
+//
+//Modifiers a key is typed with
+//
+#define EMU_LAYOUT_SHIFT		0x01
+#define EMU_LAYOUT_CTRL			0x02
+#define EMU_LAYOUT_ALT			0x04
+#define EMU_LAYOUT_MODIFIERS	0x07
+//
+//The scan code takes the E0 prefix
+//
+#define EMU_LAYOUT_E0			0x80
+
+//
+//Characters a table holds at most, the UTF-16 code units
+//
+#define EMU_LAYOUT_MAX_CHARS	0x10000
+//
+//Characters of the table EmuLayoutUs fills, the ASCII range
+//
+#define EMU_LAYOUT_US_CHARS		0x80
+
+//
+//Packets a character takes at most, three modifiers pressed and released
+//around the key, a buffer this many times the length of the text holds all of it
+//
+#define EMU_TEXT_MAX_INPUTS		8
+
+#define EMU_TEXT_INVALID		0xFFFFFFFF
+
+typedef struct _EMU_LAYOUT_KEY {
+	//
+	//Set 1 scan code, 0 if the layout cannot type the character
+	//
+	UCHAR ScanCode;
+	//
+	//EMU_LAYOUT_* modifiers and E0 prefix
+	//
+	UCHAR Flags;
+
+} EMU_LAYOUT_KEY, * PEMU_LAYOUT_KEY;
+
+typedef struct _EMU_LAYOUT {
+	const EMU_LAYOUT_KEY* Keys;
+	//
+	//Characters in Keys, up to EMU_LAYOUT_MAX_CHARS
+	//
+	ULONG Count;
+
+} EMU_LAYOUT, * PEMU_LAYOUT;
+
+FORCEINLINE
+VOID
+EmuLayoutUs(
+	OUT PEMU_LAYOUT_KEY Keys,
+	OUT PEMU_LAYOUT Layout)
+/*++
+
+Routine Description:
+
+	Fills a table of EMU_LAYOUT_US_CHARS keys with the US layout, for
+	callers without access to the layouts of the system.
+
+--*/
+{
+	//characters of the scan codes from First, unshifted and shifted
+	static const struct {
+		UCHAR First;
+		const char* Plain;
+		const char* Shifted;
+	} rows[] = {
+		{ 0x02, "1234567890-=", "!@#$%^&*()_+" },
+		{ 0x10, "qwertyuiop[]", "QWERTYUIOP{}" },
+		{ 0x1E, "asdfghjkl;'`", "ASDFGHJKL:\"~" },
+		{ 0x2B, "\\zxcvbnm,./", "|ZXCVBNM<>?" }
+	};
+	ULONG row;
+	ULONG i;
+
+	RtlZeroMemory(Keys, EMU_LAYOUT_US_CHARS * sizeof(EMU_LAYOUT_KEY));
+	for (row = 0; row < sizeof(rows) / sizeof(rows[0]); row++)
+	{
+		for (i = 0; rows[row].Plain[i]; i++)
+		{
+			Keys[(UCHAR)rows[row].Plain[i]].ScanCode = (UCHAR)(rows[row].First + i);
+			Keys[(UCHAR)rows[row].Shifted[i]].ScanCode = (UCHAR)(rows[row].First + i);
+			Keys[(UCHAR)rows[row].Shifted[i]].Flags = EMU_LAYOUT_SHIFT;
+		}
+	}
+	Keys[' '].ScanCode = 0x39;
+	Keys['\t'].ScanCode = 0x0F;
+	Keys['\b'].ScanCode = 0x0E;
+	Keys['\n'].ScanCode = 0x1C;
+	Keys['\r'].ScanCode = 0x1C;
+	Layout->Keys = Keys;
+	Layout->Count = EMU_LAYOUT_US_CHARS;
+}
+
+FORCEINLINE
+VOID
+EmuTextInput(
+	OUT PKEYBOARD_INPUT_DATA Input,
+	IN UCHAR ScanCode,
+	IN USHORT Flags)
+{
+	RtlZeroMemory(Input, sizeof(KEYBOARD_INPUT_DATA));
+	Input->MakeCode = ScanCode;
+	Input->Flags = Flags;
+}
+
+FORCEINLINE
+ULONG
+EmuTextModifierCount(
+	IN UCHAR Modifiers)
+{
+	return (Modifiers & EMU_LAYOUT_SHIFT ? 1 : 0) + (Modifiers & EMU_LAYOUT_CTRL ? 1 : 0) +
+		(Modifiers & EMU_LAYOUT_ALT ? 1 : 0);
+}
+
+FORCEINLINE
+VOID
+EmuTextSetModifiers(
+	IN OUT PUCHAR Held,
+	IN UCHAR Wanted,
+	OUT PKEYBOARD_INPUT_DATA Inputs,
+	IN OUT PULONG Count)
+/*++
+
+Routine Description:
+
+	Releases the held modifiers a key doesn't want, then presses the ones
+	it wants and aren't held.
+
+--*/
+{
+	//left shift, left control and left alt, in the order of the EMU_LAYOUT_* bits
+	static const UCHAR scanCodes[3] = { 0x2A, 0x1D, 0x38 };
+	ULONG i;
+
+	for (i = 0; i < 3; i++)
+	{
+		if ((*Held & ~Wanted) & (1 << i))
+			EmuTextInput(&Inputs[(*Count)++], scanCodes[i], KEY_BREAK);
+	}
+	for (i = 0; i < 3; i++)
+	{
+		if ((Wanted & ~*Held) & (1 << i))
+			EmuTextInput(&Inputs[(*Count)++], scanCodes[i], KEY_MAKE);
+	}
+	*Held = Wanted;
+}
+
+FORCEINLINE
+BOOLEAN
+EmuTextTypeKey(
+	IN const EMU_LAYOUT_KEY* Key,
+	IN OUT PUCHAR Held,
+	OUT PKEYBOARD_INPUT_DATA Inputs,
+	IN ULONG Capacity,
+	IN OUT PULONG Count)
+/*++
+
+Routine Description:
+
+	Appends the packets typing a key, if they fit along with the releases
+	of its modifiers that end the buffer.
+
+--*/
+{
+	UCHAR wanted = Key->Flags & EMU_LAYOUT_MODIFIERS;
+	USHORT e0 = (Key->Flags & EMU_LAYOUT_E0) ? KEY_E0 : 0;
+
+	if (Capacity - *Count < 2 + EmuTextModifierCount(*Held ^ wanted) + EmuTextModifierCount(wanted))
+		return FALSE;
+	EmuTextSetModifiers(Held, wanted, Inputs, Count);
+	EmuTextInput(&Inputs[(*Count)++], Key->ScanCode, KEY_MAKE | e0);
+	EmuTextInput(&Inputs[(*Count)++], Key->ScanCode, KEY_BREAK | e0);
+	return TRUE;
+}
+
+FORCEINLINE
+const EMU_LAYOUT_KEY*
+EmuLayoutFind(
+	IN const EMU_LAYOUT* Layout,
+	IN ULONG Character)
+{
+	if (Character >= Layout->Count || Layout->Keys[Character].ScanCode == 0)
+		return NULL;
+	return &Layout->Keys[Character];
+}
+
+FORCEINLINE
+ULONG
+EmuCompileTextUtf16(
+	IN const EMU_LAYOUT* Layout,
+	IN const USHORT* Text,
+	IN ULONG Length,
+	OUT PKEYBOARD_INPUT_DATA Inputs,
+	IN ULONG Capacity,
+	OUT PULONG InputCount,
+	OUT OPTIONAL PULONG Skipped)
+/*++
+
+Routine Description:
+
+	Compiles UTF-16 text into packets. A carriage return followed by a
+	line feed types one key.
+
+Return Value:
+
+	The code units consumed, Length unless the packets of the next
+	character didn't fit.
+
+--*/
+{
+	ULONG used = 0;
+	ULONG skipped = 0;
+	UCHAR held = 0;
+
+	*InputCount = 0;
+	while (used < Length)
+	{
+		ULONG character = Text[used];
+		ULONG units = 1;
+		const EMU_LAYOUT_KEY* key;
+
+		if (character >= 0xD800 && character <= 0xDFFF) {
+			if (character <= 0xDBFF && used + 1 < Length && Text[used + 1] >= 0xDC00 && Text[used + 1] <= 0xDFFF)
+				units = 2;
+			character = EMU_TEXT_INVALID;
+		}
+		else if (character == '\r' && used + 1 < Length && Text[used + 1] == '\n') {
+			units = 2;
+		}
+
+		key = EmuLayoutFind(Layout, character);
+		if (key == NULL)
+			skipped++;
+		else if (!EmuTextTypeKey(key, &held, Inputs, Capacity, InputCount))
+			break;
+		used += units;
+	}
+	EmuTextSetModifiers(&held, 0, Inputs, InputCount);
+	if (Skipped)
+		*Skipped = skipped;
+	return used;
+}
+
+FORCEINLINE
+ULONG
+EmuTextDecodeUtf8(
+	IN const UCHAR* Text,
+	IN ULONG Length,
+	OUT PULONG Units)
+/*++
+
+Routine Description:
+
+	Decodes the character at the start of UTF-8 text.
+
+Return Value:
+
+	The character, Units receives the bytes it takes,
+	EMU_TEXT_INVALID for a byte that doesn't start a well formed character,
+	Units is then 1.
+
+--*/
+{
+	ULONG character;
+	ULONG count;
+	ULONG i;
+
+	*Units = 1;
+	if (Text[0] < 0x80)
+		return Text[0];
+	if (Text[0] >= 0xC2 && Text[0] <= 0xDF) {
+		character = Text[0] & 0x1F;
+		count = 2;
+	}
+	else if (Text[0] >= 0xE0 && Text[0] <= 0xEF) {
+		character = Text[0] & 0x0F;
+		count = 3;
+	}
+	else if (Text[0] >= 0xF0 && Text[0] <= 0xF4) {
+		character = Text[0] & 0x07;
+		count = 4;
+	}
+	else {
+		return EMU_TEXT_INVALID;
+	}
+	if (count > Length)
+		return EMU_TEXT_INVALID;
+	for (i = 1; i < count; i++)
+	{
+		if ((Text[i] & 0xC0) != 0x80)
+			return EMU_TEXT_INVALID;
+		character = (character << 6) | (Text[i] & 0x3F);
+	}
+	//overlong forms, surrogates and characters past U+10FFFF
+	if ((count == 3 && character < 0x800) || (count == 4 && (character < 0x10000 || character > 0x10FFFF)) ||
+		(character >= 0xD800 && character <= 0xDFFF))
+		return EMU_TEXT_INVALID;
+	*Units = count;
+	return character;
+}
+
+FORCEINLINE
+ULONG
+EmuCompileTextUtf8(
+	IN const EMU_LAYOUT* Layout,
+	IN const UCHAR* Text,
+	IN ULONG Length,
+	OUT PKEYBOARD_INPUT_DATA Inputs,
+	IN ULONG Capacity,
+	OUT PULONG InputCount,
+	OUT OPTIONAL PULONG Skipped)
+/*++
+
+Routine Description:
+
+	Compiles UTF-8 text into packets like EmuCompileTextUtf16. Bytes that
+	don't decode are skipped one at a time.
+
+Return Value:
+
+	The bytes consumed, Length unless the packets of the next character
+	didn't fit.
+
+--*/
+{
+	ULONG used = 0;
+	ULONG skipped = 0;
+	UCHAR held = 0;
+
+	*InputCount = 0;
+	while (used < Length)
+	{
+		ULONG units;
+		ULONG character = EmuTextDecodeUtf8(Text + used, Length - used, &units);
+		const EMU_LAYOUT_KEY* key;
+
+		if (character == '\r' && used + 1 < Length && Text[used + 1] == '\n')
+			units = 2;
+
+		key = EmuLayoutFind(Layout, character);
+		if (key == NULL)
+			skipped++;
+		else if (!EmuTextTypeKey(key, &held, Inputs, Capacity, InputCount))
+			break;
+		used += units;
+	}
+	EmuTextSetModifiers(&held, 0, Inputs, InputCount);
+	if (Skipped)
+		*Skipped = skipped;
+	return used;
+}
+
+#endif // TEXTLAYOUT_H
@@ -0,0 +1,348 @@
+/*++
+
+Module Name:
+
+	TraceRing.h
+
+Abstract:
+
+	Binary trace of the hot paths of the drivers. Every processor writes
+	compact records into a ring of its own, a single drain copies them out
+	into a dump that user mode decodes offline.
+
+	A ring has one writer, the processor it belongs to running at
+	DISPATCH_LEVEL, and one reader, the drain. The writer fills the slot
+	at Head and publishes Head + 1, the drain copies the slots up to Head
+	and publishes how far it got in Tail. A full ring drops the new record
+	and counts it in Lost, so neither side ever waits for the other.
+
+	A dump starts with an EMU_TRACE_DUMP and holds one EMU_TRACE_CHUNK per
+	drained processor, each followed by its records in the order they were
+	written. Records of different processors are ordered by their Time.
+
+Environment:
+
+	kernel mode, user mode
+
+--*/
+
+#ifndef TRACERING_H
+#define TRACERING_H
+
+#include "EmuTypes.h"
+
+#define EMU_TRACE_MAGIC 0x52544D45 // 'EMTR'
+#define EMU_TRACE_VERSION 1
+
+//
+//Records per processor, a power of two
+//
+#define EMU_TRACE_CAPACITY 1024
+
+#define EMU_TRACE_CACHE_LINE 64
+
+typedef enum _EMU_TRACE_EVENT {
+	EMU_TRACE_NONE,
+	//A batch reached the service callback. Arg0 packets, Arg1 the first packet
+	EMU_TRACE_INPUT,
+	//Packets were filtered. Arg0 packets, Arg1 the first of them
+	EMU_TRACE_FILTER,
+	//A modify entry changed a packet. Arg0 the old value, Arg1 the new one
+	EMU_TRACE_MODIFY,
+	//The service callback is done with a batch. Arg0 packets it dropped, Arg1 ticks it took
+	EMU_TRACE_DONE,
+	//Packets were injected. Arg0 packets, Arg1 the EMU_STAT they count as
+	EMU_TRACE_INJECT,
+	EMU_TRACE_EVENT_COUNT
+} EMU_TRACE_EVENT;
+
+//
+//Writes a record into the ring of the current processor, how the portable
+//parts of the service callbacks reach the trace of the driver or the host.
+//Context is whatever the owner of the rings handed out with the writer
+//
+typedef VOID (*EMU_TRACE_WRITER)(PVOID Context, USHORT Event, USHORT Arg0, ULONG Arg1);
+
+//
+//Packets are traced as one ULONG: the scan code or button flags in the low
+//word and the packet flags in the high word
+//
+typedef struct _EMU_TRACE_RECORD {
+	//
+	//Performance counter when the record was written
+	//
+	LONG64 Time;
+	USHORT Event;
+	USHORT Arg0;
+	ULONG Arg1;
+
+} EMU_TRACE_RECORD, * PEMU_TRACE_RECORD;
+
+typedef struct _EMU_TRACE_RING {
+	//
+	//Written by the processor the ring belongs to
+	//
+	volatile LONG64 Head;
+	LONG64 CachedTail;
+	ULONG64 Lost;
+	UCHAR WriterPadding[EMU_TRACE_CACHE_LINE - 3 * sizeof(LONG64)];
+	//
+	//Written by the drain
+	//
+	volatile LONG64 Tail;
+	ULONG64 LostDrained;
+	UCHAR ReaderPadding[EMU_TRACE_CACHE_LINE - 2 * sizeof(LONG64)];
+	EMU_TRACE_RECORD Records[EMU_TRACE_CAPACITY];
+
+} EMU_TRACE_RING, * PEMU_TRACE_RING;
+
+typedef struct _EMU_TRACE_DUMP {
+	//
+	//EMU_TRACE_MAGIC
+	//
+	ULONG Magic;
+	//
+	//EMU_TRACE_VERSION
+	//
+	ULONG Version;
+	//
+	//Performance counter ticks per second, the unit of Time
+	//
+	LONG64 Frequency;
+
+} EMU_TRACE_DUMP, * PEMU_TRACE_DUMP;
+
+typedef struct _EMU_TRACE_CHUNK {
+	ULONG Processor;
+	//
+	//Records following the chunk
+	//
+	ULONG Count;
+	//
+	//Records the processor dropped on a full ring since the previous drain
+	//
+	ULONG64 Lost;
+
+} EMU_TRACE_CHUNK, * PEMU_TRACE_CHUNK;
+
+typedef struct _EMU_TRACE_CURSOR {
+	const UCHAR* Next;
+	const UCHAR* End;
+	EMU_TRACE_CHUNK Chunk;
+	//
+	//Records of the current chunk not yet returned
+	//
+	ULONG Left;
+
+} EMU_TRACE_CURSOR, * PEMU_TRACE_CURSOR;
+
+#ifdef _WIN32
+#define EmuTraceLoad(Target) ReadAcquire64(Target)
+#define EmuTraceStore(Target, Value) WriteRelease64((Target), (Value))
+#else
+#define EmuTraceLoad(Target) __atomic_load_n((Target), __ATOMIC_ACQUIRE)
+#define EmuTraceStore(Target, Value) __atomic_store_n((Target), (Value), __ATOMIC_RELEASE)
+#endif
+
+FORCEINLINE
+VOID
+EmuTraceWrite(
+	IN OUT PEMU_TRACE_RING Ring,
+	IN LONG64 Time,
+	IN USHORT Event,
+	IN USHORT Arg0,
+	IN ULONG Arg1)
+/*++
+
+Routine Description:
+
+	Appends a record, or counts it as lost if the ring is full. Only the
+	processor the ring belongs to may call it, without being preempted by
+	another writer of the ring.
+
+--*/
+{
+	LONG64 head = Ring->Head;
+	PEMU_TRACE_RECORD record;
+
+	//the tail is only read again when the ring looks full
+	if (head - Ring->CachedTail >= EMU_TRACE_CAPACITY) {
+		Ring->CachedTail = EmuTraceLoad(&Ring->Tail);
+		if (head - Ring->CachedTail >= EMU_TRACE_CAPACITY) {
+			Ring->Lost++;
+			return;
+		}
+	}
+	record = &Ring->Records[head & (EMU_TRACE_CAPACITY - 1)];
+	record->Time = Time;
+	record->Event = Event;
+	record->Arg0 = Arg0;
+	record->Arg1 = Arg1;
+	EmuTraceStore(&Ring->Head, head + 1);
+}
+
+FORCEINLINE
+ULONG
+EmuTraceBeginDump(
+	OUT PVOID Buffer,
+	IN LONG64 Frequency)
+/*++
+
+Routine Description:
+
+	Writes the header of a dump into a buffer of at least
+	sizeof(EMU_TRACE_DUMP) bytes and returns its size.
+
+--*/
+{
+	EMU_TRACE_DUMP dump;
+
+	dump.Magic = EMU_TRACE_MAGIC;
+	dump.Version = EMU_TRACE_VERSION;
+	dump.Frequency = Frequency;
+	RtlCopyMemory(Buffer, &dump, sizeof(dump));
+	return (ULONG)sizeof(dump);
+}
+
+FORCEINLINE
+ULONG
+EmuTraceDrain(
+	IN OUT PEMU_TRACE_RING Ring,
+	IN ULONG Processor,
+	OUT PVOID Buffer,
+	IN ULONG Size)
+/*++
+
+Routine Description:
+
+	Moves as many records of a ring as fit into a buffer, behind a chunk
+	header. Drains of the same ring must not overlap.
+
+Return Value:
+
+	Bytes written,
+	0 if the ring had nothing to report or there is no room for a chunk.
+
+--*/
+{
+	EMU_TRACE_CHUNK chunk;
+	LONG64 head;
+	LONG64 tail = Ring->Tail;
+	ULONG64 lost;
+	ULONG room;
+	ULONG first;
+
+	if (Size < sizeof(EMU_TRACE_CHUNK))
+		return 0;
+	room = (Size - (ULONG)sizeof(EMU_TRACE_CHUNK)) / (ULONG)sizeof(EMU_TRACE_RECORD);
+	head = EmuTraceLoad(&Ring->Head);
+	lost = *(volatile ULONG64*)&Ring->Lost;
+
+	chunk.Processor = Processor;
+	chunk.Count = (ULONG)(head - tail) < room ? (ULONG)(head - tail) : room;
+	chunk.Lost = lost - Ring->LostDrained;
+	if (chunk.Count == 0 && chunk.Lost == 0)
+		return 0;
+
+	RtlCopyMemory(Buffer, &chunk, sizeof(chunk));
+	//the records may wrap around the end of the ring
+	first = (ULONG)(tail & (EMU_TRACE_CAPACITY - 1));
+	if (first + chunk.Count <= EMU_TRACE_CAPACITY) {
+		RtlCopyMemory((PUCHAR)Buffer + sizeof(chunk), &Ring->Records[first], chunk.Count * sizeof(EMU_TRACE_RECORD));
+	}
+	else {
+		RtlCopyMemory((PUCHAR)Buffer + sizeof(chunk), &Ring->Records[first], (EMU_TRACE_CAPACITY - first) * sizeof(EMU_TRACE_RECORD));
+		RtlCopyMemory((PUCHAR)Buffer + sizeof(chunk) + (EMU_TRACE_CAPACITY - first) * sizeof(EMU_TRACE_RECORD),
+			Ring->Records, (first + chunk.Count - EMU_TRACE_CAPACITY) * sizeof(EMU_TRACE_RECORD));
+	}
+	Ring->LostDrained = lost;
+	//the slots are handed back to the writer only after they were copied
+	EmuTraceStore(&Ring->Tail, tail + chunk.Count);
+	return (ULONG)sizeof(chunk) + chunk.Count * (ULONG)sizeof(EMU_TRACE_RECORD);
+}
+
+FORCEINLINE
+BOOLEAN
+EmuTraceOpen(
+	OUT PEMU_TRACE_CURSOR Cursor,
+	IN const VOID* Dump,
+	IN ULONG Size,
+	OUT PLONG64 Frequency)
+/*++
+
+Routine Description:
+
+	Starts decoding a dump.
+
+Return Value:
+
+	TRUE if the dump has a header this version understands,
+	FALSE otherwise.
+
+--*/
+{
+	EMU_TRACE_DUMP dump;
+
+	RtlZeroMemory(Cursor, sizeof(EMU_TRACE_CURSOR));
+	if (Size < sizeof(dump))
+		return FALSE;
+	RtlCopyMemory(&dump, Dump, sizeof(dump));
+	if (dump.Magic != EMU_TRACE_MAGIC || dump.Version != EMU_TRACE_VERSION)
+		return FALSE;
+	*Frequency = dump.Frequency;
+	Cursor->Next = (const UCHAR*)Dump + sizeof(dump);
+	Cursor->End = (const UCHAR*)Dump + Size;
+	return TRUE;
+}
+
+FORCEINLINE
+BOOLEAN
+EmuTraceNext(
+	IN OUT PEMU_TRACE_CURSOR Cursor,
+	OUT PEMU_TRACE_RECORD Record)
+/*++
+
+Routine Description:
+
+	Returns the next record of a dump. Cursor->Chunk describes the chunk
+	it came from, including the records its processor lost. A chunk that
+	claims more records than the dump holds ends the decoding.
+
+Return Value:
+
+	TRUE if a record was returned,
+	FALSE at the end of the dump.
+
+--*/
+{
+	while (Cursor->Left == 0)
+	{
+		if ((size_t)(Cursor->End - Cursor->Next) < sizeof(EMU_TRACE_CHUNK))
+			return FALSE;
+		RtlCopyMemory(&Cursor->Chunk, Cursor->Next, sizeof(EMU_TRACE_CHUNK));
+		Cursor->Next += sizeof(EMU_TRACE_CHUNK);
+		if ((size_t)(Cursor->End - Cursor->Next) / sizeof(EMU_TRACE_RECORD) < Cursor->Chunk.Count) {
+			Cursor->Next = Cursor->End;
+			return FALSE;
+		}
+		Cursor->Left = Cursor->Chunk.Count;
+	}
+	RtlCopyMemory(Record, Cursor->Next, sizeof(EMU_TRACE_RECORD));
+	Cursor->Next += sizeof(EMU_TRACE_RECORD);
+	Cursor->Left--;
+	return TRUE;
+}
+
+FORCEINLINE
+const char*
+EmuTraceEventName(
+	IN USHORT Event)
+{
+	static const char* const names[EMU_TRACE_EVENT_COUNT] = {
+		"none", "input", "filter", "modify", "done", "inject"
+	};
+
+	return Event < EMU_TRACE_EVENT_COUNT ? names[Event] : "unknown";
+}
+
+#endif // TRACERING_H
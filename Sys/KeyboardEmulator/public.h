@@ -2,6 +2,10 @@
 #define _PUBLIC_H
 
 #include "devioctl.h"
+#include "../Common/RuleTypes.h"
+#include "../Common/CaptureRing.h"
+#include "../Common/EmuHistogram.h"
+#include "../Common/TraceRing.h"
 
 #define IOCTL_INDEX0             0x800
 #define IOCTL_INDEX1             0x801
@@ -12,6 +16,29 @@
 #define IOCTL_INDEX6             0x806
 #define IOCTL_INDEX7             0x807
 #define IOCTL_INDEX8             0x808
+#define IOCTL_INDEX9             0x809
+#define IOCTL_INDEX10            0x80A
+#define IOCTL_INDEX11            0x80B
+#define IOCTL_INDEX12            0x80C
+#define IOCTL_INDEX13            0x80D
+#define IOCTL_INDEX14            0x80E
+#define IOCTL_INDEX15            0x80F
+#define IOCTL_INDEX16            0x810
+#define IOCTL_INDEX17            0x811
+#define IOCTL_INDEX18            0x812
+#define IOCTL_INDEX19            0x813
+#define IOCTL_INDEX20            0x814
+#define IOCTL_INDEX21            0x815
+#define IOCTL_INDEX22            0x816
+#define IOCTL_INDEX23            0x817
+#define IOCTL_INDEX24            0x818
+#define IOCTL_INDEX25            0x819
+#define IOCTL_INDEX26            0x81a
+#define IOCTL_INDEX27            0x81b
+#define IOCTL_INDEX28            0x81c
+#define IOCTL_INDEX29            0x81d
+#define IOCTL_INDEX30            0x81e
+#define IOCTL_INDEX31            0x81f
 
 #define IOCTL_KEYBOARD_GET_ATTRIBUTES \
     CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX0, METHOD_BUFFERED, FILE_READ_DATA)
@@ -40,11 +67,143 @@
 #define IOCTL_KEYBOARD_GET_MODIFY \
 	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX8, METHOD_OUT_DIRECT, FILE_READ_DATA)
 
+#define IOCTL_KEYBOARD_SET_AUTOFIRE \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX9, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_KEYBOARD_GET_AUTOFIRE \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX10, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_KEYBOARD_SET_RULES \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX11, METHOD_IN_DIRECT, FILE_WRITE_DATA)
+
+#define IOCTL_KEYBOARD_GET_RULES \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX12, METHOD_OUT_DIRECT, FILE_READ_DATA)
+
+#define IOCTL_KEYBOARD_SET_PROFILE \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX13, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_KEYBOARD_GET_PROFILE \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX14, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_KEYBOARD_SWITCH_PROFILE \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX15, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_KEYBOARD_SAVE_IMAGE \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX16, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_KEYBOARD_SET_CAPTURE \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX17, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_KEYBOARD_GET_CAPTURE \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX18, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_KEYBOARD_CAPTURE \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX19, METHOD_OUT_DIRECT, FILE_READ_DATA)
+
+#define IOCTL_KEYBOARD_MAP_CAPTURE_RING \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX20, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_KEYBOARD_UNMAP_CAPTURE_RING \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX21, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_KEYBOARD_GET_DEVICES \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX22, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_KEYBOARD_SET_DEVICE_HANDLE \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX23, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_KEYBOARD_BROADCAST_RULES \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX24, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_KEYBOARD_GET_STATS \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX25, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_KEYBOARD_SET_STATS \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX26, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_KEYBOARD_GET_LATENCY \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX27, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_KEYBOARD_SET_TRACE \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX28, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_KEYBOARD_READ_TRACE \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX29, METHOD_OUT_DIRECT, FILE_READ_DATA)
+
+#define IOCTL_KEYBOARD_GET_GENERATION \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX30, METHOD_BUFFERED, FILE_READ_DATA)
+
+//
+//Replaces the filters and the modifies of the edit profile at once. The input
+//is the filter mode and filter count as sent with IOCTL_KEYBOARD_SET_FILTER,
+//the filters in FILTER_KEY_FLAG_AND_SCANCODE mode, then the modify count and
+//the modifies as sent with IOCTL_KEYBOARD_SET_MODIFY
+//
+#define IOCTL_KEYBOARD_SET_TABLES \
+	CTL_CODE( FILE_DEVICE_KEYBOARD, IOCTL_INDEX31, METHOD_IN_DIRECT, FILE_WRITE_DATA)
+
+//
+//Makes a device IOCTL (filters, modifies, tables, rules, generation, stats, latency, autofire, profiles,
+//insertion, attributes) take its target keyboard from a KEY_DEVICE_HEADER in front of its input
+//instead of the keyboard selected on the handle with IOCTL_KEYBOARD_SET_DEVICE_HANDLE
+//
+#define IOCTL_KEYBOARD_TARGETED(Ioctl) ((Ioctl) | (0x400 << 2))
+
+//
+//Number of filter/modify/rule profiles preloaded per keyboard
+//
+#define KEY_PROFILE_COUNT 4
+
 typedef struct _KEYBOARD_QUERY_RESULT {
 	USHORT ActiveDeviceId; 
 	USHORT NumberOfDevices;
 } KEYBOARD_QUERY_RESULT, * PKEYBOARD_QUERY_RESULT;
 
+typedef struct _KEY_DEVICE_HEADER {
+	//
+	//Handle of the target keyboard as reported by IOCTL_KEYBOARD_GET_DEVICES
+	//
+	ULONG DeviceHandle;
+	//
+	//0, or the generation IOCTL_KEYBOARD_GET_GENERATION must report for a set of
+	//filters, modifies, tables or rules to be applied. The set fails with
+	//STATUS_REVISION_MISMATCH when the tables changed since. Must be 0 for
+	//every other IOCTL. A set given room for a ULONG of output returns the
+	//generation it committed the tables under
+	//
+	ULONG Generation;
+} KEY_DEVICE_HEADER, * PKEY_DEVICE_HEADER;
+
+typedef struct _KEY_DEVICE_INFO {
+	//
+	//Stable handle of the keyboard, the same after it is plugged back or the machine restarts
+	//
+	ULONG DeviceHandle;
+	//
+	//Current index of the keyboard, as taken by IOCTL_KEYBOARD_SET_DEVICE_ID. Indices
+	//shift when a device leaves, the handle is what identifies the keyboard
+	//
+	USHORT DeviceId;
+	USHORT Reserved;
+} KEY_DEVICE_INFO, * PKEY_DEVICE_INFO;
+
+//
+//DeviceCount of a KEY_RULE_BROADCAST that targets every keyboard
+//
+#define KEY_ALL_DEVICES 0xFFFFFFFF
+
+typedef struct _KEY_RULE_BROADCAST {
+	//
+	//Number of handles in DeviceHandles, KEY_ALL_DEVICES for every keyboard present
+	//
+	ULONG DeviceCount;
+	//
+	//Handles of the target keyboards, none with KEY_ALL_DEVICES. The handles are
+	//followed by the rule count and the rules as sent with IOCTL_KEYBOARD_SET_RULES.
+	//
+	ULONG DeviceHandles[1];
+} KEY_RULE_BROADCAST, * PKEY_RULE_BROADCAST;
+
 typedef struct _KEY_FILTER_DATA {
 	//The predicate flag that will be used to filter inputs
 	USHORT FlagPredicates;
@@ -99,4 +258,177 @@ typedef struct _KEY_FILTER_REQUEST {
 	PKEY_FILTER_DATA FilterData;
 
 } KEY_FILTER_REQUEST, * PKEY_FILTER_REQUEST;
+
+//Shortest autofire cycle the driver accepts, in microseconds
+#define KEY_AUTOFIRE_MIN_PERIOD 1000
+
+typedef struct _KEY_AUTOFIRE_DATA {
+	//Scan code of the key that fires while held down, 0 disables autofire
+	USHORT TriggerScanCode;
+	//KEY_E0/KEY_E1 bits the trigger key must carry
+	USHORT TriggerFlags;
+	//Scan code of the synthesized key, usually the same as the trigger
+	USHORT OutputScanCode;
+	//KEY_E0/KEY_E1 bits of the synthesized key
+	USHORT OutputFlags;
+	//Length of one press/release cycle in microseconds
+	ULONG PeriodMicroseconds;
+	//How long the synthesized key stays down in each cycle, in microseconds
+	ULONG PressMicroseconds;
+} KEY_AUTOFIRE_DATA, * PKEY_AUTOFIRE_DATA;
+
+typedef struct _KEY_PROFILE_HOTKEY {
+	//Scan code of the key that activates the profile, 0 if the profile has no hotkey
+	USHORT ScanCode;
+	//KEY_E0 or KEY_E1 if the key has the prefix, 0 otherwise
+	USHORT Flags;
+} KEY_PROFILE_HOTKEY, * PKEY_PROFILE_HOTKEY;
+
+typedef struct _KEY_PROFILE_DATA {
+	//Index of the profile applied to the inputs
+	USHORT ActiveProfile;
+	//Index of the profile the filter, modify and rule requests are stored to and read from
+	USHORT EditProfile;
+	//Hotkey of each profile, pressing it activates the profile with the same index.
+	//Hotkeys are consumed and never reach the system.
+	KEY_PROFILE_HOTKEY Hotkeys[KEY_PROFILE_COUNT];
+} KEY_PROFILE_DATA, * PKEY_PROFILE_DATA;
+
+typedef enum _KEY_CAPTURE_SOURCE
+{
+	//Nothing is captured
+	KEY_CAPTURE_NONE = 0x0000,
+	//Keys dropped by the filter
+	KEY_CAPTURE_FILTERED = 0x0001,
+	//Keys passed on to the system, after modifications and rules
+	KEY_CAPTURE_PASSED = 0x0002,
+} KEY_CAPTURE_SOURCE, * PKEY_CAPTURE_SOURCE;
+
+typedef enum _KEY_CAPTURE_DELIVERY
+{
+	//Captured keys complete the pending IOCTL_KEYBOARD_CAPTURE requests
+	KEY_CAPTURE_DELIVERY_REQUESTS = 0x0000,
+	//Captured keys are written to the ring mapped by IOCTL_KEYBOARD_MAP_CAPTURE_RING
+	KEY_CAPTURE_DELIVERY_RING = 0x0001,
+} KEY_CAPTURE_DELIVERY, * PKEY_CAPTURE_DELIVERY;
+
+//
+//Number of records the capture ring holds
+//
+#define KEY_CAPTURE_RING_CAPACITY 4096
+
+//
+//Most records a capture request is filled with, a larger buffer is completed with this many
+//
+#define KEY_CAPTURE_BATCH_MAX 1024
+
+typedef struct _KEY_CAPTURE_CONFIG {
+	//KEY_CAPTURE_SOURCE bits of the keys copied to the capture requests or the capture ring
+	USHORT Sources;
+	//KEY_CAPTURE_DELIVERY
+	USHORT Delivery;
+	//Longest time a captured key waits for its batch to fill, in microseconds.
+	//0 completes a request with the keys of each input report.
+	ULONG LatencyMicroseconds;
+} KEY_CAPTURE_CONFIG, * PKEY_CAPTURE_CONFIG;
+
+typedef struct _KEY_CAPTURE_RECORD {
+	//QueryPerformanceCounter time the key was received
+	LONG64 Timestamp;
+	//Handle of the keyboard that reported the key, as reported by IOCTL_KEYBOARD_GET_DEVICES
+	ULONG DeviceHandle;
+	//The KEY_CAPTURE_SOURCE bit the key was captured from
+	USHORT Source;
+	USHORT Reserved;
+	//The key as it was dropped or passed on
+	KEYBOARD_INPUT_DATA Input;
+} KEY_CAPTURE_RECORD, * PKEY_CAPTURE_RECORD;
+
+typedef struct _KEY_CAPTURE_RING_REQUEST {
+	//Handle of an auto-reset event the driver signals when records arrive while the reader waits
+	ULONG64 EventHandle;
+} KEY_CAPTURE_RING_REQUEST, * PKEY_CAPTURE_RING_REQUEST;
+
+typedef struct _KEY_CAPTURE_RING_MAPPING {
+	//Address of the EMU_RING_HEADER of the ring in the calling process, mapped read-only
+	ULONG64 Address;
+	//Bytes of the mapping
+	ULONG Size;
+	//Bit of the reader in the WaitMask of the ring
+	ULONG ReaderIndex;
+	//Address of the WaitMask of the ring in the calling process, the only word the readers write
+	ULONG64 WaitAddress;
+} KEY_CAPTURE_RING_MAPPING, * PKEY_CAPTURE_RING_MAPPING;
+
+typedef struct _KEY_DETECT_REQUEST {
+	//Milliseconds to wait for input before the request fails with STATUS_IO_TIMEOUT, 0 waits until it is canceled
+	ULONG Timeout;
+} KEY_DETECT_REQUEST, * PKEY_DETECT_REQUEST;
+
+typedef struct _KEY_DETECT_RESULT {
+	//Stable handle of the detected keyboard. A USHORT sized output receives its
+	//current index instead, as taken by IOCTL_KEYBOARD_SET_DEVICE_ID
+	ULONG DeviceHandle;
+} KEY_DETECT_RESULT, * PKEY_DETECT_RESULT;
+
+
+//
+//KEY_STATS_CONFIG flags
+//
+#define KEY_STATS_RULE_HITS 0x0001
+
+typedef struct _KEY_STATS_CONFIG {
+	//KEY_STATS_RULE_HITS counts how often each rule applies in the rule tables set from then on
+	ULONG Flags;
+} KEY_STATS_CONFIG, * PKEY_STATS_CONFIG;
+
+typedef struct _KEY_STATS {
+	//Keys the keyboard reported
+	ULONG64 Seen;
+	//Keys consumed by filters, rules, profile hotkeys or the autofire trigger
+	ULONG64 Dropped;
+	//Keys changed by modify entries or rules
+	ULONG64 Modified;
+	//Keys inserted with IOCTL_KEYBOARD_INSERT_KEY
+	ULONG64 Injected;
+	//Keys synthesized by autofire
+	ULONG64 Expanded;
+	//Rules of the active profile
+	USHORT RuleCount;
+	//TRUE if the rule table of the active profile counts hits, RuleHits then holds as many as fit
+	USHORT RuleHitsCounted;
+	ULONG Reserved;
+	//Times each rule applied, summed over all the devices the table is installed on
+	ULONG64 RuleHits[1];
+} KEY_STATS, * PKEY_STATS;
+
+
+//
+//KEY_LATENCY_REQUEST flags
+//
+#define KEY_LATENCY_RESET 0x0001
+
+typedef struct _KEY_LATENCY_REQUEST {
+	//KEY_LATENCY_RESET starts the next interval right after the returned histograms
+	ULONG Flags;
+} KEY_LATENCY_REQUEST, * PKEY_LATENCY_REQUEST;
+
+typedef struct _KEY_LATENCY {
+	//Performance counter ticks per second, the unit of the EMU_HIST_CALLBACK and EMU_HIST_INJECT histograms
+	LONG64 Frequency;
+	//Histograms indexed by EMU_HIST, counting since the last reset
+	EMU_HISTOGRAM Histograms[EMU_HIST_COUNT];
+} KEY_LATENCY, * PKEY_LATENCY;
+
+
+//
+//KEY_TRACE_CONFIG flags
+//
+#define KEY_TRACE_ENABLE 0x0001
+
+typedef struct _KEY_TRACE_CONFIG {
+	//KEY_TRACE_ENABLE records the hot paths of every keyboard into the per processor trace rings
+	ULONG Flags;
+} KEY_TRACE_CONFIG, * PKEY_TRACE_CONFIG;
+
 #endif
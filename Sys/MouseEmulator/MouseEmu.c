@@ -21,8 +21,45 @@ Module Name:
 WDFCOLLECTION   FilterDeviceCollection;
 WDFWAITLOCK     FilterDeviceCollectionLock;
 
+//
+// Stable handles of the filter devices. Lookups take DeviceTableLock only,
+// changes hold FilterDeviceCollectionLock as well.
+//
+EMU_DEVICE_TABLE DeviceTable;
+WDFSPINLOCK     DeviceTableLock;
+
+//
+// Processors the per-processor counters are laid out for, and whether the
+// rule tables allocated from now on count how often their rules apply.
+//
+ULONG           StatsProcessorCount;
+volatile LONG   CountRuleHits = FALSE;
+
+//
+// Performance counter ticks per second, the unit of the latency histograms
+//
+LONG64          PerformanceFrequency;
+
+//
+// Binary trace of the hot paths, one ring per processor. The rings are
+// allocated when tracing is first enabled and kept until unload.
+//
+volatile LONG   TraceEnabled = FALSE;
+PEMU_TRACE_RING TraceRings;
+
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (INIT, DriverEntry)
+#pragma alloc_text (INIT, LoadRuleImage)
+#pragma alloc_text (PAGE, ApplyRuleImage)
+#pragma alloc_text (PAGE, ReadRuleImage)
+#pragma alloc_text (PAGE, LoadDeviceRuleImage)
+#pragma alloc_text (PAGE, RetrieveDeviceHeader)
+#pragma alloc_text (PAGE, RetrieveDeviceInput)
+#pragma alloc_text (PAGE, QueryDeviceIdentity)
+#pragma alloc_text (PAGE, GetDeviceIndex)
+#pragma alloc_text (PAGE, ParkDeviceConfiguration)
+#pragma alloc_text (PAGE, BroadcastRules)
+#pragma alloc_text (PAGE, MouFilter_EvtDriverUnload)
 #pragma alloc_text (PAGE, MouFilter_EvtDeviceAdd)
 #pragma alloc_text (PAGE, MouFilter_EvtIoInternalDeviceControl)
 #endif
@@ -37,6 +74,23 @@ WDFWAITLOCK     FilterDeviceCollectionLock;
 
 WDFDEVICE       ControlDevice = NULL;
 
+//
+// Buttons held on any of the filtered mice. The keyboard filter reads it
+// through SharedLink to evaluate its conditional rules, and SharedLink
+// hands us the key state of the keyboards in return.
+//
+
+EMU_INPUT_STATE MouseInputState;
+EMU_SHARED_LINK SharedLink;
+
+//
+// Validated profile image read from the registry, applied before it is
+// connected to every device that has no image saved for its own handle.
+// Guarded by FilterDeviceCollectionLock.
+//
+
+PVOID PersistedImage = NULL;
+
 
 NTSTATUS
 DriverEntry(
@@ -80,6 +134,7 @@ Return Value:
 		&config,
 		MouFilter_EvtDeviceAdd
 	);
+	config.EvtDriverUnload = MouFilter_EvtDriverUnload;
 
 	//
 	// Create a framework driver object to represent our driver.
@@ -121,9 +176,408 @@ Return Value:
 		return status;
 	}
 
+	status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES,
+		&DeviceTableLock);
+	if (!NT_SUCCESS(status))
+	{
+		KdPrint(("WdfSpinLockCreate failed with status 0x%x\n", status));
+		return status;
+	}
+
+	//
+	// Counters are indexed by the processor number, which stays below
+	// the maximum count even when processors are added later.
+	//
+	StatsProcessorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	KeQueryPerformanceCounter((PLARGE_INTEGER)&PerformanceFrequency);
+
+	//
+	// The link to the keyboard filter is optional, without it rules
+	// conditioned on keys see every key as released.
+	//
+	status = LoadRuleImage(WdfGetDriver());
+	if (!NT_SUCCESS(status))
+	{
+		KdPrint(("LoadRuleImage failed with status 0x%x\n", status));
+	}
+
+	status = EmuLinkOpen(&SharedLink, EMU_LINK_ROLE_MOUSE, &MouseInputState);
+	if (!NT_SUCCESS(status))
+	{
+		KdPrint(("EmuLinkOpen failed with status 0x%x\n", status));
+		status = STATUS_SUCCESS;
+	}
+
+	return status;
+}
+
+VOID
+MouFilter_EvtDriverUnload(
+	IN WDFDRIVER Driver
+)
+/*++
+
+Routine Description:
+
+	Called before the driver image is unloaded. Withdraws the button state
+	from the keyboard filter and waits until it is no longer being read, then
+	frees the persisted profile image.
+
+Arguments:
+
+	Driver - Handle to the framework driver object.
+
+Return Value:
+
+	VOID
+
+--*/
+{
+	UNREFERENCED_PARAMETER(Driver);
+	PAGED_CODE();
+
+	DebugPrint(("Entered MouFilter_EvtDriverUnload\n"));
+
+	EmuLinkClose(&SharedLink);
+
+	//no filter device is left to write a trace record
+	if (TraceRings) {
+		ExFreePoolWithTag(TraceRings, MOUSE_POOL_TAG);
+		TraceRings = NULL;
+	}
+
+	if (PersistedImage) {
+		ExFreePoolWithTag(PersistedImage, MOUSE_POOL_TAG);
+		PersistedImage = NULL;
+	}
+
+	//configurations parked for devices that never came back
+	for (ULONG i = 0; i < EMU_DEVICE_TABLE_SIZE; i++)
+	{
+		if (DeviceTable.Entries[i].Parked) {
+			ExFreePoolWithTag(DeviceTable.Entries[i].Parked, MOUSE_POOL_TAG);
+			DeviceTable.Entries[i].Parked = NULL;
+		}
+	}
+}
+
+NTSTATUS
+LoadRuleImage(
+	IN WDFDRIVER Driver
+)
+/*++
+
+Routine Description:
+
+	Reads the profile image of the devices without an image of their own
+	from the Parameters key of the driver. A missing value is not an error,
+	an image that fails the checksum or the structure checks is ignored.
+
+Arguments:
+
+	Driver - Handle to the framework driver object.
+
+Return Value:
+
+	STATUS_SUCCESS if there is no image or it was loaded,
+	error status otherwise.
+
+--*/
+{
+	NTSTATUS	status;
+	WDFKEY		key;
+	PVOID		image;
+	DECLARE_CONST_UNICODE_STRING(valueName, EMU_IMAGE_VALUE_NAME);
+
+	PAGED_CODE();
+
+	status = WdfDriverOpenParametersRegistryKey(Driver, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &key);
+	if (!NT_SUCCESS(status))
+		return status;
+	status = ReadRuleImage(key, &valueName, &image);
+	WdfRegistryClose(key);
+	if (NT_SUCCESS(status))
+		PersistedImage = image;
+	return status;
+}
+
+NTSTATUS
+LoadDeviceRuleImage(
+	IN ULONG DeviceHandle,
+	OUT PVOID* Image
+)
+/*++
+
+Routine Description:
+
+	Reads the profile image saved by IOCTL_MOUSE_SAVE_IMAGE for the mouse
+	with the given handle.
+
+Arguments:
+
+	DeviceHandle - Handle of the mouse, never EMU_DEVICE_HANDLE_NONE.
+
+	Image - Receives the image allocated from paged pool, NULL if none was
+	saved for the handle.
+
+Return Value:
+
+	STATUS_SUCCESS if there is no image or it was loaded,
+	error status otherwise.
+
+--*/
+{
+	NTSTATUS		status;
+	WDFKEY			key;
+	UNICODE_STRING	valueName;
+	WCHAR			nameBuffer[EMU_IMAGE_DEVICE_VALUE_CHARS + 1];
+
+	PAGED_CODE();
+
+	*Image = NULL;
+	RtlInitEmptyUnicodeString(&valueName, nameBuffer, sizeof(nameBuffer));
+	status = RtlUnicodeStringPrintf(&valueName, EMU_IMAGE_DEVICE_VALUE_FORMAT, DeviceHandle);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	status = WdfDriverOpenParametersRegistryKey(WdfGetDriver(), KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &key);
+	if (!NT_SUCCESS(status))
+		return status;
+	status = ReadRuleImage(key, &valueName, Image);
+	WdfRegistryClose(key);
 	return status;
 }
 
+NTSTATUS
+ReadRuleImage(
+	IN WDFKEY Key,
+	IN PCUNICODE_STRING ValueName,
+	OUT PVOID* Image
+)
+/*++
+
+Routine Description:
+
+	Reads and validates one profile image value.
+
+Arguments:
+
+	Key - Opened Parameters key of the driver.
+
+	ValueName - Name of the REG_BINARY value.
+
+	Image - Receives the image allocated from paged pool, NULL if the
+	value does not exist.
+
+Return Value:
+
+	STATUS_SUCCESS if there is no image or it was read,
+	STATUS_INVALID_IMAGE_FORMAT for an image that fails the checks,
+	error status otherwise.
+
+--*/
+{
+	NTSTATUS	status;
+	ULONG		length = 0;
+	PVOID		image;
+
+	PAGED_CODE();
+
+	*Image = NULL;
+	status = WdfRegistryQueryValue(Key, ValueName, 0, NULL, &length, NULL);
+	if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+		return STATUS_SUCCESS;
+	if (status != STATUS_BUFFER_OVERFLOW || length < sizeof(EMU_IMAGE_HEADER) || length > EMU_IMAGE_MAX_SIZE)
+		return NT_SUCCESS(status) ? STATUS_INVALID_IMAGE_FORMAT : status;
+
+	image = ExAllocatePoolWithTag(PagedPool, length, MOUSE_POOL_TAG);
+	if (image == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	status = WdfRegistryQueryValue(Key, ValueName, length, image, &length, NULL);
+	if (!NT_SUCCESS(status)) {
+		ExFreePoolWithTag(image, MOUSE_POOL_TAG);
+		return status;
+	}
+	if (!EmuValidateRuleImage(image, length)) {
+		ExFreePoolWithTag(image, MOUSE_POOL_TAG);
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	DebugPrint(("Loaded profile image %wZ of %u bytes\n", ValueName, length));
+	*Image = image;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ApplyRuleImage(
+	IN PFILTER_DEVICE_EXTENSION FilterExtension,
+	IN const VOID* Image
+)
+/*++
+
+Routine Description:
+
+	Fills the profiles of a device that is not connected yet from a
+	validated image. Payloads get the same checks as the input of the
+	matching IOCTL, sections that fail them are skipped.
+
+Arguments:
+
+	FilterExtension - Filter device extension of the new device.
+
+	Image - Image that passed EmuValidateRuleImage.
+
+Return Value:
+
+	STATUS_SUCCESS if successful,
+	STATUS_INSUFFICIENT_RESOURCES if a table could not be allocated.
+
+--*/
+{
+	EMU_IMAGE_CURSOR	cursor;
+	EMU_IMAGE_SECTION	section;
+	const UCHAR*		payload;
+	PMOUSE_PROFILE		profile;
+	USHORT				count;
+	ULONG				bytes;
+	PVOID				table;
+
+	PAGED_CODE();
+
+	EmuOpenRuleImage(&cursor, Image);
+	while (EmuNextImageSection(&cursor, &section, &payload))
+	{
+		if (section.Type == EMU_SECTION_ACTIVE_PROFILE) {
+			if (section.Length >= sizeof(USHORT) && EmuReadUshort(payload) < MOUSE_PROFILE_COUNT)
+				FilterExtension->Pipeline.ActiveProfile = EmuReadUshort(payload);
+			continue;
+		}
+		if (section.Profile >= MOUSE_PROFILE_COUNT)
+			continue;
+		profile = &FilterExtension->Pipeline.Profiles[section.Profile];
+
+		switch (section.Type) {
+		case EMU_SECTION_FILTER:
+			if (section.Length < sizeof(USHORT))
+				break;
+			profile->FilterMode = EmuReadUshort(payload);
+			break;
+		case EMU_SECTION_MODIFY:
+			if (section.Length < sizeof(USHORT) || profile->ModifyRequest.ModifyData != NULL)
+				break;
+			count = EmuReadUshort(payload);
+			bytes = count * sizeof(MOUSE_MODIFY_DATA);
+			if (count == 0 || section.Length < bytes + sizeof(USHORT))
+				break;
+			table = ExAllocatePoolWithTag(NonPagedPool, bytes, MOUSE_POOL_TAG);
+			if (table == NULL)
+				return STATUS_INSUFFICIENT_RESOURCES;
+			RtlCopyMemory(table, payload + sizeof(USHORT), bytes);
+			profile->ModifyRequest.ModifyData = (PMOUSE_MODIFY_DATA)table;
+			profile->ModifyRequest.ModifyCount = count;
+			break;
+		case EMU_SECTION_RULES:
+			if (section.Length < sizeof(USHORT) || profile->RuleRequest.Rules != NULL)
+				break;
+			count = EmuReadUshort(payload);
+			bytes = count * sizeof(EMU_RULE);
+			if (count == 0 || section.Length < bytes + sizeof(USHORT))
+				break;
+			table = AllocateSharedRules(count);
+			if (table == NULL)
+				return STATUS_INSUFFICIENT_RESOURCES;
+			RtlCopyMemory(table, payload + sizeof(USHORT), bytes);
+			if (!EmuValidateRules((PEMU_RULE)table, count, EmuSharedRulesIndex((PEMU_RULE)table))) {
+				ReleaseSharedRules((PEMU_RULE)table);
+				break;
+			}
+			profile->RuleRequest.Rules = (PEMU_RULE)table;
+			profile->RuleRequest.RuleCount = count;
+			break;
+		case EMU_SECTION_HOTKEY:
+			if (section.Length < sizeof(USHORT))
+				break;
+			count = EmuReadUshort(payload);
+			//exactly one button down flag, as IOCTL_MOUSE_SET_PROFILE accepts
+			if ((count & MOUSE_BUTTON_DOWN_MASK) != count || (count & (count - 1)) != 0)
+				break;
+			FilterExtension->Pipeline.ProfileHotkeys[section.Profile] = count;
+			FilterExtension->Pipeline.ProfileHotkeyMask |= count;
+			break;
+		}
+	}
+	return STATUS_SUCCESS;
+}
+
+ULONG
+SerializeProfiles(
+	IN PFILTER_DEVICE_EXTENSION FilterExtension,
+	OUT OPTIONAL PUCHAR Image,
+	IN ULONG Capacity
+)
+/*++
+
+Routine Description:
+
+	Writes the profiles and profile hotkeys of a device as an image. Called
+	with a NULL Image first to measure it.
+	Must be called with the filter extension spin lock held.
+
+Arguments:
+
+	FilterExtension - Filter device extension of the device to save.
+
+	Image - Buffer receiving the image, may be NULL.
+
+	Capacity - Number of bytes in Image.
+
+Return Value:
+
+	Size of the image, 0 if it does not fit in Capacity.
+
+--*/
+{
+	ULONG		size = sizeof(EMU_IMAGE_HEADER);
+	USHORT		sectionCount = 0;
+	USHORT		activeProfile = (USHORT)FilterExtension->Pipeline.ActiveProfile;
+	BOOLEAN		fits;
+
+	fits = EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_ACTIVE_PROFILE, 0,
+		&activeProfile, sizeof(activeProfile), NULL, 0);
+	sectionCount++;
+	for (USHORT p = 0; p < MOUSE_PROFILE_COUNT; p++)
+	{
+		PMOUSE_PROFILE profile = &FilterExtension->Pipeline.Profiles[p];
+		if (profile->FilterMode != FILTER_MOUSE_NONE) {
+			fits = fits && EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_FILTER, p,
+				&profile->FilterMode, sizeof(profile->FilterMode), NULL, 0);
+			sectionCount++;
+		}
+		if (profile->ModifyRequest.ModifyCount > 0) {
+			fits = fits && EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_MODIFY, p,
+				&profile->ModifyRequest.ModifyCount, sizeof(USHORT),
+				profile->ModifyRequest.ModifyData, profile->ModifyRequest.ModifyCount * sizeof(MOUSE_MODIFY_DATA));
+			sectionCount++;
+		}
+		if (profile->RuleRequest.RuleCount > 0) {
+			fits = fits && EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_RULES, p,
+				&profile->RuleRequest.RuleCount, sizeof(USHORT),
+				profile->RuleRequest.Rules, profile->RuleRequest.RuleCount * sizeof(EMU_RULE));
+			sectionCount++;
+		}
+		if (FilterExtension->Pipeline.ProfileHotkeys[p] != 0) {
+			fits = fits && EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_HOTKEY, p,
+				&FilterExtension->Pipeline.ProfileHotkeys[p], sizeof(USHORT), NULL, 0);
+			sectionCount++;
+		}
+	}
+	if (!fits)
+		return 0;
+	if (Image != NULL)
+		EmuFinishRuleImage(Image, size, sectionCount);
+	return size;
+}
+
 NTSTATUS
 MouFilter_EvtDeviceAdd(
 	IN WDFDRIVER        Driver,
@@ -159,6 +613,13 @@ Return Value:
 	WDFDEVICE                   hDevice;
 	PFILTER_DEVICE_EXTENSION    filterExt;
 	WDF_IO_QUEUE_CONFIG			ioQueueConfig;
+	WDF_TIMER_CONFIG			timerConfig;
+	WDF_OBJECT_ATTRIBUTES		timerAttributes;
+	ULONG						deviceHandle;
+	ULONG						identity;
+	PEMU_DEVICE_ENTRY			entry;
+	PVOID						parked;
+	PVOID						savedImage;
 
 	UNREFERENCED_PARAMETER(Driver);
 
@@ -202,9 +663,52 @@ Return Value:
 
 
 	filterExt = FilterGetData(hDevice);
-	filterExt->FilterMode = 0;
-	filterExt->ModifyRequest.ModifyCount = 0;
-	filterExt->ModifyRequest.ModifyData = NULL;
+	RtlZeroMemory(filterExt->Pipeline.Profiles, sizeof(filterExt->Pipeline.Profiles));
+	RtlZeroMemory(filterExt->Pipeline.ProfileHotkeys, sizeof(filterExt->Pipeline.ProfileHotkeys));
+	filterExt->Pipeline.ActiveProfile = 0;
+	filterExt->EditProfile = 0;
+	filterExt->RuleGeneration = 1;
+	filterExt->Pipeline.ProfileHotkeyMask = 0;
+	RtlZeroMemory(&filterExt->AbsoluteMap, sizeof(filterExt->AbsoluteMap));
+	RtlZeroMemory(&filterExt->Pipeline.AbsoluteTransform, sizeof(filterExt->Pipeline.AbsoluteTransform));
+	RtlZeroMemory(&filterExt->Pipeline.Autofire, sizeof(filterExt->Pipeline.Autofire));
+	AutofireInitialize(&filterExt->Pipeline.AutofireSchedule, 0, 0);
+	ExInitializeRundownProtection(&filterExt->Rundown);
+
+	filterExt->Stats = (PEMU_STATS)ExAllocatePoolWithTag(NonPagedPool, EmuStatsSize(StatsProcessorCount, 0), MOUSE_POOL_TAG);
+	if (filterExt->Stats == NULL) {
+		DebugPrint(("Failed to allocate the device counters\n"));
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	EmuStatsInitialize(filterExt->Stats, StatsProcessorCount, 0);
+
+	//
+	// Past a page the pool hands out page aligned blocks, and a set of
+	// histograms spans whole cache lines, so no two processors share one.
+	//
+	filterExt->Histograms = (PEMU_HISTOGRAM)ExAllocatePoolWithTag(NonPagedPool,
+		(StatsProcessorCount + 1) * EMU_HIST_COUNT * sizeof(EMU_HISTOGRAM), MOUSE_POOL_TAG);
+	if (filterExt->Histograms == NULL) {
+		DebugPrint(("Failed to allocate the device histograms\n"));
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(filterExt->Histograms, (StatsProcessorCount + 1) * EMU_HIST_COUNT * sizeof(EMU_HISTOGRAM));
+
+	//
+	// Autofire cycles are emitted from a high resolution timer so that the
+	// synthesized clicks don't depend on a user mode thread being scheduled.
+	//
+	WDF_TIMER_CONFIG_INIT(&timerConfig, MouFilter_EvtAutofireTimer);
+	timerConfig.AutomaticSerialization = FALSE;
+	timerConfig.UseHighResolutionTimer = WdfTrue;
+	WDF_OBJECT_ATTRIBUTES_INIT(&timerAttributes);
+	timerAttributes.ParentObject = hDevice;
+
+	status = WdfTimerCreate(&timerConfig, &timerAttributes, &filterExt->AutofireTimer);
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("WdfTimerCreate failed 0x%x\n", status));
+		return status;
+	}
 
 
 	//
@@ -234,10 +738,62 @@ Return Value:
 		return status;
 	}
 
+	//
+	// The handle comes from the instance ID, so a mouse that is plugged
+	// back gets the handle it had before.
+	//
+	QueryDeviceIdentity(hDevice, &deviceHandle, &identity);
+
 	//
 	// Add this device to the FilterDevice collection.
 	//
 	WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
+	WdfSpinLockAcquire(DeviceTableLock);
+	entry = EmuDeviceTableClaim(&DeviceTable, deviceHandle, identity);
+	parked = NULL;
+	if (entry != NULL) {
+		filterExt->DeviceHandle = entry->Handle;
+		parked = entry->Parked;
+		entry->Parked = NULL;
+	}
+	else {
+		filterExt->DeviceHandle = EMU_DEVICE_HANDLE_NONE;
+	}
+	WdfSpinLockRelease(DeviceTableLock);
+	//
+	// The saved profiles are in place before the device is connected,
+	// so they apply from the very first packet. A mouse that was here
+	// before gets back the configuration it left with instead, one with
+	// profiles saved for its handle gets those and any other the image
+	// every device starts with.
+	//
+	savedImage = NULL;
+	if (parked == NULL && filterExt->DeviceHandle != EMU_DEVICE_HANDLE_NONE) {
+		status = LoadDeviceRuleImage(filterExt->DeviceHandle, &savedImage);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("LoadDeviceRuleImage failed with status code 0x%x\n", status));
+		}
+	}
+	if (parked == NULL)
+		parked = savedImage;
+	if (parked != NULL || PersistedImage != NULL) {
+		status = ApplyRuleImage(filterExt, parked != NULL ? parked : PersistedImage);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("ApplyRuleImage failed with status code 0x%x\n", status));
+		}
+	}
+	if (parked != NULL)
+		ExFreePoolWithTag(parked, MOUSE_POOL_TAG);
+	if (filterExt->DeviceHandle != EMU_DEVICE_HANDLE_NONE) {
+		//control requests find the device from now on
+		WdfSpinLockAcquire(DeviceTableLock);
+		entry = EmuDeviceTableFind(&DeviceTable, filterExt->DeviceHandle);
+		entry->Device = filterExt;
+		WdfSpinLockRelease(DeviceTableLock);
+	}
+	else {
+		DebugPrint(("Device table is full, the mouse gets no handle\n"));
+	}
 	//
 	// WdfCollectionAdd takes a reference on the item object and removes
 	// it when you call WdfCollectionRemove.
@@ -296,6 +852,7 @@ Return Value:
 {
 	ULONG						count;
 	PFILTER_DEVICE_EXTENSION	filterExt;
+	PEMU_DEVICE_ENTRY			entry;
 	PAGED_CODE();
 
 	DebugPrint(("Entered MouFilter_EvtDeviceContextCleanup\n"));
@@ -319,12 +876,42 @@ Return Value:
 	}
 
 	WdfCollectionRemove(FilterDeviceCollection, Device);
-	WdfWaitLockRelease(FilterDeviceCollectionLock);
+	//
+	// Control requests no longer find the device, the ones still
+	// holding it are waited out below.
+	//
 	filterExt = FilterGetData(Device);
+	WdfSpinLockAcquire(DeviceTableLock);
+	entry = EmuDeviceTableFind(&DeviceTable, filterExt->DeviceHandle);
+	if (entry != NULL)
+		entry->Device = NULL;
+	WdfSpinLockRelease(DeviceTableLock);
+	WdfWaitLockRelease(FilterDeviceCollectionLock);
 	if (filterExt) {
-		if (filterExt->ModifyRequest.ModifyData) {
-			ExFreePoolWithTag(filterExt->ModifyRequest.ModifyData, MOUSE_POOL_TAG);
-			filterExt->ModifyRequest.ModifyData = NULL;
+		ExWaitForRundownProtectionRelease(&filterExt->Rundown);
+		ParkDeviceConfiguration(filterExt);
+		if (filterExt->AutofireTimer) {
+			WdfTimerStop(filterExt->AutofireTimer, TRUE);
+		}
+		for (USHORT p = 0; p < MOUSE_PROFILE_COUNT; p++)
+		{
+			PMOUSE_PROFILE profile = &filterExt->Pipeline.Profiles[p];
+			if (profile->ModifyRequest.ModifyData) {
+				ExFreePoolWithTag(profile->ModifyRequest.ModifyData, MOUSE_POOL_TAG);
+				profile->ModifyRequest.ModifyData = NULL;
+			}
+			if (profile->RuleRequest.Rules) {
+				ReleaseSharedRules(profile->RuleRequest.Rules);
+				profile->RuleRequest.Rules = NULL;
+			}
+		}
+		if (filterExt->Stats) {
+			ExFreePoolWithTag(filterExt->Stats, MOUSE_POOL_TAG);
+			filterExt->Stats = NULL;
+		}
+		if (filterExt->Histograms) {
+			ExFreePoolWithTag(filterExt->Histograms, MOUSE_POOL_TAG);
+			filterExt->Histograms = NULL;
 		}
 	}
 }
@@ -365,6 +952,10 @@ Return Value:
 	WDFDEVICE                   controlDevice = NULL;
 	WDF_OBJECT_ATTRIBUTES       controlAttributes;
 	WDF_IO_QUEUE_CONFIG         ioQueueConfig;
+	WDF_TIMER_CONFIG			timerConfig;
+	WDF_OBJECT_ATTRIBUTES		timerAttributes;
+	WDF_FILEOBJECT_CONFIG		fileConfig;
+	WDF_OBJECT_ATTRIBUTES		fileAttributes;
 	BOOLEAN                     bCreate = FALSE;
 	NTSTATUS                    status;
 	WDFQUEUE                    queue;
@@ -423,10 +1014,19 @@ Return Value:
 		goto Error;
 	}
 
+	//
+	// Processes the capture ring is mapped into get it unmapped when
+	// they close their handle.
+	//
+	WDF_FILEOBJECT_CONFIG_INIT(&fileConfig, WDF_NO_EVENT_CALLBACK, WDF_NO_EVENT_CALLBACK, MouFilter_EvtFileCleanup);
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&fileAttributes, CONTROL_SESSION_CONTEXT);
+	WdfDeviceInitSetFileObjectConfig(pInit, &fileConfig, &fileAttributes);
+
 	//
 	// Specify the size of device context
 	//
 	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&controlAttributes, CONTROL_DEVICE_EXTENSION);
+	controlAttributes.EvtDestroyCallback = MouFilter_EvtControlDeviceDestroy;
 
 	status = WdfDeviceCreate(&pInit,
 		&controlAttributes,
@@ -436,15 +1036,42 @@ Return Value:
 	}
 
 	controlExt = ControlGetData(controlDevice);
-	controlExt->InputRequired = FALSE;
+	controlExt->DetectState = DETECT_IDLE;
+	controlExt->DetectedHandle = EMU_DEVICE_HANDLE_NONE;
+	controlExt->DetectWorkItem = NULL;
+	controlExt->DetectTimerDue = 0;
+	controlExt->CaptureSources = MOUSE_CAPTURE_NONE;
+	controlExt->CaptureLatency = 0;
+	controlExt->CaptureRequest = NULL;
+	controlExt->CaptureFile = NULL;
+	controlExt->CaptureRecords = NULL;
+	controlExt->CaptureCapacity = 0;
+	controlExt->CaptureCount = 0;
+	controlExt->CaptureDelivery = MOUSE_CAPTURE_DELIVERY_REQUESTS;
+	controlExt->CaptureRingMdl = NULL;
+	controlExt->CaptureWaitMdl = NULL;
+	RtlZeroMemory(&controlExt->CaptureRing, sizeof(controlExt->CaptureRing));
+	RtlZeroMemory(controlExt->RingReaders, sizeof(controlExt->RingReaders));
 	status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &controlExt->SpinLock);
 
 	if (!NT_SUCCESS(status)) {
 		DebugPrint(("WdfSpinLockCreate failed %x\n", status));
 		goto Error;
 	}
-	//
-	// Create a symbolic link for the control object so that usermode can open
+	status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &controlExt->CaptureLock);
+
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("WdfSpinLockCreate failed %x\n", status));
+		goto Error;
+	}
+	status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &controlExt->RingLock);
+
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("WdfWaitLockCreate failed %x\n", status));
+		goto Error;
+	}
+	//
+	// Create a symbolic link for the control object so that usermode can open
 	// the device.
 	//
 
@@ -490,6 +1117,74 @@ Return Value:
 	if (!NT_SUCCESS(status)) {
 		goto Error;
 	}
+	//
+	//Capture requests wait in their own manual queue until packets are captured
+	//
+	WDF_IO_QUEUE_CONFIG_INIT(&ioQueueConfig, WdfIoQueueDispatchManual);
+
+	status = WdfIoQueueCreate(controlDevice,
+		&ioQueueConfig,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&controlExt->CaptureQueue // pointer to manual queue
+	);
+	if (!NT_SUCCESS(status)) {
+		goto Error;
+	}
+	//
+	//The request of the open batch waits in a manual queue of its own, where
+	//it can be canceled while the batch fills
+	//
+	WDF_IO_QUEUE_CONFIG_INIT(&ioQueueConfig, WdfIoQueueDispatchManual);
+
+	status = WdfIoQueueCreate(controlDevice,
+		&ioQueueConfig,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&controlExt->CaptureBatchQueue // pointer to manual queue
+	);
+	if (!NT_SUCCESS(status)) {
+		goto Error;
+	}
+
+	controlExt->CaptureRecords = (PMOUSE_CAPTURE_RECORD)ExAllocatePoolWithTag(NonPagedPool,
+		MOUSE_CAPTURE_BATCH_MAX * sizeof(MOUSE_CAPTURE_RECORD), MOUSE_POOL_TAG);
+	if (controlExt->CaptureRecords == NULL) {
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		goto Error;
+	}
+
+	WDF_TIMER_CONFIG_INIT(&timerConfig, MouFilter_EvtCaptureTimer);
+	timerConfig.AutomaticSerialization = FALSE;
+	timerConfig.UseHighResolutionTimer = WdfTrue;
+	WDF_OBJECT_ATTRIBUTES_INIT(&timerAttributes);
+	timerAttributes.ParentObject = controlDevice;
+
+	status = WdfTimerCreate(&timerConfig, &timerAttributes, &controlExt->CaptureTimer);
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("WdfTimerCreate failed 0x%x\n", status));
+		goto Error;
+	}
+
+	WDF_TIMER_CONFIG_INIT(&timerConfig, MouFilter_EvtDetectTimer);
+	timerConfig.AutomaticSerialization = FALSE;
+	WDF_OBJECT_ATTRIBUTES_INIT(&timerAttributes);
+	timerAttributes.ParentObject = controlDevice;
+
+	status = WdfTimerCreate(&timerConfig, &timerAttributes, &controlExt->DetectTimer);
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("WdfTimerCreate failed 0x%x\n", status));
+		goto Error;
+	}
+
+	//
+	// One work item answers all the detect requests waiting for an input,
+	// the service callback queues it without allocating anything.
+	//
+	controlExt->DetectWorkItem = IoAllocateWorkItem(WdfDeviceWdmGetDeviceObject(controlDevice));
+	if (controlExt->DetectWorkItem == NULL) {
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		DebugPrint(("Failed to allocate work item:  %x\n", status));
+		goto Error;
+	}
 
 	//
 	// Control devices must notify WDF when they are done initializing.   I/O is
@@ -540,6 +1235,8 @@ Return Value:
 
 --*/
 {
+	PCONTROL_DEVICE_EXTENSION	controlExt;
+
 	UNREFERENCED_PARAMETER(Device);
 
 	PAGED_CODE();
@@ -547,6 +1244,18 @@ Return Value:
 	KdPrint(("Deleting Control Device\n"));
 
 	if (ControlDevice) {
+		//
+		// No more packets get captured, hand the open batch to user mode
+		// before the queues go away.
+		//
+		controlExt = ControlGetData(ControlDevice);
+		WdfTimerStop(controlExt->CaptureTimer, TRUE);
+		WdfTimerStop(controlExt->DetectTimer, TRUE);
+		WdfSpinLockAcquire(controlExt->CaptureLock);
+		controlExt->CaptureSources = MOUSE_CAPTURE_NONE;
+		if (controlExt->CaptureRequest != NULL)
+			CompleteCaptureBatch(controlExt);
+		WdfSpinLockRelease(controlExt->CaptureLock);
 		WdfObjectDelete(ControlDevice);
 		ControlDevice = NULL;
 	}
@@ -813,7 +1522,7 @@ Return Value:
 --*/
 {
 	NTSTATUS status = STATUS_SUCCESS;
-	PFILTER_DEVICE_EXTENSION	filterExt;
+	PFILTER_DEVICE_EXTENSION	filterExt = NULL;
 	PCONTROL_DEVICE_EXTENSION	controlExt;
 	WDFMEMORY					outputMemory;
 	WDFMEMORY					inputMemory;
@@ -821,17 +1530,85 @@ Return Value:
 	size_t						inputCount;
 	size_t						requiredBytes;
 	USHORT						noItems;
-	WDFDEVICE					hFilterDevice;
+	PCONTROL_SESSION_CONTEXT	session;
+	ULONG						deviceHandle;
+	PULONG						deviceHandleBuffer;
+	PMOUSE_DEVICE_INFO			deviceInfo;
+	size_t						inputOffset;
+	ULONG						expectedGeneration;
+	ULONG						committedGeneration;
 	MOUSE_QUERY_RESULT			mouseIDs = { 0 };
 	PUSHORT                     keyboardIdBuffer;
 	PMOUSE_INPUT_DATA			inputData;
 	size_t						bufferSize;
+	PMOUSE_ABSOLUTE_MAP			absoluteMap;
+	MOUSE_ABSOLUTE_MAP			absoluteMapCopy;
+	MOUSE_ABSOLUTE_TRANSFORM	absoluteTransform;
+	PMOUSE_AUTOFIRE_DATA		autofireData;
+	MOUSE_AUTOFIRE_DATA			autofireCopy;
+	MOUSE_INPUT_DATA			releaseInput;
+	BOOLEAN						releaseRequired;
+	USHORT						ruleCount;
+	PEMU_RULE					newRules;
+	PEMU_RULE					oldRules;
+	PMOUSE_PROFILE				profile;
+	PMOUSE_PROFILE_DATA			profileData;
+	MOUSE_PROFILE_DATA			profileCopy;
+	PUSHORT						profileIndex;
+	WDFKEY						key;
+	PUCHAR						image;
+	ULONG						imageSize;
+	PMOUSE_CAPTURE_RING_REQUEST	ringRequest;
+	MOUSE_CAPTURE_RING_MAPPING	ringMapping;
+	PMOUSE_CAPTURE_CONFIG		captureConfig;
+	MOUSE_CAPTURE_CONFIG		captureCopy;
+	WDFREQUEST					captureRequest;
+	PMOUSE_STATS				stats;
+	PMOUSE_STATS_CONFIG			statsConfig;
+	PEMU_RULE					statsRules;
+	PEMU_STATS					ruleStats;
+	ULONG64						counters[EMU_STAT_COUNT];
+	ULONG						hitCount;
+	PMOUSE_LATENCY_REQUEST		latencyRequest;
+	PMOUSE_LATENCY				latency;
+	PULONG						generation;
+	PEMU_HISTOGRAM				latencyBase;
+	ULONG						latencyFlags;
+	PMOUSE_TRACE_CONFIG			traceConfig;
+	PEMU_TRACE_RING				traceRings;
+	PUCHAR						traceDump;
+	PMOUSE_DETECT_REQUEST		detectRequest;
+	PDETECT_REQUEST_CONTEXT		detectContext;
+	WDF_OBJECT_ATTRIBUTES		detectAttributes;
+	LONG64						detectDeadline;
+	LONG64						now;
+	UNICODE_STRING				imageValueName;
+	WCHAR						imageNameBuffer[EMU_IMAGE_DEVICE_VALUE_CHARS + 1];
 	UNREFERENCED_PARAMETER(Queue);
 
 	PAGED_CODE();
 
 	DebugPrint(("Entered MouFilter_EvtIoDeviceControl\n"));
 	controlExt = ControlGetData(ControlDevice);
+	session = SessionGetData(WdfRequestGetFileObject(Request));
+	deviceHandle = session->DeviceHandle;
+	inputOffset = 0;
+	expectedGeneration = 0;
+
+	//
+	// A device IOCTL may name its target mouse in front of its input
+	// instead of using the one selected on the handle.
+	//
+	if (IoControlCode & IOCTL_MOUSE_TARGETED(0)) {
+		IoControlCode &= ~IOCTL_MOUSE_TARGETED(0);
+		status = RetrieveDeviceHeader(Request, IoControlCode, &deviceHandle, &expectedGeneration);
+		if (!NT_SUCCESS(status)) {
+			WdfRequestComplete(Request, status);
+			return;
+		}
+		inputOffset = sizeof(MOUSE_DEVICE_HEADER);
+		InputBufferLength -= inputOffset;
+	}
 
 	//hDevice = WdfIoQueueGetDevice(Queue);
 	//devExt = FilterGetData(hDevice);
@@ -849,7 +1626,7 @@ Return Value:
 			break;
 		}
 
-		//there is not much contention if any at all over FilterDeviceCollectionLock, hence lets use this lock to protect controlExt->ActiveKeyboardId too.
+		//there is not much contention if any at all over FilterDeviceCollectionLock, hence lets use this lock to protect session->DeviceHandle too.
 		status = WdfRequestRetrieveInputBuffer(Request, sizeof(USHORT), &keyboardIdBuffer, &bytesTransferred);
 		if (!NT_SUCCESS(status)) {
 			DebugPrint(("WdfRequestRetrieveInputBuffer failed %x\n", status));
@@ -862,7 +1639,7 @@ Return Value:
 		noItems = (USHORT)WdfCollectionGetCount(FilterDeviceCollection);
 		if (noItems == 0) {
 			status = STATUS_INVALID_PARAMETER;
-			controlExt->ActiveMouseId = 0;
+			session->DeviceHandle = EMU_DEVICE_HANDLE_NONE;
 			DebugPrint(("Not any filter device found.\n"));
 			WdfWaitLockRelease(FilterDeviceCollectionLock);
 			break;
@@ -873,7 +1650,7 @@ Return Value:
 			WdfWaitLockRelease(FilterDeviceCollectionLock);
 			break;
 		}
-		controlExt->ActiveMouseId = *keyboardIdBuffer;
+		session->DeviceHandle = FilterGetData(WdfCollectionGetItem(FilterDeviceCollection, *keyboardIdBuffer))->DeviceHandle;
 		WdfWaitLockRelease(FilterDeviceCollectionLock);
 #pragma endregion
 		break;
@@ -900,26 +1677,19 @@ Return Value:
 			DebugPrint(("WdfMemoryGetBuffer failed.\n"));
 			break;
 		}
-		NT_ASSERT(bytesTransferred == InputBufferLength);
-
-		WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
-
-		noItems = (USHORT)WdfCollectionGetCount(FilterDeviceCollection);
-		if (noItems == 0) {
-			status = STATUS_INVALID_DEVICE_REQUEST;
-			DebugPrint(("Not any filter device found.\n"));
-			WdfWaitLockRelease(FilterDeviceCollectionLock);
+		NT_ASSERT(bytesTransferred == inputOffset + InputBufferLength);
+		inputData = (PMOUSE_INPUT_DATA)((PUCHAR)inputData + inputOffset);
+		bytesTransferred -= inputOffset;
+
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
 			break;
 		}
-
-		hFilterDevice = WdfCollectionGetItem(FilterDeviceCollection, controlExt->ActiveMouseId);
-
-		WdfWaitLockRelease(FilterDeviceCollectionLock);
-
-		filterExt = FilterGetData(hFilterDevice);
 		inputCount = (bytesTransferred / sizeof(MOUSE_INPUT_DATA));
 
-		On_IOCTL_MOUSE_INSERT_KEY(inputData, inputCount, filterExt);
+		On_IOCTL_MOUSE_INSERT_KEY(inputData, inputCount, filterExt, EMU_STAT_INJECTED);
 #pragma endregion
 		break;
 	case IOCTL_MOUSE_SET_FILTER:
@@ -940,33 +1710,33 @@ Return Value:
 			break;
 		}
 
-		WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
-
-		noItems = (USHORT)WdfCollectionGetCount(FilterDeviceCollection);
-		if (noItems == 0) {
-			status = STATUS_INVALID_DEVICE_REQUEST;
-			DebugPrint(("Not any filter device found.\n"));
-			WdfWaitLockRelease(FilterDeviceCollectionLock);
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
 			break;
 		}
-
-		hFilterDevice = WdfCollectionGetItem(FilterDeviceCollection, controlExt->ActiveMouseId);
-
-		WdfWaitLockRelease(FilterDeviceCollectionLock);
-
-		filterExt = FilterGetData(hFilterDevice);
-
 		WdfSpinLockAcquire(filterExt->SpinLock);
+		//checked where it is bumped, a commit racing this one cannot slip in between
+		if (expectedGeneration != 0 && (ULONG)filterExt->RuleGeneration != expectedGeneration) {
+			status = STATUS_REVISION_MISMATCH;
+			DebugPrint(("Rule generation %x expected, the tables are at %x.\n", expectedGeneration, filterExt->RuleGeneration));
+			WdfSpinLockRelease(filterExt->SpinLock);
+			break;
+		}
+		committedGeneration = BumpRuleGeneration(filterExt);
+		profile = &filterExt->Pipeline.Profiles[filterExt->EditProfile];
 		//first we reset filters
-		filterExt->FilterMode = FILTER_MOUSE_NONE;
+		profile->FilterMode = FILTER_MOUSE_NONE;
 
-		status = WdfMemoryCopyToBuffer(inputMemory, 0, &filterExt->FilterMode, sizeof(filterExt->FilterMode));
+		status = WdfMemoryCopyToBuffer(inputMemory, inputOffset, &profile->FilterMode, sizeof(profile->FilterMode));
 		if (!NT_SUCCESS(status)) {
 			DebugPrint(("WdfMemoryCopyToBuffer failed %x\n", status));
 			WdfSpinLockRelease(filterExt->SpinLock);
 			break;
 		}
 		WdfSpinLockRelease(filterExt->SpinLock);
+		ReturnRuleGeneration(Request, OutputBufferLength, committedGeneration, &bytesTransferred);
 #pragma endregion
 		break;
 	case IOCTL_MOUSE_SET_MODIFY:
@@ -986,51 +1756,50 @@ Return Value:
 			break;
 		}
 
-		WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
-
-		noItems = (USHORT)WdfCollectionGetCount(FilterDeviceCollection);
-		if (noItems == 0) {
-			status = STATUS_INVALID_DEVICE_REQUEST;
-			DebugPrint(("Not any filter device found.\n"));
-			WdfWaitLockRelease(FilterDeviceCollectionLock);
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
 			break;
 		}
-
-		hFilterDevice = WdfCollectionGetItem(FilterDeviceCollection, controlExt->ActiveMouseId);
-
-		WdfWaitLockRelease(FilterDeviceCollectionLock);
-
-		filterExt = FilterGetData(hFilterDevice);
-
 		WdfSpinLockAcquire(filterExt->SpinLock);
+		//checked where it is bumped, a commit racing this one cannot slip in between
+		if (expectedGeneration != 0 && (ULONG)filterExt->RuleGeneration != expectedGeneration) {
+			status = STATUS_REVISION_MISMATCH;
+			DebugPrint(("Rule generation %x expected, the tables are at %x.\n", expectedGeneration, filterExt->RuleGeneration));
+			WdfSpinLockRelease(filterExt->SpinLock);
+			break;
+		}
+		committedGeneration = BumpRuleGeneration(filterExt);
+		profile = &filterExt->Pipeline.Profiles[filterExt->EditProfile];
 		//first we should clear previously allocated buffer and reset mofify count
-		filterExt->ModifyRequest.ModifyCount = 0;
-		if (filterExt->ModifyRequest.ModifyData) {
-			ExFreePoolWithTag(filterExt->ModifyRequest.ModifyData, MOUSE_POOL_TAG);
-			filterExt->ModifyRequest.ModifyData = NULL;
+		profile->ModifyRequest.ModifyCount = 0;
+		if (profile->ModifyRequest.ModifyData) {
+			ExFreePoolWithTag(profile->ModifyRequest.ModifyData, MOUSE_POOL_TAG);
+			profile->ModifyRequest.ModifyData = NULL;
 		}
-		status = WdfMemoryCopyToBuffer(inputMemory, 0, &filterExt->ModifyRequest.ModifyCount, sizeof(filterExt->ModifyRequest.ModifyCount));
+		status = WdfMemoryCopyToBuffer(inputMemory, inputOffset, &profile->ModifyRequest.ModifyCount, sizeof(profile->ModifyRequest.ModifyCount));
 		if (!NT_SUCCESS(status)) {
 			DebugPrint(("WdfMemoryCopyToBuffer failed %x\n", status));
 			WdfSpinLockRelease(filterExt->SpinLock);
 			break;
 		}
 
-		if (filterExt->ModifyRequest.ModifyCount > 0) {
-			requiredBytes = filterExt->ModifyRequest.ModifyCount * sizeof(MOUSE_MODIFY_DATA);
+		if (profile->ModifyRequest.ModifyCount > 0) {
+			requiredBytes = profile->ModifyRequest.ModifyCount * sizeof(MOUSE_MODIFY_DATA);
 			if (InputBufferLength < requiredBytes + sizeof(USHORT))//buffer size does not match
 			{
 				status = STATUS_BUFFER_TOO_SMALL;
 				WdfSpinLockRelease(filterExt->SpinLock);
 				break;
 			}
-			filterExt->ModifyRequest.ModifyData = (PMOUSE_MODIFY_DATA)ExAllocatePoolWithTag(NonPagedPool, requiredBytes, MOUSE_POOL_TAG);
-			if (filterExt->ModifyRequest.ModifyData == NULL) {
+			profile->ModifyRequest.ModifyData = (PMOUSE_MODIFY_DATA)ExAllocatePoolWithTag(NonPagedPool, requiredBytes, MOUSE_POOL_TAG);
+			if (profile->ModifyRequest.ModifyData == NULL) {
 				status = STATUS_INSUFFICIENT_RESOURCES;
 				WdfSpinLockRelease(filterExt->SpinLock);
 				break;
 			}
-			status = WdfMemoryCopyToBuffer(inputMemory, sizeof(filterExt->ModifyRequest.ModifyCount), filterExt->ModifyRequest.ModifyData, requiredBytes);
+			status = WdfMemoryCopyToBuffer(inputMemory, inputOffset + sizeof(profile->ModifyRequest.ModifyCount), profile->ModifyRequest.ModifyData, requiredBytes);
 			if (!NT_SUCCESS(status)) {
 				DebugPrint(("WdfMemoryCopyToBuffer failed %x\n", status));
 				WdfSpinLockRelease(filterExt->SpinLock);
@@ -1038,6 +1807,7 @@ Return Value:
 			}
 		}
 		WdfSpinLockRelease(filterExt->SpinLock);
+		ReturnRuleGeneration(Request, OutputBufferLength, committedGeneration, &bytesTransferred);
 #pragma endregion
 		break;
 	case IOCTL_MOUSE_GET_FILTER:
@@ -1058,30 +1828,22 @@ Return Value:
 			break;
 		}
 
-		WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
-
-		noItems = (USHORT)WdfCollectionGetCount(FilterDeviceCollection);
-		if (noItems == 0) {
-			status = STATUS_INVALID_DEVICE_REQUEST;
-			DebugPrint(("Not any filter device found.\n"));
-			WdfWaitLockRelease(FilterDeviceCollectionLock);
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
 			break;
 		}
-
-		hFilterDevice = WdfCollectionGetItem(FilterDeviceCollection, controlExt->ActiveMouseId);
-
-		WdfWaitLockRelease(FilterDeviceCollectionLock);
-
-		filterExt = FilterGetData(hFilterDevice);
+		profile = &filterExt->Pipeline.Profiles[filterExt->EditProfile];
 
 		WdfSpinLockAcquire(filterExt->SpinLock);
-		status = WdfMemoryCopyFromBuffer(outputMemory, 0, &filterExt->FilterMode, sizeof(filterExt->FilterMode));
+		status = WdfMemoryCopyFromBuffer(outputMemory, 0, &profile->FilterMode, sizeof(profile->FilterMode));
 		if (!NT_SUCCESS(status)) {
 			DebugPrint(("WdfMemoryCopyFromBuffer failed %x\n", status));
 			WdfSpinLockRelease(filterExt->SpinLock);
 			break;
 		}
-		bytesTransferred += sizeof(filterExt->FilterMode);
+		bytesTransferred += sizeof(profile->FilterMode);
 		WdfSpinLockRelease(filterExt->SpinLock);
 #pragma endregion
 		break;
@@ -1110,32 +1872,24 @@ Return Value:
 		}
 		NT_ASSERT(bufferSize == OutputBufferLength);
 
-		WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
-
-		noItems = (USHORT)WdfCollectionGetCount(FilterDeviceCollection);
-		if (noItems == 0) {
-			status = STATUS_INVALID_DEVICE_REQUEST;
-			DebugPrint(("Not any filter device found.\n"));
-			WdfWaitLockRelease(FilterDeviceCollectionLock);
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
 			break;
 		}
-
-		hFilterDevice = WdfCollectionGetItem(FilterDeviceCollection, controlExt->ActiveMouseId);
-
-		WdfWaitLockRelease(FilterDeviceCollectionLock);
-
-		filterExt = FilterGetData(hFilterDevice);
+		profile = &filterExt->Pipeline.Profiles[filterExt->EditProfile];
 
 		WdfSpinLockAcquire(filterExt->SpinLock);
 
-		*modifyQueryBuffer = filterExt->ModifyRequest.ModifyCount;
+		*modifyQueryBuffer = profile->ModifyRequest.ModifyCount;
 		modifyQueryBuffer++;
-		bytesTransferred += sizeof(filterExt->ModifyRequest.ModifyCount);
+		bytesTransferred += sizeof(profile->ModifyRequest.ModifyCount);
 		PMOUSE_MODIFY_DATA modifyData = (PMOUSE_MODIFY_DATA)modifyQueryBuffer;
 		USHORT i = 0;
-		while (i < filterExt->ModifyRequest.ModifyCount && bytesTransferred < bufferSize && bufferSize - bytesTransferred >= sizeof(MOUSE_MODIFY_DATA))
+		while (i < profile->ModifyRequest.ModifyCount && bytesTransferred < bufferSize && bufferSize - bytesTransferred >= sizeof(MOUSE_MODIFY_DATA))
 		{
-			*modifyData = filterExt->ModifyRequest.ModifyData[i];
+			*modifyData = profile->ModifyRequest.ModifyData[i];
 			modifyData++;
 			bytesTransferred += sizeof(MOUSE_MODIFY_DATA);
 			i++;
@@ -1161,18 +1915,12 @@ Return Value:
 			break;
 		}
 
-		WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
-		noItems = (USHORT)WdfCollectionGetCount(FilterDeviceCollection);
-		if (noItems == 0) {
-			status = STATUS_INVALID_DEVICE_REQUEST;
-			DebugPrint(("Not any filter device found.\n"));
-			WdfWaitLockRelease(FilterDeviceCollectionLock);
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
 			break;
 		}
-		hFilterDevice = WdfCollectionGetItem(FilterDeviceCollection, controlExt->ActiveMouseId);
-		WdfWaitLockRelease(FilterDeviceCollectionLock);
-
-		filterExt = FilterGetData(hFilterDevice);
 		status = WdfMemoryCopyFromBuffer(outputMemory,
 			0,
 			&filterExt->MouseAttributes,
@@ -1186,259 +1934,2559 @@ Return Value:
 		bytesTransferred = sizeof(MOUSE_ATTRIBUTES);
 #pragma endregion
 		break;
-
-	case IOCTL_MOUSE_DETECT_DEVICE_ID:
-#pragma region IOCTL_MOUSE_DETECT_DEVICE_ID
-		DebugPrint(("Received IOCTL_MOUSE_DETECT_DEVICE_ID\n"));
-		if (OutputBufferLength < sizeof(USHORT)) {
+	case IOCTL_MOUSE_SET_ABSOLUTE_MAP:
+#pragma region IOCTL_MOUSE_SET_ABSOLUTE_MAP
+		DebugPrint(("Received IOCTL_MOUSE_SET_ABSOLUTE_MAP\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (InputBufferLength < sizeof(MOUSE_ABSOLUTE_MAP)) {
 			status = STATUS_BUFFER_TOO_SMALL;
 			break;
 		}
 
-		WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
-		noItems = (USHORT)WdfCollectionGetCount(FilterDeviceCollection);
-		if (noItems == 0) {
-			status = STATUS_INVALID_DEVICE_REQUEST;
-			DebugPrint(("Not any filter device found.\n"));
-			WdfWaitLockRelease(FilterDeviceCollectionLock);
+		status = RetrieveDeviceInput(Request, inputOffset, sizeof(MOUSE_ABSOLUTE_MAP), (PVOID*)&absoluteMap, &bytesTransferred);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("RetrieveDeviceInput failed %x\n", status));
 			break;
 		}
-		WdfWaitLockRelease(FilterDeviceCollectionLock);
+		bytesTransferred = 0;
 
-		if (controlExt->InputDeviceWorkItem != NULL) {
-			status = STATUS_OPERATION_IN_PROGRESS;
-			DebugPrint(("Another request is in progress\n"));
-			break;
-		}
-		controlExt->InputDeviceWorkItem = IoAllocateWorkItem(WdfDeviceWdmGetDeviceObject(ControlDevice));
-		if (controlExt->InputDeviceWorkItem == NULL)
-		{
-			status = STATUS_INSUFFICIENT_RESOURCES;
-			DebugPrint(("Failed to allocate work item:  %x\n", status));
+		if ((absoluteMap->Flags & ABSOLUTE_MAP_ENABLED) &&
+			(absoluteMap->Left > absoluteMap->Right || absoluteMap->Top > absoluteMap->Bottom)) {
+			status = STATUS_INVALID_PARAMETER;
 			break;
 		}
-		status = WdfRequestForwardToIoQueue(Request, controlExt->ManualQueue);
-		if (!NT_SUCCESS(status)) {
-			DebugPrint(("WdfRequestForwardToIoQueue failed %x\n", status));
+		//compiling outside the lock, the callback only sees the final transform
+		MousePipelineCompileAbsoluteMap(absoluteMap, &absoluteTransform);
+
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
 			break;
 		}
 
-		WdfSpinLockAcquire(controlExt->SpinLock);
-		controlExt->InputRequired = TRUE;//signalling the KbFilter_ServiceCallback to queue the workitem on key entered
-		WdfSpinLockRelease(controlExt->SpinLock);
-		return;//important to return from function here
+		WdfSpinLockAcquire(filterExt->SpinLock);
+		filterExt->AbsoluteMap = *absoluteMap;
+		filterExt->Pipeline.AbsoluteTransform = absoluteTransform;
+		WdfSpinLockRelease(filterExt->SpinLock);
 #pragma endregion
-
-	case IOCTL_MOUSE_GET_DEVICE_ID:
-#pragma region IOCTL_MOUSE_GET_DEVICE_ID
-		DebugPrint(("Received IOCTL_MOUSE_GET_DEVICE_ID\n"));
-		if (OutputBufferLength < sizeof(MOUSE_QUERY_RESULT)) {
+		break;
+	case IOCTL_MOUSE_GET_ABSOLUTE_MAP:
+#pragma region IOCTL_MOUSE_GET_ABSOLUTE_MAP
+		DebugPrint(("Received IOCTL_MOUSE_GET_ABSOLUTE_MAP\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (OutputBufferLength < sizeof(MOUSE_ABSOLUTE_MAP)) {
 			status = STATUS_BUFFER_TOO_SMALL;
 			break;
 		}
+
 		status = WdfRequestRetrieveOutputMemory(Request, &outputMemory);
+
 		if (!NT_SUCCESS(status)) {
 			DebugPrint(("WdfRequestRetrieveOutputMemory failed %x\n", status));
 			break;
 		}
-		WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
-		noItems = (USHORT)WdfCollectionGetCount(FilterDeviceCollection);
-		mouseIDs.ActiveDeviceId = controlExt->ActiveMouseId;
-		WdfWaitLockRelease(FilterDeviceCollectionLock);
-		mouseIDs.NumberOfDevices = noItems;
+
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
+			break;
+		}
+
+		WdfSpinLockAcquire(filterExt->SpinLock);
+		absoluteMapCopy = filterExt->AbsoluteMap;
+		WdfSpinLockRelease(filterExt->SpinLock);
+
 		status = WdfMemoryCopyFromBuffer(outputMemory,
 			0,
-			&mouseIDs,
-			sizeof(MOUSE_QUERY_RESULT));
+			&absoluteMapCopy,
+			sizeof(MOUSE_ABSOLUTE_MAP));
+
 		if (!NT_SUCCESS(status)) {
 			DebugPrint(("WdfMemoryCopyFromBuffer failed %x\n", status));
 			break;
 		}
-		bytesTransferred = sizeof(MOUSE_QUERY_RESULT);
+
+		bytesTransferred = sizeof(MOUSE_ABSOLUTE_MAP);
 #pragma endregion
 		break;
+	case IOCTL_MOUSE_SET_AUTOFIRE:
+#pragma region IOCTL_MOUSE_SET_AUTOFIRE
+		DebugPrint(("Received IOCTL_MOUSE_SET_AUTOFIRE\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (InputBufferLength < sizeof(MOUSE_AUTOFIRE_DATA)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
 
-	default:
-		status = STATUS_NOT_IMPLEMENTED;
-		break;
-	}
-	//this will free the user bufferd input
-	WdfRequestCompleteWithInformation(Request, status, bytesTransferred);
+		status = RetrieveDeviceInput(Request, inputOffset, sizeof(MOUSE_AUTOFIRE_DATA), (PVOID*)&autofireData, &bytesTransferred);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("RetrieveDeviceInput failed %x\n", status));
+			break;
+		}
+		bytesTransferred = 0;
+
+		if (autofireData->TriggerButton != 0) {
+			//trigger and output must each be exactly one button down flag
+			if ((autofireData->TriggerButton & MOUSE_BUTTON_DOWN_MASK) != autofireData->TriggerButton ||
+				(autofireData->TriggerButton & (autofireData->TriggerButton - 1)) != 0 ||
+				autofireData->OutputButton == 0 ||
+				(autofireData->OutputButton & MOUSE_BUTTON_DOWN_MASK) != autofireData->OutputButton ||
+				(autofireData->OutputButton & (autofireData->OutputButton - 1)) != 0 ||
+				autofireData->PeriodMicroseconds < MOUSE_AUTOFIRE_MIN_PERIOD ||
+				autofireData->PressMicroseconds == 0 ||
+				autofireData->PressMicroseconds >= autofireData->PeriodMicroseconds) {
+				status = STATUS_INVALID_PARAMETER;
+				break;
+			}
+		}
 
-	return;
-}
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
+			break;
+		}
 
-VOID
-On_IOCTL_MOUSE_INSERT_KEY(
-	IN PMOUSE_INPUT_DATA InputDataStart,
-	IN size_t InputCount,
-	IN PFILTER_DEVICE_EXTENSION FilterExtension) {
-	/*++
+		WdfSpinLockAcquire(filterExt->SpinLock);
+		//a button still held down by the previous configuration must be released
+		releaseRequired = AutofireDisarm(&filterExt->Pipeline.AutofireSchedule);
+		RtlZeroMemory(&releaseInput, sizeof(releaseInput));
+		releaseInput.ButtonFlags = (USHORT)(filterExt->Pipeline.Autofire.OutputButton << 1);
+		if (releaseRequired)
+			On_IOCTL_MOUSE_INSERT_KEY(&releaseInput, 1, filterExt, EMU_STAT_EXPANDED);
+		filterExt->Pipeline.Autofire = *autofireData;
+		//the schedule runs on the interrupt time which is in 100ns units
+		AutofireInitialize(&filterExt->Pipeline.AutofireSchedule,
+			(LONG64)autofireData->PeriodMicroseconds * 10,
+			(LONG64)autofireData->PressMicroseconds * 10);
+		WdfSpinLockRelease(filterExt->SpinLock);
+		WdfTimerStop(filterExt->AutofireTimer, FALSE);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_GET_AUTOFIRE:
+#pragma region IOCTL_MOUSE_GET_AUTOFIRE
+		DebugPrint(("Received IOCTL_MOUSE_GET_AUTOFIRE\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (OutputBufferLength < sizeof(MOUSE_AUTOFIRE_DATA)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
 
-Routine Description:
+		status = WdfRequestRetrieveOutputMemory(Request, &outputMemory);
 
-	Forwards our artificial inputs to the mouclass service callback
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveOutputMemory failed %x\n", status));
+			break;
+		}
 
-Arguments:
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
+			break;
+		}
 
-	InputDataStart - Mouse input structure pointer.
+		WdfSpinLockAcquire(filterExt->SpinLock);
+		autofireCopy = filterExt->Pipeline.Autofire;
+		WdfSpinLockRelease(filterExt->SpinLock);
 
-	InputCount - Number of inputs the pointer points to.
+		status = WdfMemoryCopyFromBuffer(outputMemory,
+			0,
+			&autofireCopy,
+			sizeof(MOUSE_AUTOFIRE_DATA));
 
-	FilterExtension - Filter device extension which holds the hooked service call back of the mouclass.
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfMemoryCopyFromBuffer failed %x\n", status));
+			break;
+		}
 
-Return Value:
+		bytesTransferred = sizeof(MOUSE_AUTOFIRE_DATA);
+#pragma endregion
+		break;
 
-		Void.
+	case IOCTL_MOUSE_SET_RULES:
+#pragma region IOCTL_MOUSE_SET_RULES
+		DebugPrint(("Received IOCTL_MOUSE_SET_RULES\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (InputBufferLength < sizeof(USHORT)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		status = WdfRequestRetrieveInputMemory(Request, &inputMemory);
+
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveInputMemory failed %x\n", status));
+			break;
+		}
+
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
+			break;
+		}
+		status = WdfMemoryCopyToBuffer(inputMemory, inputOffset, &ruleCount, sizeof(ruleCount));
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfMemoryCopyToBuffer failed %x\n", status));
+			break;
+		}
+
+		//the new rules are copied and validated before the lock is taken, the service callback only waits for the swap
+		newRules = NULL;
+		if (ruleCount > 0) {
+			requiredBytes = ruleCount * sizeof(EMU_RULE);
+			if (InputBufferLength < requiredBytes + sizeof(USHORT))//buffer size does not match
+			{
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+			newRules = AllocateSharedRules(ruleCount);
+			if (newRules == NULL) {
+				status = STATUS_INSUFFICIENT_RESOURCES;
+				break;
+			}
+			status = WdfMemoryCopyToBuffer(inputMemory, inputOffset + sizeof(ruleCount), newRules, requiredBytes);
+			if (!NT_SUCCESS(status)) {
+				DebugPrint(("WdfMemoryCopyToBuffer failed %x\n", status));
+				ReleaseSharedRules(newRules);
+				break;
+			}
+			if (!EmuValidateRules(newRules, ruleCount, EmuSharedRulesIndex(newRules))) {
+				status = STATUS_INVALID_PARAMETER;
+				ReleaseSharedRules(newRules);
+				break;
+			}
+		}
+
+		WdfSpinLockAcquire(filterExt->SpinLock);
+		//checked where it is bumped, a commit racing this one cannot slip in between
+		if (expectedGeneration != 0 && (ULONG)filterExt->RuleGeneration != expectedGeneration) {
+			status = STATUS_REVISION_MISMATCH;
+			DebugPrint(("Rule generation %x expected, the tables are at %x.\n", expectedGeneration, filterExt->RuleGeneration));
+			WdfSpinLockRelease(filterExt->SpinLock);
+			ReleaseSharedRules(newRules);
+			break;
+		}
+		committedGeneration = BumpRuleGeneration(filterExt);
+		profile = &filterExt->Pipeline.Profiles[filterExt->EditProfile];
+		oldRules = profile->RuleRequest.Rules;
+		profile->RuleRequest.Rules = newRules;
+		profile->RuleRequest.RuleCount = ruleCount;
+		WdfSpinLockRelease(filterExt->SpinLock);
+
+		ReleaseSharedRules(oldRules);
+		ReturnRuleGeneration(Request, OutputBufferLength, committedGeneration, &bytesTransferred);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_BROADCAST_RULES:
+#pragma region IOCTL_MOUSE_BROADCAST_RULES
+		DebugPrint(("Received IOCTL_MOUSE_BROADCAST_RULES\n"));
+		status = BroadcastRules(Request, InputBufferLength);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_GET_RULES:
+#pragma region IOCTL_MOUSE_GET_RULES
+		DebugPrint(("Received IOCTL_MOUSE_GET_RULES\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (OutputBufferLength < sizeof(USHORT)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		status = WdfRequestRetrieveOutputMemory(Request, &outputMemory);
+
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveOutputMemory failed %x\n", status));
+			break;
+		}
+
+		PUSHORT ruleQueryBuffer = (PUSHORT)WdfMemoryGetBuffer(outputMemory, &bufferSize);
+		if (ruleQueryBuffer == NULL) {
+			status = STATUS_INVALID_DEVICE_REQUEST;
+			DebugPrint(("WdfMemoryGetBuffer failed.\n"));
+			break;
+		}
+		NT_ASSERT(bufferSize == OutputBufferLength);
+
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
+			break;
+		}
+		profile = &filterExt->Pipeline.Profiles[filterExt->EditProfile];
+
+		WdfSpinLockAcquire(filterExt->SpinLock);
+
+		*ruleQueryBuffer = profile->RuleRequest.RuleCount;
+		ruleQueryBuffer++;
+		bytesTransferred += sizeof(profile->RuleRequest.RuleCount);
+		PEMU_RULE ruleData = (PEMU_RULE)ruleQueryBuffer;
+		for (USHORT r = 0; r < profile->RuleRequest.RuleCount && bufferSize - bytesTransferred >= sizeof(EMU_RULE); r++)
+		{
+			*ruleData = profile->RuleRequest.Rules[r];
+			ruleData++;
+			bytesTransferred += sizeof(EMU_RULE);
+		}
+		WdfSpinLockRelease(filterExt->SpinLock);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_GET_STATS:
+#pragma region IOCTL_MOUSE_GET_STATS
+		DebugPrint(("Received IOCTL_MOUSE_GET_STATS\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (OutputBufferLength < FIELD_OFFSET(MOUSE_STATS, RuleHits)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		status = WdfRequestRetrieveOutputBuffer(Request, FIELD_OFFSET(MOUSE_STATS, RuleHits), &stats, NULL);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveOutputBuffer failed %x\n", status));
+			break;
+		}
+
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
+			break;
+		}
+
+		RtlZeroMemory(stats, FIELD_OFFSET(MOUSE_STATS, RuleHits));
+		EmuStatsCollect(filterExt->Stats, counters);
+		stats->Seen = counters[EMU_STAT_SEEN];
+		stats->Dropped = counters[EMU_STAT_DROPPED];
+		stats->Modified = counters[EMU_STAT_MODIFIED];
+		stats->Injected = counters[EMU_STAT_INJECTED];
+		stats->Expanded = counters[EMU_STAT_EXPANDED];
+		bytesTransferred = FIELD_OFFSET(MOUSE_STATS, RuleHits);
+
+		//
+		// The hits of the active rule table are summed outside the lock,
+		// the reference keeps the table alive meanwhile.
+		//
+		WdfSpinLockAcquire(filterExt->SpinLock);
+		profile = &filterExt->Pipeline.Profiles[filterExt->Pipeline.ActiveProfile];
+		stats->RuleCount = profile->RuleRequest.RuleCount;
+		statsRules = profile->RuleRequest.Rules;
+		if (statsRules != NULL)
+			EmuSharedRulesReference(statsRules);
+		WdfSpinLockRelease(filterExt->SpinLock);
+
+		if (statsRules != NULL) {
+			ruleStats = EmuSharedRulesHits(statsRules);
+			if (ruleStats != NULL) {
+				hitCount = (ULONG)((OutputBufferLength - bytesTransferred) / sizeof(ULONG64));
+				if (hitCount > ruleStats->RuleCount)
+					hitCount = ruleStats->RuleCount;
+				stats->RuleHitsCounted = TRUE;
+				EmuStatsCollectRuleHits(ruleStats, stats->RuleHits, hitCount);
+				bytesTransferred += hitCount * sizeof(ULONG64);
+			}
+			ReleaseSharedRules(statsRules);
+		}
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_SET_STATS:
+#pragma region IOCTL_MOUSE_SET_STATS
+		DebugPrint(("Received IOCTL_MOUSE_SET_STATS\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (InputBufferLength < sizeof(MOUSE_STATS_CONFIG)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		status = WdfRequestRetrieveInputBuffer(Request, sizeof(MOUSE_STATS_CONFIG), &statsConfig, NULL);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveInputBuffer failed %x\n", status));
+			break;
+		}
+		if ((statsConfig->Flags & ~MOUSE_STATS_RULE_HITS) != 0) {
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+		//installed tables keep what they were allocated with, new ones follow the setting
+		InterlockedExchange(&CountRuleHits, (statsConfig->Flags & MOUSE_STATS_RULE_HITS) != 0);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_GET_LATENCY:
+#pragma region IOCTL_MOUSE_GET_LATENCY
+		DebugPrint(("Received IOCTL_MOUSE_GET_LATENCY\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (OutputBufferLength < sizeof(MOUSE_LATENCY)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		//the flags are read first, input and output share the buffer
+		latencyFlags = 0;
+		if (InputBufferLength >= sizeof(MOUSE_LATENCY_REQUEST)) {
+			status = RetrieveDeviceInput(Request, inputOffset, sizeof(MOUSE_LATENCY_REQUEST), (PVOID*)&latencyRequest, &bytesTransferred);
+			if (!NT_SUCCESS(status)) {
+				DebugPrint(("RetrieveDeviceInput failed %x\n", status));
+				break;
+			}
+			bytesTransferred = 0;
+			latencyFlags = latencyRequest->Flags;
+		}
+		if ((latencyFlags & ~MOUSE_LATENCY_RESET) != 0) {
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+		status = WdfRequestRetrieveOutputBuffer(Request, sizeof(MOUSE_LATENCY), &latency, NULL);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveOutputBuffer failed %x\n", status));
+			break;
+		}
+
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
+			break;
+		}
+
+		//
+		// The control queue dispatches one request at a time, so the base
+		// needs no lock. A reset moves the base to the snapshot it returns,
+		// every recorded value shows up in exactly one reset interval.
+		//
+		RtlZeroMemory(latency, sizeof(MOUSE_LATENCY));
+		latency->Frequency = PerformanceFrequency;
+		latencyBase = filterExt->Histograms + StatsProcessorCount * EMU_HIST_COUNT;
+		for (ULONG p = 0; p < StatsProcessorCount; p++)
+			for (ULONG k = 0; k < EMU_HIST_COUNT; k++)
+				EmuHistogramAccumulate(&latency->Histograms[k], &filterExt->Histograms[p * EMU_HIST_COUNT + k]);
+		for (ULONG k = 0; k < EMU_HIST_COUNT; k++) {
+			EmuHistogramSubtract(&latency->Histograms[k], &latencyBase[k]);
+			if (latencyFlags & MOUSE_LATENCY_RESET)
+				EmuHistogramAccumulate(&latencyBase[k], &latency->Histograms[k]);
+		}
+		bytesTransferred = sizeof(MOUSE_LATENCY);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_SET_TRACE:
+#pragma region IOCTL_MOUSE_SET_TRACE
+		DebugPrint(("Received IOCTL_MOUSE_SET_TRACE\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (InputBufferLength < sizeof(MOUSE_TRACE_CONFIG)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		status = WdfRequestRetrieveInputBuffer(Request, sizeof(MOUSE_TRACE_CONFIG), &traceConfig, NULL);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveInputBuffer failed %x\n", status));
+			break;
+		}
+		if ((traceConfig->Flags & ~MOUSE_TRACE_ENABLE) != 0) {
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+		//
+		// The rings are published before tracing is turned on and stay
+		// until unload, so a writer that sees tracing on finds them.
+		//
+		if ((traceConfig->Flags & MOUSE_TRACE_ENABLE) && TraceRings == NULL) {
+			traceRings = (PEMU_TRACE_RING)ExAllocatePoolWithTag(NonPagedPool, StatsProcessorCount * sizeof(EMU_TRACE_RING), MOUSE_POOL_TAG);
+			if (traceRings == NULL) {
+				status = STATUS_INSUFFICIENT_RESOURCES;
+				break;
+			}
+			RtlZeroMemory(traceRings, StatsProcessorCount * sizeof(EMU_TRACE_RING));
+			InterlockedExchangePointer((PVOID volatile*)&TraceRings, traceRings);
+		}
+		InterlockedExchange(&TraceEnabled, (traceConfig->Flags & MOUSE_TRACE_ENABLE) != 0);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_READ_TRACE:
+#pragma region IOCTL_MOUSE_READ_TRACE
+		DebugPrint(("Received IOCTL_MOUSE_READ_TRACE\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (OutputBufferLength < sizeof(EMU_TRACE_DUMP)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		status = WdfRequestRetrieveOutputBuffer(Request, sizeof(EMU_TRACE_DUMP), &traceDump, NULL);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveOutputBuffer failed %x\n", status));
+			break;
+		}
+		//
+		// The control queue dispatches one request at a time, so the rings
+		// have a single drain. Records that don't fit stay for the next read.
+		//
+		bytesTransferred = EmuTraceBeginDump(traceDump, PerformanceFrequency);
+		if (TraceRings != NULL)
+			for (ULONG p = 0; p < StatsProcessorCount; p++)
+				bytesTransferred += EmuTraceDrain(&TraceRings[p], p, traceDump + bytesTransferred, (ULONG)(OutputBufferLength - bytesTransferred));
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_GET_GENERATION:
+#pragma region IOCTL_MOUSE_GET_GENERATION
+		DebugPrint(("Received IOCTL_MOUSE_GET_GENERATION\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (OutputBufferLength < sizeof(ULONG)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		status = WdfRequestRetrieveOutputBuffer(Request, sizeof(ULONG), &generation, NULL);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveOutputBuffer failed %x\n", status));
+			break;
+		}
+
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
+			break;
+		}
+		*generation = (ULONG)ReadNoFence(&filterExt->RuleGeneration);
+		bytesTransferred = sizeof(ULONG);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_SET_PROFILE:
+#pragma region IOCTL_MOUSE_SET_PROFILE
+		DebugPrint(("Received IOCTL_MOUSE_SET_PROFILE\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (InputBufferLength < sizeof(MOUSE_PROFILE_DATA)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		status = RetrieveDeviceInput(Request, inputOffset, sizeof(MOUSE_PROFILE_DATA), (PVOID*)&profileData, &bytesTransferred);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("RetrieveDeviceInput failed %x\n", status));
+			break;
+		}
+		bytesTransferred = 0;
+
+		if (profileData->ActiveProfile >= MOUSE_PROFILE_COUNT || profileData->EditProfile >= MOUSE_PROFILE_COUNT) {
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+		//every hotkey must be exactly one button down flag
+		for (USHORT p = 0; p < MOUSE_PROFILE_COUNT; p++)
+		{
+			if ((profileData->Hotkeys[p] & MOUSE_BUTTON_DOWN_MASK) != profileData->Hotkeys[p] ||
+				(profileData->Hotkeys[p] & (profileData->Hotkeys[p] - 1)) != 0) {
+				status = STATUS_INVALID_PARAMETER;
+				break;
+			}
+		}
+		if (!NT_SUCCESS(status))
+			break;
+
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
+			break;
+		}
+
+		WdfSpinLockAcquire(filterExt->SpinLock);
+		BumpRuleGeneration(filterExt);
+		filterExt->Pipeline.ProfileHotkeyMask = 0;
+		for (USHORT p = 0; p < MOUSE_PROFILE_COUNT; p++)
+		{
+			filterExt->Pipeline.ProfileHotkeys[p] = profileData->Hotkeys[p];
+			filterExt->Pipeline.ProfileHotkeyMask |= profileData->Hotkeys[p];
+		}
+		filterExt->EditProfile = profileData->EditProfile;
+		WdfSpinLockRelease(filterExt->SpinLock);
+		InterlockedExchange(&filterExt->Pipeline.ActiveProfile, profileData->ActiveProfile);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_GET_PROFILE:
+#pragma region IOCTL_MOUSE_GET_PROFILE
+		DebugPrint(("Received IOCTL_MOUSE_GET_PROFILE\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (OutputBufferLength < sizeof(MOUSE_PROFILE_DATA)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		status = WdfRequestRetrieveOutputMemory(Request, &outputMemory);
+
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveOutputMemory failed %x\n", status));
+			break;
+		}
+
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
+			break;
+		}
+
+		WdfSpinLockAcquire(filterExt->SpinLock);
+		profileCopy.ActiveProfile = (USHORT)filterExt->Pipeline.ActiveProfile;
+		profileCopy.EditProfile = filterExt->EditProfile;
+		for (USHORT p = 0; p < MOUSE_PROFILE_COUNT; p++)
+			profileCopy.Hotkeys[p] = filterExt->Pipeline.ProfileHotkeys[p];
+		WdfSpinLockRelease(filterExt->SpinLock);
+
+		status = WdfMemoryCopyFromBuffer(outputMemory,
+			0,
+			&profileCopy,
+			sizeof(MOUSE_PROFILE_DATA));
+
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfMemoryCopyFromBuffer failed %x\n", status));
+			break;
+		}
+
+		bytesTransferred = sizeof(MOUSE_PROFILE_DATA);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_SWITCH_PROFILE:
+#pragma region IOCTL_MOUSE_SWITCH_PROFILE
+		DebugPrint(("Received IOCTL_MOUSE_SWITCH_PROFILE\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (InputBufferLength < sizeof(USHORT)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		status = RetrieveDeviceInput(Request, inputOffset, sizeof(USHORT), (PVOID*)&profileIndex, &bytesTransferred);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("RetrieveDeviceInput failed %x\n", status));
+			break;
+		}
+		bytesTransferred = 0;
+
+		if (*profileIndex >= MOUSE_PROFILE_COUNT) {
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
+			break;
+		}
+
+		//the tables of every profile are already in place, the next packet just picks another slot
+		InterlockedExchange(&filterExt->Pipeline.ActiveProfile, *profileIndex);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_SAVE_IMAGE:
+#pragma region IOCTL_MOUSE_SAVE_IMAGE
+		DebugPrint(("Received IOCTL_MOUSE_SAVE_IMAGE\n"));
+
+		filterExt = ReferenceFilterDevice(deviceHandle);
+		if (filterExt == NULL) {
+			status = STATUS_NO_SUCH_DEVICE;
+			DebugPrint(("Device %x not found.\n", deviceHandle));
+			break;
+		}
+
+		WdfSpinLockAcquire(filterExt->SpinLock);
+		imageSize = SerializeProfiles(filterExt, NULL, 0);
+		image = (PUCHAR)ExAllocatePoolWithTag(NonPagedPool, imageSize, MOUSE_POOL_TAG);
+		if (image != NULL)
+			imageSize = SerializeProfiles(filterExt, image, imageSize);
+		WdfSpinLockRelease(filterExt->SpinLock);
+		if (image == NULL) {
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			break;
+		}
+		if (imageSize == 0 || imageSize > EMU_IMAGE_MAX_SIZE) {
+			status = STATUS_INVALID_BUFFER_SIZE;
+			ExFreePoolWithTag(image, MOUSE_POOL_TAG);
+			break;
+		}
+
+		status = WdfDriverOpenParametersRegistryKey(WdfGetDriver(), KEY_WRITE, WDF_NO_OBJECT_ATTRIBUTES, &key);
+		if (NT_SUCCESS(status)) {
+			//the image belongs to this mouse, it gets it back when it is added again
+			RtlInitEmptyUnicodeString(&imageValueName, imageNameBuffer, sizeof(imageNameBuffer));
+			status = RtlUnicodeStringPrintf(&imageValueName, EMU_IMAGE_DEVICE_VALUE_FORMAT, filterExt->DeviceHandle);
+			if (NT_SUCCESS(status))
+				status = WdfRegistryAssignValue(key, &imageValueName, REG_BINARY, imageSize, image);
+			WdfRegistryClose(key);
+		}
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("Saving the profile image failed %x\n", status));
+		}
+		ExFreePoolWithTag(image, MOUSE_POOL_TAG);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_SET_CAPTURE:
+#pragma region IOCTL_MOUSE_SET_CAPTURE
+		DebugPrint(("Received IOCTL_MOUSE_SET_CAPTURE\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (InputBufferLength < sizeof(MOUSE_CAPTURE_CONFIG)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		status = WdfRequestRetrieveInputBuffer(Request, sizeof(MOUSE_CAPTURE_CONFIG), &captureConfig, &bytesTransferred);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveInputBuffer failed %x\n", status));
+			break;
+		}
+		bytesTransferred = 0;
+
+		if ((captureConfig->Sources & ~(MOUSE_CAPTURE_FILTERED | MOUSE_CAPTURE_PASSED)) != 0 ||
+			captureConfig->Delivery > MOUSE_CAPTURE_DELIVERY_RING) {
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+
+		WdfSpinLockAcquire(controlExt->CaptureLock);
+		controlExt->CaptureSources = captureConfig->Sources;
+		controlExt->CaptureDelivery = captureConfig->Delivery;
+		//the deadlines run on the interrupt time which is in 100ns units
+		controlExt->CaptureLatency = (LONG64)captureConfig->LatencyMicroseconds * 10;
+		//the open batch was started under the previous latency, don't keep it waiting
+		if (controlExt->CaptureRequest != NULL)
+			CompleteCaptureBatch(controlExt);
+		WdfSpinLockRelease(controlExt->CaptureLock);
+
+		if (captureConfig->Sources == MOUSE_CAPTURE_NONE || captureConfig->Delivery == MOUSE_CAPTURE_DELIVERY_RING) {
+			//no request will be filled anymore, release the waiting ones
+			while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(controlExt->CaptureQueue, &captureRequest)))
+				WdfRequestComplete(captureRequest, STATUS_CANCELLED);
+		}
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_GET_CAPTURE:
+#pragma region IOCTL_MOUSE_GET_CAPTURE
+		DebugPrint(("Received IOCTL_MOUSE_GET_CAPTURE\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (OutputBufferLength < sizeof(MOUSE_CAPTURE_CONFIG)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		status = WdfRequestRetrieveOutputMemory(Request, &outputMemory);
+
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveOutputMemory failed %x\n", status));
+			break;
+		}
+
+		RtlZeroMemory(&captureCopy, sizeof(captureCopy));
+		WdfSpinLockAcquire(controlExt->CaptureLock);
+		captureCopy.Sources = controlExt->CaptureSources;
+		captureCopy.Delivery = controlExt->CaptureDelivery;
+		captureCopy.LatencyMicroseconds = (ULONG)(controlExt->CaptureLatency / 10);
+		WdfSpinLockRelease(controlExt->CaptureLock);
+
+		status = WdfMemoryCopyFromBuffer(outputMemory,
+			0,
+			&captureCopy,
+			sizeof(MOUSE_CAPTURE_CONFIG));
+
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfMemoryCopyFromBuffer failed %x\n", status));
+			break;
+		}
+
+		bytesTransferred = sizeof(MOUSE_CAPTURE_CONFIG);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_CAPTURE:
+#pragma region IOCTL_MOUSE_CAPTURE
+		DebugPrint(("Received IOCTL_MOUSE_CAPTURE\n"));
+		if (OutputBufferLength < sizeof(MOUSE_CAPTURE_RECORD)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		if (controlExt->CaptureSources == MOUSE_CAPTURE_NONE || controlExt->CaptureDelivery != MOUSE_CAPTURE_DELIVERY_REQUESTS) {
+			status = STATUS_INVALID_DEVICE_STATE;
+			DebugPrint(("Capturing to requests is not enabled\n"));
+			break;
+		}
+		//
+		// The request stays pending until the service callback fills it with captured packets,
+		// clients keep several of them outstanding so no packet is lost between two completions.
+		//
+		status = WdfRequestForwardToIoQueue(Request, controlExt->CaptureQueue);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestForwardToIoQueue failed %x\n", status));
+			break;
+		}
+		return;//important to return from function here
+#pragma endregion
+
+	case IOCTL_MOUSE_MAP_CAPTURE_RING:
+#pragma region IOCTL_MOUSE_MAP_CAPTURE_RING
+		DebugPrint(("Received IOCTL_MOUSE_MAP_CAPTURE_RING\n"));
+		//
+		// Buffer is too small, fail the request
+		//
+		if (InputBufferLength < sizeof(MOUSE_CAPTURE_RING_REQUEST) || OutputBufferLength < sizeof(MOUSE_CAPTURE_RING_MAPPING)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		status = WdfRequestRetrieveInputBuffer(Request, sizeof(MOUSE_CAPTURE_RING_REQUEST), &ringRequest, &bytesTransferred);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveInputBuffer failed %x\n", status));
+			break;
+		}
+		bytesTransferred = 0;
+
+		status = MapCaptureRing(controlExt, Request, (HANDLE)(ULONG_PTR)ringRequest->EventHandle, &ringMapping);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("MapCaptureRing failed %x\n", status));
+			break;
+		}
+
+		status = WdfRequestRetrieveOutputMemory(Request, &outputMemory);
+		if (NT_SUCCESS(status))
+			status = WdfMemoryCopyFromBuffer(outputMemory, 0, &ringMapping, sizeof(MOUSE_CAPTURE_RING_MAPPING));
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("Returning the ring mapping failed %x\n", status));
+			UnmapCaptureRing(controlExt, WdfRequestGetFileObject(Request));
+			break;
+		}
+
+		bytesTransferred = sizeof(MOUSE_CAPTURE_RING_MAPPING);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_UNMAP_CAPTURE_RING:
+#pragma region IOCTL_MOUSE_UNMAP_CAPTURE_RING
+		DebugPrint(("Received IOCTL_MOUSE_UNMAP_CAPTURE_RING\n"));
+		UnmapCaptureRing(controlExt, WdfRequestGetFileObject(Request));
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_DETECT_DEVICE_ID:
+#pragma region IOCTL_MOUSE_DETECT_DEVICE_ID
+		DebugPrint(("Received IOCTL_MOUSE_DETECT_DEVICE_ID\n"));
+		if (OutputBufferLength < sizeof(USHORT)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
+		noItems = (USHORT)WdfCollectionGetCount(FilterDeviceCollection);
+		if (noItems == 0) {
+			status = STATUS_INVALID_DEVICE_REQUEST;
+			DebugPrint(("Not any filter device found.\n"));
+			WdfWaitLockRelease(FilterDeviceCollectionLock);
+			break;
+		}
+		WdfWaitLockRelease(FilterDeviceCollectionLock);
+
+		//
+		// Any number of requests may wait, the next input answers all of
+		// them. An optional MOUSE_DETECT_REQUEST bounds the wait, canceled
+		// requests are completed by the framework.
+		//
+		detectDeadline = 0;
+		now = 0;
+		if (InputBufferLength >= sizeof(MOUSE_DETECT_REQUEST)) {
+			status = WdfRequestRetrieveInputBuffer(Request, sizeof(MOUSE_DETECT_REQUEST), &detectRequest, NULL);
+			if (!NT_SUCCESS(status)) {
+				DebugPrint(("WdfRequestRetrieveInputBuffer failed %x\n", status));
+				break;
+			}
+			if (detectRequest->Timeout != 0) {
+				WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&detectAttributes, DETECT_REQUEST_CONTEXT);
+				status = WdfObjectAllocateContext(Request, &detectAttributes, &detectContext);
+				if (!NT_SUCCESS(status)) {
+					DebugPrint(("WdfObjectAllocateContext failed %x\n", status));
+					break;
+				}
+				now = (LONG64)KeQueryInterruptTime();
+				detectDeadline = now + (LONG64)detectRequest->Timeout * 10000;
+				detectContext->Deadline = detectDeadline;
+			}
+		}
+
+		status = WdfRequestForwardToIoQueue(Request, controlExt->ManualQueue);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestForwardToIoQueue failed %x\n", status));
+			break;
+		}
+		//the request may be answered from here on, only the copied deadline is used
+		if (detectDeadline != 0)
+			ScheduleDetectTimer(controlExt, detectDeadline, now);
+
+		//a busy work item arms again by itself once it sees this request
+		InterlockedCompareExchange(&controlExt->DetectState, DETECT_ARMED, DETECT_IDLE);
+		return;//important to return from function here
+#pragma endregion
+
+	case IOCTL_MOUSE_GET_DEVICE_ID:
+#pragma region IOCTL_MOUSE_GET_DEVICE_ID
+		DebugPrint(("Received IOCTL_MOUSE_GET_DEVICE_ID\n"));
+		if (OutputBufferLength < sizeof(MOUSE_QUERY_RESULT)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		status = WdfRequestRetrieveOutputMemory(Request, &outputMemory);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveOutputMemory failed %x\n", status));
+			break;
+		}
+		filterExt = ReferenceFilterDevice(session->DeviceHandle);
+		WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
+		noItems = (USHORT)WdfCollectionGetCount(FilterDeviceCollection);
+		mouseIDs.ActiveDeviceId = filterExt != NULL ? GetDeviceIndex(filterExt) : 0;
+		WdfWaitLockRelease(FilterDeviceCollectionLock);
+		mouseIDs.NumberOfDevices = noItems;
+		status = WdfMemoryCopyFromBuffer(outputMemory,
+			0,
+			&mouseIDs,
+			sizeof(MOUSE_QUERY_RESULT));
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfMemoryCopyFromBuffer failed %x\n", status));
+			break;
+		}
+		bytesTransferred = sizeof(MOUSE_QUERY_RESULT);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_GET_DEVICES:
+#pragma region IOCTL_MOUSE_GET_DEVICES
+		DebugPrint(("Received IOCTL_MOUSE_GET_DEVICES\n"));
+		if (OutputBufferLength < sizeof(MOUSE_DEVICE_INFO)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		status = WdfRequestRetrieveOutputBuffer(Request, sizeof(MOUSE_DEVICE_INFO), (PVOID*)&deviceInfo, &bufferSize);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveOutputBuffer failed %x\n", status));
+			break;
+		}
+		WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
+		noItems = (USHORT)WdfCollectionGetCount(FilterDeviceCollection);
+		inputCount = bufferSize / sizeof(MOUSE_DEVICE_INFO);
+		if (inputCount > noItems)
+			inputCount = noItems;
+		else if (inputCount < noItems)
+			status = STATUS_BUFFER_OVERFLOW;//the caller learns there are more and asks again with a bigger buffer
+		for (USHORT i = 0; i < inputCount; i++)
+		{
+			deviceInfo[i].DeviceHandle = FilterGetData(WdfCollectionGetItem(FilterDeviceCollection, i))->DeviceHandle;
+			deviceInfo[i].DeviceId = i;
+			deviceInfo[i].Reserved = 0;
+		}
+		WdfWaitLockRelease(FilterDeviceCollectionLock);
+		bytesTransferred = inputCount * sizeof(MOUSE_DEVICE_INFO);
+#pragma endregion
+		break;
+	case IOCTL_MOUSE_SET_DEVICE_HANDLE:
+#pragma region IOCTL_MOUSE_SET_DEVICE_HANDLE
+		DebugPrint(("Received IOCTL_MOUSE_SET_DEVICE_HANDLE\n"));
+		if (InputBufferLength < sizeof(ULONG)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), (PVOID*)&deviceHandleBuffer, NULL);
+		if (!NT_SUCCESS(status)) {
+			DebugPrint(("WdfRequestRetrieveInputBuffer failed %x\n", status));
+			break;
+		}
+		//EMU_DEVICE_HANDLE_NONE goes back to following the first mouse
+		if (*deviceHandleBuffer != EMU_DEVICE_HANDLE_NONE) {
+			filterExt = ReferenceFilterDevice(*deviceHandleBuffer);
+			if (filterExt == NULL) {
+				status = STATUS_NO_SUCH_DEVICE;
+				DebugPrint(("Device %x not found.\n", *deviceHandleBuffer));
+				break;
+			}
+		}
+		session->DeviceHandle = *deviceHandleBuffer;
+#pragma endregion
+		break;
+
+	default:
+		status = STATUS_NOT_IMPLEMENTED;
+		break;
+	}
+	if (filterExt != NULL)
+		DereferenceFilterDevice(filterExt);
+	//this will free the user bufferd input
+	WdfRequestCompleteWithInformation(Request, status, bytesTransferred);
+
+	return;
+}
+
+VOID
+On_IOCTL_MOUSE_INSERT_KEY(
+	IN PMOUSE_INPUT_DATA InputDataStart,
+	IN size_t InputCount,
+	IN PFILTER_DEVICE_EXTENSION FilterExtension,
+	IN EMU_STAT Stat) {
+	/*++
+
+Routine Description:
+
+	Forwards our artificial inputs to the mouclass service callback
+
+Arguments:
+
+	InputDataStart - Mouse input structure pointer.
+
+	InputCount - Number of inputs the pointer points to.
+
+	FilterExtension - Filter device extension which holds the hooked service call back of the mouclass.
+
+	Stat - Counter the inputs are added to, EMU_STAT_INJECTED or EMU_STAT_EXPANDED.
+
+Return Value:
+
+		Void.
+
+--*/
+	LONG64 start = KeQueryPerformanceCounter(NULL).QuadPart;
+	KIRQL oldIrql = KeGetCurrentIrql();
+	if (oldIrql < DISPATCH_LEVEL)
+		KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+	NT_ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+	ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+	EmuStatsAdd(FilterExtension->Stats, processor, Stat, (ULONG)InputCount);
+	TracePoint(EMU_TRACE_INJECT, InputCount, Stat);
+	ULONG InputDataConsumed = 0;
+	PMOUSE_INPUT_DATA end = InputDataStart + InputCount;
+	__try {
+		//calling the kbdclass service callback
+		(*(PSERVICE_CALLBACK_ROUTINE)(ULONG_PTR)FilterExtension->UpperConnectData.ClassService)(
+			FilterExtension->UpperConnectData.ClassDeviceObject,
+			InputDataStart,
+			end,
+			&InputDataConsumed);
+	}
+	__finally {
+		EmuHistogramRecord(&FilterExtension->Histograms[processor * EMU_HIST_COUNT + EMU_HIST_INJECT],
+			KeQueryPerformanceCounter(NULL).QuadPart - start);
+		if (oldIrql < DISPATCH_LEVEL)
+			KeLowerIrql(oldIrql);
+	}
+}
+
+VOID
+RecordCallbackStats(
+	IN PFILTER_DEVICE_EXTENSION FilterExtension,
+	IN ULONG Processor,
+	IN ULONG Dropped,
+	IN LONG64 Start)
+/*++
+
+Routine Description:
+
+	Closes the books on a service callback: counts the packets it dropped
+	and how long it held the batch before passing it on or dropping it.
+	Called at DISPATCH_LEVEL on the processor the callback started on.
+
+Arguments:
+
+	FilterExtension - Extension of the filtered device.
+
+	Processor - Number of the current processor.
+
+	Dropped - Packets the callback consumed without passing them on.
+
+	Start - Performance counter when the callback started.
+
+Return Value:
+
+	void.
+
+--*/
+{
+	LONG64 elapsed = KeQueryPerformanceCounter(NULL).QuadPart - Start;
+
+	EmuStatsAdd(FilterExtension->Stats, Processor, EMU_STAT_DROPPED, Dropped);
+	EmuHistogramRecord(&FilterExtension->Histograms[Processor * EMU_HIST_COUNT + EMU_HIST_CALLBACK], elapsed);
+	TracePoint(EMU_TRACE_DONE, Dropped, elapsed);
+}
+
+VOID
+WriteTraceRecord(
+	IN PVOID Context,
+	IN USHORT Event,
+	IN USHORT Arg0,
+	IN ULONG Arg1)
+/*++
+
+Routine Description:
+
+	Appends a record to the trace ring of the current processor, called
+	through TracePoint at DISPATCH_LEVEL, and the EMU_TRACE_WRITER of the
+	pipeline stages.
+
+Arguments:
+
+	Context - Unused, the driver has one set of rings.
+
+	Event - EMU_TRACE_EVENT of the record.
+
+	Arg0 - First argument of the event.
+
+	Arg1 - Second argument of the event.
+
+Return Value:
+
+	void.
+
+--*/
+{
+	PEMU_TRACE_RING rings = (PEMU_TRACE_RING)ReadPointerAcquire((PVOID volatile*)&TraceRings);
+
+	UNREFERENCED_PARAMETER(Context);
+	if (rings == NULL)
+		return;
+	EmuTraceWrite(&rings[KeGetCurrentProcessorNumberEx(NULL)], KeQueryPerformanceCounter(NULL).QuadPart, Event, Arg0, Arg1);
+}
+
+VOID
+MouFilter_ServiceCallback(
+	IN PDEVICE_OBJECT DeviceObject,
+	IN PMOUSE_INPUT_DATA InputDataStart,
+	IN PMOUSE_INPUT_DATA InputDataEnd,
+	IN OUT PULONG InputDataConsumed
+)
+/*++
+
+Routine Description:
+
+	Called when there are mouse packets to report to the RIT.  You can do
+	anything you like to the packets.  For instance:
+
+	o Drop a packet altogether
+	o Mutate the contents of a packet
+	o Insert packets into the stream
+
+Arguments:
+
+	DeviceObject - Context passed during the connect IOCTL
+
+	InputDataStart - First packet to be reported
+
+	InputDataEnd - One past the last packet to be reported.  Total number of
+				   packets is equal to InputDataEnd - InputDataStart
+
+	InputDataConsumed - Set to the total number of packets consumed by the RIT
+						(via the function pointer we replaced in the connect
+						IOCTL)
+
+Return Value:
+
+	void.
+
+--*/
+{
+	PFILTER_DEVICE_EXTENSION	filterExt;
+	PCONTROL_DEVICE_EXTENSION	controlExt;
+	WDFDEVICE					filterDevice;
+	PMOUSE_PIPELINE				pipeline;
+	MOUSE_PIPELINE_CONTEXT		context;
+	LONG						activeProfile;
+	ULONG						inputCount;
+	ULONG						processor;
+	ULONG						consumed;
+	LONG64						start;
+
+	controlExt = ControlGetData(ControlDevice);
+	filterDevice = WdfWdmDeviceGetWdfDeviceHandle(DeviceObject);
+	filterExt = FilterGetData(filterDevice);
+	//
+	// Without waiting detect requests this costs one plain load. The input
+	// that wins the exchange owns the work item until it has run.
+	//
+	if (ReadNoFence(&controlExt->DetectState) == DETECT_ARMED &&
+		InterlockedCompareExchange(&controlExt->DetectState, DETECT_BUSY, DETECT_ARMED) == DETECT_ARMED) {
+		controlExt->DetectedHandle = filterExt->DeviceHandle;
+		IoQueueWorkItem(controlExt->DetectWorkItem, SetCurrentInputDevice, DelayedWorkQueue, NULL);
+	}
+
+	//
+	// UpperConnectData must be called at DISPATCH
+	//
+	if (InputDataStart) {
+
+		start = KeQueryPerformanceCounter(NULL).QuadPart;
+		TracePoint(EMU_TRACE_INPUT, InputDataEnd - InputDataStart, InputDataStart->ButtonFlags | (ULONG)InputDataStart->Flags << 16);
+
+#pragma region Tracking button state
+		//the physical state is tracked before any filtering, conditions look at what the user holds
+		for (LONG64 i = 0; i < InputDataEnd - InputDataStart; i++)
+			EmuTrackButtons(&MouseInputState, InputDataStart[i].ButtonFlags);
+#pragma endregion
+
+		//the callback runs at DISPATCH_LEVEL, the counters of this processor are ours alone
+		processor = KeGetCurrentProcessorNumberEx(NULL);
+		consumed = *InputDataConsumed;
+		EmuStatsAdd(filterExt->Stats, processor, EMU_STAT_SEEN, (ULONG)(InputDataEnd - InputDataStart));
+		EmuHistogramRecord(&filterExt->Histograms[processor * EMU_HIST_COUNT + EMU_HIST_BATCH], InputDataEnd - InputDataStart);
+
+		pipeline = &filterExt->Pipeline;
+		context.Stats = filterExt->Stats;
+		context.Processor = processor;
+		context.Trace = ReadNoFence(&TraceEnabled) ? WriteTraceRecord : NULL;
+		context.TraceContext = NULL;
+		context.CaptureFiltered = (controlExt->CaptureSources & MOUSE_CAPTURE_FILTERED) ? CaptureFilteredInput : NULL;
+		context.CaptureContext = controlExt;
+		context.DeviceHandle = filterExt->DeviceHandle;
+		inputCount = (ULONG)(InputDataEnd - InputDataStart);
+
+		WdfSpinLockAcquire(filterExt->SpinLock);
+
+#pragma region Profile hotkeys
+		if (pipeline->ProfileHotkeyMask != 0)
+			MousePipelineHotkeys(pipeline, InputDataStart, inputCount);
+		//the index is read once so the whole batch sees the same active profile
+		activeProfile = pipeline->ActiveProfile;
+#pragma endregion
+
+#pragma region Filtering and modifying buttons
+		MousePipelineFilter(pipeline, activeProfile, &context, InputDataStart, &inputCount, InputDataConsumed);
+		if (inputCount == 0)
+		{
+			WdfSpinLockRelease(filterExt->SpinLock);
+			RecordCallbackStats(filterExt, processor, *InputDataConsumed - consumed, start);
+			return;	//all inputs were filtered
+		}
+		InputDataEnd = InputDataStart + inputCount;
+#pragma endregion
+
+#pragma region Conditional rules
+		if (pipeline->Profiles[activeProfile].RuleRequest.RuleCount > 0) {
+			PEMU_INPUT_STATE keyboardState = EmuLinkAcquirePeer(&SharedLink);
+			MousePipelineRules(pipeline, activeProfile, &context, keyboardState, &MouseInputState, InputDataStart, inputCount);
+			if (keyboardState)
+				EmuLinkReleasePeer(&SharedLink);
+		}
+#pragma endregion
+
+#pragma region Remapping absolute inputs
+		if (pipeline->AbsoluteTransform.Enabled)
+			MousePipelineRemapAbsolute(pipeline, InputDataStart, inputCount);
+#pragma endregion
+
+#pragma region Autofire
+		if (pipeline->Autofire.TriggerButton != 0) {
+			ULONG64 qpcTimeStamp;
+			LONG64 now = (LONG64)KeQueryInterruptTimePrecise(&qpcTimeStamp);
+			LONG64 dueIn;
+
+			switch (MousePipelineAutofire(pipeline, now, InputDataStart, inputCount)) {
+			case AUTOFIRE_TIMER_START:
+				dueIn = AutofireDueIn(&pipeline->AutofireSchedule, now);
+				WdfTimerStart(filterExt->AutofireTimer, -(dueIn > 0 ? dueIn : 1));
+				break;
+			case AUTOFIRE_TIMER_STOP:
+				WdfTimerStop(filterExt->AutofireTimer, FALSE);
+				break;
+			default:
+				break;
+			}
+		}
+		WdfSpinLockRelease(filterExt->SpinLock);
+#pragma endregion
+
+		if (controlExt->CaptureSources & MOUSE_CAPTURE_PASSED)
+			CaptureInputs(controlExt, filterExt->DeviceHandle, MOUSE_CAPTURE_PASSED, InputDataStart, (ULONG)(InputDataEnd - InputDataStart));
+
+		RecordCallbackStats(filterExt, processor, *InputDataConsumed - consumed, start);
+		//forwarding input to the kbdclass service callback.
+		(*(PSERVICE_CALLBACK_ROUTINE)(ULONG_PTR)filterExt->UpperConnectData.ClassService)(
+			filterExt->UpperConnectData.ClassDeviceObject,
+			InputDataStart,
+			InputDataEnd,
+			InputDataConsumed);
+	}
+}
+
+VOID
+MouFilter_EvtAutofireTimer(
+	IN WDFTIMER Timer
+)
+/*++
+
+Routine Description:
+
+	Emits the autofire presses and releases that are due and rearms itself
+	for the next one while the trigger is held.
+
+Arguments:
+
+	Timer - Handle to the autofire timer of a filter device.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	PFILTER_DEVICE_EXTENSION	filterExt;
+	MOUSE_INPUT_DATA			inputs[2];
+	ULONG						inputCount = 0;
+	AUTOFIRE_ACTION				action;
+	ULONG64						qpcTimeStamp;
+	LONG64						now;
+	LONG64						dueIn;
+
+	filterExt = FilterGetData(WdfTimerGetParentObject(Timer));
+	RtlZeroMemory(inputs, sizeof(inputs));
+	now = (LONG64)KeQueryInterruptTimePrecise(&qpcTimeStamp);
+
+	WdfSpinLockAcquire(filterExt->SpinLock);
+	while (inputCount < ARRAYSIZE(inputs) &&
+		(action = AutofireStep(&filterExt->Pipeline.AutofireSchedule, now)) != AUTOFIRE_ACTION_NONE)
+	{
+		inputs[inputCount].Flags = MOUSE_MOVE_RELATIVE;
+		inputs[inputCount].ButtonFlags = action == AUTOFIRE_ACTION_PRESS ?
+			filterExt->Pipeline.Autofire.OutputButton : (USHORT)(filterExt->Pipeline.Autofire.OutputButton << 1);
+		inputCount++;
+	}
+	//injecting under the lock keeps the releases of the service callback ordered after our presses
+	if (inputCount > 0)
+		On_IOCTL_MOUSE_INSERT_KEY(inputs, inputCount, filterExt, EMU_STAT_EXPANDED);
+	dueIn = AutofireDueIn(&filterExt->Pipeline.AutofireSchedule, now);
+	if (dueIn >= 0)
+		WdfTimerStart(Timer, -(dueIn > 0 ? dueIn : 1));
+	WdfSpinLockRelease(filterExt->SpinLock);
+}
+
+VOID
+CaptureInputs(
+	IN PCONTROL_DEVICE_EXTENSION ControlExtension,
+	IN ULONG DeviceHandle,
+	IN USHORT Source,
+	IN PMOUSE_INPUT_DATA InputDataStart,
+	IN ULONG InputCount)
+/*++
+
+Routine Description:
+
+	Copies packets into the open capture batch, opening a new batch on the next
+	pending capture request when needed. A batch is completed as soon as its
+	buffer is full, the first packet of a batch sets the deadline the capture
+	timer completes it by otherwise.
+	The packets are collected in CaptureRecords while the request of the batch
+	waits in CaptureBatchQueue, so it can be canceled or cleaned up meanwhile.
+	Packets are dropped when user mode has no capture request pending.
+	With ring delivery the packets are written to the capture ring instead.
+
+Arguments:
+
+	ControlExtension - Control device extension which holds the capture state.
+
+	DeviceHandle - Handle of the mouse that reported the packets.
+
+	Source - The MOUSE_CAPTURE_SOURCE bit the packets are captured from.
+
+	InputDataStart - Packets to capture.
+
+	InputCount - Number of packets.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	PMOUSE_CAPTURE_RECORD			record;
+	WDFREQUEST					request;
+	PVOID						buffer;
+	size_t						bufferSize;
+	NTSTATUS					status;
+	ULONG64						qpcTimeStamp;
+	LONG64						now;
+	ULONG						i = 0;
+
+	now = (LONG64)KeQueryInterruptTimePrecise(&qpcTimeStamp);
+
+	if (ControlExtension->CaptureDelivery == MOUSE_CAPTURE_DELIVERY_RING) {
+		MOUSE_CAPTURE_RECORD ringRecord;
+		ULONG waiters;
+
+		RtlZeroMemory(&ringRecord, sizeof(ringRecord));
+		ringRecord.Timestamp = (LONG64)qpcTimeStamp;
+		ringRecord.DeviceHandle = DeviceHandle;
+		ringRecord.Source = Source;
+		WdfSpinLockAcquire(ControlExtension->CaptureLock);
+		if (ControlExtension->CaptureRingMdl != NULL) {
+			for (; i < InputCount; i++)
+			{
+				ringRecord.Input = InputDataStart[i];
+				EmuRingWrite(&ControlExtension->CaptureRing, &ringRecord);
+			}
+			//only readers that ran dry are woken up, the others are polling
+			waiters = EmuRingTakeWaiters(&ControlExtension->CaptureRing);
+			for (ULONG r = 0; waiters != 0; r++, waiters >>= 1)
+			{
+				if ((waiters & 1) && ControlExtension->RingReaders[r].Event != NULL)
+					KeSetEvent(ControlExtension->RingReaders[r].Event, IO_NO_INCREMENT, FALSE);
+			}
+		}
+		WdfSpinLockRelease(ControlExtension->CaptureLock);
+		return;
+	}
+
+	WdfSpinLockAcquire(ControlExtension->CaptureLock);
+	while (i < InputCount)
+	{
+		if (ControlExtension->CaptureRequest == NULL) {
+			status = WdfIoQueueRetrieveNextRequest(ControlExtension->CaptureQueue, &request);
+			if (!NT_SUCCESS(status))
+				break;	//nobody is listening, the packets are lost
+			status = WdfRequestRetrieveOutputBuffer(request, sizeof(MOUSE_CAPTURE_RECORD), &buffer, &bufferSize);
+			if (!NT_SUCCESS(status)) {
+				DebugPrint(("WdfRequestRetrieveOutputBuffer failed %x\n", status));
+				WdfRequestComplete(request, status);
+				continue;
+			}
+			status = WdfRequestForwardToIoQueue(request, ControlExtension->CaptureBatchQueue);
+			if (!NT_SUCCESS(status)) {
+				DebugPrint(("WdfRequestForwardToIoQueue failed %x\n", status));
+				WdfRequestComplete(request, status);
+				continue;
+			}
+			ControlExtension->CaptureRequest = request;
+			ControlExtension->CaptureFile = WdfRequestGetFileObject(request);
+			ControlExtension->CaptureCapacity = (ULONG)(bufferSize / sizeof(MOUSE_CAPTURE_RECORD) < MOUSE_CAPTURE_BATCH_MAX ? bufferSize / sizeof(MOUSE_CAPTURE_RECORD) : MOUSE_CAPTURE_BATCH_MAX);
+			ControlExtension->CaptureCount = 0;
+			ControlExtension->CaptureDeadline = now + ControlExtension->CaptureLatency;
+			if (ControlExtension->CaptureLatency > 0)
+				WdfTimerStart(ControlExtension->CaptureTimer, -ControlExtension->CaptureLatency);
+		}
+		record = &ControlExtension->CaptureRecords[ControlExtension->CaptureCount++];
+		record->Timestamp = (LONG64)qpcTimeStamp;
+		record->DeviceHandle = DeviceHandle;
+		record->Source = Source;
+		record->Input = InputDataStart[i++];
+		if (ControlExtension->CaptureCount == ControlExtension->CaptureCapacity)
+			CompleteCaptureBatch(ControlExtension);
+	}
+	//without a latency every input report is delivered right away
+	if (ControlExtension->CaptureLatency == 0 && ControlExtension->CaptureRequest != NULL)
+		CompleteCaptureBatch(ControlExtension);
+	WdfSpinLockRelease(ControlExtension->CaptureLock);
+}
+
+VOID
+CaptureFilteredInput(
+	IN PVOID Context,
+	IN ULONG DeviceHandle,
+	IN PMOUSE_INPUT_DATA Input)
+/*++
+
+Routine Description:
+
+	Captures an input the profile filters, the MOUSE_PIPELINE_CAPTURE the
+	service callback hands to MousePipelineFilter while MOUSE_CAPTURE_FILTERED
+	is captured.
+
+Arguments:
+
+	Context - Control device extension which holds the capture state.
+
+	DeviceHandle - Handle of the mouse that reported the input.
+
+	Input - The filtered input.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	CaptureInputs((PCONTROL_DEVICE_EXTENSION)Context, DeviceHandle, MOUSE_CAPTURE_FILTERED, Input, 1);
+}
+
+VOID
+CompleteCaptureBatch(
+	IN PCONTROL_DEVICE_EXTENSION ControlExtension)
+/*++
+
+Routine Description:
+
+	Completes the capture request of the open batch with the records filled so far,
+	once it is taken back from CaptureBatchQueue. A request canceled meanwhile was
+	completed by the framework, the records of its batch are dropped.
+	Must be called with the CaptureLock held and a batch open.
+
+Arguments:
+
+	ControlExtension - Control device extension which holds the capture state.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	WDFREQUEST	request;
+	PVOID		buffer;
+	size_t		bytesTransferred = ControlExtension->CaptureCount * sizeof(MOUSE_CAPTURE_RECORD);
+	NTSTATUS	status;
+
+	ControlExtension->CaptureRequest = NULL;
+	ControlExtension->CaptureFile = NULL;
+	ControlExtension->CaptureCapacity = 0;
+	ControlExtension->CaptureCount = 0;
+	//the queue holds the request of the open batch only
+	status = WdfIoQueueRetrieveNextRequest(ControlExtension->CaptureBatchQueue, &request);
+	if (!NT_SUCCESS(status))
+		return;
+	status = WdfRequestRetrieveOutputBuffer(request, bytesTransferred, &buffer, NULL);
+	if (NT_SUCCESS(status))
+		RtlCopyMemory(buffer, ControlExtension->CaptureRecords, bytesTransferred);
+	else
+		bytesTransferred = 0;
+	WdfRequestCompleteWithInformation(request, status, bytesTransferred);
+}
+
+VOID
+MouFilter_EvtCaptureTimer(
+	IN WDFTIMER Timer
+)
+/*++
+
+Routine Description:
+
+	Completes the open capture batch once its latency deadline has passed.
+	The timer may still fire for a batch that already filled up, in which case
+	it is rearmed for the deadline of the batch opened since.
+
+Arguments:
+
+	Timer - Handle to the capture timer of the control device.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	PCONTROL_DEVICE_EXTENSION	controlExt;
+	ULONG64						qpcTimeStamp;
+	LONG64						now;
+
+	controlExt = ControlGetData(WdfTimerGetParentObject(Timer));
+	now = (LONG64)KeQueryInterruptTimePrecise(&qpcTimeStamp);
+
+	WdfSpinLockAcquire(controlExt->CaptureLock);
+	if (controlExt->CaptureRequest != NULL) {
+		if (now >= controlExt->CaptureDeadline)
+			CompleteCaptureBatch(controlExt);
+		else
+			WdfTimerStart(Timer, -(controlExt->CaptureDeadline - now));
+	}
+	WdfSpinLockRelease(controlExt->CaptureLock);
+}
+
+PVOID
+MapCapturePages(
+	IN PMDL Mdl,
+	IN ULONG Protection)
+/*++
+
+Routine Description:
+
+	Maps pages of the capture ring into the current process.
+
+Arguments:
+
+	Mdl - Pages to map.
+
+	Protection - MdlMappingNoWrite and MdlMappingNoExecute flags of the mapping.
+
+Return Value:
+
+	Address of the mapping, NULL if it failed.
+
+--*/
+{
+	PVOID	userAddress;
+
+	PAGED_CODE();
+
+	__try {
+		userAddress = MmMapLockedPagesSpecifyCache(Mdl, UserMode, MmCached, NULL, FALSE, NormalPagePriority | Protection);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER) {
+		userAddress = NULL;
+	}
+	return userAddress;
+}
+
+NTSTATUS
+MapCaptureRing(
+	IN PCONTROL_DEVICE_EXTENSION ControlExtension,
+	IN WDFREQUEST Request,
+	IN HANDLE Event,
+	OUT PMOUSE_CAPTURE_RING_MAPPING Mapping)
+/*++
+
+Routine Description:
+
+	Maps the capture ring into the process that sent the request, allocating
+	the ring on first use. Each file object maps the ring once and gets its
+	own reader index and wake up event. The ring is mapped read-only, only the
+	separate page of its WaitMask is writable, so a reader cannot corrupt the
+	records of the other readers. The mappings are removed when the file
+	object is cleaned up or the ring is unmapped explicitly.
+
+Arguments:
+
+	ControlExtension - Control device extension which holds the capture state.
+
+	Request - The IOCTL_MOUSE_MAP_CAPTURE_RING request.
+
+	Event - Handle of the reader's event in the requesting process.
+
+	Mapping - Receives the address of the ring in the process and the reader index.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+{
+	WDFFILEOBJECT				fileObject;
+	PEPROCESS					process;
+	KAPC_STATE					apcState;
+	BOOLEAN						attached = FALSE;
+	PKEVENT						event = NULL;
+	PVOID						userAddress = NULL;
+	PVOID						userWaitAddress = NULL;
+	PVOID						ringAddress;
+	PVOID						waitAddress;
+	PMDL						mdl;
+	PMDL						waitMdl;
+	PHYSICAL_ADDRESS			lowAddress;
+	PHYSICAL_ADDRESS			highAddress;
+	PHYSICAL_ADDRESS			skipBytes;
+	PCAPTURE_RING_READER		reader;
+	ULONG						ringSize;
+	ULONG						readerIndex = EMU_RING_MAX_READERS;
+	NTSTATUS					status = STATUS_SUCCESS;
+
+	PAGED_CODE();
+
+	fileObject = WdfRequestGetFileObject(Request);
+	process = IoGetRequestorProcess(WdfRequestWdmGetIrp(Request));
+	if (fileObject == NULL || process == NULL)
+		return STATUS_INVALID_DEVICE_REQUEST;
+	ringSize = EmuRingSize(sizeof(MOUSE_CAPTURE_RECORD), MOUSE_CAPTURE_RING_CAPACITY);
+
+	WdfWaitLockAcquire(ControlExtension->RingLock, NULL);
+	for (ULONG r = 0; r < EMU_RING_MAX_READERS; r++)
+	{
+		if (ControlExtension->RingReaders[r].FileObject == fileObject) {
+			status = STATUS_ALREADY_REGISTERED;
+			break;
+		}
+		if (ControlExtension->RingReaders[r].FileObject == NULL && readerIndex == EMU_RING_MAX_READERS)
+			readerIndex = r;
+	}
+	if (NT_SUCCESS(status) && readerIndex == EMU_RING_MAX_READERS)
+		status = STATUS_TOO_MANY_SESSIONS;
+
+	//
+	// The ring and its wait page are allocated once and live until the control
+	// device is destroyed, the pages come zeroed which is the empty ring.
+	//
+	if (NT_SUCCESS(status) && ControlExtension->CaptureRingMdl == NULL) {
+		lowAddress.QuadPart = 0;
+		highAddress.QuadPart = (LONGLONG)-1;
+		skipBytes.QuadPart = 0;
+		mdl = MmAllocatePagesForMdlEx(lowAddress, highAddress, skipBytes, ringSize, MmCached, MM_ALLOCATE_FULLY_REQUIRED);
+		ringAddress = mdl != NULL ? MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute) : NULL;
+		waitMdl = ringAddress != NULL ? MmAllocatePagesForMdlEx(lowAddress, highAddress, skipBytes, PAGE_SIZE, MmCached, MM_ALLOCATE_FULLY_REQUIRED) : NULL;
+		waitAddress = waitMdl != NULL ? MmGetSystemAddressForMdlSafe(waitMdl, NormalPagePriority | MdlMappingNoExecute) : NULL;
+		if (waitAddress == NULL) {
+			if (waitMdl != NULL) {
+				MmFreePagesFromMdl(waitMdl);
+				ExFreePool(waitMdl);
+			}
+			if (ringAddress != NULL)
+				MmUnmapLockedPages(ringAddress, mdl);
+			if (mdl != NULL) {
+				MmFreePagesFromMdl(mdl);
+				ExFreePool(mdl);
+			}
+			status = STATUS_INSUFFICIENT_RESOURCES;
+		}
+		else {
+			WdfSpinLockAcquire(ControlExtension->CaptureLock);
+			EmuRingInitialize(&ControlExtension->CaptureRing, ringAddress, (volatile LONG*)waitAddress, sizeof(MOUSE_CAPTURE_RECORD), MOUSE_CAPTURE_RING_CAPACITY);
+			ControlExtension->CaptureRingMdl = mdl;
+			ControlExtension->CaptureWaitMdl = waitMdl;
+			WdfSpinLockRelease(ControlExtension->CaptureLock);
+		}
+	}
+
+	if (NT_SUCCESS(status)) {
+		//
+		// The sequential queue may dispatch the request in another thread,
+		// the event handle and the mapping belong to the requesting process.
+		//
+		if (process != PsGetCurrentProcess()) {
+			KeStackAttachProcess(process, &apcState);
+			attached = TRUE;
+		}
+		status = ObReferenceObjectByHandle(Event, EVENT_MODIFY_STATE, *ExEventObjectType, UserMode, (PVOID*)&event, NULL);
+		if (NT_SUCCESS(status)) {
+			userAddress = MapCapturePages(ControlExtension->CaptureRingMdl, MdlMappingNoWrite | MdlMappingNoExecute);
+			userWaitAddress = userAddress != NULL ? MapCapturePages(ControlExtension->CaptureWaitMdl, MdlMappingNoExecute) : NULL;
+			if (userWaitAddress == NULL) {
+				if (userAddress != NULL)
+					MmUnmapLockedPages(userAddress, ControlExtension->CaptureRingMdl);
+				ObDereferenceObject(event);
+				status = STATUS_INSUFFICIENT_RESOURCES;
+			}
+		}
+		if (attached)
+			KeUnstackDetachProcess(&apcState);
+	}
+
+	if (NT_SUCCESS(status)) {
+		ObReferenceObject(process);
+		reader = &ControlExtension->RingReaders[readerIndex];
+		WdfSpinLockAcquire(ControlExtension->CaptureLock);
+		reader->FileObject = fileObject;
+		reader->Process = process;
+		reader->UserAddress = userAddress;
+		reader->UserWaitAddress = userWaitAddress;
+		reader->Event = event;
+		WdfSpinLockRelease(ControlExtension->CaptureLock);
+
+		Mapping->Address = (ULONG64)(ULONG_PTR)userAddress;
+		Mapping->Size = ringSize;
+		Mapping->ReaderIndex = readerIndex;
+		Mapping->WaitAddress = (ULONG64)(ULONG_PTR)userWaitAddress;
+	}
+	WdfWaitLockRelease(ControlExtension->RingLock);
+	return status;
+}
+
+VOID
+UnmapCaptureRing(
+	IN PCONTROL_DEVICE_EXTENSION ControlExtension,
+	IN WDFFILEOBJECT FileObject)
+/*++
+
+Routine Description:
+
+	Removes the mapping of the capture ring made for the file object, if any,
+	and frees its reader index.
+
+Arguments:
+
+	ControlExtension - Control device extension which holds the capture state.
+
+	FileObject - File object the ring was mapped for.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	CAPTURE_RING_READER			reader;
+	KAPC_STATE					apcState;
+
+	PAGED_CODE();
+
+	WdfWaitLockAcquire(ControlExtension->RingLock, NULL);
+	for (ULONG r = 0; r < EMU_RING_MAX_READERS; r++)
+	{
+		if (ControlExtension->RingReaders[r].FileObject != FileObject)
+			continue;
+
+		//the writer stops signalling the event before it goes away
+		WdfSpinLockAcquire(ControlExtension->CaptureLock);
+		reader = ControlExtension->RingReaders[r];
+		RtlZeroMemory(&ControlExtension->RingReaders[r], sizeof(CAPTURE_RING_READER));
+		WdfSpinLockRelease(ControlExtension->CaptureLock);
+
+		//the last handle may be closed by another process than the one the ring is mapped into
+		if (reader.Process != PsGetCurrentProcess()) {
+			KeStackAttachProcess(reader.Process, &apcState);
+			MmUnmapLockedPages(reader.UserAddress, ControlExtension->CaptureRingMdl);
+			MmUnmapLockedPages(reader.UserWaitAddress, ControlExtension->CaptureWaitMdl);
+			KeUnstackDetachProcess(&apcState);
+		}
+		else {
+			MmUnmapLockedPages(reader.UserAddress, ControlExtension->CaptureRingMdl);
+			MmUnmapLockedPages(reader.UserWaitAddress, ControlExtension->CaptureWaitMdl);
+		}
+		ObDereferenceObject(reader.Event);
+		ObDereferenceObject(reader.Process);
+		break;
+	}
+	WdfWaitLockRelease(ControlExtension->RingLock);
+}
+
+VOID
+MouFilter_EvtFileCleanup(
+	IN WDFFILEOBJECT FileObject
+)
+/*++
+
+Routine Description:
+
+	Called when the last handle of a file object of the control device is
+	closed. The capture ring must not stay mapped into the process, and the
+	open capture batch is dropped if its request was sent on the file object,
+	the framework has purged the request already.
+
+Arguments:
+
+	FileObject - Handle to the framework file object.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	PCONTROL_DEVICE_EXTENSION	controlExt;
+
+	PAGED_CODE();
+
+	controlExt = ControlGetData(WdfFileObjectGetDevice(FileObject));
+	WdfSpinLockAcquire(controlExt->CaptureLock);
+	if (controlExt->CaptureRequest != NULL && controlExt->CaptureFile == FileObject) {
+		controlExt->CaptureRequest = NULL;
+		controlExt->CaptureFile = NULL;
+		controlExt->CaptureCapacity = 0;
+		controlExt->CaptureCount = 0;
+	}
+	WdfSpinLockRelease(controlExt->CaptureLock);
+	UnmapCaptureRing(controlExt, FileObject);
+}
+
+VOID
+MouFilter_EvtControlDeviceDestroy(
+	IN WDFOBJECT Object
+)
+/*++
+
+Routine Description:
+
+	Frees the capture ring and the detect work item. The control device is
+	destroyed after all of its file objects, so no process has the ring
+	mapped anymore.
+
+Arguments:
+
+	Object - Handle to the control device.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	PCONTROL_DEVICE_EXTENSION	controlExt;
+
+	controlExt = ControlGetData(Object);
+	if (controlExt->DetectWorkItem != NULL) {
+		IoFreeWorkItem(controlExt->DetectWorkItem);
+		controlExt->DetectWorkItem = NULL;
+	}
+	if (controlExt->CaptureRecords != NULL) {
+		ExFreePoolWithTag(controlExt->CaptureRecords, MOUSE_POOL_TAG);
+		controlExt->CaptureRecords = NULL;
+	}
+	if (controlExt->CaptureRingMdl != NULL) {
+		MmUnmapLockedPages(controlExt->CaptureRing.Header, controlExt->CaptureRingMdl);
+		MmFreePagesFromMdl(controlExt->CaptureRingMdl);
+		ExFreePool(controlExt->CaptureRingMdl);
+		controlExt->CaptureRingMdl = NULL;
+		MmUnmapLockedPages((PVOID)controlExt->CaptureRing.WaitMask, controlExt->CaptureWaitMdl);
+		MmFreePagesFromMdl(controlExt->CaptureWaitMdl);
+		ExFreePool(controlExt->CaptureWaitMdl);
+		controlExt->CaptureWaitMdl = NULL;
+	}
+}
+
+VOID
+QueryDeviceIdentity(
+	IN WDFDEVICE Device,
+	OUT PULONG Handle,
+	OUT PULONG Identity
+)
+/*++
+
+Routine Description:
+
+	Hashes the instance ID of a mouse into the handle it asks for in
+	DeviceTable and the identity that tells it apart from other devices
+	asking for the same handle. The driver key name, which is as stable,
+	stands in when the instance ID cannot be read.
+
+Arguments:
+
+	Device - Handle to the framework filter device.
+
+	Handle - Receives the preferred handle.
+
+	Identity - Receives the identity hash.
+
+Return Value:
+
+	None, a device without readable IDs gets hashes that only last
+	until it goes away.
+
+--*/
+{
+	NTSTATUS					status;
+	WDF_DEVICE_PROPERTY_DATA	propertyData;
+	DEVPROPTYPE					propertyType;
+	WDFMEMORY					memory;
+	PWCHAR						id;
+	size_t						length;
+
+	PAGED_CODE();
+
+	WDF_DEVICE_PROPERTY_DATA_INIT(&propertyData, &DEVPKEY_Device_InstanceId);
+	status = WdfDeviceAllocAndQueryPropertyEx(Device, &propertyData, PagedPool, WDF_NO_OBJECT_ATTRIBUTES, &memory, &propertyType);
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("Querying the instance ID failed %x\n", status));
+		status = WdfDeviceAllocAndQueryProperty(Device, DevicePropertyDriverKeyName, PagedPool, WDF_NO_OBJECT_ATTRIBUTES, &memory);
+	}
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("Querying the driver key name failed %x\n", status));
+		*Handle = EmuHashDeviceId((const UCHAR*)&Device, sizeof(Device), EMU_DEVICE_HANDLE_SEED);
+		*Identity = EmuHashDeviceId((const UCHAR*)&Device, sizeof(Device), EMU_DEVICE_IDENTITY_SEED);
+		return;
+	}
+
+	id = (PWCHAR)WdfMemoryGetBuffer(memory, &length);
+	length /= sizeof(WCHAR);
+	//the terminator is not part of the ID
+	while (length > 0 && id[length - 1] == L'\0')
+		length--;
+	//instance IDs are case insensitive
+	for (size_t i = 0; i < length; i++)
+		id[i] = RtlUpcaseUnicodeChar(id[i]);
+
+	*Handle = EmuHashDeviceId((const UCHAR*)id, (ULONG)(length * sizeof(WCHAR)), EMU_DEVICE_HANDLE_SEED);
+	*Identity = EmuHashDeviceId((const UCHAR*)id, (ULONG)(length * sizeof(WCHAR)), EMU_DEVICE_IDENTITY_SEED);
+	WdfObjectDelete(memory);
+}
+
+PFILTER_DEVICE_EXTENSION
+ReferenceFilterDevice(
+	IN ULONG DeviceHandle
+)
+/*++
+
+Routine Description:
+
+	Finds a mouse by its handle and keeps it from going away until
+	DereferenceFilterDevice. Only DeviceTableLock is taken, unless the
+	handle is EMU_DEVICE_HANDLE_NONE and stands for the first mouse.
+
+Arguments:
+
+	DeviceHandle - Handle of the mouse.
+
+Return Value:
+
+	The extension of the mouse,
+	NULL if no mouse has the handle or it is being removed.
+
+--*/
+{
+	PEMU_DEVICE_ENTRY			entry;
+	PFILTER_DEVICE_EXTENSION	filterExt = NULL;
+
+	PAGED_CODE();
+
+	if (DeviceHandle == EMU_DEVICE_HANDLE_NONE) {
+		WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
+		if (WdfCollectionGetCount(FilterDeviceCollection) > 0)
+			DeviceHandle = FilterGetData(WdfCollectionGetItem(FilterDeviceCollection, 0))->DeviceHandle;
+		WdfWaitLockRelease(FilterDeviceCollectionLock);
+	}
+
+	WdfSpinLockAcquire(DeviceTableLock);
+	entry = EmuDeviceTableFind(&DeviceTable, DeviceHandle);
+	if (entry != NULL && entry->Device != NULL) {
+		filterExt = (PFILTER_DEVICE_EXTENSION)entry->Device;
+		if (!ExAcquireRundownProtection(&filterExt->Rundown))
+			filterExt = NULL;
+	}
+	WdfSpinLockRelease(DeviceTableLock);
+	return filterExt;
+}
+
+VOID
+DereferenceFilterDevice(
+	IN PFILTER_DEVICE_EXTENSION FilterExtension
+)
+/*++
+
+Routine Description:
+
+	Releases a mouse found with ReferenceFilterDevice.
+
+--*/
+{
+	ExReleaseRundownProtection(&FilterExtension->Rundown);
+}
+
+USHORT
+GetDeviceIndex(
+	IN PFILTER_DEVICE_EXTENSION FilterExtension
+)
+/*++
+
+Routine Description:
+
+	Finds the index of a mouse in FilterDeviceCollection, the id the
+	index based IOCTLs of older clients work with. Indices shift as devices
+	leave, so they are looked up when asked for and never stored.
+	Must be called with FilterDeviceCollectionLock held.
+
+Arguments:
+
+	FilterExtension - Extension of the mouse.
+
+Return Value:
+
+	The index, the number of devices if the mouse already left the collection.
+
+--*/
+{
+	ULONG count;
+	ULONG i;
+
+	PAGED_CODE();
+
+	count = WdfCollectionGetCount(FilterDeviceCollection);
+	for (i = 0; i < count; i++)
+	{
+		if (FilterGetData(WdfCollectionGetItem(FilterDeviceCollection, i)) == FilterExtension)
+			break;
+	}
+	return (USHORT)i;
+}
+
+VOID
+ParkDeviceConfiguration(
+	IN PFILTER_DEVICE_EXTENSION FilterExtension
+)
+/*++
+
+Routine Description:
+
+	Keeps the profiles of a departing mouse in its entry of DeviceTable,
+	so the mouse gets them back when it returns. The entry is freed
+	instead when the table is too full to park or the image can't be made.
+
+Arguments:
+
+	FilterExtension - Extension of the departing mouse, no control
+	request holds it any more.
+
+--*/
+{
+	PUCHAR				image;
+	ULONG				imageSize;
+	PVOID				oldImage = NULL;
+	PEMU_DEVICE_ENTRY	entry;
+
+	PAGED_CODE();
+
+	if (FilterExtension->DeviceHandle == EMU_DEVICE_HANDLE_NONE)
+		return;
+
+	WdfSpinLockAcquire(FilterExtension->SpinLock);
+	imageSize = SerializeProfiles(FilterExtension, NULL, 0);
+	image = (PUCHAR)ExAllocatePoolWithTag(NonPagedPool, imageSize, MOUSE_POOL_TAG);
+	if (image != NULL)
+		imageSize = SerializeProfiles(FilterExtension, image, imageSize);
+	WdfSpinLockRelease(FilterExtension->SpinLock);
+	if (image != NULL && (imageSize == 0 || imageSize > EMU_IMAGE_MAX_SIZE)) {
+		ExFreePoolWithTag(image, MOUSE_POOL_TAG);
+		image = NULL;
+	}
+
+	WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
+	WdfSpinLockAcquire(DeviceTableLock);
+	entry = EmuDeviceTableFind(&DeviceTable, FilterExtension->DeviceHandle);
+	//a mouse that already came back keeps its entry as it is
+	if (entry != NULL && entry->Device == NULL) {
+		oldImage = entry->Parked;
+		if (image != NULL && DeviceTable.Count <= EMU_DEVICE_TABLE_SIZE / 2) {
+			entry->Parked = image;
+			image = NULL;
+		}
+		else {
+			EmuDeviceTableRemove(&DeviceTable, entry);
+		}
+	}
+	WdfSpinLockRelease(DeviceTableLock);
+	WdfWaitLockRelease(FilterDeviceCollectionLock);
+	if (oldImage)
+		ExFreePoolWithTag(oldImage, MOUSE_POOL_TAG);
+	if (image)
+		ExFreePoolWithTag(image, MOUSE_POOL_TAG);
+}
+
+PEMU_RULE
+AllocateSharedRules(
+	IN USHORT RuleCount
+)
+/*++
+
+Routine Description:
+
+	Allocates a shared rule table with room for RuleCount rules and their
+	index, and one reference owned by the caller. While CountRuleHits is
+	set the table gets a counter per rule and processor behind its rules.
+
+Return Value:
+
+	The rules of the table for the caller to fill,
+	NULL if the table could not be allocated.
+
+--*/
+{
+	PVOID		block;
+	PEMU_RULE	rules;
+	ULONG		rulesSize;
+	ULONG		hitsSize = 0;
+
+	rulesSize = (EmuSharedRulesSize(RuleCount) + sizeof(PVOID) - 1) & ~(ULONG)(sizeof(PVOID) - 1);
+	if (ReadNoFence(&CountRuleHits) && RuleCount > 0)
+		hitsSize = EmuStatsSize(StatsProcessorCount, RuleCount);
+	block = ExAllocatePoolWithTag(NonPagedPool, rulesSize + hitsSize, MOUSE_POOL_TAG);
+	if (block == NULL)
+		return NULL;
+	rules = EmuSharedRulesInitialize(block, RuleCount);
+	if (hitsSize != 0)
+		((PEMU_SHARED_RULES)block)->Hits = EmuStatsInitialize((PUCHAR)block + rulesSize, StatsProcessorCount, RuleCount);
+	return rules;
+}
+
+VOID
+ReleaseSharedRules(
+	IN PEMU_RULE Rules
+)
+/*++
+
+Routine Description:
+
+	Drops a reference to a shared rule table and frees the table with the
+	last one. Rules may be NULL.
+
+--*/
+{
+	if (Rules != NULL && EmuSharedRulesRelease(Rules))
+		ExFreePoolWithTag(EmuSharedRulesBlock(Rules), MOUSE_POOL_TAG);
+}
+
+NTSTATUS
+BroadcastRules(
+	IN WDFREQUEST Request,
+	IN size_t InputBufferLength
+)
+/*++
+
+Routine Description:
+
+	Handles IOCTL_MOUSE_BROADCAST_RULES. The rules are copied and validated
+	once and the same table is installed in the edited profile of every
+	target mouse, each of which takes a reference to it. Either all the
+	listed mouses get the rules or none does.
+
+Arguments:
+
+	Request - Handle to the framework request object.
+
+	InputBufferLength - Length of the MOUSE_RULE_BROADCAST input.
+
+Return Value:
+
+	STATUS_SUCCESS if successful,
+	STATUS_NO_SUCH_DEVICE if a listed mouse is not present,
+	or another error status.
+
+--*/
+{
+	NTSTATUS					status;
+	PMOUSE_RULE_BROADCAST		broadcast;
+	ULONG						deviceCount;
+	size_t						offset;
+	USHORT						ruleCount;
+	PEMU_RULE					newRules = NULL;
+	PEMU_RULE					oldRules;
+	PFILTER_DEVICE_EXTENSION*	targets;
+	ULONG						targetCount = 0;
+	PFILTER_DEVICE_EXTENSION	filterExt;
+	PMOUSE_PROFILE				profile;
+
+	PAGED_CODE();
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG) + sizeof(USHORT), (PVOID*)&broadcast, NULL);
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("WdfRequestRetrieveInputBuffer failed %x\n", status));
+		return status;
+	}
+
+	deviceCount = broadcast->DeviceCount;
+	offset = FIELD_OFFSET(MOUSE_RULE_BROADCAST, DeviceHandles);
+	if (deviceCount != MOUSE_ALL_DEVICES) {
+		if (deviceCount == 0 || deviceCount > EMU_DEVICE_TABLE_SIZE)
+			return STATUS_INVALID_PARAMETER;
+		offset += deviceCount * sizeof(ULONG);
+	}
+	if (InputBufferLength < offset + sizeof(USHORT))
+		return STATUS_BUFFER_TOO_SMALL;
+	RtlCopyMemory(&ruleCount, (PUCHAR)broadcast + offset, sizeof(USHORT));
+	offset += sizeof(USHORT);
+	if (InputBufferLength < offset + ruleCount * sizeof(EMU_RULE))
+		return STATUS_BUFFER_TOO_SMALL;
+
+	if (ruleCount > 0) {
+		newRules = AllocateSharedRules(ruleCount);
+		if (newRules == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES;
+		RtlCopyMemory(newRules, (PUCHAR)broadcast + offset, ruleCount * sizeof(EMU_RULE));
+		if (!EmuValidateRules(newRules, ruleCount, EmuSharedRulesIndex(newRules))) {
+			ReleaseSharedRules(newRules);
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
 
---*/
-	DebugPrint(("Entered On_IOCTL_MOUSE_INSERT_KEY\n"));
-	KIRQL oldIrql = KeGetCurrentIrql();
-	if (oldIrql < DISPATCH_LEVEL)
-		KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
-	NT_ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
-	ULONG InputDataConsumed = 0;
-	PMOUSE_INPUT_DATA end = InputDataStart + InputCount;
-	__try {
-		//calling the kbdclass service callback
-		(*(PSERVICE_CALLBACK_ROUTINE)(ULONG_PTR)FilterExtension->UpperConnectData.ClassService)(
-			FilterExtension->UpperConnectData.ClassDeviceObject,
-			InputDataStart,
-			end,
-			&InputDataConsumed);
+	targets = (PFILTER_DEVICE_EXTENSION*)ExAllocatePoolWithTag(PagedPool, EMU_DEVICE_TABLE_SIZE * sizeof(PFILTER_DEVICE_EXTENSION), MOUSE_POOL_TAG);
+	if (targets == NULL) {
+		ReleaseSharedRules(newRules);
+		return STATUS_INSUFFICIENT_RESOURCES;
 	}
-	__finally {
-		if (oldIrql < DISPATCH_LEVEL)
-			KeLowerIrql(oldIrql);
+
+	//every target is held before the first one changes
+	if (deviceCount == MOUSE_ALL_DEVICES) {
+		WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
+		deviceCount = WdfCollectionGetCount(FilterDeviceCollection);
+		for (ULONG i = 0; i < deviceCount && targetCount < EMU_DEVICE_TABLE_SIZE; i++)
+		{
+			filterExt = FilterGetData(WdfCollectionGetItem(FilterDeviceCollection, i));
+			if (ExAcquireRundownProtection(&filterExt->Rundown))
+				targets[targetCount++] = filterExt;
+		}
+		WdfWaitLockRelease(FilterDeviceCollectionLock);
+	}
+	else {
+		for (ULONG i = 0; i < deviceCount; i++)
+		{
+			filterExt = ReferenceFilterDevice(broadcast->DeviceHandles[i]);
+			if (filterExt == NULL) {
+				status = STATUS_NO_SUCH_DEVICE;
+				DebugPrint(("Device %x not found.\n", broadcast->DeviceHandles[i]));
+				break;
+			}
+			targets[targetCount++] = filterExt;
+		}
+	}
+
+	if (NT_SUCCESS(status)) {
+		for (ULONG i = 0; i < targetCount; i++)
+		{
+			filterExt = targets[i];
+			profile = &filterExt->Pipeline.Profiles[filterExt->EditProfile];
+			if (newRules)
+				EmuSharedRulesReference(newRules);
+			WdfSpinLockAcquire(filterExt->SpinLock);
+			BumpRuleGeneration(filterExt);
+			oldRules = profile->RuleRequest.Rules;
+			profile->RuleRequest.Rules = newRules;
+			profile->RuleRequest.RuleCount = ruleCount;
+			WdfSpinLockRelease(filterExt->SpinLock);
+			ReleaseSharedRules(oldRules);
+		}
 	}
+
+	for (ULONG i = 0; i < targetCount; i++)
+		DereferenceFilterDevice(targets[i]);
+	ExFreePoolWithTag(targets, MOUSE_POOL_TAG);
+	//the profiles hold their own references now
+	ReleaseSharedRules(newRules);
+	return status;
 }
 
-VOID
-MouFilter_ServiceCallback(
-	IN PDEVICE_OBJECT DeviceObject,
-	IN PMOUSE_INPUT_DATA InputDataStart,
-	IN PMOUSE_INPUT_DATA InputDataEnd,
-	IN OUT PULONG InputDataConsumed
+ULONG
+BumpRuleGeneration(
+	IN PFILTER_DEVICE_EXTENSION FilterExtension
 )
 /*++
 
 Routine Description:
 
-	Called when there are mouse packets to report to the RIT.  You can do
-	anything you like to the packets.  For instance:
+	Moves the rule generation of a mouse on after its filters, modifies,
+	rules or edit profile changed. Clients that cached the tables notice the
+	change when the generation they saw is gone. 0 is skipped so it can mean
+	"not read yet" to them.
 
-	o Drop a packet altogether
-	o Mutate the contents of a packet
-	o Insert packets into the stream
+Arguments:
+
+	FilterExtension - Extension of the mouse whose tables changed.
+
+Return Value:
+
+	The new generation.
+
+--*/
+{
+	LONG	generation = InterlockedIncrement(&FilterExtension->RuleGeneration);
+
+	if (generation == 0)
+		generation = InterlockedIncrement(&FilterExtension->RuleGeneration);
+	return (ULONG)generation;
+}
+
+VOID
+ReturnRuleGeneration(
+	IN WDFREQUEST Request,
+	IN size_t OutputBufferLength,
+	IN ULONG Generation,
+	OUT size_t* BytesTransferred
+)
+/*++
+
+Routine Description:
+
+	Hands the generation a set of filters, modifies, tables or rules
+	committed back to a caller that left room for it. Other clients may
+	move the generation on right after, only the caller knows which one
+	its own tables got.
 
 Arguments:
 
-	DeviceObject - Context passed during the connect IOCTL
+	Request - The set request.
 
-	InputDataStart - First packet to be reported
+	OutputBufferLength - Length of the output buffer of the request.
 
-	InputDataEnd - One past the last packet to be reported.  Total number of
-				   packets is equal to InputDataEnd - InputDataStart
+	Generation - The generation BumpRuleGeneration returned for the set.
 
-	InputDataConsumed - Set to the total number of packets consumed by the RIT
-						(via the function pointer we replaced in the connect
-						IOCTL)
+	BytesTransferred - Set to the bytes returned if the generation was written.
 
 Return Value:
 
-	void.
+	None
 
 --*/
 {
-	PFILTER_DEVICE_EXTENSION	filterExt;
-	PCONTROL_DEVICE_EXTENSION	controlExt;
-	WDFDEVICE					filterDevice;
-	BOOLEAN						setInputRequested = FALSE;
+	PULONG		generation;
+	NTSTATUS	status;
 
-	DebugPrint(("Entered MouFilter_ServiceCallback\n"));
-	controlExt = ControlGetData(ControlDevice);
-	filterDevice = WdfWdmDeviceGetWdfDeviceHandle(DeviceObject);
-	filterExt = FilterGetData(filterDevice);
-	WdfSpinLockAcquire(controlExt->SpinLock);
-	setInputRequested = controlExt->InputRequired;
-	controlExt->InputRequired = FALSE;//important to set it here else another key input will cause bsod since controlExt->InputDeviceWorkItem might be cleared or in use.
-	WdfSpinLockRelease(controlExt->SpinLock);
-	if (setInputRequested)
-		IoQueueWorkItem(controlExt->InputDeviceWorkItem, SetCurrentInputDevice, DelayedWorkQueue, filterDevice);
+	if (OutputBufferLength < sizeof(ULONG))
+		return;
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(ULONG), (PVOID*)&generation, NULL);
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("WdfRequestRetrieveOutputBuffer failed %x\n", status));
+		return;
+	}
+	*generation = Generation;
+	*BytesTransferred = sizeof(ULONG);
+}
 
-	//
-	// UpperConnectData must be called at DISPATCH
-	//
-	if (InputDataStart) {
+NTSTATUS
+RetrieveDeviceHeader(
+	IN WDFREQUEST Request,
+	IN ULONG IoControlCode,
+	OUT PULONG DeviceHandle,
+	OUT PULONG Generation
+)
+/*++
 
-		/*DebugPrint(("Mouse input - LastX: %d, LastY: %d\n   \
-			Flags: %x, ButtonFlags: %x, ButtonData: %x\n	\
-			Count: %i\n",									\
-			InputDataStart->LastX, InputDataStart->LastY,   \
-			InputDataStart->Flags, InputDataStart->ButtonFlags, InputDataStart->ButtonData, \
-			InputDataEnd - InputDataStart));*/
+Routine Description:
 
-#pragma region Filtering keys
-		WdfSpinLockAcquire(filterExt->SpinLock);
+	Reads the MOUSE_DEVICE_HEADER in front of the input of a device IOCTL that
+	names its target mouse.
 
-		if (filterExt->FilterMode == FILTER_MOUSE_ALL) {
-			WdfSpinLockRelease(filterExt->SpinLock);
-			(*InputDataConsumed) += (ULONG)(InputDataEnd - InputDataStart);//Every filtered key needs to be consumed.
-			DebugPrint(("Button filtered, flag: %x ,Button flags: %x\n", InputDataStart->Flags, InputDataStart->ButtonFlags));
-			return; //drop the input
-		}
-		for (LONG64 i = 0; i < InputDataEnd - InputDataStart; i++)
-		{
-			if (filterExt->FilterMode & FILTER_MOUSE_MOVE || (InputDataStart[i].ButtonFlags & filterExt->FilterMode))
-			{
-				//filter this input
-
-				(*InputDataConsumed) += 1; //Every filtered key needs to be consumed.
-				DebugPrint(("Button filtered, flag: %x ,Button flags: %x\n", InputDataStart[i].Flags, InputDataStart[i].ButtonFlags));
-				if (i == 0 && InputDataEnd - InputDataStart == 1)
-				{
-					WdfSpinLockRelease(filterExt->SpinLock);
-					return;	//this is the only input, drop it. (most probabely there are always just one input at a time from a keyboard device)
-				}
-				LONG64 j = i;
-				//In the case there are more than one input, replace this one with the next and so on.
-				while (j + 1 < InputDataEnd - InputDataStart) {
-					InputDataStart[j] = InputDataStart[j + 1];
-					j++;
-				}
-				InputDataEnd--;
-			}
+Arguments:
 
-		}
+	Request - Handle to the framework request object.
 
-#pragma endregion
+	IoControlCode - IOCTL of the request without the targeted bit.
 
-#pragma region Modifing Keys
-		if (filterExt->ModifyRequest.ModifyCount > 0)
-			for (LONG64 i = 0; i < InputDataEnd - InputDataStart; i++)
-			{
-				for (USHORT j = 0; j < filterExt->ModifyRequest.ModifyCount; j++)
-				{
-					if (InputDataStart[i].ButtonFlags == filterExt->ModifyRequest.ModifyData[j].FromState) {
-						InputDataStart[i].ButtonFlags = filterExt->ModifyRequest.ModifyData[j].ToState;
-						DebugPrint(("Button modified from: %x to: %x\n", filterExt->ModifyRequest.ModifyData[j].FromState, filterExt->ModifyRequest.ModifyData[j].ToState));
-						break;
-					}
+	DeviceHandle - Receives the handle of the target mouse.
 
-				}
-			}
-		WdfSpinLockRelease(filterExt->SpinLock);
-#pragma endregion
+	Generation - Receives the rule generation a set is conditional on, 0 for none.
 
-		//forwarding input to the kbdclass service callback.
-		(*(PSERVICE_CALLBACK_ROUTINE)(ULONG_PTR)filterExt->UpperConnectData.ClassService)(
-			filterExt->UpperConnectData.ClassDeviceObject,
-			InputDataStart,
-			InputDataEnd,
-			InputDataConsumed);
+Return Value:
+
+	STATUS_SUCCESS if the header is valid,
+	STATUS_INVALID_DEVICE_REQUEST if the IOCTL does not target a mouse,
+	or the status of retrieving the input buffer.
+
+--*/
+{
+	NTSTATUS			status;
+	PMOUSE_DEVICE_HEADER	header;
+
+	PAGED_CODE();
+
+	switch (IoControlCode) {
+	case IOCTL_MOUSE_INSERT_KEY:
+	case IOCTL_MOUSE_SET_FILTER:
+	case IOCTL_MOUSE_GET_FILTER:
+	case IOCTL_MOUSE_SET_MODIFY:
+	case IOCTL_MOUSE_GET_MODIFY:
+	case IOCTL_MOUSE_GET_ATTRIBUTES:
+	case IOCTL_MOUSE_SET_ABSOLUTE_MAP:
+	case IOCTL_MOUSE_GET_ABSOLUTE_MAP:
+	case IOCTL_MOUSE_SET_AUTOFIRE:
+	case IOCTL_MOUSE_GET_AUTOFIRE:
+	case IOCTL_MOUSE_SET_RULES:
+	case IOCTL_MOUSE_GET_RULES:
+	case IOCTL_MOUSE_GET_STATS:
+	case IOCTL_MOUSE_GET_LATENCY:
+	case IOCTL_MOUSE_GET_GENERATION:
+	case IOCTL_MOUSE_SET_PROFILE:
+	case IOCTL_MOUSE_GET_PROFILE:
+	case IOCTL_MOUSE_SWITCH_PROFILE:
+	case IOCTL_MOUSE_SAVE_IMAGE:
+		break;
+	default:
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(MOUSE_DEVICE_HEADER), &header, NULL);
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("WdfRequestRetrieveInputBuffer failed %x\n", status));
+		return status;
 	}
+	if (header->Generation != 0 && IoControlCode != IOCTL_MOUSE_SET_FILTER &&
+		IoControlCode != IOCTL_MOUSE_SET_MODIFY && IoControlCode != IOCTL_MOUSE_SET_RULES)
+		return STATUS_INVALID_PARAMETER;
+
+	*DeviceHandle = header->DeviceHandle;
+	*Generation = header->Generation;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+RetrieveDeviceInput(
+	IN WDFREQUEST Request,
+	IN size_t InputOffset,
+	IN size_t MinimumRequiredSize,
+	OUT PVOID* Buffer,
+	OUT size_t* Length
+)
+/*++
+
+Routine Description:
+
+	WdfRequestRetrieveInputBuffer for device IOCTLs, skips the MOUSE_DEVICE_HEADER
+	of the request if it has one.
+
+Arguments:
+
+	Request - Handle to the framework request object.
+
+	InputOffset - Size of the device header, 0 if the request has none.
+
+	MinimumRequiredSize - Size of the input expected after the header.
+
+	Buffer - Receives the input after the header.
+
+	Length - Receives the length of the whole input buffer.
+
+Return Value:
+
+	The status of retrieving the input buffer.
+
+--*/
+{
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	status = WdfRequestRetrieveInputBuffer(Request, InputOffset + MinimumRequiredSize, Buffer, Length);
+	if (NT_SUCCESS(status))
+		*Buffer = (PUCHAR)*Buffer + InputOffset;
+	return status;
 }
 
+VOID
+CompleteDetectRequest(
+	IN WDFREQUEST Request,
+	IN PMOUSE_DETECT_RESULT Result,
+	IN USHORT DeviceIndex
+)
+/*++
+
+Routine Description:
+
+	Completes a detect request with the detected mouse. Callers with a
+	MOUSE_DETECT_RESULT sized output get its handle, older ones with a
+	USHORT sized output its index.
+
+Arguments:
+
+	Request - Handle to the detect request.
+
+	Result - The detected mouse.
+
+	DeviceIndex - Index of the detected mouse in FilterDeviceCollection.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	NTSTATUS	status;
+	PVOID		buffer;
+	size_t		length;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(USHORT), &buffer, &length);
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("WdfRequestRetrieveOutputBuffer failed %x\n", status));
+		WdfRequestComplete(Request, status);
+		return;
+	}
+	if (length >= sizeof(MOUSE_DETECT_RESULT)) {
+		length = sizeof(MOUSE_DETECT_RESULT);
+		RtlCopyMemory(buffer, Result, length);
+	}
+	else {
+		length = sizeof(USHORT);
+		RtlCopyMemory(buffer, &DeviceIndex, length);
+	}
+	WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, length);
+}
 
 _Function_class_(IO_WORKITEM_ROUTINE)
 VOID
@@ -1450,15 +4498,16 @@ SetCurrentInputDevice(
 
 Routine Description:
 
-	Work item WorkerRoutine queued from MouFilter_ServiceCallback in response to the user
-	request to detect the input device.
+	Work item WorkerRoutine queued from MouFilter_ServiceCallback when an input
+	arrives while detect requests are waiting. Completes every waiting
+	request with the device that generated the input and makes it the
+	target of the handles the requests came from.
 
 Arguments:
 
-	DeviceObject - Device object of the framework filter device.
+	DeviceObject - Device object of the control device.
 
-	Context - Context passed which is the filter device corresponding to the
-	mouse device which generated the input.
+	Context - Unused, the device is in DetectedHandle of the control device.
 
 Return Value:
 
@@ -1467,59 +4516,157 @@ Return Value:
 --*/
 
 	UNREFERENCED_PARAMETER(DeviceObject);
+	UNREFERENCED_PARAMETER(Context);
 
 	PAGED_CODE();
 
 	DebugPrint(("Entered SetCurrentInputDevice\n"));
-	WDFDEVICE					filterDevice;
-	ULONG                       noItems;
+	PFILTER_DEVICE_EXTENSION	filterExt;
 	PCONTROL_DEVICE_EXTENSION   controlExt;
 	WDFREQUEST                  request;
-	WDFMEMORY					outputMemory;
-	NTSTATUS                    status;
-	USHORT						deviceId;
+	MOUSE_DETECT_RESULT			result;
+	USHORT						deviceIndex;
+	PCONTROL_SESSION_CONTEXT	session;
+	ULONG						queued;
 
 	controlExt = ControlGetData(ControlDevice);
-	filterDevice = (WDFDEVICE)Context;
-	WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
-	noItems = WdfCollectionGetCount(FilterDeviceCollection);
-	deviceId = controlExt->ActiveMouseId;
-	for (USHORT i = 0; i < noItems; i++)
-	{
-		if (filterDevice == WdfCollectionGetItem(FilterDeviceCollection, i)) {
-			deviceId = i;
-			break;
+
+	//
+	// The device may have left since its input, then the requests keep
+	// waiting for the next one.
+	//
+	filterExt = ReferenceFilterDevice(controlExt->DetectedHandle);
+	if (filterExt != NULL) {
+		RtlZeroMemory(&result, sizeof(result));
+		result.DeviceHandle = filterExt->DeviceHandle;
+		WdfWaitLockAcquire(FilterDeviceCollectionLock, NULL);
+		deviceIndex = GetDeviceIndex(filterExt);
+		WdfWaitLockRelease(FilterDeviceCollectionLock);
+		DereferenceFilterDevice(filterExt);
+
+		while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(controlExt->ManualQueue, &request))) {
+			//the detected device becomes the target of the handle that asked for it
+			session = SessionGetData(WdfRequestGetFileObject(request));
+			session->DeviceHandle = result.DeviceHandle;
+			CompleteDetectRequest(request, &result, deviceIndex);
 		}
 	}
-	controlExt->ActiveMouseId = deviceId;
-	WdfWaitLockRelease(FilterDeviceCollectionLock);
 
+	//
+	// Requests forwarded while this ran found the state busy, arm for them.
+	//
+	InterlockedExchange(&controlExt->DetectState, DETECT_IDLE);
+	WdfIoQueueGetState(controlExt->ManualQueue, &queued, NULL);
+	if (queued != 0)
+		InterlockedCompareExchange(&controlExt->DetectState, DETECT_ARMED, DETECT_IDLE);
+}
 
-	IoFreeWorkItem(controlExt->InputDeviceWorkItem);
-	controlExt->InputDeviceWorkItem = NULL;
-	status = WdfIoQueueRetrieveNextRequest(controlExt->ManualQueue, &request);//fetching the pending request from our manual queue.
-	if (!NT_SUCCESS(status)) {
-		NT_ASSERT(status != STATUS_NO_MORE_ENTRIES);//should not get this
-		DebugPrint(("WdfIoQueueRetrieveNextRequest failed %x\n", status));
-		return;
-	}
-	status = WdfRequestRetrieveOutputMemory(request, &outputMemory);
-	if (!NT_SUCCESS(status)) {
-		DebugPrint(("WdfRequestRetrieveOutputMemory failed %x\n", status));
-		WdfRequestComplete(request, status);
-		return;
+VOID
+ScheduleDetectTimer(
+	IN PCONTROL_DEVICE_EXTENSION ControlExtension,
+	IN LONG64 Deadline,
+	IN LONG64 Now
+)
+/*++
+
+Routine Description:
+
+	Makes sure the detect timer fires no later than Deadline. The timer
+	runs for the earliest deadline only and finds the later ones when it
+	fires.
+
+Arguments:
+
+	ControlExtension - Extension of the control device.
+
+	Deadline - Interrupt time a detect request times out at.
+
+	Now - Current interrupt time.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	WdfSpinLockAcquire(ControlExtension->SpinLock);
+	if (ControlExtension->DetectTimerDue == 0 || Deadline < ControlExtension->DetectTimerDue) {
+		ControlExtension->DetectTimerDue = Deadline;
+		WdfTimerStart(ControlExtension->DetectTimer, -(Deadline > Now ? Deadline - Now : 1));
 	}
-	status = WdfMemoryCopyFromBuffer(
-		outputMemory,
-		0,
-		&deviceId,
-		sizeof(deviceId));
-	if (!NT_SUCCESS(status)) {
-		DebugPrint(("WdfMemoryCopyFromBuffer failed %x\n", status));
-		WdfRequestComplete(request, status);
-		return;
+	WdfSpinLockRelease(ControlExtension->SpinLock);
+}
+
+VOID
+MouFilter_EvtDetectTimer(
+	IN WDFTIMER Timer
+)
+/*++
+
+Routine Description:
+
+	Fails the waiting detect requests whose timeout passed with
+	STATUS_IO_TIMEOUT and schedules itself for the next deadline.
+
+Arguments:
+
+	Timer - Handle to the detect timer.
+
+Return Value:
+
+	Void.
+
+--*/
+{
+	PCONTROL_DEVICE_EXTENSION	controlExt;
+	PDETECT_REQUEST_CONTEXT		detectContext;
+	WDFREQUEST					previous;
+	WDFREQUEST					found;
+	WDFREQUEST					request;
+	NTSTATUS					status;
+	LONG64						now;
+	LONG64						next;
+
+	controlExt = ControlGetData(WdfTimerGetParentObject(Timer));
+	WdfSpinLockAcquire(controlExt->SpinLock);
+	controlExt->DetectTimerDue = 0;
+	WdfSpinLockRelease(controlExt->SpinLock);
+
+	now = (LONG64)KeQueryInterruptTime();
+	next = 0;
+	previous = NULL;
+	for (;;) {
+		status = WdfIoQueueFindRequest(controlExt->ManualQueue, previous, NULL, NULL, &found);
+		if (previous != NULL) {
+			WdfObjectDereference(previous);
+			previous = NULL;
+		}
+		if (status == STATUS_NOT_FOUND)
+			continue;//the previous request left the queue meanwhile, start over
+		if (!NT_SUCCESS(status))
+			break;
+
+		//requests without a timeout have no context
+		detectContext = DetectGetData(found);
+		if (detectContext == NULL) {
+			previous = found;
+			continue;
+		}
+		if (detectContext->Deadline > now) {
+			if (next == 0 || detectContext->Deadline < next)
+				next = detectContext->Deadline;
+			previous = found;
+			continue;
+		}
+
+		status = WdfIoQueueRetrieveFoundRequest(controlExt->ManualQueue, found, &request);
+		WdfObjectDereference(found);
+		if (NT_SUCCESS(status))
+			WdfRequestComplete(request, STATUS_IO_TIMEOUT);
 	}
-	WdfRequestCompleteWithInformation(request, status, sizeof(deviceId));
+
+	if (next != 0)
+		ScheduleDetectTimer(controlExt, next, now);
 }
 
 VOID
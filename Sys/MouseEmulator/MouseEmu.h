@@ -32,9 +32,18 @@ Revision History:
 #pragma warning(default:4201)
 
 #include <wdf.h>
+#include <initguid.h>
+#include <devpkey.h>
 #define NTSTRSAFE_LIB
 #include <ntstrsafe.h>
 #include "public.h"
+#include "..\Common\Autofire.h"
+#include "..\Common\RuleEngine.h"
+#include "..\Common\SharedLink.h"
+#include "..\Common\RuleImage.h"
+#include "..\Common\DeviceTable.h"
+#include "..\Common\SharedRules.h"
+#include "..\Common\MousePipeline.h"
 
 #define MOUSE_POOL_TAG (ULONG) 'memu'
 
@@ -52,6 +61,17 @@ Revision History:
 
 #endif
 
+//
+// Records an event of the hot paths into the trace ring of the current
+// processor, see TraceRing.h. While tracing is off it costs one branch.
+// Callers run at DISPATCH_LEVEL.
+//
+#define TracePoint(_event_, _arg0_, _arg1_) \
+	do { \
+		if (ReadNoFence(&TraceEnabled)) \
+			WriteTraceRecord(NULL, (_event_), (USHORT)(_arg0_), (ULONG)(_arg1_)); \
+	} while (0)
+
 
 typedef struct _FILTER_DEVICE_EXTENSION
 {
@@ -60,17 +80,48 @@ typedef struct _FILTER_DEVICE_EXTENSION
 	//
 	WDFSPINLOCK SpinLock;
 	//
+	//Stable handle of the device in DeviceTable, derived from its instance ID
+	//
+	ULONG DeviceHandle;
+	//
+	//Held by control requests while they use the device, waited out before it goes away
+	//
+	EX_RUNDOWN_REF Rundown;
+	//
+	//Moves on with every change of the rule tables of the edit profile, never 0,
+	//see IOCTL_MOUSE_GET_GENERATION
+	//
+	volatile LONG RuleGeneration;
+	//
+	//Packet counters, one cache line per processor
+	//
+	PEMU_STATS Stats;
+	//
+	//Histograms of the callback and injection paths, EMU_HIST_COUNT per
+	//processor followed by the EMU_HIST_COUNT taken by the last reset
+	//
+	PEMU_HISTOGRAM Histograms;
+	//
 	// The real connect data that this driver reports to
 	//
 	CONNECT_DATA UpperConnectData;
 	//
-	// The mouse filtering request
+	//Profiles, hotkeys, rule latches, the compiled absolute map and autofire
+	//state the service callback runs the packets through, guarded by SpinLock
+	//
+	MOUSE_PIPELINE Pipeline;
+	//
+	//Index of the profile the filter, modify and rule IOCTLs operate on
+	//
+	USHORT EditProfile;
+	//
+	//The absolute map as requested by user mode
 	//
-	USHORT FilterMode;
+	MOUSE_ABSOLUTE_MAP AbsoluteMap;
 	//
-	//The mouse modify request
+	//High resolution timer that emits the autofire cycles while the trigger is held
 	//
-	MOUSE_MODIFY_REQUEST ModifyRequest;
+	WDFTIMER AutofireTimer;
 	//
 	// Cached Keyboard Attributes
 	//
@@ -78,32 +129,167 @@ typedef struct _FILTER_DEVICE_EXTENSION
 
 } FILTER_DEVICE_EXTENSION, * PFILTER_DEVICE_EXTENSION;
 
+typedef struct _CAPTURE_RING_READER
+{
+	//
+	//File object the ring was mapped for, NULL if the reader slot is free
+	//
+	WDFFILEOBJECT FileObject;
+	//
+	//Process the ring is mapped into
+	//
+	PEPROCESS Process;
+	//
+	//Address of the ring in the process, mapped read-only
+	//
+	PVOID UserAddress;
+	//
+	//Address of the wait page of the ring in the process
+	//
+	PVOID UserWaitAddress;
+	//
+	//Event signalled when records arrive while the reader waits
+	//
+	PKEVENT Event;
+
+} CAPTURE_RING_READER, * PCAPTURE_RING_READER;
+
 typedef struct _CONTROL_DEVICE_EXTENSION {
 	//
 	//Spin lock to synch input tempering
 	//
 	WDFSPINLOCK SpinLock;
 	//
-	//Current input device target which receives filtering etc.
+	//DETECT_ARMED while detect requests wait for input, DETECT_BUSY from the
+	//input that answers them until the work item has completed them
+	//
+	volatile LONG DetectState;
+	//
+	//Handle of the device whose input answered the detect requests
+	//
+	ULONG DetectedHandle;
+	//
+	//Work item that completes the detect requests, queued at most once at a time
 	//
-	USHORT   ActiveMouseId;
+	PIO_WORKITEM DetectWorkItem;
 	//
-	//Is used to signal when user wants to detect the current input device
+	//Fails the detect requests whose timeout passed
 	//
-	BOOLEAN InputRequired;
+	WDFTIMER DetectTimer;
 	//
-	//Work item that sets the current input device when it is detected.
+	//Interrupt time the detect timer is due at, 0 while it is not running.
+	//Guarded by SpinLock.
 	//
-	PIO_WORKITEM InputDeviceWorkItem;
+	LONG64 DetectTimerDue;
 	//
 	//Queue to redirect pending IRPs for detecting current input deveice until user press any key
 	//
 	WDFQUEUE ManualQueue;
+	//
+	//Queue of the IOCTL_MOUSE_CAPTURE requests waiting for captured packets
+	//
+	WDFQUEUE CaptureQueue;
+	//
+	//Holds the capture request of the open batch, the framework cancels it
+	//there and purges it when its handle is cleaned up
+	//
+	WDFQUEUE CaptureBatchQueue;
+	//
+	//Spin lock to synch the capture batch
+	//
+	WDFSPINLOCK CaptureLock;
+	//
+	//Completes a partially filled batch once its latency deadline passes
+	//
+	WDFTIMER CaptureTimer;
+	//
+	//MOUSE_CAPTURE_SOURCE bits, checked by the service callback before taking the lock
+	//
+	volatile USHORT CaptureSources;
+	//
+	//Longest time a captured packet waits for its batch to fill, in 100ns units
+	//
+	LONG64 CaptureLatency;
+	//
+	//The capture request of the open batch, parked in CaptureBatchQueue, NULL if no batch is open
+	//
+	WDFREQUEST CaptureRequest;
+	//
+	//File object the capture request of the open batch was sent on
+	//
+	WDFFILEOBJECT CaptureFile;
+	//
+	//Records of the open batch, MOUSE_CAPTURE_BATCH_MAX of them, copied to the capture request when it completes
+	//
+	PMOUSE_CAPTURE_RECORD CaptureRecords;
+	//
+	//Number of records the open batch takes, what the capture request holds up to MOUSE_CAPTURE_BATCH_MAX
+	//
+	ULONG CaptureCapacity;
+	//
+	//Number of records filled so far
+	//
+	ULONG CaptureCount;
+	//
+	//Interrupt time the open batch has to be completed by
+	//
+	LONG64 CaptureDeadline;
+	//
+	//MOUSE_CAPTURE_DELIVERY
+	//
+	USHORT CaptureDelivery;
+	//
+	//Pages of the capture ring, allocated when the first reader maps it
+	//
+	PMDL CaptureRingMdl;
+	//
+	//Page holding the WaitMask of the capture ring, the only page the readers may write
+	//
+	PMDL CaptureWaitMdl;
+	//
+	//Writes to the system mapping of the capture ring, guarded by CaptureLock
+	//
+	EMU_RING_WRITER CaptureRing;
+	//
+	//Wait lock to synch mapping and unmapping of the capture ring
+	//
+	WDFWAITLOCK RingLock;
+	//
+	//Processes the capture ring is mapped into, the events are guarded by CaptureLock as well
+	//
+	CAPTURE_RING_READER RingReaders[EMU_RING_MAX_READERS];
 
 } CONTROL_DEVICE_EXTENSION, * PCONTROL_DEVICE_EXTENSION;
 
+typedef struct _CONTROL_SESSION_CONTEXT {
+	//
+	//Handle of the mouse the device IOCTLs of this handle target unless they name one in
+	//a MOUSE_DEVICE_HEADER, EMU_DEVICE_HANDLE_NONE for the first mouse
+	//
+	ULONG DeviceHandle;
+
+} CONTROL_SESSION_CONTEXT, * PCONTROL_SESSION_CONTEXT;
+
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILTER_DEVICE_EXTENSION, FilterGetData)
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CONTROL_DEVICE_EXTENSION, ControlGetData)
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CONTROL_SESSION_CONTEXT, SessionGetData)
+
+//
+//DetectState of the control device
+//
+#define DETECT_IDLE		0
+#define DETECT_ARMED	1
+#define DETECT_BUSY		2
+
+typedef struct _DETECT_REQUEST_CONTEXT {
+	//
+	//Interrupt time the request times out at
+	//
+	LONG64 Deadline;
+
+} DETECT_REQUEST_CONTEXT, * PDETECT_REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DETECT_REQUEST_CONTEXT, DetectGetData)
 
 #define NTDEVICE_NAME_STRING      L"\\Device\\MouseEmulator"
 #define SYMBOLIC_NAME_STRING      L"\\DosDevices\\MouseEmulator"
@@ -115,11 +301,18 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CONTROL_DEVICE_EXTENSION, ControlGetData)
 //
 DRIVER_INITIALIZE DriverEntry;
 
+EVT_WDF_DRIVER_UNLOAD MouFilter_EvtDriverUnload;
+
 EVT_WDF_DRIVER_DEVICE_ADD MouFilter_EvtDeviceAdd;
 EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL MouFilter_EvtIoInternalDeviceControl;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL MouFilter_EvtIoDeviceControl;
 EVT_WDF_DEVICE_CONTEXT_CLEANUP MouFilter_EvtDeviceContextCleanup;
 EVT_WDF_REQUEST_COMPLETION_ROUTINE MouFilter_RequestCompletionRoutine;
+EVT_WDF_TIMER MouFilter_EvtAutofireTimer;
+EVT_WDF_TIMER MouFilter_EvtCaptureTimer;
+EVT_WDF_TIMER MouFilter_EvtDetectTimer;
+EVT_WDF_FILE_CLEANUP MouFilter_EvtFileCleanup;
+EVT_WDF_OBJECT_CONTEXT_DESTROY MouFilter_EvtControlDeviceDestroy;
 
 _Must_inspect_result_
 _Success_(return == STATUS_SUCCESS)
@@ -139,8 +332,140 @@ VOID
 On_IOCTL_MOUSE_INSERT_KEY(
 	IN PMOUSE_INPUT_DATA InputDataStart,
 	IN size_t InputCount,
+	IN PFILTER_DEVICE_EXTENSION FilterExtension,
+	IN EMU_STAT Stat);
+
+NTSTATUS
+LoadRuleImage(
+	IN WDFDRIVER Driver);
+
+NTSTATUS
+LoadDeviceRuleImage(
+	IN ULONG DeviceHandle,
+	OUT PVOID* Image);
+
+NTSTATUS
+ReadRuleImage(
+	IN WDFKEY Key,
+	IN PCUNICODE_STRING ValueName,
+	OUT PVOID* Image);
+
+NTSTATUS
+ApplyRuleImage(
+	IN PFILTER_DEVICE_EXTENSION FilterExtension,
+	IN const VOID* Image);
+
+ULONG
+SerializeProfiles(
+	IN PFILTER_DEVICE_EXTENSION FilterExtension,
+	OUT OPTIONAL PUCHAR Image,
+	IN ULONG Capacity);
+
+VOID
+WriteTraceRecord(
+	IN PVOID Context,
+	IN USHORT Event,
+	IN USHORT Arg0,
+	IN ULONG Arg1);
+
+VOID
+RecordCallbackStats(
+	IN PFILTER_DEVICE_EXTENSION FilterExtension,
+	IN ULONG Processor,
+	IN ULONG Dropped,
+	IN LONG64 Start);
+
+VOID
+CaptureInputs(
+	IN PCONTROL_DEVICE_EXTENSION ControlExtension,
+	IN ULONG DeviceHandle,
+	IN USHORT Source,
+	IN PMOUSE_INPUT_DATA InputDataStart,
+	IN ULONG InputCount);
+
+VOID
+CaptureFilteredInput(
+	IN PVOID Context,
+	IN ULONG DeviceHandle,
+	IN PMOUSE_INPUT_DATA Input);
+
+VOID
+CompleteCaptureBatch(
+	IN PCONTROL_DEVICE_EXTENSION ControlExtension);
+
+PVOID
+MapCapturePages(
+	IN PMDL Mdl,
+	IN ULONG Protection);
+
+NTSTATUS
+MapCaptureRing(
+	IN PCONTROL_DEVICE_EXTENSION ControlExtension,
+	IN WDFREQUEST Request,
+	IN HANDLE Event,
+	OUT PMOUSE_CAPTURE_RING_MAPPING Mapping);
+
+VOID
+UnmapCaptureRing(
+	IN PCONTROL_DEVICE_EXTENSION ControlExtension,
+	IN WDFFILEOBJECT FileObject);
+
+NTSTATUS
+RetrieveDeviceHeader(
+	IN WDFREQUEST Request,
+	IN ULONG IoControlCode,
+	OUT PULONG DeviceHandle,
+	OUT PULONG Generation);
+
+NTSTATUS
+RetrieveDeviceInput(
+	IN WDFREQUEST Request,
+	IN size_t InputOffset,
+	IN size_t MinimumRequiredSize,
+	OUT PVOID* Buffer,
+	OUT size_t* Length);
+
+VOID
+QueryDeviceIdentity(
+	IN WDFDEVICE Device,
+	OUT PULONG Handle,
+	OUT PULONG Identity);
+
+PFILTER_DEVICE_EXTENSION
+ReferenceFilterDevice(
+	IN ULONG DeviceHandle);
+
+VOID
+DereferenceFilterDevice(
 	IN PFILTER_DEVICE_EXTENSION FilterExtension);
 
+VOID
+ParkDeviceConfiguration(
+	IN PFILTER_DEVICE_EXTENSION FilterExtension);
+
+PEMU_RULE
+AllocateSharedRules(
+	IN USHORT RuleCount);
+
+VOID
+ReleaseSharedRules(
+	IN PEMU_RULE Rules);
+
+ULONG
+BumpRuleGeneration(
+	IN PFILTER_DEVICE_EXTENSION FilterExtension);
+
+VOID
+ReturnRuleGeneration(
+	IN WDFREQUEST Request,
+	IN size_t OutputBufferLength,
+	IN ULONG Generation,
+	OUT size_t* BytesTransferred);
+
+NTSTATUS
+BroadcastRules(
+	IN WDFREQUEST Request,
+	IN size_t InputBufferLength);
 
 VOID
 MouFilter_ServiceCallback(
@@ -156,6 +481,22 @@ SetCurrentInputDevice(
 	_In_ PDEVICE_OBJECT DeviceObject,
 	_In_opt_ PVOID Context);
 
+VOID
+CompleteDetectRequest(
+	IN WDFREQUEST Request,
+	IN PMOUSE_DETECT_RESULT Result,
+	IN USHORT DeviceIndex);
+
+USHORT
+GetDeviceIndex(
+	IN PFILTER_DEVICE_EXTENSION FilterExtension);
+
+VOID
+ScheduleDetectTimer(
+	IN PCONTROL_DEVICE_EXTENSION ControlExtension,
+	IN LONG64 Deadline,
+	IN LONG64 Now);
+
 #endif  // MOUEMU_H
 
 
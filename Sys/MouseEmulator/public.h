@@ -1,5 +1,9 @@
 #pragma once
 #include "devioctl.h"
+#include "../Common/RuleTypes.h"
+#include "../Common/CaptureRing.h"
+#include "../Common/EmuHistogram.h"
+#include "../Common/TraceRing.h"
 
 #define IOCTL_INDEX0             0x800
 #define IOCTL_INDEX1             0x801
@@ -10,6 +14,30 @@
 #define IOCTL_INDEX6             0x806
 #define IOCTL_INDEX7             0x807
 #define IOCTL_INDEX8             0x808
+#define IOCTL_INDEX9             0x809
+#define IOCTL_INDEX10            0x80A
+#define IOCTL_INDEX11            0x80B
+#define IOCTL_INDEX12            0x80C
+#define IOCTL_INDEX13            0x80D
+#define IOCTL_INDEX14            0x80E
+#define IOCTL_INDEX15            0x80F
+#define IOCTL_INDEX16            0x810
+#define IOCTL_INDEX17            0x811
+#define IOCTL_INDEX18            0x812
+#define IOCTL_INDEX19            0x813
+#define IOCTL_INDEX20            0x814
+#define IOCTL_INDEX21            0x815
+#define IOCTL_INDEX22            0x816
+#define IOCTL_INDEX23            0x817
+#define IOCTL_INDEX24            0x818
+#define IOCTL_INDEX25            0x819
+#define IOCTL_INDEX26            0x81a
+#define IOCTL_INDEX27            0x81b
+#define IOCTL_INDEX28            0x81c
+#define IOCTL_INDEX29            0x81d
+#define IOCTL_INDEX30            0x81e
+#define IOCTL_INDEX31            0x81f
+#define IOCTL_INDEX32            0x820
 
 #define IOCTL_MOUSE_GET_ATTRIBUTES \
     CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX0, METHOD_BUFFERED, FILE_READ_DATA)
@@ -38,11 +66,140 @@
 #define IOCTL_MOUSE_GET_MODIFY \
 	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX8, METHOD_OUT_DIRECT, FILE_READ_DATA)
 
+#define IOCTL_MOUSE_SET_ABSOLUTE_MAP \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX9, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MOUSE_GET_ABSOLUTE_MAP \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX10, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_MOUSE_SET_AUTOFIRE \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX11, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MOUSE_GET_AUTOFIRE \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX12, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_MOUSE_SET_RULES \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX13, METHOD_IN_DIRECT, FILE_WRITE_DATA)
+
+#define IOCTL_MOUSE_GET_RULES \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX14, METHOD_OUT_DIRECT, FILE_READ_DATA)
+
+#define IOCTL_MOUSE_SET_PROFILE \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX15, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MOUSE_GET_PROFILE \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX16, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_MOUSE_SWITCH_PROFILE \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX17, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MOUSE_SAVE_IMAGE \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX18, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MOUSE_SET_CAPTURE \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX19, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MOUSE_GET_CAPTURE \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX20, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_MOUSE_CAPTURE \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX21, METHOD_OUT_DIRECT, FILE_READ_DATA)
+
+#define IOCTL_MOUSE_MAP_CAPTURE_RING \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX22, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_MOUSE_UNMAP_CAPTURE_RING \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX23, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_MOUSE_GET_DEVICES \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX24, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_MOUSE_SET_DEVICE_HANDLE \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX25, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MOUSE_BROADCAST_RULES \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX26, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MOUSE_GET_STATS \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX27, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_MOUSE_SET_STATS \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX28, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MOUSE_GET_LATENCY \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX29, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define IOCTL_MOUSE_SET_TRACE \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX30, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MOUSE_READ_TRACE \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX31, METHOD_OUT_DIRECT, FILE_READ_DATA)
+
+#define IOCTL_MOUSE_GET_GENERATION \
+	CTL_CODE( FILE_DEVICE_MOUSE, IOCTL_INDEX32, METHOD_BUFFERED, FILE_READ_DATA)
+
+//
+//Makes a device IOCTL (filters, modifies, absolute maps, rules, generation, stats, latency, autofire,
+//profiles, insertion, attributes) take its target mouse from a MOUSE_DEVICE_HEADER in front of its input
+//instead of the mouse selected on the handle with IOCTL_MOUSE_SET_DEVICE_HANDLE
+//
+#define IOCTL_MOUSE_TARGETED(Ioctl) ((Ioctl) | (0x400 << 2))
+
+//
+//Number of filter/modify/rule profiles preloaded per mouse
+//
+#define MOUSE_PROFILE_COUNT 4
+
 typedef struct _MOUSE_QUERY_RESULT {
 	USHORT ActiveDeviceId;
 	USHORT NumberOfDevices;
 } MOUSE_QUERY_RESULT, * PMOUSE_QUERY_RESULT;
 
+typedef struct _MOUSE_DEVICE_HEADER {
+	//
+	//Handle of the target mouse as reported by IOCTL_MOUSE_GET_DEVICES
+	//
+	ULONG DeviceHandle;
+	//
+	//0, or the generation IOCTL_MOUSE_GET_GENERATION must report for a set of
+	//filters, modifies or rules to be applied. The set fails with
+	//STATUS_REVISION_MISMATCH when the tables changed since. Must be 0 for
+	//every other IOCTL. A set given room for a ULONG of output returns the
+	//generation it committed the tables under
+	//
+	ULONG Generation;
+} MOUSE_DEVICE_HEADER, * PMOUSE_DEVICE_HEADER;
+
+typedef struct _MOUSE_DEVICE_INFO {
+	//
+	//Stable handle of the mouse, the same after it is plugged back or the machine restarts
+	//
+	ULONG DeviceHandle;
+	//
+	//Current index of the mouse, as taken by IOCTL_MOUSE_SET_DEVICE_ID. Indices
+	//shift when a device leaves, the handle is what identifies the mouse
+	//
+	USHORT DeviceId;
+	USHORT Reserved;
+} MOUSE_DEVICE_INFO, * PMOUSE_DEVICE_INFO;
+
+//
+//DeviceCount of a MOUSE_RULE_BROADCAST that targets every mouse
+//
+#define MOUSE_ALL_DEVICES 0xFFFFFFFF
+
+typedef struct _MOUSE_RULE_BROADCAST {
+	//
+	//Number of handles in DeviceHandles, MOUSE_ALL_DEVICES for every mouse present
+	//
+	ULONG DeviceCount;
+	//
+	//Handles of the target mouses, none with MOUSE_ALL_DEVICES. The handles are
+	//followed by the rule count and the rules as sent with IOCTL_MOUSE_SET_RULES.
+	//
+	ULONG DeviceHandles[1];
+} MOUSE_RULE_BROADCAST, * PMOUSE_RULE_BROADCAST;
+
 typedef enum _MOUSE_FILTER_MODE
 {
 	FILTER_MOUSE_NONE = 0x0000,
@@ -99,3 +256,187 @@ typedef struct _MOUSE_MODIFY_REQUEST {
 	PMOUSE_MODIFY_DATA ModifyData;
 
 } MOUSE_MODIFY_REQUEST, * PMOUSE_MODIFY_REQUEST;
+
+typedef enum _MOUSE_ABSOLUTE_MAP_FLAGS
+{
+	//Absolute packets pass through untouched
+	ABSOLUTE_MAP_NONE = 0x0000,
+	//Remap absolute packets into the target rectangle
+	ABSOLUTE_MAP_ENABLED = 0x0001,
+	//Report remapped packets in virtual desktop coordinates instead of primary monitor coordinates
+	ABSOLUTE_MAP_VIRTUAL_DESKTOP = 0x0002,
+} MOUSE_ABSOLUTE_MAP_FLAGS, * PMOUSE_ABSOLUTE_MAP_FLAGS;
+
+typedef struct _MOUSE_ABSOLUTE_MAP {
+	//
+	//Combination of MOUSE_ABSOLUTE_MAP_FLAGS
+	//
+	USHORT Flags;
+	//
+	//Target rectangle in normalized (0-65535) coordinates which the whole
+	//absolute range of the device is mapped into. Bounds are inclusive.
+	//
+	USHORT Left;
+	USHORT Top;
+	USHORT Right;
+	USHORT Bottom;
+
+} MOUSE_ABSOLUTE_MAP, * PMOUSE_ABSOLUTE_MAP;
+
+//Shortest autofire cycle the driver accepts, in microseconds
+#define MOUSE_AUTOFIRE_MIN_PERIOD 1000
+
+typedef struct _MOUSE_AUTOFIRE_DATA {
+	//A single *_BUTTON_DOWN flag of the button that fires while held down, 0 disables autofire
+	USHORT TriggerButton;
+	//A single *_BUTTON_DOWN flag of the synthesized button, usually the same as the trigger
+	USHORT OutputButton;
+	//Length of one press/release cycle in microseconds
+	ULONG PeriodMicroseconds;
+	//How long the synthesized button stays down in each cycle, in microseconds
+	ULONG PressMicroseconds;
+} MOUSE_AUTOFIRE_DATA, * PMOUSE_AUTOFIRE_DATA;
+
+typedef struct _MOUSE_PROFILE_DATA {
+	//Index of the profile applied to the inputs
+	USHORT ActiveProfile;
+	//Index of the profile the filter, modify and rule requests are stored to and read from
+	USHORT EditProfile;
+	//A single *_BUTTON_DOWN flag per profile, pressing the button activates the profile with the same index.
+	//0 if the profile has no hotkey. Hotkey button flags are stripped and never reach the system.
+	USHORT Hotkeys[MOUSE_PROFILE_COUNT];
+} MOUSE_PROFILE_DATA, * PMOUSE_PROFILE_DATA;
+
+typedef enum _MOUSE_CAPTURE_SOURCE
+{
+	//Nothing is captured
+	MOUSE_CAPTURE_NONE = 0x0000,
+	//Packets dropped by the filter
+	MOUSE_CAPTURE_FILTERED = 0x0001,
+	//Packets passed on to the system, after modifications, rules and remapping
+	MOUSE_CAPTURE_PASSED = 0x0002,
+} MOUSE_CAPTURE_SOURCE, * PMOUSE_CAPTURE_SOURCE;
+
+typedef enum _MOUSE_CAPTURE_DELIVERY
+{
+	//Captured packets complete the pending IOCTL_MOUSE_CAPTURE requests
+	MOUSE_CAPTURE_DELIVERY_REQUESTS = 0x0000,
+	//Captured packets are written to the ring mapped by IOCTL_MOUSE_MAP_CAPTURE_RING
+	MOUSE_CAPTURE_DELIVERY_RING = 0x0001,
+} MOUSE_CAPTURE_DELIVERY, * PMOUSE_CAPTURE_DELIVERY;
+
+//
+//Number of records the capture ring holds
+//
+#define MOUSE_CAPTURE_RING_CAPACITY 4096
+
+//
+//Most records a capture request is filled with, a larger buffer is completed with this many
+//
+#define MOUSE_CAPTURE_BATCH_MAX 1024
+
+typedef struct _MOUSE_CAPTURE_CONFIG {
+	//MOUSE_CAPTURE_SOURCE bits of the packets copied to the capture requests or the capture ring
+	USHORT Sources;
+	//MOUSE_CAPTURE_DELIVERY
+	USHORT Delivery;
+	//Longest time a captured packet waits for its batch to fill, in microseconds.
+	//0 completes a request with the packets of each input report.
+	ULONG LatencyMicroseconds;
+} MOUSE_CAPTURE_CONFIG, * PMOUSE_CAPTURE_CONFIG;
+
+typedef struct _MOUSE_CAPTURE_RECORD {
+	//QueryPerformanceCounter time the packet was received
+	LONG64 Timestamp;
+	//Handle of the mouse that reported the packet, as reported by IOCTL_MOUSE_GET_DEVICES
+	ULONG DeviceHandle;
+	//The MOUSE_CAPTURE_SOURCE bit the packet was captured from
+	USHORT Source;
+	USHORT Reserved;
+	//The packet as it was dropped or passed on
+	MOUSE_INPUT_DATA Input;
+} MOUSE_CAPTURE_RECORD, * PMOUSE_CAPTURE_RECORD;
+
+typedef struct _MOUSE_CAPTURE_RING_REQUEST {
+	//Handle of an auto-reset event the driver signals when records arrive while the reader waits
+	ULONG64 EventHandle;
+} MOUSE_CAPTURE_RING_REQUEST, * PMOUSE_CAPTURE_RING_REQUEST;
+
+typedef struct _MOUSE_CAPTURE_RING_MAPPING {
+	//Address of the EMU_RING_HEADER of the ring in the calling process, mapped read-only
+	ULONG64 Address;
+	//Bytes of the mapping
+	ULONG Size;
+	//Bit of the reader in the WaitMask of the ring
+	ULONG ReaderIndex;
+	//Address of the WaitMask of the ring in the calling process, the only word the readers write
+	ULONG64 WaitAddress;
+} MOUSE_CAPTURE_RING_MAPPING, * PMOUSE_CAPTURE_RING_MAPPING;
+
+typedef struct _MOUSE_DETECT_REQUEST {
+	//Milliseconds to wait for input before the request fails with STATUS_IO_TIMEOUT, 0 waits until it is canceled
+	ULONG Timeout;
+} MOUSE_DETECT_REQUEST, * PMOUSE_DETECT_REQUEST;
+
+typedef struct _MOUSE_DETECT_RESULT {
+	//Stable handle of the detected mouse. A USHORT sized output receives its
+	//current index instead, as taken by IOCTL_MOUSE_SET_DEVICE_ID
+	ULONG DeviceHandle;
+} MOUSE_DETECT_RESULT, * PMOUSE_DETECT_RESULT;
+
+//
+//MOUSE_STATS_CONFIG flags
+//
+#define MOUSE_STATS_RULE_HITS 0x0001
+
+typedef struct _MOUSE_STATS_CONFIG {
+	//MOUSE_STATS_RULE_HITS counts how often each rule applies in the rule tables set from then on
+	ULONG Flags;
+} MOUSE_STATS_CONFIG, * PMOUSE_STATS_CONFIG;
+
+typedef struct _MOUSE_STATS {
+	//Packets the mouse reported
+	ULONG64 Seen;
+	//Packets consumed by filters, rules, profile hotkeys or the autofire trigger
+	ULONG64 Dropped;
+	//Packets changed by modify entries or rules
+	ULONG64 Modified;
+	//Packets inserted with IOCTL_MOUSE_INSERT_KEY
+	ULONG64 Injected;
+	//Packets synthesized by autofire
+	ULONG64 Expanded;
+	//Rules of the active profile
+	USHORT RuleCount;
+	//TRUE if the rule table of the active profile counts hits, RuleHits then holds as many as fit
+	USHORT RuleHitsCounted;
+	ULONG Reserved;
+	//Times each rule applied, summed over all the devices the table is installed on
+	ULONG64 RuleHits[1];
+} MOUSE_STATS, * PMOUSE_STATS;
+
+//
+//MOUSE_LATENCY_REQUEST flags
+//
+#define MOUSE_LATENCY_RESET 0x0001
+
+typedef struct _MOUSE_LATENCY_REQUEST {
+	//MOUSE_LATENCY_RESET starts the next interval right after the returned histograms
+	ULONG Flags;
+} MOUSE_LATENCY_REQUEST, * PMOUSE_LATENCY_REQUEST;
+
+typedef struct _MOUSE_LATENCY {
+	//Performance counter ticks per second, the unit of the EMU_HIST_CALLBACK and EMU_HIST_INJECT histograms
+	LONG64 Frequency;
+	//Histograms indexed by EMU_HIST, counting since the last reset
+	EMU_HISTOGRAM Histograms[EMU_HIST_COUNT];
+} MOUSE_LATENCY, * PMOUSE_LATENCY;
+
+//
+//MOUSE_TRACE_CONFIG flags
+//
+#define MOUSE_TRACE_ENABLE 0x0001
+
+typedef struct _MOUSE_TRACE_CONFIG {
+	//MOUSE_TRACE_ENABLE records the hot paths of every mouse into the per processor trace rings
+	ULONG Flags;
+} MOUSE_TRACE_CONFIG, * PMOUSE_TRACE_CONFIG;
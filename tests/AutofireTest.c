@@ -0,0 +1,163 @@
+/*++
+
+Module Name:
+
+	AutofireTest.c
+
+Abstract:
+
+	Drives the autofire schedule of Autofire.h with a virtual clock, the
+	way the timer callback of the drivers steps it.
+
+--*/
+
+#include "EmuTest.h"
+#include "Autofire.h"
+
+#define PERIOD 10
+#define PRESS 4
+
+//
+//Steps the schedule at every tick of a virtual clock, records when presses happen
+//
+static ULONG RunTicks(PAUTOFIRE_SCHEDULE Schedule, LONG64 From, LONG64 To, LONG64* Presses, ULONG Capacity, PULONG Releases)
+{
+	ULONG pressCount = 0;
+	LONG64 now;
+	AUTOFIRE_ACTION action;
+
+	for (now = From; now < To; now++)
+	{
+		while ((action = AutofireStep(Schedule, now)) != AUTOFIRE_ACTION_NONE)
+		{
+			if (action == AUTOFIRE_ACTION_PRESS) {
+				if (pressCount < Capacity)
+					Presses[pressCount] = now;
+				pressCount++;
+			}
+			else {
+				(*Releases)++;
+			}
+		}
+	}
+	return pressCount;
+}
+
+static void TestArm(void)
+{
+	AUTOFIRE_SCHEDULE schedule;
+
+	AutofireInitialize(&schedule, PERIOD, PRESS);
+	EMU_CHECK_EQUAL(AutofireDueIn(&schedule, 100), -1);
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 100), AUTOFIRE_ACTION_NONE);
+
+	AutofireArm(&schedule, 100);
+	EMU_CHECK_EQUAL(AutofireDueIn(&schedule, 100), 0);
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 100), AUTOFIRE_ACTION_PRESS);
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 100), AUTOFIRE_ACTION_NONE);
+	EMU_CHECK_EQUAL(AutofireDueIn(&schedule, 100), PRESS);
+
+	//typematic repeats of the trigger don't restart the cycle
+	AutofireArm(&schedule, 102);
+	EMU_CHECK_EQUAL(AutofireDueIn(&schedule, 102), PRESS - 2);
+	EMU_CHECK(schedule.Pressed);
+}
+
+static void TestStep(void)
+{
+	AUTOFIRE_SCHEDULE schedule;
+	LONG64 presses[16];
+	ULONG releases = 0;
+	ULONG count;
+	ULONG i;
+
+	AutofireInitialize(&schedule, PERIOD, PRESS);
+	AutofireArm(&schedule, 100);
+	count = RunTicks(&schedule, 100, 200, presses, 16, &releases);
+	EMU_CHECK_EQUAL(count, 10);
+	EMU_CHECK_EQUAL(releases, 10);
+	for (i = 0; i < count && i < 16; i++)
+		EMU_CHECK_EQUAL(presses[i], 100 + i * PERIOD);
+
+	//the release of the last cycle falls at 194, the next press at 200
+	EMU_CHECK(!schedule.Pressed);
+	EMU_CHECK_EQUAL(AutofireDueIn(&schedule, 199), 1);
+}
+
+static void TestLateTimer(void)
+{
+	AUTOFIRE_SCHEDULE schedule;
+	LONG64 now = 0;
+	ULONG i;
+
+	//a timer firing 3 ticks late every time keeps the presses on the grid
+	AutofireInitialize(&schedule, PERIOD, PRESS);
+	AutofireArm(&schedule, 0);
+	for (i = 0; i < 20; i++)
+	{
+		EMU_CHECK_EQUAL(AutofireStep(&schedule, now), (i % 2) ? AUTOFIRE_ACTION_RELEASE : AUTOFIRE_ACTION_PRESS);
+		EMU_CHECK_EQUAL(AutofireStep(&schedule, now), AUTOFIRE_ACTION_NONE);
+		now += AutofireDueIn(&schedule, now) + 3;
+	}
+	EMU_CHECK_EQUAL(schedule.NextDue, 10 * PERIOD);
+}
+
+static void TestDisarm(void)
+{
+	AUTOFIRE_SCHEDULE schedule;
+
+	AutofireInitialize(&schedule, PERIOD, PRESS);
+	EMU_CHECK(!AutofireDisarm(&schedule));
+
+	//released while the output is down, the caller emits one release
+	AutofireArm(&schedule, 0);
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 0), AUTOFIRE_ACTION_PRESS);
+	EMU_CHECK(AutofireDisarm(&schedule));
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 4), AUTOFIRE_ACTION_NONE);
+	EMU_CHECK_EQUAL(AutofireDueIn(&schedule, 4), -1);
+
+	//released between cycles, nothing is left to release
+	AutofireArm(&schedule, 20);
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 20), AUTOFIRE_ACTION_PRESS);
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 24), AUTOFIRE_ACTION_RELEASE);
+	EMU_CHECK(!AutofireDisarm(&schedule));
+
+	//arming again starts a cycle at once
+	AutofireArm(&schedule, 27);
+	EMU_CHECK_EQUAL(AutofireDueIn(&schedule, 27), 0);
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 27), AUTOFIRE_ACTION_PRESS);
+}
+
+static void TestStarvation(void)
+{
+	AUTOFIRE_SCHEDULE schedule;
+
+	AutofireInitialize(&schedule, PERIOD, PRESS);
+	AutofireArm(&schedule, 0);
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 0), AUTOFIRE_ACTION_PRESS);
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 4), AUTOFIRE_ACTION_RELEASE);
+
+	//starved until 57, the cycles of 10 to 40 are dropped, not emitted as a burst
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 57), AUTOFIRE_ACTION_PRESS);
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 57), AUTOFIRE_ACTION_RELEASE);
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 57), AUTOFIRE_ACTION_NONE);
+	//the cycle that was due at 50 keeps the grid, the next one starts at 60
+	EMU_CHECK_EQUAL(AutofireDueIn(&schedule, 57), 3);
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 60), AUTOFIRE_ACTION_PRESS);
+
+	//starved while the output is down, the release comes first
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 200), AUTOFIRE_ACTION_RELEASE);
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 200), AUTOFIRE_ACTION_PRESS);
+	EMU_CHECK_EQUAL(AutofireStep(&schedule, 200), AUTOFIRE_ACTION_NONE);
+	EMU_CHECK_EQUAL(AutofireDueIn(&schedule, 200), PRESS);
+}
+
+int main(void)
+{
+	TestArm();
+	TestStep();
+	TestLateTimer();
+	TestDisarm();
+	TestStarvation();
+	return EMU_TEST_RESULT();
+}
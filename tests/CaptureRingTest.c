@@ -0,0 +1,280 @@
+/*++
+
+Module Name:
+
+	CaptureRingTest.c
+
+Abstract:
+
+	Checks the capture ring of CaptureRing.h: attach validation, in order
+	delivery, lapped readers and their loss counts, the wait handshake, and
+	a writer process racing a reader over a shared mapping the reader sees
+	read-only, the stand-in for the pages the driver maps into the reader
+	processes.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+//MAP_ANONYMOUS and memfd_create are not POSIX
+#define _GNU_SOURCE
+
+#include "EmuTest.h"
+#include "CaptureRing.h"
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define WORDS 6
+
+//
+//The WaitMask the readers share, apart from the ring as the driver keeps it
+//
+static volatile LONG WaitMask;
+
+typedef struct _TEST_RECORD {
+	LONG64 Sequence;
+	ULONG Words[WORDS];
+} TEST_RECORD;
+
+//
+//Every word depends on the sequence, a record copied while it was rewritten doesn't check out
+//
+static void FillRecord(TEST_RECORD* Record, LONG64 Sequence)
+{
+	Record->Sequence = Sequence;
+	for (ULONG i = 0; i < WORDS; i++)
+		Record->Words[i] = (ULONG)(Sequence * 2654435761u) ^ (i * 0x9E3779B9u);
+}
+
+static BOOLEAN RecordIntact(const TEST_RECORD* Record)
+{
+	TEST_RECORD expected;
+
+	FillRecord(&expected, Record->Sequence);
+	return memcmp(&expected, Record, sizeof(expected)) == 0;
+}
+
+static PVOID CreateRing(PEMU_RING_WRITER Writer, ULONG Capacity, ULONG* Size)
+{
+	PVOID ring;
+
+	*Size = EmuRingSize(sizeof(TEST_RECORD), Capacity);
+	ring = calloc(1, *Size);
+	EmuRingInitialize(Writer, ring, &WaitMask, sizeof(TEST_RECORD), Capacity);
+	return ring;
+}
+
+static void WriteRecords(PEMU_RING_WRITER Writer, LONG64 Count)
+{
+	TEST_RECORD record;
+
+	for (LONG64 i = 0; i < Count; i++)
+	{
+		FillRecord(&record, Writer->Sequence);
+		EmuRingWrite(Writer, &record);
+	}
+}
+
+static void TestAttach(void)
+{
+	EMU_RING_WRITER writer;
+	EMU_RING_READER reader;
+	ULONG size;
+	PVOID ring = CreateRing(&writer, 8, &size);
+	PEMU_RING_HEADER header = (PEMU_RING_HEADER)ring;
+
+	EMU_CHECK_EQUAL(size, EMU_RING_SLOTS_OFFSET + 8 * (sizeof(LONG64) + sizeof(TEST_RECORD)));
+	EMU_CHECK(EmuRingAttach(&reader, ring, size, &WaitMask));
+	//a mapping shorter than the slots it claims
+	EMU_CHECK(!EmuRingAttach(&reader, ring, size - 1, &WaitMask));
+	EMU_CHECK(!EmuRingAttach(&reader, ring, EMU_RING_SLOTS_OFFSET - 1, &WaitMask));
+
+	header->Capacity = 6;
+	EMU_CHECK(!EmuRingAttach(&reader, ring, size, &WaitMask));
+	header->Capacity = 0;
+	EMU_CHECK(!EmuRingAttach(&reader, ring, size, &WaitMask));
+	header->Capacity = 8;
+	header->SlotSize += 8;
+	EMU_CHECK(!EmuRingAttach(&reader, ring, size, &WaitMask));
+	header->SlotSize -= 8;
+	header->Version++;
+	EMU_CHECK(!EmuRingAttach(&reader, ring, size, &WaitMask));
+	header->Version--;
+	header->Magic = 0;
+	EMU_CHECK(!EmuRingAttach(&reader, ring, size, &WaitMask));
+	free(ring);
+}
+
+static void TestInOrder(void)
+{
+	EMU_RING_WRITER writer;
+	EMU_RING_READER reader;
+	TEST_RECORD record;
+	ULONG size;
+	PVOID ring = CreateRing(&writer, 8, &size);
+
+	//records written before the reader attached are not delivered
+	WriteRecords(&writer, 3);
+	EMU_CHECK(EmuRingAttach(&reader, ring, size, &WaitMask));
+	EMU_CHECK(!EmuRingRead(&reader, &record));
+
+	WriteRecords(&writer, 8);
+	for (LONG64 i = 3; i < 11; i++)
+	{
+		EMU_CHECK(EmuRingRead(&reader, &record));
+		EMU_CHECK_EQUAL(record.Sequence, i);
+		EMU_CHECK(RecordIntact(&record));
+	}
+	EMU_CHECK(!EmuRingRead(&reader, &record));
+	EMU_CHECK_EQUAL(reader.Lost, 0);
+	free(ring);
+}
+
+static void TestLapped(void)
+{
+	EMU_RING_WRITER writer;
+	EMU_RING_READER slow;
+	EMU_RING_READER fast;
+	TEST_RECORD record;
+	ULONG size;
+	PVOID ring = CreateRing(&writer, 8, &size);
+
+	EMU_CHECK(EmuRingAttach(&slow, ring, size, &WaitMask));
+	EMU_CHECK(EmuRingAttach(&fast, ring, size, &WaitMask));
+
+	//the fast reader keeps up, the slow one was lapped and resumes at the oldest record held
+	for (LONG64 i = 0; i < 20; i++)
+	{
+		WriteRecords(&writer, 1);
+		EMU_CHECK(EmuRingRead(&fast, &record));
+		EMU_CHECK_EQUAL(record.Sequence, i);
+	}
+	EMU_CHECK(EmuRingRead(&slow, &record));
+	EMU_CHECK_EQUAL(record.Sequence, 12);
+	EMU_CHECK_EQUAL(slow.Lost, 12);
+	for (LONG64 i = 13; i < 20; i++)
+	{
+		EMU_CHECK(EmuRingRead(&slow, &record));
+		EMU_CHECK_EQUAL(record.Sequence, i);
+	}
+	EMU_CHECK(!EmuRingRead(&slow, &record));
+	EMU_CHECK_EQUAL(slow.Lost, 12);
+	EMU_CHECK_EQUAL(fast.Lost, 0);
+
+	//exactly a ring behind loses nothing, one more loses one
+	WriteRecords(&writer, 8);
+	EMU_CHECK(EmuRingRead(&slow, &record));
+	EMU_CHECK_EQUAL(record.Sequence, 20);
+	EMU_CHECK_EQUAL(slow.Lost, 12);
+	WriteRecords(&writer, 8);
+	EMU_CHECK(EmuRingRead(&slow, &record));
+	EMU_CHECK_EQUAL(record.Sequence, 28);
+	EMU_CHECK_EQUAL(slow.Lost, 19);
+	free(ring);
+}
+
+static void TestWait(void)
+{
+	EMU_RING_WRITER writer;
+	EMU_RING_READER reader;
+	TEST_RECORD record;
+	ULONG size;
+	PVOID ring = CreateRing(&writer, 8, &size);
+
+	EMU_CHECK(EmuRingAttach(&reader, ring, size, &WaitMask));
+	EMU_CHECK_EQUAL(EmuRingTakeWaiters(&writer), 0);
+
+	//an idle reader blocks and is woken by the next batch
+	EMU_CHECK(EmuRingPrepareWait(&reader, 3));
+	EMU_CHECK_EQUAL(WaitMask, 1 << 3);
+	WriteRecords(&writer, 2);
+	EMU_CHECK_EQUAL(EmuRingTakeWaiters(&writer), 1 << 3);
+	EMU_CHECK_EQUAL(WaitMask, 0);
+	EMU_CHECK_EQUAL(EmuRingTakeWaiters(&writer), 0);
+
+	//records that arrived before the check send the reader back to reading
+	EMU_CHECK(!EmuRingPrepareWait(&reader, 3));
+	EMU_CHECK_EQUAL(WaitMask, 0);
+	EMU_CHECK(EmuRingRead(&reader, &record));
+	EMU_CHECK(EmuRingRead(&reader, &record));
+	EMU_CHECK(EmuRingPrepareWait(&reader, 3));
+	free(ring);
+}
+
+static void TestRacingWriter(ULONG Capacity, LONG64 Count)
+{
+	EMU_RING_WRITER writer;
+	EMU_RING_READER reader;
+	TEST_RECORD record;
+	ULONG size = EmuRingSize(sizeof(TEST_RECORD), Capacity);
+	int section = memfd_create("CaptureRingTest", 0);
+	PVOID ring = MAP_FAILED;
+	PVOID view = MAP_FAILED;
+	LONG64 start;
+	LONG64 read = 0;
+	LONG64 previous = -1;
+	pid_t child;
+	int status;
+
+	//the writer maps the section read-write, the reader read-only
+	if (section >= 0 && ftruncate(section, size) == 0) {
+		ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, section, 0);
+		view = mmap(NULL, size, PROT_READ, MAP_SHARED, section, 0);
+	}
+	if (section >= 0)
+		close(section);
+	EMU_CHECK(ring != MAP_FAILED && view != MAP_FAILED);
+	if (ring == MAP_FAILED || view == MAP_FAILED)
+		return;
+	EmuRingInitialize(&writer, ring, &WaitMask, sizeof(TEST_RECORD), Capacity);
+	EMU_CHECK(EmuRingAttach(&reader, view, size, &WaitMask));
+	start = reader.Sequence;
+
+	//the writer is another process, the only thing shared is the mapping
+	child = fork();
+	if (child == 0) {
+		WriteRecords(&writer, Count);
+		_exit(0);
+	}
+
+	while (reader.Sequence < Count)
+	{
+		if (!EmuRingRead(&reader, &record)) {
+			sched_yield();
+			continue;
+		}
+		read++;
+		if (!RecordIntact(&record) || record.Sequence <= previous || record.Sequence != reader.Sequence - 1) {
+			printf("record %lld read torn or out of order after %lld\n", (long long)record.Sequence, (long long)previous);
+			EmuTestFailures++;
+			break;
+		}
+		previous = record.Sequence;
+	}
+	waitpid(child, &status, 0);
+	EMU_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	//every record was either delivered or counted as lost
+	EMU_CHECK_EQUAL(read + (LONG64)reader.Lost, Count - start);
+	EMU_CHECK(!EmuRingRead(&reader, &record));
+	printf("capacity %u: %lld of %lld records read, %llu lost\n", Capacity, (long long)read, (long long)Count, (unsigned long long)reader.Lost);
+	munmap(view, size);
+	munmap(ring, size);
+}
+
+int main(void)
+{
+	TestAttach();
+	TestInOrder();
+	TestLapped();
+	TestWait();
+	//a small ring gets lapped all the time, a large one rarely
+	TestRacingWriter(4, 2000000);
+	TestRacingWriter(4096, 2000000);
+	return EMU_TEST_RESULT();
+}
@@ -0,0 +1,48 @@
+/*++
+
+Module Name:
+
+	EmuBench.h
+
+Abstract:
+
+	Timing shared by the off target benchmarks of the portable Sys/Common
+	code. A benchmark runs each case for a fixed number of iterations and
+	prints the time per operation, results are only comparable between
+	runs on the same machine.
+
+Environment:
+
+	user mode, off target
+
+--*/
+
+#ifndef EMUBENCH_H
+#define EMUBENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "EmuTypes.h"
+
+//
+//Results are stored here so the compiler can't drop the work that made them
+//
+static volatile LONG64 EmuBenchSink;
+
+static LONG64 EmuBenchNow(void)
+{
+	struct timespec now;
+
+	timespec_get(&now, TIME_UTC);
+	return (LONG64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void EmuBenchReport(const char* Name, LONG64 Operations, LONG64 Nanoseconds)
+{
+	printf("%-48s %12.1f ns/op %12lld ops\n", Name, (double)Nanoseconds / (double)Operations, (long long)Operations);
+}
+
+#endif // EMUBENCH_H
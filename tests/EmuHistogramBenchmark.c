@@ -0,0 +1,56 @@
+/*++
+
+Module Name:
+
+	EmuHistogramBenchmark.c
+
+Abstract:
+
+	Times recording into a histogram, the cost the service callbacks pay
+	for every batch, and reading quantiles out of the sum of the per
+	processor sets.
+
+--*/
+
+#include "EmuBench.h"
+#include "EmuHistogram.h"
+
+#define VALUES 4096
+#define RECORDS 100000000
+#define PROCESSORS 64
+
+int main(void)
+{
+	static EMU_HISTOGRAM processors[PROCESSORS];
+	EMU_HISTOGRAM total;
+	LONG64 values[VALUES];
+	ULONG64 state = 88172645463325252ull;
+	LONG64 start;
+	LONG64 iterations;
+
+	//ticks spread over several powers of two like real callback times
+	for (ULONG i = 0; i < VALUES; i++)
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		values[i] = (LONG64)(state >> (44 + state % 16));
+	}
+
+	start = EmuBenchNow();
+	for (ULONG i = 0; i < RECORDS; i++)
+		EmuHistogramRecord(&processors[0], values[i % VALUES]);
+	EmuBenchReport("record", RECORDS, EmuBenchNow() - start);
+
+	iterations = 20000;
+	start = EmuBenchNow();
+	for (LONG64 i = 0; i < iterations; i++)
+	{
+		RtlZeroMemory(&total, sizeof(total));
+		for (ULONG p = 0; p < PROCESSORS; p++)
+			EmuHistogramAccumulate(&total, &processors[p]);
+		EmuBenchSink += EmuHistogramValueAt(&total, 990000);
+	}
+	EmuBenchReport("sum 64 processors and read p99", iterations, EmuBenchNow() - start);
+	return 0;
+}
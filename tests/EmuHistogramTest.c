@@ -0,0 +1,183 @@
+/*++
+
+Module Name:
+
+	EmuHistogramTest.c
+
+Abstract:
+
+	Checks the log-linear histograms of EmuHistogram.h: the buckets tile
+	the 32-bit range without gaps and are never wider than the bound, and
+	the quantiles read from uniform, exponential and heavy tailed samples
+	are within that bound of the exact ones. Also checks that snapshot
+	differences survive wrapping counters.
+
+--*/
+
+#include <math.h>
+
+#include "EmuTest.h"
+#include "EmuHistogram.h"
+
+#define SAMPLES 200000
+
+static ULONG64 RandomState = 0x9E3779B97F4A7C15ull;
+
+static ULONG64 Random(void)
+{
+	RandomState ^= RandomState << 13;
+	RandomState ^= RandomState >> 7;
+	RandomState ^= RandomState << 17;
+	return RandomState;
+}
+
+//
+//Uniform in [0, 1)
+//
+static double RandomUnit(void)
+{
+	return (double)(Random() >> 11) / 9007199254740992.0;
+}
+
+static int CompareValues(const void* Left, const void* Right)
+{
+	LONG64 left = *(const LONG64*)Left;
+	LONG64 right = *(const LONG64*)Right;
+
+	return left < right ? -1 : left > right;
+}
+
+static void TestBuckets(void)
+{
+	EMU_CHECK_EQUAL(EmuHistogramBucketLow(0), 0);
+	EMU_CHECK_EQUAL(EmuHistogramBucketHigh(EMU_HIST_BUCKETS - 1), 0xFFFFFFFF);
+	for (ULONG i = 0; i < EMU_HIST_BUCKETS; i++)
+	{
+		ULONG low = EmuHistogramBucketLow(i);
+		ULONG high = EmuHistogramBucketHigh(i);
+
+		EMU_CHECK(low <= high);
+		EMU_CHECK_EQUAL(EmuHistogramBucket(low), i);
+		EMU_CHECK_EQUAL(EmuHistogramBucket(high), i);
+		//no gap to the next bucket
+		if (i + 1 < EMU_HIST_BUCKETS)
+			EMU_CHECK_EQUAL(EmuHistogramBucketLow(i + 1), (LONG64)high + 1);
+		//never wider than an eighth of the values it holds
+		if (i >= EMU_HIST_SUB_COUNT)
+			EMU_CHECK((ULONG64)(high - low + 1) * EMU_HIST_SUB_COUNT <= low);
+		else
+			EMU_CHECK_EQUAL(high, low);
+	}
+	EMU_CHECK_EQUAL(EmuHistogramBucket(-1), 0);
+	EMU_CHECK_EQUAL(EmuHistogramBucket(-0x7FFFFFFFFFFFLL), 0);
+	EMU_CHECK_EQUAL(EmuHistogramBucket(0x100000000LL), EMU_HIST_BUCKETS - 1);
+	EMU_CHECK_EQUAL(EmuHistogramBucket(0x7FFFFFFFFFFFFFFFLL), EMU_HIST_BUCKETS - 1);
+
+	for (ULONG i = 0; i < 1000000; i++)
+	{
+		ULONG value = (ULONG)Random() >> (Random() & 31);
+		ULONG bucket = EmuHistogramBucket(value);
+
+		if (bucket >= EMU_HIST_BUCKETS || value < EmuHistogramBucketLow(bucket) || value > EmuHistogramBucketHigh(bucket)) {
+			printf("value %u lands in bucket %u\n", value, bucket);
+			EmuTestFailures++;
+			break;
+		}
+	}
+}
+
+static void CheckQuantiles(const char* Name, LONG64* Values, ULONG Count)
+{
+	static const ULONG quantiles[] = { 1, 500000, 900000, 990000, 999000, 999999, EMU_HIST_PPM };
+	EMU_HISTOGRAM histogram;
+
+	RtlZeroMemory(&histogram, sizeof(histogram));
+	for (ULONG i = 0; i < Count; i++)
+		EmuHistogramRecord(&histogram, Values[i]);
+	EMU_CHECK_EQUAL(EmuHistogramTotal(&histogram), Count);
+
+	qsort(Values, Count, sizeof(LONG64), CompareValues);
+	for (ULONG q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+	{
+		ULONG64 rank = ((ULONG64)Count * quantiles[q] + EMU_HIST_PPM - 1) / EMU_HIST_PPM;
+		LONG64 exact = Values[rank == 0 ? 0 : rank - 1];
+		ULONG reported = EmuHistogramValueAt(&histogram, quantiles[q]);
+
+		//never below the true value, and above it by less than a bucket
+		if (reported < exact || (ULONG64)(reported - exact) * EMU_HIST_SUB_COUNT > (ULONG64)exact) {
+			printf("%s: quantile %u ppm is %lld, reported %u\n", Name, quantiles[q], (long long)exact, reported);
+			EmuTestFailures++;
+		}
+	}
+}
+
+static void TestDistributions(void)
+{
+	LONG64* values = (LONG64*)malloc(SAMPLES * sizeof(LONG64));
+
+	for (ULONG i = 0; i < SAMPLES; i++)
+		values[i] = 1 + (LONG64)(Random() % 100000);
+	CheckQuantiles("uniform", values, SAMPLES);
+
+	//callback times, mean 2000 ticks
+	for (ULONG i = 0; i < SAMPLES; i++)
+		values[i] = 1 + (LONG64)(-2000.0 * log1p(-RandomUnit()));
+	CheckQuantiles("exponential", values, SAMPLES);
+
+	//injections that now and then wait for a busy class service, Pareto with alpha 1.5
+	for (ULONG i = 0; i < SAMPLES; i++)
+	{
+		double value = 100.0 / pow(1.0 - RandomUnit(), 1.0 / 1.5);
+		values[i] = value > 4e9 ? 4000000000LL : (LONG64)value;
+	}
+	CheckQuantiles("pareto", values, SAMPLES);
+
+	//batch sizes, a handful of small values
+	for (ULONG i = 0; i < SAMPLES; i++)
+		values[i] = 1 + (LONG64)(Random() % 6);
+	CheckQuantiles("batch", values, SAMPLES);
+	free(values);
+}
+
+static void TestSnapshots(void)
+{
+	EMU_HISTOGRAM processors[2];
+	EMU_HISTOGRAM base;
+	EMU_HISTOGRAM total;
+
+	RtlZeroMemory(&total, sizeof(total));
+	EMU_CHECK_EQUAL(EmuHistogramValueAt(&total, 500000), 0);
+
+	//counters about to wrap
+	RtlZeroMemory(processors, sizeof(processors));
+	processors[0].Counts[EmuHistogramBucket(100)] = 0xFFFFFFF0;
+	processors[1].Counts[EmuHistogramBucket(5000)] = 7;
+	RtlZeroMemory(&base, sizeof(base));
+	EmuHistogramAccumulate(&base, &processors[0]);
+	EmuHistogramAccumulate(&base, &processors[1]);
+
+	for (ULONG i = 0; i < 0x20; i++)
+		EmuHistogramRecord(&processors[0], 100);
+	EmuHistogramRecord(&processors[1], 5000);
+	EmuHistogramRecord(&processors[1], 3);
+
+	EmuHistogramAccumulate(&total, &processors[0]);
+	EmuHistogramAccumulate(&total, &processors[1]);
+	EmuHistogramSubtract(&total, &base);
+	EMU_CHECK_EQUAL(total.Counts[EmuHistogramBucket(100)], 0x20);
+	EMU_CHECK_EQUAL(total.Counts[EmuHistogramBucket(5000)], 1);
+	EMU_CHECK_EQUAL(total.Counts[3], 1);
+	EMU_CHECK_EQUAL(EmuHistogramTotal(&total), 0x22);
+	EMU_CHECK_EQUAL(EmuHistogramValueAt(&total, 0), 3);
+	EMU_CHECK_EQUAL(EmuHistogramValueAt(&total, EMU_HIST_PPM), EmuHistogramBucketHigh(EmuHistogramBucket(5000)));
+	//quantiles past a million are the maximum
+	EMU_CHECK_EQUAL(EmuHistogramValueAt(&total, 2 * EMU_HIST_PPM), EmuHistogramBucketHigh(EmuHistogramBucket(5000)));
+}
+
+int main(void)
+{
+	TestBuckets();
+	TestDistributions();
+	TestSnapshots();
+	return EMU_TEST_RESULT();
+}
@@ -0,0 +1,113 @@
+/*++
+
+Module Name:
+
+	EmuStatsBenchmark.c
+
+Abstract:
+
+	Times packet counter increments from one thread per processor: the
+	per processor areas of EmuStats.h against one interlocked counter
+	shared by all threads, and against per thread counters packed next to
+	each other without padding, which share cache lines.
+
+	The threads stand in for processors, on a machine with fewer
+	processors than threads the contention mostly turns into scheduling.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include <pthread.h>
+
+#include "EmuBench.h"
+#include "EmuStats.h"
+
+#define INCREMENTS 10000000
+#define MAX_THREADS 16
+
+typedef enum _LAYOUT {
+	LAYOUT_PER_PROCESSOR,
+	LAYOUT_SHARED,
+	LAYOUT_PACKED
+} LAYOUT;
+
+typedef struct _WORKER {
+	LAYOUT Layout;
+	ULONG Index;
+} WORKER;
+
+static PEMU_STATS Stats;
+static volatile ULONG64 SharedCounter __attribute__((aligned(64)));
+static volatile ULONG64 PackedCounters[MAX_THREADS] __attribute__((aligned(64)));
+static volatile LONG StartFlag;
+
+static void* Increment(void* Context)
+{
+	WORKER* worker = (WORKER*)Context;
+
+	while (!__atomic_load_n(&StartFlag, __ATOMIC_ACQUIRE))
+		;
+	switch (worker->Layout) {
+	case LAYOUT_PER_PROCESSOR:
+		for (ULONG i = 0; i < INCREMENTS; i++)
+		{
+			EmuStatsAdd(Stats, worker->Index, EMU_STAT_SEEN, 1);
+			//keep the compiler from folding the loop into one add
+			__asm__ volatile("" ::: "memory");
+		}
+		break;
+	case LAYOUT_SHARED:
+		for (ULONG i = 0; i < INCREMENTS; i++)
+			__atomic_fetch_add(&SharedCounter, 1, __ATOMIC_RELAXED);
+		break;
+	case LAYOUT_PACKED:
+		for (ULONG i = 0; i < INCREMENTS; i++)
+			PackedCounters[worker->Index]++;
+		break;
+	}
+	return NULL;
+}
+
+static void RunCase(const char* Name, LAYOUT Layout, ULONG Threads)
+{
+	pthread_t threads[MAX_THREADS];
+	WORKER workers[MAX_THREADS];
+	ULONG64 counters[EMU_STAT_COUNT];
+	char name[64];
+	LONG64 start;
+
+	StartFlag = 0;
+	for (ULONG i = 0; i < Threads; i++)
+	{
+		workers[i].Layout = Layout;
+		workers[i].Index = i;
+		pthread_create(&threads[i], NULL, Increment, &workers[i]);
+	}
+	start = EmuBenchNow();
+	__atomic_store_n(&StartFlag, 1, __ATOMIC_RELEASE);
+	for (ULONG i = 0; i < Threads; i++)
+		pthread_join(threads[i], NULL);
+
+	snprintf(name, sizeof(name), "%s, %u threads", Name, Threads);
+	EmuBenchReport(name, (LONG64)INCREMENTS * Threads, EmuBenchNow() - start);
+	EmuStatsCollect(Stats, counters);
+	EmuBenchSink += counters[EMU_STAT_SEEN] + SharedCounter + PackedCounters[0];
+}
+
+int main(void)
+{
+	PVOID block = malloc(EmuStatsSize(MAX_THREADS, 0));
+
+	Stats = EmuStatsInitialize(block, MAX_THREADS, 0);
+	for (ULONG threads = 1; threads <= MAX_THREADS; threads *= 2)
+	{
+		RunCase("per processor areas", LAYOUT_PER_PROCESSOR, threads);
+		RunCase("one interlocked counter", LAYOUT_SHARED, threads);
+		RunCase("packed per thread counters", LAYOUT_PACKED, threads);
+	}
+	free(block);
+	return 0;
+}
@@ -0,0 +1,168 @@
+/*++
+
+Module Name:
+
+	EmuStatsTest.c
+
+Abstract:
+
+	Checks the counter blocks of EmuStats.h: every area starts on its own
+	cache line whatever the alignment of the block, the areas stay within
+	EmuStatsSize, collecting sums every processor, and writers adding on
+	their own processor concurrently lose no count.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include <pthread.h>
+
+#include "EmuTest.h"
+#include "EmuStats.h"
+
+#define THREADS 8
+#define ADDS 1000000
+
+static void TestLayout(void)
+{
+	static const ULONG ruleCounts[] = { 0, 1, 7, 8, 9, 2000 };
+
+	for (ULONG r = 0; r < sizeof(ruleCounts) / sizeof(ruleCounts[0]); r++)
+	{
+		for (ULONG processors = 1; processors <= 64; processors *= 4)
+		{
+			ULONG size = EmuStatsSize(processors, ruleCounts[r]);
+			PUCHAR block = (PUCHAR)malloc(size + 8);
+
+			//blocks of every alignment up to 8 bytes past one
+			for (ULONG offset = 0; offset <= 8; offset += 4)
+			{
+				PEMU_STATS stats = EmuStatsInitialize(block + offset, processors, ruleCounts[r]);
+				PUCHAR end = stats->Areas + (size_t)processors * stats->AreaSize;
+
+				EMU_CHECK_EQUAL((size_t)stats->Areas % EMU_STATS_CACHE_LINE, 0);
+				EMU_CHECK_EQUAL(stats->AreaSize % EMU_STATS_CACHE_LINE, 0);
+				EMU_CHECK(stats->AreaSize >= sizeof(EMU_STATS_SLOT) + ruleCounts[r] * sizeof(ULONG64));
+				EMU_CHECK(stats->Areas >= (PUCHAR)(stats + 1));
+				EMU_CHECK(end <= block + offset + size);
+				if (ruleCounts[r] == 0)
+					EMU_CHECK(EmuStatsRuleHits(stats, processors - 1) == NULL);
+				else
+					EMU_CHECK((PUCHAR)(EmuStatsRuleHits(stats, processors - 1) + ruleCounts[r]) <= end);
+			}
+			free(block);
+		}
+	}
+	EMU_CHECK_EQUAL(sizeof(EMU_STATS_SLOT), EMU_STATS_CACHE_LINE);
+	EMU_CHECK(EmuStatsRuleHits(NULL, 0) == NULL);
+}
+
+static void TestCollect(void)
+{
+	ULONG size = EmuStatsSize(4, 3);
+	PVOID block = malloc(size);
+	PEMU_STATS stats;
+	ULONG64 counters[EMU_STAT_COUNT];
+	ULONG64 hits[3];
+
+	//leftovers of an earlier block must not show
+	memset(block, 0xCC, size);
+	stats = EmuStatsInitialize(block, 4, 3);
+	EmuStatsCollect(stats, counters);
+	for (ULONG i = 0; i < EMU_STAT_COUNT; i++)
+		EMU_CHECK_EQUAL(counters[i], 0);
+
+	for (ULONG p = 0; p < 4; p++)
+	{
+		EmuStatsAdd(stats, p, EMU_STAT_SEEN, 10 + p);
+		EmuStatsAdd(stats, p, EMU_STAT_DROPPED, 1);
+		EmuStatsRuleHits(stats, p)[p % 3] += 5;
+		EmuStatsRuleHits(stats, p)[2] += 1;
+	}
+	EmuStatsAdd(stats, 2, EMU_STAT_EXPANDED, 0xFFFFFFFF);
+	EmuStatsAdd(stats, 3, EMU_STAT_EXPANDED, 0xFFFFFFFF);
+
+	EmuStatsCollect(stats, counters);
+	EMU_CHECK_EQUAL(counters[EMU_STAT_SEEN], 46);
+	EMU_CHECK_EQUAL(counters[EMU_STAT_DROPPED], 4);
+	EMU_CHECK_EQUAL(counters[EMU_STAT_MODIFIED], 0);
+	EMU_CHECK_EQUAL(counters[EMU_STAT_INJECTED], 0);
+	//64 bit counters carry past 32 bits
+	EMU_CHECK(counters[EMU_STAT_EXPANDED] == 0x1FFFFFFFEull);
+
+	EmuStatsCollectRuleHits(stats, hits, 3);
+	EMU_CHECK_EQUAL(hits[0], 10);
+	EMU_CHECK_EQUAL(hits[1], 5);
+	EMU_CHECK_EQUAL(hits[2], 9);
+	//a shorter read leaves the rest of the buffer alone
+	hits[2] = 77;
+	EmuStatsCollectRuleHits(stats, hits, 2);
+	EMU_CHECK_EQUAL(hits[2], 77);
+	free(block);
+}
+
+typedef struct _WRITER {
+	PEMU_STATS Stats;
+	ULONG Processor;
+} WRITER;
+
+static void* Write(void* Context)
+{
+	WRITER* writer = (WRITER*)Context;
+	PULONG64 hits = EmuStatsRuleHits(writer->Stats, writer->Processor);
+
+	for (ULONG i = 0; i < ADDS; i++)
+	{
+		EmuStatsAdd(writer->Stats, writer->Processor, EMU_STAT_SEEN, 1);
+		if (i & 1)
+			EmuStatsAdd(writer->Stats, writer->Processor, EMU_STAT_MODIFIED, 2);
+		hits[i % 5]++;
+	}
+	return NULL;
+}
+
+static void TestConcurrentWriters(void)
+{
+	PVOID block = malloc(EmuStatsSize(THREADS, 5));
+	PEMU_STATS stats = EmuStatsInitialize(block, THREADS, 5);
+	pthread_t threads[THREADS];
+	WRITER writers[THREADS];
+	ULONG64 counters[EMU_STAT_COUNT];
+	ULONG64 hits[5];
+
+	for (ULONG i = 0; i < THREADS; i++)
+	{
+		writers[i].Stats = stats;
+		writers[i].Processor = i;
+		pthread_create(&threads[i], NULL, Write, &writers[i]);
+	}
+	//a reader collecting while they write sees counts that only grow
+	counters[EMU_STAT_SEEN] = 0;
+	for (ULONG i = 0; i < 1000; i++)
+	{
+		ULONG64 previous = counters[EMU_STAT_SEEN];
+
+		EmuStatsCollect(stats, counters);
+		EMU_CHECK(counters[EMU_STAT_SEEN] >= previous && counters[EMU_STAT_SEEN] <= (ULONG64)THREADS * ADDS);
+	}
+	for (ULONG i = 0; i < THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	EmuStatsCollect(stats, counters);
+	EMU_CHECK_EQUAL(counters[EMU_STAT_SEEN], (LONG64)THREADS * ADDS);
+	EMU_CHECK_EQUAL(counters[EMU_STAT_MODIFIED], (LONG64)THREADS * ADDS);
+	EmuStatsCollectRuleHits(stats, hits, 5);
+	for (ULONG r = 0; r < 5; r++)
+		EMU_CHECK_EQUAL(hits[r], (LONG64)THREADS * (ADDS / 5));
+	free(block);
+}
+
+int main(void)
+{
+	TestLayout();
+	TestCollect();
+	TestConcurrentWriters();
+	return EMU_TEST_RESULT();
+}
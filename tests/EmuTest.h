@@ -0,0 +1,50 @@
+/*++
+
+Module Name:
+
+	EmuTest.h
+
+Abstract:
+
+	Checks shared by the off target tests of the portable Sys/Common code.
+	A failed check prints where it failed and the test goes on, main
+	returns EMU_TEST_RESULT() so ctest sees every failure of a run.
+
+Environment:
+
+	user mode, off target
+
+--*/
+
+#ifndef EMUTEST_H
+#define EMUTEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "EmuTypes.h"
+
+static int EmuTestFailures;
+
+#define EMU_CHECK(Condition) \
+	do { \
+		if (!(Condition)) { \
+			printf("%s(%d): check failed: %s\n", __FILE__, __LINE__, #Condition); \
+			EmuTestFailures++; \
+		} \
+	} while (0)
+
+#define EMU_CHECK_EQUAL(Actual, Expected) \
+	do { \
+		long long actual_ = (long long)(Actual); \
+		long long expected_ = (long long)(Expected); \
+		if (actual_ != expected_) { \
+			printf("%s(%d): %s is %lld, expected %lld\n", __FILE__, __LINE__, #Actual, actual_, expected_); \
+			EmuTestFailures++; \
+		} \
+	} while (0)
+
+#define EMU_TEST_RESULT() (EmuTestFailures == 0 ? 0 : 1)
+
+#endif // EMUTEST_H
@@ -0,0 +1,226 @@
+/*++
+
+Module Name:
+
+	EntrySetTest.c
+
+Abstract:
+
+	Checks the entry set of EntrySet.h: slot sizing, lookups, updates of
+	a key already in the set, a full set, removal of probe chains that
+	wrap around the end of the slots, growing into more slots, and random
+	edits against a reference model.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include "EmuTest.h"
+#include "EntrySet.h"
+
+#define SLOTS 16
+//Keys of the chain that wraps around the end of the slots
+#define CHAIN 3
+//The model edits more keys than its set has room for
+#define MODEL_SLOTS 256
+#define KEY_RANGE 512
+
+static ULONG64 RandomState = 0x2545F4914F6CDD1Dull;
+
+static ULONG64 Random(void)
+{
+	RandomState ^= RandomState << 13;
+	RandomState ^= RandomState >> 7;
+	RandomState ^= RandomState << 17;
+	return RandomState;
+}
+
+//
+//Keys probed from Home, as many as asked for
+//
+static ULONG FindKeysAt(const EMU_ENTRY_SET* Set, ULONG Home, ULONG64* Keys, ULONG Count)
+{
+	ULONG found = 0;
+
+	for (ULONG64 key = 1; found < Count && key < 1000000; key++)
+	{
+		if (EmuEntrySetHome(Set, key) == Home)
+			Keys[found++] = key;
+	}
+	return found;
+}
+
+static void TestSlots(void)
+{
+	EMU_CHECK_EQUAL(EmuEntrySetSlots(0), EMU_ENTRY_SET_MIN_SLOTS);
+	EMU_CHECK_EQUAL(EmuEntrySetSlots(8), 16);
+	EMU_CHECK_EQUAL(EmuEntrySetSlots(9), 32);
+	EMU_CHECK_EQUAL(EmuEntrySetSlots(1000), 2048);
+}
+
+static void TestInsertFindRemove(void)
+{
+	EMU_ENTRY_SLOT slots[SLOTS];
+	EMU_ENTRY_SET set;
+
+	EmuEntrySetInitialize(&set, slots, SLOTS);
+	EMU_CHECK_EQUAL(EmuEntrySetFind(&set, 7), EMU_ENTRY_NONE);
+	EMU_CHECK(EmuEntrySetInsert(&set, 7, 0));
+	EMU_CHECK(EmuEntrySetInsert(&set, 0x0003001E0001ull, 1));
+	EMU_CHECK_EQUAL(set.Count, 2);
+	EMU_CHECK_EQUAL(EmuEntrySetFind(&set, 7), 0);
+	EMU_CHECK_EQUAL(EmuEntrySetFind(&set, 0x0003001E0001ull), 1);
+
+	//a key in the set moves to its new position
+	EMU_CHECK(EmuEntrySetInsert(&set, 7, 5));
+	EMU_CHECK_EQUAL(set.Count, 2);
+	EMU_CHECK_EQUAL(EmuEntrySetFind(&set, 7), 5);
+
+	EMU_CHECK_EQUAL(EmuEntrySetRemove(&set, 7), 5);
+	EMU_CHECK_EQUAL(EmuEntrySetRemove(&set, 7), EMU_ENTRY_NONE);
+	EMU_CHECK_EQUAL(EmuEntrySetFind(&set, 7), EMU_ENTRY_NONE);
+	EMU_CHECK_EQUAL(EmuEntrySetFind(&set, 0x0003001E0001ull), 1);
+	EMU_CHECK_EQUAL(set.Count, 1);
+
+	//key 0 is a key like any other
+	EMU_CHECK(EmuEntrySetInsert(&set, 0, 9));
+	EMU_CHECK_EQUAL(EmuEntrySetFind(&set, 0), 9);
+}
+
+static void TestFull(void)
+{
+	EMU_ENTRY_SLOT slots[SLOTS];
+	EMU_ENTRY_SET set;
+	ULONG64 key;
+
+	EmuEntrySetInitialize(&set, slots, SLOTS);
+	for (key = 0; key < SLOTS / 2; key++)
+		EMU_CHECK(EmuEntrySetInsert(&set, key, (ULONG)key));
+	EMU_CHECK(!EmuEntrySetInsert(&set, key, (ULONG)key));
+	EMU_CHECK_EQUAL(set.Count, SLOTS / 2);
+	EMU_CHECK_EQUAL(EmuEntrySetFind(&set, key), EMU_ENTRY_NONE);
+	//the keys in the set still move
+	EMU_CHECK(EmuEntrySetInsert(&set, 3, 30));
+	EMU_CHECK_EQUAL(EmuEntrySetFind(&set, 3), 30);
+
+	EMU_CHECK_EQUAL(EmuEntrySetRemove(&set, 0), 0);
+	EMU_CHECK(EmuEntrySetInsert(&set, key, (ULONG)key));
+}
+
+static void TestWrappedChain(void)
+{
+	EMU_ENTRY_SLOT slots[SLOTS];
+	EMU_ENTRY_SET set;
+	ULONG64 last[CHAIN];
+	ULONG64 first = 0;
+	ULONG i;
+
+	EmuEntrySetInitialize(&set, slots, SLOTS);
+	EMU_CHECK_EQUAL(FindKeysAt(&set, SLOTS - 1, last, CHAIN), CHAIN);
+	EMU_CHECK_EQUAL(FindKeysAt(&set, 0, &first, 1), 1);
+
+	//three keys of the last slot wrap into slots 0 and 1, the key of slot 0 lands in slot 2
+	for (i = 0; i < CHAIN; i++)
+		EMU_CHECK(EmuEntrySetInsert(&set, last[i], i));
+	EMU_CHECK(EmuEntrySetInsert(&set, first, 10));
+	EMU_CHECK_EQUAL(slots[2].Key, first);
+
+	//removing the head of the chain moves every key back, across the wrap
+	EMU_CHECK_EQUAL(EmuEntrySetRemove(&set, last[0]), 0);
+	EMU_CHECK_EQUAL(slots[SLOTS - 1].Key, last[1]);
+	EMU_CHECK_EQUAL(slots[0].Key, last[2]);
+	EMU_CHECK_EQUAL(slots[1].Key, first);
+	EMU_CHECK_EQUAL(slots[2].Index, EMU_ENTRY_NONE);
+	EMU_CHECK_EQUAL(EmuEntrySetFind(&set, last[1]), 1);
+	EMU_CHECK_EQUAL(EmuEntrySetFind(&set, last[2]), 2);
+	EMU_CHECK_EQUAL(EmuEntrySetFind(&set, first), 10);
+
+	//and again, the key of slot 0 ends up at its home
+	EMU_CHECK_EQUAL(EmuEntrySetRemove(&set, last[1]), 1);
+	EMU_CHECK_EQUAL(slots[SLOTS - 1].Key, last[2]);
+	EMU_CHECK_EQUAL(slots[0].Key, first);
+	EMU_CHECK_EQUAL(EmuEntrySetFind(&set, first), 10);
+	EMU_CHECK_EQUAL(set.Count, 2);
+}
+
+static void TestMove(void)
+{
+	EMU_ENTRY_SLOT small[SLOTS];
+	EMU_ENTRY_SLOT large[2 * SLOTS];
+	EMU_ENTRY_SET source;
+	EMU_ENTRY_SET target;
+	ULONG64 key;
+
+	EmuEntrySetInitialize(&source, small, SLOTS);
+	for (key = 0; key < SLOTS / 2; key++)
+		EMU_CHECK(EmuEntrySetInsert(&source, key * 0x10001, (ULONG)key));
+	EmuEntrySetRemove(&source, 0x10001);
+
+	EmuEntrySetInitialize(&target, large, 2 * SLOTS);
+	EmuEntrySetMove(&target, &source);
+	EMU_CHECK_EQUAL(target.Count, source.Count);
+	EMU_CHECK_EQUAL(EmuEntrySetFind(&target, 0x10001), EMU_ENTRY_NONE);
+	for (key = 2; key < SLOTS / 2; key++)
+		EMU_CHECK_EQUAL(EmuEntrySetFind(&target, key * 0x10001), key);
+	//the grown set takes the entries the small one had no room for
+	for (key = 100; target.Count < SLOTS; key++)
+		EMU_CHECK(EmuEntrySetInsert(&target, key, (ULONG)key));
+	EMU_CHECK(!EmuEntrySetInsert(&target, key, (ULONG)key));
+}
+
+static void TestAgainstModel(void)
+{
+	EMU_ENTRY_SLOT slots[MODEL_SLOTS];
+	EMU_ENTRY_SET set;
+	ULONG model[KEY_RANGE];
+	ULONG count = 0;
+	ULONG mismatches = 0;
+
+	EmuEntrySetInitialize(&set, slots, MODEL_SLOTS);
+	for (ULONG i = 0; i < KEY_RANGE; i++)
+		model[i] = EMU_ENTRY_NONE;
+
+	for (ULONG step = 0; step < 200000; step++)
+	{
+		ULONG key = (ULONG)(Random() % KEY_RANGE);
+		//the packed keys of the API are sparse, spread the small ones the same way
+		ULONG64 packed = ((ULONG64)key << 32) | (key * 7u);
+
+		if (Random() & 1) {
+			BOOLEAN inserted = EmuEntrySetInsert(&set, packed, step);
+
+			if (model[key] != EMU_ENTRY_NONE || count < MODEL_SLOTS / 2) {
+				mismatches += !inserted;
+				count += model[key] == EMU_ENTRY_NONE;
+				model[key] = step;
+			}
+			else {
+				mismatches += inserted;
+			}
+		}
+		else {
+			mismatches += EmuEntrySetRemove(&set, packed) != model[key];
+			count -= model[key] != EMU_ENTRY_NONE;
+			model[key] = EMU_ENTRY_NONE;
+		}
+		if ((step & 1023) == 0) {
+			for (ULONG k = 0; k < KEY_RANGE; k++)
+				mismatches += EmuEntrySetFind(&set, ((ULONG64)k << 32) | (k * 7u)) != model[k];
+		}
+	}
+	EMU_CHECK_EQUAL(mismatches, 0);
+	EMU_CHECK_EQUAL(set.Count, count);
+}
+
+int main(void)
+{
+	TestSlots();
+	TestInsertFindRemove();
+	TestFull();
+	TestWrappedChain();
+	TestMove();
+	TestAgainstModel();
+	return EMU_TEST_RESULT();
+}
@@ -0,0 +1,115 @@
+/*++
+
+Module Name:
+
+	InputCorpus.h
+
+Abstract:
+
+	Synthetic recorded sessions for the off target tests and benchmarks of
+	the recording, replay file and replay code: typing with key repeat,
+	relative mouse motion with clicks and wheel turns, and an absolute
+	pointer like a tablet or a remote desktop. Every corpus is generated
+	from a seed, the same seed gives the same events.
+
+Environment:
+
+	user mode, off target
+
+--*/
+
+#ifndef INPUTCORPUS_H
+#define INPUTCORPUS_H
+
+#include "EmuTypes.h"
+
+//
+//Time units per second of the corpora, the performance counter of most machines
+//
+#define CORPUS_FREQUENCY 10000000
+
+typedef struct _CORPUS_KEY_EVENT {
+	LONG64 Time;
+	KEYBOARD_INPUT_DATA Input;
+} CORPUS_KEY_EVENT;
+
+typedef struct _CORPUS_MOUSE_EVENT {
+	LONG64 Time;
+	MOUSE_INPUT_DATA Input;
+} CORPUS_MOUSE_EVENT;
+
+static ULONG64 CorpusNext(ULONG64* State)
+{
+	*State ^= *State << 13;
+	*State ^= *State >> 7;
+	*State ^= *State << 17;
+	return *State;
+}
+
+static void CorpusTyping(CORPUS_KEY_EVENT* Events, ULONG Count, ULONG64 Seed)
+{
+	//letters, space, shift and the E0 arrows
+	static const USHORT keys[] = { 0x1E, 0x30, 0x2E, 0x20, 0x12, 0x21, 0x22, 0x23, 0x17, 0x24, 0x39, 0x2A, 0x48, 0x50 };
+	ULONG64 state = Seed | 1;
+	LONG64 time = 0;
+	ULONG i = 0;
+
+	while (i < Count)
+	{
+		ULONG64 random = CorpusNext(&state);
+		USHORT key = keys[random % (sizeof(keys) / sizeof(keys[0]))];
+		USHORT flags = key >= 0x48 ? KEY_E0 : 0;
+		//now and then a key is held long enough to repeat
+		ULONG makes = (random >> 8) % 50 == 0 ? 2 + (ULONG)((random >> 16) % 30) : 1;
+
+		time += CORPUS_FREQUENCY / 20 + (LONG64)((random >> 24) % (CORPUS_FREQUENCY / 5));
+		for (ULONG m = 0; m <= makes && i < Count; m++, i++)
+		{
+			RtlZeroMemory(&Events[i], sizeof(Events[i]));
+			Events[i].Time = time;
+			Events[i].Input.MakeCode = key;
+			Events[i].Input.Flags = flags | (m == makes ? KEY_BREAK : KEY_MAKE);
+			time += m + 1 < makes ? CORPUS_FREQUENCY / 30 : CORPUS_FREQUENCY / 12;
+		}
+	}
+}
+
+static void CorpusMouse(CORPUS_MOUSE_EVENT* Events, ULONG Count, ULONG64 Seed, BOOLEAN Absolute)
+{
+	ULONG64 state = Seed | 1;
+	LONG64 time = 0;
+	LONG x = 32768;
+	LONG y = 32768;
+
+	for (ULONG i = 0; i < Count; i++)
+	{
+		ULONG64 random = CorpusNext(&state);
+		LONG dx = (LONG)(random % 15) - 7;
+		LONG dy = (LONG)((random >> 8) % 15) - 7;
+
+		RtlZeroMemory(&Events[i], sizeof(Events[i]));
+		//125 Hz polling with some jitter
+		time += CORPUS_FREQUENCY / 125 + (LONG64)((random >> 16) % 2000);
+		Events[i].Time = time;
+		if ((random >> 32) % 200 == 0) {
+			Events[i].Input.ButtonFlags = (random >> 40) & 1 ? 0x0001 : 0x0002;
+		}
+		else if ((random >> 32) % 200 == 1) {
+			Events[i].Input.ButtonFlags = 0x0400;
+			Events[i].Input.ButtonData = (random >> 40) & 1 ? 120 : (USHORT)-120;
+		}
+		if (Absolute) {
+			x = x + dx * 40 < 0 ? 0 : x + dx * 40 > 0xFFFF ? 0xFFFF : x + dx * 40;
+			y = y + dy * 40 < 0 ? 0 : y + dy * 40 > 0xFFFF ? 0xFFFF : y + dy * 40;
+			Events[i].Input.Flags = 0x0001;
+			Events[i].Input.LastX = x;
+			Events[i].Input.LastY = y;
+		}
+		else {
+			Events[i].Input.LastX = dx;
+			Events[i].Input.LastY = dy;
+		}
+	}
+}
+
+#endif // INPUTCORPUS_H
@@ -0,0 +1,114 @@
+/*++
+
+Module Name:
+
+	InputRecordingBenchmark.c
+
+Abstract:
+
+	Encodes and decodes the synthetic sessions of InputCorpus.h with
+	InputRecording.h. Throughput is given in MB/s of the raw packets, the
+	KEYBOARD_INPUT_DATA and MOUSE_INPUT_DATA arrays a session took before,
+	and the ratio compares those arrays with the encoded stream that also
+	holds a timestamp per event.
+
+--*/
+
+#include "EmuBench.h"
+#include "InputCorpus.h"
+#include "InputRecording.h"
+
+#define EVENTS 1000000
+#define ROUNDS 10
+
+static void Report(const char* Corpus, const char* Step, ULONG64 RawBytes, LONG64 Nanoseconds)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "%s %s", Corpus, Step);
+	printf("%-48s %12.1f MB/s\n", name, (double)RawBytes * ROUNDS * 1000.0 / (double)Nanoseconds);
+}
+
+static void BenchmarkKeyboard(void)
+{
+	CORPUS_KEY_EVENT* events = (CORPUS_KEY_EVENT*)malloc(EVENTS * sizeof(CORPUS_KEY_EVENT));
+	PUCHAR stream = (PUCHAR)malloc(sizeof(EMU_REC_HEADER) + (size_t)EVENTS * EMU_REC_MAX_EVENT);
+	ULONG64 raw = (ULONG64)EVENTS * sizeof(KEYBOARD_INPUT_DATA);
+	EMU_REC_STATE state;
+	KEYBOARD_INPUT_DATA input;
+	LONG64 time;
+	LONG64 start;
+	ULONG size = 0;
+
+	CorpusTyping(events, EVENTS, 11);
+	start = EmuBenchNow();
+	for (ULONG round = 0; round < ROUNDS; round++)
+	{
+		EmuRecReset(&state, 0);
+		size = EmuRecWriteHeader(stream, EMU_REC_KEYBOARD, CORPUS_FREQUENCY);
+		for (ULONG i = 0; i < EVENTS; i++)
+			size += EmuRecEncodeKeyboard(&state, events[i].Time, &events[i].Input, stream + size);
+	}
+	Report("typing", "encode", raw, EmuBenchNow() - start);
+
+	start = EmuBenchNow();
+	for (ULONG round = 0; round < ROUNDS; round++)
+	{
+		const UCHAR* cursor = stream + sizeof(EMU_REC_HEADER);
+
+		EmuRecReset(&state, 0);
+		while (EmuRecDecodeKeyboard(&state, &cursor, stream + size, &time, &input))
+			EmuBenchSink += input.MakeCode;
+	}
+	Report("typing", "decode", raw, EmuBenchNow() - start);
+	printf("%-48s %12.1f x, %.2f bytes per event\n", "typing ratio", (double)raw / size, (double)size / EVENTS);
+	free(stream);
+	free(events);
+}
+
+static void BenchmarkMouse(const char* Corpus, BOOLEAN Absolute)
+{
+	CORPUS_MOUSE_EVENT* events = (CORPUS_MOUSE_EVENT*)malloc(EVENTS * sizeof(CORPUS_MOUSE_EVENT));
+	PUCHAR stream = (PUCHAR)malloc(sizeof(EMU_REC_HEADER) + (size_t)EVENTS * EMU_REC_MAX_EVENT);
+	ULONG64 raw = (ULONG64)EVENTS * sizeof(MOUSE_INPUT_DATA);
+	EMU_REC_STATE state;
+	MOUSE_INPUT_DATA input;
+	char name[64];
+	LONG64 time;
+	LONG64 start;
+	ULONG size = 0;
+
+	CorpusMouse(events, EVENTS, 12, Absolute);
+	start = EmuBenchNow();
+	for (ULONG round = 0; round < ROUNDS; round++)
+	{
+		EmuRecReset(&state, 0);
+		size = EmuRecWriteHeader(stream, EMU_REC_MOUSE, CORPUS_FREQUENCY);
+		for (ULONG i = 0; i < EVENTS; i++)
+			size += EmuRecEncodeMouse(&state, events[i].Time, &events[i].Input, stream + size);
+	}
+	Report(Corpus, "encode", raw, EmuBenchNow() - start);
+
+	start = EmuBenchNow();
+	for (ULONG round = 0; round < ROUNDS; round++)
+	{
+		const UCHAR* cursor = stream + sizeof(EMU_REC_HEADER);
+
+		EmuRecReset(&state, 0);
+		while (EmuRecDecodeMouse(&state, &cursor, stream + size, &time, &input))
+			EmuBenchSink += input.LastX;
+	}
+	Report(Corpus, "decode", raw, EmuBenchNow() - start);
+	snprintf(name, sizeof(name), "%s ratio", Corpus);
+	printf("%-48s %12.1f x, %.2f bytes per event\n", name, (double)raw / size, (double)size / EVENTS);
+	free(stream);
+	free(events);
+}
+
+int main(void)
+{
+	BenchmarkKeyboard();
+	BenchmarkMouse("relative mouse", FALSE);
+	BenchmarkMouse("absolute pointer", TRUE);
+	return 0;
+}
@@ -0,0 +1,379 @@
+/*++
+
+Module Name:
+
+	InputRecordingTest.c
+
+Abstract:
+
+	Round trips synthetic sessions and edge case packets through the
+	encoding of InputRecording.h, and checks that every truncation of a
+	stream decodes exactly the events before the cut and that damaged
+	streams are rejected or decode without reading past their end.
+
+--*/
+
+#include "EmuTest.h"
+#include "InputCorpus.h"
+#include "InputRecording.h"
+
+#define EVENTS 20000
+
+static BOOLEAN SameKey(const KEYBOARD_INPUT_DATA* Left, const KEYBOARD_INPUT_DATA* Right)
+{
+	return Left->MakeCode == Right->MakeCode && Left->Flags == Right->Flags &&
+		Left->UnitId == Right->UnitId && Left->ExtraInformation == Right->ExtraInformation;
+}
+
+static BOOLEAN SameMouse(const MOUSE_INPUT_DATA* Left, const MOUSE_INPUT_DATA* Right)
+{
+	return Left->UnitId == Right->UnitId && Left->Flags == Right->Flags && Left->Buttons == Right->Buttons &&
+		Left->RawButtons == Right->RawButtons && Left->LastX == Right->LastX && Left->LastY == Right->LastY &&
+		Left->ExtraInformation == Right->ExtraInformation;
+}
+
+//
+//Encodes events into a buffer after a header, Ends gets the end offset of every event
+//
+static ULONG EncodeKeys(const CORPUS_KEY_EVENT* Events, ULONG Count, PUCHAR Out, PULONG Ends)
+{
+	EMU_REC_STATE state;
+	ULONG used = EmuRecWriteHeader(Out, EMU_REC_KEYBOARD, CORPUS_FREQUENCY);
+
+	EmuRecReset(&state, 0);
+	for (ULONG i = 0; i < Count; i++)
+	{
+		ULONG length = EmuRecEncodeKeyboard(&state, Events[i].Time, &Events[i].Input, Out + used);
+
+		EMU_CHECK(length <= EMU_REC_MAX_EVENT);
+		used += length;
+		if (Ends)
+			Ends[i] = used;
+	}
+	return used;
+}
+
+static ULONG EncodeMouse(const CORPUS_MOUSE_EVENT* Events, ULONG Count, PUCHAR Out, PULONG Ends)
+{
+	EMU_REC_STATE state;
+	ULONG used = EmuRecWriteHeader(Out, EMU_REC_MOUSE, CORPUS_FREQUENCY);
+
+	EmuRecReset(&state, 0);
+	for (ULONG i = 0; i < Count; i++)
+	{
+		ULONG length = EmuRecEncodeMouse(&state, Events[i].Time, &Events[i].Input, Out + used);
+
+		EMU_CHECK(length <= EMU_REC_MAX_EVENT);
+		used += length;
+		if (Ends)
+			Ends[i] = used;
+	}
+	return used;
+}
+
+//
+//Decodes a stream, returns the events decoded and leaves the cursor offset in Used
+//
+static ULONG DecodeKeys(const UCHAR* In, ULONG Size, CORPUS_KEY_EVENT* Events, ULONG Capacity, PULONG Used)
+{
+	EMU_REC_HEADER header;
+	EMU_REC_STATE state;
+	const UCHAR* cursor = In + sizeof(EMU_REC_HEADER);
+	ULONG count = 0;
+
+	*Used = 0;
+	if (!EmuRecReadHeader(In, Size, EMU_REC_KEYBOARD, &header))
+		return 0;
+	EmuRecReset(&state, 0);
+	while (count < Capacity && EmuRecDecodeKeyboard(&state, &cursor, In + Size, &Events[count].Time, &Events[count].Input))
+		count++;
+	*Used = (ULONG)(cursor - In);
+	return count;
+}
+
+static ULONG DecodeMouse(const UCHAR* In, ULONG Size, CORPUS_MOUSE_EVENT* Events, ULONG Capacity, PULONG Used)
+{
+	EMU_REC_HEADER header;
+	EMU_REC_STATE state;
+	const UCHAR* cursor = In + sizeof(EMU_REC_HEADER);
+	ULONG count = 0;
+
+	*Used = 0;
+	if (!EmuRecReadHeader(In, Size, EMU_REC_MOUSE, &header))
+		return 0;
+	EmuRecReset(&state, 0);
+	while (count < Capacity && EmuRecDecodeMouse(&state, &cursor, In + Size, &Events[count].Time, &Events[count].Input))
+		count++;
+	*Used = (ULONG)(cursor - In);
+	return count;
+}
+
+static void TestVarints(void)
+{
+	static const ULONG64 values[] = { 0, 1, 0x7F, 0x80, 0x3FFF, 0x4000, 0xFFFFFFFF, 0x7FFFFFFFFFFFFFFFull, 0xFFFFFFFFFFFFFFFFull };
+	static const LONG64 signedValues[] = { 0, -1, 1, -64, 64, 0x7FFFFFFF, -0x80000000LL, 0x7FFFFFFFFFFFFFFFLL, -0x7FFFFFFFFFFFFFFFLL - 1 };
+	UCHAR buffer[16];
+	const UCHAR* cursor;
+	ULONG64 value = 0;
+
+	for (ULONG i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+	{
+		ULONG length = EmuRecPutVarint(buffer, values[i]);
+
+		EMU_CHECK(length <= 10);
+		cursor = buffer;
+		EMU_CHECK(EmuRecGetVarint(&cursor, buffer + length, &value));
+		EMU_CHECK(value == values[i]);
+		EMU_CHECK(cursor == buffer + length);
+		//every shorter read runs out of input
+		cursor = buffer;
+		EMU_CHECK(!EmuRecGetVarint(&cursor, buffer + length - 1, &value));
+		EMU_CHECK(cursor == buffer);
+	}
+	for (ULONG i = 0; i < sizeof(signedValues) / sizeof(signedValues[0]); i++)
+		EMU_CHECK(EmuRecUnZigZag(EmuRecZigZag(signedValues[i])) == signedValues[i]);
+	//small moves in either direction take one byte
+	EMU_CHECK_EQUAL(EmuRecZigZag(-64), 127);
+	EMU_CHECK_EQUAL(EmuRecZigZag(63), 126);
+
+	//a varint that never ends within 64 bits
+	memset(buffer, 0xFF, sizeof(buffer));
+	cursor = buffer;
+	EMU_CHECK(!EmuRecGetVarint(&cursor, buffer + sizeof(buffer), &value));
+}
+
+static void TestHeader(void)
+{
+	UCHAR buffer[sizeof(EMU_REC_HEADER)];
+	EMU_REC_HEADER header;
+	PEMU_REC_HEADER written = (PEMU_REC_HEADER)buffer;
+
+	EMU_CHECK_EQUAL(EmuRecWriteHeader(buffer, EMU_REC_MOUSE, CORPUS_FREQUENCY), sizeof(EMU_REC_HEADER));
+	EMU_CHECK(EmuRecReadHeader(buffer, sizeof(buffer), EMU_REC_MOUSE, &header));
+	EMU_CHECK_EQUAL(header.Frequency, CORPUS_FREQUENCY);
+	EMU_CHECK(!EmuRecReadHeader(buffer, sizeof(buffer) - 1, EMU_REC_MOUSE, &header));
+	EMU_CHECK(!EmuRecReadHeader(buffer, sizeof(buffer), EMU_REC_KEYBOARD, &header));
+	written->Version++;
+	EMU_CHECK(!EmuRecReadHeader(buffer, sizeof(buffer), EMU_REC_MOUSE, &header));
+	written->Version--;
+	written->Frequency = 0;
+	EMU_CHECK(!EmuRecReadHeader(buffer, sizeof(buffer), EMU_REC_MOUSE, &header));
+	written->Frequency = CORPUS_FREQUENCY;
+	written->Magic ^= 0x100;
+	EMU_CHECK(!EmuRecReadHeader(buffer, sizeof(buffer), EMU_REC_MOUSE, &header));
+}
+
+static void TestKeyboardRoundTrip(void)
+{
+	CORPUS_KEY_EVENT* events = (CORPUS_KEY_EVENT*)calloc(EVENTS, sizeof(CORPUS_KEY_EVENT));
+	CORPUS_KEY_EVENT* decoded = (CORPUS_KEY_EVENT*)calloc(EVENTS, sizeof(CORPUS_KEY_EVENT));
+	PUCHAR stream = (PUCHAR)malloc(sizeof(EMU_REC_HEADER) + (size_t)EVENTS * EMU_REC_MAX_EVENT);
+	ULONG size;
+	ULONG used;
+	ULONG count;
+
+	CorpusTyping(events, EVENTS, 1);
+	//more distinct packets than the dictionary holds, and the widest fields
+	for (ULONG i = 0; i < 300; i++)
+	{
+		events[1000 + i].Input.MakeCode = (USHORT)i;
+		events[1000 + i].Input.UnitId = (USHORT)(i % 3);
+		events[1000 + i].Input.ExtraInformation = i * 0x01000193u;
+	}
+	events[5000].Input.MakeCode = 0xFFFF;
+	events[5000].Input.Flags = 0xFFFF;
+	events[5000].Input.UnitId = 0xFFFF;
+	events[5000].Input.ExtraInformation = 0xFFFFFFFF;
+	//an event out of order keeps the time of the one before
+	events[6000].Time = events[5999].Time - 100;
+
+	size = EncodeKeys(events, EVENTS, stream, NULL);
+	count = DecodeKeys(stream, size, decoded, EVENTS, &used);
+	EMU_CHECK_EQUAL(count, EVENTS);
+	EMU_CHECK_EQUAL(used, size);
+	for (ULONG i = 0; i < count; i++)
+	{
+		LONG64 expected = i == 6000 ? events[5999].Time : events[i].Time;
+
+		if (decoded[i].Time != expected || !SameKey(&decoded[i].Input, &events[i].Input)) {
+			printf("keyboard event %u decoded wrong\n", i);
+			EmuTestFailures++;
+			break;
+		}
+	}
+	//typing repeats few packets, the time delta takes most of an event
+	printf("keyboard: %u events in %u bytes\n", EVENTS, size);
+	EMU_CHECK(size < EVENTS * sizeof(KEYBOARD_INPUT_DATA) / 2);
+	free(stream);
+	free(decoded);
+	free(events);
+}
+
+static void TestMouseRoundTrip(BOOLEAN Absolute)
+{
+	CORPUS_MOUSE_EVENT* events = (CORPUS_MOUSE_EVENT*)calloc(EVENTS, sizeof(CORPUS_MOUSE_EVENT));
+	CORPUS_MOUSE_EVENT* decoded = (CORPUS_MOUSE_EVENT*)calloc(EVENTS, sizeof(CORPUS_MOUSE_EVENT));
+	PUCHAR stream = (PUCHAR)malloc(sizeof(EMU_REC_HEADER) + (size_t)EVENTS * EMU_REC_MAX_EVENT);
+	ULONG size;
+	ULONG used;
+	ULONG count;
+
+	CorpusMouse(events, EVENTS, 2, Absolute);
+	//extreme moves and every field set
+	events[100].Input.LastX = 0x7FFFFFFF;
+	events[100].Input.LastY = -0x7FFFFFFF - 1;
+	events[101].Input.LastX = -0x7FFFFFFF - 1;
+	events[101].Input.LastY = 0x7FFFFFFF;
+	events[102].Input.UnitId = 0xFFFF;
+	events[102].Input.RawButtons = 0xFFFFFFFF;
+	events[102].Input.ExtraInformation = 0xFFFFFFFF;
+	events[102].Input.ButtonFlags = 0xFFFF;
+	events[102].Input.ButtonData = 0xFFFF;
+	//switching between relative and absolute packets
+	events[200].Input.Flags ^= EMU_REC_MOUSE_ABSOLUTE;
+	events[201].Input.Flags ^= EMU_REC_MOUSE_ABSOLUTE;
+
+	size = EncodeMouse(events, EVENTS, stream, NULL);
+	count = DecodeMouse(stream, size, decoded, EVENTS, &used);
+	EMU_CHECK_EQUAL(count, EVENTS);
+	EMU_CHECK_EQUAL(used, size);
+	for (ULONG i = 0; i < count; i++)
+	{
+		if (decoded[i].Time != events[i].Time || !SameMouse(&decoded[i].Input, &events[i].Input)) {
+			printf("%s mouse event %u decoded wrong\n", Absolute ? "absolute" : "relative", i);
+			EmuTestFailures++;
+			break;
+		}
+	}
+	printf("%s mouse: %u events in %u bytes\n", Absolute ? "absolute" : "relative", EVENTS, size);
+	EMU_CHECK(size < EVENTS * sizeof(MOUSE_INPUT_DATA) / 2);
+	free(stream);
+	free(decoded);
+	free(events);
+}
+
+static void TestTruncation(void)
+{
+	CORPUS_KEY_EVENT keys[300];
+	CORPUS_KEY_EVENT decodedKeys[300];
+	CORPUS_MOUSE_EVENT mice[300];
+	CORPUS_MOUSE_EVENT decodedMice[300];
+	ULONG keyEnds[300];
+	ULONG mouseEnds[300];
+	UCHAR keyStream[sizeof(EMU_REC_HEADER) + 300 * EMU_REC_MAX_EVENT];
+	UCHAR mouseStream[sizeof(EMU_REC_HEADER) + 300 * EMU_REC_MAX_EVENT];
+	ULONG keySize;
+	ULONG mouseSize;
+	ULONG used;
+
+	CorpusTyping(keys, 300, 3);
+	keys[7].Input.ExtraInformation = 0xFFFFFFFF;
+	CorpusMouse(mice, 300, 4, FALSE);
+	keySize = EncodeKeys(keys, 300, keyStream, keyEnds);
+	mouseSize = EncodeMouse(mice, 300, mouseStream, mouseEnds);
+
+	//a cut stream decodes the events before the cut and stops at the one it splits
+	for (ULONG length = sizeof(EMU_REC_HEADER); length <= keySize; length++)
+	{
+		PUCHAR copy = (PUCHAR)malloc(length);
+		ULONG whole = 0;
+		ULONG count;
+
+		memcpy(copy, keyStream, length);
+		while (whole < 300 && keyEnds[whole] <= length)
+			whole++;
+		count = DecodeKeys(copy, length, decodedKeys, 300, &used);
+		EMU_CHECK_EQUAL(count, whole);
+		EMU_CHECK_EQUAL(used, whole == 0 ? sizeof(EMU_REC_HEADER) : keyEnds[whole - 1]);
+		if (count > 0)
+			EMU_CHECK(SameKey(&decodedKeys[count - 1].Input, &keys[count - 1].Input));
+		free(copy);
+	}
+	for (ULONG length = sizeof(EMU_REC_HEADER); length <= mouseSize; length++)
+	{
+		PUCHAR copy = (PUCHAR)malloc(length);
+		ULONG whole = 0;
+		ULONG count;
+
+		memcpy(copy, mouseStream, length);
+		while (whole < 300 && mouseEnds[whole] <= length)
+			whole++;
+		count = DecodeMouse(copy, length, decodedMice, 300, &used);
+		EMU_CHECK_EQUAL(count, whole);
+		EMU_CHECK_EQUAL(used, whole == 0 ? sizeof(EMU_REC_HEADER) : mouseEnds[whole - 1]);
+		if (count > 0)
+			EMU_CHECK(SameMouse(&decodedMice[count - 1].Input, &mice[count - 1].Input));
+		free(copy);
+	}
+
+	//a stream cut inside its header is not a recording
+	EMU_CHECK_EQUAL(DecodeKeys(keyStream, sizeof(EMU_REC_HEADER) - 1, decodedKeys, 300, &used), 0);
+}
+
+static void TestCorruption(void)
+{
+	CORPUS_KEY_EVENT keys[200];
+	CORPUS_KEY_EVENT decodedKeys[200];
+	CORPUS_MOUSE_EVENT mice[200];
+	CORPUS_MOUSE_EVENT decodedMice[200];
+	UCHAR keyStream[sizeof(EMU_REC_HEADER) + 200 * EMU_REC_MAX_EVENT];
+	UCHAR mouseStream[sizeof(EMU_REC_HEADER) + 200 * EMU_REC_MAX_EVENT];
+	EMU_REC_STATE state;
+	UCHAR event[4];
+	const UCHAR* cursor;
+	KEYBOARD_INPUT_DATA key;
+	LONG64 time;
+	ULONG keySize;
+	ULONG mouseSize;
+	ULONG used;
+
+	CorpusTyping(keys, 200, 5);
+	CorpusMouse(mice, 200, 6, TRUE);
+	keySize = EncodeKeys(keys, 200, keyStream, NULL);
+	mouseSize = EncodeMouse(mice, 200, mouseStream, NULL);
+
+	//every flipped bit either fails the decoding or yields events, never a read past the end
+	for (ULONG bit = 0; bit < keySize * 8; bit++)
+	{
+		keyStream[bit / 8] ^= (UCHAR)(1 << (bit % 8));
+		EMU_CHECK(DecodeKeys(keyStream, keySize, decodedKeys, 200, &used) <= 200);
+		EMU_CHECK(used <= keySize);
+		keyStream[bit / 8] ^= (UCHAR)(1 << (bit % 8));
+	}
+	for (ULONG bit = 0; bit < mouseSize * 8; bit++)
+	{
+		mouseStream[bit / 8] ^= (UCHAR)(1 << (bit % 8));
+		EMU_CHECK(DecodeMouse(mouseStream, mouseSize, decodedMice, 200, &used) <= 200);
+		EMU_CHECK(used <= mouseSize);
+		mouseStream[bit / 8] ^= (UCHAR)(1 << (bit % 8));
+	}
+
+	//a dictionary index nothing was stored at, and an unknown token
+	EmuRecReset(&state, 0);
+	event[0] = 0;
+	event[1] = 0;
+	cursor = event;
+	EMU_CHECK(!EmuRecDecodeKeyboard(&state, &cursor, event + 2, &time, &key));
+	EMU_CHECK(cursor == event);
+	event[1] = EMU_REC_LITERAL + 1;
+	EMU_CHECK(!EmuRecDecodeKeyboard(&state, &cursor, event + 2, &time, &key));
+	//a literal cut short joins no dictionary
+	event[1] = EMU_REC_LITERAL;
+	event[2] = 0x1E;
+	event[3] = 0;
+	EMU_CHECK(!EmuRecDecodeKeyboard(&state, &cursor, event + 4, &time, &key));
+	EMU_CHECK_EQUAL(state.DictCount, 0);
+	EMU_CHECK_EQUAL(state.Time, 0);
+}
+
+int main(void)
+{
+	TestVarints();
+	TestHeader();
+	TestKeyboardRoundTrip();
+	TestMouseRoundTrip(FALSE);
+	TestMouseRoundTrip(TRUE);
+	TestTruncation();
+	TestCorruption();
+	return EMU_TEST_RESULT();
+}
@@ -0,0 +1,109 @@
+/*++
+
+Module Name:
+
+	InsertQueueBenchmark.c
+
+Abstract:
+
+	Measures how many inserts one thread gets through KeyboardEmuAPI when
+	every insert takes a round trip to the driver. The transport of the in
+	process host delays each insert by its insert latency, as a device
+	would, and injects the inserts of a handle in the order they were sent.
+
+	Before: 'KeyboardInsertKeys' on a driver handle, the thread waits the
+	whole latency of every insert before it sends the next.
+
+	After: an insert queue on an overlapped capture handle, up to its depth
+	of inserts in flight, their latencies overlapping. Without latency the
+	queue only adds its bookkeeping to every insert.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include "EmuBench.h"
+#include "host/EmuHost.h"
+#include "../Dll/Native/KeyboardEmuAPI/KeyboardEmuAPI.h"
+
+#define INSERTS 2000
+#define SCAN_A 0x1E
+
+static PEMU_HOST Host;
+static ULONG Device;
+static KEYBOARD_INPUT_DATA Inputs[2];
+
+static void Report(const char* Name, ULONG Latency, LONG64 Nanoseconds)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "%s, %u us latency", Name, Latency);
+	EmuBenchReport(name, INSERTS, Nanoseconds);
+	printf("%-48s %12.0f inserts/s\n", "", INSERTS * 1e9 / (double)Nanoseconds);
+}
+
+static VOID CountCompletion(PVOID Context, DWORD Error, ULONG InputCount)
+{
+	UNREFERENCED_PARAMETER(Context);
+	EmuBenchSink += Error == ERROR_SUCCESS ? InputCount : 0;
+}
+
+static void RunSync(ULONG Latency)
+{
+	HANDLE driver = CreateDriverHandle();
+	LONG64 start;
+
+	KeyboardSetActiveDeviceHandle(driver, Device);
+	start = EmuBenchNow();
+	for (ULONG i = 0; i < INSERTS; i++)
+		EmuBenchSink += KeyboardInsertKeys(driver, Inputs, ARRAYSIZE(Inputs));
+	Report("before, sync", Latency, EmuBenchNow() - start);
+	DisposeHandle(driver);
+}
+
+static void RunQueue(ULONG Latency, ULONG Depth)
+{
+	HANDLE capture = CreateCaptureHandle();
+	KEY_INSERT_QUEUE queue;
+	char name[48];
+	LONG64 start;
+
+	KeyboardSetActiveDeviceHandle(capture, Device);
+	KeyboardInsertQueueOpen(capture, Depth, CountCompletion, &queue);
+	start = EmuBenchNow();
+	for (ULONG i = 0; i < INSERTS; i++)
+		EmuBenchSink += KeyboardInsertKeysAsync(&queue, Inputs, ARRAYSIZE(Inputs), NULL);
+	//the last inserts count once they completed
+	KeyboardInsertQueueClose(&queue);
+	snprintf(name, sizeof(name), "after, queue of %u", Depth);
+	Report(name, Latency, EmuBenchNow() - start);
+	DisposeHandle(capture);
+}
+
+int main(void)
+{
+	static const ULONG latencies[] = { 0, 50, 200 };
+	static const ULONG depths[] = { 1, 4, 16, KEY_INSERT_DEPTH_MAX };
+	EMU_TRANSPORT transport;
+
+	Host = EmuHostCreate();
+	EmuHostTransport(Host, EMU_HOST_KEYBOARD, &transport);
+	KeyboardSetTransport(&transport);
+	Device = EmuHostAddDevice(Host, EMU_HOST_KEYBOARD, "ACPI\\PNP0303\\4&1d401fb5&0");
+	Inputs[0].MakeCode = SCAN_A;
+	Inputs[1].MakeCode = SCAN_A;
+	Inputs[1].Flags = KEY_BREAK;
+
+	for (ULONG l = 0; l < ARRAYSIZE(latencies); l++)
+	{
+		EmuHostSetInsertLatency(Host, latencies[l]);
+		RunSync(latencies[l]);
+		for (ULONG d = 0; d < ARRAYSIZE(depths); d++)
+			RunQueue(latencies[l], depths[d]);
+	}
+
+	EmuHostDestroy(Host);
+	return 0;
+}
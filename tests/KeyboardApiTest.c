@@ -0,0 +1,941 @@
+/*++
+
+Module Name:
+
+	KeyboardApiTest.c
+
+Abstract:
+
+	Drives KeyboardEmuAPI through the in process host of host/: device
+	selection, filters and modifies, rule edits racing another client and
+	each other,
+	insert queues with and without latency on the host, conditional rules
+	on a held mouse button, profiles, autofire on the virtual clock,
+	capture requests, the capture ring and its read-only mapping,
+	detection, parked configurations,
+	broadcast rules, latency histograms and the trace ring, and rule calls and inserts that make no heap
+	allocations once warm. What the filter passes on is read back from
+	the mock class service.
+
+	Built with EMU_HOST_REMOTE the same tests run against EmuSimulator,
+	all but the capture ring, which can not be mapped across processes.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include <pthread.h>
+#include <ntddmou.h>
+
+#include "EmuTest.h"
+#include "host/EmuHost.h"
+#include "../Dll/Native/KeyboardEmuAPI/KeyboardEmuAPI.h"
+
+#define SCAN_A	0x1E
+#define SCAN_B	0x30
+#define SCAN_C	0x2E
+#define SCAN_W	0x11
+#define SCAN_UP	0x48
+#define SCAN_F1	0x3B
+
+typedef struct _TEST_HOST {
+	PEMU_HOST Host;
+	EMU_TRANSPORT Transport;
+	HANDLE Driver;
+	ULONG Devices[2];
+} TEST_HOST, * PTEST_HOST;
+
+static void TestHostOpen(PTEST_HOST Test)
+{
+	Test->Host = EmuHostCreate();
+	EmuHostTransport(Test->Host, EMU_HOST_KEYBOARD, &Test->Transport);
+	KeyboardSetTransport(&Test->Transport);
+	Test->Devices[0] = EmuHostAddDevice(Test->Host, EMU_HOST_KEYBOARD, "ACPI\\PNP0303\\4&1d401fb5&0");
+	Test->Devices[1] = EmuHostAddDevice(Test->Host, EMU_HOST_KEYBOARD, "HID\\VID_046D&PID_C31C\\7&2a8f1d9&0&0000");
+	Test->Driver = CreateDriverHandle();
+}
+
+static void TestHostClose(PTEST_HOST Test)
+{
+	DisposeHandle(Test->Driver);
+	EmuHostDestroy(Test->Host);
+}
+
+static void Press(PTEST_HOST Test, ULONG Device, USHORT ScanCode, USHORT Flags)
+{
+	KEYBOARD_INPUT_DATA input;
+
+	memset(&input, 0, sizeof(input));
+	input.MakeCode = ScanCode;
+	input.Flags = Flags;
+	EmuHostInput(Test->Host, EMU_HOST_KEYBOARD, Device, &input, 1);
+}
+
+static ULONG Delivered(PTEST_HOST Test, PKEY_CAPTURE_RECORD Records, ULONG Capacity)
+{
+	return EmuHostDelivered(Test->Host, EMU_HOST_KEYBOARD, Records, Capacity);
+}
+
+//
+//Looks the address up in the mappings of the process, the heap counts as writable
+//
+static BOOLEAN MappedWritable(const volatile VOID* Address)
+{
+	unsigned long long start, end, address = (unsigned long long)(ULONG_PTR)Address;
+	char permissions[8];
+	char line[512];
+	BOOLEAN writable = FALSE;
+	FILE* maps = fopen("/proc/self/maps", "r");
+
+	while (maps && fgets(line, sizeof(line), maps))
+	{
+		if (sscanf(line, "%llx-%llx %7s", &start, &end, permissions) == 3 && address >= start && address < end) {
+			writable = permissions[1] == 'w';
+			break;
+		}
+	}
+	if (maps)
+		fclose(maps);
+	return writable;
+}
+
+static void TestDevices(void)
+{
+	TEST_HOST test;
+	KEYBOARD_QUERY_RESULT query;
+	KEY_DEVICE_INFO devices[4];
+	KEYBOARD_ATTRIBUTES attributes;
+	ULONG count = 0;
+
+	TestHostOpen(&test);
+	EMU_CHECK(test.Driver != INVALID_HANDLE_VALUE);
+	EMU_CHECK(test.Devices[0] != test.Devices[1]);
+
+	EMU_CHECK(KeyboardGetDevices(test.Driver, &query));
+	EMU_CHECK_EQUAL(query.NumberOfDevices, 2);
+	EMU_CHECK(KeyboardGetDeviceHandles(test.Driver, devices, ARRAYSIZE(devices), &count));
+	EMU_CHECK_EQUAL(count, 2);
+	EMU_CHECK_EQUAL(devices[0].DeviceHandle, test.Devices[0]);
+	EMU_CHECK_EQUAL(devices[1].DeviceHandle, test.Devices[1]);
+	EMU_CHECK_EQUAL(devices[1].DeviceId, 1);
+
+	EMU_CHECK(KeyboardSetActiveDeviceHandle(test.Driver, test.Devices[1]));
+	EMU_CHECK(!KeyboardSetActiveDeviceHandle(test.Driver, 0x7FFF0000));
+	EMU_CHECK_EQUAL(GetLastError(), ERROR_FILE_NOT_FOUND);
+
+	EMU_CHECK(KeyboardGetAttributes(test.Driver, &attributes));
+	EMU_CHECK_EQUAL(attributes.NumberOfKeysTotal, 101);
+	EMU_CHECK_EQUAL(attributes.NumberOfFunctionKeys, 12);
+
+	TestHostClose(&test);
+}
+
+static void TestFilterAndModify(void)
+{
+	TEST_HOST test;
+	KEY_FILTER_DATA filter = { FLAG_KEY_PRESS, SCAN_A };
+	KEY_FILTER_REQUEST filterRequest = { FILTER_KEY_FLAG_AND_SCANCODE, 1, &filter };
+	KEY_MODIFY_DATA modify = { FLAG_KEY_PRESS, SCAN_B, SCAN_C };
+	KEY_MODIFY_REQUEST modifyRequest = { 1, &modify };
+	KEY_FILTER_DATA readFilters[4];
+	KEY_FILTER_REQUEST readRequest = { 0, ARRAYSIZE(readFilters), readFilters };
+	KEY_CAPTURE_RECORD records[8];
+	KEY_STATS stats;
+
+	TestHostOpen(&test);
+	EMU_CHECK(KeyboardSetKeyFiltering(test.Driver, &filterRequest));
+	EMU_CHECK(KeyboardSetKeyModifying(test.Driver, &modifyRequest));
+	EMU_CHECK(KeyboardGetKeyFiltering(test.Driver, &readRequest));
+	EMU_CHECK_EQUAL(readRequest.FilterMode, FILTER_KEY_FLAG_AND_SCANCODE);
+	EMU_CHECK_EQUAL(readRequest.FilterCount, 1);
+	EMU_CHECK_EQUAL(readFilters[0].ScanCode, SCAN_A);
+
+	Press(&test, test.Devices[0], SCAN_A, KEY_MAKE);
+	Press(&test, test.Devices[0], SCAN_A, KEY_BREAK);
+	Press(&test, test.Devices[0], SCAN_B, KEY_MAKE);
+	Press(&test, test.Devices[0], SCAN_B, KEY_BREAK);
+	//the tables belong to the first keyboard, the second one passes everything
+	Press(&test, test.Devices[1], SCAN_A, KEY_MAKE);
+
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 3);
+	EMU_CHECK_EQUAL(records[0].Input.MakeCode, SCAN_C);
+	EMU_CHECK_EQUAL(records[0].DeviceHandle, test.Devices[0]);
+	EMU_CHECK_EQUAL(records[1].Input.MakeCode, SCAN_C);
+	EMU_CHECK_EQUAL(records[1].Input.Flags, KEY_BREAK);
+	EMU_CHECK_EQUAL(records[2].Input.MakeCode, SCAN_A);
+	EMU_CHECK_EQUAL(records[2].DeviceHandle, test.Devices[1]);
+
+	EMU_CHECK(KeyboardGetStats(test.Driver, &stats, sizeof(stats)));
+	EMU_CHECK_EQUAL(stats.Seen, 4);
+	EMU_CHECK_EQUAL(stats.Dropped, 2);
+	EMU_CHECK_EQUAL(stats.Modified, 2);
+
+	//only the make of A
+	filter.FlagPredicates = FLAG_KEY_DOWN;
+	EMU_CHECK(KeyboardSetKeyFiltering(test.Driver, &filterRequest));
+	Press(&test, test.Devices[0], SCAN_A, KEY_MAKE);
+	Press(&test, test.Devices[0], SCAN_A, KEY_BREAK);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 1);
+	EMU_CHECK_EQUAL(records[0].Input.Flags, KEY_BREAK);
+
+	TestHostClose(&test);
+}
+
+static void TestRuleEditConflict(void)
+{
+	TEST_HOST test;
+	KEY_RULE_EDIT edit;
+	KEY_FILTER_DATA filterA = { FLAG_KEY_PRESS, SCAN_A };
+	KEY_FILTER_DATA filterB = { FLAG_KEY_PRESS, SCAN_B };
+	KEY_FILTER_REQUEST other = { FILTER_KEY_FLAG_AND_SCANCODE, 1, &filterB };
+	ULONG before = 0;
+	ULONG after = 0;
+
+	TestHostOpen(&test);
+	EMU_CHECK(KeyboardGetRuleGeneration(test.Driver, test.Devices[0], &before));
+	EMU_CHECK(KeyboardBeginRuleEdit(test.Driver, test.Devices[0], &edit));
+	EMU_CHECK(KeyboardRuleEditAddFilter(&edit, &filterA));
+	EMU_CHECK(KeyboardCommitRuleEdit(&edit));
+	EMU_CHECK(KeyboardGetRuleGeneration(test.Driver, test.Devices[0], &after));
+	EMU_CHECK(after != before);
+	//the edit goes on from the generation the host committed, not one it guessed
+	EMU_CHECK_EQUAL(edit.Tables.Generation, after);
+
+	//another client replaces the tables, the edit must not overwrite them
+	EMU_CHECK(KeyboardSetKeyFiltering(test.Driver, &other));
+	EMU_CHECK(KeyboardRuleEditAddFilter(&edit, &filterB));
+	EMU_CHECK(!KeyboardCommitRuleEdit(&edit));
+	EMU_CHECK_EQUAL(GetLastError(), ERROR_REVISION_MISMATCH);
+	EMU_CHECK(KeyboardEndRuleEdit(&edit));
+
+	TestHostClose(&test);
+}
+
+#define RACING_EDITS 4
+#define RACING_ROUNDS 16
+
+static struct {
+	pthread_barrier_t Start;
+	PKEY_RULE_EDIT Edit;
+	BOOL Committed;
+	DWORD Error;
+} RacingEdits[RACING_EDITS];
+
+static void* CommitRacingEdit(void* Context)
+{
+	ULONG i = (ULONG)(ULONG_PTR)Context;
+
+	pthread_barrier_wait(&RacingEdits[0].Start);
+	RacingEdits[i].Committed = KeyboardCommitRuleEdit(RacingEdits[i].Edit);
+	RacingEdits[i].Error = RacingEdits[i].Committed ? ERROR_SUCCESS : GetLastError();
+	return NULL;
+}
+
+static void TestRacingRuleEdits(void)
+{
+	TEST_HOST test;
+	KEY_RULE_EDIT edits[RACING_EDITS];
+	KEY_RULE_EDIT late;
+	KEY_FILTER_DATA filter = { FLAG_KEY_PRESS, SCAN_A };
+	pthread_t threads[RACING_EDITS];
+	ULONG generation = 0;
+
+	TestHostOpen(&test);
+
+	//two edits read at the same generation, only the first commit lands
+	EMU_CHECK(KeyboardBeginRuleEdit(test.Driver, test.Devices[0], &edits[0]));
+	EMU_CHECK(KeyboardBeginRuleEdit(test.Driver, test.Devices[0], &late));
+	EMU_CHECK(KeyboardRuleEditAddFilter(&edits[0], &filter));
+	EMU_CHECK(KeyboardRuleEditAddFilter(&late, &filter));
+	EMU_CHECK(KeyboardCommitRuleEdit(&edits[0]));
+	EMU_CHECK(!KeyboardCommitRuleEdit(&late));
+	EMU_CHECK_EQUAL(GetLastError(), ERROR_REVISION_MISMATCH);
+	EMU_CHECK(KeyboardGetRuleGeneration(test.Driver, test.Devices[0], &generation));
+	EMU_CHECK_EQUAL(edits[0].Tables.Generation, generation);
+	EMU_CHECK(KeyboardEndRuleEdit(&late));
+	EMU_CHECK(KeyboardEndRuleEdit(&edits[0]));
+
+	//the same with the commits let go at once from their own threads
+	pthread_barrier_init(&RacingEdits[0].Start, NULL, RACING_EDITS);
+	for (ULONG round = 0; round < RACING_ROUNDS; round++)
+	{
+		ULONG committed = 0;
+		ULONG winner = 0;
+
+		for (ULONG i = 0; i < RACING_EDITS; i++)
+		{
+			//a filter the tables do not hold yet, or the edit would have nothing to commit
+			KEY_FILTER_DATA own = { FLAG_KEY_PRESS, (USHORT)(0x40 + round * RACING_EDITS + i) };
+
+			EMU_CHECK(KeyboardBeginRuleEdit(test.Driver, test.Devices[0], &edits[i]));
+			EMU_CHECK(KeyboardRuleEditAddFilter(&edits[i], &own));
+			RacingEdits[i].Edit = &edits[i];
+		}
+		for (ULONG i = 0; i < RACING_EDITS; i++)
+			pthread_create(&threads[i], NULL, CommitRacingEdit, (void*)(ULONG_PTR)i);
+		for (ULONG i = 0; i < RACING_EDITS; i++)
+		{
+			pthread_join(threads[i], NULL);
+			if (RacingEdits[i].Committed) {
+				committed++;
+				winner = i;
+			}
+			else {
+				EMU_CHECK_EQUAL(RacingEdits[i].Error, ERROR_REVISION_MISMATCH);
+			}
+		}
+		EMU_CHECK_EQUAL(committed, 1);
+		EMU_CHECK(KeyboardGetRuleGeneration(test.Driver, test.Devices[0], &generation));
+		EMU_CHECK_EQUAL(edits[winner].Tables.Generation, generation);
+		for (ULONG i = 0; i < RACING_EDITS; i++)
+			EMU_CHECK(KeyboardEndRuleEdit(&edits[i]));
+	}
+	pthread_barrier_destroy(&RacingEdits[0].Start);
+
+	TestHostClose(&test);
+}
+
+static void TestInsert(void)
+{
+	TEST_HOST test;
+	KEYBOARD_INPUT_DATA inputs[2];
+	KEY_CAPTURE_RECORD records[4];
+	KEY_DEVICE_HEADER header;
+	KEY_STATS stats;
+	DWORD bytes = 0;
+
+	TestHostOpen(&test);
+	memset(inputs, 0, sizeof(inputs));
+	inputs[0].MakeCode = SCAN_B;
+	inputs[1].MakeCode = SCAN_B;
+	inputs[1].Flags = KEY_BREAK;
+
+	EMU_CHECK(KeyboardSetActiveDeviceHandle(test.Driver, test.Devices[1]));
+	EMU_CHECK(KeyboardInsertKeys(test.Driver, inputs, 2));
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 2);
+	EMU_CHECK_EQUAL(records[0].DeviceHandle, test.Devices[1]);
+	EMU_CHECK_EQUAL(records[1].Input.Flags, KEY_BREAK);
+	EMU_CHECK(KeyboardGetStats(test.Driver, &stats, sizeof(stats)));
+	EMU_CHECK_EQUAL(stats.Injected, 2);
+	EMU_CHECK_EQUAL(stats.Seen, 0);
+
+	//a targeted IOCTL goes to its keyboard whatever the handle selected
+	EMU_CHECK(KeyboardDeviceIoControl(test.Driver, test.Devices[0], IOCTL_KEYBOARD_INSERT_KEY,
+		inputs, sizeof(inputs), NULL, 0, &bytes));
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 2);
+	EMU_CHECK_EQUAL(records[0].DeviceHandle, test.Devices[0]);
+
+	//a generation is only taken by the sets of tables
+	header.DeviceHandle = test.Devices[0];
+	header.Generation = 1;
+	EMU_CHECK_EQUAL(test.Transport.IoControl(test.Transport.Context, test.Driver,
+		IOCTL_KEYBOARD_TARGETED(IOCTL_KEYBOARD_GET_STATS), &header, sizeof(header), &stats, sizeof(stats), &bytes, NULL),
+		ERROR_INVALID_PARAMETER);
+
+	TestHostClose(&test);
+}
+
+//
+//Completions reported by the insert queues, in the order they came
+//
+static struct {
+	ULONG Count;
+	ULONG_PTR Contexts[16];
+	DWORD Errors[16];
+	ULONG InputCounts[16];
+} Completions;
+
+static VOID RecordCompletion(PVOID Context, DWORD Error, ULONG InputCount)
+{
+	if (Completions.Count < ARRAYSIZE(Completions.Contexts)) {
+		Completions.Contexts[Completions.Count] = (ULONG_PTR)Context;
+		Completions.Errors[Completions.Count] = Error;
+		Completions.InputCounts[Completions.Count] = InputCount;
+	}
+	Completions.Count++;
+}
+
+static void TestInsertQueue(void)
+{
+	TEST_HOST test;
+	KEY_INSERT_QUEUE queue;
+	KEYBOARD_INPUT_DATA inputs[2];
+	KEY_CAPTURE_RECORD records[16];
+	HANDLE capture;
+	ULONG failures = 0;
+	ULONG i;
+
+	TestHostOpen(&test);
+	//inserts only stay in flight on a handle opened for overlapped IO
+	capture = CreateCaptureHandle();
+	EMU_CHECK(KeyboardSetActiveDeviceHandle(capture, test.Devices[1]));
+	EMU_CHECK(!KeyboardInsertQueueOpen(capture, 0, RecordCompletion, &queue));
+	EMU_CHECK(!KeyboardInsertQueueOpen(capture, KEY_INSERT_DEPTH_MAX + 1, RecordCompletion, &queue));
+	memset(inputs, 0, sizeof(inputs));
+	inputs[1].Flags = KEY_BREAK;
+
+	//without latency every insert completes as it is sent
+	memset(&Completions, 0, sizeof(Completions));
+	EMU_CHECK(KeyboardInsertQueueOpen(capture, 4, RecordCompletion, &queue));
+	for (i = 0; i < 6; i++)
+	{
+		inputs[0].MakeCode = inputs[1].MakeCode = (USHORT)(SCAN_A + i);
+		failures += !KeyboardInsertKeysAsync(&queue, inputs, 2, (PVOID)(ULONG_PTR)(i + 1));
+	}
+	EMU_CHECK_EQUAL(failures, 0);
+	//the fifth insert found the queue full and reported the four before it
+	EMU_CHECK_EQUAL(Completions.Count, 4);
+	EMU_CHECK_EQUAL(KeyboardInsertQueueComplete(&queue, FALSE), 2);
+	EMU_CHECK_EQUAL(KeyboardInsertQueueComplete(&queue, FALSE), 0);
+	EMU_CHECK_EQUAL(Completions.Count, 6);
+	for (i = 0; i < 6; i++)
+	{
+		failures += Completions.Contexts[i] != i + 1;
+		failures += Completions.Errors[i] != ERROR_SUCCESS;
+		failures += Completions.InputCounts[i] != 2;
+	}
+	EMU_CHECK_EQUAL(failures, 0);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 12);
+	for (i = 0; i < 12; i++)
+	{
+		failures += records[i].DeviceHandle != test.Devices[1];
+		failures += records[i].Input.MakeCode != SCAN_A + i / 2;
+		failures += records[i].Input.Flags != ((i & 1) ? KEY_BREAK : KEY_MAKE);
+	}
+	EMU_CHECK_EQUAL(failures, 0);
+	EMU_CHECK(KeyboardInsertQueueClose(&queue));
+
+	//with latency the inserts stay in flight until the host completes them
+	memset(&Completions, 0, sizeof(Completions));
+	EmuHostSetInsertLatency(test.Host, 20000);
+	EMU_CHECK(KeyboardInsertQueueOpen(capture, 4, RecordCompletion, &queue));
+	for (i = 0; i < 4; i++)
+	{
+		inputs[0].MakeCode = inputs[1].MakeCode = (USHORT)(SCAN_A + i);
+		failures += !KeyboardInsertKeysAsync(&queue, inputs, 2, (PVOID)(ULONG_PTR)(i + 1));
+	}
+	EMU_CHECK_EQUAL(failures, 0);
+	EMU_CHECK_EQUAL(KeyboardInsertQueueComplete(&queue, FALSE), 0);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 0);
+	EMU_CHECK(KeyboardInsertQueueComplete(&queue, TRUE) >= 1);
+	EMU_CHECK_EQUAL(Completions.Contexts[0], 1);
+	//closing waits for the rest
+	EMU_CHECK(KeyboardInsertQueueClose(&queue));
+	EMU_CHECK_EQUAL(Completions.Count, 4);
+	for (i = 0; i < 4; i++)
+	{
+		failures += Completions.Contexts[i] != i + 1;
+		failures += Completions.Errors[i] != ERROR_SUCCESS;
+	}
+	EMU_CHECK_EQUAL(failures, 0);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 8);
+	EMU_CHECK_EQUAL(records[7].Input.MakeCode, SCAN_A + 3);
+
+	//a handle opened without overlapped IO completes every insert before it is queued
+	memset(&Completions, 0, sizeof(Completions));
+	EMU_CHECK(KeyboardSetActiveDeviceHandle(test.Driver, test.Devices[0]));
+	EMU_CHECK(KeyboardInsertQueueOpen(test.Driver, 4, RecordCompletion, &queue));
+	EMU_CHECK(KeyboardInsertKeysAsync(&queue, inputs, 2, NULL));
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 2);
+	EMU_CHECK_EQUAL(records[0].DeviceHandle, test.Devices[0]);
+	EMU_CHECK_EQUAL(KeyboardInsertQueueComplete(&queue, FALSE), 1);
+	EMU_CHECK(KeyboardInsertQueueClose(&queue));
+	EMU_CHECK_EQUAL(Completions.Count, 1);
+
+	DisposeHandle(capture);
+	TestHostClose(&test);
+}
+
+static void TestInsertQueueAllocations(void)
+{
+	TEST_HOST test;
+	KEY_INSERT_QUEUE queue;
+	KEYBOARD_INPUT_DATA inputs[8];
+	HANDLE capture;
+	LONG64 allocations = 0;
+	ULONG failures = 0;
+
+	TestHostOpen(&test);
+	capture = CreateCaptureHandle();
+	EMU_CHECK(KeyboardSetActiveDeviceHandle(capture, test.Devices[0]));
+	EMU_CHECK(KeyboardInsertQueueOpen(capture, 4, NULL, &queue));
+	memset(inputs, 0, sizeof(inputs));
+
+	//the first round grows the buffer of every slot, the rest must reuse them
+	for (ULONG insert = 0; insert < 400; insert++)
+	{
+		if (insert == 4)
+			allocations = ShimHeapAllocations;
+		failures += !KeyboardInsertKeysAsync(&queue, inputs, ARRAYSIZE(inputs), NULL);
+	}
+	EMU_CHECK_EQUAL(failures, 0);
+	EMU_CHECK_EQUAL(ShimHeapAllocations - allocations, 0);
+	EMU_CHECK(KeyboardInsertQueueClose(&queue));
+
+	DisposeHandle(capture);
+	TestHostClose(&test);
+}
+
+static void TestMouseCondition(void)
+{
+	TEST_HOST test;
+	EMU_RULE rule = { EMU_CONDITION_BUTTON_DOWN, MOUSE_RIGHT_BUTTON_DOWN, EMU_RULE_REMAP, FLAG_KEY_PRESS, SCAN_W, SCAN_UP };
+	EMU_RULE_REQUEST ruleRequest = { 1, &rule };
+	MOUSE_INPUT_DATA button;
+	KEY_CAPTURE_RECORD records[4];
+	ULONG mouse;
+
+	TestHostOpen(&test);
+	mouse = EmuHostAddDevice(test.Host, EMU_HOST_MOUSE, "HID\\VID_046D&PID_C077\\6&3b2f2e4&0&0000");
+	EMU_CHECK(KeyboardSetRules(test.Driver, &ruleRequest));
+
+	Press(&test, test.Devices[0], SCAN_W, KEY_MAKE);
+	Press(&test, test.Devices[0], SCAN_W, KEY_BREAK);
+	memset(&button, 0, sizeof(button));
+	button.ButtonFlags = MOUSE_RIGHT_BUTTON_DOWN;
+	EMU_CHECK(EmuHostInput(test.Host, EMU_HOST_MOUSE, mouse, &button, 1));
+	Press(&test, test.Devices[0], SCAN_W, KEY_MAKE);
+	//the release while the button is still held
+	Press(&test, test.Devices[0], SCAN_W, KEY_BREAK);
+
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 4);
+	EMU_CHECK_EQUAL(records[0].Input.MakeCode, SCAN_W);
+	EMU_CHECK_EQUAL(records[1].Input.MakeCode, SCAN_W);
+	EMU_CHECK_EQUAL(records[2].Input.MakeCode, SCAN_UP);
+	EMU_CHECK_EQUAL(records[3].Input.MakeCode, SCAN_UP);
+
+	TestHostClose(&test);
+}
+
+static void TestProfiles(void)
+{
+	TEST_HOST test;
+	KEY_PROFILE_DATA profile;
+	KEY_FILTER_REQUEST all = { FILTER_KEY_ALL, 0, NULL };
+	KEY_CAPTURE_RECORD records[4];
+
+	TestHostOpen(&test);
+	memset(&profile, 0, sizeof(profile));
+	profile.ActiveProfile = 0;
+	profile.EditProfile = 1;
+	profile.Hotkeys[1].ScanCode = SCAN_F1;
+	EMU_CHECK(KeyboardSetProfile(test.Driver, &profile));
+	EMU_CHECK(KeyboardSetKeyFiltering(test.Driver, &all));
+
+	Press(&test, test.Devices[0], SCAN_A, KEY_MAKE);
+	Press(&test, test.Devices[0], SCAN_A, KEY_BREAK);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 2);
+
+	//the hotkey is consumed and activates the profile that drops everything
+	Press(&test, test.Devices[0], SCAN_F1, KEY_MAKE);
+	Press(&test, test.Devices[0], SCAN_F1, KEY_BREAK);
+	Press(&test, test.Devices[0], SCAN_A, KEY_MAKE);
+	EMU_CHECK(KeyboardGetProfile(test.Driver, &profile));
+	EMU_CHECK_EQUAL(profile.ActiveProfile, 1);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 0);
+
+	//the release goes through the profile its press went through
+	EMU_CHECK(KeyboardSwitchProfile(test.Driver, 0));
+	Press(&test, test.Devices[0], SCAN_A, KEY_BREAK);
+	Press(&test, test.Devices[0], SCAN_B, KEY_MAKE);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 1);
+	EMU_CHECK_EQUAL(records[0].Input.MakeCode, SCAN_B);
+
+	EMU_CHECK(!KeyboardSwitchProfile(test.Driver, KEY_PROFILE_COUNT));
+	EMU_CHECK_EQUAL(GetLastError(), ERROR_INVALID_PARAMETER);
+
+	TestHostClose(&test);
+}
+
+static void TestAutofire(void)
+{
+	TEST_HOST test;
+	KEY_AUTOFIRE_DATA autofire = { SCAN_A, 0, SCAN_B, 0, 10000, 4000 };
+	KEY_AUTOFIRE_DATA read;
+	KEY_CAPTURE_RECORD records[16];
+	KEY_STATS stats;
+
+	TestHostOpen(&test);
+	EMU_CHECK(KeyboardSetAutofire(test.Driver, &autofire));
+	EMU_CHECK(KeyboardGetAutofire(test.Driver, &read));
+	EMU_CHECK_EQUAL(read.PeriodMicroseconds, 10000);
+
+	Press(&test, test.Devices[0], SCAN_A, KEY_MAKE);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 1);
+	EMU_CHECK_EQUAL(records[0].Input.MakeCode, SCAN_B);
+	EMU_CHECK_EQUAL(records[0].Input.Flags, KEY_MAKE);
+
+	//two full cycles on the virtual clock
+	EmuHostAdvance(test.Host, 20000);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 4);
+	EMU_CHECK_EQUAL(records[0].Input.Flags, KEY_BREAK);
+	EMU_CHECK_EQUAL(records[1].Input.Flags, KEY_MAKE);
+	EMU_CHECK_EQUAL(records[2].Input.Flags, KEY_BREAK);
+	EMU_CHECK_EQUAL(records[3].Input.Flags, KEY_MAKE);
+
+	//releasing the trigger releases the output and stops the timer
+	Press(&test, test.Devices[0], SCAN_A, KEY_BREAK);
+	EmuHostAdvance(test.Host, 50000);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 1);
+	EMU_CHECK_EQUAL(records[0].Input.MakeCode, SCAN_B);
+	EMU_CHECK_EQUAL(records[0].Input.Flags, KEY_BREAK);
+
+	EMU_CHECK(KeyboardGetStats(test.Driver, &stats, sizeof(stats)));
+	EMU_CHECK_EQUAL(stats.Expanded, 4);
+
+	autofire.PeriodMicroseconds = KEY_AUTOFIRE_MIN_PERIOD - 1;
+	EMU_CHECK(!KeyboardSetAutofire(test.Driver, &autofire));
+
+	TestHostClose(&test);
+}
+
+static void TestCaptureRequests(void)
+{
+	TEST_HOST test;
+	KEY_CAPTURE_CONFIG config = { KEY_CAPTURE_FILTERED | KEY_CAPTURE_PASSED, KEY_CAPTURE_DELIVERY_REQUESTS, 0 };
+	KEY_FILTER_DATA filter = { FLAG_KEY_PRESS, SCAN_A };
+	KEY_FILTER_REQUEST filterRequest = { FILTER_KEY_FLAG_AND_SCANCODE, 1, &filter };
+	KEY_CAPTURE_RECORD records[8];
+	PKEY_CAPTURE_RECORD many;
+	OVERLAPPED overlapped;
+	HANDLE capture;
+	DWORD bytes = 0;
+
+	TestHostOpen(&test);
+	capture = CreateCaptureHandle();
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	EMU_CHECK(KeyboardSetKeyFiltering(test.Driver, &filterRequest));
+	EMU_CHECK(KeyboardSetCapture(test.Driver, &config));
+
+	EMU_CHECK(KeyboardCapture(capture, records, ARRAYSIZE(records), &overlapped));
+	EMU_CHECK(!GetOverlappedResult(capture, &overlapped, &bytes, FALSE));
+	EMU_CHECK_EQUAL(GetLastError(), ERROR_IO_INCOMPLETE);
+	Press(&test, test.Devices[0], SCAN_A, KEY_MAKE);
+	EMU_CHECK(GetOverlappedResult(capture, &overlapped, &bytes, FALSE));
+	EMU_CHECK_EQUAL(bytes, sizeof(KEY_CAPTURE_RECORD));
+	EMU_CHECK_EQUAL(records[0].Source, KEY_CAPTURE_FILTERED);
+	EMU_CHECK_EQUAL(records[0].DeviceHandle, test.Devices[0]);
+
+	//with a latency the keys of several reports batch until it runs out
+	config.LatencyMicroseconds = 1000;
+	EMU_CHECK(KeyboardSetCapture(test.Driver, &config));
+	EMU_CHECK(KeyboardCapture(capture, records, ARRAYSIZE(records), &overlapped));
+	Press(&test, test.Devices[1], SCAN_B, KEY_MAKE);
+	EmuHostAdvance(test.Host, 500);
+	Press(&test, test.Devices[1], SCAN_B, KEY_BREAK);
+	EMU_CHECK(!GetOverlappedResult(capture, &overlapped, &bytes, FALSE));
+	EMU_CHECK_EQUAL(GetLastError(), ERROR_IO_INCOMPLETE);
+	EmuHostAdvance(test.Host, 500);
+	EMU_CHECK(GetOverlappedResult(capture, &overlapped, &bytes, FALSE));
+	EMU_CHECK_EQUAL(bytes, 2 * sizeof(KEY_CAPTURE_RECORD));
+	EMU_CHECK_EQUAL(records[0].Source, KEY_CAPTURE_PASSED);
+	EMU_CHECK(records[1].Timestamp > records[0].Timestamp);
+
+	//closing the handle aborts the open batch, its keys go with it
+	EMU_CHECK(KeyboardCapture(capture, records, ARRAYSIZE(records), &overlapped));
+	Press(&test, test.Devices[1], SCAN_B, KEY_MAKE);
+	DisposeHandle(capture);
+	EMU_CHECK(!GetOverlappedResult(capture, &overlapped, &bytes, FALSE));
+	EMU_CHECK_EQUAL(GetLastError(), ERROR_OPERATION_ABORTED);
+	capture = CreateCaptureHandle();
+	EMU_CHECK(KeyboardCapture(capture, records, ARRAYSIZE(records), &overlapped));
+	Press(&test, test.Devices[1], SCAN_B, KEY_BREAK);
+	EmuHostAdvance(test.Host, 1000);
+	EMU_CHECK(GetOverlappedResult(capture, &overlapped, &bytes, FALSE));
+	EMU_CHECK_EQUAL(bytes, sizeof(KEY_CAPTURE_RECORD));
+	EMU_CHECK_EQUAL(records[0].Input.Flags, KEY_BREAK);
+
+	//a batch holds at most KEY_CAPTURE_BATCH_MAX records whatever the buffer
+	many = (PKEY_CAPTURE_RECORD)malloc((KEY_CAPTURE_BATCH_MAX + 8) * sizeof(KEY_CAPTURE_RECORD));
+	EMU_CHECK(many != NULL);
+	EMU_CHECK(KeyboardCapture(capture, many, KEY_CAPTURE_BATCH_MAX + 8, &overlapped));
+	for (ULONG i = 0; i < KEY_CAPTURE_BATCH_MAX; i++)
+		Press(&test, test.Devices[1], SCAN_B, (USHORT)(i & 1 ? KEY_BREAK : KEY_MAKE));
+	EMU_CHECK(GetOverlappedResult(capture, &overlapped, &bytes, FALSE));
+	EMU_CHECK_EQUAL(bytes, KEY_CAPTURE_BATCH_MAX * sizeof(KEY_CAPTURE_RECORD));
+	free(many);
+
+	CloseHandle(overlapped.hEvent);
+	DisposeHandle(capture);
+	TestHostClose(&test);
+}
+
+static void TestCaptureRing(void)
+{
+	TEST_HOST test;
+	KEY_CAPTURE_CONFIG config = { KEY_CAPTURE_PASSED, KEY_CAPTURE_DELIVERY_RING, 0 };
+	KEY_CAPTURE_READER reader;
+	KEY_CAPTURE_RECORD records[8];
+
+	TestHostOpen(&test);
+	EMU_CHECK(KeyboardSetCapture(test.Driver, &config));
+	EMU_CHECK(KeyboardOpenCaptureRing(test.Driver, &reader));
+	EMU_CHECK_EQUAL(KeyboardReadCaptureRing(&reader, records, ARRAYSIZE(records), 0), 0);
+	//the reader may only write the WaitMask, never the records
+	EMU_CHECK(!MappedWritable(reader.Ring.Header));
+	EMU_CHECK(MappedWritable(reader.Ring.WaitMask));
+
+	Press(&test, test.Devices[0], SCAN_A, KEY_MAKE);
+	Press(&test, test.Devices[1], SCAN_B, KEY_MAKE);
+	EMU_CHECK_EQUAL(KeyboardReadCaptureRing(&reader, records, ARRAYSIZE(records), 0), 2);
+	EMU_CHECK_EQUAL(records[0].Input.MakeCode, SCAN_A);
+	EMU_CHECK_EQUAL(records[1].DeviceHandle, test.Devices[1]);
+	EMU_CHECK(KeyboardCloseCaptureRing(test.Driver, &reader));
+
+	TestHostClose(&test);
+}
+
+static void TestDetect(void)
+{
+	TEST_HOST test;
+	KEY_DETECT_RESULT result;
+	OVERLAPPED overlapped;
+	HANDLE detect;
+	DWORD bytes = 0;
+
+	TestHostOpen(&test);
+	//a request only stays pending on a handle opened for overlapped IO
+	detect = CreateCaptureHandle();
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+	EMU_CHECK(KeyboardDetectDevice(detect, 0, &result, &overlapped));
+	EmuHostAdvance(test.Host, 1000000);
+	EMU_CHECK(!GetOverlappedResult(detect, &overlapped, &bytes, FALSE));
+	Press(&test, test.Devices[1], SCAN_A, KEY_MAKE);
+	EMU_CHECK(GetOverlappedResult(detect, &overlapped, &bytes, FALSE));
+	EMU_CHECK_EQUAL(result.DeviceHandle, test.Devices[1]);
+
+	EMU_CHECK(KeyboardDetectDevice(detect, 50, &result, &overlapped));
+	EmuHostAdvance(test.Host, 49000);
+	EMU_CHECK(!GetOverlappedResult(detect, &overlapped, &bytes, FALSE));
+	EMU_CHECK_EQUAL(GetLastError(), ERROR_IO_INCOMPLETE);
+	EmuHostAdvance(test.Host, 1000);
+	EMU_CHECK(!GetOverlappedResult(detect, &overlapped, &bytes, FALSE));
+	EMU_CHECK_EQUAL(GetLastError(), ERROR_SEM_TIMEOUT);
+
+	CloseHandle(overlapped.hEvent);
+	DisposeHandle(detect);
+	TestHostClose(&test);
+}
+
+static void TestParkedConfiguration(void)
+{
+	TEST_HOST test;
+	KEY_FILTER_DATA filter = { FLAG_KEY_PRESS, SCAN_A };
+	KEY_FILTER_REQUEST filterRequest = { FILTER_KEY_FLAG_AND_SCANCODE, 1, &filter };
+	KEY_CAPTURE_RECORD records[4];
+	ULONG handle;
+
+	TestHostOpen(&test);
+	EMU_CHECK(KeyboardSetActiveDeviceHandle(test.Driver, test.Devices[1]));
+	EMU_CHECK(KeyboardSetKeyFiltering(test.Driver, &filterRequest));
+	EMU_CHECK(KeyboardSaveProfiles(test.Driver));
+
+	//unplugged and plugged back, the keyboard keeps its handle and its filter
+	EMU_CHECK(EmuHostRemoveDevice(test.Host, EMU_HOST_KEYBOARD, test.Devices[1]));
+	EMU_CHECK(!KeyboardSetKeyFiltering(test.Driver, &filterRequest));
+	handle = EmuHostAddDevice(test.Host, EMU_HOST_KEYBOARD, "HID\\VID_046D&PID_C31C\\7&2a8f1d9&0&0000");
+	EMU_CHECK_EQUAL(handle, test.Devices[1]);
+	Press(&test, handle, SCAN_A, KEY_MAKE);
+	Press(&test, handle, SCAN_B, KEY_MAKE);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 1);
+	EMU_CHECK_EQUAL(records[0].Input.MakeCode, SCAN_B);
+
+	TestHostClose(&test);
+}
+
+static void TestBroadcastRules(void)
+{
+	TEST_HOST test;
+	EMU_RULE rule = { EMU_CONDITION_NONE, 0, EMU_RULE_DROP, FLAG_KEY_PRESS, SCAN_B, 0 };
+	EMU_RULE_REQUEST ruleRequest = { 1, &rule };
+	KEY_STATS_CONFIG statsConfig = { KEY_STATS_RULE_HITS };
+	EMU_RULE readRules[2];
+	EMU_RULE_REQUEST readRequest = { ARRAYSIZE(readRules), readRules };
+	KEY_CAPTURE_RECORD records[4];
+	KEY_STATS stats;
+
+	TestHostOpen(&test);
+	EMU_CHECK(KeyboardSetStats(test.Driver, &statsConfig));
+	EMU_CHECK(KeyboardBroadcastRules(test.Driver, test.Devices, 2, &ruleRequest));
+	EMU_CHECK(KeyboardSetActiveDeviceHandle(test.Driver, test.Devices[1]));
+	EMU_CHECK(KeyboardGetRules(test.Driver, &readRequest));
+	EMU_CHECK_EQUAL(readRequest.RuleCount, 1);
+	EMU_CHECK_EQUAL(readRules[0].From, SCAN_B);
+
+	Press(&test, test.Devices[0], SCAN_B, KEY_MAKE);
+	Press(&test, test.Devices[1], SCAN_B, KEY_MAKE);
+	Press(&test, test.Devices[1], SCAN_C, KEY_MAKE);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 1);
+	EMU_CHECK_EQUAL(records[0].Input.MakeCode, SCAN_C);
+
+	//the table is shared, its hits add up over both keyboards
+	EMU_CHECK(KeyboardGetStats(test.Driver, &stats, sizeof(stats)));
+	EMU_CHECK_EQUAL(stats.RuleCount, 1);
+	EMU_CHECK(stats.RuleHitsCounted);
+	EMU_CHECK_EQUAL(stats.RuleHits[0], 2);
+
+	TestHostClose(&test);
+}
+
+static void TestLatency(void)
+{
+	TEST_HOST test;
+	KEY_LATENCY_REQUEST request = { 0x8000 };
+	KEYBOARD_INPUT_DATA input;
+	KEY_LATENCY latency;
+	DWORD bytes = 0;
+
+	TestHostOpen(&test);
+	Press(&test, test.Devices[0], SCAN_A, KEY_MAKE);
+	Press(&test, test.Devices[0], SCAN_A, KEY_BREAK);
+	//the second keyboard has histograms of its own
+	Press(&test, test.Devices[1], SCAN_B, KEY_MAKE);
+	EMU_CHECK(KeyboardGetLatency(test.Driver, TRUE, &latency));
+	EMU_CHECK_EQUAL(latency.Frequency, 1000000000LL);
+	EMU_CHECK_EQUAL(EmuHistogramTotal(&latency.Histograms[EMU_HIST_BATCH]), 2);
+	EMU_CHECK_EQUAL(EmuHistogramTotal(&latency.Histograms[EMU_HIST_CALLBACK]), 2);
+	EMU_CHECK_EQUAL(EmuHistogramTotal(&latency.Histograms[EMU_HIST_INJECT]), 0);
+
+	//the reset starts the next interval right after the returned histograms
+	memset(&input, 0, sizeof(input));
+	input.MakeCode = SCAN_B;
+	EMU_CHECK(KeyboardInsertKeys(test.Driver, &input, 1));
+	EMU_CHECK(KeyboardGetLatency(test.Driver, FALSE, &latency));
+	EMU_CHECK_EQUAL(EmuHistogramTotal(&latency.Histograms[EMU_HIST_BATCH]), 0);
+	EMU_CHECK_EQUAL(EmuHistogramTotal(&latency.Histograms[EMU_HIST_CALLBACK]), 0);
+	EMU_CHECK_EQUAL(EmuHistogramTotal(&latency.Histograms[EMU_HIST_INJECT]), 1);
+
+	EMU_CHECK_EQUAL(test.Transport.IoControl(test.Transport.Context, test.Driver, IOCTL_KEYBOARD_GET_LATENCY,
+		&request, sizeof(request), &latency, sizeof(latency), &bytes, NULL), ERROR_INVALID_PARAMETER);
+
+	TestHostClose(&test);
+}
+
+static void TestTrace(void)
+{
+	TEST_HOST test;
+	KEY_FILTER_DATA filter = { FLAG_KEY_PRESS, SCAN_A };
+	KEY_FILTER_REQUEST filterRequest = { FILTER_KEY_FLAG_AND_SCANCODE, 1, &filter };
+	static const USHORT events[] = { EMU_TRACE_INPUT, EMU_TRACE_FILTER, EMU_TRACE_DONE, EMU_TRACE_INPUT, EMU_TRACE_DONE };
+	static UCHAR dump[sizeof(EMU_TRACE_DUMP) + sizeof(EMU_TRACE_CHUNK) + 16 * sizeof(EMU_TRACE_RECORD)];
+	EMU_TRACE_CURSOR cursor;
+	EMU_TRACE_RECORD record;
+	LONG64 frequency = 0;
+	ULONG bytes = 0;
+	ULONG count = 0;
+
+	TestHostOpen(&test);
+	EMU_CHECK(KeyboardSetKeyFiltering(test.Driver, &filterRequest));
+	//nothing is recorded before tracing is enabled
+	Press(&test, test.Devices[0], SCAN_B, KEY_MAKE);
+	EMU_CHECK(KeyboardReadTrace(test.Driver, dump, sizeof(dump), &bytes));
+	EMU_CHECK_EQUAL(bytes, sizeof(EMU_TRACE_DUMP));
+
+	EMU_CHECK(KeyboardSetTrace(test.Driver, TRUE));
+	Press(&test, test.Devices[0], SCAN_A, KEY_MAKE);
+	Press(&test, test.Devices[1], SCAN_B, KEY_BREAK);
+	EMU_CHECK(KeyboardReadTrace(test.Driver, dump, sizeof(dump), &bytes));
+	EMU_CHECK(EmuTraceOpen(&cursor, dump, bytes, &frequency));
+	EMU_CHECK_EQUAL(frequency, 1000000000LL);
+	while (EmuTraceNext(&cursor, &record))
+	{
+		if (count < ARRAYSIZE(events))
+			EMU_CHECK_EQUAL(record.Event, events[count]);
+		if (record.Event == EMU_TRACE_FILTER)
+			EMU_CHECK_EQUAL(record.Arg1, SCAN_A | (ULONG)KEY_MAKE << 16);
+		if (record.Event == EMU_TRACE_DONE)
+			EMU_CHECK_EQUAL(record.Arg0, count == 2 ? 1 : 0);
+		count++;
+	}
+	EMU_CHECK_EQUAL(count, ARRAYSIZE(events));
+
+	//the read drained the ring, and a disabled trace stays empty
+	EMU_CHECK(KeyboardSetTrace(test.Driver, FALSE));
+	Press(&test, test.Devices[0], SCAN_B, KEY_MAKE);
+	EMU_CHECK(KeyboardReadTrace(test.Driver, dump, sizeof(dump), &bytes));
+	EMU_CHECK_EQUAL(bytes, sizeof(EMU_TRACE_DUMP));
+	EMU_CHECK(!KeyboardReadTrace(test.Driver, dump, sizeof(EMU_TRACE_DUMP) - 1, &bytes));
+
+	TestHostClose(&test);
+}
+
+static void TestSteadyStateAllocations(void)
+{
+	TEST_HOST test;
+	KEY_FILTER_DATA filters[32];
+	KEY_FILTER_REQUEST filterRequest = { FILTER_KEY_FLAG_AND_SCANCODE, ARRAYSIZE(filters), filters };
+	KEY_FILTER_DATA readFilters[ARRAYSIZE(filters) + 1];
+	KEY_FILTER_REQUEST readRequest;
+	KEY_MODIFY_DATA modifies[32];
+	KEY_MODIFY_REQUEST modifyRequest = { ARRAYSIZE(modifies), modifies };
+	KEY_FILTER_DATA extraFilter = { FLAG_KEY_PRESS, 0x7F };
+	KEY_MODIFY_DATA extraModify = { FLAG_KEY_PRESS, 0x7F, SCAN_A };
+	EMU_RULE rule = { EMU_CONDITION_NONE, 0, EMU_RULE_DROP, FLAG_KEY_PRESS, SCAN_B, 0 };
+	EMU_RULE_REQUEST ruleRequest = { 1, &rule };
+	LONG64 allocations = 0;
+	ULONG failures = 0;
+
+	TestHostOpen(&test);
+	for (USHORT i = 0; i < ARRAYSIZE(filters); i++)
+	{
+		filters[i].FlagPredicates = FLAG_KEY_PRESS;
+		filters[i].ScanCode = (USHORT)(0x40 + i);
+		modifies[i].FlagPredicates = FLAG_KEY_PRESS;
+		modifies[i].FromScanCode = (USHORT)(0x10 + i);
+		modifies[i].ToScanCode = SCAN_C;
+	}
+
+	//the first round grows the scratch buffers of the thread, the rest must reuse them
+	for (ULONG round = 0; round < 100; round++)
+	{
+		if (round == 1)
+			allocations = ShimHeapAllocations;
+		failures += !KeyboardSetKeyFiltering(test.Driver, &filterRequest);
+		readRequest.FilterCount = ARRAYSIZE(readFilters);
+		readRequest.FilterData = readFilters;
+		failures += !KeyboardGetKeyFiltering(test.Driver, &readRequest);
+		failures += !KeyboardAddKeyFiltering(test.Driver, &extraFilter);
+		failures += !KeyboardRemoveKeyFiltering(test.Driver, &extraFilter);
+		failures += !KeyboardSetKeyModifying(test.Driver, &modifyRequest);
+		failures += !KeyboardAddKeyModifying(test.Driver, &extraModify);
+		failures += !KeyboardRemoveKeyModifying(test.Driver, &extraModify);
+		failures += !KeyboardSetRules(test.Driver, &ruleRequest);
+		failures += !KeyboardBroadcastRules(test.Driver, test.Devices, 2, &ruleRequest);
+	}
+	EMU_CHECK_EQUAL(failures, 0);
+	EMU_CHECK_EQUAL(ShimHeapAllocations - allocations, 0);
+	EMU_CHECK_EQUAL(readRequest.FilterCount, ARRAYSIZE(filters));
+
+	TestHostClose(&test);
+}
+
+int main(void)
+{
+	TestDevices();
+	TestFilterAndModify();
+	TestRuleEditConflict();
+	TestRacingRuleEdits();
+	TestInsert();
+	TestInsertQueue();
+	TestInsertQueueAllocations();
+	TestMouseCondition();
+	TestProfiles();
+	TestAutofire();
+	TestCaptureRequests();
+#ifndef EMU_HOST_REMOTE
+	//the ring can only be mapped in the process of the host
+	TestCaptureRing();
+#endif
+	TestDetect();
+	TestParkedConfiguration();
+	TestBroadcastRules();
+	TestLatency();
+	TestTrace();
+	TestSteadyStateAllocations();
+	return EMU_TEST_RESULT();
+}
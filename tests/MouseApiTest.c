@@ -0,0 +1,741 @@
+/*++
+
+Module Name:
+
+	MouseApiTest.c
+
+Abstract:
+
+	Drives MouseEmuAPI through the in process host of host/: device
+	selection, filter modes and button modifications, rule edits racing
+	another client, insert queues with and without latency on the host,
+	conditional rules on a held key, profile hotkeys, absolute remapping,
+	button autofire on the virtual clock, capture requests, the capture
+	ring, detection, parked configurations, latency histograms and the
+	trace ring, and rule calls and inserts
+	that make no heap allocations once warm. What the filter
+	passes on is read back from the mock class service.
+
+	Built with EMU_HOST_REMOTE the same tests run against EmuSimulator,
+	all but the capture ring, which can not be mapped across processes.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include "EmuTest.h"
+#include "host/EmuHost.h"
+#include "../Dll/Native/MouseEmuAPI/MouseEmuAPI.h"
+
+#define SCAN_LSHIFT 0x2A
+
+typedef struct _TEST_HOST {
+	PEMU_HOST Host;
+	EMU_TRANSPORT Transport;
+	HANDLE Driver;
+	ULONG Devices[2];
+} TEST_HOST, * PTEST_HOST;
+
+static void TestHostOpen(PTEST_HOST Test)
+{
+	Test->Host = EmuHostCreate();
+	EmuHostTransport(Test->Host, EMU_HOST_MOUSE, &Test->Transport);
+	MouseSetTransport(&Test->Transport);
+	Test->Devices[0] = EmuHostAddDevice(Test->Host, EMU_HOST_MOUSE, "ACPI\\PNP0F13\\4&1d401fb5&0");
+	Test->Devices[1] = EmuHostAddDevice(Test->Host, EMU_HOST_MOUSE, "HID\\VID_046D&PID_C077\\6&3b2f2e4&0&0000");
+	Test->Driver = CreateDriverHandle();
+}
+
+static void TestHostClose(PTEST_HOST Test)
+{
+	DisposeHandle(Test->Driver);
+	EmuHostDestroy(Test->Host);
+}
+
+static void Click(PTEST_HOST Test, ULONG Device, USHORT ButtonFlags)
+{
+	MOUSE_INPUT_DATA input;
+
+	memset(&input, 0, sizeof(input));
+	input.ButtonFlags = ButtonFlags;
+	EmuHostInput(Test->Host, EMU_HOST_MOUSE, Device, &input, 1);
+}
+
+static void Move(PTEST_HOST Test, ULONG Device, USHORT Flags, LONG X, LONG Y)
+{
+	MOUSE_INPUT_DATA input;
+
+	memset(&input, 0, sizeof(input));
+	input.Flags = Flags;
+	input.LastX = X;
+	input.LastY = Y;
+	EmuHostInput(Test->Host, EMU_HOST_MOUSE, Device, &input, 1);
+}
+
+static ULONG Delivered(PTEST_HOST Test, PMOUSE_CAPTURE_RECORD Records, ULONG Capacity)
+{
+	return EmuHostDelivered(Test->Host, EMU_HOST_MOUSE, Records, Capacity);
+}
+
+static void TestDevices(void)
+{
+	TEST_HOST test;
+	MOUSE_QUERY_RESULT query;
+	MOUSE_DEVICE_INFO devices[4];
+	MOUSE_ATTRIBUTES attributes;
+	ULONG count = 0;
+
+	TestHostOpen(&test);
+	EMU_CHECK(test.Driver != INVALID_HANDLE_VALUE);
+	EMU_CHECK(MouseGetDevices(test.Driver, &query));
+	EMU_CHECK_EQUAL(query.NumberOfDevices, 2);
+	EMU_CHECK(MouseGetDeviceHandles(test.Driver, devices, ARRAYSIZE(devices), &count));
+	EMU_CHECK_EQUAL(count, 2);
+	EMU_CHECK_EQUAL(devices[0].DeviceHandle, test.Devices[0]);
+	EMU_CHECK_EQUAL(devices[1].DeviceHandle, test.Devices[1]);
+
+	EMU_CHECK(MouseSetActiveDeviceHandle(test.Driver, test.Devices[1]));
+	EMU_CHECK(!MouseSetActiveDeviceHandle(test.Driver, 0x7FFF0000));
+	EMU_CHECK_EQUAL(GetLastError(), ERROR_FILE_NOT_FOUND);
+
+	EMU_CHECK(MouseGetAttributes(test.Driver, &attributes));
+	EMU_CHECK_EQUAL(attributes.NumberOfButtons, 5);
+
+	TestHostClose(&test);
+}
+
+static void TestFilterAndModify(void)
+{
+	TEST_HOST test;
+	MOUSE_MODIFY_DATA modify = { MOUSE_LEFT_BUTTON_DOWN, MOUSE_MIDDLE_BUTTON_DOWN };
+	MOUSE_FILTER_MODE filterMode = FILTER_MOUSE_NONE;
+	MOUSE_CAPTURE_RECORD records[8];
+	MOUSE_STATS stats;
+
+	TestHostOpen(&test);
+	EMU_CHECK(MouseSetFilterMode(test.Driver, FILTER_MOUSE_RIGHT_BUTTON_PRESS));
+	EMU_CHECK(MouseGetFilterMode(test.Driver, &filterMode));
+	EMU_CHECK_EQUAL(filterMode, FILTER_MOUSE_RIGHT_BUTTON_PRESS);
+	EMU_CHECK(MouseAddButtonModification(test.Driver, &modify));
+
+	Click(&test, test.Devices[0], MOUSE_RIGHT_BUTTON_DOWN);
+	Click(&test, test.Devices[0], MOUSE_RIGHT_BUTTON_UP);
+	Click(&test, test.Devices[0], MOUSE_LEFT_BUTTON_DOWN);
+	Move(&test, test.Devices[0], MOUSE_MOVE_RELATIVE, 3, -2);
+	//the tables belong to the first mouse, the second one passes everything
+	Click(&test, test.Devices[1], MOUSE_RIGHT_BUTTON_DOWN);
+
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 3);
+	EMU_CHECK_EQUAL(records[0].Input.ButtonFlags, MOUSE_MIDDLE_BUTTON_DOWN);
+	EMU_CHECK_EQUAL(records[1].Input.LastX, 3);
+	EMU_CHECK_EQUAL(records[1].Input.LastY, -2);
+	EMU_CHECK_EQUAL(records[2].Input.ButtonFlags, MOUSE_RIGHT_BUTTON_DOWN);
+	EMU_CHECK_EQUAL(records[2].DeviceHandle, test.Devices[1]);
+
+	EMU_CHECK(MouseGetStats(test.Driver, &stats, sizeof(stats)));
+	EMU_CHECK_EQUAL(stats.Seen, 4);
+	EMU_CHECK_EQUAL(stats.Dropped, 2);
+	EMU_CHECK_EQUAL(stats.Modified, 1);
+
+	//moves are dropped as a whole
+	EMU_CHECK(MouseSetFilterMode(test.Driver, FILTER_MOUSE_MOVE));
+	Move(&test, test.Devices[0], MOUSE_MOVE_RELATIVE, 1, 1);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 0);
+
+	TestHostClose(&test);
+}
+
+static void TestRuleEditConflict(void)
+{
+	TEST_HOST test;
+	MOUSE_RULE_EDIT edit;
+	MOUSE_MODIFY_DATA left = { MOUSE_LEFT_BUTTON_DOWN, MOUSE_RIGHT_BUTTON_DOWN };
+	MOUSE_MODIFY_DATA right = { MOUSE_RIGHT_BUTTON_DOWN, MOUSE_LEFT_BUTTON_DOWN };
+	ULONG before = 0;
+	ULONG after = 0;
+
+	TestHostOpen(&test);
+	EMU_CHECK(MouseGetRuleGeneration(test.Driver, test.Devices[0], &before));
+	EMU_CHECK(MouseBeginRuleEdit(test.Driver, test.Devices[0], &edit));
+	EMU_CHECK(MouseRuleEditAddModification(&edit, &left));
+	EMU_CHECK(MouseCommitRuleEdit(&edit));
+	EMU_CHECK(MouseGetRuleGeneration(test.Driver, test.Devices[0], &after));
+	EMU_CHECK(after != before);
+	//the edit goes on from the generation the host committed, not one it guessed
+	EMU_CHECK_EQUAL(edit.Tables.Generation, after);
+
+	//another client changes the tables, the edit must not overwrite them
+	EMU_CHECK(MouseSetFilterMode(test.Driver, FILTER_MOUSE_WHEEL));
+	EMU_CHECK(MouseRuleEditAddModification(&edit, &right));
+	EMU_CHECK(!MouseCommitRuleEdit(&edit));
+	EMU_CHECK_EQUAL(GetLastError(), ERROR_REVISION_MISMATCH);
+	EMU_CHECK(MouseEndRuleEdit(&edit));
+
+	TestHostClose(&test);
+}
+
+static void TestInsert(void)
+{
+	TEST_HOST test;
+	MOUSE_INPUT_DATA inputs[2];
+	MOUSE_CAPTURE_RECORD records[4];
+	MOUSE_DEVICE_HEADER header;
+	MOUSE_STATS stats;
+	DWORD bytes = 0;
+
+	TestHostOpen(&test);
+	memset(inputs, 0, sizeof(inputs));
+	inputs[0].ButtonFlags = MOUSE_LEFT_BUTTON_DOWN;
+	inputs[1].ButtonFlags = MOUSE_LEFT_BUTTON_UP;
+
+	EMU_CHECK(MouseSetActiveDeviceHandle(test.Driver, test.Devices[1]));
+	EMU_CHECK(MouseInsertInputs(test.Driver, inputs, 2));
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 2);
+	EMU_CHECK_EQUAL(records[0].DeviceHandle, test.Devices[1]);
+	EMU_CHECK_EQUAL(records[1].Input.ButtonFlags, MOUSE_LEFT_BUTTON_UP);
+	EMU_CHECK(MouseGetStats(test.Driver, &stats, sizeof(stats)));
+	EMU_CHECK_EQUAL(stats.Injected, 2);
+
+	//a targeted IOCTL goes to its mouse whatever the handle selected
+	EMU_CHECK(MouseDeviceIoControl(test.Driver, test.Devices[0], IOCTL_MOUSE_INSERT_KEY,
+		inputs, sizeof(inputs), NULL, 0, &bytes));
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 2);
+	EMU_CHECK_EQUAL(records[0].DeviceHandle, test.Devices[0]);
+
+	//a generation is only taken by the sets of tables
+	header.DeviceHandle = test.Devices[0];
+	header.Generation = 1;
+	EMU_CHECK_EQUAL(test.Transport.IoControl(test.Transport.Context, test.Driver,
+		IOCTL_MOUSE_TARGETED(IOCTL_MOUSE_GET_STATS), &header, sizeof(header), &stats, sizeof(stats), &bytes, NULL),
+		ERROR_INVALID_PARAMETER);
+
+	TestHostClose(&test);
+}
+
+//
+//Completions reported by the insert queues, in the order they came
+//
+static struct {
+	ULONG Count;
+	ULONG_PTR Contexts[16];
+	DWORD Errors[16];
+	ULONG InputCounts[16];
+} Completions;
+
+static VOID RecordCompletion(PVOID Context, DWORD Error, ULONG InputCount)
+{
+	if (Completions.Count < ARRAYSIZE(Completions.Contexts)) {
+		Completions.Contexts[Completions.Count] = (ULONG_PTR)Context;
+		Completions.Errors[Completions.Count] = Error;
+		Completions.InputCounts[Completions.Count] = InputCount;
+	}
+	Completions.Count++;
+}
+
+static void TestInsertQueue(void)
+{
+	TEST_HOST test;
+	MOUSE_INSERT_QUEUE queue;
+	MOUSE_INPUT_DATA inputs[2];
+	MOUSE_CAPTURE_RECORD records[16];
+	HANDLE capture;
+	ULONG failures = 0;
+	ULONG i;
+
+	TestHostOpen(&test);
+	//inserts only stay in flight on a handle opened for overlapped IO
+	capture = CreateCaptureHandle();
+	EMU_CHECK(MouseSetActiveDeviceHandle(capture, test.Devices[1]));
+	EMU_CHECK(!MouseInsertQueueOpen(capture, 0, RecordCompletion, &queue));
+	EMU_CHECK(!MouseInsertQueueOpen(capture, MOUSE_INSERT_DEPTH_MAX + 1, RecordCompletion, &queue));
+	memset(inputs, 0, sizeof(inputs));
+	inputs[0].ButtonFlags = MOUSE_LEFT_BUTTON_DOWN;
+	inputs[1].ButtonFlags = MOUSE_LEFT_BUTTON_UP;
+
+	//without latency every insert completes as it is sent
+	memset(&Completions, 0, sizeof(Completions));
+	EMU_CHECK(MouseInsertQueueOpen(capture, 4, RecordCompletion, &queue));
+	for (i = 0; i < 6; i++)
+	{
+		inputs[0].LastX = inputs[1].LastX = (LONG)(i + 1);
+		failures += !MouseInsertInputsAsync(&queue, inputs, 2, (PVOID)(ULONG_PTR)(i + 1));
+	}
+	EMU_CHECK_EQUAL(failures, 0);
+	//the fifth insert found the queue full and reported the four before it
+	EMU_CHECK_EQUAL(Completions.Count, 4);
+	EMU_CHECK_EQUAL(MouseInsertQueueComplete(&queue, FALSE), 2);
+	EMU_CHECK_EQUAL(MouseInsertQueueComplete(&queue, FALSE), 0);
+	EMU_CHECK_EQUAL(Completions.Count, 6);
+	for (i = 0; i < 6; i++)
+	{
+		failures += Completions.Contexts[i] != i + 1;
+		failures += Completions.Errors[i] != ERROR_SUCCESS;
+		failures += Completions.InputCounts[i] != 2;
+	}
+	EMU_CHECK_EQUAL(failures, 0);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 12);
+	for (i = 0; i < 12; i++)
+	{
+		failures += records[i].DeviceHandle != test.Devices[1];
+		failures += records[i].Input.LastX != (LONG)(i / 2 + 1);
+		failures += records[i].Input.ButtonFlags != ((i & 1) ? MOUSE_LEFT_BUTTON_UP : MOUSE_LEFT_BUTTON_DOWN);
+	}
+	EMU_CHECK_EQUAL(failures, 0);
+	EMU_CHECK(MouseInsertQueueClose(&queue));
+
+	//with latency the inserts stay in flight until the host completes them
+	memset(&Completions, 0, sizeof(Completions));
+	EmuHostSetInsertLatency(test.Host, 20000);
+	EMU_CHECK(MouseInsertQueueOpen(capture, 4, RecordCompletion, &queue));
+	for (i = 0; i < 4; i++)
+	{
+		inputs[0].LastX = inputs[1].LastX = (LONG)(i + 1);
+		failures += !MouseInsertInputsAsync(&queue, inputs, 2, (PVOID)(ULONG_PTR)(i + 1));
+	}
+	EMU_CHECK_EQUAL(failures, 0);
+	EMU_CHECK_EQUAL(MouseInsertQueueComplete(&queue, FALSE), 0);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 0);
+	EMU_CHECK(MouseInsertQueueComplete(&queue, TRUE) >= 1);
+	EMU_CHECK_EQUAL(Completions.Contexts[0], 1);
+	//closing waits for the rest
+	EMU_CHECK(MouseInsertQueueClose(&queue));
+	EMU_CHECK_EQUAL(Completions.Count, 4);
+	for (i = 0; i < 4; i++)
+	{
+		failures += Completions.Contexts[i] != i + 1;
+		failures += Completions.Errors[i] != ERROR_SUCCESS;
+	}
+	EMU_CHECK_EQUAL(failures, 0);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 8);
+	EMU_CHECK_EQUAL(records[7].Input.LastX, 4);
+
+	//a handle opened without overlapped IO completes every insert before it is queued
+	memset(&Completions, 0, sizeof(Completions));
+	EMU_CHECK(MouseSetActiveDeviceHandle(test.Driver, test.Devices[0]));
+	EMU_CHECK(MouseInsertQueueOpen(test.Driver, 4, RecordCompletion, &queue));
+	EMU_CHECK(MouseInsertInputsAsync(&queue, inputs, 2, NULL));
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 2);
+	EMU_CHECK_EQUAL(records[0].DeviceHandle, test.Devices[0]);
+	EMU_CHECK_EQUAL(MouseInsertQueueComplete(&queue, FALSE), 1);
+	EMU_CHECK(MouseInsertQueueClose(&queue));
+	EMU_CHECK_EQUAL(Completions.Count, 1);
+
+	DisposeHandle(capture);
+	TestHostClose(&test);
+}
+
+static void TestInsertQueueAllocations(void)
+{
+	TEST_HOST test;
+	MOUSE_INSERT_QUEUE queue;
+	MOUSE_INPUT_DATA inputs[8];
+	HANDLE capture;
+	LONG64 allocations = 0;
+	ULONG failures = 0;
+
+	TestHostOpen(&test);
+	capture = CreateCaptureHandle();
+	EMU_CHECK(MouseSetActiveDeviceHandle(capture, test.Devices[0]));
+	EMU_CHECK(MouseInsertQueueOpen(capture, 4, NULL, &queue));
+	memset(inputs, 0, sizeof(inputs));
+
+	//the first round grows the buffer of every slot, the rest must reuse them
+	for (ULONG insert = 0; insert < 400; insert++)
+	{
+		if (insert == 4)
+			allocations = ShimHeapAllocations;
+		failures += !MouseInsertInputsAsync(&queue, inputs, ARRAYSIZE(inputs), NULL);
+	}
+	EMU_CHECK_EQUAL(failures, 0);
+	EMU_CHECK_EQUAL(ShimHeapAllocations - allocations, 0);
+	EMU_CHECK(MouseInsertQueueClose(&queue));
+
+	DisposeHandle(capture);
+	TestHostClose(&test);
+}
+
+static void TestKeyCondition(void)
+{
+	TEST_HOST test;
+	EMU_RULE rule = { EMU_CONDITION_KEY_DOWN, EMU_KEY_INDEX(SCAN_LSHIFT, 0), EMU_RULE_REMAP, 0,
+		MOUSE_LEFT_BUTTON_DOWN, MOUSE_RIGHT_BUTTON_DOWN };
+	EMU_RULE_REQUEST ruleRequest = { 1, &rule };
+	KEYBOARD_INPUT_DATA key;
+	MOUSE_CAPTURE_RECORD records[4];
+	ULONG keyboard;
+
+	TestHostOpen(&test);
+	keyboard = EmuHostAddDevice(test.Host, EMU_HOST_KEYBOARD, "ACPI\\PNP0303\\4&1d401fb5&0");
+	EMU_CHECK(MouseSetRules(test.Driver, &ruleRequest));
+
+	Click(&test, test.Devices[0], MOUSE_LEFT_BUTTON_DOWN);
+	Click(&test, test.Devices[0], MOUSE_LEFT_BUTTON_UP);
+	memset(&key, 0, sizeof(key));
+	key.MakeCode = SCAN_LSHIFT;
+	EMU_CHECK(EmuHostInput(test.Host, EMU_HOST_KEYBOARD, keyboard, &key, 1));
+	Click(&test, test.Devices[0], MOUSE_LEFT_BUTTON_DOWN);
+	//the up follows its down through the rule even once the key is released
+	key.Flags = KEY_BREAK;
+	EMU_CHECK(EmuHostInput(test.Host, EMU_HOST_KEYBOARD, keyboard, &key, 1));
+	Click(&test, test.Devices[0], MOUSE_LEFT_BUTTON_UP);
+
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 4);
+	EMU_CHECK_EQUAL(records[0].Input.ButtonFlags, MOUSE_LEFT_BUTTON_DOWN);
+	EMU_CHECK_EQUAL(records[1].Input.ButtonFlags, MOUSE_LEFT_BUTTON_UP);
+	EMU_CHECK_EQUAL(records[2].Input.ButtonFlags, MOUSE_RIGHT_BUTTON_DOWN);
+	EMU_CHECK_EQUAL(records[3].Input.ButtonFlags, MOUSE_RIGHT_BUTTON_UP);
+
+	TestHostClose(&test);
+}
+
+static void TestProfiles(void)
+{
+	TEST_HOST test;
+	MOUSE_PROFILE_DATA profile;
+	MOUSE_CAPTURE_RECORD records[4];
+
+	TestHostOpen(&test);
+	memset(&profile, 0, sizeof(profile));
+	profile.EditProfile = 1;
+	profile.Hotkeys[1] = MOUSE_BUTTON_4_DOWN;
+	EMU_CHECK(MouseSetProfile(test.Driver, &profile));
+	EMU_CHECK(MouseSetFilterMode(test.Driver, FILTER_MOUSE_LEFT_BUTTON_PRESS));
+
+	Click(&test, test.Devices[0], MOUSE_LEFT_BUTTON_DOWN);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 1);
+
+	//the hotkey flags are stripped, the rest of the packet goes through the new profile
+	Click(&test, test.Devices[0], MOUSE_BUTTON_4_DOWN | MOUSE_LEFT_BUTTON_UP);
+	Click(&test, test.Devices[0], MOUSE_BUTTON_4_UP);
+	Click(&test, test.Devices[0], MOUSE_LEFT_BUTTON_DOWN);
+	EMU_CHECK(MouseGetProfile(test.Driver, &profile));
+	EMU_CHECK_EQUAL(profile.ActiveProfile, 1);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 2);
+	EMU_CHECK_EQUAL(records[0].Input.ButtonFlags, MOUSE_LEFT_BUTTON_UP);
+	EMU_CHECK_EQUAL(records[1].Input.ButtonFlags, 0);
+
+	//the up goes through the profile its down went through
+	EMU_CHECK(MouseSwitchProfile(test.Driver, 0));
+	Click(&test, test.Devices[0], MOUSE_LEFT_BUTTON_UP);
+	Click(&test, test.Devices[0], MOUSE_RIGHT_BUTTON_DOWN);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 1);
+	EMU_CHECK_EQUAL(records[0].Input.ButtonFlags, MOUSE_RIGHT_BUTTON_DOWN);
+
+	TestHostClose(&test);
+}
+
+static void TestAbsoluteMapping(void)
+{
+	TEST_HOST test;
+	MOUSE_ABSOLUTE_MAP map = { ABSOLUTE_MAP_ENABLED | ABSOLUTE_MAP_VIRTUAL_DESKTOP, 32768, 0, 65535, 32767 };
+	MOUSE_ABSOLUTE_MAP read;
+	MOUSE_CAPTURE_RECORD records[4];
+
+	TestHostOpen(&test);
+	EMU_CHECK(MouseSetAbsoluteMapping(test.Driver, &map));
+	EMU_CHECK(MouseGetAbsoluteMapping(test.Driver, &read));
+	EMU_CHECK_EQUAL(read.Left, 32768);
+
+	Move(&test, test.Devices[0], MOUSE_MOVE_ABSOLUTE, 0, 0);
+	Move(&test, test.Devices[0], MOUSE_MOVE_ABSOLUTE, 65535, 65535);
+	Move(&test, test.Devices[0], MOUSE_MOVE_RELATIVE, 5, 5);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 3);
+	EMU_CHECK_EQUAL(records[0].Input.LastX, 32768);
+	EMU_CHECK_EQUAL(records[0].Input.LastY, 0);
+	EMU_CHECK_EQUAL(records[0].Input.Flags, MOUSE_MOVE_ABSOLUTE | MOUSE_VIRTUAL_DESKTOP);
+	EMU_CHECK_EQUAL(records[1].Input.LastX, 65535);
+	EMU_CHECK_EQUAL(records[1].Input.LastY, 32767);
+	//relative moves are left alone
+	EMU_CHECK_EQUAL(records[2].Input.LastX, 5);
+
+	map.Right = 100;
+	EMU_CHECK(!MouseSetAbsoluteMapping(test.Driver, &map));
+
+	TestHostClose(&test);
+}
+
+static void TestAutofire(void)
+{
+	TEST_HOST test;
+	MOUSE_AUTOFIRE_DATA autofire = { MOUSE_LEFT_BUTTON_DOWN, MOUSE_LEFT_BUTTON_DOWN, 10000, 4000 };
+	MOUSE_CAPTURE_RECORD records[16];
+	MOUSE_STATS stats;
+
+	TestHostOpen(&test);
+	EMU_CHECK(MouseSetAutofire(test.Driver, &autofire));
+
+	Click(&test, test.Devices[0], MOUSE_LEFT_BUTTON_DOWN);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 1);
+	EMU_CHECK_EQUAL(records[0].Input.ButtonFlags, MOUSE_LEFT_BUTTON_DOWN);
+
+	//two full cycles on the virtual clock
+	EmuHostAdvance(test.Host, 20000);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 4);
+	EMU_CHECK_EQUAL(records[0].Input.ButtonFlags, MOUSE_LEFT_BUTTON_UP);
+	EMU_CHECK_EQUAL(records[1].Input.ButtonFlags, MOUSE_LEFT_BUTTON_DOWN);
+	EMU_CHECK_EQUAL(records[2].Input.ButtonFlags, MOUSE_LEFT_BUTTON_UP);
+	EMU_CHECK_EQUAL(records[3].Input.ButtonFlags, MOUSE_LEFT_BUTTON_DOWN);
+
+	//releasing the trigger releases the output and stops the timer
+	Click(&test, test.Devices[0], MOUSE_LEFT_BUTTON_UP);
+	EmuHostAdvance(test.Host, 50000);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 1);
+	EMU_CHECK_EQUAL(records[0].Input.ButtonFlags, MOUSE_LEFT_BUTTON_UP);
+
+	EMU_CHECK(MouseGetStats(test.Driver, &stats, sizeof(stats)));
+	EMU_CHECK_EQUAL(stats.Expanded, 4);
+
+	//the trigger must be a single button
+	autofire.TriggerButton = MOUSE_LEFT_BUTTON_DOWN | MOUSE_RIGHT_BUTTON_DOWN;
+	EMU_CHECK(!MouseSetAutofire(test.Driver, &autofire));
+
+	TestHostClose(&test);
+}
+
+static void TestCapture(void)
+{
+	TEST_HOST test;
+	MOUSE_CAPTURE_CONFIG config = { MOUSE_CAPTURE_FILTERED | MOUSE_CAPTURE_PASSED, MOUSE_CAPTURE_DELIVERY_REQUESTS, 1000 };
+	MOUSE_CAPTURE_READER reader;
+	MOUSE_CAPTURE_RECORD records[8];
+	OVERLAPPED overlapped;
+	HANDLE capture;
+	DWORD bytes = 0;
+
+	TestHostOpen(&test);
+	capture = CreateCaptureHandle();
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	EMU_CHECK(MouseSetFilterMode(test.Driver, FILTER_MOUSE_WHEEL));
+	EMU_CHECK(MouseSetCapture(test.Driver, &config));
+
+	//the packets of several reports batch until the latency runs out
+	EMU_CHECK(MouseCapture(capture, records, ARRAYSIZE(records), &overlapped));
+	Click(&test, test.Devices[0], MOUSE_WHEEL);
+	Move(&test, test.Devices[1], MOUSE_MOVE_RELATIVE, 1, 0);
+	EMU_CHECK(!GetOverlappedResult(capture, &overlapped, &bytes, FALSE));
+	EMU_CHECK_EQUAL(GetLastError(), ERROR_IO_INCOMPLETE);
+	EmuHostAdvance(test.Host, 1000);
+	EMU_CHECK(GetOverlappedResult(capture, &overlapped, &bytes, FALSE));
+	EMU_CHECK_EQUAL(bytes, 2 * sizeof(MOUSE_CAPTURE_RECORD));
+	EMU_CHECK_EQUAL(records[0].Source, MOUSE_CAPTURE_FILTERED);
+	EMU_CHECK_EQUAL(records[1].Source, MOUSE_CAPTURE_PASSED);
+	EMU_CHECK_EQUAL(records[1].DeviceHandle, test.Devices[1]);
+
+	config.Delivery = MOUSE_CAPTURE_DELIVERY_RING;
+	config.LatencyMicroseconds = 0;
+	EMU_CHECK(MouseSetCapture(test.Driver, &config));
+#ifndef EMU_HOST_REMOTE
+	EMU_CHECK(MouseOpenCaptureRing(test.Driver, &reader));
+	Move(&test, test.Devices[0], MOUSE_MOVE_RELATIVE, 7, 0);
+	EMU_CHECK_EQUAL(MouseReadCaptureRing(&reader, records, ARRAYSIZE(records), 0), 1);
+	EMU_CHECK_EQUAL(records[0].Input.LastX, 7);
+	EMU_CHECK(MouseCloseCaptureRing(test.Driver, &reader));
+#else
+	//the ring can only be mapped in the process of the host
+	EMU_CHECK(!MouseOpenCaptureRing(test.Driver, &reader));
+	EMU_CHECK_EQUAL(GetLastError(), ERROR_NOT_SUPPORTED);
+#endif
+
+	CloseHandle(overlapped.hEvent);
+	DisposeHandle(capture);
+	TestHostClose(&test);
+}
+
+static void TestDetect(void)
+{
+	TEST_HOST test;
+	MOUSE_DETECT_RESULT result;
+	OVERLAPPED overlapped;
+	HANDLE detect;
+	DWORD bytes = 0;
+
+	TestHostOpen(&test);
+	//a request only stays pending on a handle opened for overlapped IO
+	detect = CreateCaptureHandle();
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+	EMU_CHECK(MouseDetectDevice(detect, 0, &result, &overlapped));
+	Move(&test, test.Devices[1], MOUSE_MOVE_RELATIVE, 1, 1);
+	EMU_CHECK(GetOverlappedResult(detect, &overlapped, &bytes, FALSE));
+	EMU_CHECK_EQUAL(result.DeviceHandle, test.Devices[1]);
+
+	EMU_CHECK(MouseDetectDevice(detect, 50, &result, &overlapped));
+	EmuHostAdvance(test.Host, 50000);
+	EMU_CHECK(!GetOverlappedResult(detect, &overlapped, &bytes, FALSE));
+	EMU_CHECK_EQUAL(GetLastError(), ERROR_SEM_TIMEOUT);
+
+	CloseHandle(overlapped.hEvent);
+	DisposeHandle(detect);
+	TestHostClose(&test);
+}
+
+static void TestParkedConfiguration(void)
+{
+	TEST_HOST test;
+	MOUSE_CAPTURE_RECORD records[4];
+	MOUSE_FILTER_MODE filterMode = FILTER_MOUSE_NONE;
+	ULONG handle;
+
+	TestHostOpen(&test);
+	EMU_CHECK(MouseSetActiveDeviceHandle(test.Driver, test.Devices[1]));
+	EMU_CHECK(MouseSetFilterMode(test.Driver, FILTER_MOUSE_MIDDLE_BUTTON_PRESS));
+	EMU_CHECK(MouseSaveProfiles(test.Driver));
+
+	//unplugged and plugged back, the mouse keeps its handle and its filter
+	EMU_CHECK(EmuHostRemoveDevice(test.Host, EMU_HOST_MOUSE, test.Devices[1]));
+	EMU_CHECK(!MouseGetFilterMode(test.Driver, &filterMode));
+	handle = EmuHostAddDevice(test.Host, EMU_HOST_MOUSE, "HID\\VID_046D&PID_C077\\6&3b2f2e4&0&0000");
+	EMU_CHECK_EQUAL(handle, test.Devices[1]);
+	Click(&test, handle, MOUSE_MIDDLE_BUTTON_DOWN);
+	Click(&test, handle, MOUSE_LEFT_BUTTON_DOWN);
+	EMU_CHECK_EQUAL(Delivered(&test, records, ARRAYSIZE(records)), 1);
+	EMU_CHECK_EQUAL(records[0].Input.ButtonFlags, MOUSE_LEFT_BUTTON_DOWN);
+
+	TestHostClose(&test);
+}
+
+static void TestLatency(void)
+{
+	TEST_HOST test;
+	MOUSE_LATENCY_REQUEST request = { 0x8000 };
+	MOUSE_INPUT_DATA input;
+	MOUSE_LATENCY latency;
+	DWORD bytes = 0;
+
+	TestHostOpen(&test);
+	Click(&test, test.Devices[0], MOUSE_LEFT_BUTTON_DOWN);
+	Move(&test, test.Devices[0], MOUSE_MOVE_RELATIVE, 1, 1);
+	//the second mouse has histograms of its own
+	Click(&test, test.Devices[1], MOUSE_LEFT_BUTTON_UP);
+	EMU_CHECK(MouseGetLatency(test.Driver, TRUE, &latency));
+	EMU_CHECK_EQUAL(latency.Frequency, 1000000000LL);
+	EMU_CHECK_EQUAL(EmuHistogramTotal(&latency.Histograms[EMU_HIST_BATCH]), 2);
+	EMU_CHECK_EQUAL(EmuHistogramTotal(&latency.Histograms[EMU_HIST_CALLBACK]), 2);
+	EMU_CHECK_EQUAL(EmuHistogramTotal(&latency.Histograms[EMU_HIST_INJECT]), 0);
+
+	//the reset starts the next interval right after the returned histograms
+	memset(&input, 0, sizeof(input));
+	input.ButtonFlags = MOUSE_LEFT_BUTTON_UP;
+	EMU_CHECK(MouseInsertInputs(test.Driver, &input, 1));
+	EMU_CHECK(MouseGetLatency(test.Driver, FALSE, &latency));
+	EMU_CHECK_EQUAL(EmuHistogramTotal(&latency.Histograms[EMU_HIST_BATCH]), 0);
+	EMU_CHECK_EQUAL(EmuHistogramTotal(&latency.Histograms[EMU_HIST_CALLBACK]), 0);
+	EMU_CHECK_EQUAL(EmuHistogramTotal(&latency.Histograms[EMU_HIST_INJECT]), 1);
+
+	EMU_CHECK_EQUAL(test.Transport.IoControl(test.Transport.Context, test.Driver, IOCTL_MOUSE_GET_LATENCY,
+		&request, sizeof(request), &latency, sizeof(latency), &bytes, NULL), ERROR_INVALID_PARAMETER);
+
+	TestHostClose(&test);
+}
+
+static void TestTrace(void)
+{
+	TEST_HOST test;
+	static const USHORT events[] = { EMU_TRACE_INPUT, EMU_TRACE_FILTER, EMU_TRACE_DONE, EMU_TRACE_INPUT, EMU_TRACE_DONE };
+	static UCHAR dump[sizeof(EMU_TRACE_DUMP) + sizeof(EMU_TRACE_CHUNK) + 16 * sizeof(EMU_TRACE_RECORD)];
+	EMU_TRACE_CURSOR cursor;
+	EMU_TRACE_RECORD record;
+	LONG64 frequency = 0;
+	ULONG bytes = 0;
+	ULONG count = 0;
+
+	TestHostOpen(&test);
+	EMU_CHECK(MouseSetFilterMode(test.Driver, FILTER_MOUSE_RIGHT_BUTTON_PRESS));
+	//nothing is recorded before tracing is enabled
+	Click(&test, test.Devices[0], MOUSE_LEFT_BUTTON_DOWN);
+	EMU_CHECK(MouseReadTrace(test.Driver, dump, sizeof(dump), &bytes));
+	EMU_CHECK_EQUAL(bytes, sizeof(EMU_TRACE_DUMP));
+
+	EMU_CHECK(MouseSetTrace(test.Driver, TRUE));
+	Click(&test, test.Devices[0], MOUSE_RIGHT_BUTTON_DOWN);
+	Click(&test, test.Devices[1], MOUSE_LEFT_BUTTON_UP);
+	EMU_CHECK(MouseReadTrace(test.Driver, dump, sizeof(dump), &bytes));
+	EMU_CHECK(EmuTraceOpen(&cursor, dump, bytes, &frequency));
+	EMU_CHECK_EQUAL(frequency, 1000000000LL);
+	while (EmuTraceNext(&cursor, &record))
+	{
+		if (count < ARRAYSIZE(events))
+			EMU_CHECK_EQUAL(record.Event, events[count]);
+		if (record.Event == EMU_TRACE_FILTER)
+			EMU_CHECK_EQUAL(record.Arg1, MOUSE_RIGHT_BUTTON_DOWN);
+		if (record.Event == EMU_TRACE_DONE)
+			EMU_CHECK_EQUAL(record.Arg0, count == 2 ? 1 : 0);
+		count++;
+	}
+	EMU_CHECK_EQUAL(count, ARRAYSIZE(events));
+
+	//the read drained the ring, and a disabled trace stays empty
+	EMU_CHECK(MouseSetTrace(test.Driver, FALSE));
+	Click(&test, test.Devices[0], MOUSE_LEFT_BUTTON_DOWN);
+	EMU_CHECK(MouseReadTrace(test.Driver, dump, sizeof(dump), &bytes));
+	EMU_CHECK_EQUAL(bytes, sizeof(EMU_TRACE_DUMP));
+	EMU_CHECK(!MouseReadTrace(test.Driver, dump, sizeof(EMU_TRACE_DUMP) - 1, &bytes));
+
+	TestHostClose(&test);
+}
+
+static void TestSteadyStateAllocations(void)
+{
+	TEST_HOST test;
+	MOUSE_MODIFY_DATA modifies[16];
+	MOUSE_MODIFY_REQUEST modifyRequest = { ARRAYSIZE(modifies), modifies };
+	MOUSE_MODIFY_DATA readModifies[ARRAYSIZE(modifies) + 1];
+	MOUSE_MODIFY_REQUEST readRequest;
+	MOUSE_MODIFY_DATA extra = { MOUSE_BUTTON_5_DOWN, MOUSE_BUTTON_4_DOWN };
+	EMU_RULE rule = { EMU_CONDITION_NONE, 0, EMU_RULE_DROP, 0, MOUSE_WHEEL, 0 };
+	EMU_RULE_REQUEST ruleRequest = { 1, &rule };
+	LONG64 allocations = 0;
+	ULONG failures = 0;
+
+	TestHostOpen(&test);
+	for (USHORT i = 0; i < ARRAYSIZE(modifies); i++)
+	{
+		modifies[i].FromState = (USHORT)(MOUSE_LEFT_BUTTON_DOWN | (i << 10));
+		modifies[i].ToState = MOUSE_RIGHT_BUTTON_DOWN;
+	}
+
+	//the first round grows the scratch buffers of the thread, the rest must reuse them
+	for (ULONG round = 0; round < 100; round++)
+	{
+		if (round == 1)
+			allocations = ShimHeapAllocations;
+		failures += !MouseSetModification(test.Driver, &modifyRequest);
+		readRequest.ModifyCount = ARRAYSIZE(readModifies);
+		readRequest.ModifyData = readModifies;
+		failures += !MouseGetModifications(test.Driver, &readRequest);
+		failures += !MouseAddButtonModification(test.Driver, &extra);
+		failures += !MouseRemoveButtonModification(test.Driver, &extra);
+		failures += !MouseSetRules(test.Driver, &ruleRequest);
+		failures += !MouseBroadcastRules(test.Driver, test.Devices, 2, &ruleRequest);
+	}
+	EMU_CHECK_EQUAL(failures, 0);
+	EMU_CHECK_EQUAL(ShimHeapAllocations - allocations, 0);
+	EMU_CHECK_EQUAL(readRequest.ModifyCount, ARRAYSIZE(modifies));
+
+	TestHostClose(&test);
+}
+
+int main(void)
+{
+	TestDevices();
+	TestFilterAndModify();
+	TestRuleEditConflict();
+	TestInsert();
+	TestInsertQueue();
+	TestInsertQueueAllocations();
+	TestKeyCondition();
+	TestProfiles();
+	TestAbsoluteMapping();
+	TestAutofire();
+	TestCapture();
+	TestDetect();
+	TestParkedConfiguration();
+	TestLatency();
+	TestTrace();
+	TestSteadyStateAllocations();
+	return EMU_TEST_RESULT();
+}
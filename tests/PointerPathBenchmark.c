@@ -0,0 +1,56 @@
+/*++
+
+Module Name:
+
+	PointerPathBenchmark.c
+
+Abstract:
+
+	Generates the packets of long paths with PointerPath.h, for every
+	curve, relative and absolute, at once and in slices of the size of one
+	insert. Since every point is computed on its own, a slice costs no more
+	per packet than the whole path.
+
+--*/
+
+#include "EmuBench.h"
+#include "PointerPath.h"
+
+#define STEPS 0x100000
+#define ROUNDS 10
+#define SLICE 64
+
+static MOUSE_INPUT_DATA Inputs[STEPS];
+static LONG64 Times[STEPS];
+
+int main(void)
+{
+	static const char* curves[] = { "linear", "bezier", "minimum jerk" };
+
+	for (USHORT curve = EMU_PATH_LINEAR; curve <= EMU_PATH_MINIMUM_JERK; curve++)
+	{
+		for (ULONG absolute = 0; absolute < 2; absolute++)
+		{
+			EMU_PATH path = { curve, absolute ? EMU_PATH_ABSOLUTE : 0, STEPS, { 100, 200 }, { 60000, 30000 },
+				{ 40000, 0 }, { 0, 50000 }, 0, 10000000 };
+			char name[64];
+			LONG64 start;
+
+			start = EmuBenchNow();
+			for (ULONG round = 0; round < ROUNDS; round++)
+				EmuBenchSink += EmuPathGenerate(&path, 0, Inputs, Times, STEPS);
+			snprintf(name, sizeof(name), "%s%s at once", curves[curve], absolute ? " absolute" : "");
+			EmuBenchReport(name, (LONG64)STEPS * ROUNDS, EmuBenchNow() - start);
+
+			start = EmuBenchNow();
+			for (ULONG round = 0; round < ROUNDS; round++)
+			{
+				for (ULONG first = 0; first < STEPS; first += SLICE)
+					EmuBenchSink += EmuPathGenerate(&path, first, Inputs, Times, SLICE);
+			}
+			snprintf(name, sizeof(name), "%s%s in slices of %u", curves[curve], absolute ? " absolute" : "", SLICE);
+			EmuBenchReport(name, (LONG64)STEPS * ROUNDS, EmuBenchNow() - start);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,394 @@
+/*++
+
+Module Name:
+
+	PointerPathTest.c
+
+Abstract:
+
+	Generates paths with PointerPath.h and checks them against the curves
+	computed in floating point: relative packets add up to exactly the
+	distance, every point lies within a unit of its curve, and a path
+	generated into buffers of any size comes out the same. Also checks the
+	times of the packets, mirror images, the ends of a minimum jerk move
+	and the ranges EmuPathValid accepts.
+
+--*/
+
+#include <math.h>
+
+#include "EmuTest.h"
+#include "PointerPath.h"
+
+#define MAX_PACKETS 20000
+
+static MOUSE_INPUT_DATA Inputs[MAX_PACKETS];
+static MOUSE_INPUT_DATA Slices[MAX_PACKETS];
+static LONG64 Times[MAX_PACKETS];
+static LONG64 SliceTimes[MAX_PACKETS];
+
+static ULONG64 Next(PULONG64 State)
+{
+	*State ^= *State << 13;
+	*State ^= *State >> 7;
+	*State ^= *State << 17;
+	return *State;
+}
+
+static LONG RandomCoordinate(PULONG64 State, BOOLEAN Absolute)
+{
+	ULONG64 r = Next(State);
+
+	if (Absolute)
+		return (LONG)(r % (EMU_PATH_MAX_ABSOLUTE + 1));
+	//mostly screen sized moves, some across the whole range
+	if ((r >> 40) % 4 == 0)
+		return (LONG)(r % (2 * EMU_PATH_MAX_COORDINATE + 1)) - EMU_PATH_MAX_COORDINATE;
+	return (LONG)(r % 8001) - 4000;
+}
+
+static void RandomPath(PEMU_PATH Path, PULONG64 State, USHORT Curve, BOOLEAN Absolute, ULONG MaxSteps)
+{
+	RtlZeroMemory(Path, sizeof(EMU_PATH));
+	Path->Curve = Curve;
+	Path->Flags = Absolute ? EMU_PATH_ABSOLUTE | (Next(State) & 1 ? EMU_PATH_VIRTUAL_DESKTOP : 0) : 0;
+	Path->Steps = 1 + (ULONG)(Next(State) % MaxSteps);
+	Path->Start.X = RandomCoordinate(State, Absolute);
+	Path->Start.Y = RandomCoordinate(State, Absolute);
+	Path->End.X = RandomCoordinate(State, Absolute);
+	Path->End.Y = RandomCoordinate(State, Absolute);
+	Path->Control1.X = RandomCoordinate(State, Absolute);
+	Path->Control1.Y = RandomCoordinate(State, Absolute);
+	Path->Control2.X = RandomCoordinate(State, Absolute);
+	Path->Control2.Y = RandomCoordinate(State, Absolute);
+	Path->StartTime = (LONG64)(Next(State) % 1000000000);
+	Path->Duration = (LONG64)(Next(State) % 100000000);
+}
+
+//
+//Point of a step on the curve, in floating point
+//
+static void ExactPoint(const EMU_PATH* Path, ULONG Step, double* X, double* Y)
+{
+	double u = (double)Step / Path->Steps;
+	double s;
+
+	if (Path->Curve == EMU_PATH_BEZIER) {
+		double v = 1.0 - u;
+
+		*X = v * v * v * Path->Start.X + 3 * v * v * u * Path->Control1.X + 3 * v * u * u * Path->Control2.X + u * u * u * Path->End.X;
+		*Y = v * v * v * Path->Start.Y + 3 * v * v * u * Path->Control1.Y + 3 * v * u * u * Path->Control2.Y + u * u * u * Path->End.Y;
+		return;
+	}
+	s = Path->Curve == EMU_PATH_MINIMUM_JERK ? u * u * u * (10 - 15 * u + 6 * u * u) : u;
+	*X = Path->Start.X + s * ((double)Path->End.X - Path->Start.X);
+	*Y = Path->Start.Y + s * ((double)Path->End.Y - Path->Start.Y);
+}
+
+//
+//Follows the packets of a path from its start, checking each point lies
+//within a unit of the curve and the last one is the end
+//
+static BOOLEAN CheckCurve(const EMU_PATH* Path, const MOUSE_INPUT_DATA* Packets, double* WorstError)
+{
+	BOOLEAN absolute = (Path->Flags & EMU_PATH_ABSOLUTE) != 0;
+	LONG64 x = Path->Start.X;
+	LONG64 y = Path->Start.Y;
+
+	for (ULONG i = 0; i < Path->Steps; i++)
+	{
+		double exactX;
+		double exactY;
+
+		if (Packets[i].Flags != Path->Flags)
+			return FALSE;
+		if (absolute) {
+			x = Packets[i].LastX;
+			y = Packets[i].LastY;
+			if (!EmuPathPointValid(&(EMU_PATH_POINT){ (LONG)x, (LONG)y }, TRUE))
+				return FALSE;
+		}
+		else {
+			x += Packets[i].LastX;
+			y += Packets[i].LastY;
+		}
+		ExactPoint(Path, i + 1, &exactX, &exactY);
+		if (fabs((double)x - exactX) > *WorstError)
+			*WorstError = fabs((double)x - exactX);
+		if (fabs((double)y - exactY) > *WorstError)
+			*WorstError = fabs((double)y - exactY);
+	}
+	return x == Path->End.X && y == Path->End.Y;
+}
+
+static void TestCurves(USHORT Curve, BOOLEAN Absolute, ULONG64 Seed)
+{
+	ULONG64 state = Seed;
+	double worst = 0;
+	ULONG failures = 0;
+
+	for (ULONG n = 0; n < 2000; n++)
+	{
+		EMU_PATH path;
+
+		RandomPath(&path, &state, Curve, Absolute, n % 10 == 0 ? MAX_PACKETS : 200);
+		if (EmuPathGenerate(&path, 0, Inputs, Times, MAX_PACKETS) != path.Steps || !CheckCurve(&path, Inputs, &worst)) {
+			if (failures++ == 0)
+				printf("curve %u%s: path %u misses its end\n", Curve, Absolute ? " absolute" : "", n);
+		}
+	}
+	if (failures != 0 || worst >= 1.0) {
+		printf("curve %u%s: %u paths wrong, points up to %f off the curve\n", Curve, Absolute ? " absolute" : "", failures, worst);
+		EmuTestFailures++;
+	}
+}
+
+//
+//Paths at the edges of the ranges, where the fixed point math is closest to overflowing
+//
+static void TestExtremes(void)
+{
+	static const LONG m = EMU_PATH_MAX_COORDINATE;
+	static const EMU_PATH_POINT corners[][4] = {
+		{ { -0x100000, -0x100000 }, { 0x100000, 0x100000 }, { 0x100000, -0x100000 }, { -0x100000, 0x100000 } },
+		{ { 0x100000, 0x100000 }, { -0x100000, -0x100000 }, { -0x100000, -0x100000 }, { 0x100000, 0x100000 } },
+		{ { 0, 0 }, { 1, -1 }, { 0x100000, 0x100000 }, { -0x100000, -0x100000 } },
+		{ { -0x100000, 0x100000 }, { 0x100000, -0x100000 }, { 0, 0 }, { 0, 0 } }
+	};
+	static MOUSE_INPUT_DATA packets[EMU_PATH_MAX_STEPS];
+	static const ULONG steps[] = { 1, 2, 3, 7, 1000, EMU_PATH_MAX_STEPS };
+
+	EMU_CHECK_EQUAL(m, 0x100000);
+	for (USHORT curve = EMU_PATH_LINEAR; curve <= EMU_PATH_MINIMUM_JERK; curve++)
+	{
+		for (ULONG c = 0; c < sizeof(corners) / sizeof(corners[0]); c++)
+		{
+			for (ULONG s = 0; s < sizeof(steps) / sizeof(steps[0]); s++)
+			{
+				EMU_PATH path = { curve, 0, steps[s], corners[c][0], corners[c][1], corners[c][2], corners[c][3], 0,
+					EMU_PATH_MAX_DURATION };
+				double worst = 0;
+
+				EMU_CHECK(EmuPathValid(&path));
+				EMU_CHECK_EQUAL(EmuPathGenerate(&path, 0, packets, NULL, EMU_PATH_MAX_STEPS), steps[s]);
+				EMU_CHECK(CheckCurve(&path, packets, &worst));
+				EMU_CHECK(worst < 1.0);
+			}
+		}
+	}
+}
+
+//
+//A path generated a slice at a time, into buffers of one size, matches it generated at once
+//
+static void TestSlices(void)
+{
+	ULONG64 state = 7;
+
+	for (USHORT curve = EMU_PATH_LINEAR; curve <= EMU_PATH_MINIMUM_JERK; curve++)
+	{
+		for (ULONG n = 0; n < 8; n++)
+		{
+			EMU_PATH path;
+			ULONG mismatches = 0;
+
+			RandomPath(&path, &state, curve, n & 1, 3000);
+			EMU_CHECK_EQUAL(EmuPathGenerate(&path, 0, Inputs, Times, MAX_PACKETS), path.Steps);
+			for (ULONG capacity = 1; capacity <= 70; capacity++)
+			{
+				ULONG first = 0;
+				ULONG count;
+
+				RtlZeroMemory(Slices, path.Steps * sizeof(MOUSE_INPUT_DATA));
+				while ((count = EmuPathGenerate(&path, first, Slices + first, SliceTimes + first, capacity)) != 0)
+				{
+					if (count > capacity)
+						mismatches++;
+					first += count;
+				}
+				if (first != path.Steps || memcmp(Slices, Inputs, path.Steps * sizeof(MOUSE_INPUT_DATA)) != 0 ||
+					memcmp(SliceTimes, Times, path.Steps * sizeof(LONG64)) != 0)
+					mismatches++;
+			}
+			if (mismatches != 0) {
+				printf("curve %u: path %u comes out different in slices\n", curve, n);
+				EmuTestFailures++;
+			}
+		}
+	}
+}
+
+static void TestTimes(void)
+{
+	ULONG64 state = 11;
+
+	for (ULONG n = 0; n < 200; n++)
+	{
+		EMU_PATH path;
+		BOOLEAN ordered = TRUE;
+
+		RandomPath(&path, &state, (USHORT)(n % 3), FALSE, 5000);
+		EMU_CHECK_EQUAL(EmuPathGenerate(&path, 0, Inputs, Times, MAX_PACKETS), path.Steps);
+		for (ULONG i = 0; i < path.Steps; i++)
+		{
+			if (Times[i] < (i == 0 ? path.StartTime : Times[i - 1]) || Times[i] > path.StartTime + path.Duration)
+				ordered = FALSE;
+		}
+		EMU_CHECK(ordered);
+		EMU_CHECK_EQUAL(Times[path.Steps - 1], path.StartTime + path.Duration);
+	}
+
+	//the longest duration over the most steps doesn't overflow
+	{
+		EMU_PATH path = { EMU_PATH_LINEAR, 0, EMU_PATH_MAX_STEPS, { 0, 0 }, { 10, 10 }, { 0, 0 }, { 0, 0 },
+			EMU_PATH_MAX_DURATION, EMU_PATH_MAX_DURATION };
+
+		EMU_CHECK_EQUAL(EmuPathGenerate(&path, EMU_PATH_MAX_STEPS - 1, Inputs, Times, 1), 1);
+		EMU_CHECK_EQUAL(Times[0], 2 * EMU_PATH_MAX_DURATION);
+		EMU_CHECK_EQUAL(EmuPathGenerate(&path, EMU_PATH_MAX_STEPS / 2 - 1, Inputs, Times, 1), 1);
+		EMU_CHECK_EQUAL(Times[0], EMU_PATH_MAX_DURATION + EMU_PATH_MAX_DURATION / 2);
+	}
+}
+
+static void TestShapes(void)
+{
+	ULONG64 state = 13;
+
+	//a mirror image takes the mirrored steps
+	for (ULONG n = 0; n < 500; n++)
+	{
+		EMU_PATH path;
+		EMU_PATH mirror;
+		BOOLEAN mirrored = TRUE;
+
+		RandomPath(&path, &state, (USHORT)(n % 3), FALSE, 500);
+		mirror = path;
+		mirror.Start.X = -path.Start.X;
+		mirror.End.X = -path.End.X;
+		mirror.Control1.X = -path.Control1.X;
+		mirror.Control2.X = -path.Control2.X;
+		EmuPathGenerate(&path, 0, Inputs, NULL, MAX_PACKETS);
+		EmuPathGenerate(&mirror, 0, Slices, NULL, MAX_PACKETS);
+		for (ULONG i = 0; i < path.Steps; i++)
+		{
+			if (Slices[i].LastX != -Inputs[i].LastX || Slices[i].LastY != Inputs[i].LastY)
+				mirrored = FALSE;
+		}
+		EMU_CHECK(mirrored);
+	}
+
+	//a minimum jerk move never steps back and starts and ends slower than it moves halfway
+	{
+		EMU_PATH path = { EMU_PATH_MINIMUM_JERK, 0, 100, { 0, 0 }, { 10000, -3000 }, { 0, 0 }, { 0, 0 }, 0, 1000 };
+		BOOLEAN forward = TRUE;
+
+		EMU_CHECK_EQUAL(EmuPathGenerate(&path, 0, Inputs, NULL, MAX_PACKETS), 100);
+		for (ULONG i = 0; i < 100; i++)
+		{
+			if (Inputs[i].LastX < 0 || Inputs[i].LastY > 0)
+				forward = FALSE;
+		}
+		EMU_CHECK(forward);
+		EMU_CHECK(Inputs[0].LastX < Inputs[49].LastX / 50);
+		EMU_CHECK(Inputs[99].LastX < Inputs[49].LastX / 50);
+		//a linear move goes at one speed, its steps differ by the rounding
+		path.Curve = EMU_PATH_LINEAR;
+		EmuPathGenerate(&path, 0, Inputs, NULL, MAX_PACKETS);
+		for (ULONG i = 0; i < 100; i++)
+			EMU_CHECK_EQUAL(Inputs[i].LastX, 100);
+	}
+
+	//a path to where it starts moves nowhere
+	{
+		EMU_PATH path = { EMU_PATH_BEZIER, 0, 50, { 5, 5 }, { 5, 5 }, { 900, -40 }, { -300, 70 }, 0, 1000 };
+		LONG x = 0;
+		LONG y = 0;
+
+		EMU_CHECK_EQUAL(EmuPathGenerate(&path, 0, Inputs, NULL, MAX_PACKETS), 50);
+		for (ULONG i = 0; i < 50; i++)
+		{
+			x += Inputs[i].LastX;
+			y += Inputs[i].LastY;
+		}
+		EMU_CHECK_EQUAL(x, 0);
+		EMU_CHECK_EQUAL(y, 0);
+		EMU_CHECK(Inputs[10].LastX != 0);
+	}
+}
+
+static void TestValid(void)
+{
+	EMU_PATH valid = { EMU_PATH_BEZIER, 0, 10, { 0, 0 }, { 100, 100 }, { 50, 0 }, { 0, 50 }, 0, 1000 };
+	EMU_PATH path;
+
+	EMU_CHECK(EmuPathValid(&valid));
+
+#define EXPECT_VALID(Field, Value, Valid) \
+	do { \
+		path = valid; \
+		path.Field = Value; \
+		EMU_CHECK_EQUAL(EmuPathValid(&path), Valid); \
+		EMU_CHECK_EQUAL(EmuPathGenerate(&path, 0, Inputs, Times, MAX_PACKETS) != 0, Valid); \
+	} while (0)
+
+	EXPECT_VALID(Curve, EMU_PATH_MINIMUM_JERK, TRUE);
+	EXPECT_VALID(Curve, EMU_PATH_MINIMUM_JERK + 1, FALSE);
+	EXPECT_VALID(Flags, EMU_PATH_ABSOLUTE, TRUE);
+	EXPECT_VALID(Flags, EMU_PATH_ABSOLUTE | EMU_PATH_VIRTUAL_DESKTOP, TRUE);
+	EXPECT_VALID(Flags, EMU_PATH_VIRTUAL_DESKTOP, FALSE);
+	EXPECT_VALID(Flags, 0x0004, FALSE);
+	EXPECT_VALID(Steps, 0, FALSE);
+	EXPECT_VALID(Steps, 1, TRUE);
+	EXPECT_VALID(Steps, MAX_PACKETS, TRUE);
+	EXPECT_VALID(Steps, EMU_PATH_MAX_STEPS + 1, FALSE);
+	EXPECT_VALID(Duration, 0, TRUE);
+	EXPECT_VALID(Duration, -1, FALSE);
+	EXPECT_VALID(Duration, EMU_PATH_MAX_DURATION, TRUE);
+	EXPECT_VALID(Duration, EMU_PATH_MAX_DURATION + 1, FALSE);
+	EXPECT_VALID(Start.X, EMU_PATH_MAX_COORDINATE, TRUE);
+	EXPECT_VALID(Start.X, EMU_PATH_MAX_COORDINATE + 1, FALSE);
+	EXPECT_VALID(Start.Y, -EMU_PATH_MAX_COORDINATE, TRUE);
+	EXPECT_VALID(Start.Y, -EMU_PATH_MAX_COORDINATE - 1, FALSE);
+	EXPECT_VALID(End.X, -EMU_PATH_MAX_COORDINATE - 1, FALSE);
+	EXPECT_VALID(End.Y, EMU_PATH_MAX_COORDINATE + 1, FALSE);
+	EXPECT_VALID(Control1.X, EMU_PATH_MAX_COORDINATE + 1, FALSE);
+	EXPECT_VALID(Control2.Y, -EMU_PATH_MAX_COORDINATE - 1, FALSE);
+	EXPECT_VALID(Control1.Y, 0x7FFFFFFF, FALSE);
+
+	//only a Bezier curve has control points
+	valid.Curve = EMU_PATH_LINEAR;
+	EXPECT_VALID(Control1.X, 0x7FFFFFFF, TRUE);
+	EXPECT_VALID(Control2.Y, -0x7FFFFFFF, TRUE);
+
+	//absolute paths stay in the normalized range
+	valid.Flags = EMU_PATH_ABSOLUTE;
+	valid.Curve = EMU_PATH_BEZIER;
+	EXPECT_VALID(Start.X, EMU_PATH_MAX_ABSOLUTE, TRUE);
+	EXPECT_VALID(Start.X, EMU_PATH_MAX_ABSOLUTE + 1, FALSE);
+	EXPECT_VALID(End.Y, -1, FALSE);
+	EXPECT_VALID(Control1.X, -1, FALSE);
+	EXPECT_VALID(Control2.Y, EMU_PATH_MAX_ABSOLUTE + 1, FALSE);
+
+#undef EXPECT_VALID
+
+	//nothing is generated past the last step
+	EMU_CHECK_EQUAL(EmuPathGenerate(&valid, 9, Inputs, NULL, MAX_PACKETS), 1);
+	EMU_CHECK_EQUAL(EmuPathGenerate(&valid, 10, Inputs, NULL, MAX_PACKETS), 0);
+	EMU_CHECK_EQUAL(EmuPathGenerate(&valid, 0xFFFFFFFF, Inputs, NULL, MAX_PACKETS), 0);
+	EMU_CHECK_EQUAL(EmuPathGenerate(&valid, 0, Inputs, NULL, 0), 0);
+}
+
+int main(void)
+{
+	for (USHORT curve = EMU_PATH_LINEAR; curve <= EMU_PATH_MINIMUM_JERK; curve++)
+	{
+		TestCurves(curve, FALSE, 1 + curve);
+		TestCurves(curve, TRUE, 4 + curve);
+	}
+	TestExtremes();
+	TestSlices();
+	TestTimes();
+	TestShapes();
+	TestValid();
+	return EMU_TEST_RESULT();
+}
@@ -0,0 +1,418 @@
+/*++
+
+Module Name:
+
+	ReplayEngineTest.c
+
+Abstract:
+
+	Plays sources through the replay engine of ReplayEngine.h against a
+	mock transport and a virtual clock that only moves when the engine
+	waits. The clock wakes up late or early on demand, so the tests check
+	the timing of every injected event at any speed, that late wakeups
+	don't shift the events after them, the batching window, looping, and
+	how the playback ends.
+
+--*/
+
+#include "EmuTest.h"
+#include "InputCorpus.h"
+#include "ReplayEngine.h"
+
+#define MAX_EVENTS 20000
+
+//
+//Clock units per second, a microsecond clock against the 100ns units of the corpora
+//
+#define CLOCK_FREQUENCY 1000000
+
+typedef struct _MOCK_SOURCE {
+	EMU_REPLAY_EVENT Events[MAX_EVENTS];
+	ULONG Count;
+	ULONG Next;
+	//
+	//Events a read returns at most, to move the read boundaries around
+	//
+	ULONG ReadSize;
+	ULONG Rewinds;
+} MOCK_SOURCE;
+
+typedef struct _MOCK_WORLD {
+	LONG64 Now;
+	//
+	//Wakeups come up to Late units after the time asked for, or one unit early with Early
+	//
+	LONG64 Late;
+	BOOLEAN Early;
+	ULONG64 Random;
+	//
+	//EMU_REC_KEYBOARD or EMU_REC_MOUSE, what Insert is handed
+	//
+	USHORT Kind;
+	ULONG Waits;
+	//
+	//Wait returns FALSE once it was called that often, 0 never
+	//
+	ULONG StopAfter;
+	//
+	//Insert fails once it injected that many events, 0 never
+	//
+	ULONG FailAfter;
+	ULONG Injected;
+	ULONG Batches;
+	ULONG MaxBatch;
+	//
+	//Clock time and source event of every injected event
+	//
+	LONG64 InjectedAt[MAX_EVENTS * 3];
+	LONG InjectedX[MAX_EVENTS * 3];
+} MOCK_WORLD;
+
+static MOCK_SOURCE Source;
+static MOCK_WORLD World;
+
+static ULONG Read(PVOID Context, PEMU_REPLAY_EVENT Events, ULONG Count)
+{
+	MOCK_SOURCE* source = (MOCK_SOURCE*)Context;
+	ULONG count = source->Count - source->Next;
+
+	if (count > Count)
+		count = Count;
+	if (count > source->ReadSize)
+		count = source->ReadSize;
+	memcpy(Events, &source->Events[source->Next], count * sizeof(EMU_REPLAY_EVENT));
+	source->Next += count;
+	return count;
+}
+
+static BOOLEAN Rewind(PVOID Context)
+{
+	MOCK_SOURCE* source = (MOCK_SOURCE*)Context;
+
+	source->Next = 0;
+	source->Rewinds++;
+	return TRUE;
+}
+
+static BOOLEAN Insert(PVOID Context, const VOID* Inputs, ULONG Count)
+{
+	MOCK_WORLD* world = (MOCK_WORLD*)Context;
+
+	if (world->FailAfter != 0 && world->Injected + Count > world->FailAfter)
+		return FALSE;
+	for (ULONG i = 0; i < Count && world->Injected < MAX_EVENTS * 3; i++)
+	{
+		world->InjectedAt[world->Injected] = world->Now;
+		//mouse packets carry their source event in LastX, keys in MakeCode
+		world->InjectedX[world->Injected++] = world->Kind == EMU_REC_KEYBOARD ?
+			((const KEYBOARD_INPUT_DATA*)Inputs)[i].MakeCode : ((const MOUSE_INPUT_DATA*)Inputs)[i].LastX;
+	}
+	world->Batches++;
+	if (Count > world->MaxBatch)
+		world->MaxBatch = Count;
+	return TRUE;
+}
+
+static LONG64 Now(PVOID Context)
+{
+	return ((MOCK_WORLD*)Context)->Now;
+}
+
+static BOOLEAN Wait(PVOID Context, LONG64 Until)
+{
+	MOCK_WORLD* world = (MOCK_WORLD*)Context;
+
+	world->Waits++;
+	if (world->StopAfter != 0 && world->Waits >= world->StopAfter)
+		return FALSE;
+	//only a real sleep wakes up late or early
+	if (Until > world->Now) {
+		if (world->Early && (CorpusNext(&world->Random) & 1))
+			world->Now = Until - 1;
+		else
+			world->Now = Until + (world->Late ? (LONG64)(CorpusNext(&world->Random) % (ULONG64)(world->Late + 1)) : 0);
+	}
+	return TRUE;
+}
+
+//
+//Mouse events 0 to Count - 1, LastX numbers them
+//
+static void FillSource(ULONG Count, ULONG64 Seed)
+{
+	static CORPUS_MOUSE_EVENT corpus[MAX_EVENTS];
+
+	CorpusMouse(corpus, Count, Seed, FALSE);
+	for (ULONG i = 0; i < Count; i++)
+	{
+		Source.Events[i].Time = 5000000 + corpus[i].Time;
+		Source.Events[i].Input.Mouse = corpus[i].Input;
+		Source.Events[i].Input.Mouse.LastX = (LONG)i;
+	}
+	Source.Count = Count;
+	Source.Next = 0;
+	Source.ReadSize = EMU_REPLAY_LOOKAHEAD;
+	Source.Rewinds = 0;
+}
+
+static void ResetWorld(void)
+{
+	RtlZeroMemory(&World, sizeof(World));
+	World.Now = 1000;
+	World.Random = 0x2545F4914F6CDD1Dull;
+	World.Kind = EMU_REC_MOUSE;
+}
+
+static EMU_REPLAY_STATUS Play(ULONG SpeedPercent, ULONG Loops, LONG64 Window, PEMU_REPLAY_STATS Stats)
+{
+	EMU_REPLAY_SOURCE source = { &Source, Read, Rewind, CORPUS_FREQUENCY };
+	EMU_REPLAY_TRANSPORT transport = { &World, Insert };
+	EMU_REPLAY_CLOCK clock = { &World, Now, Wait, CLOCK_FREQUENCY };
+	EMU_REPLAY_OPTIONS options = { EMU_REC_MOUSE, 0, SpeedPercent, Loops, Window };
+
+	return EmuReplayRun(&source, &transport, &clock, &options, Stats);
+}
+
+//
+//Clock time an event is due at, from the start of its pass
+//
+static LONG64 DueAt(LONG64 PassClock, ULONG Event, ULONG SpeedPercent)
+{
+	return PassClock + (LONG64)((double)(Source.Events[Event].Time - Source.Events[0].Time) *
+		CLOCK_FREQUENCY * 100.0 / ((double)CORPUS_FREQUENCY * SpeedPercent));
+}
+
+//
+//The first Events injected events came in order over the passes, none
+//earlier than Window before it was due and none later than the latest wakeup
+//
+static void CheckTiming(const char* Name, ULONG SpeedPercent, LONG64 Window, LONG64 Late, ULONG Events)
+{
+	LONG64 passClock = 1000;
+	ULONG failures = 0;
+
+	EMU_CHECK(World.Injected >= Events);
+	for (ULONG pass = 0; pass * Source.Count < Events; pass++)
+	{
+		for (ULONG i = 0; i < Source.Count && pass * Source.Count + i < Events; i++)
+		{
+			ULONG n = pass * Source.Count + i;
+			LONG64 due = DueAt(passClock, i, SpeedPercent);
+
+			if (World.InjectedX[n] != (LONG)i || World.InjectedAt[n] < due - Window || World.InjectedAt[n] > due + Late) {
+				if (failures++ == 0)
+					printf("%s: event %u of pass %u injected at %lld, due at %lld\n", Name, i, pass,
+						(long long)World.InjectedAt[n], (long long)due);
+			}
+		}
+		//the next pass starts where the last event was due
+		passClock = DueAt(passClock, Source.Count - 1, SpeedPercent);
+	}
+	if (failures != 0) {
+		printf("%s: %u events off\n", Name, failures);
+		EmuTestFailures++;
+	}
+}
+
+static void TestSpeeds(void)
+{
+	static const ULONG speeds[] = { EMU_REPLAY_SPEED_MIN, 100, 250, EMU_REPLAY_SPEED_MAX };
+	EMU_REPLAY_STATS stats;
+
+	for (ULONG s = 0; s < sizeof(speeds) / sizeof(speeds[0]); s++)
+	{
+		char name[32];
+
+		snprintf(name, sizeof(name), "%u%% speed", speeds[s]);
+		FillSource(5000, 1);
+		ResetWorld();
+		EMU_CHECK_EQUAL(Play(speeds[s], 1, 0, &stats), EMU_REPLAY_DONE);
+		CheckTiming(name, speeds[s], 0, 0, 5000);
+		EMU_CHECK_EQUAL(stats.Events, 5000);
+		EMU_CHECK_EQUAL(stats.Loops, 1);
+		EMU_CHECK_EQUAL(stats.MaxLate, 0);
+		//a batch per event on a clock that is never late, the corpus has no two at one time
+		EMU_CHECK_EQUAL(stats.Batches, 5000);
+		//the playback took the recorded time divided by the speed
+		EMU_CHECK_EQUAL(World.Now, DueAt(1000, 4999, speeds[s]));
+	}
+}
+
+static void TestLateWakeups(void)
+{
+	EMU_REPLAY_STATS stats;
+	LONG64 late = CLOCK_FREQUENCY / 50;
+
+	//wakeups up to 20ms late, several polling intervals
+	FillSource(MAX_EVENTS, 2);
+	ResetWorld();
+	World.Late = late;
+	EMU_CHECK_EQUAL(Play(100, 1, 0, &stats), EMU_REPLAY_DONE);
+	CheckTiming("late wakeups", 100, 0, late, MAX_EVENTS);
+	EMU_CHECK(stats.MaxLate <= late);
+	//overdue events are caught up in batches, the end is not shifted by the sum of the delays
+	EMU_CHECK(stats.Batches < MAX_EVENTS);
+	EMU_CHECK(World.Now <= DueAt(1000, MAX_EVENTS - 1, 100) + late);
+	printf("late wakeups: %llu batches, %lld units late in total, %lld at most\n",
+		(unsigned long long)stats.Batches, (long long)stats.TotalLate, (long long)stats.MaxLate);
+
+	//early wakeups are waited out, nothing is injected ahead of time
+	FillSource(5000, 3);
+	ResetWorld();
+	World.Early = TRUE;
+	EMU_CHECK_EQUAL(Play(100, 1, 0, &stats), EMU_REPLAY_DONE);
+	CheckTiming("early wakeups", 100, 0, 0, 5000);
+	EMU_CHECK(World.Waits > 5000);
+}
+
+static void TestWindow(void)
+{
+	EMU_REPLAY_STATS stats;
+	LONG64 window = CLOCK_FREQUENCY / 20;
+
+	//a 50ms window joins several 8ms polls into a batch
+	FillSource(5000, 4);
+	ResetWorld();
+	EMU_CHECK_EQUAL(Play(100, 1, window, &stats), EMU_REPLAY_DONE);
+	CheckTiming("window", 100, window, 0, 5000);
+	EMU_CHECK(stats.Batches < 5000 / 4);
+	EMU_CHECK(World.MaxBatch <= EMU_REPLAY_LOOKAHEAD);
+
+	//reads of a few events cut batches short, but keep the timing
+	FillSource(5000, 4);
+	Source.ReadSize = 3;
+	ResetWorld();
+	EMU_CHECK_EQUAL(Play(100, 1, window, &stats), EMU_REPLAY_DONE);
+	CheckTiming("short reads", 100, window, 0, 5000);
+	EMU_CHECK(World.MaxBatch <= 3);
+
+	//events at one time, and older than the event before, go together
+	FillSource(100, 5);
+	for (ULONG i = 10; i < 20; i++)
+		Source.Events[i].Time = Source.Events[10].Time;
+	Source.Events[30].Time = Source.Events[29].Time - 1000;
+	ResetWorld();
+	EMU_CHECK_EQUAL(Play(100, 1, 0, &stats), EMU_REPLAY_DONE);
+	EMU_CHECK_EQUAL(stats.Events, 100);
+	EMU_CHECK_EQUAL(stats.Batches, 100 - 9 - 1);
+	EMU_CHECK_EQUAL(World.InjectedAt[19], World.InjectedAt[10]);
+	EMU_CHECK_EQUAL(World.InjectedAt[30], World.InjectedAt[29]);
+}
+
+static void TestLoops(void)
+{
+	EMU_REPLAY_STATS stats;
+
+	FillSource(1000, 6);
+	ResetWorld();
+	World.Late = 300;
+	EMU_CHECK_EQUAL(Play(200, 3, 0, &stats), EMU_REPLAY_DONE);
+	CheckTiming("loops", 200, 0, 300, 3000);
+	EMU_CHECK_EQUAL(stats.Loops, 3);
+	EMU_CHECK_EQUAL(stats.Events, 3000);
+	EMU_CHECK_EQUAL(Source.Rewinds, 2);
+
+	//endless looping until the clock stops it
+	FillSource(1000, 6);
+	ResetWorld();
+	World.StopAfter = 2500;
+	EMU_CHECK_EQUAL(Play(100, 0, 0, &stats), EMU_REPLAY_STOPPED);
+	EMU_CHECK_EQUAL(stats.Loops, 2);
+	EMU_CHECK_EQUAL(stats.Events, 2499);
+	CheckTiming("endless loops", 100, 0, 0, 2499);
+
+	//a source that can't start over
+	{
+		EMU_REPLAY_SOURCE source = { &Source, Read, NULL, CORPUS_FREQUENCY };
+		EMU_REPLAY_TRANSPORT transport = { &World, Insert };
+		EMU_REPLAY_CLOCK clock = { &World, Now, Wait, CLOCK_FREQUENCY };
+		EMU_REPLAY_OPTIONS options = { EMU_REC_MOUSE, 0, 100, 2, 0 };
+
+		FillSource(100, 7);
+		ResetWorld();
+		EMU_CHECK_EQUAL(EmuReplayRun(&source, &transport, &clock, &options, &stats), EMU_REPLAY_SOURCE_FAILED);
+		EMU_CHECK_EQUAL(stats.Events, 100);
+		options.Loops = 1;
+		Source.Next = 0;
+		EMU_CHECK_EQUAL(EmuReplayRun(&source, &transport, &clock, &options, &stats), EMU_REPLAY_DONE);
+	}
+
+	//an empty source is done at once, even when looping forever
+	FillSource(0, 8);
+	ResetWorld();
+	EMU_CHECK_EQUAL(Play(100, 0, 0, &stats), EMU_REPLAY_DONE);
+	EMU_CHECK_EQUAL(stats.Events, 0);
+	EMU_CHECK_EQUAL(World.Waits, 0);
+}
+
+static void TestFailures(void)
+{
+	EMU_REPLAY_SOURCE source = { &Source, Read, Rewind, CORPUS_FREQUENCY };
+	EMU_REPLAY_TRANSPORT transport = { &World, Insert };
+	EMU_REPLAY_CLOCK clock = { &World, Now, Wait, CLOCK_FREQUENCY };
+	EMU_REPLAY_OPTIONS options = { EMU_REC_MOUSE, 0, 100, 1, 0 };
+	EMU_REPLAY_STATS stats;
+
+	FillSource(100, 9);
+	ResetWorld();
+	World.FailAfter = 40;
+	EMU_CHECK_EQUAL(Play(100, 1, 0, &stats), EMU_REPLAY_INSERT_FAILED);
+	EMU_CHECK_EQUAL(stats.Events, 40);
+
+	options.SpeedPercent = EMU_REPLAY_SPEED_MIN - 1;
+	EMU_CHECK_EQUAL(EmuReplayRun(&source, &transport, &clock, &options, &stats), EMU_REPLAY_INVALID);
+	options.SpeedPercent = EMU_REPLAY_SPEED_MAX + 1;
+	EMU_CHECK_EQUAL(EmuReplayRun(&source, &transport, &clock, &options, &stats), EMU_REPLAY_INVALID);
+	options.SpeedPercent = 100;
+	options.Window = -1;
+	EMU_CHECK_EQUAL(EmuReplayRun(&source, &transport, &clock, &options, &stats), EMU_REPLAY_INVALID);
+	options.Window = 0;
+	options.Kind = 3;
+	EMU_CHECK_EQUAL(EmuReplayRun(&source, &transport, &clock, &options, &stats), EMU_REPLAY_INVALID);
+	options.Kind = EMU_REC_MOUSE;
+	clock.Frequency = 0;
+	EMU_CHECK_EQUAL(EmuReplayRun(&source, &transport, &clock, &options, &stats), EMU_REPLAY_INVALID);
+	clock.Frequency = CLOCK_FREQUENCY;
+	transport.Insert = NULL;
+	EMU_CHECK_EQUAL(EmuReplayRun(&source, &transport, &clock, &options, &stats), EMU_REPLAY_INVALID);
+	EMU_CHECK_EQUAL(stats.Events, 0);
+}
+
+static void TestKeyboard(void)
+{
+	EMU_REPLAY_SOURCE source = { &Source, Read, Rewind, CORPUS_FREQUENCY };
+	EMU_REPLAY_TRANSPORT transport = { &World, Insert };
+	EMU_REPLAY_CLOCK clock = { &World, Now, Wait, CLOCK_FREQUENCY };
+	EMU_REPLAY_OPTIONS options = { EMU_REC_KEYBOARD, 0, 100, 1, 0 };
+	static CORPUS_KEY_EVENT corpus[1000];
+	EMU_REPLAY_STATS stats;
+
+	CorpusTyping(corpus, 1000, 10);
+	for (ULONG i = 0; i < 1000; i++)
+	{
+		RtlZeroMemory(&Source.Events[i].Input, sizeof(EMU_REPLAY_INPUT));
+		Source.Events[i].Time = corpus[i].Time;
+		Source.Events[i].Input.Keyboard = corpus[i].Input;
+		Source.Events[i].Input.Keyboard.MakeCode = (USHORT)i;
+	}
+	Source.Count = 1000;
+	Source.Next = 0;
+	Source.ReadSize = EMU_REPLAY_LOOKAHEAD;
+	ResetWorld();
+	World.Kind = EMU_REC_KEYBOARD;
+	EMU_CHECK_EQUAL(EmuReplayRun(&source, &transport, &clock, &options, &stats), EMU_REPLAY_DONE);
+	for (ULONG i = 0; i < 1000; i++)
+		EMU_CHECK_EQUAL(World.InjectedX[i], i);
+	CheckTiming("keyboard", 100, 0, 0, 1000);
+}
+
+int main(void)
+{
+	TestSpeeds();
+	TestLateWakeups();
+	TestWindow();
+	TestLoops();
+	TestFailures();
+	TestKeyboard();
+	return EMU_TEST_RESULT();
+}
@@ -0,0 +1,92 @@
+/*++
+
+Module Name:
+
+	ReplayFileBenchmark.c
+
+Abstract:
+
+	Writes a multi-gigabyte replay file of relative mouse motion, then
+	times opening it, seeking to random times and reading it through from
+	start to end. The size in MB and the directory of the file can be
+	given on the command line, the file is removed at the end.
+
+		ReplayFileBenchmark [megabytes [directory]]
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include "EmuBench.h"
+#include "InputCorpus.h"
+#include "ReplayStore.h"
+
+#define BLOCK 65536
+#define SEEKS 200000
+
+int main(int argc, char** argv)
+{
+	ULONG64 target = (ULONG64)(argc > 1 ? atoll(argv[1]) : 2048) << 20;
+	const char* directory = argc > 2 ? argv[2] : "/tmp";
+	CORPUS_MOUSE_EVENT* events = (CORPUS_MOUSE_EVENT*)malloc(BLOCK * sizeof(CORPUS_MOUSE_EVENT));
+	REPLAY_WRITER* writer;
+	REPLAY_READER reader;
+	MOUSE_INPUT_DATA input;
+	char path[4096];
+	LONG64 timeBase = 0;
+	LONG64 time;
+	LONG64 start;
+	LONG64 elapsed;
+	ULONG64 state = 31;
+	ULONG64 count = 0;
+	ULONG seed = 0;
+
+	snprintf(path, sizeof(path), "%s/ReplayFileBenchmark.%d", directory, (int)getpid());
+	writer = ReplayCreate(path, EMU_REC_MOUSE, CORPUS_FREQUENCY);
+	if (writer == NULL) {
+		printf("can't create %s\n", path);
+		return 1;
+	}
+	start = EmuBenchNow();
+	while (writer->Offset < target)
+	{
+		CorpusMouse(events, BLOCK, ++seed, FALSE);
+		for (ULONG i = 0; i < BLOCK; i++)
+			ReplayAppend(writer, timeBase + events[i].Time, &events[i].Input);
+		timeBase += events[BLOCK - 1].Time;
+	}
+	ReplayFinish(writer);
+	elapsed = EmuBenchNow() - start;
+	printf("%-48s %12.1f MB/s %12.1f MB\n", "write", (double)target / (1 << 20) / ((double)elapsed / 1e9), (double)target / (1 << 20));
+
+	start = EmuBenchNow();
+	ReplayOpen(&reader, path, EMU_REC_MOUSE);
+	EmuBenchReport("open and map", 1, EmuBenchNow() - start);
+	printf("%-48s %12llu events %8u chunks\n", "file", (unsigned long long)reader.Header.EventCount, reader.Header.ChunkCount);
+
+	//a seek is a binary search of the index and the decoding of part of a chunk
+	start = EmuBenchNow();
+	for (ULONG i = 0; i < SEEKS; i++)
+	{
+		ReplaySeek(&reader, (LONG64)(CorpusNext(&state) % (ULONG64)timeBase));
+		if (ReplayNext(&reader, &time, &input))
+			EmuBenchSink += time;
+	}
+	EmuBenchReport("seek to a random time and read", SEEKS, EmuBenchNow() - start);
+
+	ReplaySeek(&reader, 0);
+	start = EmuBenchNow();
+	while (ReplayNext(&reader, &time, &input))
+		count++;
+	elapsed = EmuBenchNow() - start;
+	EmuBenchReport("read through", (LONG64)count, elapsed);
+	printf("%-48s %12.1f MB/s\n", "read through", (double)reader.Header.IndexOffset / (1 << 20) / ((double)elapsed / 1e9));
+	ReplayClose(&reader);
+	unlink(path);
+	free(events);
+	return 0;
+}
@@ -0,0 +1,327 @@
+/*++
+
+Module Name:
+
+	ReplayFileTest.c
+
+Abstract:
+
+	Writes replay files in the layout of ReplayFile.h and reads them back
+	through a mapping: every event in order, seeks to any time landing on
+	the first event at or after it, events sharing a time across chunks,
+	chunks past 4 GB in a sparse file, and files that were not finished,
+	are truncated or carry a damaged index or chunk.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include "EmuTest.h"
+#include "InputCorpus.h"
+#include "ReplayStore.h"
+
+#define EVENTS 400000
+#define SEEKS 5000
+
+static char Path[] = "/tmp/ReplayFileTestXXXXXX";
+
+static BOOLEAN SameMouse(const MOUSE_INPUT_DATA* Left, const MOUSE_INPUT_DATA* Right)
+{
+	return Left->UnitId == Right->UnitId && Left->Flags == Right->Flags && Left->Buttons == Right->Buttons &&
+		Left->RawButtons == Right->RawButtons && Left->LastX == Right->LastX && Left->LastY == Right->LastY &&
+		Left->ExtraInformation == Right->ExtraInformation;
+}
+
+static void WriteFile(const CORPUS_MOUSE_EVENT* Events, ULONG Count, ULONG64 HoleAt, ULONG64 HoleBytes)
+{
+	REPLAY_WRITER* writer = ReplayCreate(Path, EMU_REC_MOUSE, CORPUS_FREQUENCY);
+
+	EMU_CHECK(writer != NULL);
+	if (writer == NULL)
+		return;
+	for (ULONG i = 0; i < Count; i++)
+	{
+		if (i == HoleAt)
+			EMU_CHECK(ReplaySkip(writer, HoleBytes));
+		EMU_CHECK(ReplayAppend(writer, Events[i].Time, &Events[i].Input));
+	}
+	EMU_CHECK(ReplayFinish(writer));
+}
+
+//
+//The first event at or after Time, the events are in the order of their times
+//
+static ULONG LowerBound(const CORPUS_MOUSE_EVENT* Events, ULONG Count, LONG64 Time)
+{
+	ULONG low = 0;
+	ULONG high = Count;
+
+	while (low < high)
+	{
+		ULONG middle = low + (high - low) / 2;
+		if (Events[middle].Time < Time)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+static void CheckReadAll(const CORPUS_MOUSE_EVENT* Events, ULONG Count)
+{
+	REPLAY_READER reader;
+	MOUSE_INPUT_DATA input;
+	LONG64 time;
+	ULONG read = 0;
+
+	EMU_CHECK(ReplayOpen(&reader, Path, EMU_REC_MOUSE));
+	EMU_CHECK_EQUAL(reader.Header.EventCount, Count);
+	EMU_CHECK_EQUAL(reader.Header.LastTime, Events[Count - 1].Time);
+	//nothing is decoded before reading starts
+	EMU_CHECK_EQUAL(reader.ChunksEntered, 0);
+	while (ReplayNext(&reader, &time, &input))
+	{
+		if (read >= Count || time != Events[read].Time || !SameMouse(&input, &Events[read].Input)) {
+			printf("event %u read back wrong\n", read);
+			EmuTestFailures++;
+			break;
+		}
+		read++;
+	}
+	EMU_CHECK_EQUAL(read, Count);
+	EMU_CHECK_EQUAL(reader.ChunksEntered, reader.Header.ChunkCount);
+	ReplayClose(&reader);
+}
+
+static void CheckSeeks(const CORPUS_MOUSE_EVENT* Events, ULONG Count, ULONG64 Seed)
+{
+	REPLAY_READER reader;
+	MOUSE_INPUT_DATA input;
+	LONG64 first = Events[0].Time;
+	LONG64 span = Events[Count - 1].Time - first + 200;
+	LONG64 time;
+	ULONG64 state = Seed;
+
+	EMU_CHECK(ReplayOpen(&reader, Path, EMU_REC_MOUSE));
+	for (ULONG i = 0; i < SEEKS; i++)
+	{
+		ULONG64 random = CorpusNext(&state);
+		//random times, and the exact times of events which may open a chunk
+		LONG64 target = i & 1 ? Events[random % Count].Time : first - 100 + (LONG64)(random % (ULONG64)span);
+		ULONG expected = LowerBound(Events, Count, target);
+		ULONG64 entered = reader.ChunksEntered;
+
+		EMU_CHECK(ReplaySeek(&reader, target));
+		if (expected == Count) {
+			EMU_CHECK(!ReplayNext(&reader, &time, &input));
+			continue;
+		}
+		if (!ReplayNext(&reader, &time, &input) || time != Events[expected].Time || !SameMouse(&input, &Events[expected].Input)) {
+			printf("seek to %lld misses event %u\n", (long long)target, expected);
+			EmuTestFailures++;
+			break;
+		}
+		//a seek decodes at most the chunk it lands in and the one after it
+		EMU_CHECK(reader.ChunksEntered - entered <= 2);
+	}
+	ReplayClose(&reader);
+}
+
+static void TestRoundTrip(CORPUS_MOUSE_EVENT* Events)
+{
+	CorpusMouse(Events, EVENTS, 21, FALSE);
+	WriteFile(Events, EVENTS, EVENTS, 0);
+	CheckReadAll(Events, EVENTS);
+	CheckSeeks(Events, EVENTS, 22);
+}
+
+static void TestSharedTimes(CORPUS_MOUSE_EVENT* Events)
+{
+	//batches of packets sharing a time, long enough to span chunks
+	CorpusMouse(Events, EVENTS, 23, TRUE);
+	for (ULONG i = 0; i < EVENTS; i++)
+		Events[i].Time = (LONG64)(i / 30000) * CORPUS_FREQUENCY;
+	WriteFile(Events, EVENTS, EVENTS, 0);
+	CheckReadAll(Events, EVENTS);
+	CheckSeeks(Events, EVENTS, 24);
+}
+
+static void TestLargeOffsets(CORPUS_MOUSE_EVENT* Events)
+{
+	struct stat status;
+
+	//the second half of the chunks lies past 5 GB
+	CorpusMouse(Events, EVENTS, 25, FALSE);
+	WriteFile(Events, EVENTS, EVENTS / 2, 5ull << 30);
+	EMU_CHECK(stat(Path, &status) == 0 && (ULONG64)status.st_size > (5ull << 30));
+	CheckReadAll(Events, EVENTS);
+	CheckSeeks(Events, EVENTS, 26);
+}
+
+static void TestKeyboard(void)
+{
+	CORPUS_KEY_EVENT events[5000];
+	REPLAY_WRITER* writer = ReplayCreate(Path, EMU_REC_KEYBOARD, CORPUS_FREQUENCY);
+	REPLAY_READER reader;
+	KEYBOARD_INPUT_DATA input;
+	LONG64 time;
+	ULONG read = 0;
+
+	CorpusTyping(events, 5000, 27);
+	for (ULONG i = 0; i < 5000; i++)
+		ReplayAppend(writer, events[i].Time, &events[i].Input);
+	EMU_CHECK(ReplayFinish(writer));
+
+	//a keyboard file is no mouse file
+	EMU_CHECK(!ReplayOpen(&reader, Path, EMU_REC_MOUSE));
+	EMU_CHECK(ReplayOpen(&reader, Path, EMU_REC_KEYBOARD));
+	EMU_CHECK(ReplaySeek(&reader, events[2500].Time));
+	while (ReplayNext(&reader, &time, &input))
+	{
+		ULONG i = 2500 + read++;
+
+		if (i >= 5000 || time != events[i].Time || input.MakeCode != events[i].Input.MakeCode || input.Flags != events[i].Input.Flags) {
+			printf("keyboard event %u read back wrong\n", i);
+			EmuTestFailures++;
+			break;
+		}
+	}
+	EMU_CHECK_EQUAL(read, 2500);
+	ReplayClose(&reader);
+
+	//a file without events
+	writer = ReplayCreate(Path, EMU_REC_KEYBOARD, CORPUS_FREQUENCY);
+	EMU_CHECK(ReplayFinish(writer));
+	EMU_CHECK(ReplayOpen(&reader, Path, EMU_REC_KEYBOARD));
+	EMU_CHECK_EQUAL(reader.Header.ChunkCount, 0);
+	EMU_CHECK(ReplaySeek(&reader, 1000));
+	EMU_CHECK(!ReplayNext(&reader, &time, &input));
+	ReplayClose(&reader);
+}
+
+static void Patch(ULONG64 Offset, const VOID* Bytes, ULONG Size)
+{
+	int file = open(Path, O_WRONLY);
+
+	EMU_CHECK(pwrite(file, Bytes, Size, (off_t)Offset) == (ssize_t)Size);
+	close(file);
+}
+
+//
+//Reads as far as the file lets, a damaged chunk ends the reading
+//
+static ULONG ReadCount(void)
+{
+	REPLAY_READER reader;
+	MOUSE_INPUT_DATA input;
+	LONG64 time;
+	ULONG read = 0;
+
+	if (!ReplayOpen(&reader, Path, EMU_REC_MOUSE))
+		return (ULONG)-1;
+	while (ReplayNext(&reader, &time, &input))
+		read++;
+	ReplayClose(&reader);
+	return read;
+}
+
+static void TestDamaged(CORPUS_MOUSE_EVENT* Events)
+{
+	EMU_REPLAY_HEADER header;
+	EMU_REPLAY_INDEX entry;
+	EMU_REPLAY_CHUNK chunk;
+	EMU_REPLAY_INDEX second;
+	REPLAY_READER reader;
+	ULONG64 zero = 0;
+	ULONG firstCount;
+	int file;
+
+	CorpusMouse(Events, 100000, 28, FALSE);
+	WriteFile(Events, 100000, 100000, 0);
+	EMU_CHECK(ReplayOpen(&reader, Path, EMU_REC_MOUSE));
+	header = reader.Header;
+	entry = reader.Index[0];
+	second = reader.Index[1];
+	memcpy(&chunk, reader.Base + entry.Offset, sizeof(chunk));
+	ReplayClose(&reader);
+	firstCount = chunk.Count;
+	EMU_CHECK(header.ChunkCount > 2);
+	EMU_CHECK_EQUAL(ReadCount(), 100000);
+
+	//a writer that never finished left no index
+	Patch(FIELD_OFFSET(EMU_REPLAY_HEADER, IndexOffset), &zero, sizeof(zero));
+	EMU_CHECK_EQUAL(ReadCount(), (ULONG)-1);
+	Patch(FIELD_OFFSET(EMU_REPLAY_HEADER, IndexOffset), &header.IndexOffset, sizeof(header.IndexOffset));
+
+	//an index cut short, down to the header alone
+	file = open(Path, O_WRONLY);
+	EMU_CHECK(ftruncate(file, (off_t)(header.IndexOffset + (header.ChunkCount - 1) * sizeof(EMU_REPLAY_INDEX))) == 0);
+	EMU_CHECK_EQUAL(ReadCount(), (ULONG)-1);
+	EMU_CHECK(ftruncate(file, sizeof(EMU_REPLAY_HEADER) - 1) == 0);
+	EMU_CHECK_EQUAL(ReadCount(), (ULONG)-1);
+	close(file);
+
+	//damaged chunks of an index that is fine end the reading before them
+	WriteFile(Events, 100000, 100000, 0);
+	chunk.Magic ^= 1;
+	Patch(second.Offset, &chunk, sizeof(chunk));
+	EMU_CHECK_EQUAL(ReadCount(), firstCount);
+
+	WriteFile(Events, 100000, 100000, 0);
+	entry.Time += 1;
+	Patch(header.IndexOffset, &entry, sizeof(entry));
+	EMU_CHECK_EQUAL(ReadCount(), 0);
+	entry.Time -= 1;
+
+	//chunks claiming more bytes than there are, or lying in the index or the header
+	WriteFile(Events, 100000, 100000, 0);
+	chunk.Magic ^= 1;
+	chunk.Bytes = EMU_REPLAY_CHUNK_BYTES + 1;
+	Patch(entry.Offset, &chunk, sizeof(chunk));
+	EMU_CHECK_EQUAL(ReadCount(), 0);
+
+	WriteFile(Events, 100000, 100000, 0);
+	second.Offset = header.IndexOffset - sizeof(EMU_REPLAY_CHUNK) + 1;
+	Patch(header.IndexOffset + sizeof(EMU_REPLAY_INDEX), &second, sizeof(second));
+	EMU_CHECK_EQUAL(ReadCount(), firstCount);
+	second.Offset = 0xFFFFFFFFFFFFFFF0ull;
+	Patch(header.IndexOffset + sizeof(EMU_REPLAY_INDEX), &second, sizeof(second));
+	EMU_CHECK_EQUAL(ReadCount(), firstCount);
+	second.Offset = 8;
+	Patch(header.IndexOffset + sizeof(EMU_REPLAY_INDEX), &second, sizeof(second));
+	EMU_CHECK_EQUAL(ReadCount(), firstCount);
+
+	//events that don't decode end their chunk early
+	WriteFile(Events, 100000, 100000, 0);
+	{
+		UCHAR garbage[64];
+
+		memset(garbage, 0xFF, sizeof(garbage));
+		Patch(entry.Offset + sizeof(EMU_REPLAY_CHUNK) + 100, garbage, sizeof(garbage));
+		EMU_CHECK(ReadCount() < 100000);
+	}
+}
+
+int main(void)
+{
+	CORPUS_MOUSE_EVENT* events = (CORPUS_MOUSE_EVENT*)malloc(EVENTS * sizeof(CORPUS_MOUSE_EVENT));
+	int file = mkstemp(Path);
+
+	if (file < 0) {
+		printf("no temporary file\n");
+		return 1;
+	}
+	close(file);
+	TestRoundTrip(events);
+	TestSharedTimes(events);
+	TestLargeOffsets(events);
+	TestKeyboard();
+	TestDamaged(events);
+	unlink(Path);
+	free(events);
+	return EMU_TEST_RESULT();
+}
@@ -0,0 +1,237 @@
+/*++
+
+Module Name:
+
+	ReplayStore.h
+
+Abstract:
+
+	POSIX counterpart of the replay file writer and reader of the native
+	APIs, for the off target tests and benchmarks of ReplayFile.h. The
+	writer streams chunks with stdio and writes the index at the end, the
+	reader maps the file and decodes a chunk only once reading reaches it,
+	with the same checks as KeyboardReplayOpen and EnterReplayChunk.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#ifndef REPLAYSTORE_H
+#define REPLAYSTORE_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ReplayFile.h"
+
+typedef struct _REPLAY_WRITER {
+	FILE* File;
+	EMU_REPLAY_HEADER Header;
+	EMU_REPLAY_CHUNK Chunk;
+	EMU_REC_STATE State;
+	PEMU_REPLAY_INDEX Index;
+	ULONG IndexCapacity;
+	ULONG Used;
+	ULONG64 Offset;
+	UCHAR Events[EMU_REPLAY_CHUNK_BYTES];
+} REPLAY_WRITER;
+
+typedef struct _REPLAY_READER {
+	int File;
+	const UCHAR* Base;
+	ULONG64 Size;
+	EMU_REPLAY_HEADER Header;
+	const EMU_REPLAY_INDEX* Index;
+	EMU_REPLAY_CURSOR Cursor;
+	ULONG NextChunk;
+	//
+	//Chunks entered since the file was opened
+	//
+	ULONG64 ChunksEntered;
+	LONG64 SeekTime;
+} REPLAY_READER;
+
+static BOOLEAN ReplayWriteChunk(REPLAY_WRITER* Writer)
+{
+	if (Writer->Chunk.Count == 0)
+		return TRUE;
+	if (Writer->Header.ChunkCount == Writer->IndexCapacity) {
+		ULONG capacity = Writer->IndexCapacity ? Writer->IndexCapacity * 2 : 256;
+		PEMU_REPLAY_INDEX index = (PEMU_REPLAY_INDEX)realloc(Writer->Index, capacity * sizeof(EMU_REPLAY_INDEX));
+
+		if (index == NULL)
+			return FALSE;
+		Writer->Index = index;
+		Writer->IndexCapacity = capacity;
+	}
+	Writer->Chunk.Bytes = Writer->Used;
+	if (fwrite(&Writer->Chunk, sizeof(Writer->Chunk), 1, Writer->File) != 1 ||
+		fwrite(Writer->Events, 1, Writer->Used, Writer->File) != Writer->Used)
+		return FALSE;
+	Writer->Index[Writer->Header.ChunkCount].Time = Writer->Chunk.FirstTime;
+	Writer->Index[Writer->Header.ChunkCount].Offset = Writer->Offset;
+	Writer->Header.ChunkCount++;
+	Writer->Offset += sizeof(Writer->Chunk) + Writer->Used;
+	Writer->Chunk.Count = 0;
+	Writer->Used = 0;
+	return TRUE;
+}
+
+static REPLAY_WRITER* ReplayCreate(const char* Path, USHORT Kind, LONG64 Frequency)
+{
+	REPLAY_WRITER* writer = (REPLAY_WRITER*)calloc(1, sizeof(REPLAY_WRITER));
+
+	writer->File = fopen(Path, "wb");
+	if (writer->File == NULL) {
+		free(writer);
+		return NULL;
+	}
+	EmuReplayInitializeHeader(&writer->Header, Kind, Frequency);
+	writer->Chunk.Magic = EMU_REPLAY_CHUNK_MAGIC;
+	writer->Offset = sizeof(writer->Header);
+	//the header is written again once the index is in place
+	fwrite(&writer->Header, sizeof(writer->Header), 1, writer->File);
+	return writer;
+}
+
+static BOOLEAN ReplayAppend(REPLAY_WRITER* Writer, LONG64 Time, const VOID* Input)
+{
+	if (Writer->Used > EMU_REPLAY_CHUNK_BYTES - EMU_REC_MAX_EVENT && !ReplayWriteChunk(Writer))
+		return FALSE;
+	if (Writer->Chunk.Count == 0) {
+		//a chunk starts where the one before ended, time never runs backwards
+		if (Writer->Header.EventCount > 0 && Time < Writer->Header.LastTime)
+			Time = Writer->Header.LastTime;
+		Writer->Chunk.FirstTime = Time;
+		EmuRecReset(&Writer->State, Time);
+	}
+	if (Writer->Header.Kind == EMU_REC_KEYBOARD)
+		Writer->Used += EmuRecEncodeKeyboard(&Writer->State, Time, (const KEYBOARD_INPUT_DATA*)Input, Writer->Events + Writer->Used);
+	else
+		Writer->Used += EmuRecEncodeMouse(&Writer->State, Time, (const MOUSE_INPUT_DATA*)Input, Writer->Events + Writer->Used);
+	Writer->Chunk.Count++;
+	Writer->Chunk.LastTime = Writer->State.Time;
+	Writer->Header.EventCount++;
+	Writer->Header.LastTime = Writer->State.Time;
+	return TRUE;
+}
+
+//
+//Closes the current chunk and leaves a hole of Bytes in the file, so chunk
+//offsets past 4 GB are tested without writing gigabytes
+//
+static BOOLEAN ReplaySkip(REPLAY_WRITER* Writer, ULONG64 Bytes)
+{
+	if (!ReplayWriteChunk(Writer) || fseeko(Writer->File, (off_t)Bytes, SEEK_CUR) != 0)
+		return FALSE;
+	Writer->Offset += Bytes;
+	return TRUE;
+}
+
+static BOOLEAN ReplayFinish(REPLAY_WRITER* Writer)
+{
+	BOOLEAN result = ReplayWriteChunk(Writer);
+
+	if (result && Writer->Header.ChunkCount > 0)
+		result = fwrite(Writer->Index, sizeof(EMU_REPLAY_INDEX), Writer->Header.ChunkCount, Writer->File) == Writer->Header.ChunkCount;
+	if (result) {
+		Writer->Header.IndexOffset = Writer->Offset;
+		result = fseeko(Writer->File, 0, SEEK_SET) == 0 &&
+			fwrite(&Writer->Header, sizeof(Writer->Header), 1, Writer->File) == 1;
+	}
+	if (fclose(Writer->File) != 0)
+		result = FALSE;
+	free(Writer->Index);
+	free(Writer);
+	return result;
+}
+
+static BOOLEAN ReplayEnterChunk(REPLAY_READER* Reader, ULONG Chunk)
+{
+	const EMU_REPLAY_INDEX* entry;
+	EMU_REPLAY_CHUNK header;
+
+	Reader->Cursor.Left = 0;
+	Reader->NextChunk = Reader->Header.ChunkCount;
+	if (Chunk >= Reader->Header.ChunkCount)
+		return TRUE;
+	entry = &Reader->Index[Chunk];
+	if (entry->Offset < sizeof(EMU_REPLAY_HEADER) || entry->Offset > Reader->Header.IndexOffset - sizeof(EMU_REPLAY_CHUNK))
+		return FALSE;
+	memcpy(&header, Reader->Base + entry->Offset, sizeof(header));
+	if (!EmuReplayCheckChunk(&header, &Reader->Header, entry))
+		return FALSE;
+	EmuReplayBeginChunk(&Reader->Cursor, Reader->Header.Kind, &header, Reader->Base + entry->Offset + sizeof(header));
+	Reader->NextChunk = Chunk + 1;
+	Reader->ChunksEntered++;
+	return TRUE;
+}
+
+static BOOLEAN ReplayOpen(REPLAY_READER* Reader, const char* Path, USHORT Kind)
+{
+	struct stat status;
+
+	memset(Reader, 0, sizeof(*Reader));
+	Reader->File = open(Path, O_RDONLY);
+	if (Reader->File < 0)
+		return FALSE;
+	if (fstat(Reader->File, &status) != 0 || pread(Reader->File, &Reader->Header, sizeof(Reader->Header), 0) != sizeof(Reader->Header) ||
+		!EmuReplayCheckHeader(&Reader->Header, (ULONG64)status.st_size, Kind)) {
+		close(Reader->File);
+		return FALSE;
+	}
+	//pages of the chunks are only read once a chunk is entered
+	Reader->Size = (ULONG64)status.st_size;
+	Reader->Base = (const UCHAR*)mmap(NULL, (size_t)Reader->Size, PROT_READ, MAP_SHARED, Reader->File, 0);
+	if (Reader->Base == MAP_FAILED) {
+		close(Reader->File);
+		return FALSE;
+	}
+	Reader->Index = (const EMU_REPLAY_INDEX*)(Reader->Base + Reader->Header.IndexOffset);
+	Reader->SeekTime = Reader->Header.ChunkCount > 0 ? Reader->Index[0].Time : 0;
+	return TRUE;
+}
+
+static BOOLEAN ReplaySeek(REPLAY_READER* Reader, LONG64 Time)
+{
+	Reader->SeekTime = Time;
+	if (Reader->Header.ChunkCount == 0)
+		return TRUE;
+	return ReplayEnterChunk(Reader, EmuReplayFindChunk(Reader->Index, Reader->Header.ChunkCount, Time));
+}
+
+//
+//Reads the next event at or after the seek time, Input gets the packet of the kind of the file
+//
+static BOOLEAN ReplayNext(REPLAY_READER* Reader, PLONG64 Time, PVOID Input)
+{
+	for (;;)
+	{
+		BOOLEAN decoded = Reader->Header.Kind == EMU_REC_KEYBOARD ?
+			EmuReplayNextKeyboard(&Reader->Cursor, Time, (PKEYBOARD_INPUT_DATA)Input) :
+			EmuReplayNextMouse(&Reader->Cursor, Time, (PMOUSE_INPUT_DATA)Input);
+
+		if (!decoded) {
+			//chunks are entered only once reading reaches them
+			if (Reader->NextChunk >= Reader->Header.ChunkCount || !ReplayEnterChunk(Reader, Reader->NextChunk))
+				return FALSE;
+			continue;
+		}
+		if (*Time >= Reader->SeekTime)
+			return TRUE;
+	}
+}
+
+static void ReplayClose(REPLAY_READER* Reader)
+{
+	munmap((PVOID)Reader->Base, (size_t)Reader->Size);
+	close(Reader->File);
+}
+
+#endif // REPLAYSTORE_H
@@ -0,0 +1,172 @@
+/*++
+
+Module Name:
+
+	RuleEngineBenchmark.c
+
+Abstract:
+
+	Measures the rules of RuleEngine.c per packet as the rule table grows,
+	typing over keyboard rules on distinct scan codes and clicking over
+	mouse rules on every button.
+
+	Before: every rule is checked against every packet, as the engine did
+	before it was given an index.
+
+	After: the engine as it is, walking only the key chain of the scan code
+	or the button chains of the flags set in a packet.
+
+Environment:
+
+	user mode, off target
+
+--*/
+
+#include "EmuBench.h"
+#include "InputCorpus.h"
+#include "RuleEngine.h"
+
+#define PACKETS 4096
+#define ROUNDS 200
+#define MAX_RULES 512
+
+static EMU_RULE Rules[MAX_RULES];
+static USHORT IndexBuffer[(sizeof(EMU_RULE_INDEX) + 2 * MAX_RULES * sizeof(USHORT)) / sizeof(USHORT)];
+static KEYBOARD_INPUT_DATA Keys[PACKETS];
+static KEYBOARD_INPUT_DATA Work[PACKETS];
+static MOUSE_INPUT_DATA Buttons[PACKETS];
+static MOUSE_INPUT_DATA WorkButtons[PACKETS];
+
+static ULONG ScanKeyboardRules(USHORT RuleCount, PKEYBOARD_INPUT_DATA Inputs, ULONG InputCount)
+{
+	ULONG kept = 0;
+
+	for (ULONG i = 0; i < InputCount; i++)
+	{
+		BOOLEAN drop = FALSE;
+		USHORT checkFlag = Inputs[i].Flags == 0 ? 1 : (USHORT)(Inputs[i].Flags << 1);
+
+		for (USHORT j = 0; j < RuleCount; j++)
+		{
+			if (Inputs[i].MakeCode != Rules[j].From || (checkFlag & Rules[j].FlagPredicates) == 0)
+				continue;
+			if (!EmuRuleConditionHolds(&Rules[j], NULL, NULL))
+				continue;
+			if (Rules[j].Action == EMU_RULE_DROP)
+				drop = TRUE;
+			else
+				Inputs[i].MakeCode = Rules[j].To;
+			break;
+		}
+		if (!drop)
+			Inputs[kept++] = Inputs[i];
+	}
+	return kept;
+}
+
+static void ScanMouseRules(USHORT RuleCount, PMOUSE_INPUT_DATA Inputs, ULONG InputCount)
+{
+	for (ULONG i = 0; i < InputCount; i++)
+	{
+		USHORT stripped = 0;
+		USHORT added = 0;
+
+		for (USHORT j = 0; j < RuleCount; j++)
+		{
+			if (Rules[j].From == 0 || (Inputs[i].ButtonFlags & Rules[j].From) != Rules[j].From)
+				continue;
+			if (!EmuRuleConditionHolds(&Rules[j], NULL, NULL))
+				continue;
+			stripped |= Rules[j].From;
+			if (Rules[j].Action == EMU_RULE_REMAP)
+				added |= Rules[j].To;
+		}
+		Inputs[i].ButtonFlags = (USHORT)((Inputs[i].ButtonFlags & ~stripped) | added);
+	}
+}
+
+static void Report(const char* Name, USHORT RuleCount, LONG64 Nanoseconds)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "%s, %u rules", Name, RuleCount);
+	EmuBenchReport(name, (LONG64)PACKETS * ROUNDS, Nanoseconds);
+}
+
+static void RunKeyboard(USHORT RuleCount, BOOLEAN Before)
+{
+	const EMU_RULE_INDEX* index = (const EMU_RULE_INDEX*)IndexBuffer;
+	ULONG remapped;
+	LONG64 elapsed = 0;
+
+	//rules on scan codes nobody types, and one remapping every typed key at the end
+	for (USHORT j = 0; j < RuleCount; j++)
+	{
+		EMU_RULE rule = { EMU_CONDITION_NONE, 0, EMU_RULE_REMAP, 7, (USHORT)(0x60 + j), 0x01 };
+		Rules[j] = rule;
+	}
+	Rules[RuleCount - 1].From = 0x1E;
+	EmuValidateRules(Rules, RuleCount, (PEMU_RULE_INDEX)IndexBuffer);
+	for (ULONG round = 0; round < ROUNDS; round++)
+	{
+		LONG64 start;
+
+		memcpy(Work, Keys, sizeof(Keys));
+		start = EmuBenchNow();
+		EmuBenchSink += Before ? ScanKeyboardRules(RuleCount, Work, PACKETS) :
+			EmuApplyKeyboardRules(Rules, index, NULL, NULL, Work, PACKETS, NULL, NULL, &remapped);
+		elapsed += EmuBenchNow() - start;
+	}
+	Report(Before ? "before, keyboard" : "after, keyboard", RuleCount, elapsed);
+}
+
+static void RunMouse(USHORT RuleCount, BOOLEAN Before)
+{
+	const EMU_RULE_INDEX* index = (const EMU_RULE_INDEX*)IndexBuffer;
+	LONG64 elapsed = 0;
+
+	//chords of two buttons, most of them never pressed together
+	for (USHORT j = 0; j < RuleCount; j++)
+	{
+		EMU_RULE rule = { EMU_CONDITION_NONE, 0, EMU_RULE_REMAP, 0,
+			(USHORT)((1 << (j % 10)) | (1 << (10 + j % 2))), 0x0004 };
+		Rules[j] = rule;
+	}
+	EmuValidateRules(Rules, RuleCount, (PEMU_RULE_INDEX)IndexBuffer);
+	for (ULONG round = 0; round < ROUNDS; round++)
+	{
+		LONG64 start;
+
+		memcpy(WorkButtons, Buttons, sizeof(Buttons));
+		start = EmuBenchNow();
+		if (Before)
+			ScanMouseRules(RuleCount, WorkButtons, PACKETS);
+		else
+			EmuBenchSink += EmuApplyMouseRules(Rules, index, NULL, NULL, WorkButtons, PACKETS, NULL, NULL);
+		elapsed += EmuBenchNow() - start;
+	}
+	Report(Before ? "before, mouse" : "after, mouse", RuleCount, elapsed);
+}
+
+int main(void)
+{
+	static const USHORT ruleCounts[] = { 8, 64, 512 };
+	static CORPUS_KEY_EVENT typing[PACKETS];
+	static CORPUS_MOUSE_EVENT motion[PACKETS];
+
+	CorpusTyping(typing, PACKETS, 1);
+	CorpusMouse(motion, PACKETS, 1, FALSE);
+	for (ULONG i = 0; i < PACKETS; i++)
+	{
+		Keys[i] = typing[i].Input;
+		Buttons[i] = motion[i].Input;
+	}
+	for (ULONG i = 0; i < sizeof(ruleCounts) / sizeof(ruleCounts[0]); i++)
+	{
+		RunKeyboard(ruleCounts[i], TRUE);
+		RunKeyboard(ruleCounts[i], FALSE);
+		RunMouse(ruleCounts[i], TRUE);
+		RunMouse(ruleCounts[i], FALSE);
+	}
+	return 0;
+}
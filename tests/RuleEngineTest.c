@@ -0,0 +1,330 @@
+/*++
+
+Module Name:
+
+	RuleEngineTest.c
+
+Abstract:
+
+	Checks the conditional rules of RuleEngine.c, in particular that the
+	release of a key or button goes the way its press went when the
+	condition changes while it is held, and that the rule index picks the
+	same rules as a scan of every rule.
+
+--*/
+
+#include "EmuTest.h"
+#include "InputCorpus.h"
+#include "RuleEngine.h"
+
+//
+//ntddmou.h button flags
+//
+#define LEFT_DOWN	0x0001
+#define LEFT_UP		0x0002
+#define RIGHT_DOWN	0x0004
+#define RIGHT_UP	0x0008
+#define MIDDLE_DOWN	0x0010
+#define MIDDLE_UP	0x0020
+
+#define SCAN_W		0x11
+#define SCAN_UP		0x48
+#define SCAN_SHIFT	0x2A
+
+#define TEST_MAX_RULES	64
+
+static USHORT IndexBuffer[(sizeof(EMU_RULE_INDEX) + 2 * TEST_MAX_RULES * sizeof(USHORT)) / sizeof(USHORT)];
+
+static const EMU_RULE_INDEX* Index(const EMU_RULE* Rules, USHORT RuleCount)
+{
+	PEMU_RULE_INDEX index = (PEMU_RULE_INDEX)IndexBuffer;
+
+	EMU_CHECK(RuleCount <= TEST_MAX_RULES);
+	EMU_CHECK(EmuValidateRules(Rules, RuleCount, index));
+	return index;
+}
+
+static KEYBOARD_INPUT_DATA Key(USHORT MakeCode, USHORT Flags)
+{
+	KEYBOARD_INPUT_DATA input;
+
+	memset(&input, 0, sizeof(input));
+	input.MakeCode = MakeCode;
+	input.Flags = Flags;
+	return input;
+}
+
+static USHORT Buttons(const EMU_RULE* Rules, USHORT RuleCount, const EMU_INPUT_STATE* KeyboardState,
+	PEMU_BUTTON_LATCHES Latches, USHORT ButtonFlags)
+{
+	MOUSE_INPUT_DATA input;
+
+	memset(&input, 0, sizeof(input));
+	input.ButtonFlags = ButtonFlags;
+	EmuApplyMouseRules(Rules, Index(Rules, RuleCount), KeyboardState, NULL, &input, 1, Latches, NULL);
+	return input.ButtonFlags;
+}
+
+static void TestValidate(void)
+{
+	EMU_RULE rule = { EMU_CONDITION_BUTTON_DOWN, RIGHT_DOWN, EMU_RULE_REMAP, 3, SCAN_W, SCAN_UP };
+
+	EMU_CHECK(EmuValidateRules(&rule, 1, NULL));
+	rule.ConditionValue = RIGHT_UP;
+	EMU_CHECK(!EmuValidateRules(&rule, 1, NULL));
+	rule.ConditionValue = 0;
+	EMU_CHECK(!EmuValidateRules(&rule, 1, NULL));
+	rule.ConditionType = EMU_CONDITION_BUTTON_UP;
+	rule.ConditionValue = 0x0400;
+	EMU_CHECK(!EmuValidateRules(&rule, 1, NULL));
+	rule.ConditionValue = LEFT_DOWN | MIDDLE_DOWN;
+	EMU_CHECK(EmuValidateRules(&rule, 1, NULL));
+	rule.ConditionType = EMU_CONDITION_KEY_DOWN;
+	rule.ConditionValue = EMU_KEY_STATE_BITS;
+	EMU_CHECK(!EmuValidateRules(&rule, 1, NULL));
+}
+
+static void TestKeyReleasedAfterCondition(void)
+{
+	//W types up arrow while the right button is held, make and break predicates
+	EMU_RULE rule = { EMU_CONDITION_BUTTON_DOWN, RIGHT_DOWN, EMU_RULE_REMAP, 3, SCAN_W, SCAN_UP };
+	EMU_INPUT_STATE mouse;
+	EMU_KEY_LATCHES latches;
+	KEYBOARD_INPUT_DATA input;
+	ULONG remapped;
+
+	memset(&mouse, 0, sizeof(mouse));
+	memset(&latches, 0, sizeof(latches));
+	EmuTrackButtons(&mouse, RIGHT_DOWN);
+
+	input = Key(SCAN_W, KEY_MAKE);
+	EMU_CHECK_EQUAL(EmuApplyKeyboardRules(&rule, Index(&rule, 1), NULL, &mouse, &input, 1, &latches, NULL, &remapped), 1);
+	EMU_CHECK_EQUAL(input.MakeCode, SCAN_UP);
+
+	//the button goes up first, the repeat and the break still type up arrow
+	EmuTrackButtons(&mouse, RIGHT_UP);
+	input = Key(SCAN_W, KEY_MAKE);
+	EmuApplyKeyboardRules(&rule, Index(&rule, 1), NULL, &mouse, &input, 1, &latches, NULL, &remapped);
+	EMU_CHECK_EQUAL(input.MakeCode, SCAN_UP);
+	input = Key(SCAN_W, KEY_BREAK);
+	EmuApplyKeyboardRules(&rule, Index(&rule, 1), NULL, &mouse, &input, 1, &latches, NULL, &remapped);
+	EMU_CHECK_EQUAL(input.MakeCode, SCAN_UP);
+	EMU_CHECK_EQUAL(remapped, 1);
+
+	//the next press sees the condition again
+	input = Key(SCAN_W, KEY_MAKE);
+	EmuApplyKeyboardRules(&rule, Index(&rule, 1), NULL, &mouse, &input, 1, &latches, NULL, &remapped);
+	EMU_CHECK_EQUAL(input.MakeCode, SCAN_W);
+
+	//pressed without the condition, the break stays W after the button goes down
+	EmuTrackButtons(&mouse, RIGHT_DOWN);
+	input = Key(SCAN_W, KEY_BREAK);
+	EmuApplyKeyboardRules(&rule, Index(&rule, 1), NULL, &mouse, &input, 1, &latches, NULL, &remapped);
+	EMU_CHECK_EQUAL(input.MakeCode, SCAN_W);
+	EMU_CHECK_EQUAL(latches.Keys[SCAN_W].State, EMU_LATCH_NONE);
+}
+
+static void TestDroppedKeyStaysDropped(void)
+{
+	EMU_RULE rule = { EMU_CONDITION_KEY_DOWN, SCAN_SHIFT, EMU_RULE_DROP, 3, SCAN_W, 0 };
+	EMU_INPUT_STATE keyboard;
+	EMU_KEY_LATCHES latches;
+	KEYBOARD_INPUT_DATA inputs[2];
+	ULONG remapped;
+
+	memset(&keyboard, 0, sizeof(keyboard));
+	memset(&latches, 0, sizeof(latches));
+	EmuTrackKey(&keyboard, SCAN_SHIFT, KEY_MAKE);
+	inputs[0] = Key(SCAN_W, KEY_MAKE);
+	EMU_CHECK_EQUAL(EmuApplyKeyboardRules(&rule, Index(&rule, 1), &keyboard, NULL, inputs, 1, &latches, NULL, &remapped), 0);
+
+	EmuTrackKey(&keyboard, SCAN_SHIFT, KEY_BREAK);
+	inputs[0] = Key(SCAN_SHIFT, KEY_BREAK);
+	inputs[1] = Key(SCAN_W, KEY_BREAK);
+	EMU_CHECK_EQUAL(EmuApplyKeyboardRules(&rule, Index(&rule, 1), &keyboard, NULL, inputs, 2, &latches, NULL, &remapped), 1);
+	EMU_CHECK_EQUAL(inputs[0].MakeCode, SCAN_SHIFT);
+
+	//without latches every packet is evaluated on its own, as before
+	inputs[0] = Key(SCAN_W, KEY_BREAK);
+	EMU_CHECK_EQUAL(EmuApplyKeyboardRules(&rule, Index(&rule, 1), &keyboard, NULL, inputs, 1, NULL, NULL, &remapped), 1);
+}
+
+static void TestButtonReleasedAfterCondition(void)
+{
+	//right button is middle while shift is held
+	EMU_RULE rules[2] = {
+		{ EMU_CONDITION_KEY_DOWN, SCAN_SHIFT, EMU_RULE_REMAP, 0, RIGHT_DOWN, MIDDLE_DOWN },
+		{ EMU_CONDITION_KEY_DOWN, SCAN_SHIFT, EMU_RULE_REMAP, 0, RIGHT_UP, MIDDLE_UP }
+	};
+	EMU_INPUT_STATE keyboard;
+	EMU_BUTTON_LATCHES latches;
+
+	memset(&keyboard, 0, sizeof(keyboard));
+	memset(&latches, 0, sizeof(latches));
+	EmuTrackKey(&keyboard, SCAN_SHIFT, KEY_MAKE);
+	EMU_CHECK_EQUAL(Buttons(rules, 2, &keyboard, &latches, RIGHT_DOWN), MIDDLE_DOWN);
+	EmuTrackKey(&keyboard, SCAN_SHIFT, KEY_BREAK);
+	//the left button goes down in the same packet and is latched unchanged
+	EMU_CHECK_EQUAL(Buttons(rules, 2, &keyboard, &latches, RIGHT_UP | LEFT_DOWN), MIDDLE_UP | LEFT_DOWN);
+	EMU_CHECK_EQUAL(latches.Latched, LEFT_DOWN);
+
+	//pressed without shift, released with it
+	EMU_CHECK_EQUAL(Buttons(rules, 2, &keyboard, &latches, RIGHT_DOWN), RIGHT_DOWN);
+	EmuTrackKey(&keyboard, SCAN_SHIFT, KEY_MAKE);
+	EMU_CHECK_EQUAL(Buttons(rules, 2, &keyboard, &latches, RIGHT_UP), RIGHT_UP);
+
+	//the left button was latched unchanged and releases as itself
+	EMU_CHECK_EQUAL(Buttons(rules, 2, &keyboard, &latches, LEFT_UP), LEFT_UP);
+	EMU_CHECK_EQUAL(latches.Latched, 0);
+}
+
+static void TestDroppedButton(void)
+{
+	EMU_RULE rule = { EMU_CONDITION_KEY_DOWN, SCAN_SHIFT, EMU_RULE_DROP, 0, LEFT_DOWN, 0 };
+	EMU_INPUT_STATE keyboard;
+	EMU_BUTTON_LATCHES latches;
+
+	memset(&keyboard, 0, sizeof(keyboard));
+	memset(&latches, 0, sizeof(latches));
+	EmuTrackKey(&keyboard, SCAN_SHIFT, KEY_MAKE);
+	EMU_CHECK_EQUAL(Buttons(&rule, 1, &keyboard, &latches, LEFT_DOWN), 0);
+	EmuTrackKey(&keyboard, SCAN_SHIFT, KEY_BREAK);
+	EMU_CHECK_EQUAL(Buttons(&rule, 1, &keyboard, &latches, LEFT_UP), 0);
+}
+
+static ULONG ScanKeyboardRules(const EMU_RULE* Rules, USHORT RuleCount, const EMU_INPUT_STATE* KeyboardState,
+	PKEYBOARD_INPUT_DATA Inputs, ULONG InputCount, PULONG64 RuleHits)
+{
+	ULONG kept = 0;
+
+	for (ULONG i = 0; i < InputCount; i++)
+	{
+		BOOLEAN drop = FALSE;
+		USHORT checkFlag = Inputs[i].Flags == 0 ? 1 : (USHORT)(Inputs[i].Flags << 1);
+
+		for (USHORT j = 0; j < RuleCount; j++)
+		{
+			if (Inputs[i].MakeCode != Rules[j].From || (checkFlag & Rules[j].FlagPredicates) == 0)
+				continue;
+			if (!EmuRuleConditionHolds(&Rules[j], KeyboardState, NULL))
+				continue;
+			RuleHits[j]++;
+			if (Rules[j].Action == EMU_RULE_DROP)
+				drop = TRUE;
+			else
+				Inputs[i].MakeCode = Rules[j].To;
+			break;
+		}
+		if (!drop)
+			Inputs[kept++] = Inputs[i];
+	}
+	return kept;
+}
+
+static void ScanMouseRules(const EMU_RULE* Rules, USHORT RuleCount, const EMU_INPUT_STATE* KeyboardState,
+	PMOUSE_INPUT_DATA Inputs, ULONG InputCount, PULONG64 RuleHits)
+{
+	for (ULONG i = 0; i < InputCount; i++)
+	{
+		USHORT stripped = 0;
+		USHORT added = 0;
+
+		for (USHORT j = 0; j < RuleCount; j++)
+		{
+			if (Rules[j].From == 0 || (Inputs[i].ButtonFlags & Rules[j].From) != Rules[j].From)
+				continue;
+			if (!EmuRuleConditionHolds(&Rules[j], KeyboardState, NULL))
+				continue;
+			RuleHits[j]++;
+			stripped |= Rules[j].From;
+			if (Rules[j].Action == EMU_RULE_REMAP)
+				added |= Rules[j].To;
+		}
+		Inputs[i].ButtonFlags = (USHORT)((Inputs[i].ButtonFlags & ~stripped) | added);
+	}
+}
+
+static void RandomRule(PEMU_RULE Rule, ULONG64* State, BOOLEAN Mouse)
+{
+	ULONG64 random = CorpusNext(State);
+
+	memset(Rule, 0, sizeof(*Rule));
+	Rule->ConditionType = (random & 3) == 0 ? EMU_CONDITION_KEY_DOWN : EMU_CONDITION_NONE;
+	Rule->ConditionValue = SCAN_SHIFT;
+	Rule->Action = (random & 4) ? EMU_RULE_DROP : EMU_RULE_REMAP;
+	if (Mouse) {
+		//one or two of the low twelve flags, now and then none
+		Rule->From = (random & 0x38) == 0 ? 0 : (USHORT)((1 << ((random >> 8) % 12)) | ((random & 0x40) ? 1 << ((random >> 16) % 12) : 0));
+		Rule->To = (USHORT)((random >> 24) & EMU_BUTTON_DOWN_MASK);
+	}
+	else {
+		//0x100 apart codes share a key chain
+		Rule->FlagPredicates = (USHORT)(1 + (random >> 8) % 7);
+		Rule->From = (USHORT)(0x10 + (random >> 16) % 8 + ((random & 0x40) ? 0x100 : 0));
+		Rule->To = (USHORT)(0x30 + (random >> 24) % 8);
+	}
+}
+
+static void TestIndexMatchesScan(void)
+{
+	EMU_RULE rules[TEST_MAX_RULES];
+	ULONG64 indexHits[TEST_MAX_RULES];
+	ULONG64 scanHits[TEST_MAX_RULES];
+	KEYBOARD_INPUT_DATA keys[32];
+	KEYBOARD_INPUT_DATA expectedKeys[32];
+	MOUSE_INPUT_DATA buttons[32];
+	MOUSE_INPUT_DATA expectedButtons[32];
+	EMU_INPUT_STATE keyboard;
+	ULONG64 state = 0x2545F4914F6CDD1DULL;
+	ULONG remapped;
+
+	for (ULONG round = 0; round < 2000; round++)
+	{
+		USHORT ruleCount = (USHORT)(CorpusNext(&state) % (TEST_MAX_RULES + 1));
+		BOOLEAN mouse = (round & 1) != 0;
+		const EMU_RULE_INDEX* index;
+
+		for (USHORT j = 0; j < ruleCount; j++)
+			RandomRule(&rules[j], &state, mouse);
+		index = Index(rules, ruleCount);
+		memset(&keyboard, 0, sizeof(keyboard));
+		if (CorpusNext(&state) & 1)
+			EmuTrackKey(&keyboard, SCAN_SHIFT, KEY_MAKE);
+		memset(indexHits, 0, sizeof(indexHits));
+		memset(scanHits, 0, sizeof(scanHits));
+
+		for (ULONG i = 0; i < 32; i++)
+		{
+			ULONG64 random = CorpusNext(&state);
+			keys[i] = Key((USHORT)(0x10 + random % 8 + ((random & 8) ? 0x100 : 0)), (USHORT)((random >> 8) % 4));
+			memset(&buttons[i], 0, sizeof(buttons[i]));
+			buttons[i].ButtonFlags = (USHORT)(random >> 16) & 0x0FFF;
+		}
+		if (mouse) {
+			memcpy(expectedButtons, buttons, sizeof(buttons));
+			ScanMouseRules(rules, ruleCount, &keyboard, expectedButtons, 32, scanHits);
+			EmuApplyMouseRules(rules, index, &keyboard, NULL, buttons, 32, NULL, indexHits);
+			EMU_CHECK(memcmp(buttons, expectedButtons, sizeof(buttons)) == 0);
+		}
+		else {
+			ULONG kept;
+
+			memcpy(expectedKeys, keys, sizeof(keys));
+			kept = ScanKeyboardRules(rules, ruleCount, &keyboard, expectedKeys, 32, scanHits);
+			EMU_CHECK_EQUAL(EmuApplyKeyboardRules(rules, index, &keyboard, NULL, keys, 32, NULL, indexHits, &remapped), kept);
+			EMU_CHECK(memcmp(keys, expectedKeys, kept * sizeof(KEYBOARD_INPUT_DATA)) == 0);
+		}
+		EMU_CHECK(memcmp(indexHits, scanHits, ruleCount * sizeof(ULONG64)) == 0);
+	}
+}
+
+int main(void)
+{
+	TestValidate();
+	TestKeyReleasedAfterCondition();
+	TestDroppedKeyStaysDropped();
+	TestButtonReleasedAfterCondition();
+	TestDroppedButton();
+	TestIndexMatchesScan();
+	return EMU_TEST_RESULT();
+}
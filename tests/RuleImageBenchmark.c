@@ -0,0 +1,51 @@
+/*++
+
+Module Name:
+
+	RuleImageBenchmark.c
+
+Abstract:
+
+	Times the checksum and the validation of profile images of the sizes
+	SerializeProfiles writes, from a single profile up to the largest
+	image the driver loads.
+
+--*/
+
+#include "EmuBench.h"
+#include "RuleImage.h"
+
+static void BenchmarkImage(ULONG PayloadSize, ULONG Sections, LONG64 Iterations)
+{
+	ULONG capacity = sizeof(EMU_IMAGE_HEADER) + Sections * (sizeof(EMU_IMAGE_SECTION) + PayloadSize);
+	PUCHAR image = (PUCHAR)malloc(capacity);
+	PUCHAR payload = (PUCHAR)malloc(PayloadSize);
+	ULONG size = sizeof(EMU_IMAGE_HEADER);
+	char name[64];
+	LONG64 start;
+	LONG64 accepted = 0;
+
+	for (ULONG i = 0; i < PayloadSize; i++)
+		payload[i] = (UCHAR)(i * 31);
+	for (ULONG i = 0; i < Sections; i++)
+		EmuAppendImageSection(image, capacity, &size, EMU_SECTION_RULES, (USHORT)(i % 4), payload, PayloadSize, NULL, 0);
+	EmuFinishRuleImage(image, size, (USHORT)Sections);
+
+	start = EmuBenchNow();
+	for (LONG64 i = 0; i < Iterations; i++)
+		accepted += EmuValidateRuleImage(image, size);
+	snprintf(name, sizeof(name), "validate %u bytes in %u sections", size, Sections);
+	EmuBenchReport(name, Iterations, EmuBenchNow() - start);
+	EmuBenchSink = accepted;
+
+	free(payload);
+	free(image);
+}
+
+int main(void)
+{
+	BenchmarkImage(64, 4, 200000);
+	BenchmarkImage(4096, 16, 500);
+	BenchmarkImage(EMU_IMAGE_MAX_SIZE / 16 - sizeof(EMU_IMAGE_SECTION) - 1, 15, 20);
+	return 0;
+}
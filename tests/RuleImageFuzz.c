@@ -0,0 +1,144 @@
+/*++
+
+Module Name:
+
+	RuleImageFuzz.c
+
+Abstract:
+
+	Fuzzes EmuValidateRuleImage and the section walk with the bytes the
+	driver reads from the registry. Every input is tried as it is and
+	resealed with a matching header, so the section walk is reached
+	without guessing checksums. An accepted image must walk to its end
+	with every payload inside the image.
+
+	Built as a test it replays a fixed set of mutations of valid images.
+	Configured with -DEMU_FUZZ=ON and clang it is a libFuzzer target
+	instead.
+
+--*/
+
+#include "EmuTest.h"
+#include "RuleImage.h"
+
+#include <stdint.h>
+
+#define FUZZ_ITERATIONS 200000
+#define FUZZ_MAX_SIZE 256
+
+static void CheckImage(const UCHAR* Image, ULONG Size)
+{
+	EMU_IMAGE_HEADER header;
+	EMU_IMAGE_CURSOR cursor;
+	EMU_IMAGE_SECTION section;
+	const UCHAR* payload;
+	ULONG sections = 0;
+
+	if (!EmuValidateRuleImage(Image, Size))
+		return;
+	memcpy(&header, Image, sizeof(header));
+	EMU_CHECK_EQUAL(header.Size, Size);
+
+	EmuOpenRuleImage(&cursor, Image);
+	while (EmuNextImageSection(&cursor, &section, &payload))
+	{
+		EMU_CHECK(payload >= Image + sizeof(header));
+		EMU_CHECK(section.Length <= (ULONG)(Image + Size - payload));
+		sections++;
+	}
+	EMU_CHECK_EQUAL(sections, header.SectionCount);
+	EMU_CHECK(cursor.Next == Image + Size);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* Data, size_t Size)
+{
+	UCHAR* image;
+	USHORT sectionCount;
+
+	if (Size > EMU_IMAGE_MAX_SIZE - sizeof(EMU_IMAGE_HEADER))
+		return 0;
+
+	//an exact copy, so reading past the end is caught by the sanitizers
+	image = (UCHAR*)malloc(Size + sizeof(EMU_IMAGE_HEADER));
+	if (image == NULL)
+		return 0;
+	memcpy(image, Data, Size);
+	CheckImage(image, (ULONG)Size);
+
+	//the same bytes as the sections of an image with a valid header, the first two pick the count
+	sectionCount = Size >= 2 ? (USHORT)(Data[0] | Data[1] << 8) % 8 : 0;
+	memcpy(image + sizeof(EMU_IMAGE_HEADER), Data, Size);
+	EmuFinishRuleImage(image, (ULONG)(Size + sizeof(EMU_IMAGE_HEADER)), sectionCount);
+	CheckImage(image, (ULONG)(Size + sizeof(EMU_IMAGE_HEADER)));
+
+	free(image);
+	if (EmuTestFailures != 0)
+		abort();
+	return 0;
+}
+
+#ifndef EMU_LIBFUZZER
+
+static ULONG FuzzSeed = 0x12345678;
+
+//
+//xorshift32, the runs are the same on every machine
+//
+static ULONG FuzzRandom(void)
+{
+	FuzzSeed ^= FuzzSeed << 13;
+	FuzzSeed ^= FuzzSeed >> 17;
+	FuzzSeed ^= FuzzSeed << 5;
+	return FuzzSeed;
+}
+
+//
+//Sections only, with lengths that are mostly right
+//
+static ULONG BuildSections(PUCHAR Buffer, ULONG Capacity)
+{
+	ULONG size = 0;
+	ULONG count = FuzzRandom() % 6;
+
+	for (ULONG i = 0; i < count; i++)
+	{
+		EMU_IMAGE_SECTION section;
+		ULONG length = FuzzRandom() % 24;
+
+		if (size + sizeof(section) + length > Capacity)
+			break;
+		section.Type = (USHORT)(FuzzRandom() % 7);
+		section.Profile = (USHORT)(FuzzRandom() % 5);
+		section.Length = length;
+		if (FuzzRandom() % 8 == 0)
+			section.Length += FuzzRandom() % 16 - 8;
+		memcpy(Buffer + size, &section, sizeof(section));
+		size += sizeof(section);
+		for (ULONG j = 0; j < length; j++)
+			Buffer[size++] = (UCHAR)FuzzRandom();
+	}
+	return size;
+}
+
+int main(void)
+{
+	UCHAR buffer[FUZZ_MAX_SIZE];
+
+	for (ULONG i = 0; i < FUZZ_ITERATIONS && EmuTestFailures == 0; i++)
+	{
+		ULONG size = BuildSections(buffer + 2, sizeof(buffer) - 2) + 2;
+		ULONG flips = FuzzRandom() % 4;
+
+		//the count prefix LLVMFuzzerTestOneInput reads
+		buffer[0] = (UCHAR)FuzzRandom();
+		buffer[1] = 0;
+		for (ULONG j = 0; j < flips; j++)
+			buffer[FuzzRandom() % size] ^= (UCHAR)(1 << (FuzzRandom() % 8));
+		if (FuzzRandom() % 4 == 0)
+			size = FuzzRandom() % (size + 1);
+		LLVMFuzzerTestOneInput(buffer, size);
+	}
+	return EMU_TEST_RESULT();
+}
+
+#endif
@@ -0,0 +1,175 @@
+/*++
+
+Module Name:
+
+	RuleImageTest.c
+
+Abstract:
+
+	Writes profile images the way SerializeProfiles does and checks that
+	EmuValidateRuleImage accepts them whole and rejects every corrupted
+	byte and every truncation.
+
+--*/
+
+#include "EmuTest.h"
+#include "RuleImage.h"
+
+#define IMAGE_CAPACITY 512
+
+static const UCHAR FilterPayload[] = { 0x02, 0x00, 0x03, 0x00, 0x1E, 0x00, 0x01, 0x00, 0x30, 0x00, 0x02, 0x00, 0x2E, 0x00, 0x03, 0x00 };
+static const UCHAR ModifyPayload[] = { 0x01, 0x00, 0x10, 0x00, 0x11, 0x00, 0x03, 0x00 };
+
+//
+//Active profile 1, a filter in profile 0 and a modify in profile 1, sized with a NULL image first
+//
+static ULONG BuildImage(PUCHAR Image, ULONG Capacity)
+{
+	USHORT activeProfile = 1;
+	USHORT counts = 2;
+	ULONG size = sizeof(EMU_IMAGE_HEADER);
+	ULONG measured = sizeof(EMU_IMAGE_HEADER);
+
+	EmuAppendImageSection(NULL, 0, &measured, EMU_SECTION_ACTIVE_PROFILE, 0, &activeProfile, sizeof(activeProfile), NULL, 0);
+	EmuAppendImageSection(NULL, 0, &measured, EMU_SECTION_FILTER, 0, &counts, sizeof(counts), FilterPayload, sizeof(FilterPayload));
+	EmuAppendImageSection(NULL, 0, &measured, EMU_SECTION_MODIFY, 1, ModifyPayload, sizeof(ModifyPayload), NULL, 0);
+	if (measured > Capacity)
+		return 0;
+
+	EMU_CHECK(EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_ACTIVE_PROFILE, 0, &activeProfile, sizeof(activeProfile), NULL, 0));
+	EMU_CHECK(EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_FILTER, 0, &counts, sizeof(counts), FilterPayload, sizeof(FilterPayload)));
+	EMU_CHECK(EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_MODIFY, 1, ModifyPayload, sizeof(ModifyPayload), NULL, 0));
+	EMU_CHECK_EQUAL(size, measured);
+	EmuFinishRuleImage(Image, size, 3);
+	return size;
+}
+
+static void TestCrc(void)
+{
+	//the check value of CRC-32/ISO-HDLC
+	EMU_CHECK_EQUAL(EmuCrc32(0, "123456789", 9), 0xCBF43926);
+	//continuing over the second part gives the checksum of the whole
+	EMU_CHECK_EQUAL(EmuCrc32(EmuCrc32(0, "1234", 4), "56789", 5), 0xCBF43926);
+	EMU_CHECK_EQUAL(EmuCrc32(0, "", 0), 0);
+}
+
+static void TestRoundTrip(void)
+{
+	UCHAR image[IMAGE_CAPACITY];
+	EMU_IMAGE_CURSOR cursor;
+	EMU_IMAGE_SECTION section;
+	const UCHAR* payload;
+	ULONG size = BuildImage(image, sizeof(image));
+
+	EMU_CHECK(EmuValidateRuleImage(image, size));
+	EmuOpenRuleImage(&cursor, image);
+
+	EMU_CHECK(EmuNextImageSection(&cursor, &section, &payload));
+	EMU_CHECK_EQUAL(section.Type, EMU_SECTION_ACTIVE_PROFILE);
+	EMU_CHECK_EQUAL(section.Length, sizeof(USHORT));
+	EMU_CHECK_EQUAL(EmuReadUshort(payload), 1);
+
+	EMU_CHECK(EmuNextImageSection(&cursor, &section, &payload));
+	EMU_CHECK_EQUAL(section.Type, EMU_SECTION_FILTER);
+	EMU_CHECK_EQUAL(section.Profile, 0);
+	EMU_CHECK_EQUAL(section.Length, sizeof(USHORT) + sizeof(FilterPayload));
+	EMU_CHECK_EQUAL(EmuReadUshort(payload), 2);
+	EMU_CHECK(memcmp(payload + sizeof(USHORT), FilterPayload, sizeof(FilterPayload)) == 0);
+
+	EMU_CHECK(EmuNextImageSection(&cursor, &section, &payload));
+	EMU_CHECK_EQUAL(section.Type, EMU_SECTION_MODIFY);
+	EMU_CHECK_EQUAL(section.Profile, 1);
+	EMU_CHECK(memcmp(payload, ModifyPayload, sizeof(ModifyPayload)) == 0);
+
+	EMU_CHECK(!EmuNextImageSection(&cursor, &section, &payload));
+	EMU_CHECK(cursor.Next == cursor.End);
+}
+
+static void TestCapacity(void)
+{
+	UCHAR image[IMAGE_CAPACITY];
+	USHORT value = 0;
+	ULONG size = sizeof(EMU_IMAGE_HEADER);
+
+	//a section that doesn't fit leaves the size alone
+	EMU_CHECK(!EmuAppendImageSection(image, sizeof(EMU_IMAGE_HEADER) + sizeof(EMU_IMAGE_SECTION) + 1, &size,
+		EMU_SECTION_ACTIVE_PROFILE, 0, &value, sizeof(value), NULL, 0));
+	EMU_CHECK_EQUAL(size, sizeof(EMU_IMAGE_HEADER));
+	EMU_CHECK(EmuAppendImageSection(image, sizeof(EMU_IMAGE_HEADER) + sizeof(EMU_IMAGE_SECTION) + 2, &size,
+		EMU_SECTION_ACTIVE_PROFILE, 0, &value, sizeof(value), NULL, 0));
+	EMU_CHECK_EQUAL(size, sizeof(EMU_IMAGE_HEADER) + sizeof(EMU_IMAGE_SECTION) + 2);
+}
+
+static void TestCorruption(void)
+{
+	UCHAR image[IMAGE_CAPACITY];
+	ULONG size = BuildImage(image, sizeof(image));
+
+	//every byte is covered by the header checks, the checksum or the section walk
+	for (ULONG i = 0; i < size; i++)
+	{
+		for (ULONG bit = 0; bit < 8; bit++)
+		{
+			image[i] ^= (UCHAR)(1 << bit);
+			if (EmuValidateRuleImage(image, size)) {
+				printf("flipping bit %u of byte %u is not detected\n", bit, i);
+				EmuTestFailures++;
+			}
+			image[i] ^= (UCHAR)(1 << bit);
+		}
+	}
+	EMU_CHECK(EmuValidateRuleImage(image, size));
+}
+
+static void TestTruncation(void)
+{
+	UCHAR image[IMAGE_CAPACITY];
+	ULONG size = BuildImage(image, sizeof(image));
+
+	for (ULONG length = 0; length < size; length++)
+	{
+		if (EmuValidateRuleImage(image, length)) {
+			printf("image truncated to %u bytes is accepted\n", length);
+			EmuTestFailures++;
+		}
+	}
+	EMU_CHECK(!EmuValidateRuleImage(NULL, size));
+}
+
+static void TestSectionBounds(void)
+{
+	UCHAR image[IMAGE_CAPACITY];
+	EMU_IMAGE_SECTION section;
+	ULONG size = BuildImage(image, sizeof(image));
+
+	//a resealed image whose first section claims more than is left
+	memcpy(&section, image + sizeof(EMU_IMAGE_HEADER), sizeof(section));
+	section.Length = 0xFFFFFFF0;
+	memcpy(image + sizeof(EMU_IMAGE_HEADER), &section, sizeof(section));
+	EmuFinishRuleImage(image, size, 3);
+	EMU_CHECK(!EmuValidateRuleImage(image, size));
+
+	//bytes trailing the last section
+	size = BuildImage(image, sizeof(image));
+	image[size] = 0;
+	EmuFinishRuleImage(image, size + 1, 3);
+	EMU_CHECK(!EmuValidateRuleImage(image, size + 1));
+
+	//fewer sections than the header counts, and more
+	size = BuildImage(image, sizeof(image));
+	EmuFinishRuleImage(image, size, 4);
+	EMU_CHECK(!EmuValidateRuleImage(image, size));
+	EmuFinishRuleImage(image, size, 2);
+	EMU_CHECK(!EmuValidateRuleImage(image, size));
+}
+
+int main(void)
+{
+	TestCrc();
+	TestRoundTrip();
+	TestCapacity();
+	TestCorruption();
+	TestTruncation();
+	TestSectionBounds();
+	return EMU_TEST_RESULT();
+}
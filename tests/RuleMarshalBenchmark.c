@@ -0,0 +1,178 @@
+/*++
+
+Module Name:
+
+	RuleMarshalBenchmark.c
+
+Abstract:
+
+	Measures how KeyboardEmuAPI packs filter tables into IOCTL buffers,
+	through the transport of the in process host so the driver side costs
+	the same in every case, and counts the process heap allocations each
+	call makes.
+
+	Before: a fresh HeapAlloc per call, the table copied into it one entry
+	at a time, as the API did before it used per thread scratch buffers.
+
+	After: the API as it is, packing with memcpy into its scratch buffers.
+	Once they have grown to the size of the table a call allocates nothing.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include "EmuBench.h"
+#include "host/EmuHost.h"
+#include "../Dll/Native/KeyboardEmuAPI/KeyboardEmuAPI.h"
+
+#define CALLS 20000
+#define MAX_FILTERS 512
+
+static EMU_TRANSPORT Transport;
+static HANDLE Driver;
+static KEY_FILTER_DATA Filters[MAX_FILTERS];
+static KEY_FILTER_DATA ReadFilters[MAX_FILTERS];
+
+static BOOL SetFilteringBefore(PKEY_FILTER_REQUEST FilterRequest)
+{
+	HANDLE processHeap = GetProcessHeap();
+	DWORD requiredBytes = 2 * sizeof(USHORT) + FilterRequest->FilterCount * sizeof(KEY_FILTER_DATA);
+	PUSHORT buffer = (PUSHORT)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, requiredBytes);
+	PKEY_FILTER_DATA filterData;
+	DWORD bytesReturned = 0;
+	ULONG error;
+
+	if (!buffer)
+		return FALSE;
+	buffer[0] = FilterRequest->FilterMode;
+	buffer[1] = FilterRequest->FilterCount;
+	filterData = (PKEY_FILTER_DATA)&buffer[2];
+	for (USHORT i = 0; i < FilterRequest->FilterCount; i++)
+		filterData[i] = FilterRequest->FilterData[i];
+	error = Transport.IoControl(Transport.Context, Driver, IOCTL_KEYBOARD_SET_FILTER,
+		buffer, requiredBytes, NULL, 0, &bytesReturned, NULL);
+	HeapFree(processHeap, 0, buffer);
+	return error == ERROR_SUCCESS;
+}
+
+static BOOL GetFilteringBefore(PKEY_FILTER_REQUEST FilterBuffer)
+{
+	HANDLE processHeap = GetProcessHeap();
+	DWORD requiredBytes = 2 * sizeof(USHORT) + FilterBuffer->FilterCount * sizeof(KEY_FILTER_DATA);
+	PUSHORT buffer = (PUSHORT)HeapAlloc(processHeap, HEAP_ZERO_MEMORY, requiredBytes);
+	PKEY_FILTER_DATA filterData;
+	DWORD bytesReturned = 0;
+	USHORT filterCount;
+
+	if (!buffer)
+		return FALSE;
+	if (Transport.IoControl(Transport.Context, Driver, IOCTL_KEYBOARD_GET_FILTER,
+		NULL, 0, buffer, requiredBytes, &bytesReturned, NULL) != ERROR_SUCCESS || bytesReturned < 2 * sizeof(USHORT)) {
+		HeapFree(processHeap, 0, buffer);
+		return FALSE;
+	}
+	FilterBuffer->FilterMode = buffer[0];
+	FilterBuffer->FilterCount = buffer[1];
+	filterCount = (USHORT)((bytesReturned - 2 * sizeof(USHORT)) / sizeof(KEY_FILTER_DATA));
+	filterData = (PKEY_FILTER_DATA)&buffer[2];
+	for (USHORT i = 0; i < filterCount; i++)
+		FilterBuffer->FilterData[i] = filterData[i];
+	HeapFree(processHeap, 0, buffer);
+	return TRUE;
+}
+
+static void Report(const char* Name, USHORT FilterCount, LONG64 Nanoseconds, LONG64 Allocations)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "%s, %u filters", Name, FilterCount);
+	EmuBenchReport(name, CALLS, Nanoseconds);
+	printf("%-48s %12.2f allocations/op\n", "", (double)Allocations / CALLS);
+}
+
+static void RunSet(USHORT FilterCount, BOOLEAN Before)
+{
+	KEY_FILTER_REQUEST filterRequest = { FILTER_KEY_FLAG_AND_SCANCODE, FilterCount, Filters };
+	LONG64 allocations;
+	LONG64 start;
+
+	//the first call grows the scratch buffers to the table
+	EmuBenchSink += Before ? SetFilteringBefore(&filterRequest) : KeyboardSetKeyFiltering(Driver, &filterRequest);
+	allocations = ShimHeapAllocations;
+	start = EmuBenchNow();
+	for (ULONG i = 0; i < CALLS; i++)
+		EmuBenchSink += Before ? SetFilteringBefore(&filterRequest) : KeyboardSetKeyFiltering(Driver, &filterRequest);
+	Report(Before ? "before, set" : "after, set", FilterCount, EmuBenchNow() - start, ShimHeapAllocations - allocations);
+}
+
+static void RunGet(USHORT FilterCount, BOOLEAN Before)
+{
+	KEY_FILTER_REQUEST filterRequest = { FILTER_KEY_FLAG_AND_SCANCODE, FilterCount, Filters };
+	KEY_FILTER_REQUEST readRequest;
+	LONG64 allocations;
+	LONG64 start;
+
+	KeyboardSetKeyFiltering(Driver, &filterRequest);
+	readRequest.FilterCount = FilterCount;
+	readRequest.FilterData = ReadFilters;
+	EmuBenchSink += Before ? GetFilteringBefore(&readRequest) : KeyboardGetKeyFiltering(Driver, &readRequest);
+	allocations = ShimHeapAllocations;
+	start = EmuBenchNow();
+	for (ULONG i = 0; i < CALLS; i++)
+	{
+		readRequest.FilterCount = FilterCount;
+		EmuBenchSink += Before ? GetFilteringBefore(&readRequest) : KeyboardGetKeyFiltering(Driver, &readRequest);
+	}
+	Report(Before ? "before, get" : "after, get", FilterCount, EmuBenchNow() - start, ShimHeapAllocations - allocations);
+}
+
+static void RunAddRemove(USHORT FilterCount)
+{
+	KEY_FILTER_REQUEST filterRequest = { FILTER_KEY_FLAG_AND_SCANCODE, FilterCount, Filters };
+	KEY_FILTER_DATA extra = { FLAG_KEY_PRESS, 0xFF };
+	LONG64 allocations;
+	LONG64 start;
+
+	KeyboardSetKeyFiltering(Driver, &filterRequest);
+	KeyboardAddKeyFiltering(Driver, &extra);
+	KeyboardRemoveKeyFiltering(Driver, &extra);
+	allocations = ShimHeapAllocations;
+	start = EmuBenchNow();
+	for (ULONG i = 0; i < CALLS; i++)
+	{
+		EmuBenchSink += KeyboardAddKeyFiltering(Driver, &extra);
+		EmuBenchSink += KeyboardRemoveKeyFiltering(Driver, &extra);
+	}
+	Report("after, add and remove", FilterCount, EmuBenchNow() - start, ShimHeapAllocations - allocations);
+}
+
+int main(void)
+{
+	static const USHORT filterCounts[] = { 8, 64, MAX_FILTERS };
+	PEMU_HOST host = EmuHostCreate();
+
+	EmuHostTransport(host, EMU_HOST_KEYBOARD, &Transport);
+	KeyboardSetTransport(&Transport);
+	EmuHostAddDevice(host, EMU_HOST_KEYBOARD, "ACPI\\PNP0303\\4&1d401fb5&0");
+	Driver = CreateDriverHandle();
+	for (USHORT i = 0; i < MAX_FILTERS; i++)
+	{
+		Filters[i].FlagPredicates = (USHORT)(1 + (i & 1));
+		Filters[i].ScanCode = (USHORT)(i >> 1);
+	}
+
+	for (ULONG c = 0; c < ARRAYSIZE(filterCounts); c++)
+	{
+		RunSet(filterCounts[c], TRUE);
+		RunSet(filterCounts[c], FALSE);
+		RunGet(filterCounts[c], TRUE);
+		RunGet(filterCounts[c], FALSE);
+		RunAddRemove(filterCounts[c]);
+	}
+
+	DisposeHandle(Driver);
+	EmuHostDestroy(host);
+	return 0;
+}
@@ -0,0 +1,191 @@
+/*++
+
+Module Name:
+
+	ServiceCallbackBenchmark.c
+
+Abstract:
+
+	Times the keyboard service callback of keyboardEmu.c with one thread
+	per device calling at full speed, before and after the detect check
+	was moved off the control extension spinlock. Every call runs the
+	real stages of KeyPipeline.c on a batch of four packets, tracks the
+	physical key state, and takes the spinlock of its own device around
+	the stages, like the driver.
+
+	Before: every callback took the control extension spinlock, shared by
+	all devices, to read and clear InputRequired.
+
+	After: a plain load of DetectState, exchanged only while a detect
+	request waits.
+
+	The threads stand in for processors serving different devices, on a
+	machine with fewer processors than threads they share counters anyway.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include <pthread.h>
+
+#include "EmuBench.h"
+#include "InputState.h"
+#include "KeyPipeline.h"
+
+#define CALLBACKS 2000000
+#define MAX_THREADS 16
+#define BATCH 4
+
+#define DETECT_ARMED 1
+#define DETECT_BUSY 2
+
+//
+//What keyboardEmu.c keeps in the filter extension of each device
+//
+typedef struct _BENCH_DEVICE {
+	volatile LONG SpinLock __attribute__((aligned(64)));
+	KEY_PIPELINE Pipeline;
+	PEMU_STATS Stats;
+	PVOID StatsBlock;
+	ULONG Handle;
+	BOOLEAN Before;
+} BENCH_DEVICE;
+
+static KEY_FILTER_DATA FilterData[] = {
+	//caps lock presses and releases are filtered
+	{ 3, 0x3A },
+};
+static KEY_MODIFY_DATA ModifyData[] = {
+	//A turns into S
+	{ 3, 0x1E, 0x1F },
+};
+static const KEYBOARD_INPUT_DATA Batch[BATCH] = {
+	{ 0, 0x1E, KEY_MAKE, 0, 0 },
+	{ 0, 0x1E, KEY_BREAK, 0, 0 },
+	{ 0, 0x3A, KEY_MAKE, 0, 0 },
+	{ 0, 0x3A, KEY_BREAK, 0, 0 },
+};
+
+static EMU_INPUT_STATE KeyboardInputState;
+static BENCH_DEVICE Devices[MAX_THREADS];
+
+//
+//Control extension fields, each on its own line like in the real extension
+//
+static volatile LONG ControlSpinLock __attribute__((aligned(64)));
+static volatile BOOLEAN InputRequired __attribute__((aligned(64)));
+static volatile LONG DetectState __attribute__((aligned(64)));
+
+static volatile LONG StartFlag;
+
+static void AcquireSpinLock(volatile LONG* Lock)
+{
+	while (__atomic_exchange_n(Lock, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(Lock, __ATOMIC_RELAXED))
+			;
+}
+
+static void ReleaseSpinLock(volatile LONG* Lock)
+{
+	__atomic_store_n(Lock, 0, __ATOMIC_RELEASE);
+}
+
+static void ServiceCallback(BENCH_DEVICE* Device, ULONG Processor, PKEYBOARD_INPUT_DATA Inputs, ULONG InputCount, PULONG Consumed)
+{
+	KEY_PIPELINE_CONTEXT context = { Device->Stats, Processor, NULL, NULL, NULL, NULL, Device->Handle };
+	PKEY_PIPELINE pipeline = &Device->Pipeline;
+	BOOLEAN inputRequired = FALSE;
+	LONG armed = DETECT_ARMED;
+
+	if (Device->Before) {
+		AcquireSpinLock(&ControlSpinLock);
+		inputRequired = InputRequired;
+		InputRequired = FALSE;
+		ReleaseSpinLock(&ControlSpinLock);
+	}
+	//ReadNoFence and InterlockedCompareExchange in the driver
+	else if (__atomic_load_n(&DetectState, __ATOMIC_RELAXED) == DETECT_ARMED &&
+		__atomic_compare_exchange_n(&DetectState, &armed, DETECT_BUSY, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		inputRequired = TRUE;
+	EmuBenchSink += inputRequired;
+
+	for (ULONG i = 0; i < InputCount; i++)
+		EmuTrackKey(&KeyboardInputState, Inputs[i].MakeCode, Inputs[i].Flags);
+	EmuStatsAdd(Device->Stats, Processor, EMU_STAT_SEEN, InputCount);
+
+	AcquireSpinLock(&Device->SpinLock);
+	if (pipeline->ProfileHotkeysSet)
+		KeyPipelineHotkeys(pipeline, Inputs, &InputCount, Consumed);
+	if (InputCount > 0)
+		KeyPipelineFilter(pipeline, pipeline->ActiveProfile, &context, Inputs, &InputCount, Consumed);
+	ReleaseSpinLock(&Device->SpinLock);
+	EmuBenchSink += InputCount;
+}
+
+static void* RunDevice(void* Context)
+{
+	BENCH_DEVICE* device = (BENCH_DEVICE*)Context;
+	ULONG processor = (ULONG)(device - Devices);
+	KEYBOARD_INPUT_DATA inputs[BATCH];
+	ULONG consumed = 0;
+
+	while (!__atomic_load_n(&StartFlag, __ATOMIC_ACQUIRE))
+		;
+	for (ULONG i = 0; i < CALLBACKS; i++)
+	{
+		//the stages remove filtered packets in place
+		memcpy(inputs, Batch, sizeof(Batch));
+		ServiceCallback(device, processor, inputs, BATCH, &consumed);
+	}
+	EmuBenchSink += consumed;
+	return NULL;
+}
+
+static void RunCase(const char* Case, BOOLEAN Before, ULONG Threads)
+{
+	pthread_t threads[MAX_THREADS];
+	char name[64];
+	LONG64 start;
+
+	for (ULONG i = 0; i < Threads; i++)
+	{
+		BENCH_DEVICE* device = &Devices[i];
+
+		memset(device, 0, sizeof(BENCH_DEVICE));
+		device->Handle = i + 1;
+		device->Before = Before;
+		device->StatsBlock = malloc(EmuStatsSize(MAX_THREADS, 0));
+		device->Stats = EmuStatsInitialize(device->StatsBlock, MAX_THREADS, 0);
+		device->Pipeline.Profiles[0].FilterRequest.FilterMode = FILTER_KEY_FLAG_AND_SCANCODE;
+		device->Pipeline.Profiles[0].FilterRequest.FilterCount = sizeof(FilterData) / sizeof(FilterData[0]);
+		device->Pipeline.Profiles[0].FilterRequest.FilterData = FilterData;
+		device->Pipeline.Profiles[0].ModifyRequest.ModifyCount = sizeof(ModifyData) / sizeof(ModifyData[0]);
+		device->Pipeline.Profiles[0].ModifyRequest.ModifyData = ModifyData;
+	}
+
+	StartFlag = 0;
+	for (ULONG i = 0; i < Threads; i++)
+		pthread_create(&threads[i], NULL, RunDevice, &Devices[i]);
+	start = EmuBenchNow();
+	InterlockedExchange(&StartFlag, 1);
+	for (ULONG i = 0; i < Threads; i++)
+		pthread_join(threads[i], NULL);
+
+	//time per callback as one device sees it
+	snprintf(name, sizeof(name), "%s, %u devices", Case, Threads);
+	EmuBenchReport(name, CALLBACKS, EmuBenchNow() - start);
+
+	for (ULONG i = 0; i < Threads; i++)
+		free(Devices[i].StatsBlock);
+}
+
+int main(void)
+{
+	for (ULONG threads = 1; threads <= 8; threads *= 2)
+		RunCase("before, control spinlock", TRUE, threads);
+	for (ULONG threads = 1; threads <= 8; threads *= 2)
+		RunCase("after, DetectState load", FALSE, threads);
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*++
+
+Module Name:
+
+	SharedLinkBenchmark.c
+
+Abstract:
+
+	Measures the per packet shared state the service callbacks touch, with
+	one thread per device calling at full speed, before and after the
+	service callback was moved off shared counters.
+
+	Before: every callback took the control extension spinlock to read and
+	clear InputRequired, and took the single counter rundown reference on
+	the peer block whether the peer was loaded or not.
+
+	After: a plain load of DetectState, and the cache aware rundown
+	reference of SharedLink.c, skipped while no peer is loaded.
+
+	The threads stand in for processors serving different devices, on a
+	machine with fewer processors than threads they share counters anyway.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include <pthread.h>
+
+#include <ntddk.h>
+#include "EmuBench.h"
+#include "SharedLink.h"
+
+#define CALLBACKS 2000000
+#define MAX_THREADS 16
+
+#define DETECT_ARMED 1
+#define DETECT_BUSY 2
+
+typedef struct _BENCH_CASE {
+	const char* Name;
+	BOOLEAN Before;
+	BOOLEAN Peer;
+} BENCH_CASE;
+
+static EMU_INPUT_STATE KeyboardState;
+static EMU_INPUT_STATE MouseState;
+static EMU_SHARED_LINK KeyboardLink;
+static EMU_SHARED_LINK MouseLink;
+
+//
+//Control extension fields, each on its own line like in the real extension
+//
+static volatile LONG SpinLock __attribute__((aligned(64)));
+static volatile BOOLEAN InputRequired __attribute__((aligned(64)));
+static volatile LONG DetectState __attribute__((aligned(64)));
+
+static const BENCH_CASE* CurrentCase;
+static volatile LONG StartFlag;
+
+static PEMU_INPUT_STATE AcquirePeerBefore(PEMU_SHARED_LINK Link)
+{
+	PEMU_INPUT_STATE peerState;
+
+	if (!ExAcquireRundownProtectionCacheAware(Link->PeerRundown))
+		return NULL;
+	peerState = Link->PeerState;
+	if (peerState == NULL)
+		ExReleaseRundownProtectionCacheAware(Link->PeerRundown);
+	return peerState;
+}
+
+static void ServiceCallback(BOOLEAN Before)
+{
+	PEMU_INPUT_STATE peer;
+	BOOLEAN inputRequired = FALSE;
+
+	if (Before) {
+		while (__atomic_exchange_n(&SpinLock, 1, __ATOMIC_ACQUIRE))
+			while (ReadNoFence(&SpinLock))
+				;
+		inputRequired = InputRequired;
+		InputRequired = FALSE;
+		__atomic_store_n(&SpinLock, 0, __ATOMIC_RELEASE);
+		peer = AcquirePeerBefore(&KeyboardLink);
+	}
+	else {
+		if (ReadNoFence(&DetectState) == DETECT_ARMED &&
+			InterlockedCompareExchange(&DetectState, DETECT_BUSY, DETECT_ARMED) == DETECT_ARMED)
+			inputRequired = TRUE;
+		peer = EmuLinkAcquirePeer(&KeyboardLink);
+	}
+	if (peer != NULL) {
+		EmuBenchSink += peer->ButtonsDown;
+		EmuLinkReleasePeer(&KeyboardLink);
+	}
+	EmuBenchSink += inputRequired;
+}
+
+static void* RunDevice(void* Context)
+{
+	(void)Context;
+	while (!ReadNoFence(&StartFlag))
+		;
+	for (ULONG i = 0; i < CALLBACKS; i++)
+		ServiceCallback(CurrentCase->Before);
+	return NULL;
+}
+
+static void RunCase(const BENCH_CASE* Case, ULONG Threads)
+{
+	pthread_t threads[MAX_THREADS];
+	char name[64];
+	LONG64 start;
+
+	//before used a single counter rundown reference
+	ShimRundownShards = Case->Before ? 1 : 0;
+	EmuLinkOpen(&KeyboardLink, EMU_LINK_ROLE_KEYBOARD, &KeyboardState);
+	if (Case->Peer)
+		EmuLinkOpen(&MouseLink, EMU_LINK_ROLE_MOUSE, &MouseState);
+
+	CurrentCase = Case;
+	StartFlag = 0;
+	for (ULONG i = 0; i < Threads; i++)
+		pthread_create(&threads[i], NULL, RunDevice, NULL);
+	start = EmuBenchNow();
+	InterlockedExchange(&StartFlag, 1);
+	for (ULONG i = 0; i < Threads; i++)
+		pthread_join(threads[i], NULL);
+
+	//time per callback as one device sees it
+	snprintf(name, sizeof(name), "%s, %u devices", Case->Name, Threads);
+	EmuBenchReport(name, CALLBACKS, EmuBenchNow() - start);
+
+	if (Case->Peer)
+		EmuLinkClose(&MouseLink);
+	EmuLinkClose(&KeyboardLink);
+}
+
+int main(void)
+{
+	static const BENCH_CASE cases[] = {
+		{ "before, no peer", TRUE, FALSE },
+		{ "after, no peer", FALSE, FALSE },
+		{ "before, peer loaded", TRUE, TRUE },
+		{ "after, peer loaded", FALSE, TRUE },
+	};
+
+	for (ULONG c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+	{
+		for (ULONG threads = 1; threads <= 8; threads *= 2)
+			RunCase(&cases[c], threads);
+	}
+	return 0;
+}
@@ -0,0 +1,162 @@
+/*++
+
+Module Name:
+
+	SharedLinkTest.c
+
+Abstract:
+
+	Runs the cross driver link of SharedLink.c over the user mode kernel
+	stand-in: a lone driver has no peer, the second driver to load gets
+	the block of the first one through the announce reply, a driver that
+	unloads waits for the readers of its block, and readers racing a peer
+	that loads and unloads never see a withdrawn block.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include <ntddk.h>
+#include "EmuTest.h"
+#include "SharedLink.h"
+
+//
+//Written into a block once its driver unloaded, a reader must never see it
+//
+#define WITHDRAWN_MARK 0x5EAD
+
+static EMU_INPUT_STATE KeyboardState;
+static EMU_INPUT_STATE MouseState;
+static EMU_SHARED_LINK KeyboardLink;
+static EMU_SHARED_LINK MouseLink;
+
+static volatile LONG MouseClosed;
+static volatile LONG StopReaders;
+
+static void SleepMilliseconds(long Milliseconds)
+{
+	struct timespec delay = { 0, Milliseconds * 1000000 };
+
+	nanosleep(&delay, NULL);
+}
+
+static void TestOpen(void)
+{
+	EMU_CHECK_EQUAL(EmuLinkOpen(&KeyboardLink, EMU_LINK_ROLE_KEYBOARD, &KeyboardState), STATUS_SUCCESS);
+	EMU_CHECK(EmuLinkAcquirePeer(&KeyboardLink) == NULL);
+
+	//the keyboard replies to the announce of the mouse with its own block
+	EMU_CHECK_EQUAL(EmuLinkOpen(&MouseLink, EMU_LINK_ROLE_MOUSE, &MouseState), STATUS_SUCCESS);
+	EMU_CHECK(EmuLinkAcquirePeer(&MouseLink) == &KeyboardState);
+	EmuLinkReleasePeer(&MouseLink);
+	EMU_CHECK(EmuLinkAcquirePeer(&KeyboardLink) == &MouseState);
+	EmuLinkReleasePeer(&KeyboardLink);
+}
+
+static void* CloseMouse(void* Context)
+{
+	(void)Context;
+	EmuLinkClose(&MouseLink);
+	InterlockedExchange(&MouseClosed, 1);
+	return NULL;
+}
+
+static void TestCloseWaitsForReaders(void)
+{
+	pthread_t thread;
+
+	//a keyboard service callback reads the mouse block while the mouse unloads
+	MouseClosed = 0;
+	EMU_CHECK(EmuLinkAcquirePeer(&KeyboardLink) == &MouseState);
+	pthread_create(&thread, NULL, CloseMouse, NULL);
+	SleepMilliseconds(50);
+	EMU_CHECK_EQUAL(MouseClosed, 0);
+	//new readers are turned away while the unload waits
+	EMU_CHECK(EmuLinkAcquirePeer(&KeyboardLink) == NULL);
+	EmuLinkReleasePeer(&KeyboardLink);
+	pthread_join(thread, NULL);
+	EMU_CHECK_EQUAL(MouseClosed, 1);
+	EMU_CHECK(EmuLinkAcquirePeer(&KeyboardLink) == NULL);
+
+	//the mouse loads again, readers are let back in
+	EMU_CHECK_EQUAL(EmuLinkOpen(&MouseLink, EMU_LINK_ROLE_MOUSE, &MouseState), STATUS_SUCCESS);
+	EMU_CHECK(EmuLinkAcquirePeer(&KeyboardLink) == &MouseState);
+	EmuLinkReleasePeer(&KeyboardLink);
+}
+
+static void* ReadPeer(void* Context)
+{
+	LONG64* reads = (LONG64*)Context;
+	PEMU_INPUT_STATE peer;
+
+	while (!StopReaders)
+	{
+		peer = EmuLinkAcquirePeer(&KeyboardLink);
+		if (peer == NULL) {
+			sched_yield();
+			continue;
+		}
+		if (peer != &MouseState || peer->ButtonsDown == WITHDRAWN_MARK) {
+			printf("read a withdrawn peer block\n");
+			EmuTestFailures++;
+		}
+		EmuLinkReleasePeer(&KeyboardLink);
+		//let the unloading thread run on machines with few processors
+		if ((++*reads & 0x3FF) == 0)
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void TestRacingReaders(ULONG Readers, ULONG Cycles)
+{
+	pthread_t threads[8];
+	LONG64 reads[8] = { 0 };
+	LONG64 total = 0;
+
+	StopReaders = 0;
+	for (ULONG i = 0; i < Readers; i++)
+		pthread_create(&threads[i], NULL, ReadPeer, &reads[i]);
+	for (ULONG cycle = 0; cycle < Cycles; cycle++)
+	{
+		sched_yield();
+		EmuLinkClose(&MouseLink);
+		//the unload returned, nobody may read the block anymore
+		MouseState.ButtonsDown = WITHDRAWN_MARK;
+		sched_yield();
+		MouseState.ButtonsDown = 0;
+		EMU_CHECK_EQUAL(EmuLinkOpen(&MouseLink, EMU_LINK_ROLE_MOUSE, &MouseState), STATUS_SUCCESS);
+	}
+	InterlockedExchange(&StopReaders, 1);
+	for (ULONG i = 0; i < Readers; i++)
+	{
+		pthread_join(threads[i], NULL);
+		total += reads[i];
+	}
+	EMU_CHECK(total > 0);
+	printf("%u readers: %lld reads over %u unloads\n", Readers, (long long)total, Cycles);
+}
+
+int main(void)
+{
+	TestOpen();
+	TestCloseWaitsForReaders();
+	TestRacingReaders(4, 2000);
+
+	//single counter rundown references, the kind the link used before
+	EmuLinkClose(&MouseLink);
+	EmuLinkClose(&KeyboardLink);
+	ShimRundownShards = 1;
+	TestOpen();
+	TestCloseWaitsForReaders();
+	TestRacingReaders(4, 2000);
+	EmuLinkClose(&MouseLink);
+	EmuLinkClose(&KeyboardLink);
+	return EMU_TEST_RESULT();
+}
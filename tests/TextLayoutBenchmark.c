@@ -0,0 +1,94 @@
+/*++
+
+Module Name:
+
+	TextLayoutBenchmark.c
+
+Abstract:
+
+	Compiles a megabyte of English-like text with the US table of
+	TextLayout.h, from UTF-16 and from UTF-8, into buffers of a few sizes.
+	The buffer of a single insert and one holding the whole text show what
+	stopping and restarting at buffer ends costs. Throughput is given in
+	characters per second.
+
+--*/
+
+#include "EmuBench.h"
+#include "TextLayout.h"
+
+#define CHARACTERS 0x100000
+#define ROUNDS 10
+
+static USHORT Text[CHARACTERS];
+static UCHAR Utf8[CHARACTERS];
+static KEYBOARD_INPUT_DATA Inputs[CHARACTERS * EMU_TEXT_MAX_INPUTS];
+
+static void Report(const char* Encoding, ULONG Capacity, ULONG64 Packets, LONG64 Nanoseconds)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "%s into %u packets", Encoding, Capacity);
+	printf("%-48s %12.1f Mchars/s %6.2f packets/char\n", name,
+		(double)CHARACTERS * ROUNDS * 1000.0 / (double)Nanoseconds, (double)Packets / ((double)CHARACTERS * ROUNDS));
+}
+
+int main(void)
+{
+	static const char* words[] = { "the", "Quick", "brown", "fox", "jumps", "over", "THE", "lazy", "dog,", "42", "times!\r\n" };
+	static const ULONG capacities[] = { 64, 1024, CHARACTERS * EMU_TEXT_MAX_INPUTS };
+	EMU_LAYOUT_KEY keys[EMU_LAYOUT_US_CHARS];
+	EMU_LAYOUT layout;
+	ULONG64 state = 1;
+	ULONG length = 0;
+
+	EmuLayoutUs(keys, &layout);
+	while (length < CHARACTERS)
+	{
+		const char* word;
+
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		for (word = words[state % (sizeof(words) / sizeof(words[0]))]; *word && length < CHARACTERS; word++)
+			Text[length++] = (UCHAR)*word;
+		if (length < CHARACTERS)
+			Text[length++] = ' ';
+	}
+	for (ULONG i = 0; i < CHARACTERS; i++)
+		Utf8[i] = (UCHAR)Text[i];
+
+	for (ULONG c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++)
+	{
+		ULONG64 packets = 0;
+		LONG64 start = EmuBenchNow();
+
+		for (ULONG round = 0; round < ROUNDS; round++)
+		{
+			for (ULONG used = 0; used < CHARACTERS;)
+			{
+				ULONG count;
+
+				used += EmuCompileTextUtf16(&layout, Text + used, CHARACTERS - used, Inputs, capacities[c], &count, NULL);
+				packets += count;
+			}
+		}
+		Report("UTF-16", capacities[c], packets, EmuBenchNow() - start);
+
+		packets = 0;
+		start = EmuBenchNow();
+		for (ULONG round = 0; round < ROUNDS; round++)
+		{
+			for (ULONG used = 0; used < CHARACTERS;)
+			{
+				ULONG count;
+
+				used += EmuCompileTextUtf8(&layout, Utf8 + used, CHARACTERS - used, Inputs, capacities[c], &count, NULL);
+				packets += count;
+			}
+		}
+		Report("UTF-8", capacities[c], packets, EmuBenchNow() - start);
+		EmuBenchSink = Inputs[0].MakeCode;
+	}
+	return 0;
+}
@@ -0,0 +1,487 @@
+/*++
+
+Module Name:
+
+	TextLayoutTest.c
+
+Abstract:
+
+	Compiles text with TextLayout.h and types the packets back on a model
+	keyboard that tracks the modifiers held, checking the text comes out
+	as it went in. Covers the US table, a full UTF-16 table with E0 keys
+	and keys taking control and alt, modifier runs, line ends, surrogates,
+	the UTF-8 decoder, and text compiled into buffers of every size.
+
+--*/
+
+#include "EmuTest.h"
+#include "TextLayout.h"
+
+#define TEXT_LENGTH 4096
+
+static EMU_LAYOUT_KEY UsKeys[EMU_LAYOUT_US_CHARS];
+static EMU_LAYOUT_KEY WideKeys[EMU_LAYOUT_MAX_CHARS];
+static EMU_LAYOUT Us;
+static EMU_LAYOUT Wide;
+
+//
+//First character of the layout typed by a key and its flags, by [Flags][ScanCode]
+//
+static ULONG Typed[256][256];
+
+static const UCHAR ModifierScanCodes[3] = { 0x2A, 0x1D, 0x38 };
+
+static void IndexLayout(const EMU_LAYOUT* Layout)
+{
+	for (ULONG flags = 0; flags < 256; flags++)
+		for (ULONG scanCode = 0; scanCode < 256; scanCode++)
+			Typed[flags][scanCode] = EMU_TEXT_INVALID;
+	for (ULONG c = Layout->Count; c-- > 0;)
+	{
+		if (Layout->Keys[c].ScanCode != 0)
+			Typed[Layout->Keys[c].Flags][Layout->Keys[c].ScanCode] = c;
+	}
+}
+
+//
+//The character a layout types for one, EMU_TEXT_INVALID if it has no key
+//
+static ULONG Canonical(const EMU_LAYOUT* Layout, ULONG Character)
+{
+	const EMU_LAYOUT_KEY* key = EmuLayoutFind(Layout, Character);
+
+	return key ? Typed[key->Flags][key->ScanCode] : EMU_TEXT_INVALID;
+}
+
+//
+//The US table and a table of the whole UTF-16 range holding it, with keys
+//for a few accented letters, some taking control and alt like AltGr does,
+//Cyrillic and arrows behind the E0 prefix
+//
+static void BuildLayouts(void)
+{
+	EmuLayoutUs(UsKeys, &Us);
+
+	memcpy(WideKeys, UsKeys, sizeof(UsKeys));
+	WideKeys[0x00E9].ScanCode = 0x12;
+	WideKeys[0x00E9].Flags = EMU_LAYOUT_CTRL | EMU_LAYOUT_ALT;
+	WideKeys[0x00C9].ScanCode = 0x12;
+	WideKeys[0x00C9].Flags = EMU_LAYOUT_SHIFT | EMU_LAYOUT_CTRL | EMU_LAYOUT_ALT;
+	WideKeys[0x20AC].ScanCode = 0x06;
+	WideKeys[0x20AC].Flags = EMU_LAYOUT_CTRL | EMU_LAYOUT_ALT;
+	WideKeys[0x00E4].ScanCode = 0x28;
+	WideKeys[0x00E4].Flags = EMU_LAYOUT_ALT;
+	for (ULONG i = 0; i < 0x30; i++)
+	{
+		WideKeys[0x0430 + i].ScanCode = (UCHAR)(0x10 + i);
+		WideKeys[0x0410 + i].ScanCode = (UCHAR)(0x10 + i);
+		WideKeys[0x0410 + i].Flags = EMU_LAYOUT_SHIFT;
+	}
+	WideKeys[0x2190].ScanCode = 0x4B;
+	WideKeys[0x2190].Flags = EMU_LAYOUT_E0;
+	WideKeys[0x2192].ScanCode = 0x4D;
+	WideKeys[0x2192].Flags = EMU_LAYOUT_E0;
+	WideKeys[0x21D2].ScanCode = 0x4D;
+	WideKeys[0x21D2].Flags = EMU_LAYOUT_E0 | EMU_LAYOUT_SHIFT;
+	Wide.Keys = WideKeys;
+	Wide.Count = EMU_LAYOUT_MAX_CHARS;
+}
+
+static ULONG64 Next(PULONG64 State)
+{
+	*State ^= *State << 13;
+	*State ^= *State >> 7;
+	*State ^= *State << 17;
+	return *State;
+}
+
+//
+//Text drawing from every case the compiler tells apart
+//
+static void RandomText(PUSHORT Text, ULONG Length, ULONG64 Seed)
+{
+	static const USHORT wide[] = { 0x00E9, 0x00C9, 0x20AC, 0x00E4, 0x0414, 0x0434, 0x2190, 0x2192, 0x21D2, 0x4E2D, 0x00FF };
+	ULONG64 state = Seed;
+
+	for (ULONG i = 0; i < Length; i++)
+	{
+		ULONG64 r = Next(&state);
+
+		switch (r % 16)
+		{
+		case 0:
+			Text[i] = wide[(r >> 8) % (sizeof(wide) / sizeof(wide[0]))];
+			break;
+		case 1:
+			if (i + 1 < Length) {
+				Text[i++] = (USHORT)(0xD800 + (r >> 8) % 0x400);
+				Text[i] = (USHORT)(0xDC00 + (r >> 20) % 0x400);
+			}
+			else {
+				Text[i] = (USHORT)(0xDC00 + (r >> 8) % 0x400);
+			}
+			break;
+		case 2:
+			Text[i] = (USHORT)(0xD800 + (r >> 8) % 0x800);
+			break;
+		case 3:
+			Text[i] = (r >> 8) & 1 ? '\r' : '\n';
+			break;
+		case 4:
+			Text[i] = (USHORT)((r >> 8) % 0x20);
+			break;
+		default:
+			Text[i] = (USHORT)(0x20 + (r >> 8) % 0x5F);
+			break;
+		}
+	}
+}
+
+//
+//What typing a text gives on a layout, each character as its canonical one
+//
+static ULONG ExpectedText(const EMU_LAYOUT* Layout, const USHORT* Text, ULONG Length, PULONG Output, PULONG Skipped)
+{
+	ULONG count = 0;
+
+	*Skipped = 0;
+	for (ULONG i = 0; i < Length; i++)
+	{
+		ULONG character = Text[i];
+
+		if (character >= 0xD800 && character <= 0xDBFF && i + 1 < Length && Text[i + 1] >= 0xDC00 && Text[i + 1] <= 0xDFFF) {
+			i++;
+			character = EMU_TEXT_INVALID;
+		}
+		else if (character >= 0xD800 && character <= 0xDFFF) {
+			character = EMU_TEXT_INVALID;
+		}
+		else if (character == '\r' && i + 1 < Length && Text[i + 1] == '\n') {
+			i++;
+		}
+		character = character == EMU_TEXT_INVALID ? EMU_TEXT_INVALID : Canonical(Layout, character);
+		if (character == EMU_TEXT_INVALID)
+			(*Skipped)++;
+		else
+			Output[count++] = character;
+	}
+	return count;
+}
+
+//
+//Types the packets of one buffer on a keyboard starting with no modifiers
+//held and appends the characters. Every buffer must press keys with the
+//modifiers of their character held, release each key right after it is
+//pressed, and end with all modifiers released.
+//
+static BOOLEAN TypePackets(const KEYBOARD_INPUT_DATA* Inputs, ULONG Count, PULONG Output, PULONG Length)
+{
+	UCHAR held = 0;
+
+	for (ULONG i = 0; i < Count; i++)
+	{
+		ULONG modifier;
+		ULONG character;
+		USHORT e0 = Inputs[i].Flags & KEY_E0;
+
+		if ((Inputs[i].Flags & ~(KEY_BREAK | KEY_E0)) != 0 || Inputs[i].UnitId != 0 || Inputs[i].ExtraInformation != 0)
+			return FALSE;
+		for (modifier = 0; modifier < 3 && ModifierScanCodes[modifier] != Inputs[i].MakeCode; modifier++)
+			;
+		if (modifier < 3) {
+			if (e0 || ((Inputs[i].Flags & KEY_BREAK) != 0) != ((held >> modifier) & 1))
+				return FALSE;
+			held ^= (UCHAR)(1 << modifier);
+			continue;
+		}
+		if ((Inputs[i].Flags & KEY_BREAK) || i + 1 == Count || Inputs[i + 1].MakeCode != Inputs[i].MakeCode ||
+			Inputs[i + 1].Flags != (KEY_BREAK | e0))
+			return FALSE;
+		character = Typed[held | (e0 ? EMU_LAYOUT_E0 : 0)][Inputs[i].MakeCode];
+		if (character == EMU_TEXT_INVALID)
+			return FALSE;
+		Output[(*Length)++] = character;
+		i++;
+	}
+	return held == 0;
+}
+
+//
+//UTF-8 of UTF-16 text, a byte that never decodes for a lone surrogate
+//
+static ULONG ToUtf8(const USHORT* Text, ULONG Length, PUCHAR Output)
+{
+	ULONG size = 0;
+
+	for (ULONG i = 0; i < Length; i++)
+	{
+		ULONG character = Text[i];
+
+		if (character >= 0xD800 && character <= 0xDBFF && i + 1 < Length && Text[i + 1] >= 0xDC00 && Text[i + 1] <= 0xDFFF) {
+			character = 0x10000 + ((character - 0xD800) << 10) + (Text[++i] - 0xDC00);
+		}
+		else if (character >= 0xD800 && character <= 0xDFFF) {
+			Output[size++] = 0xFF;
+			continue;
+		}
+
+		if (character < 0x80) {
+			Output[size++] = (UCHAR)character;
+		}
+		else if (character < 0x800) {
+			Output[size++] = (UCHAR)(0xC0 | (character >> 6));
+			Output[size++] = (UCHAR)(0x80 | (character & 0x3F));
+		}
+		else if (character < 0x10000) {
+			Output[size++] = (UCHAR)(0xE0 | (character >> 12));
+			Output[size++] = (UCHAR)(0x80 | ((character >> 6) & 0x3F));
+			Output[size++] = (UCHAR)(0x80 | (character & 0x3F));
+		}
+		else {
+			Output[size++] = (UCHAR)(0xF0 | (character >> 18));
+			Output[size++] = (UCHAR)(0x80 | ((character >> 12) & 0x3F));
+			Output[size++] = (UCHAR)(0x80 | ((character >> 6) & 0x3F));
+			Output[size++] = (UCHAR)(0x80 | (character & 0x3F));
+		}
+	}
+	return size;
+}
+
+static void TestUsTable(void)
+{
+	static const char plain[] = "`1234567890-=qwertyuiop[]\\asdfghjkl;'zxcvbnm,./ \t\b\n\r";
+	static const char shifted[] = "~!@#$%^&*()_+QWERTYUIOP{}|ASDFGHJKL:\"ZXCVBNM<>?";
+	ULONG mapped = 0;
+
+	for (ULONG i = 0; plain[i]; i++)
+	{
+		EMU_CHECK(UsKeys[(UCHAR)plain[i]].ScanCode != 0);
+		EMU_CHECK_EQUAL(UsKeys[(UCHAR)plain[i]].Flags, 0);
+	}
+	for (ULONG i = 0; shifted[i]; i++)
+	{
+		EMU_CHECK(UsKeys[(UCHAR)shifted[i]].ScanCode != 0);
+		EMU_CHECK_EQUAL(UsKeys[(UCHAR)shifted[i]].Flags, EMU_LAYOUT_SHIFT);
+	}
+	for (ULONG c = 0; c < EMU_LAYOUT_US_CHARS; c++)
+		mapped += UsKeys[c].ScanCode != 0;
+	//the printable range and four control characters
+	EMU_CHECK_EQUAL(mapped, 0x7F - 0x20 + 4);
+	EMU_CHECK_EQUAL(UsKeys['a'].ScanCode, 0x1E);
+	EMU_CHECK_EQUAL(UsKeys['A'].ScanCode, 0x1E);
+	EMU_CHECK_EQUAL(UsKeys['1'].ScanCode, 0x02);
+	EMU_CHECK_EQUAL(UsKeys['!'].ScanCode, 0x02);
+	EMU_CHECK_EQUAL(UsKeys['z'].ScanCode, 0x2C);
+	EMU_CHECK_EQUAL(UsKeys['/'].ScanCode, 0x35);
+	EMU_CHECK_EQUAL(UsKeys['`'].ScanCode, 0x29);
+	EMU_CHECK_EQUAL(UsKeys['\\'].ScanCode, 0x2B);
+	EMU_CHECK_EQUAL(UsKeys[' '].ScanCode, 0x39);
+	EMU_CHECK_EQUAL(UsKeys['\n'].ScanCode, 0x1C);
+	EMU_CHECK_EQUAL(UsKeys['\r'].ScanCode, 0x1C);
+	EMU_CHECK_EQUAL(UsKeys[0x7F].ScanCode, 0);
+	EMU_CHECK(EmuLayoutFind(&Us, 0x80) == NULL);
+	EMU_CHECK(EmuLayoutFind(&Us, 0x0001) == NULL);
+}
+
+static void TestPackets(void)
+{
+	static const USHORT caps[] = { 'A', 'B', 'C' };
+	static const USHORT mixed[] = { 'a', 'B', 'c', 0x00E9, 0x00C9, 0x2192, 0x21D2 };
+	static const struct {
+		USHORT MakeCode;
+		USHORT Flags;
+	} expected[] = {
+		{ 0x1E, KEY_MAKE }, { 0x1E, KEY_BREAK },
+		{ 0x2A, KEY_MAKE }, { 0x30, KEY_MAKE }, { 0x30, KEY_BREAK }, { 0x2A, KEY_BREAK },
+		{ 0x2E, KEY_MAKE }, { 0x2E, KEY_BREAK },
+		{ 0x1D, KEY_MAKE }, { 0x38, KEY_MAKE }, { 0x12, KEY_MAKE }, { 0x12, KEY_BREAK },
+		{ 0x2A, KEY_MAKE }, { 0x12, KEY_MAKE }, { 0x12, KEY_BREAK },
+		{ 0x2A, KEY_BREAK }, { 0x1D, KEY_BREAK }, { 0x38, KEY_BREAK }, { 0x4D, KEY_MAKE | KEY_E0 }, { 0x4D, KEY_BREAK | KEY_E0 },
+		{ 0x2A, KEY_MAKE }, { 0x4D, KEY_MAKE | KEY_E0 }, { 0x4D, KEY_BREAK | KEY_E0 }, { 0x2A, KEY_BREAK }
+	};
+	static const USHORT crlf[] = { 'a', '\r', '\n', '\r', 'b', '\n' };
+	static const USHORT surrogates[] = { 0xD83D, 0xDE00, 'x', 0xDC00, 0xD800 };
+	KEYBOARD_INPUT_DATA inputs[64];
+	ULONG count;
+	ULONG skipped;
+
+	IndexLayout(&Wide);
+
+	//a run of capitals takes one shift press
+	EMU_CHECK_EQUAL(EmuCompileTextUtf16(&Us, caps, 3, inputs, 64, &count, &skipped), 3);
+	EMU_CHECK_EQUAL(count, 8);
+	EMU_CHECK_EQUAL(skipped, 0);
+	EMU_CHECK_EQUAL(inputs[0].MakeCode, 0x2A);
+	EMU_CHECK_EQUAL(inputs[7].MakeCode, 0x2A);
+	EMU_CHECK_EQUAL(inputs[7].Flags, KEY_BREAK);
+
+	//modifiers change between keys, shift comes back for the last two
+	EMU_CHECK_EQUAL(EmuCompileTextUtf16(&Wide, mixed, 7, inputs, 64, &count, NULL), 7);
+	EMU_CHECK_EQUAL(count, sizeof(expected) / sizeof(expected[0]));
+	for (ULONG i = 0; i < count && i < sizeof(expected) / sizeof(expected[0]); i++)
+	{
+		EMU_CHECK_EQUAL(inputs[i].MakeCode, expected[i].MakeCode);
+		EMU_CHECK_EQUAL(inputs[i].Flags, expected[i].Flags);
+	}
+
+	//a carriage return and line feed type one return, lone ones a return each
+	EMU_CHECK_EQUAL(EmuCompileTextUtf16(&Us, crlf, 6, inputs, 64, &count, &skipped), 6);
+	EMU_CHECK_EQUAL(count, 10);
+	EMU_CHECK_EQUAL(inputs[2].MakeCode, 0x1C);
+	EMU_CHECK_EQUAL(inputs[4].MakeCode, 0x1C);
+	EMU_CHECK_EQUAL(inputs[8].MakeCode, 0x1C);
+
+	//a surrogate pair is one skipped character, lone surrogates one each
+	EMU_CHECK_EQUAL(EmuCompileTextUtf16(&Wide, surrogates, 5, inputs, 64, &count, &skipped), 5);
+	EMU_CHECK_EQUAL(count, 2);
+	EMU_CHECK_EQUAL(skipped, 3);
+
+	//characters past the end of the table are skipped
+	EMU_CHECK_EQUAL(EmuCompileTextUtf16(&Us, mixed, 7, inputs, 64, &count, &skipped), 7);
+	EMU_CHECK_EQUAL(skipped, 4);
+
+	//a key and the releases after it must fit
+	EMU_CHECK_EQUAL(EmuCompileTextUtf16(&Us, caps, 3, inputs, 3, &count, NULL), 0);
+	EMU_CHECK_EQUAL(count, 0);
+	EMU_CHECK_EQUAL(EmuCompileTextUtf16(&Us, caps, 3, inputs, 4, &count, NULL), 1);
+	EMU_CHECK_EQUAL(count, 4);
+	EMU_CHECK_EQUAL(EmuCompileTextUtf16(&Wide, mixed + 4, 1, inputs, 7, &count, NULL), 0);
+	EMU_CHECK_EQUAL(EmuCompileTextUtf16(&Wide, mixed + 4, 1, inputs, EMU_TEXT_MAX_INPUTS, &count, NULL), 1);
+	EMU_CHECK_EQUAL(count, EMU_TEXT_MAX_INPUTS);
+}
+
+static void TestUtf8Decoder(void)
+{
+	static const struct {
+		UCHAR Bytes[4];
+		ULONG Length;
+		ULONG Character;
+		ULONG Units;
+	} cases[] = {
+		{ { 0x41 }, 1, 0x41, 1 },
+		{ { 0xC3, 0xA9 }, 2, 0xE9, 2 },
+		{ { 0xE2, 0x82, 0xAC }, 3, 0x20AC, 3 },
+		{ { 0xF0, 0x9F, 0x98, 0x80 }, 4, 0x1F600, 4 },
+		{ { 0xF4, 0x8F, 0xBF, 0xBF }, 4, 0x10FFFF, 4 },
+		{ { 0xEF, 0xBF, 0xBF }, 3, 0xFFFF, 3 },
+		//overlong forms
+		{ { 0xC0, 0x80 }, 2, EMU_TEXT_INVALID, 1 },
+		{ { 0xC1, 0xBF }, 2, EMU_TEXT_INVALID, 1 },
+		{ { 0xE0, 0x80, 0x80 }, 3, EMU_TEXT_INVALID, 1 },
+		{ { 0xF0, 0x80, 0x80, 0x80 }, 4, EMU_TEXT_INVALID, 1 },
+		//surrogates and past U+10FFFF
+		{ { 0xED, 0xA0, 0x80 }, 3, EMU_TEXT_INVALID, 1 },
+		{ { 0xED, 0xBF, 0xBF }, 3, EMU_TEXT_INVALID, 1 },
+		{ { 0xF4, 0x90, 0x80, 0x80 }, 4, EMU_TEXT_INVALID, 1 },
+		{ { 0xF5, 0x80, 0x80, 0x80 }, 4, EMU_TEXT_INVALID, 1 },
+		//continuation bytes, cut short or missing
+		{ { 0x80 }, 1, EMU_TEXT_INVALID, 1 },
+		{ { 0xBF }, 1, EMU_TEXT_INVALID, 1 },
+		{ { 0xE2, 0x82 }, 2, EMU_TEXT_INVALID, 1 },
+		{ { 0xE2, 0x41, 0xAC }, 3, EMU_TEXT_INVALID, 1 },
+		{ { 0xFF }, 1, EMU_TEXT_INVALID, 1 }
+	};
+	static const UCHAR text[] = { 'a', 0xC3, 0xA9, 0xE2, 0x82, 'b', 0xF0, 0x9F, 0x98, 0x80, '\r', '\n' };
+	KEYBOARD_INPUT_DATA inputs[64];
+	ULONG count;
+	ULONG skipped;
+
+	for (ULONG i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		ULONG units = 0;
+
+		EMU_CHECK_EQUAL(EmuTextDecodeUtf8(cases[i].Bytes, cases[i].Length, &units), cases[i].Character);
+		EMU_CHECK_EQUAL(units, cases[i].Units);
+	}
+
+	//a, e acute, two stray bytes, b, an emoji, a return
+	EMU_CHECK_EQUAL(EmuCompileTextUtf8(&Wide, text, sizeof(text), inputs, 64, &count, &skipped), sizeof(text));
+	EMU_CHECK_EQUAL(skipped, 3);
+	EMU_CHECK_EQUAL(count, 2 + 6 + 2 + 2);
+}
+
+//
+//Compiles text into buffers of one capacity, types each buffer on its own
+//and checks the whole text comes out
+//
+static void CheckSlices(const char* Name, const EMU_LAYOUT* Layout, const USHORT* Text, const UCHAR* Utf8, ULONG Length,
+	ULONG Utf8Length, ULONG Capacity, const ULONG* Expected, ULONG ExpectedLength, ULONG ExpectedSkipped)
+{
+	static KEYBOARD_INPUT_DATA inputs[TEXT_LENGTH * EMU_TEXT_MAX_INPUTS];
+	static KEYBOARD_INPUT_DATA inputs8[TEXT_LENGTH * EMU_TEXT_MAX_INPUTS];
+	static ULONG typed[TEXT_LENGTH];
+	ULONG length = 0;
+	ULONG used = 0;
+	ULONG used8 = 0;
+	ULONG skipped = 0;
+	BOOLEAN failed = FALSE;
+
+	while (used < Length && !failed)
+	{
+		ULONG count;
+		ULONG count8;
+		ULONG skippedNow;
+		ULONG skipped8;
+		ULONG consumed = EmuCompileTextUtf16(Layout, Text + used, Length - used, inputs, Capacity, &count, &skippedNow);
+		ULONG consumed8 = EmuCompileTextUtf8(Layout, Utf8 + used8, Utf8Length - used8, inputs8, Capacity, &count8, &skipped8);
+
+		//both encodings stop before the same character
+		if (count > Capacity || consumed == 0 || count != count8 || skippedNow != skipped8 ||
+			memcmp(inputs, inputs8, count * sizeof(KEYBOARD_INPUT_DATA)) != 0 ||
+			!TypePackets(inputs, count, typed, &length))
+			failed = TRUE;
+		used += consumed;
+		used8 += consumed8;
+		skipped += skippedNow;
+	}
+	if (failed || used != Length || used8 != Utf8Length || length != ExpectedLength || skipped != ExpectedSkipped ||
+		memcmp(typed, Expected, length * sizeof(ULONG)) != 0) {
+		printf("%s: text typed wrong into buffers of %u packets\n", Name, Capacity);
+		EmuTestFailures++;
+	}
+}
+
+static void TestText(const char* Name, const EMU_LAYOUT* Layout, ULONG64 Seed)
+{
+	static USHORT text[TEXT_LENGTH];
+	static UCHAR utf8[TEXT_LENGTH * 3];
+	static ULONG expected[TEXT_LENGTH];
+	ULONG utf8Length;
+	ULONG expectedLength;
+	ULONG skipped;
+
+	IndexLayout(Layout);
+	RandomText(text, TEXT_LENGTH, Seed);
+	utf8Length = ToUtf8(text, TEXT_LENGTH, utf8);
+	expectedLength = ExpectedText(Layout, text, TEXT_LENGTH, expected, &skipped);
+	EMU_CHECK(expectedLength > TEXT_LENGTH / 2);
+	EMU_CHECK(skipped > 0);
+
+	//every buffer a character fits in, and one holding the whole text
+	for (ULONG capacity = EMU_TEXT_MAX_INPUTS; capacity <= 64; capacity++)
+		CheckSlices(Name, Layout, text, utf8, TEXT_LENGTH, utf8Length, capacity, expected, expectedLength, skipped);
+	CheckSlices(Name, Layout, text, utf8, TEXT_LENGTH, utf8Length, 1000, expected, expectedLength, skipped);
+	CheckSlices(Name, Layout, text, utf8, TEXT_LENGTH, utf8Length, TEXT_LENGTH * EMU_TEXT_MAX_INPUTS,
+		expected, expectedLength, skipped);
+
+	//a buffer of EMU_TEXT_MAX_INPUTS per character holds the whole text in one call
+	{
+		static KEYBOARD_INPUT_DATA inputs[TEXT_LENGTH * EMU_TEXT_MAX_INPUTS];
+		ULONG count;
+
+		EMU_CHECK_EQUAL(EmuCompileTextUtf16(Layout, text, TEXT_LENGTH, inputs, TEXT_LENGTH * EMU_TEXT_MAX_INPUTS, &count, NULL),
+			TEXT_LENGTH);
+	}
+}
+
+int main(void)
+{
+	BuildLayouts();
+	TestUsTable();
+	TestPackets();
+	TestUtf8Decoder();
+	TestText("US", &Us, 1);
+	TestText("wide", &Wide, 2);
+	TestText("wide", &Wide, 3);
+	return EMU_TEST_RESULT();
+}
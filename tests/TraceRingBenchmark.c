@@ -0,0 +1,46 @@
+/*++
+
+Module Name:
+
+	TraceRingBenchmark.c
+
+Abstract:
+
+	Times a trace point the way the drivers place them in the service
+	callbacks: disabled, which is the one branch on TraceEnabled, and
+	enabled, writing a record into the ring drained every 512 records.
+
+--*/
+
+#include "EmuBench.h"
+#include "TraceRing.h"
+
+#define POINTS 100000000
+
+static EMU_TRACE_RING Ring;
+static volatile LONG TraceEnabled;
+static UCHAR DrainBuffer[sizeof(EMU_TRACE_CHUNK) + EMU_TRACE_CAPACITY * sizeof(EMU_TRACE_RECORD)];
+
+static void RunPoints(const char* Name)
+{
+	LONG64 start = EmuBenchNow();
+
+	for (ULONG i = 0; i < POINTS; i++)
+	{
+		if (__atomic_load_n(&TraceEnabled, __ATOMIC_RELAXED))
+			EmuTraceWrite(&Ring, i, EMU_TRACE_INPUT, 1, i);
+		if ((i & 511) == 511)
+			EmuBenchSink += EmuTraceDrain(&Ring, 0, DrainBuffer, sizeof(DrainBuffer));
+	}
+	EmuBenchReport(Name, POINTS, EmuBenchNow() - start);
+}
+
+int main(void)
+{
+	TraceEnabled = 0;
+	RunPoints("trace point, disabled");
+	TraceEnabled = 1;
+	RunPoints("trace point, enabled and drained");
+	EmuBenchSink += Ring.Lost;
+	return 0;
+}
@@ -0,0 +1,270 @@
+/*++
+
+Module Name:
+
+	TraceRingTest.c
+
+Abstract:
+
+	Round trips records of the per processor trace rings of TraceRing.h
+	through a dump and its decoder: order and content per processor, lost
+	records on a full ring, drains into small buffers and across the end
+	of the ring, dumps that are truncated or damaged, and a writer thread
+	racing the drain.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "EmuTest.h"
+#include "TraceRing.h"
+
+#define PROCESSORS 3
+#define FREQUENCY 10000000
+
+static EMU_TRACE_RING Rings[PROCESSORS];
+
+//
+//Records carry their sequence so the decoded ones can be checked
+//
+static void WriteSequence(PEMU_TRACE_RING Ring, ULONG Processor, ULONG Sequence)
+{
+	EmuTraceWrite(Ring, (LONG64)Sequence * 16 + Processor,
+		(USHORT)(1 + Sequence % (EMU_TRACE_EVENT_COUNT - 1)), (USHORT)Processor, Sequence);
+}
+
+static BOOLEAN RecordMatches(const EMU_TRACE_RECORD* Record, ULONG Processor)
+{
+	ULONG sequence = Record->Arg1;
+
+	return Record->Time == (LONG64)sequence * 16 + Processor &&
+		Record->Event == 1 + sequence % (EMU_TRACE_EVENT_COUNT - 1) &&
+		Record->Arg0 == Processor;
+}
+
+static ULONG DumpAll(PUCHAR Buffer, ULONG Size)
+{
+	ULONG used = EmuTraceBeginDump(Buffer, FREQUENCY);
+
+	for (ULONG p = 0; p < PROCESSORS; p++)
+		used += EmuTraceDrain(&Rings[p], p, Buffer + used, Size - used);
+	return used;
+}
+
+static void TestRoundTrip(void)
+{
+	ULONG size = sizeof(EMU_TRACE_DUMP) + PROCESSORS * (sizeof(EMU_TRACE_CHUNK) + EMU_TRACE_CAPACITY * sizeof(EMU_TRACE_RECORD));
+	PUCHAR dump = (PUCHAR)malloc(size);
+	EMU_TRACE_CURSOR cursor;
+	EMU_TRACE_RECORD record;
+	LONG64 frequency;
+	ULONG next[PROCESSORS] = { 0 };
+	ULONG used;
+
+	RtlZeroMemory(Rings, sizeof(Rings));
+	for (ULONG p = 0; p < PROCESSORS; p++)
+	{
+		for (ULONG i = 0; i < 100 * (p + 1); i++)
+			WriteSequence(&Rings[p], p, i);
+	}
+	used = DumpAll(dump, size);
+	EMU_CHECK_EQUAL(used, sizeof(EMU_TRACE_DUMP) + PROCESSORS * sizeof(EMU_TRACE_CHUNK) + 600 * sizeof(EMU_TRACE_RECORD));
+
+	EMU_CHECK(EmuTraceOpen(&cursor, dump, used, &frequency));
+	EMU_CHECK_EQUAL(frequency, FREQUENCY);
+	while (EmuTraceNext(&cursor, &record))
+	{
+		ULONG p = cursor.Chunk.Processor;
+
+		EMU_CHECK(p < PROCESSORS);
+		if (p >= PROCESSORS)
+			break;
+		EMU_CHECK_EQUAL(record.Arg1, next[p]);
+		EMU_CHECK(RecordMatches(&record, p));
+		EMU_CHECK_EQUAL(cursor.Chunk.Lost, 0);
+		next[p]++;
+	}
+	for (ULONG p = 0; p < PROCESSORS; p++)
+		EMU_CHECK_EQUAL(next[p], 100 * (p + 1));
+
+	//drained rings have nothing more to report
+	EMU_CHECK_EQUAL(DumpAll(dump, size), sizeof(EMU_TRACE_DUMP));
+	free(dump);
+}
+
+static void TestLost(void)
+{
+	UCHAR buffer[sizeof(EMU_TRACE_CHUNK) + 4 * sizeof(EMU_TRACE_RECORD)];
+	PEMU_TRACE_CHUNK chunk = (PEMU_TRACE_CHUNK)buffer;
+	PEMU_TRACE_RECORD records = (PEMU_TRACE_RECORD)(chunk + 1);
+
+	RtlZeroMemory(Rings, sizeof(Rings));
+	for (ULONG i = 0; i < EMU_TRACE_CAPACITY + 5; i++)
+		WriteSequence(&Rings[0], 0, i);
+	EMU_CHECK_EQUAL(Rings[0].Lost, 5);
+
+	//the first drain reports the loss, the next ones only records
+	EMU_CHECK_EQUAL(EmuTraceDrain(&Rings[0], 0, buffer, sizeof(buffer)), sizeof(buffer));
+	EMU_CHECK_EQUAL(chunk->Count, 4);
+	EMU_CHECK_EQUAL(chunk->Lost, 5);
+	EMU_CHECK_EQUAL(records[0].Arg1, 0);
+	EMU_CHECK_EQUAL(records[3].Arg1, 3);
+	EMU_CHECK_EQUAL(EmuTraceDrain(&Rings[0], 0, buffer, sizeof(buffer)), sizeof(buffer));
+	EMU_CHECK_EQUAL(chunk->Lost, 0);
+	EMU_CHECK_EQUAL(records[0].Arg1, 4);
+
+	//no room for a chunk, or for a record with nothing lost to report
+	EMU_CHECK_EQUAL(EmuTraceDrain(&Rings[0], 0, buffer, sizeof(EMU_TRACE_CHUNK) - 1), 0);
+	EMU_CHECK_EQUAL(EmuTraceDrain(&Rings[0], 0, buffer, sizeof(EMU_TRACE_CHUNK) + sizeof(EMU_TRACE_RECORD) - 1), 0);
+
+	//the drained slots take new records again, which wrap around the end of the ring
+	for (ULONG i = 0; i < 8; i++)
+		WriteSequence(&Rings[0], 0, 5000 + i);
+	EMU_CHECK_EQUAL(Rings[0].Lost, 5);
+	for (ULONG i = 8; i < EMU_TRACE_CAPACITY; i++)
+	{
+		EMU_CHECK_EQUAL(EmuTraceDrain(&Rings[0], 0, buffer, sizeof(EMU_TRACE_CHUNK) + sizeof(EMU_TRACE_RECORD)),
+			sizeof(EMU_TRACE_CHUNK) + sizeof(EMU_TRACE_RECORD));
+		EMU_CHECK_EQUAL(records[0].Arg1, i);
+	}
+	EMU_CHECK_EQUAL(EmuTraceDrain(&Rings[0], 0, buffer, sizeof(buffer)), sizeof(buffer));
+	EMU_CHECK_EQUAL(records[0].Arg1, 5000);
+	EMU_CHECK_EQUAL(records[3].Arg1, 5003);
+}
+
+static void TestDamagedDumps(void)
+{
+	ULONG size = sizeof(EMU_TRACE_DUMP) + PROCESSORS * (sizeof(EMU_TRACE_CHUNK) + 40 * sizeof(EMU_TRACE_RECORD));
+	PUCHAR dump = (PUCHAR)malloc(size);
+	PUCHAR copy;
+	EMU_TRACE_CURSOR cursor;
+	EMU_TRACE_RECORD record;
+	LONG64 frequency;
+	ULONG used;
+
+	RtlZeroMemory(Rings, sizeof(Rings));
+	for (ULONG p = 0; p < PROCESSORS; p++)
+	{
+		for (ULONG i = 0; i < 40; i++)
+			WriteSequence(&Rings[p], p, i);
+	}
+	used = DumpAll(dump, size);
+
+	//a truncated dump yields the complete chunks before the cut and nothing past it
+	for (ULONG length = 0; length <= used; length++)
+	{
+		ULONG whole = 0;
+		ULONG decoded = 0;
+
+		//exact copies so reading past the end shows up under a sanitizer
+		copy = (PUCHAR)malloc(length == 0 ? 1 : length);
+		memcpy(copy, dump, length);
+		if (length < sizeof(EMU_TRACE_DUMP)) {
+			EMU_CHECK(!EmuTraceOpen(&cursor, copy, length, &frequency));
+			free(copy);
+			continue;
+		}
+		EMU_CHECK(EmuTraceOpen(&cursor, copy, length, &frequency));
+		while (EmuTraceNext(&cursor, &record))
+		{
+			EMU_CHECK(RecordMatches(&record, cursor.Chunk.Processor));
+			decoded++;
+		}
+		for (ULONG p = 0; p < PROCESSORS; p++)
+		{
+			if (length >= sizeof(EMU_TRACE_DUMP) + (p + 1) * (sizeof(EMU_TRACE_CHUNK) + 40 * sizeof(EMU_TRACE_RECORD)))
+				whole += 40;
+		}
+		EMU_CHECK_EQUAL(decoded, whole);
+		free(copy);
+	}
+
+	//a chunk claiming more records than follow ends the decoding
+	((PEMU_TRACE_CHUNK)(dump + sizeof(EMU_TRACE_DUMP)))->Count = 0xFFFFFFFF;
+	EMU_CHECK(EmuTraceOpen(&cursor, dump, used, &frequency));
+	EMU_CHECK(!EmuTraceNext(&cursor, &record));
+	EMU_CHECK(!EmuTraceNext(&cursor, &record));
+
+	((PEMU_TRACE_DUMP)dump)->Version++;
+	EMU_CHECK(!EmuTraceOpen(&cursor, dump, used, &frequency));
+	((PEMU_TRACE_DUMP)dump)->Version--;
+	((PEMU_TRACE_DUMP)dump)->Magic ^= 1;
+	EMU_CHECK(!EmuTraceOpen(&cursor, dump, used, &frequency));
+	free(dump);
+
+	EMU_CHECK(strcmp(EmuTraceEventName(EMU_TRACE_INJECT), "inject") == 0);
+	EMU_CHECK(strcmp(EmuTraceEventName(EMU_TRACE_EVENT_COUNT), "unknown") == 0);
+}
+
+#define RACE_RECORDS 1000000
+
+static volatile LONG WriterDone;
+
+static void* WriteRace(void* Context)
+{
+	(void)Context;
+	for (ULONG i = 0; i < RACE_RECORDS; i++)
+	{
+		WriteSequence(&Rings[1], 1, i);
+		//let the drain run on machines with few processors
+		if ((i & 0x3FF) == 0)
+			sched_yield();
+	}
+	__atomic_store_n(&WriterDone, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void TestRacingDrain(void)
+{
+	ULONG size = sizeof(EMU_TRACE_CHUNK) + 300 * sizeof(EMU_TRACE_RECORD);
+	PUCHAR buffer = (PUCHAR)malloc(size);
+	PEMU_TRACE_CHUNK chunk = (PEMU_TRACE_CHUNK)buffer;
+	PEMU_TRACE_RECORD records = (PEMU_TRACE_RECORD)(chunk + 1);
+	pthread_t thread;
+	ULONG64 read = 0;
+	ULONG64 lost = 0;
+	LONG64 previous = -1;
+	BOOLEAN done;
+
+	RtlZeroMemory(Rings, sizeof(Rings));
+	WriterDone = 0;
+	pthread_create(&thread, NULL, WriteRace, NULL);
+	do {
+		done = (BOOLEAN)__atomic_load_n(&WriterDone, __ATOMIC_ACQUIRE);
+		while (EmuTraceDrain(&Rings[1], 1, buffer, size) != 0)
+		{
+			lost += chunk->Lost;
+			for (ULONG i = 0; i < chunk->Count; i++)
+			{
+				if (!RecordMatches(&records[i], 1) || (LONG64)records[i].Arg1 <= previous) {
+					printf("record %u drained torn or out of order after %lld\n", records[i].Arg1, (long long)previous);
+					EmuTestFailures++;
+					done = TRUE;
+					break;
+				}
+				previous = records[i].Arg1;
+			}
+			read += chunk->Count;
+		}
+	} while (!done);
+	pthread_join(thread, NULL);
+
+	//every record was either drained or counted as lost
+	EMU_CHECK_EQUAL(read + lost, RACE_RECORDS);
+	printf("%llu of %u records drained, %llu lost\n", (unsigned long long)read, RACE_RECORDS, (unsigned long long)lost);
+	free(buffer);
+}
+
+int main(void)
+{
+	TestRoundTrip();
+	TestLost();
+	TestDamagedDumps();
+	TestRacingDrain();
+	return EMU_TEST_RESULT();
+}
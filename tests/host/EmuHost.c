@@ -0,0 +1,1550 @@
+/*++
+
+Module Name:
+
+	EmuHost.c
+
+Abstract:
+
+	Control device routines the keyboard and mouse hosts share, the
+	transport the native APIs reach them through, device arrival and
+	removal, the virtual clock and the mock class service.
+
+	A request that stays pending is queued like in the manual queues of
+	the drivers. Sent with an OVERLAPPED on a handle opened for it, the
+	transport returns ERROR_IO_PENDING and the request completes through
+	its overlapped, otherwise the caller blocks in the transport until
+	the request completes as it would in DeviceIoControl.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+//memfd_create is not POSIX
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "HostClass.h"
+
+//
+//Insert delayed by the insert latency, dispatched by the insert thread at Due
+//
+typedef struct _HOST_INSERT {
+	struct _HOST_INSERT* Next;
+	PHOST_SESSION Session;
+	ULONG IoControlCode;
+	LPOVERLAPPED Overlapped;
+	struct timespec Due;
+	ULONG InputSize;
+	UCHAR Input[];
+} HOST_INSERT, * PHOST_INSERT;
+
+static VOID HostAddTime(struct timespec* Time, ULONG Microseconds)
+{
+	Time->tv_sec += Microseconds / 1000000;
+	Time->tv_nsec += (long)(Microseconds % 1000000) * 1000;
+	if (Time->tv_nsec >= 1000000000) {
+		Time->tv_sec++;
+		Time->tv_nsec -= 1000000000;
+	}
+}
+
+static VOID HostSleepUntil(const struct timespec* Due)
+{
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, Due, NULL) == EINTR)
+		;
+}
+
+//
+//Requests
+//
+
+VOID
+HostQueueRequest(
+	IN PHOST_QUEUE Queue,
+	IN PHOST_REQUEST Request)
+{
+	Request->Next = NULL;
+	if (Queue->Tail)
+		Queue->Tail->Next = Request;
+	else
+		Queue->Head = Request;
+	Queue->Tail = Request;
+}
+
+PHOST_REQUEST
+HostDequeueRequest(
+	IN PHOST_QUEUE Queue)
+{
+	PHOST_REQUEST request = Queue->Head;
+
+	if (request) {
+		Queue->Head = request->Next;
+		if (Queue->Head == NULL)
+			Queue->Tail = NULL;
+	}
+	return request;
+}
+
+static VOID HostUnlinkRequest(PHOST_QUEUE Queue, PHOST_REQUEST Request)
+{
+	PHOST_REQUEST previous = NULL;
+
+	for (PHOST_REQUEST request = Queue->Head; request; previous = request, request = request->Next)
+	{
+		if (request != Request)
+			continue;
+		if (previous)
+			previous->Next = request->Next;
+		else
+			Queue->Head = request->Next;
+		if (Queue->Tail == request)
+			Queue->Tail = previous;
+		return;
+	}
+}
+
+static PHOST_REQUEST HostPendRequest(PHOST_QUEUE Queue, PHOST_REQUEST Request)
+/*++
+
+Routine Description:
+
+	Queues a request that stays pending. A request the caller waits for
+	in the transport lives on the stack of the caller, an overlapped one
+	outlives the call and is copied.
+
+Return Value:
+
+	The queued request, NULL if it could not be allocated.
+
+--*/
+{
+	PHOST_REQUEST request = Request;
+
+	if (Request->Overlapped) {
+		request = (PHOST_REQUEST)malloc(sizeof(HOST_REQUEST));
+		if (request == NULL)
+			return NULL;
+		*request = *Request;
+	}
+	HostQueueRequest(Queue, request);
+	return request;
+}
+
+VOID
+HostCompleteRequest(
+	IN PHOST_REQUEST Request,
+	IN NTSTATUS Status,
+	IN ULONG_PTR Information)
+/*++
+
+Routine Description:
+
+	Completes a request taken off its queue.
+
+--*/
+{
+	if (Request->Overlapped) {
+		ShimCompleteOverlapped(Request->Overlapped, Status, Information);
+		free(Request);
+		return;
+	}
+	Request->Status = Status;
+	Request->Information = Information;
+	Request->Completed = TRUE;
+	pthread_cond_broadcast(&Request->Session->Class->Host->Completed);
+}
+
+static VOID HostCancelSessionRequests(PHOST_QUEUE Queue, PHOST_SESSION Session)
+{
+	PHOST_REQUEST request = Queue->Head;
+
+	while (request)
+	{
+		PHOST_REQUEST next = request->Next;
+
+		if (Session == NULL || request->Session == Session) {
+			HostUnlinkRequest(Queue, request);
+			HostCompleteRequest(request, STATUS_CANCELLED, 0);
+		}
+		request = next;
+	}
+}
+
+//
+//Devices
+//
+
+PHOST_DEVICE
+HostReferenceDevice(
+	IN PHOST_CLASS Class,
+	IN ULONG DeviceHandle)
+/*++
+
+Routine Description:
+
+	Finds the device an IOCTL goes to, the first one for EMU_DEVICE_HANDLE_NONE.
+
+Return Value:
+
+	The device, NULL if there is none.
+
+--*/
+{
+	PEMU_DEVICE_ENTRY entry;
+
+	if (DeviceHandle == EMU_DEVICE_HANDLE_NONE)
+		return Class->DeviceCount > 0 ? Class->Devices[0] : NULL;
+	entry = EmuDeviceTableFind(&Class->DeviceTable, DeviceHandle);
+	return entry ? (PHOST_DEVICE)entry->Device : NULL;
+}
+
+USHORT
+HostDeviceIndex(
+	IN PHOST_CLASS Class,
+	IN PHOST_DEVICE Device)
+{
+	for (ULONG i = 0; i < Class->DeviceCount; i++)
+	{
+		if (Class->Devices[i] == Device)
+			return (USHORT)i;
+	}
+	return 0;
+}
+
+ULONG
+HostBumpRuleGeneration(
+	IN PHOST_DEVICE Device)
+{
+	LONG generation = InterlockedIncrement(&Device->RuleGeneration);
+
+	if (generation == 0)
+		generation = InterlockedIncrement(&Device->RuleGeneration);
+	return (ULONG)generation;
+}
+
+VOID
+HostReturnRuleGeneration(
+	OUT PVOID Output,
+	IN ULONG OutputSize,
+	IN ULONG Generation,
+	OUT PULONG_PTR Information)
+/*++
+
+Routine Description:
+
+	ReturnRuleGeneration of the drivers.
+
+--*/
+{
+	if (OutputSize < sizeof(ULONG))
+		return;
+	memcpy(Output, &Generation, sizeof(ULONG));
+	*Information = sizeof(ULONG);
+}
+
+PEMU_RULE
+HostAllocateSharedRules(
+	IN PHOST_CLASS Class,
+	IN USHORT RuleCount)
+/*++
+
+Routine Description:
+
+	AllocateSharedRules of the drivers, with the hit counters behind the
+	rules while the class counts them.
+
+--*/
+{
+	PVOID block;
+	PEMU_RULE rules;
+	ULONG rulesSize;
+	ULONG hitsSize = 0;
+
+	rulesSize = (EmuSharedRulesSize(RuleCount) + sizeof(PVOID) - 1) & ~(ULONG)(sizeof(PVOID) - 1);
+	if (Class->CountRuleHits && RuleCount > 0)
+		hitsSize = EmuStatsSize(HOST_PROCESSORS, RuleCount);
+	block = malloc(rulesSize + hitsSize);
+	if (block == NULL)
+		return NULL;
+	rules = EmuSharedRulesInitialize(block, RuleCount);
+	if (hitsSize != 0)
+		((PEMU_SHARED_RULES)block)->Hits = EmuStatsInitialize((PUCHAR)block + rulesSize, HOST_PROCESSORS, RuleCount);
+	return rules;
+}
+
+VOID
+HostReleaseSharedRules(
+	IN PEMU_RULE Rules)
+{
+	if (Rules && EmuSharedRulesRelease(Rules))
+		free(EmuSharedRulesBlock(Rules));
+}
+
+NTSTATUS
+HostSetDeviceId(
+	IN PHOST_CLASS Class,
+	IN PHOST_SESSION Session,
+	IN PVOID Input,
+	IN ULONG InputSize)
+{
+	USHORT index;
+
+	if (InputSize < sizeof(USHORT))
+		return STATUS_BUFFER_TOO_SMALL;
+	memcpy(&index, Input, sizeof(USHORT));
+	if (Class->DeviceCount == 0) {
+		Session->DeviceHandle = EMU_DEVICE_HANDLE_NONE;
+		return STATUS_INVALID_PARAMETER;
+	}
+	if (index >= Class->DeviceCount)
+		return STATUS_INVALID_PARAMETER;
+	Session->DeviceHandle = Class->Devices[index]->Handle;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+HostGetDeviceId(
+	IN PHOST_CLASS Class,
+	IN PHOST_SESSION Session,
+	OUT PVOID Output,
+	IN ULONG OutputSize,
+	OUT PULONG_PTR Information)
+/*++
+
+Routine Description:
+
+	Returns the index of the device of the handle and the number of
+	devices, a KEYBOARD_QUERY_RESULT or MOUSE_QUERY_RESULT.
+
+--*/
+{
+	PHOST_DEVICE device;
+	USHORT result[2];
+
+	if (OutputSize < sizeof(result))
+		return STATUS_BUFFER_TOO_SMALL;
+	device = HostReferenceDevice(Class, Session->DeviceHandle);
+	result[0] = device ? HostDeviceIndex(Class, device) : 0;
+	result[1] = (USHORT)Class->DeviceCount;
+	memcpy(Output, result, sizeof(result));
+	*Information = sizeof(result);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+HostGetDevices(
+	IN PHOST_CLASS Class,
+	OUT PVOID Output,
+	IN ULONG OutputSize,
+	OUT PULONG_PTR Information)
+/*++
+
+Routine Description:
+
+	Lists the devices as KEY_DEVICE_INFO or MOUSE_DEVICE_INFO, the same
+	{ handle, index, reserved } layout.
+
+--*/
+{
+	struct {
+		ULONG DeviceHandle;
+		USHORT DeviceIndex;
+		USHORT Reserved;
+	} info;
+	ULONG capacity = OutputSize / sizeof(info);
+	ULONG count;
+
+	if (capacity == 0)
+		return STATUS_BUFFER_TOO_SMALL;
+	count = Class->DeviceCount < capacity ? Class->DeviceCount : capacity;
+	for (ULONG i = 0; i < count; i++)
+	{
+		info.DeviceHandle = Class->Devices[i]->Handle;
+		info.DeviceIndex = (USHORT)i;
+		info.Reserved = 0;
+		memcpy((PUCHAR)Output + i * sizeof(info), &info, sizeof(info));
+	}
+	*Information = count * sizeof(info);
+	return count < Class->DeviceCount ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+NTSTATUS
+HostSetDeviceHandle(
+	IN PHOST_CLASS Class,
+	IN PHOST_SESSION Session,
+	IN PVOID Input,
+	IN ULONG InputSize)
+{
+	ULONG deviceHandle;
+
+	if (InputSize < sizeof(ULONG))
+		return STATUS_BUFFER_TOO_SMALL;
+	memcpy(&deviceHandle, Input, sizeof(ULONG));
+	if (deviceHandle != EMU_DEVICE_HANDLE_NONE && HostReferenceDevice(Class, deviceHandle) == NULL)
+		return STATUS_NO_SUCH_DEVICE;
+	Session->DeviceHandle = deviceHandle;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+HostDetectDevice(
+	IN PHOST_CLASS Class,
+	IN PVOID Input,
+	IN ULONG InputSize,
+	IN ULONG OutputSize,
+	IN PHOST_REQUEST Request)
+/*++
+
+Routine Description:
+
+	Queues a detect request until the next input of any device, or until
+	the timeout of its KEY_DETECT_REQUEST or MOUSE_DETECT_REQUEST.
+
+--*/
+{
+	ULONG timeout = 0;
+
+	if (OutputSize < sizeof(USHORT))
+		return STATUS_BUFFER_TOO_SMALL;
+	if (Class->DeviceCount == 0)
+		return STATUS_INVALID_DEVICE_REQUEST;
+	if (InputSize >= sizeof(ULONG))
+		memcpy(&timeout, Input, sizeof(ULONG));
+	Request->Deadline = timeout != 0 ? Class->Host->Now + (LONG64)timeout * 10000 : 0;
+	return HostPendRequest(&Class->DetectQueue, Request) ? STATUS_PENDING : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+static VOID HostCompleteDetect(PHOST_CLASS Class, PHOST_DEVICE Device)
+/*++
+
+Routine Description:
+
+	Completes the waiting detect requests with the device an input came
+	from, which becomes the device of their handles. Output sized for a
+	detect result gets its handle, a USHORT the index of the device.
+
+--*/
+{
+	PHOST_REQUEST request;
+	USHORT index = HostDeviceIndex(Class, Device);
+
+	while ((request = HostDequeueRequest(&Class->DetectQueue)) != NULL)
+	{
+		ULONG_PTR length;
+
+		request->Session->DeviceHandle = Device->Handle;
+		if (request->OutputSize >= sizeof(ULONG)) {
+			memcpy(request->Output, &Device->Handle, sizeof(ULONG));
+			length = sizeof(ULONG);
+		}
+		else {
+			memcpy(request->Output, &index, sizeof(USHORT));
+			length = sizeof(USHORT);
+		}
+		HostCompleteRequest(request, STATUS_SUCCESS, length);
+	}
+}
+
+static PHOST_IMAGE HostFindImage(PHOST_CLASS Class, ULONG DeviceHandle)
+{
+	for (ULONG i = 0; i < EMU_DEVICE_TABLE_SIZE; i++)
+	{
+		if (Class->Images[i].Image != NULL && Class->Images[i].Handle == DeviceHandle)
+			return &Class->Images[i];
+	}
+	return NULL;
+}
+
+NTSTATUS
+HostSaveImage(
+	IN PHOST_CLASS Class,
+	IN PHOST_DEVICE Device)
+/*++
+
+Routine Description:
+
+	Saves the profiles of a device for its handle, it gets them back
+	when it arrives after the host forgot its parked configuration.
+
+--*/
+{
+	PHOST_IMAGE saved;
+	PUCHAR image;
+	ULONG imageSize;
+
+	imageSize = Class->Ops->SerializeProfiles(Device, NULL, 0);
+	if (imageSize == 0 || imageSize > EMU_IMAGE_MAX_SIZE)
+		return STATUS_INVALID_BUFFER_SIZE;
+	image = (PUCHAR)malloc(imageSize);
+	if (image == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	imageSize = Class->Ops->SerializeProfiles(Device, image, imageSize);
+	saved = HostFindImage(Class, Device->Handle);
+	if (saved == NULL)
+		saved = HostFindImage(Class, EMU_DEVICE_HANDLE_NONE);
+	if (saved == NULL) {
+		for (ULONG i = 0; i < EMU_DEVICE_TABLE_SIZE && saved == NULL; i++)
+		{
+			if (Class->Images[i].Image == NULL)
+				saved = &Class->Images[i];
+		}
+	}
+	if (saved == NULL) {
+		free(image);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	free(saved->Image);
+	saved->Handle = Device->Handle;
+	saved->Size = imageSize;
+	saved->Image = image;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+HostBroadcastRules(
+	IN PHOST_CLASS Class,
+	IN PVOID Input,
+	IN ULONG InputSize,
+	IN PHOST_SWAP_RULES SwapRules)
+/*++
+
+Routine Description:
+
+	BroadcastRules of the drivers: installs one shared table in the edit
+	profile of every listed device, all of them or none.
+
+--*/
+{
+	PUCHAR buffer = (PUCHAR)Input;
+	PHOST_DEVICE targets[EMU_DEVICE_TABLE_SIZE];
+	ULONG targetCount = 0;
+	ULONG deviceCount;
+	ULONG offset = sizeof(ULONG);
+	USHORT ruleCount;
+	PEMU_RULE newRules = NULL;
+
+	if (InputSize < sizeof(ULONG) + sizeof(USHORT))
+		return STATUS_BUFFER_TOO_SMALL;
+	memcpy(&deviceCount, buffer, sizeof(ULONG));
+	if (deviceCount != 0xFFFFFFFF) {
+		if (deviceCount == 0 || deviceCount > EMU_DEVICE_TABLE_SIZE)
+			return STATUS_INVALID_PARAMETER;
+		offset += deviceCount * sizeof(ULONG);
+	}
+	if (InputSize < offset + sizeof(USHORT))
+		return STATUS_BUFFER_TOO_SMALL;
+	ruleCount = EmuReadUshort(buffer + offset);
+	offset += sizeof(USHORT);
+	if (InputSize < offset + ruleCount * sizeof(EMU_RULE))
+		return STATUS_BUFFER_TOO_SMALL;
+
+	if (ruleCount > 0) {
+		newRules = HostAllocateSharedRules(Class, ruleCount);
+		if (newRules == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES;
+		memcpy(newRules, buffer + offset, ruleCount * sizeof(EMU_RULE));
+		if (!EmuValidateRules(newRules, ruleCount, EmuSharedRulesIndex(newRules))) {
+			HostReleaseSharedRules(newRules);
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
+
+	if (deviceCount == 0xFFFFFFFF) {
+		for (ULONG i = 0; i < Class->DeviceCount; i++)
+			targets[targetCount++] = Class->Devices[i];
+	}
+	else {
+		for (ULONG i = 0; i < deviceCount; i++)
+		{
+			ULONG deviceHandle;
+
+			memcpy(&deviceHandle, buffer + sizeof(ULONG) + i * sizeof(ULONG), sizeof(ULONG));
+			targets[targetCount] = HostReferenceDevice(Class, deviceHandle);
+			if (deviceHandle == EMU_DEVICE_HANDLE_NONE || targets[targetCount] == NULL) {
+				HostReleaseSharedRules(newRules);
+				return STATUS_NO_SUCH_DEVICE;
+			}
+			targetCount++;
+		}
+	}
+
+	for (ULONG i = 0; i < targetCount; i++)
+	{
+		if (newRules)
+			EmuSharedRulesReference(newRules);
+		HostBumpRuleGeneration(targets[i]);
+		HostReleaseSharedRules(SwapRules(targets[i], newRules, ruleCount));
+	}
+	//the profiles hold their own references now
+	HostReleaseSharedRules(newRules);
+	return STATUS_SUCCESS;
+}
+
+//
+//Capture
+//
+
+static VOID HostCompleteCaptureBatch(PHOST_CLASS Class)
+{
+	PHOST_REQUEST request;
+	ULONG_PTR bytes = (ULONG_PTR)Class->CaptureCount * Class->RecordSize;
+
+	Class->CaptureRequest = NULL;
+	Class->CaptureCapacity = 0;
+	Class->CaptureCount = 0;
+	//a request cancelled meanwhile takes the records of its batch with it
+	request = HostDequeueRequest(&Class->CaptureBatchQueue);
+	if (request == NULL)
+		return;
+	memcpy(request->Output, Class->CaptureRecords, bytes);
+	HostCompleteRequest(request, STATUS_SUCCESS, bytes);
+}
+
+NTSTATUS
+HostSetCapture(
+	IN PHOST_CLASS Class,
+	IN USHORT Sources,
+	IN USHORT Delivery,
+	IN ULONG LatencyMicroseconds)
+/*++
+
+Routine Description:
+
+	Sets what is captured and how it is delivered. Sources and the ring
+	delivery are the same bits for both classes. Turning capture off or
+	over to the ring fails the capture requests still waiting.
+
+--*/
+{
+	PHOST_REQUEST request;
+
+	//KEY_CAPTURE_FILTERED | KEY_CAPTURE_PASSED, KEY_CAPTURE_DELIVERY_RING
+	if ((Sources & ~0x0003) != 0 || Delivery > 1)
+		return STATUS_INVALID_PARAMETER;
+	Class->CaptureSources = Sources;
+	Class->CaptureDelivery = Delivery;
+	Class->CaptureLatency = (LONG64)LatencyMicroseconds * 10;
+	if (Class->CaptureRequest != NULL)
+		HostCompleteCaptureBatch(Class);
+	if (Sources == 0 || Delivery == 1) {
+		while ((request = HostDequeueRequest(&Class->CaptureQueue)) != NULL)
+			HostCompleteRequest(request, STATUS_CANCELLED, 0);
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+HostCapture(
+	IN PHOST_CLASS Class,
+	IN ULONG OutputSize,
+	IN PHOST_REQUEST Request)
+{
+	if (OutputSize < Class->RecordSize)
+		return STATUS_BUFFER_TOO_SMALL;
+	if (Class->CaptureSources == 0 || Class->CaptureDelivery != 0)
+		return STATUS_INVALID_DEVICE_STATE;
+	return HostPendRequest(&Class->CaptureQueue, Request) ? STATUS_PENDING : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+NTSTATUS
+HostMapCaptureRing(
+	IN PHOST_CLASS Class,
+	IN PHOST_SESSION Session,
+	IN HANDLE Event,
+	OUT PULONG64 Address,
+	OUT PULONG Size,
+	OUT PULONG ReaderIndex,
+	OUT PULONG64 WaitAddress)
+/*++
+
+Routine Description:
+
+	MapCaptureRing of the drivers. The host shares the address space of
+	its readers, they are all given the same read-only mapping of the ring
+	and the WaitMask kept apart from it.
+
+--*/
+{
+	ULONG readerIndex = EMU_RING_MAX_READERS;
+	int section;
+
+	for (ULONG r = 0; r < EMU_RING_MAX_READERS; r++)
+	{
+		if (Class->RingReaders[r].Session == Session)
+			return STATUS_ALREADY_REGISTERED;
+		if (Class->RingReaders[r].Session == NULL && readerIndex == EMU_RING_MAX_READERS)
+			readerIndex = r;
+	}
+	if (readerIndex == EMU_RING_MAX_READERS)
+		return STATUS_TOO_MANY_SESSIONS;
+	if (Class->Ring == NULL) {
+		Class->RingSize = EmuRingSize(Class->RecordSize, Class->RingCapacity);
+		section = memfd_create("EmuHostRing", 0);
+		if (section < 0)
+			return STATUS_INSUFFICIENT_RESOURCES;
+		if (ftruncate(section, Class->RingSize) == 0) {
+			Class->Ring = mmap(NULL, Class->RingSize, PROT_READ | PROT_WRITE, MAP_SHARED, section, 0);
+			Class->RingView = mmap(NULL, Class->RingSize, PROT_READ, MAP_SHARED, section, 0);
+		}
+		close(section);
+		if (Class->Ring == NULL || Class->Ring == MAP_FAILED || Class->RingView == NULL || Class->RingView == MAP_FAILED) {
+			if (Class->Ring != NULL && Class->Ring != MAP_FAILED)
+				munmap(Class->Ring, Class->RingSize);
+			if (Class->RingView != NULL && Class->RingView != MAP_FAILED)
+				munmap(Class->RingView, Class->RingSize);
+			Class->Ring = NULL;
+			Class->RingView = NULL;
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		EmuRingInitialize(&Class->CaptureRing, Class->Ring, &Class->RingWait, Class->RecordSize, Class->RingCapacity);
+	}
+	Class->RingReaders[readerIndex].Session = Session;
+	Class->RingReaders[readerIndex].Event = Event;
+	*Address = (ULONG64)(ULONG_PTR)Class->RingView;
+	*Size = Class->RingSize;
+	*ReaderIndex = readerIndex;
+	*WaitAddress = (ULONG64)(ULONG_PTR)&Class->RingWait;
+	return STATUS_SUCCESS;
+}
+
+VOID
+HostUnmapCaptureRing(
+	IN PHOST_CLASS Class,
+	IN PHOST_SESSION Session)
+{
+	for (ULONG r = 0; r < EMU_RING_MAX_READERS; r++)
+	{
+		if (Class->RingReaders[r].Session == Session) {
+			Class->RingReaders[r].Session = NULL;
+			Class->RingReaders[r].Event = NULL;
+			break;
+		}
+	}
+}
+
+VOID
+HostCaptureInputs(
+	IN PHOST_CLASS Class,
+	IN ULONG DeviceHandle,
+	IN USHORT Source,
+	IN const VOID* Inputs,
+	IN ULONG Count)
+/*++
+
+Routine Description:
+
+	CaptureInputs of the drivers, for records of either class: a LONG64
+	timestamp, the ULONG device handle, the USHORT source, a reserved
+	USHORT and the input packet.
+
+--*/
+{
+	UCHAR record[64];
+	PUCHAR target;
+	ULONG i = 0;
+
+	memset(record, 0, sizeof(record));
+	memcpy(record, &Class->Host->Now, sizeof(LONG64));
+	memcpy(record + 8, &DeviceHandle, sizeof(ULONG));
+	memcpy(record + 12, &Source, sizeof(USHORT));
+
+	if (Class->CaptureDelivery == 1) {
+		ULONG waiters;
+
+		if (Class->Ring == NULL)
+			return;
+		for (; i < Count; i++)
+		{
+			memcpy(record + 16, (const UCHAR*)Inputs + i * Class->InputSize, Class->InputSize);
+			EmuRingWrite(&Class->CaptureRing, record);
+		}
+		//only readers that ran dry are woken up, the others are polling
+		waiters = EmuRingTakeWaiters(&Class->CaptureRing);
+		for (ULONG r = 0; waiters != 0; r++, waiters >>= 1)
+		{
+			if ((waiters & 1) && Class->RingReaders[r].Event != NULL)
+				SetEvent(Class->RingReaders[r].Event);
+		}
+		return;
+	}
+
+	while (i < Count)
+	{
+		if (Class->CaptureRequest == NULL) {
+			Class->CaptureRequest = HostDequeueRequest(&Class->CaptureQueue);
+			if (Class->CaptureRequest == NULL)
+				break;	//nobody is listening, the inputs are lost
+			HostQueueRequest(&Class->CaptureBatchQueue, Class->CaptureRequest);
+			Class->CaptureCapacity = Class->CaptureRequest->OutputSize / Class->RecordSize;
+			if (Class->CaptureCapacity > HOST_CAPTURE_BATCH_MAX)
+				Class->CaptureCapacity = HOST_CAPTURE_BATCH_MAX;
+			Class->CaptureCount = 0;
+			Class->CaptureDeadline = Class->Host->Now + Class->CaptureLatency;
+		}
+		target = Class->CaptureRecords + Class->CaptureCount++ * Class->RecordSize;
+		memcpy(record + 16, (const UCHAR*)Inputs + i++ * Class->InputSize, Class->InputSize);
+		memcpy(target, record, Class->RecordSize);
+		if (Class->CaptureCount == Class->CaptureCapacity)
+			HostCompleteCaptureBatch(Class);
+	}
+	//without a latency every input report is delivered right away
+	if (Class->CaptureLatency == 0 && Class->CaptureRequest != NULL)
+		HostCompleteCaptureBatch(Class);
+}
+
+//
+//Latency and trace
+//
+
+LONG64
+HostPerformanceCounter(
+	VOID)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (LONG64)now.tv_sec * HOST_PERFORMANCE_FREQUENCY + now.tv_nsec;
+}
+
+VOID
+HostTraceWrite(
+	IN PVOID Context,
+	IN USHORT Event,
+	IN USHORT Arg0,
+	IN ULONG Arg1)
+/*++
+
+Routine Description:
+
+	WriteTraceRecord of the drivers, the EMU_TRACE_WRITER handed to the
+	pipeline stages with the class as Context.
+
+--*/
+{
+	PHOST_CLASS class = (PHOST_CLASS)Context;
+
+	if (class->TraceEnabled)
+		EmuTraceWrite(class->TraceRing, HostPerformanceCounter(), Event, Arg0, Arg1);
+}
+
+VOID
+HostRecordCallback(
+	IN PHOST_CLASS Class,
+	IN PHOST_DEVICE Device,
+	IN ULONG Dropped,
+	IN LONG64 Start)
+/*++
+
+Routine Description:
+
+	RecordCallbackStats of the drivers: counts the packets a service
+	callback dropped and how long it held the batch.
+
+--*/
+{
+	LONG64 elapsed = HostPerformanceCounter() - Start;
+
+	EmuStatsAdd(Device->Stats, 0, EMU_STAT_DROPPED, Dropped);
+	EmuHistogramRecord(&Device->Histograms[EMU_HIST_CALLBACK], elapsed);
+	HostTraceWrite(Class, EMU_TRACE_DONE, (USHORT)Dropped, (ULONG)elapsed);
+}
+
+NTSTATUS
+HostGetLatency(
+	IN PHOST_DEVICE Device,
+	IN BOOLEAN Reset,
+	OUT PVOID Output,
+	OUT PULONG_PTR Information)
+/*++
+
+Routine Description:
+
+	IOCTL_*_GET_LATENCY of the drivers. Output has the layout of
+	KEY_LATENCY and MOUSE_LATENCY, the Frequency followed by the
+	histograms. A reset moves the base to the snapshot it returns.
+
+--*/
+{
+	LONG64 frequency = HOST_PERFORMANCE_FREQUENCY;
+	EMU_HISTOGRAM histograms[EMU_HIST_COUNT];
+
+	memcpy(histograms, Device->Histograms, sizeof(histograms));
+	for (ULONG k = 0; k < EMU_HIST_COUNT; k++)
+	{
+		EmuHistogramSubtract(&histograms[k], &Device->LatencyBase[k]);
+		if (Reset)
+			EmuHistogramAccumulate(&Device->LatencyBase[k], &histograms[k]);
+	}
+	memcpy(Output, &frequency, sizeof(LONG64));
+	memcpy((PUCHAR)Output + sizeof(LONG64), histograms, sizeof(histograms));
+	*Information = sizeof(LONG64) + sizeof(histograms);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+HostSetTrace(
+	IN PHOST_CLASS Class,
+	IN BOOLEAN Enable)
+/*++
+
+Routine Description:
+
+	IOCTL_*_SET_TRACE of the drivers. The ring is allocated the first time
+	tracing is enabled and kept until the host is destroyed.
+
+--*/
+{
+	if (Enable && Class->TraceRing == NULL) {
+		Class->TraceRing = (PEMU_TRACE_RING)calloc(1, sizeof(EMU_TRACE_RING));
+		if (Class->TraceRing == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	Class->TraceEnabled = Enable;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+HostReadTrace(
+	IN PHOST_CLASS Class,
+	OUT PVOID Output,
+	IN ULONG OutputSize,
+	OUT PULONG_PTR Information)
+/*++
+
+Routine Description:
+
+	IOCTL_*_READ_TRACE of the drivers, drains the ring into a dump.
+	Records that don't fit stay for the next read.
+
+--*/
+{
+	ULONG bytes;
+
+	if (OutputSize < sizeof(EMU_TRACE_DUMP))
+		return STATUS_BUFFER_TOO_SMALL;
+	bytes = EmuTraceBeginDump(Output, HOST_PERFORMANCE_FREQUENCY);
+	if (Class->TraceRing != NULL)
+		bytes += EmuTraceDrain(Class->TraceRing, 0, (PUCHAR)Output + bytes, OutputSize - bytes);
+	*Information = bytes;
+	return STATUS_SUCCESS;
+}
+
+//
+//Timers and the class service
+//
+
+LONG64
+HostNow(
+	IN PHOST_CLASS Class)
+{
+	return Class->Host->Now;
+}
+
+VOID
+HostStartAutofire(
+	IN PHOST_CLASS Class,
+	IN PHOST_DEVICE Device,
+	IN LONG64 DueIn)
+{
+	Device->AutofireDue = Class->Host->Now + (DueIn > 0 ? DueIn : 1);
+}
+
+VOID
+HostDeliver(
+	IN PHOST_CLASS Class,
+	IN PHOST_DEVICE Device,
+	IN const VOID* Inputs,
+	IN ULONG Count)
+/*++
+
+Routine Description:
+
+	Mock class service, keeps what reaches the class driver as records
+	for EmuHostDelivered. Packets beyond its capacity are dropped.
+
+--*/
+{
+	for (ULONG i = 0; i < Count && Class->DeliveredCount < EMU_HOST_DELIVERED_CAPACITY; i++)
+	{
+		PUCHAR record = Class->Delivered + Class->DeliveredCount++ * Class->RecordSize;
+
+		memset(record, 0, Class->RecordSize);
+		memcpy(record, &Class->Host->Now, sizeof(LONG64));
+		memcpy(record + 8, &Device->Handle, sizeof(ULONG));
+		memcpy(record + 16, (const UCHAR*)Inputs + i * Class->InputSize, Class->InputSize);
+	}
+}
+
+VOID
+HostInsert(
+	IN PHOST_CLASS Class,
+	IN PHOST_DEVICE Device,
+	IN const VOID* Inputs,
+	IN ULONG Count,
+	IN ULONG Stat)
+/*++
+
+Routine Description:
+
+	On_IOCTL_*_INSERT of the drivers, counts the packets under Stat and
+	hands them to the class service without filtering.
+
+--*/
+{
+	LONG64 start = HostPerformanceCounter();
+
+	EmuStatsAdd(Device->Stats, 0, (EMU_STAT)Stat, Count);
+	HostTraceWrite(Class, EMU_TRACE_INJECT, (USHORT)Count, Stat);
+	HostDeliver(Class, Device, Inputs, Count);
+	EmuHistogramRecord(&Device->Histograms[EMU_HIST_INJECT], HostPerformanceCounter() - start);
+}
+
+static BOOLEAN HostNextTimer(PEMU_HOST Host, LONG64 Until)
+/*++
+
+Routine Description:
+
+	Runs the earliest timer due no later than Until, with the clock set
+	to its due time.
+
+Return Value:
+
+	TRUE if a timer ran, FALSE if none is due.
+
+--*/
+{
+	PHOST_CLASS timerClass = NULL;
+	PHOST_DEVICE timerDevice = NULL;
+	PHOST_REQUEST timerRequest = NULL;
+	LONG64 due = Until + 1;
+
+	for (ULONG c = 0; c < EMU_HOST_CLASS_COUNT; c++)
+	{
+		PHOST_CLASS class = &Host->Classes[c];
+
+		for (ULONG i = 0; i < class->DeviceCount; i++)
+		{
+			if (class->Devices[i]->AutofireDue != 0 && class->Devices[i]->AutofireDue < due) {
+				due = class->Devices[i]->AutofireDue;
+				timerClass = class;
+				timerDevice = class->Devices[i];
+				timerRequest = NULL;
+			}
+		}
+		if (class->CaptureRequest != NULL && class->CaptureLatency > 0 && class->CaptureDeadline < due) {
+			due = class->CaptureDeadline;
+			timerClass = class;
+			timerDevice = NULL;
+			timerRequest = NULL;
+		}
+		for (PHOST_REQUEST request = class->DetectQueue.Head; request; request = request->Next)
+		{
+			if (request->Deadline != 0 && request->Deadline < due) {
+				due = request->Deadline;
+				timerClass = class;
+				timerDevice = NULL;
+				timerRequest = request;
+			}
+		}
+	}
+	if (timerClass == NULL)
+		return FALSE;
+
+	if (due > Host->Now)
+		Host->Now = due;
+	if (timerDevice) {
+		timerDevice->AutofireDue = 0;
+		timerClass->Ops->AutofireTimer(timerClass, timerDevice);
+	}
+	else if (timerRequest) {
+		HostUnlinkRequest(&timerClass->DetectQueue, timerRequest);
+		HostCompleteRequest(timerRequest, STATUS_IO_TIMEOUT, 0);
+	}
+	else {
+		HostCompleteCaptureBatch(timerClass);
+	}
+	return TRUE;
+}
+
+//
+//Transport
+//
+
+static PVOID HostOpen(PVOID Context, ULONG Flags)
+{
+	PHOST_CLASS class = (PHOST_CLASS)Context;
+	PHOST_SESSION session = (PHOST_SESSION)calloc(1, sizeof(HOST_SESSION));
+
+	if (session) {
+		session->Class = class;
+		session->Flags = Flags;
+		session->DeviceHandle = EMU_DEVICE_HANDLE_NONE;
+	}
+	return session;
+}
+
+static VOID HostClose(PVOID Context, PVOID Handle)
+/*++
+
+Routine Description:
+
+	Cleanup of the file object: its requests are cancelled, the capture batch
+	it was collecting dropped and its ring mapping removed.
+
+--*/
+{
+	PHOST_CLASS class = (PHOST_CLASS)Context;
+	PHOST_SESSION session = (PHOST_SESSION)Handle;
+
+	pthread_mutex_lock(&class->Host->Lock);
+	if (class->CaptureRequest != NULL && class->CaptureRequest->Session == session) {
+		class->CaptureRequest = NULL;
+		class->CaptureCapacity = 0;
+		class->CaptureCount = 0;
+	}
+	HostCancelSessionRequests(&class->CaptureQueue, session);
+	HostCancelSessionRequests(&class->CaptureBatchQueue, session);
+	HostCancelSessionRequests(&class->DetectQueue, session);
+	HostUnmapCaptureRing(class, session);
+	//delayed inserts of the handle are let through, the thread still holds them
+	while (class->Host->InsertHead != NULL)
+	{
+		BOOLEAN held = FALSE;
+
+		for (PHOST_INSERT insert = class->Host->InsertHead; insert; insert = insert->Next)
+			held |= insert->Session == session;
+		if (!held)
+			break;
+		pthread_cond_wait(&class->Host->Completed, &class->Host->Lock);
+	}
+	pthread_mutex_unlock(&class->Host->Lock);
+	free(session);
+}
+
+static ULONG HostIoControl(PVOID Context, PVOID Handle, ULONG IoControlCode, PVOID Input, ULONG InputSize,
+	PVOID Output, ULONG OutputSize, PULONG BytesReturned, PVOID Overlapped)
+{
+	PHOST_CLASS class = (PHOST_CLASS)Context;
+	PEMU_HOST host = class->Host;
+	PHOST_SESSION session = (PHOST_SESSION)Handle;
+	HOST_REQUEST request;
+	ULONG_PTR information = 0;
+	NTSTATUS status;
+
+	memset(&request, 0, sizeof(request));
+	request.Session = session;
+	request.Output = Output;
+	request.OutputSize = OutputSize;
+	//only a handle opened for overlapped I/O returns before the request completes
+	if (session->Flags & EMU_TRANSPORT_OVERLAPPED)
+		request.Overlapped = (LPOVERLAPPED)Overlapped;
+	if (request.Overlapped) {
+		request.Overlapped->Internal = (ULONG_PTR)STATUS_PENDING;
+		request.Overlapped->InternalHigh = 0;
+		if (request.Overlapped->hEvent)
+			ResetEvent(request.Overlapped->hEvent);
+	}
+	*BytesReturned = 0;
+
+	pthread_mutex_lock(&host->Lock);
+	if (host->InsertLatency > 0 && (IoControlCode & ~class->TargetedBit) == class->InsertCode) {
+		PHOST_INSERT insert = (PHOST_INSERT)malloc(sizeof(HOST_INSERT) + InputSize);
+
+		if (insert == NULL) {
+			pthread_mutex_unlock(&host->Lock);
+			return RtlNtStatusToDosError(STATUS_INSUFFICIENT_RESOURCES);
+		}
+		insert->Next = NULL;
+		insert->Session = session;
+		insert->IoControlCode = IoControlCode;
+		insert->Overlapped = request.Overlapped;
+		clock_gettime(CLOCK_MONOTONIC, &insert->Due);
+		HostAddTime(&insert->Due, host->InsertLatency);
+		insert->InputSize = InputSize;
+		memcpy(insert->Input, Input, InputSize);
+		if (insert->Overlapped) {
+			//the insert thread completes it once its latency passed
+			if (host->InsertTail)
+				host->InsertTail->Next = insert;
+			else
+				host->InsertHead = insert;
+			host->InsertTail = insert;
+			pthread_cond_signal(&host->InsertQueued);
+			pthread_mutex_unlock(&host->Lock);
+			return EMU_TRANSPORT_PENDING;
+		}
+		pthread_mutex_unlock(&host->Lock);
+		HostSleepUntil(&insert->Due);
+		free(insert);
+		pthread_mutex_lock(&host->Lock);
+	}
+	status = class->Ops->Dispatch(class, session, IoControlCode, Input, InputSize, Output, OutputSize, &information, &request);
+	if (status == STATUS_PENDING) {
+		if (request.Overlapped) {
+			pthread_mutex_unlock(&host->Lock);
+			return EMU_TRANSPORT_PENDING;
+		}
+		while (!request.Completed)
+			pthread_cond_wait(&host->Completed, &host->Lock);
+		status = request.Status;
+		information = request.Information;
+	}
+	else if (request.Overlapped) {
+		ShimCompleteOverlapped(request.Overlapped, status, information);
+	}
+	pthread_mutex_unlock(&host->Lock);
+	*BytesReturned = (ULONG)information;
+	return RtlNtStatusToDosError(status);
+}
+
+static void* HostInsertThread(void* Argument)
+/*++
+
+Routine Description:
+
+	Dispatches the delayed inserts in the order they were sent, each once
+	its latency passed, and completes them through their overlapped.
+	Inserts in flight overlap their latencies like requests to a device.
+
+--*/
+{
+	PEMU_HOST host = (PEMU_HOST)Argument;
+	PHOST_INSERT insert;
+
+	pthread_mutex_lock(&host->Lock);
+	for (;;) {
+		while (host->InsertHead == NULL && !host->Stopping)
+			pthread_cond_wait(&host->InsertQueued, &host->Lock);
+		if (host->InsertHead == NULL)
+			break;
+		insert = host->InsertHead;
+		pthread_mutex_unlock(&host->Lock);
+		HostSleepUntil(&insert->Due);
+		pthread_mutex_lock(&host->Lock);
+		{
+			PHOST_CLASS class = insert->Session->Class;
+			ULONG_PTR information = 0;
+			NTSTATUS status = class->Ops->Dispatch(class, insert->Session, insert->IoControlCode,
+				insert->Input, insert->InputSize, NULL, 0, &information, NULL);
+
+			host->InsertHead = insert->Next;
+			if (host->InsertHead == NULL)
+				host->InsertTail = NULL;
+			ShimCompleteOverlapped(insert->Overlapped, status, information);
+			free(insert);
+			pthread_cond_broadcast(&host->Completed);
+		}
+	}
+	pthread_mutex_unlock(&host->Lock);
+	return NULL;
+}
+
+PEMU_HOST
+EmuHostCreate(
+	VOID)
+{
+	PEMU_HOST host = (PEMU_HOST)calloc(1, sizeof(EMU_HOST));
+
+	if (host == NULL)
+		return NULL;
+	pthread_mutex_init(&host->Lock, NULL);
+	pthread_cond_init(&host->Completed, NULL);
+	{
+		pthread_condattr_t attributes;
+
+		pthread_condattr_init(&attributes);
+		pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+		pthread_cond_init(&host->InsertQueued, &attributes);
+		pthread_condattr_destroy(&attributes);
+	}
+	KeyboardHostInitialize(&host->Classes[EMU_HOST_KEYBOARD]);
+	MouseHostInitialize(&host->Classes[EMU_HOST_MOUSE]);
+	for (ULONG c = 0; c < EMU_HOST_CLASS_COUNT; c++)
+	{
+		host->Classes[c].Host = host;
+		host->Classes[c].Delivered = (PUCHAR)malloc((size_t)EMU_HOST_DELIVERED_CAPACITY * host->Classes[c].RecordSize);
+		host->Classes[c].CaptureRecords = (PUCHAR)malloc((size_t)HOST_CAPTURE_BATCH_MAX * host->Classes[c].RecordSize);
+	}
+	if (host->Classes[EMU_HOST_KEYBOARD].Delivered == NULL || host->Classes[EMU_HOST_MOUSE].Delivered == NULL ||
+		host->Classes[EMU_HOST_KEYBOARD].CaptureRecords == NULL || host->Classes[EMU_HOST_MOUSE].CaptureRecords == NULL ||
+		pthread_create(&host->InsertThread, NULL, HostInsertThread, host) != 0) {
+		free(host->Classes[EMU_HOST_KEYBOARD].Delivered);
+		free(host->Classes[EMU_HOST_MOUSE].Delivered);
+		free(host->Classes[EMU_HOST_KEYBOARD].CaptureRecords);
+		free(host->Classes[EMU_HOST_MOUSE].CaptureRecords);
+		free(host);
+		return NULL;
+	}
+	return host;
+}
+
+VOID
+EmuHostDestroy(
+	IN PEMU_HOST Host)
+{
+	pthread_mutex_lock(&Host->Lock);
+	Host->Stopping = TRUE;
+	pthread_cond_signal(&Host->InsertQueued);
+	pthread_mutex_unlock(&Host->Lock);
+	pthread_join(Host->InsertThread, NULL);
+
+	for (ULONG c = 0; c < EMU_HOST_CLASS_COUNT; c++)
+	{
+		PHOST_CLASS class = &Host->Classes[c];
+
+		HostCancelSessionRequests(&class->CaptureQueue, NULL);
+		HostCancelSessionRequests(&class->DetectQueue, NULL);
+		if (class->CaptureRequest)
+			HostCompleteCaptureBatch(class);
+		HostCancelSessionRequests(&class->CaptureBatchQueue, NULL);
+		while (class->DeviceCount > 0)
+			EmuHostRemoveDevice(Host, c, class->Devices[0]->Handle);
+		for (ULONG i = 0; i < EMU_DEVICE_TABLE_SIZE; i++)
+		{
+			free(class->DeviceTable.Entries[i].Parked);
+			free(class->Images[i].Image);
+		}
+		if (class->Ring != NULL) {
+			munmap(class->Ring, class->RingSize);
+			munmap(class->RingView, class->RingSize);
+		}
+		free(class->Delivered);
+		free(class->CaptureRecords);
+		free(class->TraceRing);
+	}
+	pthread_cond_destroy(&Host->InsertQueued);
+	pthread_cond_destroy(&Host->Completed);
+	pthread_mutex_destroy(&Host->Lock);
+	free(Host);
+}
+
+VOID
+EmuHostTransport(
+	IN PEMU_HOST Host,
+	IN ULONG Class,
+	OUT PEMU_TRANSPORT Transport)
+{
+	Transport->Context = &Host->Classes[Class];
+	Transport->Open = HostOpen;
+	Transport->IoControl = HostIoControl;
+	Transport->Close = HostClose;
+}
+
+ULONG
+EmuHostAddDevice(
+	IN PEMU_HOST Host,
+	IN ULONG Class,
+	IN const char* InstanceId)
+/*++
+
+Routine Description:
+
+	EvtDeviceAdd of the drivers. The handle and the identity are hashed
+	from the upcased UTF-16 instance id, as the drivers hash the one of
+	the PDO.
+
+--*/
+{
+	PHOST_CLASS class = &Host->Classes[Class];
+	WCHAR id[256];
+	ULONG length = 0;
+	PEMU_DEVICE_ENTRY entry;
+	PHOST_DEVICE device;
+	PHOST_IMAGE saved;
+	PVOID parked;
+	ULONG deviceHandle;
+	ULONG identity;
+
+	while (InstanceId[length] != '\0' && length < ARRAYSIZE(id))
+	{
+		id[length] = (WCHAR)toupper((unsigned char)InstanceId[length]);
+		length++;
+	}
+	deviceHandle = EmuHashDeviceId((const UCHAR*)id, length * sizeof(WCHAR), EMU_DEVICE_HANDLE_SEED);
+	identity = EmuHashDeviceId((const UCHAR*)id, length * sizeof(WCHAR), EMU_DEVICE_IDENTITY_SEED);
+
+	pthread_mutex_lock(&Host->Lock);
+	entry = EmuDeviceTableClaim(&class->DeviceTable, deviceHandle, identity);
+	if (entry == NULL || class->DeviceCount == EMU_DEVICE_TABLE_SIZE) {
+		pthread_mutex_unlock(&Host->Lock);
+		return EMU_DEVICE_HANDLE_NONE;
+	}
+	device = class->Ops->CreateDevice(class);
+	if (device == NULL) {
+		if (entry->Parked == NULL)
+			EmuDeviceTableRemove(&class->DeviceTable, entry);
+		pthread_mutex_unlock(&Host->Lock);
+		return EMU_DEVICE_HANDLE_NONE;
+	}
+	device->Handle = entry->Handle;
+	device->Identity = identity;
+	device->RuleGeneration = 1;
+	parked = entry->Parked;
+	entry->Parked = NULL;
+	//a device that was here before gets back what it left with, else what was saved for it
+	if (parked != NULL) {
+		class->Ops->ApplyRuleImage(class, device, (const UCHAR*)parked);
+		free(parked);
+	}
+	else if ((saved = HostFindImage(class, device->Handle)) != NULL &&
+		EmuValidateRuleImage(saved->Image, saved->Size)) {
+		class->Ops->ApplyRuleImage(class, device, saved->Image);
+	}
+	entry->Device = device;
+	class->Devices[class->DeviceCount++] = device;
+	pthread_mutex_unlock(&Host->Lock);
+	return device->Handle;
+}
+
+BOOLEAN
+EmuHostRemoveDevice(
+	IN PEMU_HOST Host,
+	IN ULONG Class,
+	IN ULONG DeviceHandle)
+/*++
+
+Routine Description:
+
+	EvtDeviceContextCleanup of the drivers: the device leaves the
+	collection and its profiles are parked in its table entry, unless the
+	table is too full to keep them.
+
+--*/
+{
+	PHOST_CLASS class = &Host->Classes[Class];
+	PEMU_DEVICE_ENTRY entry;
+	PHOST_DEVICE device;
+	PUCHAR image;
+	ULONG imageSize;
+
+	pthread_mutex_lock(&Host->Lock);
+	entry = EmuDeviceTableFind(&class->DeviceTable, DeviceHandle);
+	device = entry ? (PHOST_DEVICE)entry->Device : NULL;
+	if (device == NULL) {
+		pthread_mutex_unlock(&Host->Lock);
+		return FALSE;
+	}
+	for (ULONG i = HostDeviceIndex(class, device); i + 1 < class->DeviceCount; i++)
+		class->Devices[i] = class->Devices[i + 1];
+	class->DeviceCount--;
+	entry->Device = NULL;
+
+	imageSize = class->Ops->SerializeProfiles(device, NULL, 0);
+	image = imageSize != 0 ? (PUCHAR)malloc(imageSize) : NULL;
+	if (image != NULL)
+		imageSize = class->Ops->SerializeProfiles(device, image, imageSize);
+	if (image != NULL && imageSize != 0 && imageSize <= EMU_IMAGE_MAX_SIZE &&
+		class->DeviceTable.Count <= EMU_DEVICE_TABLE_SIZE / 2) {
+		free(entry->Parked);
+		entry->Parked = image;
+	}
+	else {
+		free(image);
+		free(entry->Parked);
+		entry->Parked = NULL;
+		EmuDeviceTableRemove(&class->DeviceTable, entry);
+	}
+	class->Ops->DeleteDevice(class, device);
+	pthread_mutex_unlock(&Host->Lock);
+	return TRUE;
+}
+
+BOOLEAN
+EmuHostInput(
+	IN PEMU_HOST Host,
+	IN ULONG Class,
+	IN ULONG DeviceHandle,
+	IN const VOID* Inputs,
+	IN ULONG Count)
+{
+	PHOST_CLASS class = &Host->Classes[Class];
+	UCHAR packets[64 * sizeof(MOUSE_INPUT_DATA)];
+	PHOST_DEVICE device;
+	ULONG batch;
+
+	pthread_mutex_lock(&Host->Lock);
+	device = DeviceHandle != EMU_DEVICE_HANDLE_NONE ? HostReferenceDevice(class, DeviceHandle) : NULL;
+	if (device == NULL) {
+		pthread_mutex_unlock(&Host->Lock);
+		return FALSE;
+	}
+	HostCompleteDetect(class, device);
+	//the port driver reports from its own buffer, which the callback may rewrite
+	for (ULONG first = 0; first < Count; first += batch)
+	{
+		batch = (ULONG)(sizeof(packets) / class->InputSize);
+		if (batch > Count - first)
+			batch = Count - first;
+		memcpy(packets, (const UCHAR*)Inputs + first * class->InputSize, batch * class->InputSize);
+		class->Ops->Input(class, device, packets, batch);
+	}
+	pthread_mutex_unlock(&Host->Lock);
+	return TRUE;
+}
+
+VOID
+EmuHostAdvance(
+	IN PEMU_HOST Host,
+	IN LONG64 Microseconds)
+{
+	LONG64 until;
+
+	pthread_mutex_lock(&Host->Lock);
+	until = Host->Now + Microseconds * 10;
+	while (HostNextTimer(Host, until))
+		;
+	Host->Now = until;
+	pthread_mutex_unlock(&Host->Lock);
+}
+
+LONG64
+EmuHostNow(
+	IN PEMU_HOST Host)
+{
+	LONG64 now;
+
+	pthread_mutex_lock(&Host->Lock);
+	now = Host->Now;
+	pthread_mutex_unlock(&Host->Lock);
+	return now;
+}
+
+VOID
+EmuHostSetInsertLatency(
+	IN PEMU_HOST Host,
+	IN ULONG Microseconds)
+{
+	pthread_mutex_lock(&Host->Lock);
+	Host->InsertLatency = Microseconds;
+	pthread_mutex_unlock(&Host->Lock);
+}
+
+ULONG
+EmuHostDelivered(
+	IN PEMU_HOST Host,
+	IN ULONG Class,
+	OUT PVOID Records,
+	IN ULONG Capacity)
+{
+	PHOST_CLASS class = &Host->Classes[Class];
+	ULONG count;
+
+	pthread_mutex_lock(&Host->Lock);
+	count = class->DeliveredCount < Capacity ? class->DeliveredCount : Capacity;
+	memcpy(Records, class->Delivered, (size_t)count * class->RecordSize);
+	memmove(class->Delivered, class->Delivered + (size_t)count * class->RecordSize,
+		(size_t)(class->DeliveredCount - count) * class->RecordSize);
+	class->DeliveredCount -= count;
+	pthread_mutex_unlock(&Host->Lock);
+	return count;
+}
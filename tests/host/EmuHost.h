@@ -0,0 +1,155 @@
+/*++
+
+Module Name:
+
+	EmuHost.h
+
+Abstract:
+
+	In process host of the keyboard and mouse emulators, so the native
+	APIs can be driven off target. The host answers the IOCTLs of both
+	control devices through an EMU_TRANSPORT and runs the input of its
+	simulated devices through the same pipeline as the service callbacks
+	of the drivers, built from the portable code in Sys/Common: the stages
+	of KeyPipeline.c and MousePipeline.c, capture requests and
+	CaptureRing.h, RuleImage.c for saved and parked configurations.
+
+	What reaches the class driver is kept by a mock class service and
+	read back with EmuHostDelivered.
+
+	Time is virtual. It starts at zero and only moves with EmuHostAdvance,
+	which fires the autofire timers, capture latencies and detect timeouts
+	that fall due in order, so timing dependent behavior is reproducible.
+
+	Every call may be made from any thread, the host serializes them on
+	one lock.
+
+	EmuRemoteHost.c implements the same functions against the host an
+	EmuSimulator process serves on a Unix socket, see EmuSocket.h.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#ifndef EMUHOST_H
+#define EMUHOST_H
+
+#include "EmuTransport.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+//Device classes of the host
+//
+#define EMU_HOST_KEYBOARD		0
+#define EMU_HOST_MOUSE			1
+#define EMU_HOST_CLASS_COUNT	2
+
+//
+//Records the mock class service keeps per class before it drops input
+//
+#define EMU_HOST_DELIVERED_CAPACITY 4096
+
+typedef struct _EMU_HOST EMU_HOST, * PEMU_HOST;
+
+PEMU_HOST
+EmuHostCreate(
+	VOID);
+
+//
+//Completes the requests still pending with STATUS_CANCELLED and frees the
+//host. The transports of the host must not be used afterwards.
+//
+VOID
+EmuHostDestroy(
+	IN PEMU_HOST Host);
+
+//
+//Transport that reaches the control device of Class, for KeyboardSetTransport
+//and MouseSetTransport
+//
+VOID
+EmuHostTransport(
+	IN PEMU_HOST Host,
+	IN ULONG Class,
+	OUT PEMU_TRANSPORT Transport);
+
+//
+//Plugs in a device with the instance id of its PDO. A device unplugged
+//before gets back the configuration it had.
+//
+//Returns the device handle, EMU_DEVICE_HANDLE_NONE if the table is full.
+//
+ULONG
+EmuHostAddDevice(
+	IN PEMU_HOST Host,
+	IN ULONG Class,
+	IN const char* InstanceId);
+
+BOOLEAN
+EmuHostRemoveDevice(
+	IN PEMU_HOST Host,
+	IN ULONG Class,
+	IN ULONG DeviceHandle);
+
+//
+//Reports Count KEYBOARD_INPUT_DATA or MOUSE_INPUT_DATA packets from a
+//device, as its port driver would through the service callback.
+//
+//Returns FALSE if there is no such device.
+//
+BOOLEAN
+EmuHostInput(
+	IN PEMU_HOST Host,
+	IN ULONG Class,
+	IN ULONG DeviceHandle,
+	IN const VOID* Inputs,
+	IN ULONG Count);
+
+//
+//Moves the virtual time forward, running the timers that fall due
+//
+VOID
+EmuHostAdvance(
+	IN PEMU_HOST Host,
+	IN LONG64 Microseconds);
+
+//
+//Virtual time in 100 ns units, the unit of capture timestamps
+//
+LONG64
+EmuHostNow(
+	IN PEMU_HOST Host);
+
+//
+//Delays every insert by Microseconds of real time before it reaches the
+//class service, to stand in for the round trip to a device. 0 by default.
+//
+VOID
+EmuHostSetInsertLatency(
+	IN PEMU_HOST Host,
+	IN ULONG Microseconds);
+
+//
+//Moves the packets that reached the class service of Class into Records,
+//as KEY_CAPTURE_RECORD or MOUSE_CAPTURE_RECORD with the Source 0.
+//
+//Returns the number of records, at most Capacity. Packets not read stay
+//for the next call.
+//
+ULONG
+EmuHostDelivered(
+	IN PEMU_HOST Host,
+	IN ULONG Class,
+	OUT PVOID Records,
+	IN ULONG Capacity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EMUHOST_H
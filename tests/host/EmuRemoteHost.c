@@ -0,0 +1,616 @@
+/*++
+
+Module Name:
+
+	EmuRemoteHost.c
+
+Abstract:
+
+	EmuHost.h over the Unix socket of EmuSocket.h. EmuHostCreate starts
+	the EmuSimulator next to the executable and connects to it, every
+	other call is answered by the host the simulator serves. Tests and
+	benchmarks linked with this in place of the in process host drive the
+	native APIs across a process boundary.
+
+	Calls may be made from any thread. A reader thread matches the replies
+	to their calls and completes the overlapped of the pending IOCTLs.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <windows.h>
+#include <ntddkbd.h>
+#include <ntddmou.h>
+
+#include "DeviceTable.h"
+#include "EmuSocket.h"
+
+extern char** environ;
+
+//
+//Layout of KEY_CAPTURE_RECORD and MOUSE_CAPTURE_RECORD, the public.h of
+//the two drivers can not be included together
+//
+#define REMOTE_RECORD(Input) struct { LONG64 Timestamp; ULONG DeviceHandle; USHORT Source; USHORT Reserved; Input Packet; }
+
+static const ULONG RemoteInputSizes[EMU_HOST_CLASS_COUNT] = {
+	sizeof(KEYBOARD_INPUT_DATA),
+	sizeof(MOUSE_INPUT_DATA),
+};
+
+static const ULONG RemoteRecordSizes[EMU_HOST_CLASS_COUNT] = {
+	sizeof(REMOTE_RECORD(KEYBOARD_INPUT_DATA)),
+	sizeof(REMOTE_RECORD(MOUSE_INPUT_DATA)),
+};
+
+//
+//Milliseconds a started simulator has to listen on its socket
+//
+#define REMOTE_CONNECT_TIMEOUT 10000
+
+//
+//Call waiting for its reply, or pending IOCTL waiting for its completion
+//
+typedef struct _REMOTE_CALL {
+	struct _REMOTE_CALL* Next;
+	ULONG Id;
+	PVOID Output;
+	ULONG OutputSize;
+	//Overlapped the reader completes, NULL if the caller waits for the completion
+	LPOVERLAPPED Overlapped;
+	BOOLEAN Replied;
+	BOOLEAN Completed;
+	//The caller returned ERROR_IO_PENDING, the reader frees the call once it completes
+	BOOLEAN Detached;
+	EMU_SOCKET_MESSAGE Reply;
+	EMU_SOCKET_MESSAGE Completion;
+} REMOTE_CALL, * PREMOTE_CALL;
+
+//
+//Context of the transport of a class
+//
+typedef struct _REMOTE_CLASS {
+	PEMU_HOST Host;
+	ULONG Class;
+} REMOTE_CLASS, * PREMOTE_CLASS;
+
+typedef struct _REMOTE_HANDLE {
+	ULONG Handle;
+	ULONG Flags;
+} REMOTE_HANDLE, * PREMOTE_HANDLE;
+
+struct _EMU_HOST {
+	pid_t Simulator;
+	int Socket;
+	char Path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+	REMOTE_CLASS Classes[EMU_HOST_CLASS_COUNT];
+	pthread_t Reader;
+	//
+	//Guards the calls and serializes the writes to the socket
+	//
+	pthread_mutex_t Lock;
+	//Broadcast whenever a call is replied or completed
+	pthread_cond_t Replied;
+	PREMOTE_CALL Calls;
+	ULONG NextId;
+	//The connection is gone, every call fails from then on
+	BOOLEAN Lost;
+};
+
+static VOID RemoteUnlinkCall(PEMU_HOST Host, PREMOTE_CALL Call)
+{
+	PREMOTE_CALL* link = &Host->Calls;
+
+	while (*link != Call)
+		link = &(*link)->Next;
+	*link = Call->Next;
+}
+
+static void* RemoteReaderThread(void* Argument)
+/*++
+
+Routine Description:
+
+	Hands the replies and completions of the simulator to their calls.
+	Once the connection is gone the calls still waiting fail and the
+	pending overlapped ones complete with STATUS_CANCELLED.
+
+--*/
+{
+	PEMU_HOST host = (PEMU_HOST)Argument;
+	EMU_SOCKET_MESSAGE message;
+	PUCHAR payload = NULL;
+	ULONG payloadCapacity = 0;
+
+	while (EmuSocketReceive(host->Socket, &message, sizeof(message)) && message.PayloadSize <= EMU_SOCKET_PAYLOAD_MAX)
+	{
+		PREMOTE_CALL call;
+
+		if (message.PayloadSize > payloadCapacity) {
+			PUCHAR grown = (PUCHAR)realloc(payload, message.PayloadSize);
+
+			if (grown == NULL)
+				break;
+			payload = grown;
+			payloadCapacity = message.PayloadSize;
+		}
+		if (!EmuSocketReceive(host->Socket, payload, message.PayloadSize))
+			break;
+
+		pthread_mutex_lock(&host->Lock);
+		for (call = host->Calls; call != NULL && call->Id != message.Id; call = call->Next)
+			;
+		if (call != NULL) {
+			if (call->Output != NULL)
+				memcpy(call->Output, payload, message.PayloadSize < call->OutputSize ? message.PayloadSize : call->OutputSize);
+			if (message.Type == EMU_SOCKET_COMPLETE) {
+				call->Completion = message;
+				call->Completed = TRUE;
+				if (call->Overlapped != NULL)
+					ShimCompleteOverlapped(call->Overlapped, message.Status, message.PayloadSize);
+				if (call->Detached) {
+					RemoteUnlinkCall(host, call);
+					free(call);
+				}
+			}
+			else {
+				call->Reply = message;
+				call->Replied = TRUE;
+			}
+			pthread_cond_broadcast(&host->Replied);
+		}
+		pthread_mutex_unlock(&host->Lock);
+	}
+
+	pthread_mutex_lock(&host->Lock);
+	host->Lost = TRUE;
+	for (PREMOTE_CALL call = host->Calls, next; call != NULL; call = next)
+	{
+		next = call->Next;
+		if (call->Detached) {
+			ShimCompleteOverlapped(call->Overlapped, STATUS_CANCELLED, 0);
+			RemoteUnlinkCall(host, call);
+			free(call);
+		}
+	}
+	pthread_cond_broadcast(&host->Replied);
+	pthread_mutex_unlock(&host->Lock);
+	free(payload);
+	return NULL;
+}
+
+static ULONG RemoteCall(
+	PEMU_HOST Host,
+	PEMU_SOCKET_MESSAGE Message,
+	const VOID* Payload,
+	PVOID Output,
+	ULONG OutputSize,
+	LPOVERLAPPED Overlapped,
+	PEMU_SOCKET_MESSAGE Reply)
+/*++
+
+Routine Description:
+
+	Sends a call and waits for its reply, copying the payload of the reply
+	to Output. An IOCTL the simulator pends returns right away if it has
+	an Overlapped, the reader completes it. Otherwise its completion is
+	waited for and returned as the reply, with its status as the Error.
+
+Return Value:
+
+	The Error of the reply, ERROR_DEVICE_NOT_CONNECTED if the simulator
+	is gone.
+
+--*/
+{
+	PREMOTE_CALL call = (PREMOTE_CALL)calloc(1, sizeof(REMOTE_CALL));
+
+	memset(Reply, 0, sizeof(EMU_SOCKET_MESSAGE));
+	Reply->Status = STATUS_PENDING;
+	Reply->Error = ERROR_NOT_ENOUGH_MEMORY;
+	if (call == NULL)
+		return Reply->Error;
+	call->Output = Output;
+	call->OutputSize = OutputSize;
+	call->Overlapped = Overlapped;
+
+	Reply->Error = ERROR_DEVICE_NOT_CONNECTED;
+	pthread_mutex_lock(&Host->Lock);
+	Message->Id = call->Id = ++Host->NextId;
+	call->Next = Host->Calls;
+	Host->Calls = call;
+	if (Host->Lost || !EmuSocketSend(Host->Socket, Message, Payload))
+		goto Exit;
+	while (!call->Replied && !Host->Lost)
+		pthread_cond_wait(&Host->Replied, &Host->Lock);
+	if (!call->Replied)
+		goto Exit;
+	*Reply = call->Reply;
+	if (Message->Type == EMU_SOCKET_IOCONTROL && Reply->Error == EMU_TRANSPORT_PENDING) {
+		if (Overlapped != NULL) {
+			if (call->Completed)
+				goto Exit;
+			call->Detached = TRUE;
+			pthread_mutex_unlock(&Host->Lock);
+			return EMU_TRANSPORT_PENDING;
+		}
+		while (!call->Completed && !Host->Lost)
+			pthread_cond_wait(&Host->Replied, &Host->Lock);
+		Reply->Error = ERROR_DEVICE_NOT_CONNECTED;
+		if (!call->Completed)
+			goto Exit;
+		*Reply = call->Completion;
+		Reply->Error = RtlNtStatusToDosError(Reply->Status);
+	}
+
+Exit:
+	RemoteUnlinkCall(Host, call);
+	pthread_mutex_unlock(&Host->Lock);
+	free(call);
+	return Reply->Error;
+}
+
+//
+//Transport
+//
+
+static PVOID RemoteOpen(PVOID Context, ULONG Flags)
+{
+	PREMOTE_CLASS remote = (PREMOTE_CLASS)Context;
+	PREMOTE_HANDLE handle = (PREMOTE_HANDLE)malloc(sizeof(REMOTE_HANDLE));
+	EMU_SOCKET_MESSAGE message;
+	EMU_SOCKET_MESSAGE reply;
+
+	if (handle == NULL)
+		return NULL;
+	memset(&message, 0, sizeof(message));
+	message.Type = EMU_SOCKET_OPEN;
+	message.Class = remote->Class;
+	message.Code = Flags;
+	if (RemoteCall(remote->Host, &message, NULL, NULL, 0, NULL, &reply) != ERROR_SUCCESS) {
+		free(handle);
+		return NULL;
+	}
+	handle->Handle = reply.Handle;
+	handle->Flags = Flags;
+	return handle;
+}
+
+static ULONG RemoteIoControl(PVOID Context, PVOID Handle, ULONG IoControlCode, PVOID Input, ULONG InputSize,
+	PVOID Output, ULONG OutputSize, PULONG BytesReturned, PVOID Overlapped)
+{
+	PREMOTE_CLASS remote = (PREMOTE_CLASS)Context;
+	PREMOTE_HANDLE handle = (PREMOTE_HANDLE)Handle;
+	LPOVERLAPPED overlapped = NULL;
+	EMU_SOCKET_MESSAGE message;
+	EMU_SOCKET_MESSAGE reply;
+	ULONG error;
+
+	memset(&message, 0, sizeof(message));
+	message.Type = EMU_SOCKET_IOCONTROL;
+	message.Class = remote->Class;
+	message.Handle = handle->Handle;
+	message.Code = IoControlCode;
+	message.OutputSize = OutputSize;
+	message.PayloadSize = InputSize;
+	//only a handle opened for overlapped I/O returns before the request completes
+	if (handle->Flags & EMU_TRANSPORT_OVERLAPPED)
+		overlapped = (LPOVERLAPPED)Overlapped;
+	if (overlapped) {
+		overlapped->Internal = (ULONG_PTR)STATUS_PENDING;
+		overlapped->InternalHigh = 0;
+		if (overlapped->hEvent)
+			ResetEvent(overlapped->hEvent);
+	}
+	*BytesReturned = 0;
+
+	error = RemoteCall(remote->Host, &message, Input, Output, OutputSize, overlapped, &reply);
+	if (error == EMU_TRANSPORT_PENDING)
+		return error;
+	*BytesReturned = reply.PayloadSize;
+	//the simulator completed its overlapped, the caller's one completes the same way
+	if (overlapped && reply.Status != STATUS_PENDING)
+		ShimCompleteOverlapped(overlapped, reply.Status, reply.PayloadSize);
+	return error;
+}
+
+static VOID RemoteClose(PVOID Context, PVOID Handle)
+{
+	PREMOTE_CLASS remote = (PREMOTE_CLASS)Context;
+	PREMOTE_HANDLE handle = (PREMOTE_HANDLE)Handle;
+	EMU_SOCKET_MESSAGE message;
+	EMU_SOCKET_MESSAGE reply;
+
+	memset(&message, 0, sizeof(message));
+	message.Type = EMU_SOCKET_CLOSE;
+	message.Class = remote->Class;
+	message.Handle = handle->Handle;
+	RemoteCall(remote->Host, &message, NULL, NULL, 0, NULL, &reply);
+	free(handle);
+}
+
+//
+//Simulator
+//
+
+static BOOLEAN RemoteSimulatorPath(char* Path, size_t Size)
+/*++
+
+Routine Description:
+
+	Builds the path of the EmuSimulator in the directory of the executable.
+
+--*/
+{
+	static const char name[] = "EmuSimulator";
+	ssize_t length = readlink("/proc/self/exe", Path, Size - 1);
+	char* slash;
+
+	if (length <= 0)
+		return FALSE;
+	Path[length] = '\0';
+	slash = strrchr(Path, '/');
+	if (slash == NULL || (size_t)(slash + 1 - Path) + sizeof(name) > Size)
+		return FALSE;
+	memcpy(slash + 1, name, sizeof(name));
+	return TRUE;
+}
+
+static int RemoteConnect(PEMU_HOST Host)
+/*++
+
+Routine Description:
+
+	Connects to the simulator just started, retrying while it does not
+	listen yet.
+
+Return Value:
+
+	The socket, -1 if the simulator exited or did not listen in time.
+
+--*/
+{
+	struct sockaddr_un address;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, Host->Path, sizeof(Host->Path));
+	for (ULONG waited = 0; waited < REMOTE_CONNECT_TIMEOUT; waited++)
+	{
+		int status;
+		int client = socket(AF_UNIX, SOCK_STREAM, 0);
+
+		if (client < 0)
+			return -1;
+		if (connect(client, (struct sockaddr*)&address, sizeof(address)) == 0)
+			return client;
+		close(client);
+		if (waitpid(Host->Simulator, &status, WNOHANG) != 0) {
+			Host->Simulator = 0;
+			return -1;
+		}
+		usleep(1000);
+	}
+	return -1;
+}
+
+static VOID RemoteStopSimulator(PEMU_HOST Host)
+{
+	if (Host->Simulator != 0) {
+		kill(Host->Simulator, SIGTERM);
+		waitpid(Host->Simulator, NULL, 0);
+	}
+	unlink(Host->Path);
+}
+
+PEMU_HOST
+EmuHostCreate(
+	VOID)
+{
+	static volatile LONG instances;
+	PEMU_HOST host = (PEMU_HOST)calloc(1, sizeof(EMU_HOST));
+	char simulator[4096];
+	char* arguments[3];
+
+	if (host == NULL)
+		return NULL;
+	snprintf(host->Path, sizeof(host->Path), "/tmp/EmuSimulator.%d.%d", (int)getpid(), (int)InterlockedIncrement(&instances));
+	arguments[0] = simulator;
+	arguments[1] = host->Path;
+	arguments[2] = NULL;
+	if (!RemoteSimulatorPath(simulator, sizeof(simulator)) ||
+		posix_spawn(&host->Simulator, simulator, NULL, NULL, arguments, environ) != 0) {
+		fprintf(stderr, "EmuHostCreate: can not start %s\n", simulator);
+		free(host);
+		return NULL;
+	}
+	host->Socket = RemoteConnect(host);
+	if (host->Socket < 0) {
+		fprintf(stderr, "EmuHostCreate: %s does not listen on %s\n", simulator, host->Path);
+		RemoteStopSimulator(host);
+		free(host);
+		return NULL;
+	}
+	pthread_mutex_init(&host->Lock, NULL);
+	pthread_cond_init(&host->Replied, NULL);
+	for (ULONG c = 0; c < EMU_HOST_CLASS_COUNT; c++)
+	{
+		host->Classes[c].Host = host;
+		host->Classes[c].Class = c;
+	}
+	if (pthread_create(&host->Reader, NULL, RemoteReaderThread, host) != 0) {
+		close(host->Socket);
+		RemoteStopSimulator(host);
+		pthread_cond_destroy(&host->Replied);
+		pthread_mutex_destroy(&host->Lock);
+		free(host);
+		return NULL;
+	}
+	return host;
+}
+
+VOID
+EmuHostDestroy(
+	IN PEMU_HOST Host)
+{
+	EMU_SOCKET_MESSAGE message;
+	EMU_SOCKET_MESSAGE reply;
+
+	memset(&message, 0, sizeof(message));
+	message.Type = EMU_SOCKET_SHUTDOWN;
+	if (RemoteCall(Host, &message, NULL, NULL, 0, NULL, &reply) == ERROR_SUCCESS) {
+		//the simulator cancels what is still pending once it reads the end of the connection
+		shutdown(Host->Socket, SHUT_WR);
+		pthread_join(Host->Reader, NULL);
+		waitpid(Host->Simulator, NULL, 0);
+		Host->Simulator = 0;
+	}
+	else {
+		shutdown(Host->Socket, SHUT_RDWR);
+		pthread_join(Host->Reader, NULL);
+	}
+	close(Host->Socket);
+	RemoteStopSimulator(Host);
+	pthread_cond_destroy(&Host->Replied);
+	pthread_mutex_destroy(&Host->Lock);
+	free(Host);
+}
+
+VOID
+EmuHostTransport(
+	IN PEMU_HOST Host,
+	IN ULONG Class,
+	OUT PEMU_TRANSPORT Transport)
+{
+	Transport->Context = &Host->Classes[Class];
+	Transport->Open = RemoteOpen;
+	Transport->IoControl = RemoteIoControl;
+	Transport->Close = RemoteClose;
+}
+
+ULONG
+EmuHostAddDevice(
+	IN PEMU_HOST Host,
+	IN ULONG Class,
+	IN const char* InstanceId)
+{
+	EMU_SOCKET_MESSAGE message;
+	EMU_SOCKET_MESSAGE reply;
+
+	memset(&message, 0, sizeof(message));
+	message.Type = EMU_SOCKET_ADD_DEVICE;
+	message.Class = Class;
+	message.PayloadSize = (ULONG)strlen(InstanceId) + 1;
+	if (RemoteCall(Host, &message, InstanceId, NULL, 0, NULL, &reply) != ERROR_SUCCESS)
+		return EMU_DEVICE_HANDLE_NONE;
+	return reply.Code;
+}
+
+BOOLEAN
+EmuHostRemoveDevice(
+	IN PEMU_HOST Host,
+	IN ULONG Class,
+	IN ULONG DeviceHandle)
+{
+	EMU_SOCKET_MESSAGE message;
+	EMU_SOCKET_MESSAGE reply;
+
+	memset(&message, 0, sizeof(message));
+	message.Type = EMU_SOCKET_REMOVE_DEVICE;
+	message.Class = Class;
+	message.Handle = DeviceHandle;
+	return RemoteCall(Host, &message, NULL, NULL, 0, NULL, &reply) == ERROR_SUCCESS && reply.Code != 0;
+}
+
+BOOLEAN
+EmuHostInput(
+	IN PEMU_HOST Host,
+	IN ULONG Class,
+	IN ULONG DeviceHandle,
+	IN const VOID* Inputs,
+	IN ULONG Count)
+{
+	EMU_SOCKET_MESSAGE message;
+	EMU_SOCKET_MESSAGE reply;
+
+	memset(&message, 0, sizeof(message));
+	message.Type = EMU_SOCKET_INPUT;
+	message.Class = Class;
+	message.Handle = DeviceHandle;
+	message.Code = Count;
+	message.PayloadSize = Count * RemoteInputSizes[Class];
+	return RemoteCall(Host, &message, Inputs, NULL, 0, NULL, &reply) == ERROR_SUCCESS && reply.Code != 0;
+}
+
+VOID
+EmuHostAdvance(
+	IN PEMU_HOST Host,
+	IN LONG64 Microseconds)
+{
+	EMU_SOCKET_MESSAGE message;
+	EMU_SOCKET_MESSAGE reply;
+
+	memset(&message, 0, sizeof(message));
+	message.Type = EMU_SOCKET_ADVANCE;
+	message.Value = Microseconds;
+	RemoteCall(Host, &message, NULL, NULL, 0, NULL, &reply);
+}
+
+LONG64
+EmuHostNow(
+	IN PEMU_HOST Host)
+{
+	EMU_SOCKET_MESSAGE message;
+	EMU_SOCKET_MESSAGE reply;
+
+	memset(&message, 0, sizeof(message));
+	message.Type = EMU_SOCKET_NOW;
+	RemoteCall(Host, &message, NULL, NULL, 0, NULL, &reply);
+	return reply.Value;
+}
+
+VOID
+EmuHostSetInsertLatency(
+	IN PEMU_HOST Host,
+	IN ULONG Microseconds)
+{
+	EMU_SOCKET_MESSAGE message;
+	EMU_SOCKET_MESSAGE reply;
+
+	memset(&message, 0, sizeof(message));
+	message.Type = EMU_SOCKET_INSERT_LATENCY;
+	message.Code = Microseconds;
+	RemoteCall(Host, &message, NULL, NULL, 0, NULL, &reply);
+}
+
+ULONG
+EmuHostDelivered(
+	IN PEMU_HOST Host,
+	IN ULONG Class,
+	OUT PVOID Records,
+	IN ULONG Capacity)
+{
+	EMU_SOCKET_MESSAGE message;
+	EMU_SOCKET_MESSAGE reply;
+
+	memset(&message, 0, sizeof(message));
+	message.Type = EMU_SOCKET_DELIVERED;
+	message.Class = Class;
+	message.OutputSize = Capacity;
+	if (RemoteCall(Host, &message, NULL, Records, Capacity * RemoteRecordSizes[Class], NULL, &reply) != ERROR_SUCCESS)
+		return 0;
+	return reply.Code;
+}
@@ -0,0 +1,57 @@
+/*++
+
+Module Name:
+
+	EmuSimulator.c
+
+Abstract:
+
+	Out of process host of the keyboard and mouse emulators. Serves an
+	EmuHost on a Unix socket, see EmuSocket.h, until its client shuts it
+	down. EmuRemoteHost.c starts one per EmuHostCreate:
+
+		EmuSimulator <socket path>
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "EmuSocket.h"
+
+int main(int argc, char** argv)
+{
+	struct sockaddr_un address;
+	PEMU_HOST host;
+	int listener;
+
+	memset(&address, 0, sizeof(address));
+	if (argc != 2 || strlen(argv[1]) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "usage: EmuSimulator <socket path>\n");
+		return 2;
+	}
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, argv[1]);
+	unlink(argv[1]);
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 1) != 0) {
+		perror("EmuSimulator");
+		return 1;
+	}
+	host = EmuHostCreate();
+	if (host == NULL) {
+		fprintf(stderr, "EmuSimulator: can not create the host\n");
+		return 1;
+	}
+	EmuSocketServe(host, listener);
+	EmuHostDestroy(host);
+	close(listener);
+	unlink(argv[1]);
+	return 0;
+}
@@ -0,0 +1,195 @@
+/*++
+
+Module Name:
+
+	EmuSocket.h
+
+Abstract:
+
+	Protocol between the host served by EmuSimulator on a Unix socket and
+	EmuRemoteHost.c, which implements EmuHost.h over it so the native APIs
+	and their tests run against a driver simulated in another process.
+
+	Every message is an EMU_SOCKET_MESSAGE followed by PayloadSize bytes.
+	Each call of the client gets exactly one EMU_SOCKET_REPLY with its Id.
+	An IOCTL that stays pending is replied with Error EMU_TRANSPORT_PENDING
+	and later gets an EMU_SOCKET_COMPLETE with the same Id, always after
+	its reply. Completions a call causes are sent before its reply, so a
+	client sees them as soon as the call returns, like in process.
+
+	The server opens every handle for overlapped IO so no request blocks
+	the connection. The capture ring can not be mapped into another
+	process, mapping it fails with ERROR_NOT_SUPPORTED.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#ifndef EMUSOCKET_H
+#define EMUSOCKET_H
+
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "EmuHost.h"
+
+//
+//Calls of the client, each one an EmuHost.h function or a transport routine
+//
+#define EMU_SOCKET_OPEN				1
+#define EMU_SOCKET_IOCONTROL		2
+#define EMU_SOCKET_CLOSE			3
+#define EMU_SOCKET_ADD_DEVICE		4
+#define EMU_SOCKET_REMOVE_DEVICE	5
+#define EMU_SOCKET_INPUT			6
+#define EMU_SOCKET_ADVANCE			7
+#define EMU_SOCKET_NOW				8
+#define EMU_SOCKET_INSERT_LATENCY	9
+#define EMU_SOCKET_DELIVERED		10
+//
+//Stops the server once the connection closes
+//
+#define EMU_SOCKET_SHUTDOWN			11
+
+//
+//Sent by the server
+//
+#define EMU_SOCKET_REPLY			0x80
+#define EMU_SOCKET_COMPLETE			0x81
+
+//
+//Upper bound of a payload, a larger one ends the connection
+//
+#define EMU_SOCKET_PAYLOAD_MAX		(16 * 1024 * 1024)
+
+typedef struct _EMU_SOCKET_MESSAGE {
+	ULONG Type;
+	//
+	//Chosen by the client, matches the reply and the completion to the call
+	//
+	ULONG Id;
+	ULONG Class;
+	//
+	//Handle the server opened, or a device handle
+	//
+	ULONG Handle;
+	//
+	//IOCTL code, open flags, packet count or insert latency of a call,
+	//the result of ADD_DEVICE, REMOVE_DEVICE, INPUT and DELIVERED in a reply
+	//
+	ULONG Code;
+	//
+	//Win32 error of an IOCTL reply
+	//
+	ULONG Error;
+	//
+	//NTSTATUS the overlapped of an IOCTL holds, STATUS_PENDING if it was not completed
+	//
+	LONG Status;
+	//
+	//Output buffer size of an IOCTL, record capacity of DELIVERED
+	//
+	ULONG OutputSize;
+	//
+	//Microseconds of ADVANCE, the time of a NOW reply
+	//
+	LONG64 Value;
+	ULONG PayloadSize;
+	ULONG Reserved;
+} EMU_SOCKET_MESSAGE, * PEMU_SOCKET_MESSAGE;
+
+FORCEINLINE
+BOOLEAN
+EmuSocketReceive(
+	IN int Socket,
+	OUT PVOID Buffer,
+	IN size_t Size)
+/*++
+
+Routine Description:
+
+	Reads exactly Size bytes.
+
+Return Value:
+
+	FALSE if the connection closed or failed first.
+
+--*/
+{
+	PUCHAR next = (PUCHAR)Buffer;
+
+	while (Size > 0)
+	{
+		ssize_t read = recv(Socket, next, Size, 0);
+
+		if (read < 0 && errno == EINTR)
+			continue;
+		if (read <= 0)
+			return FALSE;
+		next += read;
+		Size -= (size_t)read;
+	}
+	return TRUE;
+}
+
+FORCEINLINE
+BOOLEAN
+EmuSocketSend(
+	IN int Socket,
+	IN const EMU_SOCKET_MESSAGE* Message,
+	IN OPTIONAL const VOID* Payload)
+/*++
+
+Routine Description:
+
+	Writes a message and its payload. The caller serializes the writes
+	to the socket.
+
+Return Value:
+
+	FALSE if the connection closed or failed.
+
+--*/
+{
+	const UCHAR* next = (const UCHAR*)Message;
+	size_t size = sizeof(EMU_SOCKET_MESSAGE);
+
+	for (int part = 0; part < 2; part++)
+	{
+		while (size > 0)
+		{
+			ssize_t written = send(Socket, next, size, MSG_NOSIGNAL);
+
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written <= 0)
+				return FALSE;
+			next += written;
+			size -= (size_t)written;
+		}
+		next = (const UCHAR*)Payload;
+		size = Payload ? Message->PayloadSize : 0;
+	}
+	return TRUE;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+//Serves Host to the clients of a listening socket, one connection at a
+//time, until a client shuts the server down.
+//
+VOID
+EmuSocketServe(
+	IN PEMU_HOST Host,
+	IN int Listener);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EMUSOCKET_H
@@ -0,0 +1,374 @@
+/*++
+
+Module Name:
+
+	EmuSocketServer.c
+
+Abstract:
+
+	Server side of EmuSocket.h: dispatches the calls of a connection to
+	the host and sends back their replies and completions.
+
+	Every pending IOCTL of a connection is sent on with an overlapped of
+	the server whose event is the completion event of the connection. A
+	completion thread waits for it, and the connection thread flushes the
+	completions a call caused before its reply.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "HostClass.h"
+#include "EmuSocket.h"
+
+//
+//Handles a connection may keep open
+//
+#define SOCKET_HANDLES 64
+
+typedef struct _SOCKET_CONNECTION SOCKET_CONNECTION, * PSOCKET_CONNECTION;
+
+//
+//IOCTL pending in the host, linked to its connection once it was replied
+//
+typedef struct _SOCKET_CALL {
+	struct _SOCKET_CALL* Next;
+	ULONG Id;
+	OVERLAPPED Overlapped;
+	ULONG OutputSize;
+	UCHAR Output[];
+} SOCKET_CALL, * PSOCKET_CALL;
+
+struct _SOCKET_CONNECTION {
+	PEMU_HOST Host;
+	int Socket;
+	EMU_TRANSPORT Transports[EMU_HOST_CLASS_COUNT];
+	//
+	//Sessions of the host indexed by handle minus one, and their classes
+	//
+	PVOID Sessions[SOCKET_HANDLES];
+	ULONG SessionClasses[SOCKET_HANDLES];
+	//
+	//Guards Calls and Closing and serializes the writes to the socket
+	//
+	pthread_mutex_t Lock;
+	PSOCKET_CALL Calls;
+	HANDLE Completion;
+	BOOLEAN Closing;
+	BOOLEAN Shutdown;
+};
+
+static VOID SocketFlushCompletions(PSOCKET_CONNECTION Connection)
+/*++
+
+Routine Description:
+
+	Sends the completions of the pending IOCTLs that completed and frees
+	them. Called with the connection lock held.
+
+--*/
+{
+	PSOCKET_CALL* link = &Connection->Calls;
+
+	while (*link)
+	{
+		PSOCKET_CALL call = *link;
+		EMU_SOCKET_MESSAGE completion;
+		DWORD bytes = 0;
+
+		if (!GetOverlappedResult(NULL, &call->Overlapped, &bytes, FALSE) && GetLastError() == ERROR_IO_INCOMPLETE) {
+			link = &call->Next;
+			continue;
+		}
+		memset(&completion, 0, sizeof(completion));
+		completion.Type = EMU_SOCKET_COMPLETE;
+		completion.Id = call->Id;
+		completion.Status = (LONG)call->Overlapped.Internal;
+		completion.PayloadSize = bytes < call->OutputSize ? bytes : call->OutputSize;
+		//a client that went away only misses the completion
+		EmuSocketSend(Connection->Socket, &completion, call->Output);
+		*link = call->Next;
+		free(call);
+	}
+}
+
+static void* SocketCompletionThread(void* Argument)
+/*++
+
+Routine Description:
+
+	Sends the completions of the requests completed by anything but a call
+	of the connection, the inserts delayed by the insert latency.
+
+--*/
+{
+	PSOCKET_CONNECTION connection = (PSOCKET_CONNECTION)Argument;
+
+	for (;;) {
+		WaitForSingleObject(connection->Completion, INFINITE);
+		pthread_mutex_lock(&connection->Lock);
+		if (connection->Closing) {
+			pthread_mutex_unlock(&connection->Lock);
+			break;
+		}
+		//a completion after the reset signals again or is flushed right here
+		ResetEvent(connection->Completion);
+		SocketFlushCompletions(connection);
+		pthread_mutex_unlock(&connection->Lock);
+	}
+	return NULL;
+}
+
+static VOID SocketReply(PSOCKET_CONNECTION Connection, PEMU_SOCKET_MESSAGE Reply, const VOID* Payload)
+{
+	pthread_mutex_lock(&Connection->Lock);
+	SocketFlushCompletions(Connection);
+	EmuSocketSend(Connection->Socket, Reply, Payload);
+	pthread_mutex_unlock(&Connection->Lock);
+}
+
+static VOID SocketIoControl(PSOCKET_CONNECTION Connection, const EMU_SOCKET_MESSAGE* Message, PVOID Input, PEMU_SOCKET_MESSAGE Reply)
+/*++
+
+Routine Description:
+
+	Sends an IOCTL on to the host and replies it. A request the host
+	completed is freed with the reply, a pending one is linked to the
+	connection after it so its completion can only follow the reply.
+
+--*/
+{
+	ULONG index = Message->Handle - 1;
+	PSOCKET_CALL call = NULL;
+	PHOST_CLASS class;
+	PEMU_TRANSPORT transport;
+	ULONG bytes = 0;
+
+	Reply->Status = STATUS_PENDING;
+	if (index >= SOCKET_HANDLES || Connection->Sessions[index] == NULL) {
+		Reply->Error = ERROR_INVALID_HANDLE;
+		SocketReply(Connection, Reply, NULL);
+		return;
+	}
+	transport = &Connection->Transports[Connection->SessionClasses[index]];
+	class = (PHOST_CLASS)transport->Context;
+	//the ring is mapped into the address space of the host
+	if ((Message->Code & ~class->TargetedBit) == class->MapRingCode)
+		Reply->Error = ERROR_NOT_SUPPORTED;
+	else if (Message->OutputSize > EMU_SOCKET_PAYLOAD_MAX ||
+		(call = (PSOCKET_CALL)calloc(1, sizeof(SOCKET_CALL) + Message->OutputSize)) == NULL)
+		Reply->Error = ERROR_NOT_ENOUGH_MEMORY;
+	if (call == NULL) {
+		SocketReply(Connection, Reply, NULL);
+		return;
+	}
+	call->Id = Message->Id;
+	call->OutputSize = Message->OutputSize;
+	call->Overlapped.hEvent = Connection->Completion;
+	Reply->Error = transport->IoControl(transport->Context, Connection->Sessions[index], Message->Code,
+		Input, Message->PayloadSize, call->Output, call->OutputSize, &bytes, &call->Overlapped);
+	if (Reply->Error != EMU_TRANSPORT_PENDING) {
+		//the host completes the overlapped of a request it did not pend, unless it failed before
+		Reply->Status = (LONG)call->Overlapped.Internal;
+		Reply->PayloadSize = bytes < call->OutputSize ? bytes : call->OutputSize;
+		SocketReply(Connection, Reply, call->Output);
+		free(call);
+		return;
+	}
+	pthread_mutex_lock(&Connection->Lock);
+	SocketFlushCompletions(Connection);
+	EmuSocketSend(Connection->Socket, Reply, NULL);
+	call->Next = Connection->Calls;
+	Connection->Calls = call;
+	SocketFlushCompletions(Connection);
+	pthread_mutex_unlock(&Connection->Lock);
+}
+
+static BOOLEAN SocketDispatch(PSOCKET_CONNECTION Connection, const EMU_SOCKET_MESSAGE* Message, PUCHAR Payload)
+/*++
+
+Routine Description:
+
+	Answers a call of the client.
+
+Return Value:
+
+	FALSE if the call is malformed and the connection has to end.
+
+--*/
+{
+	PEMU_HOST host = Connection->Host;
+	EMU_SOCKET_MESSAGE reply;
+	PUCHAR records = NULL;
+	ULONG index = Message->Handle - 1;
+
+	if (Message->Class >= EMU_HOST_CLASS_COUNT)
+		return FALSE;
+	memset(&reply, 0, sizeof(reply));
+	reply.Type = EMU_SOCKET_REPLY;
+	reply.Id = Message->Id;
+	switch (Message->Type) {
+	case EMU_SOCKET_OPEN:
+		reply.Error = ERROR_TOO_MANY_SESS;
+		for (ULONG h = 0; h < SOCKET_HANDLES; h++)
+		{
+			PEMU_TRANSPORT transport = &Connection->Transports[Message->Class];
+
+			if (Connection->Sessions[h] != NULL)
+				continue;
+			//no request may block the connection, the client waits for those sent without overlapped
+			Connection->Sessions[h] = transport->Open(transport->Context, EMU_TRANSPORT_OVERLAPPED);
+			Connection->SessionClasses[h] = Message->Class;
+			reply.Handle = Connection->Sessions[h] ? h + 1 : 0;
+			reply.Error = Connection->Sessions[h] ? ERROR_SUCCESS : ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+		break;
+	case EMU_SOCKET_IOCONTROL:
+		SocketIoControl(Connection, Message, Payload, &reply);
+		return TRUE;
+	case EMU_SOCKET_CLOSE:
+		if (index >= SOCKET_HANDLES || Connection->Sessions[index] == NULL) {
+			reply.Error = ERROR_INVALID_HANDLE;
+			break;
+		}
+		//cancels the requests of the handle, their completions go before the reply
+		Connection->Transports[Connection->SessionClasses[index]].Close(
+			Connection->Transports[Connection->SessionClasses[index]].Context, Connection->Sessions[index]);
+		Connection->Sessions[index] = NULL;
+		break;
+	case EMU_SOCKET_ADD_DEVICE:
+		//the payload always ends with a NUL the client may have left out
+		reply.Code = EmuHostAddDevice(host, Message->Class, (const char*)Payload);
+		break;
+	case EMU_SOCKET_REMOVE_DEVICE:
+		reply.Code = EmuHostRemoveDevice(host, Message->Class, Message->Handle);
+		break;
+	case EMU_SOCKET_INPUT:
+		if (Message->PayloadSize != (ULONG64)Message->Code * host->Classes[Message->Class].InputSize)
+			return FALSE;
+		reply.Code = EmuHostInput(host, Message->Class, Message->Handle, Payload, Message->Code);
+		break;
+	case EMU_SOCKET_ADVANCE:
+		EmuHostAdvance(host, Message->Value);
+		break;
+	case EMU_SOCKET_NOW:
+		reply.Value = EmuHostNow(host);
+		break;
+	case EMU_SOCKET_INSERT_LATENCY:
+		EmuHostSetInsertLatency(host, Message->Code);
+		break;
+	case EMU_SOCKET_DELIVERED:
+		{
+			ULONG capacity = Message->OutputSize < EMU_HOST_DELIVERED_CAPACITY ? Message->OutputSize : EMU_HOST_DELIVERED_CAPACITY;
+
+			records = (PUCHAR)malloc((size_t)capacity * host->Classes[Message->Class].RecordSize + 1);
+			if (records == NULL)
+				return FALSE;
+			reply.Code = EmuHostDelivered(host, Message->Class, records, capacity);
+			reply.PayloadSize = reply.Code * host->Classes[Message->Class].RecordSize;
+		}
+		break;
+	case EMU_SOCKET_SHUTDOWN:
+		Connection->Shutdown = TRUE;
+		break;
+	default:
+		return FALSE;
+	}
+	SocketReply(Connection, &reply, records);
+	free(records);
+	return TRUE;
+}
+
+static BOOLEAN SocketServeConnection(PEMU_HOST Host, int Socket)
+/*++
+
+Routine Description:
+
+	Answers the calls of a client until it closes the connection, then
+	closes the handles it left open like those of an exiting process.
+
+Return Value:
+
+	TRUE if the client shut the server down.
+
+--*/
+{
+	SOCKET_CONNECTION connection;
+	pthread_t completionThread;
+	EMU_SOCKET_MESSAGE message;
+	PUCHAR payload;
+
+	memset(&connection, 0, sizeof(connection));
+	connection.Host = Host;
+	connection.Socket = Socket;
+	for (ULONG c = 0; c < EMU_HOST_CLASS_COUNT; c++)
+		EmuHostTransport(Host, c, &connection.Transports[c]);
+	pthread_mutex_init(&connection.Lock, NULL);
+	connection.Completion = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (connection.Completion == NULL || pthread_create(&completionThread, NULL, SocketCompletionThread, &connection) != 0) {
+		if (connection.Completion)
+			CloseHandle(connection.Completion);
+		pthread_mutex_destroy(&connection.Lock);
+		return FALSE;
+	}
+
+	while (EmuSocketReceive(Socket, &message, sizeof(message)) && message.PayloadSize <= EMU_SOCKET_PAYLOAD_MAX)
+	{
+		BOOLEAN served;
+
+		payload = (PUCHAR)calloc(1, (size_t)message.PayloadSize + 1);
+		if (payload == NULL || !EmuSocketReceive(Socket, payload, message.PayloadSize)) {
+			free(payload);
+			break;
+		}
+		served = SocketDispatch(&connection, &message, payload);
+		free(payload);
+		if (!served)
+			break;
+	}
+
+	for (ULONG h = 0; h < SOCKET_HANDLES; h++)
+	{
+		if (connection.Sessions[h] != NULL)
+			connection.Transports[connection.SessionClasses[h]].Close(
+				connection.Transports[connection.SessionClasses[h]].Context, connection.Sessions[h]);
+	}
+	pthread_mutex_lock(&connection.Lock);
+	SocketFlushCompletions(&connection);
+	connection.Closing = TRUE;
+	SetEvent(connection.Completion);
+	pthread_mutex_unlock(&connection.Lock);
+	pthread_join(completionThread, NULL);
+	CloseHandle(connection.Completion);
+	pthread_mutex_destroy(&connection.Lock);
+	return connection.Shutdown;
+}
+
+VOID
+EmuSocketServe(
+	IN PEMU_HOST Host,
+	IN int Listener)
+{
+	BOOLEAN shutdown = FALSE;
+
+	while (!shutdown)
+	{
+		int client = accept(Listener, NULL, NULL);
+
+		if (client < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		shutdown = SocketServeConnection(Host, client);
+		close(client);
+	}
+}
@@ -0,0 +1,455 @@
+/*++
+
+Module Name:
+
+	HostClass.h
+
+Abstract:
+
+	State the host keeps per device class and the control device
+	routines both classes share: sessions and pending requests, the
+	device table with its parked and saved configurations, device
+	selection and detection, capture requests and the capture ring, and
+	the mock class service.
+
+	KeyboardHost.c and MouseHost.c dispatch the IOCTLs of their class and
+	run the service callback pipeline, like the drivers they stand in for.
+
+	The latency histograms and the trace records are timed with the real
+	monotonic clock, HostPerformanceCounter, in place of the performance
+	counter of the drivers. Only the timers run on the virtual time.
+
+	Everything here is called with the host lock held.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#ifndef HOSTCLASS_H
+#define HOSTCLASS_H
+
+#include <windows.h>
+
+#include "EmuHost.h"
+#include "Autofire.h"
+#include "CaptureRing.h"
+#include "DeviceTable.h"
+#include "EmuHistogram.h"
+#include "EmuStats.h"
+#include "InputState.h"
+#include "RuleEngine.h"
+#include "RuleImage.h"
+#include "SharedRules.h"
+#include "TraceRing.h"
+
+//
+//The host runs every callback on processor 0
+//
+#define HOST_PROCESSORS 1
+
+//
+//Ticks per second of HostPerformanceCounter, the Frequency of the latency
+//histograms and of the trace dumps
+//
+#define HOST_PERFORMANCE_FREQUENCY 1000000000LL
+
+//
+//KEY_CAPTURE_BATCH_MAX and MOUSE_CAPTURE_BATCH_MAX
+//
+#define HOST_CAPTURE_BATCH_MAX 1024
+
+typedef struct _HOST_CLASS HOST_CLASS, * PHOST_CLASS;
+
+//
+//Open handle of the control device, the file object of the driver
+//
+typedef struct _HOST_SESSION {
+	PHOST_CLASS Class;
+	ULONG Flags;
+	//Device the IOCTLs of the handle go to, EMU_DEVICE_HANDLE_NONE for the first one
+	ULONG DeviceHandle;
+} HOST_SESSION, * PHOST_SESSION;
+
+//
+//Request held in a queue until an input, a timer or the handle closing completes it
+//
+typedef struct _HOST_REQUEST {
+	struct _HOST_REQUEST* Next;
+	PHOST_SESSION Session;
+	//NULL while the caller waits in the transport for the request
+	LPOVERLAPPED Overlapped;
+	PVOID Output;
+	ULONG OutputSize;
+	//Time a detect request times out at, 0 for never
+	LONG64 Deadline;
+	BOOLEAN Completed;
+	NTSTATUS Status;
+	ULONG_PTR Information;
+} HOST_REQUEST, * PHOST_REQUEST;
+
+typedef struct _HOST_QUEUE {
+	PHOST_REQUEST Head;
+	PHOST_REQUEST Tail;
+} HOST_QUEUE, * PHOST_QUEUE;
+
+//
+//Part of a simulated device both classes share, first in the device of each class
+//
+typedef struct _HOST_DEVICE {
+	ULONG Handle;
+	ULONG Identity;
+	//Bumped on every change of the rule tables, never 0
+	volatile LONG RuleGeneration;
+	PEMU_STATS Stats;
+	PVOID StatsBlock;
+	//Time the autofire timer fires at, 0 while it is stopped
+	LONG64 AutofireDue;
+	//Histograms indexed by EMU_HIST, and what they held at the last reset
+	EMU_HISTOGRAM Histograms[EMU_HIST_COUNT];
+	EMU_HISTOGRAM LatencyBase[EMU_HIST_COUNT];
+} HOST_DEVICE, * PHOST_DEVICE;
+
+//
+//Rule image saved with SAVE_IMAGE, the RuleImage.%08X registry value of the driver
+//
+typedef struct _HOST_IMAGE {
+	ULONG Handle;
+	ULONG Size;
+	PUCHAR Image;
+} HOST_IMAGE, * PHOST_IMAGE;
+
+typedef struct _HOST_RING_READER {
+	PHOST_SESSION Session;
+	HANDLE Event;
+} HOST_RING_READER, * PHOST_RING_READER;
+
+typedef struct _HOST_CLASS_OPS {
+	//
+	//Dispatches an IOCTL, returns STATUS_PENDING once the request is queued
+	//
+	NTSTATUS(*Dispatch)(PHOST_CLASS Class, PHOST_SESSION Session, ULONG IoControlCode, PVOID Input, ULONG InputSize,
+		PVOID Output, ULONG OutputSize, PULONG_PTR Information, PHOST_REQUEST Request);
+	//
+	//Service callback of a device, Inputs may be modified
+	//
+	VOID(*Input)(PHOST_CLASS Class, PHOST_DEVICE Device, PVOID Inputs, ULONG Count);
+	VOID(*AutofireTimer)(PHOST_CLASS Class, PHOST_DEVICE Device);
+	PHOST_DEVICE(*CreateDevice)(PHOST_CLASS Class);
+	VOID(*DeleteDevice)(PHOST_CLASS Class, PHOST_DEVICE Device);
+	//
+	//Rule image of the profiles of a device, SerializeProfiles of the driver
+	//
+	ULONG(*SerializeProfiles)(PHOST_DEVICE Device, PUCHAR Image, ULONG Capacity);
+	VOID(*ApplyRuleImage)(PHOST_CLASS Class, PHOST_DEVICE Device, const UCHAR* Image);
+} HOST_CLASS_OPS, * PHOST_CLASS_OPS;
+
+struct _HOST_CLASS {
+	PEMU_HOST Host;
+	const HOST_CLASS_OPS* Ops;
+	ULONG InputSize;
+	ULONG RecordSize;
+	ULONG RingCapacity;
+	ULONG InsertCode;
+	ULONG MapRingCode;
+	ULONG TargetedBit;
+
+	//
+	//Devices in the order they were added, FilterDeviceCollection of the driver
+	//
+	EMU_DEVICE_TABLE DeviceTable;
+	PHOST_DEVICE Devices[EMU_DEVICE_TABLE_SIZE];
+	ULONG DeviceCount;
+	HOST_IMAGE Images[EMU_DEVICE_TABLE_SIZE];
+	BOOLEAN CountRuleHits;
+
+	//
+	//Capture
+	//
+	USHORT CaptureSources;
+	USHORT CaptureDelivery;
+	LONG64 CaptureLatency;
+	HOST_QUEUE CaptureQueue;
+	//Holds the request of the open batch, CaptureBatchQueue of the driver
+	HOST_QUEUE CaptureBatchQueue;
+	PHOST_REQUEST CaptureRequest;
+	//Records of the open batch, HOST_CAPTURE_BATCH_MAX of them
+	PUCHAR CaptureRecords;
+	ULONG CaptureCapacity;
+	ULONG CaptureCount;
+	LONG64 CaptureDeadline;
+	PVOID Ring;
+	//Read-only mapping of Ring the readers are given, as the drivers map it
+	PVOID RingView;
+	ULONG RingSize;
+	//WaitMask of the ring, kept apart from it like the wait page of the drivers
+	volatile LONG RingWait;
+	EMU_RING_WRITER CaptureRing;
+	HOST_RING_READER RingReaders[EMU_RING_MAX_READERS];
+
+	//
+	//Detect requests waiting for the next input
+	//
+	HOST_QUEUE DetectQueue;
+
+	//
+	//Trace ring of the one processor, allocated when tracing is first enabled
+	//
+	PEMU_TRACE_RING TraceRing;
+	BOOLEAN TraceEnabled;
+
+	//
+	//Mock class service
+	//
+	PUCHAR Delivered;
+	ULONG DeliveredCount;
+};
+
+struct _EMU_HOST {
+	pthread_mutex_t Lock;
+	//Broadcast whenever a request completes
+	pthread_cond_t Completed;
+	LONG64 Now;
+	//
+	//Physical state of both classes, each sees the other in its conditional rules
+	//
+	EMU_INPUT_STATE KeyboardState;
+	EMU_INPUT_STATE MouseState;
+	HOST_CLASS Classes[EMU_HOST_CLASS_COUNT];
+
+	//
+	//Inserts delayed by the insert latency, completed by the insert thread
+	//
+	ULONG InsertLatency;
+	struct _HOST_INSERT* InsertHead;
+	struct _HOST_INSERT* InsertTail;
+	pthread_cond_t InsertQueued;
+	pthread_t InsertThread;
+	BOOLEAN Stopping;
+};
+
+extern const HOST_CLASS_OPS KeyboardHostOps;
+extern const HOST_CLASS_OPS MouseHostOps;
+
+VOID
+KeyboardHostInitialize(
+	OUT PHOST_CLASS Class);
+
+VOID
+MouseHostInitialize(
+	OUT PHOST_CLASS Class);
+
+//
+//Requests
+//
+VOID
+HostCompleteRequest(
+	IN PHOST_REQUEST Request,
+	IN NTSTATUS Status,
+	IN ULONG_PTR Information);
+
+VOID
+HostQueueRequest(
+	IN PHOST_QUEUE Queue,
+	IN PHOST_REQUEST Request);
+
+PHOST_REQUEST
+HostDequeueRequest(
+	IN PHOST_QUEUE Queue);
+
+//
+//Devices
+//
+PHOST_DEVICE
+HostReferenceDevice(
+	IN PHOST_CLASS Class,
+	IN ULONG DeviceHandle);
+
+USHORT
+HostDeviceIndex(
+	IN PHOST_CLASS Class,
+	IN PHOST_DEVICE Device);
+
+ULONG
+HostBumpRuleGeneration(
+	IN PHOST_DEVICE Device);
+
+VOID
+HostReturnRuleGeneration(
+	OUT PVOID Output,
+	IN ULONG OutputSize,
+	IN ULONG Generation,
+	OUT PULONG_PTR Information);
+
+PEMU_RULE
+HostAllocateSharedRules(
+	IN PHOST_CLASS Class,
+	IN USHORT RuleCount);
+
+VOID
+HostReleaseSharedRules(
+	IN PEMU_RULE Rules);
+
+NTSTATUS
+HostSetDeviceId(
+	IN PHOST_CLASS Class,
+	IN PHOST_SESSION Session,
+	IN PVOID Input,
+	IN ULONG InputSize);
+
+NTSTATUS
+HostGetDeviceId(
+	IN PHOST_CLASS Class,
+	IN PHOST_SESSION Session,
+	OUT PVOID Output,
+	IN ULONG OutputSize,
+	OUT PULONG_PTR Information);
+
+NTSTATUS
+HostGetDevices(
+	IN PHOST_CLASS Class,
+	OUT PVOID Output,
+	IN ULONG OutputSize,
+	OUT PULONG_PTR Information);
+
+NTSTATUS
+HostSetDeviceHandle(
+	IN PHOST_CLASS Class,
+	IN PHOST_SESSION Session,
+	IN PVOID Input,
+	IN ULONG InputSize);
+
+NTSTATUS
+HostDetectDevice(
+	IN PHOST_CLASS Class,
+	IN PVOID Input,
+	IN ULONG InputSize,
+	IN ULONG OutputSize,
+	IN PHOST_REQUEST Request);
+
+NTSTATUS
+HostSaveImage(
+	IN PHOST_CLASS Class,
+	IN PHOST_DEVICE Device);
+
+//
+//Rules, the targets get the table in their edit profile through SwapRules
+//
+typedef PEMU_RULE(*PHOST_SWAP_RULES)(PHOST_DEVICE Device, PEMU_RULE Rules, USHORT RuleCount);
+
+NTSTATUS
+HostBroadcastRules(
+	IN PHOST_CLASS Class,
+	IN PVOID Input,
+	IN ULONG InputSize,
+	IN PHOST_SWAP_RULES SwapRules);
+
+//
+//Capture
+//
+NTSTATUS
+HostSetCapture(
+	IN PHOST_CLASS Class,
+	IN USHORT Sources,
+	IN USHORT Delivery,
+	IN ULONG LatencyMicroseconds);
+
+NTSTATUS
+HostCapture(
+	IN PHOST_CLASS Class,
+	IN ULONG OutputSize,
+	IN PHOST_REQUEST Request);
+
+NTSTATUS
+HostMapCaptureRing(
+	IN PHOST_CLASS Class,
+	IN PHOST_SESSION Session,
+	IN HANDLE Event,
+	OUT PULONG64 Address,
+	OUT PULONG Size,
+	OUT PULONG ReaderIndex,
+	OUT PULONG64 WaitAddress);
+
+VOID
+HostUnmapCaptureRing(
+	IN PHOST_CLASS Class,
+	IN PHOST_SESSION Session);
+
+VOID
+HostCaptureInputs(
+	IN PHOST_CLASS Class,
+	IN ULONG DeviceHandle,
+	IN USHORT Source,
+	IN const VOID* Inputs,
+	IN ULONG Count);
+
+//
+//Latency and trace
+//
+LONG64
+HostPerformanceCounter(
+	VOID);
+
+VOID
+HostTraceWrite(
+	IN PVOID Context,
+	IN USHORT Event,
+	IN USHORT Arg0,
+	IN ULONG Arg1);
+
+VOID
+HostRecordCallback(
+	IN PHOST_CLASS Class,
+	IN PHOST_DEVICE Device,
+	IN ULONG Dropped,
+	IN LONG64 Start);
+
+NTSTATUS
+HostGetLatency(
+	IN PHOST_DEVICE Device,
+	IN BOOLEAN Reset,
+	OUT PVOID Output,
+	OUT PULONG_PTR Information);
+
+NTSTATUS
+HostSetTrace(
+	IN PHOST_CLASS Class,
+	IN BOOLEAN Enable);
+
+NTSTATUS
+HostReadTrace(
+	IN PHOST_CLASS Class,
+	OUT PVOID Output,
+	IN ULONG OutputSize,
+	OUT PULONG_PTR Information);
+
+//
+//Timers and the class service
+//
+LONG64
+HostNow(
+	IN PHOST_CLASS Class);
+
+VOID
+HostStartAutofire(
+	IN PHOST_CLASS Class,
+	IN PHOST_DEVICE Device,
+	IN LONG64 DueIn);
+
+VOID
+HostDeliver(
+	IN PHOST_CLASS Class,
+	IN PHOST_DEVICE Device,
+	IN const VOID* Inputs,
+	IN ULONG Count);
+
+VOID
+HostInsert(
+	IN PHOST_CLASS Class,
+	IN PHOST_DEVICE Device,
+	IN const VOID* Inputs,
+	IN ULONG Count,
+	IN ULONG Stat);
+
+#endif // HOSTCLASS_H
@@ -0,0 +1,936 @@
+/*++
+
+Module Name:
+
+	KeyboardHost.c
+
+Abstract:
+
+	Keyboard class of the host: the IOCTLs of the keyboard control device
+	and the service callback of KbFilter, which runs the stages of
+	KeyPipeline.c and captures in the order keyboardEmu.c does.
+
+	GET_LATENCY, SET_TRACE and READ_TRACE work on the histograms of the
+	device and the trace ring of the class, see HostClass.h.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ntddkbd.h>
+
+#include "HostClass.h"
+#include "KeyPipeline.h"
+
+//the host builds the records of both classes with the same layout
+C_ASSERT(FIELD_OFFSET(KEY_CAPTURE_RECORD, Input) == 16);
+//and HostGetLatency fills the latency of both
+C_ASSERT(FIELD_OFFSET(KEY_LATENCY, Histograms) == sizeof(LONG64));
+
+//
+//FILTER_DEVICE_EXTENSION of the driver
+//
+typedef struct _KEYBOARD_DEVICE {
+	HOST_DEVICE Header;
+	KEY_PIPELINE Pipeline;
+	USHORT EditProfile;
+	KEYBOARD_ATTRIBUTES KeyboardAttributes;
+} KEYBOARD_DEVICE, * PKEYBOARD_DEVICE;
+
+//
+//Service callback
+//
+
+static VOID KeyboardCaptureFiltered(PVOID Context, ULONG DeviceHandle, PKEYBOARD_INPUT_DATA Input)
+{
+	HostCaptureInputs((PHOST_CLASS)Context, DeviceHandle, KEY_CAPTURE_FILTERED, Input, 1);
+}
+
+static VOID KeyboardServiceCallback(PHOST_CLASS Class, PHOST_DEVICE Header, PVOID Packets, ULONG Count)
+/*++
+
+Routine Description:
+
+	KbFilter_ServiceCallback of the driver.
+
+--*/
+{
+	PKEYBOARD_DEVICE device = (PKEYBOARD_DEVICE)Header;
+	PKEY_PIPELINE pipeline = &device->Pipeline;
+	PKEYBOARD_INPUT_DATA inputs = (PKEYBOARD_INPUT_DATA)Packets;
+	KEY_PIPELINE_CONTEXT context = { Header->Stats, 0, NULL, Class, NULL, Class, Header->Handle };
+	LONG64 start = HostPerformanceCounter();
+	LONG activeProfile;
+	ULONG consumed = 0;
+
+	//the physical state is tracked before any filtering, conditions look at what the user holds
+	for (ULONG i = 0; i < Count; i++)
+		EmuTrackKey(&Class->Host->KeyboardState, inputs[i].MakeCode, inputs[i].Flags);
+	if (Count > 0)
+		HostTraceWrite(Class, EMU_TRACE_INPUT, (USHORT)Count, inputs[0].MakeCode | (ULONG)inputs[0].Flags << 16);
+	EmuStatsAdd(Header->Stats, 0, EMU_STAT_SEEN, Count);
+	EmuHistogramRecord(&Header->Histograms[EMU_HIST_BATCH], Count);
+	if (Class->TraceEnabled)
+		context.Trace = HostTraceWrite;
+	if (Class->CaptureSources & KEY_CAPTURE_FILTERED)
+		context.CaptureFiltered = KeyboardCaptureFiltered;
+
+	if (pipeline->ProfileHotkeysSet)
+		KeyPipelineHotkeys(pipeline, inputs, &Count, &consumed);
+	//the index is read once so the whole batch sees the same active profile
+	activeProfile = pipeline->ActiveProfile;
+	KeyPipelineFilter(pipeline, activeProfile, &context, inputs, &Count, &consumed);
+	if (Count > 0)
+		KeyPipelineRules(pipeline, activeProfile, &context, &Class->Host->KeyboardState, &Class->Host->MouseState,
+			inputs, &Count, &consumed);
+
+	if (Count > 0 && pipeline->Autofire.TriggerScanCode != 0) {
+		LONG64 now = HostNow(Class);
+
+		switch (KeyPipelineAutofire(pipeline, now, inputs, &Count, &consumed)) {
+		case AUTOFIRE_TIMER_START:
+			HostStartAutofire(Class, Header, AutofireDueIn(&pipeline->AutofireSchedule, now));
+			break;
+		case AUTOFIRE_TIMER_STOP:
+			Header->AutofireDue = 0;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (Count > 0 && (Class->CaptureSources & KEY_CAPTURE_PASSED))
+		HostCaptureInputs(Class, Header->Handle, KEY_CAPTURE_PASSED, inputs, Count);
+	HostRecordCallback(Class, Header, consumed, start);
+	HostDeliver(Class, Header, inputs, Count);
+}
+
+static VOID KeyboardAutofireTimer(PHOST_CLASS Class, PHOST_DEVICE Header)
+/*++
+
+Routine Description:
+
+	KbFilter_EvtAutofireTimer of the driver.
+
+--*/
+{
+	PKEYBOARD_DEVICE device = (PKEYBOARD_DEVICE)Header;
+	KEYBOARD_INPUT_DATA inputs[2];
+	ULONG inputCount = 0;
+	AUTOFIRE_ACTION action;
+	LONG64 now = HostNow(Class);
+	LONG64 dueIn;
+
+	memset(inputs, 0, sizeof(inputs));
+	while (inputCount < ARRAYSIZE(inputs) &&
+		(action = AutofireStep(&device->Pipeline.AutofireSchedule, now)) != AUTOFIRE_ACTION_NONE)
+	{
+		inputs[inputCount].MakeCode = device->Pipeline.Autofire.OutputScanCode;
+		inputs[inputCount].Flags = device->Pipeline.Autofire.OutputFlags | (action == AUTOFIRE_ACTION_PRESS ? KEY_MAKE : KEY_BREAK);
+		inputCount++;
+	}
+	if (inputCount > 0)
+		HostInsert(Class, Header, inputs, inputCount, EMU_STAT_EXPANDED);
+	dueIn = AutofireDueIn(&device->Pipeline.AutofireSchedule, now);
+	if (dueIn >= 0)
+		HostStartAutofire(Class, Header, dueIn);
+}
+
+//
+//Rule images
+//
+
+static ULONG KeyboardSerializeProfiles(PHOST_DEVICE Header, PUCHAR Image, ULONG Capacity)
+/*++
+
+Routine Description:
+
+	SerializeProfiles of the driver.
+
+--*/
+{
+	PKEYBOARD_DEVICE device = (PKEYBOARD_DEVICE)Header;
+	ULONG size = sizeof(EMU_IMAGE_HEADER);
+	USHORT sectionCount = 0;
+	USHORT activeProfile = (USHORT)device->Pipeline.ActiveProfile;
+	BOOLEAN fits;
+	USHORT filterHeader[2];
+	ULONG filterBytes;
+
+	fits = EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_ACTIVE_PROFILE, 0,
+		&activeProfile, sizeof(activeProfile), NULL, 0);
+	sectionCount++;
+	for (USHORT p = 0; p < KEY_PROFILE_COUNT; p++)
+	{
+		PKEYBOARD_PROFILE profile = &device->Pipeline.Profiles[p];
+
+		if (profile->FilterRequest.FilterMode != FILTER_KEY_NONE) {
+			filterHeader[0] = profile->FilterRequest.FilterMode;
+			filterHeader[1] = profile->FilterRequest.FilterCount;
+			filterBytes = 0;
+			if (profile->FilterRequest.FilterMode == FILTER_KEY_FLAG_AND_SCANCODE && profile->FilterRequest.FilterData != NULL)
+				filterBytes = profile->FilterRequest.FilterCount * sizeof(KEY_FILTER_DATA);
+			fits = fits && EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_FILTER, p,
+				filterHeader, sizeof(filterHeader), profile->FilterRequest.FilterData, filterBytes);
+			sectionCount++;
+		}
+		if (profile->ModifyRequest.ModifyCount > 0) {
+			fits = fits && EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_MODIFY, p,
+				&profile->ModifyRequest.ModifyCount, sizeof(USHORT),
+				profile->ModifyRequest.ModifyData, profile->ModifyRequest.ModifyCount * sizeof(KEY_MODIFY_DATA));
+			sectionCount++;
+		}
+		if (profile->RuleRequest.RuleCount > 0) {
+			fits = fits && EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_RULES, p,
+				&profile->RuleRequest.RuleCount, sizeof(USHORT),
+				profile->RuleRequest.Rules, profile->RuleRequest.RuleCount * sizeof(EMU_RULE));
+			sectionCount++;
+		}
+		if (device->Pipeline.ProfileHotkeys[p].ScanCode != 0) {
+			fits = fits && EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_HOTKEY, p,
+				&device->Pipeline.ProfileHotkeys[p], sizeof(KEY_PROFILE_HOTKEY), NULL, 0);
+			sectionCount++;
+		}
+	}
+	if (!fits)
+		return 0;
+	if (Image != NULL)
+		EmuFinishRuleImage(Image, size, sectionCount);
+	return size;
+}
+
+static VOID KeyboardApplyRuleImage(PHOST_CLASS Class, PHOST_DEVICE Header, const UCHAR* Image)
+/*++
+
+Routine Description:
+
+	ApplyRuleImage of the driver, sections whose payload fails the checks
+	of the matching IOCTL are skipped.
+
+--*/
+{
+	PKEYBOARD_DEVICE device = (PKEYBOARD_DEVICE)Header;
+	EMU_IMAGE_CURSOR cursor;
+	EMU_IMAGE_SECTION section;
+	const UCHAR* payload;
+	PKEYBOARD_PROFILE profile;
+	USHORT count;
+	ULONG bytes;
+	PVOID table;
+
+	EmuOpenRuleImage(&cursor, Image);
+	while (EmuNextImageSection(&cursor, &section, &payload))
+	{
+		if (section.Type == EMU_SECTION_ACTIVE_PROFILE) {
+			if (section.Length >= sizeof(USHORT) && EmuReadUshort(payload) < KEY_PROFILE_COUNT)
+				device->Pipeline.ActiveProfile = EmuReadUshort(payload);
+			continue;
+		}
+		if (section.Profile >= KEY_PROFILE_COUNT)
+			continue;
+		profile = &device->Pipeline.Profiles[section.Profile];
+
+		switch (section.Type) {
+		case EMU_SECTION_FILTER:
+			if (section.Length < sizeof(USHORT) * 2 || profile->FilterRequest.FilterData != NULL)
+				break;
+			count = EmuReadUshort(payload + sizeof(USHORT));
+			if (EmuReadUshort(payload) == FILTER_KEY_FLAG_AND_SCANCODE && count > 0) {
+				bytes = count * sizeof(KEY_FILTER_DATA);
+				if (section.Length < bytes + sizeof(USHORT) * 2)
+					break;
+				table = malloc(bytes);
+				if (table == NULL)
+					return;
+				memcpy(table, payload + sizeof(USHORT) * 2, bytes);
+				profile->FilterRequest.FilterData = (PKEY_FILTER_DATA)table;
+			}
+			profile->FilterRequest.FilterMode = EmuReadUshort(payload);
+			profile->FilterRequest.FilterCount = count;
+			break;
+		case EMU_SECTION_MODIFY:
+			if (section.Length < sizeof(USHORT) || profile->ModifyRequest.ModifyData != NULL)
+				break;
+			count = EmuReadUshort(payload);
+			bytes = count * sizeof(KEY_MODIFY_DATA);
+			if (count == 0 || section.Length < bytes + sizeof(USHORT))
+				break;
+			table = malloc(bytes);
+			if (table == NULL)
+				return;
+			memcpy(table, payload + sizeof(USHORT), bytes);
+			profile->ModifyRequest.ModifyData = (PKEY_MODIFY_DATA)table;
+			profile->ModifyRequest.ModifyCount = count;
+			break;
+		case EMU_SECTION_RULES:
+			if (section.Length < sizeof(USHORT) || profile->RuleRequest.Rules != NULL)
+				break;
+			count = EmuReadUshort(payload);
+			bytes = count * sizeof(EMU_RULE);
+			if (count == 0 || section.Length < bytes + sizeof(USHORT))
+				break;
+			table = HostAllocateSharedRules(Class, count);
+			if (table == NULL)
+				return;
+			memcpy(table, payload + sizeof(USHORT), bytes);
+			if (!EmuValidateRules((PEMU_RULE)table, count, EmuSharedRulesIndex((PEMU_RULE)table))) {
+				HostReleaseSharedRules((PEMU_RULE)table);
+				break;
+			}
+			profile->RuleRequest.Rules = (PEMU_RULE)table;
+			profile->RuleRequest.RuleCount = count;
+			break;
+		case EMU_SECTION_HOTKEY:
+			if (section.Length < sizeof(KEY_PROFILE_HOTKEY))
+				break;
+			memcpy(&device->Pipeline.ProfileHotkeys[section.Profile], payload, sizeof(KEY_PROFILE_HOTKEY));
+			if (device->Pipeline.ProfileHotkeys[section.Profile].ScanCode != 0)
+				device->Pipeline.ProfileHotkeysSet = TRUE;
+			break;
+		}
+	}
+}
+
+//
+//Devices
+//
+
+static PHOST_DEVICE KeyboardCreateDevice(PHOST_CLASS Class)
+{
+	PKEYBOARD_DEVICE device = (PKEYBOARD_DEVICE)calloc(1, sizeof(KEYBOARD_DEVICE));
+
+	UNREFERENCED_PARAMETER(Class);
+	if (device == NULL)
+		return NULL;
+	device->Header.StatsBlock = malloc(EmuStatsSize(HOST_PROCESSORS, 0));
+	if (device->Header.StatsBlock == NULL) {
+		free(device);
+		return NULL;
+	}
+	device->Header.Stats = EmuStatsInitialize(device->Header.StatsBlock, HOST_PROCESSORS, 0);
+	//what i8042prt reports for an enhanced 101 key keyboard
+	device->KeyboardAttributes.KeyboardIdentifier.Type = 4;
+	device->KeyboardAttributes.NumberOfFunctionKeys = 12;
+	device->KeyboardAttributes.NumberOfIndicators = 3;
+	device->KeyboardAttributes.NumberOfKeysTotal = 101;
+	device->KeyboardAttributes.InputDataQueueLength = 100;
+	return &device->Header;
+}
+
+static VOID KeyboardDeleteDevice(PHOST_CLASS Class, PHOST_DEVICE Header)
+{
+	PKEYBOARD_DEVICE device = (PKEYBOARD_DEVICE)Header;
+
+	UNREFERENCED_PARAMETER(Class);
+	for (ULONG p = 0; p < KEY_PROFILE_COUNT; p++)
+	{
+		free(device->Pipeline.Profiles[p].FilterRequest.FilterData);
+		free(device->Pipeline.Profiles[p].ModifyRequest.ModifyData);
+		HostReleaseSharedRules(device->Pipeline.Profiles[p].RuleRequest.Rules);
+	}
+	free(Header->StatsBlock);
+	free(device);
+}
+
+static PEMU_RULE KeyboardSwapRules(PHOST_DEVICE Header, PEMU_RULE Rules, USHORT RuleCount)
+{
+	PKEYBOARD_DEVICE device = (PKEYBOARD_DEVICE)Header;
+	PKEYBOARD_PROFILE profile = &device->Pipeline.Profiles[device->EditProfile];
+	PEMU_RULE oldRules = profile->RuleRequest.Rules;
+
+	profile->RuleRequest.Rules = Rules;
+	profile->RuleRequest.RuleCount = RuleCount;
+	return oldRules;
+}
+
+//
+//IOCTLs
+//
+
+static NTSTATUS KeyboardSetFilter(PKEYBOARD_DEVICE Device, ULONG ExpectedGeneration, PULONG CommittedGeneration,
+	const UCHAR* Input, ULONG InputSize)
+{
+	PKEYBOARD_PROFILE profile;
+	ULONG requiredBytes;
+
+	//checked where it is bumped, a commit racing this one cannot slip in between
+	if (ExpectedGeneration != 0 && (ULONG)Device->Header.RuleGeneration != ExpectedGeneration)
+		return STATUS_REVISION_MISMATCH;
+	*CommittedGeneration = HostBumpRuleGeneration(&Device->Header);
+	profile = &Device->Pipeline.Profiles[Device->EditProfile];
+	//first we should clear previously allocated buffer and reset filters
+	profile->FilterRequest.FilterMode = FILTER_KEY_NONE;
+	profile->FilterRequest.FilterCount = 0;
+	free(profile->FilterRequest.FilterData);
+	profile->FilterRequest.FilterData = NULL;
+	profile->FilterRequest.FilterMode = EmuReadUshort(Input);
+	if (profile->FilterRequest.FilterMode != FILTER_KEY_FLAGS && profile->FilterRequest.FilterMode != FILTER_KEY_FLAG_AND_SCANCODE)
+		return STATUS_SUCCESS;
+	if (InputSize < sizeof(USHORT) * 2)
+		return STATUS_BUFFER_TOO_SMALL;
+	//In FILTER_KEY_FLAGS mode the count is the flag predicate
+	profile->FilterRequest.FilterCount = EmuReadUshort(Input + sizeof(USHORT));
+	if (profile->FilterRequest.FilterMode == FILTER_KEY_FLAGS || profile->FilterRequest.FilterCount == 0)
+		return STATUS_SUCCESS;
+	requiredBytes = profile->FilterRequest.FilterCount * sizeof(KEY_FILTER_DATA);
+	if (InputSize < requiredBytes + sizeof(USHORT) * 2)
+		return STATUS_BUFFER_TOO_SMALL;
+	profile->FilterRequest.FilterData = (PKEY_FILTER_DATA)malloc(requiredBytes);
+	if (profile->FilterRequest.FilterData == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	memcpy(profile->FilterRequest.FilterData, Input + sizeof(USHORT) * 2, requiredBytes);
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS KeyboardSetModify(PKEYBOARD_DEVICE Device, ULONG ExpectedGeneration, PULONG CommittedGeneration,
+	const UCHAR* Input, ULONG InputSize)
+{
+	PKEYBOARD_PROFILE profile;
+	ULONG requiredBytes;
+
+	//checked where it is bumped, a commit racing this one cannot slip in between
+	if (ExpectedGeneration != 0 && (ULONG)Device->Header.RuleGeneration != ExpectedGeneration)
+		return STATUS_REVISION_MISMATCH;
+	*CommittedGeneration = HostBumpRuleGeneration(&Device->Header);
+	profile = &Device->Pipeline.Profiles[Device->EditProfile];
+	profile->ModifyRequest.ModifyCount = 0;
+	free(profile->ModifyRequest.ModifyData);
+	profile->ModifyRequest.ModifyData = NULL;
+	profile->ModifyRequest.ModifyCount = EmuReadUshort(Input);
+	if (profile->ModifyRequest.ModifyCount == 0)
+		return STATUS_SUCCESS;
+	requiredBytes = profile->ModifyRequest.ModifyCount * sizeof(KEY_MODIFY_DATA);
+	if (InputSize < requiredBytes + sizeof(USHORT))
+		return STATUS_BUFFER_TOO_SMALL;
+	profile->ModifyRequest.ModifyData = (PKEY_MODIFY_DATA)malloc(requiredBytes);
+	if (profile->ModifyRequest.ModifyData == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	memcpy(profile->ModifyRequest.ModifyData, Input + sizeof(USHORT), requiredBytes);
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS KeyboardSetTables(PKEYBOARD_DEVICE Device, ULONG ExpectedGeneration, PULONG CommittedGeneration,
+	const UCHAR* Input, ULONG InputSize)
+/*++
+
+Routine Description:
+
+	Replaces the filters and modifies of the edit profile at once, both
+	tables are copied before either is swapped in.
+
+--*/
+{
+	USHORT filterMode = EmuReadUshort(Input);
+	USHORT filterCount = EmuReadUshort(Input + sizeof(USHORT));
+	USHORT modifyCount;
+	ULONG filterBytes;
+	ULONG modifyBytes;
+	PKEYBOARD_PROFILE profile;
+	PKEY_FILTER_DATA newFilterData = NULL;
+	PKEY_MODIFY_DATA newModifyData = NULL;
+
+	filterBytes = filterMode == FILTER_KEY_FLAG_AND_SCANCODE ? filterCount * sizeof(KEY_FILTER_DATA) : 0;
+	if (InputSize < sizeof(USHORT) * 2 + filterBytes + sizeof(USHORT))
+		return STATUS_BUFFER_TOO_SMALL;
+	modifyCount = EmuReadUshort(Input + sizeof(USHORT) * 2 + filterBytes);
+	modifyBytes = modifyCount * sizeof(KEY_MODIFY_DATA);
+	if (InputSize < sizeof(USHORT) * 2 + filterBytes + sizeof(USHORT) + modifyBytes)
+		return STATUS_BUFFER_TOO_SMALL;
+
+	if (filterBytes > 0) {
+		newFilterData = (PKEY_FILTER_DATA)malloc(filterBytes);
+		if (newFilterData == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES;
+		memcpy(newFilterData, Input + sizeof(USHORT) * 2, filterBytes);
+	}
+	if (modifyBytes > 0) {
+		newModifyData = (PKEY_MODIFY_DATA)malloc(modifyBytes);
+		if (newModifyData == NULL) {
+			free(newFilterData);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		memcpy(newModifyData, Input + sizeof(USHORT) * 3 + filterBytes, modifyBytes);
+	}
+
+	//checked where it is bumped, a commit racing this one cannot slip in between
+	if (ExpectedGeneration != 0 && (ULONG)Device->Header.RuleGeneration != ExpectedGeneration) {
+		free(newFilterData);
+		free(newModifyData);
+		return STATUS_REVISION_MISMATCH;
+	}
+	*CommittedGeneration = HostBumpRuleGeneration(&Device->Header);
+	profile = &Device->Pipeline.Profiles[Device->EditProfile];
+	free(profile->FilterRequest.FilterData);
+	free(profile->ModifyRequest.ModifyData);
+	profile->FilterRequest.FilterMode = filterMode;
+	profile->FilterRequest.FilterCount = filterMode == FILTER_KEY_FLAGS || filterMode == FILTER_KEY_FLAG_AND_SCANCODE ? filterCount : 0;
+	profile->FilterRequest.FilterData = newFilterData;
+	profile->ModifyRequest.ModifyCount = modifyCount;
+	profile->ModifyRequest.ModifyData = newModifyData;
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS KeyboardSetRules(PHOST_CLASS Class, PKEYBOARD_DEVICE Device, ULONG ExpectedGeneration, PULONG CommittedGeneration,
+	const UCHAR* Input, ULONG InputSize)
+{
+	USHORT ruleCount = EmuReadUshort(Input);
+	PKEYBOARD_PROFILE profile;
+	PEMU_RULE newRules = NULL;
+	PEMU_RULE oldRules;
+
+	//the new rules are copied and validated before they are swapped in
+	if (ruleCount > 0) {
+		if (InputSize < ruleCount * sizeof(EMU_RULE) + sizeof(USHORT))
+			return STATUS_BUFFER_TOO_SMALL;
+		newRules = HostAllocateSharedRules(Class, ruleCount);
+		if (newRules == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES;
+		memcpy(newRules, Input + sizeof(USHORT), ruleCount * sizeof(EMU_RULE));
+		if (!EmuValidateRules(newRules, ruleCount, EmuSharedRulesIndex(newRules))) {
+			HostReleaseSharedRules(newRules);
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
+	//checked where it is bumped, a commit racing this one cannot slip in between
+	if (ExpectedGeneration != 0 && (ULONG)Device->Header.RuleGeneration != ExpectedGeneration) {
+		HostReleaseSharedRules(newRules);
+		return STATUS_REVISION_MISMATCH;
+	}
+	*CommittedGeneration = HostBumpRuleGeneration(&Device->Header);
+	profile = &Device->Pipeline.Profiles[Device->EditProfile];
+	oldRules = profile->RuleRequest.Rules;
+	profile->RuleRequest.Rules = newRules;
+	profile->RuleRequest.RuleCount = ruleCount;
+	HostReleaseSharedRules(oldRules);
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS KeyboardSetAutofire(PHOST_CLASS Class, PKEYBOARD_DEVICE Device, const KEY_AUTOFIRE_DATA* AutofireData)
+{
+	KEYBOARD_INPUT_DATA releaseInput;
+
+	//a key still held down by the previous configuration must be released
+	if (AutofireDisarm(&Device->Pipeline.AutofireSchedule)) {
+		memset(&releaseInput, 0, sizeof(releaseInput));
+		releaseInput.MakeCode = Device->Pipeline.Autofire.OutputScanCode;
+		releaseInput.Flags = Device->Pipeline.Autofire.OutputFlags | KEY_BREAK;
+		HostInsert(Class, &Device->Header, &releaseInput, 1, EMU_STAT_EXPANDED);
+	}
+	Device->Pipeline.Autofire = *AutofireData;
+	//the schedule runs on the host clock which is in 100ns units
+	AutofireInitialize(&Device->Pipeline.AutofireSchedule,
+		(LONG64)AutofireData->PeriodMicroseconds * 10,
+		(LONG64)AutofireData->PressMicroseconds * 10);
+	Device->Header.AutofireDue = 0;
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS KeyboardGetStats(PKEYBOARD_DEVICE Device, PUCHAR Output, ULONG OutputSize, PULONG_PTR Information)
+{
+	KEY_STATS stats;
+	ULONG64 counters[EMU_STAT_COUNT];
+	PKEYBOARD_PROFILE profile = &Device->Pipeline.Profiles[Device->Pipeline.ActiveProfile];
+	PEMU_STATS ruleStats;
+	ULONG bytes = FIELD_OFFSET(KEY_STATS, RuleHits);
+	ULONG hitCount;
+
+	memset(&stats, 0, sizeof(stats));
+	EmuStatsCollect(Device->Header.Stats, counters);
+	stats.Seen = counters[EMU_STAT_SEEN];
+	stats.Dropped = counters[EMU_STAT_DROPPED];
+	stats.Modified = counters[EMU_STAT_MODIFIED];
+	stats.Injected = counters[EMU_STAT_INJECTED];
+	stats.Expanded = counters[EMU_STAT_EXPANDED];
+	stats.RuleCount = profile->RuleRequest.RuleCount;
+	ruleStats = profile->RuleRequest.Rules ? EmuSharedRulesHits(profile->RuleRequest.Rules) : NULL;
+	if (ruleStats != NULL) {
+		hitCount = (OutputSize - bytes) / sizeof(ULONG64);
+		if (hitCount > ruleStats->RuleCount)
+			hitCount = ruleStats->RuleCount;
+		stats.RuleHitsCounted = TRUE;
+		EmuStatsCollectRuleHits(ruleStats, (PULONG64)(Output + bytes), hitCount);
+		bytes += hitCount * sizeof(ULONG64);
+	}
+	memcpy(Output, &stats, FIELD_OFFSET(KEY_STATS, RuleHits));
+	*Information = bytes;
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS KeyboardDeviceControl(PHOST_CLASS Class, PKEYBOARD_DEVICE Device, ULONG IoControlCode, ULONG ExpectedGeneration,
+	const UCHAR* Input, ULONG InputSize, PUCHAR Output, ULONG OutputSize, PULONG_PTR Information)
+/*++
+
+Routine Description:
+
+	The IOCTLs that act on a keyboard once the request was checked and the
+	keyboard found.
+
+--*/
+{
+	PKEYBOARD_PROFILE profile = &Device->Pipeline.Profiles[Device->EditProfile];
+	KEY_AUTOFIRE_DATA autofire;
+	KEY_LATENCY_REQUEST latencyRequest;
+	KEY_PROFILE_DATA profileData;
+	ULONG committedGeneration;
+	ULONG bytes = 0;
+	USHORT count;
+	NTSTATUS status;
+
+	switch (IoControlCode) {
+	case IOCTL_KEYBOARD_INSERT_KEY:
+		HostInsert(Class, &Device->Header, Input, InputSize / sizeof(KEYBOARD_INPUT_DATA), EMU_STAT_INJECTED);
+		return STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_SET_FILTER:
+		status = KeyboardSetFilter(Device, ExpectedGeneration, &committedGeneration, Input, InputSize);
+		if (NT_SUCCESS(status))
+			HostReturnRuleGeneration(Output, OutputSize, committedGeneration, Information);
+		return status;
+	case IOCTL_KEYBOARD_GET_FILTER:
+		memcpy(Output, &profile->FilterRequest.FilterMode, sizeof(USHORT));
+		bytes = sizeof(USHORT);
+		if (OutputSize - bytes >= sizeof(USHORT)) {
+			memcpy(Output + bytes, &profile->FilterRequest.FilterCount, sizeof(USHORT));
+			bytes += sizeof(USHORT);
+			for (USHORT i = 0; profile->FilterRequest.FilterData != NULL && i < profile->FilterRequest.FilterCount &&
+				OutputSize - bytes >= sizeof(KEY_FILTER_DATA); i++)
+			{
+				memcpy(Output + bytes, &profile->FilterRequest.FilterData[i], sizeof(KEY_FILTER_DATA));
+				bytes += sizeof(KEY_FILTER_DATA);
+			}
+		}
+		break;
+	case IOCTL_KEYBOARD_SET_MODIFY:
+		status = KeyboardSetModify(Device, ExpectedGeneration, &committedGeneration, Input, InputSize);
+		if (NT_SUCCESS(status))
+			HostReturnRuleGeneration(Output, OutputSize, committedGeneration, Information);
+		return status;
+	case IOCTL_KEYBOARD_GET_MODIFY:
+		memcpy(Output, &profile->ModifyRequest.ModifyCount, sizeof(USHORT));
+		bytes = sizeof(USHORT);
+		for (USHORT i = 0; i < profile->ModifyRequest.ModifyCount && OutputSize - bytes >= sizeof(KEY_MODIFY_DATA); i++)
+		{
+			memcpy(Output + bytes, &profile->ModifyRequest.ModifyData[i], sizeof(KEY_MODIFY_DATA));
+			bytes += sizeof(KEY_MODIFY_DATA);
+		}
+		break;
+	case IOCTL_KEYBOARD_GET_ATTRIBUTES:
+		memcpy(Output, &Device->KeyboardAttributes, sizeof(KEYBOARD_ATTRIBUTES));
+		bytes = sizeof(KEYBOARD_ATTRIBUTES);
+		break;
+	case IOCTL_KEYBOARD_SET_AUTOFIRE:
+		memcpy(&autofire, Input, sizeof(autofire));
+		return KeyboardSetAutofire(Class, Device, &autofire);
+	case IOCTL_KEYBOARD_GET_AUTOFIRE:
+		memcpy(Output, &Device->Pipeline.Autofire, sizeof(KEY_AUTOFIRE_DATA));
+		bytes = sizeof(KEY_AUTOFIRE_DATA);
+		break;
+	case IOCTL_KEYBOARD_SET_RULES:
+		status = KeyboardSetRules(Class, Device, ExpectedGeneration, &committedGeneration, Input, InputSize);
+		if (NT_SUCCESS(status))
+			HostReturnRuleGeneration(Output, OutputSize, committedGeneration, Information);
+		return status;
+	case IOCTL_KEYBOARD_GET_RULES:
+		count = profile->RuleRequest.RuleCount;
+		memcpy(Output, &count, sizeof(USHORT));
+		bytes = sizeof(USHORT);
+		for (USHORT r = 0; r < count && OutputSize - bytes >= sizeof(EMU_RULE); r++)
+		{
+			memcpy(Output + bytes, &profile->RuleRequest.Rules[r], sizeof(EMU_RULE));
+			bytes += sizeof(EMU_RULE);
+		}
+		break;
+	case IOCTL_KEYBOARD_GET_STATS:
+		return KeyboardGetStats(Device, Output, OutputSize, Information);
+	case IOCTL_KEYBOARD_GET_LATENCY:
+		//the flags are optional, without them the histograms are only read
+		memset(&latencyRequest, 0, sizeof(latencyRequest));
+		if (InputSize >= sizeof(KEY_LATENCY_REQUEST))
+			memcpy(&latencyRequest, Input, sizeof(latencyRequest));
+		return HostGetLatency(&Device->Header, (latencyRequest.Flags & KEY_LATENCY_RESET) != 0, Output, Information);
+	case IOCTL_KEYBOARD_GET_GENERATION:
+		memcpy(Output, (const void*)&Device->Header.RuleGeneration, sizeof(ULONG));
+		bytes = sizeof(ULONG);
+		break;
+	case IOCTL_KEYBOARD_SET_TABLES:
+		status = KeyboardSetTables(Device, ExpectedGeneration, &committedGeneration, Input, InputSize);
+		if (NT_SUCCESS(status))
+			HostReturnRuleGeneration(Output, OutputSize, committedGeneration, Information);
+		return status;
+	case IOCTL_KEYBOARD_SET_PROFILE:
+		memcpy(&profileData, Input, sizeof(profileData));
+		HostBumpRuleGeneration(&Device->Header);
+		Device->Pipeline.ProfileHotkeysSet = FALSE;
+		for (USHORT p = 0; p < KEY_PROFILE_COUNT; p++)
+		{
+			Device->Pipeline.ProfileHotkeys[p] = profileData.Hotkeys[p];
+			if (profileData.Hotkeys[p].ScanCode != 0)
+				Device->Pipeline.ProfileHotkeysSet = TRUE;
+		}
+		Device->EditProfile = profileData.EditProfile;
+		Device->Pipeline.ActiveProfile = profileData.ActiveProfile;
+		return STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_GET_PROFILE:
+		memset(&profileData, 0, sizeof(profileData));
+		profileData.ActiveProfile = (USHORT)Device->Pipeline.ActiveProfile;
+		profileData.EditProfile = Device->EditProfile;
+		memcpy(profileData.Hotkeys, Device->Pipeline.ProfileHotkeys, sizeof(profileData.Hotkeys));
+		memcpy(Output, &profileData, sizeof(profileData));
+		bytes = sizeof(profileData);
+		break;
+	case IOCTL_KEYBOARD_SWITCH_PROFILE:
+		//the tables of every profile are already in place, the next packet just picks another slot
+		Device->Pipeline.ActiveProfile = EmuReadUshort(Input);
+		return STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_SAVE_IMAGE:
+		return HostSaveImage(Class, &Device->Header);
+	default:
+		return STATUS_NOT_IMPLEMENTED;
+	}
+	*Information = bytes;
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS KeyboardCheckRequest(ULONG IoControlCode, const UCHAR* Input, ULONG InputSize, ULONG OutputSize)
+/*++
+
+Routine Description:
+
+	The size and parameter checks KbFilter_EvtIoDeviceControl makes on a
+	keyboard IOCTL before it looks the keyboard up.
+
+Return Value:
+
+	STATUS_NOT_IMPLEMENTED for an IOCTL the keyboard control device does
+	not know.
+
+--*/
+{
+	KEY_AUTOFIRE_DATA autofire;
+	KEY_PROFILE_DATA profileData;
+
+	switch (IoControlCode) {
+	case IOCTL_KEYBOARD_INSERT_KEY:
+		return InputSize < sizeof(KEYBOARD_INPUT_DATA) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_SET_FILTER:
+	case IOCTL_KEYBOARD_SET_MODIFY:
+	case IOCTL_KEYBOARD_SET_RULES:
+		return InputSize < sizeof(USHORT) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_GET_FILTER:
+	case IOCTL_KEYBOARD_GET_MODIFY:
+	case IOCTL_KEYBOARD_GET_RULES:
+		return OutputSize < sizeof(USHORT) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_GET_ATTRIBUTES:
+		return OutputSize < sizeof(KEYBOARD_ATTRIBUTES) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_SET_AUTOFIRE:
+		if (InputSize < sizeof(KEY_AUTOFIRE_DATA))
+			return STATUS_BUFFER_TOO_SMALL;
+		memcpy(&autofire, Input, sizeof(autofire));
+		if (autofire.TriggerScanCode != 0 &&
+			(autofire.PeriodMicroseconds < KEY_AUTOFIRE_MIN_PERIOD ||
+				autofire.PressMicroseconds == 0 ||
+				autofire.PressMicroseconds >= autofire.PeriodMicroseconds))
+			return STATUS_INVALID_PARAMETER;
+		return STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_GET_AUTOFIRE:
+		return OutputSize < sizeof(KEY_AUTOFIRE_DATA) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_GET_LATENCY:
+		if (InputSize >= sizeof(KEY_LATENCY_REQUEST)) {
+			KEY_LATENCY_REQUEST latencyRequest;
+
+			memcpy(&latencyRequest, Input, sizeof(latencyRequest));
+			if ((latencyRequest.Flags & ~KEY_LATENCY_RESET) != 0)
+				return STATUS_INVALID_PARAMETER;
+		}
+		return OutputSize < sizeof(KEY_LATENCY) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_GET_STATS:
+		return OutputSize < FIELD_OFFSET(KEY_STATS, RuleHits) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_GET_GENERATION:
+		return OutputSize < sizeof(ULONG) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_SET_TABLES:
+		return InputSize < sizeof(USHORT) * 3 ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_SET_PROFILE:
+		if (InputSize < sizeof(KEY_PROFILE_DATA))
+			return STATUS_BUFFER_TOO_SMALL;
+		memcpy(&profileData, Input, sizeof(profileData));
+		if (profileData.ActiveProfile >= KEY_PROFILE_COUNT || profileData.EditProfile >= KEY_PROFILE_COUNT)
+			return STATUS_INVALID_PARAMETER;
+		return STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_GET_PROFILE:
+		return OutputSize < sizeof(KEY_PROFILE_DATA) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_SWITCH_PROFILE:
+		if (InputSize < sizeof(USHORT))
+			return STATUS_BUFFER_TOO_SMALL;
+		return EmuReadUshort(Input) >= KEY_PROFILE_COUNT ? STATUS_INVALID_PARAMETER : STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_SAVE_IMAGE:
+		return STATUS_SUCCESS;
+	default:
+		return STATUS_NOT_IMPLEMENTED;
+	}
+}
+
+static NTSTATUS KeyboardDispatch(PHOST_CLASS Class, PHOST_SESSION Session, ULONG IoControlCode, PVOID Input, ULONG InputSize,
+	PVOID Output, ULONG OutputSize, PULONG_PTR Information, PHOST_REQUEST Request)
+/*++
+
+Routine Description:
+
+	KbFilter_EvtIoDeviceControl of the driver.
+
+--*/
+{
+	const UCHAR* input = (const UCHAR*)Input;
+	ULONG deviceHandle = Session->DeviceHandle;
+	ULONG expectedGeneration = 0;
+	PKEYBOARD_DEVICE device;
+	KEY_DEVICE_HEADER header;
+	KEY_CAPTURE_CONFIG captureConfig;
+	KEY_CAPTURE_RING_REQUEST ringRequest;
+	KEY_CAPTURE_RING_MAPPING ringMapping;
+	KEY_STATS_CONFIG statsConfig;
+	KEY_TRACE_CONFIG traceConfig;
+	NTSTATUS status;
+
+	//
+	// A device IOCTL may name its target keyboard in front of its input
+	// instead of using the one selected on the handle.
+	//
+	if (IoControlCode & IOCTL_KEYBOARD_TARGETED(0)) {
+		IoControlCode &= ~IOCTL_KEYBOARD_TARGETED(0);
+		switch (IoControlCode) {
+		case IOCTL_KEYBOARD_INSERT_KEY:
+		case IOCTL_KEYBOARD_SET_FILTER:
+		case IOCTL_KEYBOARD_GET_FILTER:
+		case IOCTL_KEYBOARD_SET_MODIFY:
+		case IOCTL_KEYBOARD_GET_MODIFY:
+		case IOCTL_KEYBOARD_GET_ATTRIBUTES:
+		case IOCTL_KEYBOARD_SET_AUTOFIRE:
+		case IOCTL_KEYBOARD_GET_AUTOFIRE:
+		case IOCTL_KEYBOARD_SET_RULES:
+		case IOCTL_KEYBOARD_GET_RULES:
+		case IOCTL_KEYBOARD_GET_STATS:
+		case IOCTL_KEYBOARD_GET_LATENCY:
+		case IOCTL_KEYBOARD_GET_GENERATION:
+		case IOCTL_KEYBOARD_SET_TABLES:
+		case IOCTL_KEYBOARD_SET_PROFILE:
+		case IOCTL_KEYBOARD_GET_PROFILE:
+		case IOCTL_KEYBOARD_SWITCH_PROFILE:
+		case IOCTL_KEYBOARD_SAVE_IMAGE:
+			break;
+		default:
+			return STATUS_INVALID_DEVICE_REQUEST;
+		}
+		if (InputSize < sizeof(KEY_DEVICE_HEADER))
+			return STATUS_BUFFER_TOO_SMALL;
+		memcpy(&header, input, sizeof(header));
+		if (header.Generation != 0 && IoControlCode != IOCTL_KEYBOARD_SET_FILTER &&
+			IoControlCode != IOCTL_KEYBOARD_SET_MODIFY && IoControlCode != IOCTL_KEYBOARD_SET_TABLES &&
+			IoControlCode != IOCTL_KEYBOARD_SET_RULES)
+			return STATUS_INVALID_PARAMETER;
+		deviceHandle = header.DeviceHandle;
+		expectedGeneration = header.Generation;
+		input += sizeof(KEY_DEVICE_HEADER);
+		InputSize -= sizeof(KEY_DEVICE_HEADER);
+	}
+
+	switch (IoControlCode) {
+	case IOCTL_KEYBOARD_SET_DEVICE_ID:
+		return HostSetDeviceId(Class, Session, (PVOID)input, InputSize);
+	case IOCTL_KEYBOARD_GET_DEVICE_ID:
+		return HostGetDeviceId(Class, Session, Output, OutputSize, Information);
+	case IOCTL_KEYBOARD_GET_DEVICES:
+		return HostGetDevices(Class, Output, OutputSize, Information);
+	case IOCTL_KEYBOARD_SET_DEVICE_HANDLE:
+		return HostSetDeviceHandle(Class, Session, (PVOID)input, InputSize);
+	case IOCTL_KEYBOARD_DETECT_DEVICE_ID:
+		return HostDetectDevice(Class, (PVOID)input, InputSize, OutputSize, Request);
+	case IOCTL_KEYBOARD_BROADCAST_RULES:
+		return HostBroadcastRules(Class, (PVOID)input, InputSize, KeyboardSwapRules);
+	case IOCTL_KEYBOARD_SET_STATS:
+		if (InputSize < sizeof(KEY_STATS_CONFIG))
+			return STATUS_BUFFER_TOO_SMALL;
+		memcpy(&statsConfig, input, sizeof(statsConfig));
+		if ((statsConfig.Flags & ~KEY_STATS_RULE_HITS) != 0)
+			return STATUS_INVALID_PARAMETER;
+		//installed tables keep what they were allocated with, new ones follow the setting
+		Class->CountRuleHits = (statsConfig.Flags & KEY_STATS_RULE_HITS) != 0;
+		return STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_SET_CAPTURE:
+		if (InputSize < sizeof(KEY_CAPTURE_CONFIG))
+			return STATUS_BUFFER_TOO_SMALL;
+		memcpy(&captureConfig, input, sizeof(captureConfig));
+		return HostSetCapture(Class, captureConfig.Sources, captureConfig.Delivery, captureConfig.LatencyMicroseconds);
+	case IOCTL_KEYBOARD_GET_CAPTURE:
+		if (OutputSize < sizeof(KEY_CAPTURE_CONFIG))
+			return STATUS_BUFFER_TOO_SMALL;
+		memset(&captureConfig, 0, sizeof(captureConfig));
+		captureConfig.Sources = Class->CaptureSources;
+		captureConfig.Delivery = Class->CaptureDelivery;
+		captureConfig.LatencyMicroseconds = (ULONG)(Class->CaptureLatency / 10);
+		memcpy(Output, &captureConfig, sizeof(captureConfig));
+		*Information = sizeof(captureConfig);
+		return STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_CAPTURE:
+		return HostCapture(Class, OutputSize, Request);
+	case IOCTL_KEYBOARD_MAP_CAPTURE_RING:
+		if (InputSize < sizeof(KEY_CAPTURE_RING_REQUEST) || OutputSize < sizeof(KEY_CAPTURE_RING_MAPPING))
+			return STATUS_BUFFER_TOO_SMALL;
+		memcpy(&ringRequest, input, sizeof(ringRequest));
+		memset(&ringMapping, 0, sizeof(ringMapping));
+		status = HostMapCaptureRing(Class, Session, (HANDLE)(ULONG_PTR)ringRequest.EventHandle,
+			&ringMapping.Address, &ringMapping.Size, &ringMapping.ReaderIndex, &ringMapping.WaitAddress);
+		if (NT_SUCCESS(status)) {
+			memcpy(Output, &ringMapping, sizeof(ringMapping));
+			*Information = sizeof(ringMapping);
+		}
+		return status;
+	case IOCTL_KEYBOARD_UNMAP_CAPTURE_RING:
+		HostUnmapCaptureRing(Class, Session);
+		return STATUS_SUCCESS;
+	case IOCTL_KEYBOARD_SET_TRACE:
+		if (InputSize < sizeof(KEY_TRACE_CONFIG))
+			return STATUS_BUFFER_TOO_SMALL;
+		memcpy(&traceConfig, input, sizeof(traceConfig));
+		if ((traceConfig.Flags & ~KEY_TRACE_ENABLE) != 0)
+			return STATUS_INVALID_PARAMETER;
+		return HostSetTrace(Class, (traceConfig.Flags & KEY_TRACE_ENABLE) != 0);
+	case IOCTL_KEYBOARD_READ_TRACE:
+		return HostReadTrace(Class, Output, OutputSize, Information);
+	}
+
+	status = KeyboardCheckRequest(IoControlCode, input, InputSize, OutputSize);
+	if (!NT_SUCCESS(status))
+		return status;
+	device = (PKEYBOARD_DEVICE)HostReferenceDevice(Class, deviceHandle);
+	if (device == NULL)
+		return STATUS_NO_SUCH_DEVICE;
+	return KeyboardDeviceControl(Class, device, IoControlCode, expectedGeneration, input, InputSize, (PUCHAR)Output, OutputSize, Information);
+}
+
+const HOST_CLASS_OPS KeyboardHostOps = {
+	KeyboardDispatch,
+	KeyboardServiceCallback,
+	KeyboardAutofireTimer,
+	KeyboardCreateDevice,
+	KeyboardDeleteDevice,
+	KeyboardSerializeProfiles,
+	KeyboardApplyRuleImage,
+};
+
+VOID
+KeyboardHostInitialize(
+	OUT PHOST_CLASS Class)
+{
+	Class->Ops = &KeyboardHostOps;
+	Class->InputSize = sizeof(KEYBOARD_INPUT_DATA);
+	Class->RecordSize = sizeof(KEY_CAPTURE_RECORD);
+	Class->RingCapacity = KEY_CAPTURE_RING_CAPACITY;
+	Class->InsertCode = IOCTL_KEYBOARD_INSERT_KEY;
+	Class->MapRingCode = IOCTL_KEYBOARD_MAP_CAPTURE_RING;
+	Class->TargetedBit = IOCTL_KEYBOARD_TARGETED(0);
+}
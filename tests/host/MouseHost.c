@@ -0,0 +1,847 @@
+/*++
+
+Module Name:
+
+	MouseHost.c
+
+Abstract:
+
+	Mouse class of the host: the IOCTLs of the mouse control device and
+	the service callback of MouFilter, which runs the stages of
+	MousePipeline.c and captures in the order mouseEmu.c does.
+
+	GET_LATENCY, SET_TRACE and READ_TRACE work on the histograms of the
+	device and the trace ring of the class, see HostClass.h.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ntddmou.h>
+
+#include "HostClass.h"
+#include "MousePipeline.h"
+
+//the host builds the records of both classes with the same layout
+C_ASSERT(FIELD_OFFSET(MOUSE_CAPTURE_RECORD, Input) == 16);
+//and HostGetLatency fills the latency of both
+C_ASSERT(FIELD_OFFSET(MOUSE_LATENCY, Histograms) == sizeof(LONG64));
+
+//
+//Exactly one button down flag, what hotkeys and autofire buttons must be
+//
+#define MOUSE_SINGLE_BUTTON(_b_) (((_b_) & MOUSE_BUTTON_DOWN_MASK) == (_b_) && ((_b_) & ((_b_) - 1)) == 0)
+
+//
+//FILTER_DEVICE_EXTENSION of the driver
+//
+typedef struct _MOUSE_DEVICE {
+	HOST_DEVICE Header;
+	MOUSE_PIPELINE Pipeline;
+	USHORT EditProfile;
+	MOUSE_ABSOLUTE_MAP AbsoluteMap;
+	MOUSE_ATTRIBUTES MouseAttributes;
+} MOUSE_DEVICE, * PMOUSE_DEVICE;
+
+//
+//Service callback
+//
+
+static VOID MouseCaptureFiltered(PVOID Context, ULONG DeviceHandle, PMOUSE_INPUT_DATA Input)
+{
+	HostCaptureInputs((PHOST_CLASS)Context, DeviceHandle, MOUSE_CAPTURE_FILTERED, Input, 1);
+}
+
+static VOID MouseServiceCallback(PHOST_CLASS Class, PHOST_DEVICE Header, PVOID Packets, ULONG Count)
+/*++
+
+Routine Description:
+
+	MouFilter_ServiceCallback of the driver.
+
+--*/
+{
+	PMOUSE_DEVICE device = (PMOUSE_DEVICE)Header;
+	PMOUSE_PIPELINE pipeline = &device->Pipeline;
+	PMOUSE_INPUT_DATA inputs = (PMOUSE_INPUT_DATA)Packets;
+	MOUSE_PIPELINE_CONTEXT context = { Header->Stats, 0, NULL, Class, NULL, Class, Header->Handle };
+	LONG64 start = HostPerformanceCounter();
+	LONG activeProfile;
+	ULONG consumed = 0;
+
+	//the physical state is tracked before any filtering, conditions look at what the user holds
+	for (ULONG i = 0; i < Count; i++)
+		EmuTrackButtons(&Class->Host->MouseState, inputs[i].ButtonFlags);
+	if (Count > 0)
+		HostTraceWrite(Class, EMU_TRACE_INPUT, (USHORT)Count, inputs[0].ButtonFlags | (ULONG)inputs[0].Flags << 16);
+	EmuStatsAdd(Header->Stats, 0, EMU_STAT_SEEN, Count);
+	EmuHistogramRecord(&Header->Histograms[EMU_HIST_BATCH], Count);
+	if (Class->TraceEnabled)
+		context.Trace = HostTraceWrite;
+	if (Class->CaptureSources & MOUSE_CAPTURE_FILTERED)
+		context.CaptureFiltered = MouseCaptureFiltered;
+
+	if (pipeline->ProfileHotkeyMask != 0)
+		MousePipelineHotkeys(pipeline, inputs, Count);
+	//the index is read once so the whole batch sees the same active profile
+	activeProfile = pipeline->ActiveProfile;
+	MousePipelineFilter(pipeline, activeProfile, &context, inputs, &Count, &consumed);
+	if (Count == 0) {
+		//all inputs were filtered
+		HostRecordCallback(Class, Header, consumed, start);
+		return;
+	}
+
+	MousePipelineRules(pipeline, activeProfile, &context, &Class->Host->KeyboardState, &Class->Host->MouseState,
+		inputs, Count);
+	if (pipeline->AbsoluteTransform.Enabled)
+		MousePipelineRemapAbsolute(pipeline, inputs, Count);
+
+	if (pipeline->Autofire.TriggerButton != 0) {
+		LONG64 now = HostNow(Class);
+
+		switch (MousePipelineAutofire(pipeline, now, inputs, Count)) {
+		case AUTOFIRE_TIMER_START:
+			HostStartAutofire(Class, Header, AutofireDueIn(&pipeline->AutofireSchedule, now));
+			break;
+		case AUTOFIRE_TIMER_STOP:
+			Header->AutofireDue = 0;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (Class->CaptureSources & MOUSE_CAPTURE_PASSED)
+		HostCaptureInputs(Class, Header->Handle, MOUSE_CAPTURE_PASSED, inputs, Count);
+	HostRecordCallback(Class, Header, consumed, start);
+	HostDeliver(Class, Header, inputs, Count);
+}
+
+static VOID MouseAutofireTimer(PHOST_CLASS Class, PHOST_DEVICE Header)
+/*++
+
+Routine Description:
+
+	MouFilter_EvtAutofireTimer of the driver.
+
+--*/
+{
+	PMOUSE_DEVICE device = (PMOUSE_DEVICE)Header;
+	MOUSE_INPUT_DATA inputs[2];
+	ULONG inputCount = 0;
+	AUTOFIRE_ACTION action;
+	LONG64 now = HostNow(Class);
+	LONG64 dueIn;
+
+	memset(inputs, 0, sizeof(inputs));
+	while (inputCount < ARRAYSIZE(inputs) &&
+		(action = AutofireStep(&device->Pipeline.AutofireSchedule, now)) != AUTOFIRE_ACTION_NONE)
+	{
+		inputs[inputCount].Flags = MOUSE_MOVE_RELATIVE;
+		inputs[inputCount].ButtonFlags = action == AUTOFIRE_ACTION_PRESS ?
+			device->Pipeline.Autofire.OutputButton : (USHORT)(device->Pipeline.Autofire.OutputButton << 1);
+		inputCount++;
+	}
+	if (inputCount > 0)
+		HostInsert(Class, Header, inputs, inputCount, EMU_STAT_EXPANDED);
+	dueIn = AutofireDueIn(&device->Pipeline.AutofireSchedule, now);
+	if (dueIn >= 0)
+		HostStartAutofire(Class, Header, dueIn);
+}
+
+//
+//Rule images
+//
+
+static ULONG MouseSerializeProfiles(PHOST_DEVICE Header, PUCHAR Image, ULONG Capacity)
+/*++
+
+Routine Description:
+
+	SerializeProfiles of the driver.
+
+--*/
+{
+	PMOUSE_DEVICE device = (PMOUSE_DEVICE)Header;
+	ULONG size = sizeof(EMU_IMAGE_HEADER);
+	USHORT sectionCount = 0;
+	USHORT activeProfile = (USHORT)device->Pipeline.ActiveProfile;
+	BOOLEAN fits;
+
+	fits = EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_ACTIVE_PROFILE, 0,
+		&activeProfile, sizeof(activeProfile), NULL, 0);
+	sectionCount++;
+	for (USHORT p = 0; p < MOUSE_PROFILE_COUNT; p++)
+	{
+		PMOUSE_PROFILE profile = &device->Pipeline.Profiles[p];
+
+		if (profile->FilterMode != FILTER_MOUSE_NONE) {
+			fits = fits && EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_FILTER, p,
+				&profile->FilterMode, sizeof(profile->FilterMode), NULL, 0);
+			sectionCount++;
+		}
+		if (profile->ModifyRequest.ModifyCount > 0) {
+			fits = fits && EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_MODIFY, p,
+				&profile->ModifyRequest.ModifyCount, sizeof(USHORT),
+				profile->ModifyRequest.ModifyData, profile->ModifyRequest.ModifyCount * sizeof(MOUSE_MODIFY_DATA));
+			sectionCount++;
+		}
+		if (profile->RuleRequest.RuleCount > 0) {
+			fits = fits && EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_RULES, p,
+				&profile->RuleRequest.RuleCount, sizeof(USHORT),
+				profile->RuleRequest.Rules, profile->RuleRequest.RuleCount * sizeof(EMU_RULE));
+			sectionCount++;
+		}
+		if (device->Pipeline.ProfileHotkeys[p] != 0) {
+			fits = fits && EmuAppendImageSection(Image, Capacity, &size, EMU_SECTION_HOTKEY, p,
+				&device->Pipeline.ProfileHotkeys[p], sizeof(USHORT), NULL, 0);
+			sectionCount++;
+		}
+	}
+	if (!fits)
+		return 0;
+	if (Image != NULL)
+		EmuFinishRuleImage(Image, size, sectionCount);
+	return size;
+}
+
+static VOID MouseApplyRuleImage(PHOST_CLASS Class, PHOST_DEVICE Header, const UCHAR* Image)
+/*++
+
+Routine Description:
+
+	ApplyRuleImage of the driver, sections whose payload fails the checks
+	of the matching IOCTL are skipped.
+
+--*/
+{
+	PMOUSE_DEVICE device = (PMOUSE_DEVICE)Header;
+	EMU_IMAGE_CURSOR cursor;
+	EMU_IMAGE_SECTION section;
+	const UCHAR* payload;
+	PMOUSE_PROFILE profile;
+	USHORT count;
+	ULONG bytes;
+	PVOID table;
+
+	EmuOpenRuleImage(&cursor, Image);
+	while (EmuNextImageSection(&cursor, &section, &payload))
+	{
+		if (section.Type == EMU_SECTION_ACTIVE_PROFILE) {
+			if (section.Length >= sizeof(USHORT) && EmuReadUshort(payload) < MOUSE_PROFILE_COUNT)
+				device->Pipeline.ActiveProfile = EmuReadUshort(payload);
+			continue;
+		}
+		if (section.Profile >= MOUSE_PROFILE_COUNT)
+			continue;
+		profile = &device->Pipeline.Profiles[section.Profile];
+
+		switch (section.Type) {
+		case EMU_SECTION_FILTER:
+			if (section.Length < sizeof(USHORT))
+				break;
+			profile->FilterMode = EmuReadUshort(payload);
+			break;
+		case EMU_SECTION_MODIFY:
+			if (section.Length < sizeof(USHORT) || profile->ModifyRequest.ModifyData != NULL)
+				break;
+			count = EmuReadUshort(payload);
+			bytes = count * sizeof(MOUSE_MODIFY_DATA);
+			if (count == 0 || section.Length < bytes + sizeof(USHORT))
+				break;
+			table = malloc(bytes);
+			if (table == NULL)
+				return;
+			memcpy(table, payload + sizeof(USHORT), bytes);
+			profile->ModifyRequest.ModifyData = (PMOUSE_MODIFY_DATA)table;
+			profile->ModifyRequest.ModifyCount = count;
+			break;
+		case EMU_SECTION_RULES:
+			if (section.Length < sizeof(USHORT) || profile->RuleRequest.Rules != NULL)
+				break;
+			count = EmuReadUshort(payload);
+			bytes = count * sizeof(EMU_RULE);
+			if (count == 0 || section.Length < bytes + sizeof(USHORT))
+				break;
+			table = HostAllocateSharedRules(Class, count);
+			if (table == NULL)
+				return;
+			memcpy(table, payload + sizeof(USHORT), bytes);
+			if (!EmuValidateRules((PEMU_RULE)table, count, EmuSharedRulesIndex((PEMU_RULE)table))) {
+				HostReleaseSharedRules((PEMU_RULE)table);
+				break;
+			}
+			profile->RuleRequest.Rules = (PEMU_RULE)table;
+			profile->RuleRequest.RuleCount = count;
+			break;
+		case EMU_SECTION_HOTKEY:
+			if (section.Length < sizeof(USHORT))
+				break;
+			count = EmuReadUshort(payload);
+			if (!MOUSE_SINGLE_BUTTON(count))
+				break;
+			device->Pipeline.ProfileHotkeys[section.Profile] = count;
+			device->Pipeline.ProfileHotkeyMask |= count;
+			break;
+		}
+	}
+}
+
+//
+//Devices
+//
+
+static PHOST_DEVICE MouseCreateDevice(PHOST_CLASS Class)
+{
+	PMOUSE_DEVICE device = (PMOUSE_DEVICE)calloc(1, sizeof(MOUSE_DEVICE));
+
+	UNREFERENCED_PARAMETER(Class);
+	if (device == NULL)
+		return NULL;
+	device->Header.StatsBlock = malloc(EmuStatsSize(HOST_PROCESSORS, 0));
+	if (device->Header.StatsBlock == NULL) {
+		free(device);
+		return NULL;
+	}
+	device->Header.Stats = EmuStatsInitialize(device->Header.StatsBlock, HOST_PROCESSORS, 0);
+	//what mouhid reports for a five button wheel mouse
+	device->MouseAttributes.MouseIdentifier = 0x0002;
+	device->MouseAttributes.NumberOfButtons = 5;
+	device->MouseAttributes.InputDataQueueLength = 100;
+	return &device->Header;
+}
+
+static VOID MouseDeleteDevice(PHOST_CLASS Class, PHOST_DEVICE Header)
+{
+	PMOUSE_DEVICE device = (PMOUSE_DEVICE)Header;
+
+	UNREFERENCED_PARAMETER(Class);
+	for (ULONG p = 0; p < MOUSE_PROFILE_COUNT; p++)
+	{
+		free(device->Pipeline.Profiles[p].ModifyRequest.ModifyData);
+		HostReleaseSharedRules(device->Pipeline.Profiles[p].RuleRequest.Rules);
+	}
+	free(Header->StatsBlock);
+	free(device);
+}
+
+static PEMU_RULE MouseSwapRules(PHOST_DEVICE Header, PEMU_RULE Rules, USHORT RuleCount)
+{
+	PMOUSE_DEVICE device = (PMOUSE_DEVICE)Header;
+	PMOUSE_PROFILE profile = &device->Pipeline.Profiles[device->EditProfile];
+	PEMU_RULE oldRules = profile->RuleRequest.Rules;
+
+	profile->RuleRequest.Rules = Rules;
+	profile->RuleRequest.RuleCount = RuleCount;
+	return oldRules;
+}
+
+//
+//IOCTLs
+//
+
+static NTSTATUS MouseSetModify(PMOUSE_DEVICE Device, ULONG ExpectedGeneration, PULONG CommittedGeneration,
+	const UCHAR* Input, ULONG InputSize)
+{
+	PMOUSE_PROFILE profile;
+	ULONG requiredBytes;
+
+	//checked where it is bumped, a commit racing this one cannot slip in between
+	if (ExpectedGeneration != 0 && (ULONG)Device->Header.RuleGeneration != ExpectedGeneration)
+		return STATUS_REVISION_MISMATCH;
+	*CommittedGeneration = HostBumpRuleGeneration(&Device->Header);
+	profile = &Device->Pipeline.Profiles[Device->EditProfile];
+	profile->ModifyRequest.ModifyCount = 0;
+	free(profile->ModifyRequest.ModifyData);
+	profile->ModifyRequest.ModifyData = NULL;
+	profile->ModifyRequest.ModifyCount = EmuReadUshort(Input);
+	if (profile->ModifyRequest.ModifyCount == 0)
+		return STATUS_SUCCESS;
+	requiredBytes = profile->ModifyRequest.ModifyCount * sizeof(MOUSE_MODIFY_DATA);
+	if (InputSize < requiredBytes + sizeof(USHORT))
+		return STATUS_BUFFER_TOO_SMALL;
+	profile->ModifyRequest.ModifyData = (PMOUSE_MODIFY_DATA)malloc(requiredBytes);
+	if (profile->ModifyRequest.ModifyData == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	memcpy(profile->ModifyRequest.ModifyData, Input + sizeof(USHORT), requiredBytes);
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS MouseSetRules(PHOST_CLASS Class, PMOUSE_DEVICE Device, ULONG ExpectedGeneration, PULONG CommittedGeneration,
+	const UCHAR* Input, ULONG InputSize)
+{
+	USHORT ruleCount = EmuReadUshort(Input);
+	PMOUSE_PROFILE profile;
+	PEMU_RULE newRules = NULL;
+	PEMU_RULE oldRules;
+
+	//the new rules are copied and validated before they are swapped in
+	if (ruleCount > 0) {
+		if (InputSize < ruleCount * sizeof(EMU_RULE) + sizeof(USHORT))
+			return STATUS_BUFFER_TOO_SMALL;
+		newRules = HostAllocateSharedRules(Class, ruleCount);
+		if (newRules == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES;
+		memcpy(newRules, Input + sizeof(USHORT), ruleCount * sizeof(EMU_RULE));
+		if (!EmuValidateRules(newRules, ruleCount, EmuSharedRulesIndex(newRules))) {
+			HostReleaseSharedRules(newRules);
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
+	//checked where it is bumped, a commit racing this one cannot slip in between
+	if (ExpectedGeneration != 0 && (ULONG)Device->Header.RuleGeneration != ExpectedGeneration) {
+		HostReleaseSharedRules(newRules);
+		return STATUS_REVISION_MISMATCH;
+	}
+	*CommittedGeneration = HostBumpRuleGeneration(&Device->Header);
+	profile = &Device->Pipeline.Profiles[Device->EditProfile];
+	oldRules = profile->RuleRequest.Rules;
+	profile->RuleRequest.Rules = newRules;
+	profile->RuleRequest.RuleCount = ruleCount;
+	HostReleaseSharedRules(oldRules);
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS MouseSetAutofire(PHOST_CLASS Class, PMOUSE_DEVICE Device, const MOUSE_AUTOFIRE_DATA* AutofireData)
+{
+	MOUSE_INPUT_DATA releaseInput;
+
+	//a button still held down by the previous configuration must be released
+	if (AutofireDisarm(&Device->Pipeline.AutofireSchedule)) {
+		memset(&releaseInput, 0, sizeof(releaseInput));
+		releaseInput.ButtonFlags = (USHORT)(Device->Pipeline.Autofire.OutputButton << 1);
+		HostInsert(Class, &Device->Header, &releaseInput, 1, EMU_STAT_EXPANDED);
+	}
+	Device->Pipeline.Autofire = *AutofireData;
+	//the schedule runs on the host clock which is in 100ns units
+	AutofireInitialize(&Device->Pipeline.AutofireSchedule,
+		(LONG64)AutofireData->PeriodMicroseconds * 10,
+		(LONG64)AutofireData->PressMicroseconds * 10);
+	Device->Header.AutofireDue = 0;
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS MouseGetStats(PMOUSE_DEVICE Device, PUCHAR Output, ULONG OutputSize, PULONG_PTR Information)
+{
+	MOUSE_STATS stats;
+	ULONG64 counters[EMU_STAT_COUNT];
+	PMOUSE_PROFILE profile = &Device->Pipeline.Profiles[Device->Pipeline.ActiveProfile];
+	PEMU_STATS ruleStats;
+	ULONG bytes = FIELD_OFFSET(MOUSE_STATS, RuleHits);
+	ULONG hitCount;
+
+	memset(&stats, 0, sizeof(stats));
+	EmuStatsCollect(Device->Header.Stats, counters);
+	stats.Seen = counters[EMU_STAT_SEEN];
+	stats.Dropped = counters[EMU_STAT_DROPPED];
+	stats.Modified = counters[EMU_STAT_MODIFIED];
+	stats.Injected = counters[EMU_STAT_INJECTED];
+	stats.Expanded = counters[EMU_STAT_EXPANDED];
+	stats.RuleCount = profile->RuleRequest.RuleCount;
+	ruleStats = profile->RuleRequest.Rules ? EmuSharedRulesHits(profile->RuleRequest.Rules) : NULL;
+	if (ruleStats != NULL) {
+		hitCount = (OutputSize - bytes) / sizeof(ULONG64);
+		if (hitCount > ruleStats->RuleCount)
+			hitCount = ruleStats->RuleCount;
+		stats.RuleHitsCounted = TRUE;
+		EmuStatsCollectRuleHits(ruleStats, (PULONG64)(Output + bytes), hitCount);
+		bytes += hitCount * sizeof(ULONG64);
+	}
+	memcpy(Output, &stats, FIELD_OFFSET(MOUSE_STATS, RuleHits));
+	*Information = bytes;
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS MouseDeviceControl(PHOST_CLASS Class, PMOUSE_DEVICE Device, ULONG IoControlCode, ULONG ExpectedGeneration,
+	const UCHAR* Input, ULONG InputSize, PUCHAR Output, ULONG OutputSize, PULONG_PTR Information)
+/*++
+
+Routine Description:
+
+	The IOCTLs that act on a mouse once the request was checked and the
+	mouse found.
+
+--*/
+{
+	PMOUSE_PROFILE profile = &Device->Pipeline.Profiles[Device->EditProfile];
+	MOUSE_ABSOLUTE_MAP absoluteMap;
+	MOUSE_AUTOFIRE_DATA autofire;
+	MOUSE_LATENCY_REQUEST latencyRequest;
+	MOUSE_PROFILE_DATA profileData;
+	ULONG committedGeneration;
+	ULONG bytes = 0;
+	USHORT count;
+	NTSTATUS status;
+
+	switch (IoControlCode) {
+	case IOCTL_MOUSE_INSERT_KEY:
+		HostInsert(Class, &Device->Header, Input, InputSize / sizeof(MOUSE_INPUT_DATA), EMU_STAT_INJECTED);
+		return STATUS_SUCCESS;
+	case IOCTL_MOUSE_SET_FILTER:
+		//checked where it is bumped, a commit racing this one cannot slip in between
+		if (ExpectedGeneration != 0 && (ULONG)Device->Header.RuleGeneration != ExpectedGeneration)
+			return STATUS_REVISION_MISMATCH;
+		committedGeneration = HostBumpRuleGeneration(&Device->Header);
+		Device->Pipeline.Profiles[Device->EditProfile].FilterMode = EmuReadUshort(Input);
+		HostReturnRuleGeneration(Output, OutputSize, committedGeneration, Information);
+		return STATUS_SUCCESS;
+	case IOCTL_MOUSE_GET_FILTER:
+		memcpy(Output, &profile->FilterMode, sizeof(USHORT));
+		bytes = sizeof(USHORT);
+		break;
+	case IOCTL_MOUSE_SET_MODIFY:
+		status = MouseSetModify(Device, ExpectedGeneration, &committedGeneration, Input, InputSize);
+		if (NT_SUCCESS(status))
+			HostReturnRuleGeneration(Output, OutputSize, committedGeneration, Information);
+		return status;
+	case IOCTL_MOUSE_GET_MODIFY:
+		memcpy(Output, &profile->ModifyRequest.ModifyCount, sizeof(USHORT));
+		bytes = sizeof(USHORT);
+		for (USHORT i = 0; i < profile->ModifyRequest.ModifyCount && OutputSize - bytes >= sizeof(MOUSE_MODIFY_DATA); i++)
+		{
+			memcpy(Output + bytes, &profile->ModifyRequest.ModifyData[i], sizeof(MOUSE_MODIFY_DATA));
+			bytes += sizeof(MOUSE_MODIFY_DATA);
+		}
+		break;
+	case IOCTL_MOUSE_GET_ATTRIBUTES:
+		memcpy(Output, &Device->MouseAttributes, sizeof(MOUSE_ATTRIBUTES));
+		bytes = sizeof(MOUSE_ATTRIBUTES);
+		break;
+	case IOCTL_MOUSE_SET_ABSOLUTE_MAP:
+		memcpy(&absoluteMap, Input, sizeof(absoluteMap));
+		Device->AbsoluteMap = absoluteMap;
+		MousePipelineCompileAbsoluteMap(&absoluteMap, &Device->Pipeline.AbsoluteTransform);
+		return STATUS_SUCCESS;
+	case IOCTL_MOUSE_GET_ABSOLUTE_MAP:
+		memcpy(Output, &Device->AbsoluteMap, sizeof(MOUSE_ABSOLUTE_MAP));
+		bytes = sizeof(MOUSE_ABSOLUTE_MAP);
+		break;
+	case IOCTL_MOUSE_SET_AUTOFIRE:
+		memcpy(&autofire, Input, sizeof(autofire));
+		return MouseSetAutofire(Class, Device, &autofire);
+	case IOCTL_MOUSE_GET_AUTOFIRE:
+		memcpy(Output, &Device->Pipeline.Autofire, sizeof(MOUSE_AUTOFIRE_DATA));
+		bytes = sizeof(MOUSE_AUTOFIRE_DATA);
+		break;
+	case IOCTL_MOUSE_SET_RULES:
+		status = MouseSetRules(Class, Device, ExpectedGeneration, &committedGeneration, Input, InputSize);
+		if (NT_SUCCESS(status))
+			HostReturnRuleGeneration(Output, OutputSize, committedGeneration, Information);
+		return status;
+	case IOCTL_MOUSE_GET_RULES:
+		count = profile->RuleRequest.RuleCount;
+		memcpy(Output, &count, sizeof(USHORT));
+		bytes = sizeof(USHORT);
+		for (USHORT r = 0; r < count && OutputSize - bytes >= sizeof(EMU_RULE); r++)
+		{
+			memcpy(Output + bytes, &profile->RuleRequest.Rules[r], sizeof(EMU_RULE));
+			bytes += sizeof(EMU_RULE);
+		}
+		break;
+	case IOCTL_MOUSE_GET_STATS:
+		return MouseGetStats(Device, Output, OutputSize, Information);
+	case IOCTL_MOUSE_GET_LATENCY:
+		//the flags are optional, without them the histograms are only read
+		memset(&latencyRequest, 0, sizeof(latencyRequest));
+		if (InputSize >= sizeof(MOUSE_LATENCY_REQUEST))
+			memcpy(&latencyRequest, Input, sizeof(latencyRequest));
+		return HostGetLatency(&Device->Header, (latencyRequest.Flags & MOUSE_LATENCY_RESET) != 0, Output, Information);
+	case IOCTL_MOUSE_GET_GENERATION:
+		memcpy(Output, (const void*)&Device->Header.RuleGeneration, sizeof(ULONG));
+		bytes = sizeof(ULONG);
+		break;
+	case IOCTL_MOUSE_SET_PROFILE:
+		memcpy(&profileData, Input, sizeof(profileData));
+		HostBumpRuleGeneration(&Device->Header);
+		Device->Pipeline.ProfileHotkeyMask = 0;
+		for (USHORT p = 0; p < MOUSE_PROFILE_COUNT; p++)
+		{
+			Device->Pipeline.ProfileHotkeys[p] = profileData.Hotkeys[p];
+			Device->Pipeline.ProfileHotkeyMask |= profileData.Hotkeys[p];
+		}
+		Device->EditProfile = profileData.EditProfile;
+		Device->Pipeline.ActiveProfile = profileData.ActiveProfile;
+		return STATUS_SUCCESS;
+	case IOCTL_MOUSE_GET_PROFILE:
+		memset(&profileData, 0, sizeof(profileData));
+		profileData.ActiveProfile = (USHORT)Device->Pipeline.ActiveProfile;
+		profileData.EditProfile = Device->EditProfile;
+		memcpy(profileData.Hotkeys, Device->Pipeline.ProfileHotkeys, sizeof(profileData.Hotkeys));
+		memcpy(Output, &profileData, sizeof(profileData));
+		bytes = sizeof(profileData);
+		break;
+	case IOCTL_MOUSE_SWITCH_PROFILE:
+		//the tables of every profile are already in place, the next packet just picks another slot
+		Device->Pipeline.ActiveProfile = EmuReadUshort(Input);
+		return STATUS_SUCCESS;
+	case IOCTL_MOUSE_SAVE_IMAGE:
+		return HostSaveImage(Class, &Device->Header);
+	default:
+		return STATUS_NOT_IMPLEMENTED;
+	}
+	*Information = bytes;
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS MouseCheckRequest(ULONG IoControlCode, const UCHAR* Input, ULONG InputSize, ULONG OutputSize)
+/*++
+
+Routine Description:
+
+	The size and parameter checks MouFilter_EvtIoDeviceControl makes on a
+	mouse IOCTL before it looks the mouse up.
+
+Return Value:
+
+	STATUS_NOT_IMPLEMENTED for an IOCTL the mouse control device does not
+	know.
+
+--*/
+{
+	MOUSE_ABSOLUTE_MAP absoluteMap;
+	MOUSE_AUTOFIRE_DATA autofire;
+	MOUSE_PROFILE_DATA profileData;
+
+	switch (IoControlCode) {
+	case IOCTL_MOUSE_INSERT_KEY:
+		return InputSize < sizeof(MOUSE_INPUT_DATA) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_MOUSE_SET_FILTER:
+	case IOCTL_MOUSE_SET_MODIFY:
+	case IOCTL_MOUSE_SET_RULES:
+		return InputSize < sizeof(USHORT) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_MOUSE_GET_FILTER:
+	case IOCTL_MOUSE_GET_MODIFY:
+	case IOCTL_MOUSE_GET_RULES:
+		return OutputSize < sizeof(USHORT) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_MOUSE_GET_ATTRIBUTES:
+		return OutputSize < sizeof(MOUSE_ATTRIBUTES) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_MOUSE_SET_ABSOLUTE_MAP:
+		if (InputSize < sizeof(MOUSE_ABSOLUTE_MAP))
+			return STATUS_BUFFER_TOO_SMALL;
+		memcpy(&absoluteMap, Input, sizeof(absoluteMap));
+		if ((absoluteMap.Flags & ABSOLUTE_MAP_ENABLED) &&
+			(absoluteMap.Left > absoluteMap.Right || absoluteMap.Top > absoluteMap.Bottom))
+			return STATUS_INVALID_PARAMETER;
+		return STATUS_SUCCESS;
+	case IOCTL_MOUSE_GET_ABSOLUTE_MAP:
+		return OutputSize < sizeof(MOUSE_ABSOLUTE_MAP) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_MOUSE_SET_AUTOFIRE:
+		if (InputSize < sizeof(MOUSE_AUTOFIRE_DATA))
+			return STATUS_BUFFER_TOO_SMALL;
+		memcpy(&autofire, Input, sizeof(autofire));
+		if (autofire.TriggerButton != 0 &&
+			(!MOUSE_SINGLE_BUTTON(autofire.TriggerButton) ||
+				autofire.OutputButton == 0 ||
+				!MOUSE_SINGLE_BUTTON(autofire.OutputButton) ||
+				autofire.PeriodMicroseconds < MOUSE_AUTOFIRE_MIN_PERIOD ||
+				autofire.PressMicroseconds == 0 ||
+				autofire.PressMicroseconds >= autofire.PeriodMicroseconds))
+			return STATUS_INVALID_PARAMETER;
+		return STATUS_SUCCESS;
+	case IOCTL_MOUSE_GET_AUTOFIRE:
+		return OutputSize < sizeof(MOUSE_AUTOFIRE_DATA) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_MOUSE_GET_LATENCY:
+		if (InputSize >= sizeof(MOUSE_LATENCY_REQUEST)) {
+			MOUSE_LATENCY_REQUEST latencyRequest;
+
+			memcpy(&latencyRequest, Input, sizeof(latencyRequest));
+			if ((latencyRequest.Flags & ~MOUSE_LATENCY_RESET) != 0)
+				return STATUS_INVALID_PARAMETER;
+		}
+		return OutputSize < sizeof(MOUSE_LATENCY) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_MOUSE_GET_STATS:
+		return OutputSize < FIELD_OFFSET(MOUSE_STATS, RuleHits) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_MOUSE_GET_GENERATION:
+		return OutputSize < sizeof(ULONG) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_MOUSE_SET_PROFILE:
+		if (InputSize < sizeof(MOUSE_PROFILE_DATA))
+			return STATUS_BUFFER_TOO_SMALL;
+		memcpy(&profileData, Input, sizeof(profileData));
+		if (profileData.ActiveProfile >= MOUSE_PROFILE_COUNT || profileData.EditProfile >= MOUSE_PROFILE_COUNT)
+			return STATUS_INVALID_PARAMETER;
+		for (USHORT p = 0; p < MOUSE_PROFILE_COUNT; p++)
+		{
+			if (!MOUSE_SINGLE_BUTTON(profileData.Hotkeys[p]))
+				return STATUS_INVALID_PARAMETER;
+		}
+		return STATUS_SUCCESS;
+	case IOCTL_MOUSE_GET_PROFILE:
+		return OutputSize < sizeof(MOUSE_PROFILE_DATA) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+	case IOCTL_MOUSE_SWITCH_PROFILE:
+		if (InputSize < sizeof(USHORT))
+			return STATUS_BUFFER_TOO_SMALL;
+		return EmuReadUshort(Input) >= MOUSE_PROFILE_COUNT ? STATUS_INVALID_PARAMETER : STATUS_SUCCESS;
+	case IOCTL_MOUSE_SAVE_IMAGE:
+		return STATUS_SUCCESS;
+	default:
+		return STATUS_NOT_IMPLEMENTED;
+	}
+}
+
+static NTSTATUS MouseDispatch(PHOST_CLASS Class, PHOST_SESSION Session, ULONG IoControlCode, PVOID Input, ULONG InputSize,
+	PVOID Output, ULONG OutputSize, PULONG_PTR Information, PHOST_REQUEST Request)
+/*++
+
+Routine Description:
+
+	MouFilter_EvtIoDeviceControl of the driver.
+
+--*/
+{
+	const UCHAR* input = (const UCHAR*)Input;
+	ULONG deviceHandle = Session->DeviceHandle;
+	ULONG expectedGeneration = 0;
+	PMOUSE_DEVICE device;
+	MOUSE_DEVICE_HEADER header;
+	MOUSE_CAPTURE_CONFIG captureConfig;
+	MOUSE_CAPTURE_RING_REQUEST ringRequest;
+	MOUSE_CAPTURE_RING_MAPPING ringMapping;
+	MOUSE_STATS_CONFIG statsConfig;
+	MOUSE_TRACE_CONFIG traceConfig;
+	NTSTATUS status;
+
+	//
+	// A device IOCTL may name its target mouse in front of its input
+	// instead of using the one selected on the handle.
+	//
+	if (IoControlCode & IOCTL_MOUSE_TARGETED(0)) {
+		IoControlCode &= ~IOCTL_MOUSE_TARGETED(0);
+		switch (IoControlCode) {
+		case IOCTL_MOUSE_INSERT_KEY:
+		case IOCTL_MOUSE_SET_FILTER:
+		case IOCTL_MOUSE_GET_FILTER:
+		case IOCTL_MOUSE_SET_MODIFY:
+		case IOCTL_MOUSE_GET_MODIFY:
+		case IOCTL_MOUSE_GET_ATTRIBUTES:
+		case IOCTL_MOUSE_SET_ABSOLUTE_MAP:
+		case IOCTL_MOUSE_GET_ABSOLUTE_MAP:
+		case IOCTL_MOUSE_SET_AUTOFIRE:
+		case IOCTL_MOUSE_GET_AUTOFIRE:
+		case IOCTL_MOUSE_SET_RULES:
+		case IOCTL_MOUSE_GET_RULES:
+		case IOCTL_MOUSE_GET_STATS:
+		case IOCTL_MOUSE_GET_LATENCY:
+		case IOCTL_MOUSE_GET_GENERATION:
+		case IOCTL_MOUSE_SET_PROFILE:
+		case IOCTL_MOUSE_GET_PROFILE:
+		case IOCTL_MOUSE_SWITCH_PROFILE:
+		case IOCTL_MOUSE_SAVE_IMAGE:
+			break;
+		default:
+			return STATUS_INVALID_DEVICE_REQUEST;
+		}
+		if (InputSize < sizeof(MOUSE_DEVICE_HEADER))
+			return STATUS_BUFFER_TOO_SMALL;
+		memcpy(&header, input, sizeof(header));
+		if (header.Generation != 0 && IoControlCode != IOCTL_MOUSE_SET_FILTER &&
+			IoControlCode != IOCTL_MOUSE_SET_MODIFY && IoControlCode != IOCTL_MOUSE_SET_RULES)
+			return STATUS_INVALID_PARAMETER;
+		deviceHandle = header.DeviceHandle;
+		expectedGeneration = header.Generation;
+		input += sizeof(MOUSE_DEVICE_HEADER);
+		InputSize -= sizeof(MOUSE_DEVICE_HEADER);
+	}
+
+	switch (IoControlCode) {
+	case IOCTL_MOUSE_SET_DEVICE_ID:
+		return HostSetDeviceId(Class, Session, (PVOID)input, InputSize);
+	case IOCTL_MOUSE_GET_DEVICE_ID:
+		return HostGetDeviceId(Class, Session, Output, OutputSize, Information);
+	case IOCTL_MOUSE_GET_DEVICES:
+		return HostGetDevices(Class, Output, OutputSize, Information);
+	case IOCTL_MOUSE_SET_DEVICE_HANDLE:
+		return HostSetDeviceHandle(Class, Session, (PVOID)input, InputSize);
+	case IOCTL_MOUSE_DETECT_DEVICE_ID:
+		return HostDetectDevice(Class, (PVOID)input, InputSize, OutputSize, Request);
+	case IOCTL_MOUSE_BROADCAST_RULES:
+		return HostBroadcastRules(Class, (PVOID)input, InputSize, MouseSwapRules);
+	case IOCTL_MOUSE_SET_STATS:
+		if (InputSize < sizeof(MOUSE_STATS_CONFIG))
+			return STATUS_BUFFER_TOO_SMALL;
+		memcpy(&statsConfig, input, sizeof(statsConfig));
+		if ((statsConfig.Flags & ~MOUSE_STATS_RULE_HITS) != 0)
+			return STATUS_INVALID_PARAMETER;
+		//installed tables keep what they were allocated with, new ones follow the setting
+		Class->CountRuleHits = (statsConfig.Flags & MOUSE_STATS_RULE_HITS) != 0;
+		return STATUS_SUCCESS;
+	case IOCTL_MOUSE_SET_CAPTURE:
+		if (InputSize < sizeof(MOUSE_CAPTURE_CONFIG))
+			return STATUS_BUFFER_TOO_SMALL;
+		memcpy(&captureConfig, input, sizeof(captureConfig));
+		return HostSetCapture(Class, captureConfig.Sources, captureConfig.Delivery, captureConfig.LatencyMicroseconds);
+	case IOCTL_MOUSE_GET_CAPTURE:
+		if (OutputSize < sizeof(MOUSE_CAPTURE_CONFIG))
+			return STATUS_BUFFER_TOO_SMALL;
+		memset(&captureConfig, 0, sizeof(captureConfig));
+		captureConfig.Sources = Class->CaptureSources;
+		captureConfig.Delivery = Class->CaptureDelivery;
+		captureConfig.LatencyMicroseconds = (ULONG)(Class->CaptureLatency / 10);
+		memcpy(Output, &captureConfig, sizeof(captureConfig));
+		*Information = sizeof(captureConfig);
+		return STATUS_SUCCESS;
+	case IOCTL_MOUSE_CAPTURE:
+		return HostCapture(Class, OutputSize, Request);
+	case IOCTL_MOUSE_MAP_CAPTURE_RING:
+		if (InputSize < sizeof(MOUSE_CAPTURE_RING_REQUEST) || OutputSize < sizeof(MOUSE_CAPTURE_RING_MAPPING))
+			return STATUS_BUFFER_TOO_SMALL;
+		memcpy(&ringRequest, input, sizeof(ringRequest));
+		memset(&ringMapping, 0, sizeof(ringMapping));
+		status = HostMapCaptureRing(Class, Session, (HANDLE)(ULONG_PTR)ringRequest.EventHandle,
+			&ringMapping.Address, &ringMapping.Size, &ringMapping.ReaderIndex, &ringMapping.WaitAddress);
+		if (NT_SUCCESS(status)) {
+			memcpy(Output, &ringMapping, sizeof(ringMapping));
+			*Information = sizeof(ringMapping);
+		}
+		return status;
+	case IOCTL_MOUSE_UNMAP_CAPTURE_RING:
+		HostUnmapCaptureRing(Class, Session);
+		return STATUS_SUCCESS;
+	case IOCTL_MOUSE_SET_TRACE:
+		if (InputSize < sizeof(MOUSE_TRACE_CONFIG))
+			return STATUS_BUFFER_TOO_SMALL;
+		memcpy(&traceConfig, input, sizeof(traceConfig));
+		if ((traceConfig.Flags & ~MOUSE_TRACE_ENABLE) != 0)
+			return STATUS_INVALID_PARAMETER;
+		return HostSetTrace(Class, (traceConfig.Flags & MOUSE_TRACE_ENABLE) != 0);
+	case IOCTL_MOUSE_READ_TRACE:
+		return HostReadTrace(Class, Output, OutputSize, Information);
+	}
+
+	status = MouseCheckRequest(IoControlCode, input, InputSize, OutputSize);
+	if (!NT_SUCCESS(status))
+		return status;
+	device = (PMOUSE_DEVICE)HostReferenceDevice(Class, deviceHandle);
+	if (device == NULL)
+		return STATUS_NO_SUCH_DEVICE;
+	return MouseDeviceControl(Class, device, IoControlCode, expectedGeneration, input, InputSize, (PUCHAR)Output, OutputSize, Information);
+}
+
+const HOST_CLASS_OPS MouseHostOps = {
+	MouseDispatch,
+	MouseServiceCallback,
+	MouseAutofireTimer,
+	MouseCreateDevice,
+	MouseDeleteDevice,
+	MouseSerializeProfiles,
+	MouseApplyRuleImage,
+};
+
+VOID
+MouseHostInitialize(
+	OUT PHOST_CLASS Class)
+{
+	Class->Ops = &MouseHostOps;
+	Class->InputSize = sizeof(MOUSE_INPUT_DATA);
+	Class->RecordSize = sizeof(MOUSE_CAPTURE_RECORD);
+	Class->RingCapacity = MOUSE_CAPTURE_RING_CAPACITY;
+	Class->InsertCode = IOCTL_MOUSE_INSERT_KEY;
+	Class->MapRingCode = IOCTL_MOUSE_MAP_CAPTURE_RING;
+	Class->TargetedBit = IOCTL_MOUSE_TARGETED(0);
+}
@@ -0,0 +1,234 @@
+/*++
+
+Module Name:
+
+	KernelShim.c
+
+Abstract:
+
+	User mode implementation of the kernel services declared in the
+	stand-in ntddk.h.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ntddk.h"
+
+#define SHIM_CACHE_LINE 64
+#define SHIM_MAX_REGISTRATIONS 8
+
+//
+//Bit 0 of a counter is set once the rundown started, references count in steps of 2
+//
+#define SHIM_RUNDOWN_ACTIVE 1
+
+typedef struct _SHIM_REGISTRATION {
+	struct _CALLBACK_OBJECT* Object;
+	PCALLBACK_FUNCTION Function;
+	PVOID Context;
+} SHIM_REGISTRATION, * PSHIM_REGISTRATION;
+
+struct _CALLBACK_OBJECT {
+	LONG References;
+	SHIM_REGISTRATION Registrations[SHIM_MAX_REGISTRATIONS];
+};
+
+typedef struct _SHIM_RUNDOWN_COUNTER {
+	volatile LONG64 Count;
+	UCHAR Padding[SHIM_CACHE_LINE - sizeof(LONG64)];
+} SHIM_RUNDOWN_COUNTER;
+
+struct _EX_RUNDOWN_REF_CACHE_AWARE {
+	ULONG Shards;
+	SHIM_RUNDOWN_COUNTER* Counters;
+};
+
+ULONG ShimRundownShards;
+
+//
+//The one callback object there is, the tests use a single name
+//
+static struct _CALLBACK_OBJECT ShimCallbackObject;
+static pthread_mutex_t ShimCallbackLock = PTHREAD_MUTEX_INITIALIZER;
+
+NTSTATUS
+ExCreateCallback(
+	OUT PCALLBACK_OBJECT* CallbackObject,
+	IN POBJECT_ATTRIBUTES ObjectAttributes,
+	IN BOOLEAN Create,
+	IN BOOLEAN AllowMultipleCallbacks)
+{
+	UNREFERENCED_PARAMETER(ObjectAttributes);
+	UNREFERENCED_PARAMETER(AllowMultipleCallbacks);
+
+	pthread_mutex_lock(&ShimCallbackLock);
+	if (ShimCallbackObject.References == 0 && !Create) {
+		pthread_mutex_unlock(&ShimCallbackLock);
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	}
+	ShimCallbackObject.References++;
+	pthread_mutex_unlock(&ShimCallbackLock);
+	*CallbackObject = &ShimCallbackObject;
+	return STATUS_SUCCESS;
+}
+
+PVOID
+ExRegisterCallback(
+	IN PCALLBACK_OBJECT CallbackObject,
+	IN PCALLBACK_FUNCTION CallbackFunction,
+	IN OPTIONAL PVOID CallbackContext)
+{
+	PSHIM_REGISTRATION registration = NULL;
+
+	pthread_mutex_lock(&ShimCallbackLock);
+	for (ULONG i = 0; i < SHIM_MAX_REGISTRATIONS; i++)
+	{
+		if (CallbackObject->Registrations[i].Function == NULL) {
+			registration = &CallbackObject->Registrations[i];
+			registration->Object = CallbackObject;
+			registration->Function = CallbackFunction;
+			registration->Context = CallbackContext;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ShimCallbackLock);
+	return registration;
+}
+
+VOID
+ExUnregisterCallback(
+	IN PVOID CallbackRegistration)
+{
+	PSHIM_REGISTRATION registration = (PSHIM_REGISTRATION)CallbackRegistration;
+
+	pthread_mutex_lock(&ShimCallbackLock);
+	registration->Function = NULL;
+	registration->Context = NULL;
+	pthread_mutex_unlock(&ShimCallbackLock);
+}
+
+VOID
+ExNotifyCallback(
+	IN PVOID CallbackObject,
+	IN OPTIONAL PVOID Argument1,
+	IN OPTIONAL PVOID Argument2)
+{
+	struct _CALLBACK_OBJECT* object = (struct _CALLBACK_OBJECT*)CallbackObject;
+	SHIM_REGISTRATION registrations[SHIM_MAX_REGISTRATIONS];
+
+	//like the kernel, the callbacks run without the object lock held
+	pthread_mutex_lock(&ShimCallbackLock);
+	memcpy(registrations, object->Registrations, sizeof(registrations));
+	pthread_mutex_unlock(&ShimCallbackLock);
+	for (ULONG i = 0; i < SHIM_MAX_REGISTRATIONS; i++)
+	{
+		if (registrations[i].Function != NULL)
+			registrations[i].Function(registrations[i].Context, Argument1, Argument2);
+	}
+}
+
+VOID
+ObDereferenceObject(
+	IN PVOID Object)
+{
+	pthread_mutex_lock(&ShimCallbackLock);
+	((struct _CALLBACK_OBJECT*)Object)->References--;
+	pthread_mutex_unlock(&ShimCallbackLock);
+}
+
+PEX_RUNDOWN_REF_CACHE_AWARE
+ExAllocateCacheAwareRundownProtection(
+	IN POOL_TYPE PoolType,
+	IN ULONG PoolTag)
+{
+	PEX_RUNDOWN_REF_CACHE_AWARE rundown;
+	long processors = sysconf(_SC_NPROCESSORS_CONF);
+
+	UNREFERENCED_PARAMETER(PoolType);
+	UNREFERENCED_PARAMETER(PoolTag);
+
+	rundown = (PEX_RUNDOWN_REF_CACHE_AWARE)malloc(sizeof(*rundown));
+	if (rundown == NULL)
+		return NULL;
+	rundown->Shards = ShimRundownShards != 0 ? ShimRundownShards : (ULONG)(processors > 0 ? processors : 1);
+	rundown->Counters = (SHIM_RUNDOWN_COUNTER*)aligned_alloc(SHIM_CACHE_LINE, rundown->Shards * sizeof(SHIM_RUNDOWN_COUNTER));
+	if (rundown->Counters == NULL) {
+		free(rundown);
+		return NULL;
+	}
+	memset(rundown->Counters, 0, rundown->Shards * sizeof(SHIM_RUNDOWN_COUNTER));
+	return rundown;
+}
+
+VOID
+ExFreeCacheAwareRundownProtection(
+	IN PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+	free(RunRefCacheAware->Counters);
+	free(RunRefCacheAware);
+}
+
+static volatile LONG64* ShimRundownCounter(
+	IN PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+	int processor = RunRefCacheAware->Shards > 1 ? sched_getcpu() : 0;
+
+	return &RunRefCacheAware->Counters[(ULONG)(processor < 0 ? 0 : processor) % RunRefCacheAware->Shards].Count;
+}
+
+BOOLEAN
+ExAcquireRundownProtectionCacheAware(
+	IN PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+	volatile LONG64* counter = ShimRundownCounter(RunRefCacheAware);
+	LONG64 value = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+	do {
+		if (value & SHIM_RUNDOWN_ACTIVE)
+			return FALSE;
+	} while (!__atomic_compare_exchange_n(counter, &value, value + 2, TRUE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return TRUE;
+}
+
+VOID
+ExReleaseRundownProtectionCacheAware(
+	IN PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+	//the release may run on another processor than the acquire, only the sum counts
+	__atomic_fetch_sub(ShimRundownCounter(RunRefCacheAware), 2, __ATOMIC_RELEASE);
+}
+
+VOID
+ExWaitForRundownProtectionReleaseCacheAware(
+	IN PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+	LONG64 total;
+
+	for (ULONG i = 0; i < RunRefCacheAware->Shards; i++)
+		__atomic_fetch_or(&RunRefCacheAware->Counters[i].Count, SHIM_RUNDOWN_ACTIVE, __ATOMIC_SEQ_CST);
+	do {
+		total = 0;
+		for (ULONG i = 0; i < RunRefCacheAware->Shards; i++)
+			total += __atomic_load_n(&RunRefCacheAware->Counters[i].Count, __ATOMIC_ACQUIRE) & ~(LONG64)SHIM_RUNDOWN_ACTIVE;
+		if (total != 0)
+			sched_yield();
+	} while (total != 0);
+}
+
+VOID
+ExReInitializeRundownProtectionCacheAware(
+	IN PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+	for (ULONG i = 0; i < RunRefCacheAware->Shards; i++)
+		__atomic_store_n(&RunRefCacheAware->Counters[i].Count, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,171 @@
+/*++
+
+Module Name:
+
+	ntddk.h
+
+Abstract:
+
+	User mode stand-in for the few kernel services the kernel only parts of
+	Sys/Common call, so they build and run unmodified in the off target
+	tests and benchmarks. Callback objects are a per process registry,
+	rundown references follow the kernel semantics with a spinning wait.
+
+	A cache aware rundown reference keeps one counter per processor, on its
+	own cache line, like the kernel one. Setting ShimRundownShards to 1
+	before it is allocated makes it a single counter, which is what a plain
+	EX_RUNDOWN_REF is, so a benchmark can compare both with the same code.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#ifndef SHIM_NTDDK_H
+#define SHIM_NTDDK_H
+
+#include <wchar.h>
+
+#include "EmuTypes.h"
+
+typedef LONG NTSTATUS;
+typedef const wchar_t* PCWSTR;
+
+#define STATUS_SUCCESS					((NTSTATUS)0x00000000L)
+#define STATUS_INSUFFICIENT_RESOURCES	((NTSTATUS)0xC000009AL)
+#define STATUS_OBJECT_NAME_NOT_FOUND	((NTSTATUS)0xC0000034L)
+#define NT_SUCCESS(Status)				(((NTSTATUS)(Status)) >= 0)
+
+#define UNREFERENCED_PARAMETER(P)		((void)(P))
+#define PAGED_CODE()
+#define _Use_decl_annotations_
+#define _IRQL_requires_(Irql)
+#define _IRQL_requires_max_(Irql)
+
+FORCEINLINE
+PVOID
+InterlockedCompareExchangePointer(
+	IN PVOID volatile* Target,
+	IN PVOID Value,
+	IN PVOID Comparand)
+{
+	__atomic_compare_exchange_n(Target, &Comparand, Value, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return Comparand;
+}
+
+FORCEINLINE
+PVOID
+InterlockedExchangePointer(
+	IN PVOID volatile* Target,
+	IN PVOID Value)
+{
+	return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE
+LONG
+InterlockedCompareExchange(
+	IN LONG volatile* Target,
+	IN LONG Value,
+	IN LONG Comparand)
+{
+	__atomic_compare_exchange_n(Target, &Comparand, Value, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return Comparand;
+}
+
+#define ReadPointerNoFence(Source) __atomic_load_n((Source), __ATOMIC_RELAXED)
+#define ReadNoFence(Source) __atomic_load_n((Source), __ATOMIC_RELAXED)
+
+typedef struct _UNICODE_STRING {
+	USHORT Length;
+	USHORT MaximumLength;
+	PCWSTR Buffer;
+} UNICODE_STRING, * PUNICODE_STRING;
+
+#define RTL_CONSTANT_STRING(s) { sizeof(s) - sizeof((s)[0]), sizeof(s), s }
+
+typedef struct _OBJECT_ATTRIBUTES {
+	PUNICODE_STRING ObjectName;
+	ULONG Attributes;
+} OBJECT_ATTRIBUTES, * POBJECT_ATTRIBUTES;
+
+#define OBJ_CASE_INSENSITIVE	0x00000040L
+#define OBJ_KERNEL_HANDLE		0x00000200L
+
+#define InitializeObjectAttributes(p, n, a, r, s) \
+	do { (p)->ObjectName = (n); (p)->Attributes = (a); (void)(r); (void)(s); } while (0)
+
+typedef enum _POOL_TYPE {
+	NonPagedPool,
+	PagedPool
+} POOL_TYPE;
+
+typedef VOID CALLBACK_FUNCTION(
+	IN PVOID CallbackContext,
+	IN PVOID Argument1,
+	IN PVOID Argument2);
+typedef CALLBACK_FUNCTION* PCALLBACK_FUNCTION;
+
+typedef struct _CALLBACK_OBJECT* PCALLBACK_OBJECT;
+
+NTSTATUS
+ExCreateCallback(
+	OUT PCALLBACK_OBJECT* CallbackObject,
+	IN POBJECT_ATTRIBUTES ObjectAttributes,
+	IN BOOLEAN Create,
+	IN BOOLEAN AllowMultipleCallbacks);
+
+PVOID
+ExRegisterCallback(
+	IN PCALLBACK_OBJECT CallbackObject,
+	IN PCALLBACK_FUNCTION CallbackFunction,
+	IN OPTIONAL PVOID CallbackContext);
+
+VOID
+ExUnregisterCallback(
+	IN PVOID CallbackRegistration);
+
+VOID
+ExNotifyCallback(
+	IN PVOID CallbackObject,
+	IN OPTIONAL PVOID Argument1,
+	IN OPTIONAL PVOID Argument2);
+
+VOID
+ObDereferenceObject(
+	IN PVOID Object);
+
+typedef struct _EX_RUNDOWN_REF_CACHE_AWARE* PEX_RUNDOWN_REF_CACHE_AWARE;
+
+//
+//Counters of the next cache aware rundown references allocated, 0 for one per processor
+//
+extern ULONG ShimRundownShards;
+
+PEX_RUNDOWN_REF_CACHE_AWARE
+ExAllocateCacheAwareRundownProtection(
+	IN POOL_TYPE PoolType,
+	IN ULONG PoolTag);
+
+VOID
+ExFreeCacheAwareRundownProtection(
+	IN PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware);
+
+BOOLEAN
+ExAcquireRundownProtectionCacheAware(
+	IN PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware);
+
+VOID
+ExReleaseRundownProtectionCacheAware(
+	IN PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware);
+
+VOID
+ExWaitForRundownProtectionReleaseCacheAware(
+	IN PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware);
+
+VOID
+ExReInitializeRundownProtectionCacheAware(
+	IN PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware);
+
+#endif // SHIM_NTDDK_H
@@ -0,0 +1,18 @@
+/*++
+
+Module Name:
+
+	ntddkbd.h
+
+Abstract:
+
+	User mode stand-in, KEYBOARD_INPUT_DATA comes from EmuTypes.h.
+
+--*/
+
+#ifndef SHIM_NTDDKBD_H
+#define SHIM_NTDDKBD_H
+
+#include "EmuTypes.h"
+
+#endif // SHIM_NTDDKBD_H
@@ -0,0 +1,856 @@
+/*++
+
+Module Name:
+
+	Win32Shim.c
+
+Abstract:
+
+	User mode implementation over POSIX of the Windows functions declared
+	in the stand-in windows.h.
+
+	Events and timers are shim objects guarded by one lock, waits sleep
+	on one condition that every signal broadcasts. A timer is signaled
+	by the wait that finds its due time passed, so no thread runs timers.
+
+	Files are file descriptors, mappings map with mmap. There is no
+	device behind \\.\KeyboardEmulator or \\.\MouseEmulator, opening them
+	fails with ERROR_FILE_NOT_FOUND and the tests install a transport.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "windows.h"
+#include "TextLayout.h"
+
+#define SHIM_PAGE_SIZE 4096
+#define SHIM_ALLOCATION_GRANULARITY 65536
+
+typedef enum _SHIM_TYPE {
+	ShimEvent = 1,
+	ShimTimer,
+	ShimFile,
+	ShimMapping
+} SHIM_TYPE;
+
+typedef struct _SHIM_OBJECT {
+	SHIM_TYPE Type;
+	BOOLEAN ManualReset;
+	BOOLEAN Signaled;
+	//Timers only, due time in nanoseconds of the monotonic clock
+	BOOLEAN Armed;
+	LONG64 Due;
+	//Files and mappings
+	int Descriptor;
+	LONG64 Size;
+} SHIM_OBJECT, * PSHIM_OBJECT;
+
+typedef struct _SHIM_VIEW {
+	struct _SHIM_VIEW* Next;
+	PVOID Address;
+	SIZE_T Length;
+} SHIM_VIEW, * PSHIM_VIEW;
+
+//
+//Heap blocks keep their size in front, HeapReAlloc zeroes what it grew by
+//
+typedef struct _SHIM_BLOCK {
+	SIZE_T Bytes;
+	SIZE_T Padding;
+} SHIM_BLOCK, * PSHIM_BLOCK;
+
+volatile LONG64 ShimHeapAllocations;
+
+static __thread DWORD ShimLastError;
+static pthread_mutex_t ShimLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ShimSignal;
+static pthread_once_t ShimOnce = PTHREAD_ONCE_INIT;
+static PSHIM_VIEW ShimViews;
+static int ShimHeap;
+static int ShimLayout;
+
+static void ShimInitialize(void)
+{
+	pthread_condattr_t attributes;
+
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&ShimSignal, &attributes);
+	pthread_condattr_destroy(&attributes);
+}
+
+static LONG64 ShimNow(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (LONG64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void ShimLockObjects(void)
+{
+	pthread_once(&ShimOnce, ShimInitialize);
+	pthread_mutex_lock(&ShimLock);
+}
+
+static DWORD ShimErrno(int Error)
+{
+	switch (Error)
+	{
+	case ENOENT:
+		return ERROR_FILE_NOT_FOUND;
+	case EEXIST:
+		return ERROR_FILE_EXISTS;
+	case EACCES:
+	case EPERM:
+		return ERROR_ACCESS_DENIED;
+	case EBADF:
+		return ERROR_INVALID_HANDLE;
+	case ENOMEM:
+		return ERROR_NOT_ENOUGH_MEMORY;
+	default:
+		return ERROR_INVALID_PARAMETER;
+	}
+}
+
+static PSHIM_OBJECT ShimCreate(SHIM_TYPE Type)
+{
+	PSHIM_OBJECT object = (PSHIM_OBJECT)calloc(1, sizeof(SHIM_OBJECT));
+
+	if (!object) {
+		ShimLastError = ERROR_NOT_ENOUGH_MEMORY;
+		return NULL;
+	}
+	object->Type = Type;
+	object->Descriptor = -1;
+	return object;
+}
+
+static PSHIM_OBJECT ShimObject(HANDLE Handle, SHIM_TYPE Type)
+{
+	PSHIM_OBJECT object = (PSHIM_OBJECT)Handle;
+
+	if (!object || Handle == INVALID_HANDLE_VALUE || object->Type != Type) {
+		ShimLastError = ERROR_INVALID_HANDLE;
+		return NULL;
+	}
+	return object;
+}
+
+DWORD GetLastError(void)
+{
+	return ShimLastError;
+}
+
+VOID SetLastError(DWORD ErrorCode)
+{
+	ShimLastError = ErrorCode;
+}
+
+ULONG RtlNtStatusToDosError(NTSTATUS Status)
+{
+	switch (Status)
+	{
+	case STATUS_SUCCESS:
+		return ERROR_SUCCESS;
+	case STATUS_PENDING:
+		return ERROR_IO_PENDING;
+	case STATUS_BUFFER_OVERFLOW:
+		return ERROR_MORE_DATA;
+	case STATUS_NOT_IMPLEMENTED:
+	case STATUS_INVALID_DEVICE_REQUEST:
+		return ERROR_INVALID_FUNCTION;
+	case STATUS_INVALID_PARAMETER:
+		return ERROR_INVALID_PARAMETER;
+	case STATUS_NO_SUCH_DEVICE:
+		return ERROR_FILE_NOT_FOUND;
+	case STATUS_BUFFER_TOO_SMALL:
+		return ERROR_INSUFFICIENT_BUFFER;
+	case STATUS_REVISION_MISMATCH:
+		return ERROR_REVISION_MISMATCH;
+	case STATUS_INSUFFICIENT_RESOURCES:
+		return ERROR_NO_SYSTEM_RESOURCES;
+	case STATUS_IO_TIMEOUT:
+		return ERROR_SEM_TIMEOUT;
+	case STATUS_CANCELLED:
+		return ERROR_OPERATION_ABORTED;
+	case STATUS_INVALID_DEVICE_STATE:
+		return ERROR_BAD_COMMAND;
+	case STATUS_INVALID_BUFFER_SIZE:
+		return ERROR_INVALID_USER_BUFFER;
+	case STATUS_ALREADY_REGISTERED:
+		return ERROR_ALREADY_REGISTERED;
+	case STATUS_TOO_MANY_SESSIONS:
+		return ERROR_TOO_MANY_SESS;
+	default:
+		return ERROR_MR_MID_NOT_FOUND;
+	}
+}
+
+HANDLE GetProcessHeap(void)
+{
+	return &ShimHeap;
+}
+
+LPVOID HeapAlloc(HANDLE Heap, DWORD Flags, SIZE_T Bytes)
+{
+	PSHIM_BLOCK block;
+
+	UNREFERENCED_PARAMETER(Heap);
+
+	block = (PSHIM_BLOCK)((Flags & HEAP_ZERO_MEMORY) ? calloc(1, sizeof(SHIM_BLOCK) + Bytes) : malloc(sizeof(SHIM_BLOCK) + Bytes));
+	if (!block)
+		return NULL;
+	InterlockedIncrement(&ShimHeapAllocations);
+	block->Bytes = Bytes;
+	return block + 1;
+}
+
+LPVOID HeapReAlloc(HANDLE Heap, DWORD Flags, LPVOID Memory, SIZE_T Bytes)
+{
+	PSHIM_BLOCK block;
+	SIZE_T old;
+
+	UNREFERENCED_PARAMETER(Heap);
+
+	if (!Memory)
+		return NULL;
+	old = ((PSHIM_BLOCK)Memory - 1)->Bytes;
+	block = (PSHIM_BLOCK)realloc((PSHIM_BLOCK)Memory - 1, sizeof(SHIM_BLOCK) + Bytes);
+	if (!block)
+		return NULL;
+	InterlockedIncrement(&ShimHeapAllocations);
+	if ((Flags & HEAP_ZERO_MEMORY) && Bytes > old)
+		memset((PUCHAR)(block + 1) + old, 0, Bytes - old);
+	block->Bytes = Bytes;
+	return block + 1;
+}
+
+BOOL HeapFree(HANDLE Heap, DWORD Flags, LPVOID Memory)
+{
+	UNREFERENCED_PARAMETER(Heap);
+	UNREFERENCED_PARAMETER(Flags);
+
+	if (Memory)
+		free((PSHIM_BLOCK)Memory - 1);
+	return TRUE;
+}
+
+BOOL CloseHandle(HANDLE Object)
+{
+	PSHIM_OBJECT object = (PSHIM_OBJECT)Object;
+
+	if (!object || Object == INVALID_HANDLE_VALUE) {
+		ShimLastError = ERROR_INVALID_HANDLE;
+		return FALSE;
+	}
+	if (object->Descriptor >= 0)
+		close(object->Descriptor);
+	free(object);
+	return TRUE;
+}
+
+HANDLE CreateEventW(LPSECURITY_ATTRIBUTES Attributes, BOOL ManualReset, BOOL InitialState, LPCWSTR Name)
+{
+	PSHIM_OBJECT event;
+
+	UNREFERENCED_PARAMETER(Attributes);
+	UNREFERENCED_PARAMETER(Name);
+
+	event = ShimCreate(ShimEvent);
+	if (event) {
+		event->ManualReset = ManualReset ? TRUE : FALSE;
+		event->Signaled = InitialState ? TRUE : FALSE;
+	}
+	return event;
+}
+
+BOOL SetEvent(HANDLE Event)
+{
+	PSHIM_OBJECT event = ShimObject(Event, ShimEvent);
+
+	if (!event)
+		return FALSE;
+	ShimLockObjects();
+	event->Signaled = TRUE;
+	pthread_cond_broadcast(&ShimSignal);
+	pthread_mutex_unlock(&ShimLock);
+	return TRUE;
+}
+
+BOOL ResetEvent(HANDLE Event)
+{
+	PSHIM_OBJECT event = ShimObject(Event, ShimEvent);
+
+	if (!event)
+		return FALSE;
+	ShimLockObjects();
+	event->Signaled = FALSE;
+	pthread_mutex_unlock(&ShimLock);
+	return TRUE;
+}
+
+HANDLE CreateWaitableTimerExW(LPSECURITY_ATTRIBUTES Attributes, LPCWSTR Name, DWORD Flags, DWORD DesiredAccess)
+{
+	PSHIM_OBJECT timer;
+
+	UNREFERENCED_PARAMETER(Attributes);
+	UNREFERENCED_PARAMETER(Name);
+	UNREFERENCED_PARAMETER(DesiredAccess);
+
+	timer = ShimCreate(ShimTimer);
+	if (timer)
+		timer->ManualReset = (Flags & CREATE_WAITABLE_TIMER_MANUAL_RESET) ? TRUE : FALSE;
+	return timer;
+}
+
+BOOL SetWaitableTimer(HANDLE Timer, const LARGE_INTEGER* DueTime, LONG Period, PTIMERAPCROUTINE Routine, LPVOID Argument, BOOL Resume)
+{
+	PSHIM_OBJECT timer = ShimObject(Timer, ShimTimer);
+
+	UNREFERENCED_PARAMETER(Routine);
+	UNREFERENCED_PARAMETER(Argument);
+	UNREFERENCED_PARAMETER(Resume);
+
+	//absolute due times need the system clock, the native APIs only pass relative ones
+	if (!timer || !DueTime || DueTime->QuadPart > 0 || Period != 0) {
+		ShimLastError = ERROR_NOT_SUPPORTED;
+		return FALSE;
+	}
+	ShimLockObjects();
+	timer->Due = ShimNow() - DueTime->QuadPart * 100;
+	timer->Armed = TRUE;
+	timer->Signaled = FALSE;
+	pthread_cond_broadcast(&ShimSignal);
+	pthread_mutex_unlock(&ShimLock);
+	return TRUE;
+}
+
+static BOOLEAN ShimTrySatisfy(PSHIM_OBJECT Object, LONG64 Now)
+{
+	if (Object->Type == ShimTimer && Object->Armed && Now >= Object->Due) {
+		Object->Armed = FALSE;
+		Object->Signaled = TRUE;
+	}
+	if (!Object->Signaled)
+		return FALSE;
+	if (!Object->ManualReset)
+		Object->Signaled = FALSE;
+	return TRUE;
+}
+
+DWORD WaitForMultipleObjects(DWORD Count, const HANDLE* Handles, BOOL WaitAll, DWORD Milliseconds)
+{
+	LONG64 deadline = Milliseconds == INFINITE ? -1 : ShimNow() + (LONG64)Milliseconds * 1000000;
+
+	if (Count == 0 || WaitAll) {
+		ShimLastError = ERROR_NOT_SUPPORTED;
+		return WAIT_FAILED;
+	}
+	for (DWORD i = 0; i < Count; i++)
+	{
+		PSHIM_OBJECT object = (PSHIM_OBJECT)Handles[i];
+
+		if (!object || (object->Type != ShimEvent && object->Type != ShimTimer)) {
+			ShimLastError = ERROR_INVALID_HANDLE;
+			return WAIT_FAILED;
+		}
+	}
+	ShimLockObjects();
+	for (;;)
+	{
+		LONG64 now = ShimNow();
+		LONG64 wake = deadline;
+
+		for (DWORD i = 0; i < Count; i++)
+		{
+			PSHIM_OBJECT object = (PSHIM_OBJECT)Handles[i];
+
+			if (ShimTrySatisfy(object, now)) {
+				pthread_mutex_unlock(&ShimLock);
+				return WAIT_OBJECT_0 + i;
+			}
+			if (object->Type == ShimTimer && object->Armed && (wake < 0 || object->Due < wake))
+				wake = object->Due;
+		}
+		if (deadline >= 0 && now >= deadline) {
+			pthread_mutex_unlock(&ShimLock);
+			return WAIT_TIMEOUT;
+		}
+		if (wake < 0) {
+			pthread_cond_wait(&ShimSignal, &ShimLock);
+		}
+		else {
+			struct timespec until = { (time_t)(wake / 1000000000), (long)(wake % 1000000000) };
+
+			pthread_cond_timedwait(&ShimSignal, &ShimLock, &until);
+		}
+	}
+}
+
+DWORD WaitForSingleObject(HANDLE Handle, DWORD Milliseconds)
+{
+	return WaitForMultipleObjects(1, &Handle, FALSE, Milliseconds);
+}
+
+VOID Sleep(DWORD Milliseconds)
+{
+	struct timespec duration = { (time_t)(Milliseconds / 1000), (long)(Milliseconds % 1000) * 1000000 };
+
+	nanosleep(&duration, NULL);
+}
+
+VOID AcquireSRWLockShared(PSRWLOCK Lock)
+{
+	pthread_rwlock_rdlock(&Lock->Lock);
+}
+
+VOID ReleaseSRWLockShared(PSRWLOCK Lock)
+{
+	pthread_rwlock_unlock(&Lock->Lock);
+}
+
+VOID AcquireSRWLockExclusive(PSRWLOCK Lock)
+{
+	pthread_rwlock_wrlock(&Lock->Lock);
+}
+
+VOID ReleaseSRWLockExclusive(PSRWLOCK Lock)
+{
+	pthread_rwlock_unlock(&Lock->Lock);
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER* Count)
+{
+	Count->QuadPart = ShimNow();
+	return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* Frequency)
+{
+	Frequency->QuadPart = 1000000000;
+	return TRUE;
+}
+
+VOID GetSystemInfo(LPSYSTEM_INFO SystemInfo)
+{
+	memset(SystemInfo, 0, sizeof(SYSTEM_INFO));
+	SystemInfo->dwPageSize = SHIM_PAGE_SIZE;
+	SystemInfo->dwAllocationGranularity = SHIM_ALLOCATION_GRANULARITY;
+	SystemInfo->dwNumberOfProcessors = 1;
+}
+
+//
+//Converts a UTF-16 path to the UTF-8 the file system takes, FALSE if it does not fit
+//
+static BOOLEAN ShimPath(LPCWSTR FileName, char* Path, SIZE_T Size)
+{
+	SIZE_T length = 0;
+
+	for (; *FileName; FileName++)
+	{
+		ULONG code = (USHORT)*FileName;
+		UCHAR bytes[4];
+		SIZE_T count;
+
+		if (code >= 0xD800 && code <= 0xDBFF && (USHORT)FileName[1] >= 0xDC00 && (USHORT)FileName[1] <= 0xDFFF) {
+			code = 0x10000 + ((code - 0xD800) << 10) + ((USHORT)FileName[1] - 0xDC00);
+			FileName++;
+		}
+		if (code < 0x80) {
+			bytes[0] = (UCHAR)code;
+			count = 1;
+		}
+		else if (code < 0x800) {
+			bytes[0] = (UCHAR)(0xC0 | (code >> 6));
+			bytes[1] = (UCHAR)(0x80 | (code & 0x3F));
+			count = 2;
+		}
+		else if (code < 0x10000) {
+			bytes[0] = (UCHAR)(0xE0 | (code >> 12));
+			bytes[1] = (UCHAR)(0x80 | ((code >> 6) & 0x3F));
+			bytes[2] = (UCHAR)(0x80 | (code & 0x3F));
+			count = 3;
+		}
+		else {
+			bytes[0] = (UCHAR)(0xF0 | (code >> 18));
+			bytes[1] = (UCHAR)(0x80 | ((code >> 12) & 0x3F));
+			bytes[2] = (UCHAR)(0x80 | ((code >> 6) & 0x3F));
+			bytes[3] = (UCHAR)(0x80 | (code & 0x3F));
+			count = 4;
+		}
+		if (length + count >= Size)
+			return FALSE;
+		memcpy(Path + length, bytes, count);
+		length += count;
+	}
+	Path[length] = 0;
+	return TRUE;
+}
+
+HANDLE CreateFileW(LPCWSTR FileName, DWORD DesiredAccess, DWORD ShareMode, LPSECURITY_ATTRIBUTES Attributes,
+	DWORD CreationDisposition, DWORD FlagsAndAttributes, HANDLE TemplateFile)
+{
+	char path[4096];
+	int flags;
+	PSHIM_OBJECT file;
+
+	UNREFERENCED_PARAMETER(ShareMode);
+	UNREFERENCED_PARAMETER(Attributes);
+	UNREFERENCED_PARAMETER(FlagsAndAttributes);
+	UNREFERENCED_PARAMETER(TemplateFile);
+
+	if (!FileName || !ShimPath(FileName, path, sizeof(path))) {
+		ShimLastError = ERROR_INVALID_PARAMETER;
+		return INVALID_HANDLE_VALUE;
+	}
+	if ((DesiredAccess & GENERIC_READ) && (DesiredAccess & (GENERIC_WRITE | FILE_WRITE_DATA)))
+		flags = O_RDWR;
+	else if (DesiredAccess & (GENERIC_WRITE | FILE_WRITE_DATA))
+		flags = O_WRONLY;
+	else
+		flags = O_RDONLY;
+	switch (CreationDisposition)
+	{
+	case CREATE_NEW:
+		flags |= O_CREAT | O_EXCL;
+		break;
+	case CREATE_ALWAYS:
+		flags |= O_CREAT | O_TRUNC;
+		break;
+	case OPEN_ALWAYS:
+		flags |= O_CREAT;
+		break;
+	case TRUNCATE_EXISTING:
+		flags |= O_TRUNC;
+		break;
+	case OPEN_EXISTING:
+		break;
+	default:
+		ShimLastError = ERROR_INVALID_PARAMETER;
+		return INVALID_HANDLE_VALUE;
+	}
+	file = ShimCreate(ShimFile);
+	if (!file)
+		return INVALID_HANDLE_VALUE;
+	file->Descriptor = open(path, flags | O_CLOEXEC, 0644);
+	if (file->Descriptor < 0) {
+		ShimLastError = ShimErrno(errno);
+		free(file);
+		return INVALID_HANDLE_VALUE;
+	}
+	return file;
+}
+
+BOOL ReadFile(HANDLE File, LPVOID Buffer, DWORD Bytes, LPDWORD BytesRead, LPOVERLAPPED Overlapped)
+{
+	PSHIM_OBJECT file = ShimObject(File, ShimFile);
+	DWORD done = 0;
+
+	if (!file || Overlapped) {
+		if (file)
+			ShimLastError = ERROR_NOT_SUPPORTED;
+		return FALSE;
+	}
+	while (done < Bytes)
+	{
+		ssize_t read_ = read(file->Descriptor, (PUCHAR)Buffer + done, Bytes - done);
+
+		if (read_ < 0 && errno == EINTR)
+			continue;
+		if (read_ < 0) {
+			ShimLastError = ShimErrno(errno);
+			return FALSE;
+		}
+		//at the end of the file ReadFile succeeds with fewer bytes
+		if (read_ == 0)
+			break;
+		done += (DWORD)read_;
+	}
+	if (BytesRead)
+		*BytesRead = done;
+	return TRUE;
+}
+
+BOOL WriteFile(HANDLE File, LPCVOID Buffer, DWORD Bytes, LPDWORD BytesWritten, LPOVERLAPPED Overlapped)
+{
+	PSHIM_OBJECT file = ShimObject(File, ShimFile);
+	DWORD done = 0;
+
+	if (!file || Overlapped) {
+		if (file)
+			ShimLastError = ERROR_NOT_SUPPORTED;
+		return FALSE;
+	}
+	while (done < Bytes)
+	{
+		ssize_t written = write(file->Descriptor, (const UCHAR*)Buffer + done, Bytes - done);
+
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0) {
+			ShimLastError = ShimErrno(errno);
+			if (BytesWritten)
+				*BytesWritten = done;
+			return FALSE;
+		}
+		done += (DWORD)written;
+	}
+	if (BytesWritten)
+		*BytesWritten = done;
+	return TRUE;
+}
+
+BOOL SetFilePointerEx(HANDLE File, LARGE_INTEGER Distance, PLARGE_INTEGER NewPointer, DWORD MoveMethod)
+{
+	PSHIM_OBJECT file = ShimObject(File, ShimFile);
+	off_t position;
+
+	if (!file)
+		return FALSE;
+	position = lseek(file->Descriptor, (off_t)Distance.QuadPart,
+		MoveMethod == FILE_BEGIN ? SEEK_SET : MoveMethod == FILE_CURRENT ? SEEK_CUR : SEEK_END);
+	if (position < 0) {
+		ShimLastError = ShimErrno(errno);
+		return FALSE;
+	}
+	if (NewPointer)
+		NewPointer->QuadPart = position;
+	return TRUE;
+}
+
+BOOL GetFileSizeEx(HANDLE File, PLARGE_INTEGER FileSize)
+{
+	PSHIM_OBJECT file = ShimObject(File, ShimFile);
+	struct stat status;
+
+	if (!file)
+		return FALSE;
+	if (fstat(file->Descriptor, &status) != 0) {
+		ShimLastError = ShimErrno(errno);
+		return FALSE;
+	}
+	FileSize->QuadPart = status.st_size;
+	return TRUE;
+}
+
+HANDLE CreateFileMappingW(HANDLE File, LPSECURITY_ATTRIBUTES Attributes, DWORD Protect,
+	DWORD MaximumSizeHigh, DWORD MaximumSizeLow, LPCWSTR Name)
+{
+	PSHIM_OBJECT file = ShimObject(File, ShimFile);
+	PSHIM_OBJECT mapping;
+	LARGE_INTEGER size;
+
+	UNREFERENCED_PARAMETER(Attributes);
+	UNREFERENCED_PARAMETER(Name);
+
+	if (!file)
+		return NULL;
+	if (Protect != PAGE_READONLY) {
+		ShimLastError = ERROR_NOT_SUPPORTED;
+		return NULL;
+	}
+	size.QuadPart = ((LONG64)MaximumSizeHigh << 32) | MaximumSizeLow;
+	if (size.QuadPart == 0 && !GetFileSizeEx(File, &size))
+		return NULL;
+	//as on Windows an empty file cannot be mapped
+	if (size.QuadPart == 0) {
+		ShimLastError = ERROR_FILE_INVALID;
+		return NULL;
+	}
+	mapping = ShimCreate(ShimMapping);
+	if (!mapping)
+		return NULL;
+	mapping->Descriptor = dup(file->Descriptor);
+	mapping->Size = size.QuadPart;
+	if (mapping->Descriptor < 0) {
+		ShimLastError = ShimErrno(errno);
+		free(mapping);
+		return NULL;
+	}
+	return mapping;
+}
+
+LPVOID MapViewOfFile(HANDLE Mapping, DWORD DesiredAccess, DWORD OffsetHigh, DWORD OffsetLow, SIZE_T Bytes)
+{
+	PSHIM_OBJECT mapping = ShimObject(Mapping, ShimMapping);
+	LONG64 offset = ((LONG64)OffsetHigh << 32) | OffsetLow;
+	PSHIM_VIEW view;
+
+	if (!mapping)
+		return NULL;
+	if (DesiredAccess != FILE_MAP_READ || offset % SHIM_ALLOCATION_GRANULARITY != 0 || offset >= mapping->Size ||
+		(LONG64)Bytes > mapping->Size - offset) {
+		ShimLastError = ERROR_INVALID_PARAMETER;
+		return NULL;
+	}
+	if (Bytes == 0)
+		Bytes = (SIZE_T)(mapping->Size - offset);
+	view = (PSHIM_VIEW)malloc(sizeof(SHIM_VIEW));
+	if (!view) {
+		ShimLastError = ERROR_NOT_ENOUGH_MEMORY;
+		return NULL;
+	}
+	view->Address = mmap(NULL, Bytes, PROT_READ, MAP_SHARED, mapping->Descriptor, (off_t)offset);
+	view->Length = Bytes;
+	if (view->Address == MAP_FAILED) {
+		ShimLastError = ShimErrno(errno);
+		free(view);
+		return NULL;
+	}
+	ShimLockObjects();
+	view->Next = ShimViews;
+	ShimViews = view;
+	pthread_mutex_unlock(&ShimLock);
+	return view->Address;
+}
+
+BOOL UnmapViewOfFile(LPCVOID BaseAddress)
+{
+	PSHIM_VIEW* link;
+
+	ShimLockObjects();
+	for (link = &ShimViews; *link; link = &(*link)->Next)
+	{
+		PSHIM_VIEW view = *link;
+
+		if (view->Address == BaseAddress) {
+			*link = view->Next;
+			pthread_mutex_unlock(&ShimLock);
+			munmap(view->Address, view->Length);
+			free(view);
+			return TRUE;
+		}
+	}
+	pthread_mutex_unlock(&ShimLock);
+	ShimLastError = ERROR_INVALID_PARAMETER;
+	return FALSE;
+}
+
+BOOL DeviceIoControl(HANDLE Device, DWORD IoControlCode, LPVOID Input, DWORD InputSize,
+	LPVOID Output, DWORD OutputSize, LPDWORD BytesReturned, LPOVERLAPPED Overlapped)
+{
+	UNREFERENCED_PARAMETER(Device);
+	UNREFERENCED_PARAMETER(IoControlCode);
+	UNREFERENCED_PARAMETER(Input);
+	UNREFERENCED_PARAMETER(InputSize);
+	UNREFERENCED_PARAMETER(Output);
+	UNREFERENCED_PARAMETER(OutputSize);
+	UNREFERENCED_PARAMETER(Overlapped);
+
+	//no handle CreateFileW returns is a device
+	if (BytesReturned)
+		*BytesReturned = 0;
+	ShimLastError = ERROR_INVALID_FUNCTION;
+	return FALSE;
+}
+
+BOOL GetOverlappedResult(HANDLE File, LPOVERLAPPED Overlapped, LPDWORD BytesTransferred, BOOL Wait)
+{
+	NTSTATUS status;
+
+	UNREFERENCED_PARAMETER(File);
+
+	ShimLockObjects();
+	while (Overlapped->Internal == (ULONG_PTR)STATUS_PENDING)
+	{
+		if (!Wait) {
+			pthread_mutex_unlock(&ShimLock);
+			ShimLastError = ERROR_IO_INCOMPLETE;
+			return FALSE;
+		}
+		pthread_cond_wait(&ShimSignal, &ShimLock);
+	}
+	status = (NTSTATUS)Overlapped->Internal;
+	if (BytesTransferred)
+		*BytesTransferred = (DWORD)Overlapped->InternalHigh;
+	pthread_mutex_unlock(&ShimLock);
+	if (!NT_SUCCESS(status) || status == STATUS_BUFFER_OVERFLOW) {
+		ShimLastError = RtlNtStatusToDosError(status);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL CancelIoEx(HANDLE File, LPOVERLAPPED Overlapped)
+{
+	UNREFERENCED_PARAMETER(File);
+	UNREFERENCED_PARAMETER(Overlapped);
+
+	ShimLastError = ERROR_NOT_FOUND;
+	return FALSE;
+}
+
+VOID ShimCompleteOverlapped(LPOVERLAPPED Overlapped, NTSTATUS Status, ULONG_PTR Information)
+{
+	ShimLockObjects();
+	Overlapped->InternalHigh = Information;
+	Overlapped->Internal = (ULONG_PTR)Status;
+	if (Overlapped->hEvent)
+		((PSHIM_OBJECT)Overlapped->hEvent)->Signaled = TRUE;
+	pthread_cond_broadcast(&ShimSignal);
+	pthread_mutex_unlock(&ShimLock);
+}
+
+static EMU_LAYOUT_KEY ShimLayoutKeys[EMU_LAYOUT_US_CHARS];
+static pthread_once_t ShimLayoutOnce = PTHREAD_ONCE_INIT;
+
+static void ShimBuildLayout(void)
+{
+	EMU_LAYOUT layout;
+
+	EmuLayoutUs(ShimLayoutKeys, &layout);
+}
+
+HKL GetKeyboardLayout(DWORD ThreadId)
+{
+	UNREFERENCED_PARAMETER(ThreadId);
+
+	return &ShimLayout;
+}
+
+SHORT VkKeyScanExW(WCHAR Character, HKL Layout)
+{
+	USHORT character = (USHORT)Character;
+
+	UNREFERENCED_PARAMETER(Layout);
+
+	pthread_once(&ShimLayoutOnce, ShimBuildLayout);
+	if (character >= EMU_LAYOUT_US_CHARS || ShimLayoutKeys[character].ScanCode == 0)
+		return -1;
+	return (SHORT)((ShimLayoutKeys[character].Flags << 8) | ShimLayoutKeys[character].ScanCode);
+}
+
+UINT MapVirtualKeyExW(UINT Code, UINT MapType, HKL Layout)
+{
+	UNREFERENCED_PARAMETER(Layout);
+
+	return MapType == MAPVK_VK_TO_VSC_EX ? Code : 0;
+}
+
+INT ToUnicodeEx(UINT VirtualKey, UINT ScanCode, const BYTE* KeyState, LPWSTR Buffer, INT BufferChars, UINT Flags, HKL Layout)
+{
+	UNREFERENCED_PARAMETER(VirtualKey);
+	UNREFERENCED_PARAMETER(ScanCode);
+	UNREFERENCED_PARAMETER(KeyState);
+	UNREFERENCED_PARAMETER(Buffer);
+	UNREFERENCED_PARAMETER(BufferChars);
+	UNREFERENCED_PARAMETER(Flags);
+	UNREFERENCED_PARAMETER(Layout);
+
+	//the US layout has no dead keys, every key types one character
+	return 1;
+}
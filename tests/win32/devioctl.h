@@ -0,0 +1,40 @@
+/*++
+
+Module Name:
+
+	devioctl.h
+
+Abstract:
+
+	User mode stand-in for the I/O control code layout of the SDK.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#ifndef SHIM_DEVIOCTL_H
+#define SHIM_DEVIOCTL_H
+
+#define FILE_DEVICE_KEYBOARD	0x0000000b
+#define FILE_DEVICE_MOUSE		0x0000000f
+
+#define METHOD_BUFFERED			0
+#define METHOD_IN_DIRECT		1
+#define METHOD_OUT_DIRECT		2
+#define METHOD_NEITHER			3
+
+#define FILE_ANY_ACCESS			0
+#ifndef FILE_READ_DATA
+#define FILE_READ_DATA			0x0001
+#define FILE_WRITE_DATA			0x0002
+#endif
+
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+	(((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+#define DEVICE_TYPE_FROM_CTL_CODE(ControlCode)	(((ULONG)(ControlCode & 0xffff0000)) >> 16)
+#define METHOD_FROM_CTL_CODE(ControlCode)		((ULONG)(ControlCode & 3))
+
+#endif // SHIM_DEVIOCTL_H
@@ -0,0 +1,44 @@
+/*++
+
+Module Name:
+
+	ntddkbd.h
+
+Abstract:
+
+	User mode stand-in, KEYBOARD_INPUT_DATA comes from EmuTypes.h.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#ifndef SHIM_NTDDKBD_H
+#define SHIM_NTDDKBD_H
+
+#include "EmuTypes.h"
+
+typedef struct _KEYBOARD_ID {
+	UCHAR Type;
+	UCHAR Subtype;
+} KEYBOARD_ID, * PKEYBOARD_ID;
+
+typedef struct _KEYBOARD_TYPEMATIC_PARAMETERS {
+	USHORT UnitId;
+	USHORT Rate;
+	USHORT Delay;
+} KEYBOARD_TYPEMATIC_PARAMETERS, * PKEYBOARD_TYPEMATIC_PARAMETERS;
+
+typedef struct _KEYBOARD_ATTRIBUTES {
+	KEYBOARD_ID KeyboardIdentifier;
+	USHORT KeyboardMode;
+	USHORT NumberOfFunctionKeys;
+	USHORT NumberOfIndicators;
+	USHORT NumberOfKeysTotal;
+	ULONG InputDataQueueLength;
+	KEYBOARD_TYPEMATIC_PARAMETERS KeyRepeatMinimum;
+	KEYBOARD_TYPEMATIC_PARAMETERS KeyRepeatMaximum;
+} KEYBOARD_ATTRIBUTES, * PKEYBOARD_ATTRIBUTES;
+
+#endif // SHIM_NTDDKBD_H
@@ -0,0 +1,52 @@
+/*++
+
+Module Name:
+
+	ntddmou.h
+
+Abstract:
+
+	User mode stand-in, MOUSE_INPUT_DATA comes from EmuTypes.h.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#ifndef SHIM_NTDDMOU_H
+#define SHIM_NTDDMOU_H
+
+#include "EmuTypes.h"
+
+typedef struct _MOUSE_ATTRIBUTES {
+	USHORT MouseIdentifier;
+	USHORT NumberOfButtons;
+	USHORT SampleRate;
+	ULONG InputDataQueueLength;
+} MOUSE_ATTRIBUTES, * PMOUSE_ATTRIBUTES;
+
+#define MOUSE_MOVE_RELATIVE			0
+#define MOUSE_MOVE_ABSOLUTE			1
+#define MOUSE_VIRTUAL_DESKTOP		0x02
+
+#define MOUSE_LEFT_BUTTON_DOWN		0x0001
+#define MOUSE_LEFT_BUTTON_UP		0x0002
+#define MOUSE_RIGHT_BUTTON_DOWN		0x0004
+#define MOUSE_RIGHT_BUTTON_UP		0x0008
+#define MOUSE_MIDDLE_BUTTON_DOWN	0x0010
+#define MOUSE_MIDDLE_BUTTON_UP		0x0020
+#define MOUSE_BUTTON_4_DOWN			0x0040
+#define MOUSE_BUTTON_4_UP			0x0080
+#define MOUSE_BUTTON_5_DOWN			0x0100
+#define MOUSE_BUTTON_5_UP			0x0200
+#define MOUSE_BUTTON_1_DOWN		MOUSE_LEFT_BUTTON_DOWN
+#define MOUSE_BUTTON_1_UP			MOUSE_LEFT_BUTTON_UP
+#define MOUSE_BUTTON_2_DOWN		MOUSE_RIGHT_BUTTON_DOWN
+#define MOUSE_BUTTON_2_UP			MOUSE_RIGHT_BUTTON_UP
+#define MOUSE_BUTTON_3_DOWN		MOUSE_MIDDLE_BUTTON_DOWN
+#define MOUSE_BUTTON_3_UP			MOUSE_MIDDLE_BUTTON_UP
+#define MOUSE_WHEEL					0x0400
+#define MOUSE_HWHEEL				0x0800
+
+#endif // SHIM_NTDDMOU_H
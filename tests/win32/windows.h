@@ -0,0 +1,291 @@
+/*++
+
+Module Name:
+
+	windows.h
+
+Abstract:
+
+	User mode stand-in for the part of the Windows SDK the native APIs
+	use, so KeyboardEmuAPI.cpp and MouseEmuAPI.cpp build unmodified in the
+	off target tests and benchmarks. The functions are implemented over
+	POSIX in Win32Shim.c.
+
+	Every handle points at a shim object whose type CloseHandle and the
+	waits dispatch on. Waits on events and timers share one lock and one
+	condition, which is all a test needs and keeps WaitForMultipleObjects
+	simple.
+
+	WCHAR is 16 bits wide as on Windows, the sources using it are compiled
+	with -fshort-wchar so L"" literals match.
+
+	Allocations through the process heap are counted in ShimHeapAllocations
+	so a benchmark can tell how often a call went to the heap.
+
+Environment:
+
+	user mode, POSIX
+
+--*/
+
+#ifndef SHIM_WINDOWS_H
+#define SHIM_WINDOWS_H
+
+#include <pthread.h>
+
+#include "EmuTypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int					BOOL, * PBOOL, * LPBOOL;
+typedef uint8_t				BYTE, * PBYTE, * LPBYTE;
+typedef uint16_t			WORD, * PWORD;
+typedef ULONG				DWORD, * PDWORD, * LPDWORD;
+typedef int					INT;
+typedef unsigned int		UINT;
+typedef size_t				SIZE_T, * PSIZE_T;
+typedef uintptr_t			ULONG_PTR, * PULONG_PTR;
+typedef intptr_t			LONG_PTR;
+typedef void*				HANDLE, * PHANDLE, * LPHANDLE;
+typedef void*				LPVOID;
+typedef const void*			LPCVOID;
+typedef char				CHAR;
+typedef const char*			LPCSTR;
+typedef wchar_t				WCHAR, * PWCHAR, * LPWSTR;
+typedef const wchar_t*		LPCWSTR, * PCWSTR;
+typedef void*				HKL;
+typedef LONG				NTSTATUS;
+
+typedef union _LARGE_INTEGER {
+	struct {
+		DWORD LowPart;
+		LONG HighPart;
+	};
+	LONG64 QuadPart;
+} LARGE_INTEGER, * PLARGE_INTEGER;
+
+typedef struct _SECURITY_ATTRIBUTES {
+	DWORD nLength;
+	LPVOID lpSecurityDescriptor;
+	BOOL bInheritHandle;
+} SECURITY_ATTRIBUTES, * PSECURITY_ATTRIBUTES, * LPSECURITY_ATTRIBUTES;
+
+typedef struct _OVERLAPPED {
+	//NTSTATUS of the request, STATUS_PENDING while it runs
+	ULONG_PTR Internal;
+	//Bytes the request returned
+	ULONG_PTR InternalHigh;
+	union {
+		struct {
+			DWORD Offset;
+			DWORD OffsetHigh;
+		};
+		PVOID Pointer;
+	};
+	HANDLE hEvent;
+} OVERLAPPED, * LPOVERLAPPED;
+
+typedef struct _SYSTEM_INFO {
+	WORD wProcessorArchitecture;
+	WORD wReserved;
+	DWORD dwPageSize;
+	LPVOID lpMinimumApplicationAddress;
+	LPVOID lpMaximumApplicationAddress;
+	ULONG_PTR dwActiveProcessorMask;
+	DWORD dwNumberOfProcessors;
+	DWORD dwProcessorType;
+	DWORD dwAllocationGranularity;
+	WORD wProcessorLevel;
+	WORD wProcessorRevision;
+} SYSTEM_INFO, * LPSYSTEM_INFO;
+
+typedef struct _SRWLOCK {
+	pthread_rwlock_t Lock;
+} SRWLOCK, * PSRWLOCK;
+
+#define SRWLOCK_INIT { PTHREAD_RWLOCK_INITIALIZER }
+
+typedef VOID(*PTIMERAPCROUTINE)(LPVOID Argument, DWORD TimerLowValue, DWORD TimerHighValue);
+
+#define WINAPI
+#define __declspec(Attributes)
+#define UNREFERENCED_PARAMETER(P)		((void)(P))
+
+#ifndef NOMINMAX
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+#endif
+
+#define LOBYTE(w)						((BYTE)(((ULONG_PTR)(w)) & 0xff))
+#define HIBYTE(w)						((BYTE)((((ULONG_PTR)(w)) >> 8) & 0xff))
+#define MAXUSHORT						0xffff
+#define ARRAYSIZE(A)					(sizeof(A) / sizeof((A)[0]))
+#define C_ASSERT(e)						typedef char __C_ASSERT__[(e) ? 1 : -1]
+
+#define ZeroMemory(Destination, Length)			memset((Destination), 0, (Length))
+#define CopyMemory(Destination, Source, Length)	memcpy((Destination), (Source), (Length))
+#define MoveMemory(Destination, Source, Length)	memmove((Destination), (Source), (Length))
+
+#define INVALID_HANDLE_VALUE			((HANDLE)(LONG_PTR)-1)
+#define INFINITE						0xFFFFFFFF
+
+#define STATUS_SUCCESS					((NTSTATUS)0x00000000L)
+#define STATUS_PENDING					((NTSTATUS)0x00000103L)
+#define STATUS_BUFFER_OVERFLOW			((NTSTATUS)0x80000005L)
+#define STATUS_NOT_IMPLEMENTED			((NTSTATUS)0xC0000002L)
+#define STATUS_INVALID_PARAMETER		((NTSTATUS)0xC000000DL)
+#define STATUS_NO_SUCH_DEVICE			((NTSTATUS)0xC000000EL)
+#define STATUS_INVALID_DEVICE_REQUEST	((NTSTATUS)0xC0000010L)
+#define STATUS_BUFFER_TOO_SMALL			((NTSTATUS)0xC0000023L)
+#define STATUS_REVISION_MISMATCH		((NTSTATUS)0xC0000059L)
+#define STATUS_INSUFFICIENT_RESOURCES	((NTSTATUS)0xC000009AL)
+#define STATUS_IO_TIMEOUT				((NTSTATUS)0xC00000B5L)
+#define STATUS_TOO_MANY_SESSIONS		((NTSTATUS)0xC00000CEL)
+#define STATUS_CANCELLED				((NTSTATUS)0xC0000120L)
+#define STATUS_INVALID_DEVICE_STATE		((NTSTATUS)0xC0000184L)
+#define STATUS_INVALID_BUFFER_SIZE		((NTSTATUS)0xC0000206L)
+#define STATUS_ALREADY_REGISTERED		((NTSTATUS)0xC0000718L)
+#define NT_SUCCESS(Status)				(((NTSTATUS)(Status)) >= 0)
+
+#define ERROR_SUCCESS					0
+#define ERROR_INVALID_FUNCTION			1
+#define ERROR_FILE_NOT_FOUND			2
+#define ERROR_ACCESS_DENIED				5
+#define ERROR_INVALID_HANDLE			6
+#define ERROR_NOT_ENOUGH_MEMORY			8
+#define ERROR_BAD_COMMAND				22
+#define ERROR_HANDLE_EOF				38
+#define ERROR_TOO_MANY_SESS				69
+#define ERROR_NOT_SUPPORTED				50
+#define ERROR_FILE_EXISTS				80
+#define ERROR_INVALID_PARAMETER			87
+#define ERROR_SEM_TIMEOUT				121
+#define ERROR_INSUFFICIENT_BUFFER		122
+#define ERROR_MORE_DATA					234
+#define ERROR_MR_MID_NOT_FOUND			317
+#define ERROR_OPERATION_ABORTED			995
+#define ERROR_IO_INCOMPLETE				996
+#define ERROR_IO_PENDING				997
+#define ERROR_FILE_INVALID				1006
+#define ERROR_DEVICE_NOT_CONNECTED		1167
+#define ERROR_NOT_FOUND					1168
+#define ERROR_REVISION_MISMATCH			1306
+#define ERROR_NO_SYSTEM_RESOURCES		1450
+#define ERROR_ALREADY_REGISTERED		1242
+#define ERROR_TIMEOUT					1460
+#define ERROR_INVALID_USER_BUFFER		1784
+
+#define WAIT_OBJECT_0					0x00000000L
+#define WAIT_TIMEOUT					0x00000102L
+#define WAIT_FAILED						0xFFFFFFFF
+
+#define GENERIC_READ					0x80000000L
+#define GENERIC_WRITE					0x40000000L
+#define FILE_READ_DATA					0x0001
+#define FILE_WRITE_DATA					0x0002
+#define FILE_GENERIC_WRITE				0x00120116L
+#define FILE_SHARE_READ					0x00000001
+#define FILE_SHARE_WRITE				0x00000002
+#define CREATE_NEW						1
+#define CREATE_ALWAYS					2
+#define OPEN_EXISTING					3
+#define OPEN_ALWAYS						4
+#define TRUNCATE_EXISTING				5
+#define FILE_ATTRIBUTE_NORMAL			0x00000080
+#define FILE_FLAG_OVERLAPPED			0x40000000
+#define FILE_FLAG_RANDOM_ACCESS			0x10000000
+#define FILE_FLAG_SEQUENTIAL_SCAN		0x08000000
+#define FILE_BEGIN						0
+#define FILE_CURRENT					1
+#define FILE_END						2
+
+#define PAGE_READONLY					0x02
+#define FILE_MAP_READ					0x0004
+
+#define HEAP_ZERO_MEMORY				0x00000008
+
+#define CREATE_WAITABLE_TIMER_MANUAL_RESET		0x00000001
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION	0x00000002
+#define TIMER_ALL_ACCESS						0x001F0003
+
+#define VK_SHIFT						0x10
+#define VK_CONTROL						0x11
+#define VK_MENU							0x12
+#define MAPVK_VK_TO_VSC_EX				4
+
+//
+//Allocations made through the process heap, HeapAlloc and HeapReAlloc
+//
+extern volatile LONG64 ShimHeapAllocations;
+
+DWORD GetLastError(void);
+VOID SetLastError(DWORD ErrorCode);
+ULONG RtlNtStatusToDosError(NTSTATUS Status);
+
+HANDLE GetProcessHeap(void);
+LPVOID HeapAlloc(HANDLE Heap, DWORD Flags, SIZE_T Bytes);
+LPVOID HeapReAlloc(HANDLE Heap, DWORD Flags, LPVOID Memory, SIZE_T Bytes);
+BOOL HeapFree(HANDLE Heap, DWORD Flags, LPVOID Memory);
+
+BOOL CloseHandle(HANDLE Object);
+
+HANDLE CreateEventW(LPSECURITY_ATTRIBUTES Attributes, BOOL ManualReset, BOOL InitialState, LPCWSTR Name);
+BOOL SetEvent(HANDLE Event);
+BOOL ResetEvent(HANDLE Event);
+HANDLE CreateWaitableTimerExW(LPSECURITY_ATTRIBUTES Attributes, LPCWSTR Name, DWORD Flags, DWORD DesiredAccess);
+BOOL SetWaitableTimer(HANDLE Timer, const LARGE_INTEGER* DueTime, LONG Period, PTIMERAPCROUTINE Routine, LPVOID Argument, BOOL Resume);
+DWORD WaitForSingleObject(HANDLE Handle, DWORD Milliseconds);
+DWORD WaitForMultipleObjects(DWORD Count, const HANDLE* Handles, BOOL WaitAll, DWORD Milliseconds);
+VOID Sleep(DWORD Milliseconds);
+
+VOID AcquireSRWLockShared(PSRWLOCK Lock);
+VOID ReleaseSRWLockShared(PSRWLOCK Lock);
+VOID AcquireSRWLockExclusive(PSRWLOCK Lock);
+VOID ReleaseSRWLockExclusive(PSRWLOCK Lock);
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER* Count);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* Frequency);
+VOID GetSystemInfo(LPSYSTEM_INFO SystemInfo);
+
+HANDLE CreateFileW(LPCWSTR FileName, DWORD DesiredAccess, DWORD ShareMode, LPSECURITY_ATTRIBUTES Attributes,
+	DWORD CreationDisposition, DWORD FlagsAndAttributes, HANDLE TemplateFile);
+BOOL ReadFile(HANDLE File, LPVOID Buffer, DWORD Bytes, LPDWORD BytesRead, LPOVERLAPPED Overlapped);
+BOOL WriteFile(HANDLE File, LPCVOID Buffer, DWORD Bytes, LPDWORD BytesWritten, LPOVERLAPPED Overlapped);
+BOOL SetFilePointerEx(HANDLE File, LARGE_INTEGER Distance, PLARGE_INTEGER NewPointer, DWORD MoveMethod);
+BOOL GetFileSizeEx(HANDLE File, PLARGE_INTEGER FileSize);
+HANDLE CreateFileMappingW(HANDLE File, LPSECURITY_ATTRIBUTES Attributes, DWORD Protect,
+	DWORD MaximumSizeHigh, DWORD MaximumSizeLow, LPCWSTR Name);
+LPVOID MapViewOfFile(HANDLE Mapping, DWORD DesiredAccess, DWORD OffsetHigh, DWORD OffsetLow, SIZE_T Bytes);
+BOOL UnmapViewOfFile(LPCVOID BaseAddress);
+
+BOOL DeviceIoControl(HANDLE Device, DWORD IoControlCode, LPVOID Input, DWORD InputSize,
+	LPVOID Output, DWORD OutputSize, LPDWORD BytesReturned, LPOVERLAPPED Overlapped);
+BOOL GetOverlappedResult(HANDLE File, LPOVERLAPPED Overlapped, LPDWORD BytesTransferred, BOOL Wait);
+BOOL CancelIoEx(HANDLE File, LPOVERLAPPED Overlapped);
+
+//
+//The keyboard layout functions know the US layout of TextLayout.h only,
+//its virtual keys are the scan codes
+//
+HKL GetKeyboardLayout(DWORD ThreadId);
+SHORT VkKeyScanExW(WCHAR Character, HKL Layout);
+UINT MapVirtualKeyExW(UINT Code, UINT MapType, HKL Layout);
+INT ToUnicodeEx(UINT VirtualKey, UINT ScanCode, const BYTE* KeyState, LPWSTR Buffer, INT BufferChars, UINT Flags, HKL Layout);
+
+//
+//Completes an overlapped request the way the I/O manager does: stores the
+//status and the byte count, then signals the event of the request
+//
+VOID ShimCompleteOverlapped(LPOVERLAPPED Overlapped, NTSTATUS Status, ULONG_PTR Information);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SHIM_WINDOWS_H